@@ -137,6 +137,13 @@ QMAKE_CLEAN += $$PWD/src/leveldb/libleveldb.a; cd $$PWD/src/leveldb ; $(MAKE) cl
     DEFINES += HAVE_BUILD_INFO
 }
 
+# "make bench_iocoin" builds the micro-benchmarks with the daemon makefile
+!win32 {
+    bench_iocoin.commands = cd $$PWD/src && $(MAKE) -f makefile.unix bench_iocoin
+    bench_iocoin.depends = FORCE
+    QMAKE_EXTRA_TARGETS += bench_iocoin
+}
+
 contains(USE_O3, 1) {
     message(Building O3 optimization flag)
     QMAKE_CXXFLAGS_RELEASE -= -O2
@@ -198,6 +205,20 @@ HEADERS += src/qt/bitcoingui.h \
     src/serialize.h \
     src/strlcpy.h \
     src/main.h \
+    src/merkleblock.h \
+    src/memusage.h \
+    src/metrics.h \
+    src/bloom.h \
+    src/netpoll.h \
+    src/notify.h \
+    src/fees.h \
+    src/blockencodings.h \
+    src/blocksync.h \
+    src/blockimport.h \
+    src/blockfile.h \
+    src/chainsnapshot.h \
+    src/blockprefetch.h \
+    src/checkqueue.h \
     src/miner.h \
     src/net.h \
     src/key.h \
@@ -232,6 +253,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/qt/transactionview.h \
     src/qt/walletmodel.h \
     src/bitcoinrpc.h \
+    src/rpcjson.h \
     src/qt/overviewpage.h \
     src/qt/csvmodelwriter.h \
     src/crypter.h \
@@ -274,6 +296,18 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/key.cpp \
     src/script.cpp \
     src/main.cpp \
+    src/merkleblock.cpp \
+    src/metrics.cpp \
+    src/bloom.cpp \
+    src/netpoll.cpp \
+    src/notify.cpp \
+    src/fees.cpp \
+    src/blockencodings.cpp \
+    src/blocksync.cpp \
+    src/blockimport.cpp \
+    src/blockfile.cpp \
+    src/chainsnapshot.cpp \
+    src/blockprefetch.cpp \
     src/miner.cpp \
     src/init.cpp \
     src/net.cpp \
@@ -297,6 +331,9 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/qt/transactionview.cpp \
     src/qt/walletmodel.cpp \
     src/bitcoinrpc.cpp \
+    src/rpcjson.cpp \
+    src/rest.cpp \
+    src/rpcjobs.cpp \
     src/rpcdump.cpp \
     src/rpcnet.cpp \
     src/rpcmining.cpp \
@@ -449,7 +486,7 @@ macx:QMAKE_CXXFLAGS_THREAD += -pthread
 # Set libraries and includes at end, to use platform-defined defaults if not overridden
 INCLUDEPATH += $$BOOST_INCLUDE_PATH $$BDB_INCLUDE_PATH $$OPENSSL_INCLUDE_PATH $$QRENCODE_INCLUDE_PATH
 LIBS += $$join(BOOST_LIB_PATH,,-L,) $$join(BDB_LIB_PATH,,-L,) $$join(OPENSSL_LIB_PATH,,-L,) $$join(QRENCODE_LIB_PATH,,-L,)
-LIBS += -lssl -lcrypto -ldb_cxx$$BDB_LIB_SUFFIX
+LIBS += -lssl -lcrypto -ldb_cxx$$BDB_LIB_SUFFIX -lz
 # -lgdi32 has to happen after -lcrypto (see  #681)
 windows:LIBS += -lws2_32 -lshlwapi -lmswsock -lole32 -loleaut32 -luuid -lgdi32
 LIBS += -lboost_system$$BOOST_LIB_SUFFIX -lboost_filesystem$$BOOST_LIB_SUFFIX -lboost_program_options$$BOOST_LIB_SUFFIX -lboost_thread$$BOOST_THREAD_LIB_SUFFIX
@@ -84,22 +84,67 @@ CAddrInfo* CAddrMan::Find(const CNetAddr& addr, int *pnId)
         return NULL;
     if (pnId)
         *pnId = (*it).second;
-    std::map<int, CAddrInfo>::iterator it2 = mapInfo.find((*it).second);
-    if (it2 != mapInfo.end())
-        return &(*it2).second;
-    return NULL;
+    return &vInfo[(*it).second];
 }
 
 CAddrInfo* CAddrMan::Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId)
 {
-    int nId = nIdCount++;
-    mapInfo[nId] = CAddrInfo(addr, addrSource);
+    int nId;
+    if (!vFreeIds.empty())
+    {
+        nId = vFreeIds.back();
+        vFreeIds.pop_back();
+        vInfo[nId] = CAddrInfo(addr, addrSource);
+    } else {
+        nId = vInfo.size();
+        vInfo.push_back(CAddrInfo(addr, addrSource));
+    }
     mapAddr[addr] = nId;
-    mapInfo[nId].nRandomPos = vRandom.size();
+    vInfo[nId].nRandomPos = vRandom.size();
     vRandom.push_back(nId);
     if (pnId)
         *pnId = nId;
-    return &mapInfo[nId];
+    return &vInfo[nId];
+}
+
+void CAddrMan::Delete(int nId)
+{
+    CAddrInfo &info = vInfo[nId];
+    assert(!info.fInTried && info.nRefCount == 0);
+
+    SwapRandom(info.nRandomPos, vRandom.size()-1);
+    vRandom.pop_back();
+    mapAddr.erase(info);
+    info = CAddrInfo();
+    vFreeIds.push_back(nId);
+    nNew--;
+}
+
+int CAddrMan::NewBucketFind(int nUBucket, int nId) const
+{
+    const int *pBucket = vvNew[nUBucket];
+    for (int i = 0; i < vnNewSize[nUBucket]; i++)
+        if (pBucket[i] == nId)
+            return i;
+    return -1;
+}
+
+void CAddrMan::NewBucketErase(int nUBucket, int nPos)
+{
+    assert(nPos >= 0 && nPos < vnNewSize[nUBucket]);
+    vvNew[nUBucket][nPos] = vvNew[nUBucket][--vnNewSize[nUBucket]];
+}
+
+void CAddrMan::Clear_()
+{
+    vInfo.clear();
+    vFreeIds.clear();
+    mapAddr.clear();
+    vRandom.clear();
+    nTried = 0;
+    nNew = 0;
+    memset(vnTriedSize, 0, sizeof(vnTriedSize));
+    memset(vnNewSize, 0, sizeof(vnNewSize));
 }
 
 void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
@@ -112,11 +157,8 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     int nId1 = vRandom[nRndPos1];
     int nId2 = vRandom[nRndPos2];
 
-    assert(mapInfo.count(nId1) == 1);
-    assert(mapInfo.count(nId2) == 1);
-
-    mapInfo[nId1].nRandomPos = nRndPos2;
-    mapInfo[nId2].nRandomPos = nRndPos1;
+    vInfo[nId1].nRandomPos = nRndPos2;
+    vInfo[nId2].nRandomPos = nRndPos1;
 
     vRandom[nRndPos1] = nId2;
     vRandom[nRndPos2] = nId1;
@@ -124,22 +166,22 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
 
 int CAddrMan::SelectTried(int nKBucket)
 {
-    std::vector<int> &vTried = vvTried[nKBucket];
+    int *pTried = vvTried[nKBucket];
+    int nSize = vnTriedSize[nKBucket];
 
     // random shuffle the first few elements (using the entire list)
     // find the least recently tried among them
     int64_t nOldest = -1;
     int nOldestPos = -1;
-    for (unsigned int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < vTried.size(); i++)
+    for (int i = 0; i < ADDRMAN_TRIED_ENTRIES_INSPECT_ON_EVICT && i < nSize; i++)
     {
-        int nPos = GetRandInt(vTried.size() - i) + i;
-        int nTemp = vTried[nPos];
-        vTried[nPos] = vTried[i];
-        vTried[i] = nTemp;
-        assert(nOldest == -1 || mapInfo.count(nTemp) == 1);
-        if (nOldest == -1 || mapInfo[nTemp].nLastSuccess < mapInfo[nOldest].nLastSuccess) {
+        int nPos = GetRandInt(nSize - i) + i;
+        int nTemp = pTried[nPos];
+        pTried[nPos] = pTried[i];
+        pTried[i] = nTemp;
+        if (nOldest == -1 || vInfo[nTemp].nLastSuccess < vInfo[nOldest].nLastSuccess) {
            nOldest = nTemp;
-           nOldestPos = nPos;
+           nOldestPos = i;
         }
     }
 
@@ -148,67 +190,53 @@ int CAddrMan::SelectTried(int nKBucket)
 
 int CAddrMan::ShrinkNew(int nUBucket)
 {
-    assert(nUBucket >= 0 && (unsigned int)nUBucket < vvNew.size());
-    std::set<int> &vNew = vvNew[nUBucket];
+    assert(nUBucket >= 0 && nUBucket < ADDRMAN_NEW_BUCKET_COUNT);
+    int *pNew = vvNew[nUBucket];
+    int nSize = vnNewSize[nUBucket];
 
     // first look for deletable items
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+    for (int i = 0; i < nSize; i++)
     {
-        assert(mapInfo.count(*it));
-        CAddrInfo &info = mapInfo[*it];
+        int nId = pNew[i];
+        CAddrInfo &info = vInfo[nId];
         if (info.IsTerrible())
         {
+            NewBucketErase(nUBucket, i);
             if (--info.nRefCount == 0)
-            {
-                SwapRandom(info.nRandomPos, vRandom.size()-1);
-                vRandom.pop_back();
-                mapAddr.erase(info);
-                mapInfo.erase(*it);
-                nNew--;
-            }
-            vNew.erase(it);
+                Delete(nId);
             return 0;
         }
     }
 
     // otherwise, select four randomly, and pick the oldest of those to replace
-    int n[4] = {GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size()), GetRandInt(vNew.size())};
-    int nI = 0;
-    int nOldest = -1;
-    for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
-    {
-        if (nI == n[0] || nI == n[1] || nI == n[2] || nI == n[3])
-        {
-            assert(nOldest == -1 || mapInfo.count(*it) == 1);
-            if (nOldest == -1 || mapInfo[*it].nTime < mapInfo[nOldest].nTime)
-                nOldest = *it;
-        }
-        nI++;
-    }
-    assert(mapInfo.count(nOldest) == 1);
-    CAddrInfo &info = mapInfo[nOldest];
-    if (--info.nRefCount == 0)
+    int nOldestPos = -1;
+    for (int n = 0; n < 4; n++)
     {
-        SwapRandom(info.nRandomPos, vRandom.size()-1);
-        vRandom.pop_back();
-        mapAddr.erase(info);
-        mapInfo.erase(nOldest);
-        nNew--;
+        int nPos = GetRandInt(nSize);
+        if (nOldestPos == -1 || vInfo[pNew[nPos]].nTime < vInfo[pNew[nOldestPos]].nTime)
+            nOldestPos = nPos;
     }
-    vNew.erase(nOldest);
+    int nOldest = pNew[nOldestPos];
+    NewBucketErase(nUBucket, nOldestPos);
+    if (--vInfo[nOldest].nRefCount == 0)
+        Delete(nOldest);
 
     return 1;
 }
 
 void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 {
-    assert(vvNew[nOrigin].count(nId) == 1);
+    assert(NewBucketFind(nOrigin, nId) >= 0);
 
     // remove the entry from all new buckets
-    for (std::vector<std::set<int> >::iterator it = vvNew.begin(); it != vvNew.end(); it++)
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount > 0; b++)
     {
-        if ((*it).erase(nId))
+        int nPos = NewBucketFind(b, nId);
+        if (nPos >= 0)
+        {
+            NewBucketErase(b, nPos);
             info.nRefCount--;
+        }
     }
     nNew--;
 
@@ -216,12 +244,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // what tried bucket to move the entry to
     int nKBucket = info.GetTriedBucket(nKey);
-    std::vector<int> &vTried = vvTried[nKBucket];
+    int *pTried = vvTried[nKBucket];
 
     // first check whether there is place to just add it
-    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
+    if (vnTriedSize[nKBucket] < ADDRMAN_TRIED_BUCKET_SIZE)
     {
-        vTried.push_back(nId);
+        pTried[vnTriedSize[nKBucket]++] = nId;
         nTried++;
         info.fInTried = true;
         return;
@@ -229,31 +257,30 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId, int nOrigin)
 
     // otherwise, find an item to evict
     int nPos = SelectTried(nKBucket);
+    int nIdOld = pTried[nPos];
 
     // find which new bucket it belongs to
-    assert(mapInfo.count(vTried[nPos]) == 1);
-    int nUBucket = mapInfo[vTried[nPos]].GetNewBucket(nKey);
-    std::set<int> &vNew = vvNew[nUBucket];
+    int nUBucket = vInfo[nIdOld].GetNewBucket(nKey);
 
     // remove the to-be-replaced tried entry from the tried set
-    CAddrInfo& infoOld = mapInfo[vTried[nPos]];
+    CAddrInfo& infoOld = vInfo[nIdOld];
     infoOld.fInTried = false;
     infoOld.nRefCount = 1;
     // do not update nTried, as we are going to move something else there immediately
 
     // check whether there is place in that one,
-    if (vNew.size() < ADDRMAN_NEW_BUCKET_SIZE)
+    if (vnNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE)
     {
         // if so, move it back there
-        vNew.insert(vTried[nPos]);
+        vvNew[nUBucket][vnNewSize[nUBucket]++] = nIdOld;
     } else {
         // otherwise, move it to the new bucket nId came from (there is certainly place there)
-        vvNew[nOrigin].insert(vTried[nPos]);
+        vvNew[nOrigin][vnNewSize[nOrigin]++] = nIdOld;
     }
     nNew++;
 
-    vTried[nPos] = nId;
-    // we just overwrote an entry in vTried; no need to update nTried
+    pTried[nPos] = nId;
+    // we just overwrote an entry in vvTried; no need to update nTried
     info.fInTried = true;
     return;
 }
@@ -286,13 +313,12 @@ void CAddrMan::Good_(const CService &addr, int64_t nTime)
         return;
 
     // find a bucket it is in now
-    int nRnd = GetRandInt(vvNew.size());
+    int nRnd = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
     int nUBucket = -1;
-    for (unsigned int n = 0; n < vvNew.size(); n++)
+    for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++)
     {
-        int nB = (n+nRnd) % vvNew.size();
-        std::set<int> &vNew = vvNew[nB];
-        if (vNew.count(nId))
+        int nB = (n+nRnd) % ADDRMAN_NEW_BUCKET_COUNT;
+        if (NewBucketFind(nB, nId) >= 0)
         {
             nUBucket = nB;
             break;
@@ -356,13 +382,12 @@ bool CAddrMan::Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimeP
     }
 
     int nUBucket = pinfo->GetNewBucket(nKey, source);
-    std::set<int> &vNew = vvNew[nUBucket];
-    if (!vNew.count(nId))
+    if (NewBucketFind(nUBucket, nId) < 0)
     {
         pinfo->nRefCount++;
-        if (vNew.size() == ADDRMAN_NEW_BUCKET_SIZE)
+        if (vnNewSize[nUBucket] == ADDRMAN_NEW_BUCKET_SIZE)
             ShrinkNew(nUBucket);
-        vvNew[nUBucket].insert(nId);
+        vvNew[nUBucket][vnNewSize[nUBucket]++] = nId;
     }
     return fNew;
 }
@@ -399,12 +424,10 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nKBucket = GetRandInt(vvTried.size());
-            std::vector<int> &vTried = vvTried[nKBucket];
-            if (vTried.size() == 0) continue;
-            int nPos = GetRandInt(vTried.size());
-            assert(mapInfo.count(vTried[nPos]) == 1);
-            CAddrInfo &info = mapInfo[vTried[nPos]];
+            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
+            if (vnTriedSize[nKBucket] == 0) continue;
+            int nPos = GetRandInt(vnTriedSize[nKBucket]);
+            CAddrInfo &info = vInfo[vvTried[nKBucket][nPos]];
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -414,15 +437,10 @@ CAddress CAddrMan::Select_(int nUnkBias)
         double fChanceFactor = 1.0;
         while(1)
         {
-            int nUBucket = GetRandInt(vvNew.size());
-            std::set<int> &vNew = vvNew[nUBucket];
-            if (vNew.size() == 0) continue;
-            int nPos = GetRandInt(vNew.size());
-            std::set<int>::iterator it = vNew.begin();
-            while (nPos--)
-                it++;
-            assert(mapInfo.count(*it) == 1);
-            CAddrInfo &info = mapInfo[*it];
+            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
+            if (vnNewSize[nUBucket] == 0) continue;
+            int nPos = GetRandInt(vnNewSize[nUBucket]);
+            CAddrInfo &info = vInfo[vvNew[nUBucket][nPos]];
             if (GetRandInt(1<<30) < fChanceFactor*info.GetChance()*(1<<30))
                 return info;
             fChanceFactor *= 1.2;
@@ -437,11 +455,13 @@ int CAddrMan::Check_()
     std::map<int, int> mapNew;
 
     if (vRandom.size() != nTried + nNew) return -7;
+    if (vInfo.size() != vRandom.size() + vFreeIds.size()) return -16;
 
-    for (std::map<int, CAddrInfo>::iterator it = mapInfo.begin(); it != mapInfo.end(); it++)
+    for (unsigned int n = 0; n < vInfo.size(); n++)
     {
-        int n = (*it).first;
-        CAddrInfo &info = (*it).second;
+        CAddrInfo &info = vInfo[n];
+        if (info.nRandomPos == -1)
+            continue;
         if (info.fInTried)
         {
 
@@ -453,8 +473,8 @@ int CAddrMan::Check_()
             if (!info.nRefCount) return -4;
             mapNew[n] = info.nRefCount;
         }
-        if (mapAddr[info] != n) return -5;
-        if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != n) return -14;
+        if (mapAddr[info] != (int)n) return -5;
+        if (info.nRandomPos<0 || info.nRandomPos>=vRandom.size() || vRandom[info.nRandomPos] != (int)n) return -14;
         if (info.nLastTry < 0) return -6;
         if (info.nLastSuccess < 0) return -8;
     }
@@ -462,24 +482,23 @@ int CAddrMan::Check_()
     if (setTried.size() != nTried) return -9;
     if (mapNew.size() != nNew) return -10;
 
-    for (int n=0; n<vvTried.size(); n++)
+    for (int b = 0; b < ADDRMAN_TRIED_BUCKET_COUNT; b++)
     {
-        std::vector<int> &vTried = vvTried[n];
-        for (std::vector<int>::iterator it = vTried.begin(); it != vTried.end(); it++)
+        for (int i = 0; i < vnTriedSize[b]; i++)
         {
-            if (!setTried.count(*it)) return -11;
-            setTried.erase(*it);
+            if (!setTried.count(vvTried[b][i])) return -11;
+            setTried.erase(vvTried[b][i]);
         }
     }
 
-    for (int n=0; n<vvNew.size(); n++)
+    for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++)
     {
-        std::set<int> &vNew = vvNew[n];
-        for (std::set<int>::iterator it = vNew.begin(); it != vNew.end(); it++)
+        for (int i = 0; i < vnNewSize[b]; i++)
         {
-            if (!mapNew.count(*it)) return -12;
-            if (--mapNew[*it] == 0)
-                mapNew.erase(*it);
+            int nId = vvNew[b][i];
+            if (!mapNew.count(nId)) return -12;
+            if (--mapNew[nId] == 0)
+                mapNew.erase(nId);
         }
     }
 
@@ -501,8 +520,7 @@ void CAddrMan::GetAddr_(std::vector<CAddress> &vAddr)
     {
         int nRndPos = GetRandInt(vRandom.size() - n) + n;
         SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
-        vAddr.push_back(mapInfo[vRandom[n]]);
+        vAddr.push_back(vInfo[vRandom[n]]);
     }
 }
 
@@ -4,6 +4,7 @@
 #ifndef _BITCOIN_ADDRMAN
 #define _BITCOIN_ADDRMAN 1
 
+#include "memusage.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "util.h"
@@ -42,6 +43,7 @@ private:
     int nRandomPos;
 
     friend class CAddrMan;
+    friend class CAddrManSnapshot;
 
 public:
 
@@ -161,6 +163,74 @@ public:
 // the maximum number of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX 2500
 
+class CAddrMan;
+
+/** What peers.dat is written from, copied out of CAddrMan in one go so the
+ *  tables stay unlocked while it is serialized, hashed and committed */
+class CAddrManSnapshot
+{
+private:
+    std::vector<unsigned char> nKey;
+    int nNew;
+    int nTried;
+    std::vector<CAddrInfo> vInfo;
+    std::vector<int> vNew;
+    std::vector<int> vnNewSize;
+
+    friend class CAddrMan;
+
+public:
+    template<typename Stream, typename Operation>
+    unsigned int Write(Stream& s, int nType, Operation ser_action)
+    {
+        unsigned int nSerSize = 0;
+        // also the version the entries are serialized with
+        unsigned char nVersion = 0;
+        READWRITE(nVersion);
+        READWRITE(nKey);
+        READWRITE(nNew);
+        READWRITE(nTried);
+
+        int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
+        READWRITE(nUBuckets);
+        std::vector<int> vUnkIds(vInfo.size(), 0);
+        int nIds = 0;
+        for (unsigned int n = 0; n < vInfo.size(); n++)
+        {
+            if (nIds == nNew) break; // this means nNew was wrong, oh ow
+            CAddrInfo &info = vInfo[n];
+            if (info.nRandomPos >= 0 && info.nRefCount)
+            {
+                vUnkIds[n] = nIds;
+                READWRITE(info);
+                nIds++;
+            }
+        }
+        nIds = 0;
+        for (unsigned int n = 0; n < vInfo.size(); n++)
+        {
+            if (nIds == nTried) break; // this means nTried was wrong, oh ow
+            CAddrInfo &info = vInfo[n];
+            if (info.nRandomPos >= 0 && info.fInTried)
+            {
+                READWRITE(info);
+                nIds++;
+            }
+        }
+        for (int b = 0; b < ADDRMAN_NEW_BUCKET_COUNT; b++)
+        {
+            int nSize = vnNewSize[b];
+            READWRITE(nSize);
+            for (int i = 0; i < nSize; i++)
+            {
+                int nIndex = vUnkIds[vNew[b * ADDRMAN_NEW_BUCKET_SIZE + i]];
+                READWRITE(nIndex);
+            }
+        }
+        return nSerSize;
+    }
+};
+
 /** Stochastical (IP) address manager */
 class CAddrMan
 {
@@ -171,11 +241,10 @@ private:
     // secret key to randomize bucket select with
     std::vector<unsigned char> nKey;
 
-    // last used nId
-    int nIdCount;
-
-    // table with information about all nIds
-    std::map<int, CAddrInfo> mapInfo;
+    // table with information about all nIds, which index it; unused slots
+    // have nRandomPos -1 and are listed in vFreeIds for reuse
+    std::vector<CAddrInfo> vInfo;
+    std::vector<int> vFreeIds;
 
     // find an nId based on its network address
     std::map<CNetAddr, int> mapAddr;
@@ -186,14 +255,16 @@ private:
     // number of "tried" entries
     int nTried;
 
-    // list of "tried" buckets
-    std::vector<std::vector<int> > vvTried;
+    // "tried" buckets, the first vnTriedSize[b] slots of each in use
+    int vvTried[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_TRIED_BUCKET_SIZE];
+    int vnTriedSize[ADDRMAN_TRIED_BUCKET_COUNT];
 
     // number of (unique) "new" entries
     int nNew;
 
-    // list of "new" buckets
-    std::vector<std::set<int> > vvNew;
+    // "new" buckets, the first vnNewSize[b] slots of each in use
+    int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_NEW_BUCKET_SIZE];
+    int vnNewSize[ADDRMAN_NEW_BUCKET_COUNT];
 
 protected:
 
@@ -202,8 +273,18 @@ protected:
 
     // find an entry, creating it if necessary.
     // nTime and nServices of found node is updated, if necessary.
+    // Earlier CAddrInfo references may not survive this.
     CAddrInfo* Create(const CAddress &addr, const CNetAddr &addrSource, int *pnId = NULL);
 
+    // Forget an entry that is in no bucket any more.
+    void Delete(int nId);
+
+    // Whether a "new" bucket holds nId, and where.
+    int NewBucketFind(int nUBucket, int nId) const;
+
+    // Take the entry in a given slot out of a "new" bucket, the last one fills the gap.
+    void NewBucketErase(int nUBucket, int nPos);
+
     // Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
@@ -216,7 +297,7 @@ protected:
     int ShrinkNew(int nUBucket);
 
     // Move an entry from the "new" table(s) to the "tried" table
-    // @pre vvUnkown[nOrigin].count(nId) != 0
+    // @pre vvNew[nOrigin] holds nId
     void MakeTried(CAddrInfo& info, int nId, int nOrigin);
 
     // Mark an entry "good", possibly moving it from "new" to "tried".
@@ -243,6 +324,9 @@ protected:
     // Mark an entry as currently-connected-to.
     void Connected_(const CService &addr, int64_t nTime);
 
+    // Empty all tables, keeping nKey.
+    void Clear_();
+
 public:
 
     IMPLEMENT_SERIALIZE
@@ -267,126 +351,109 @@ public:
         //
         // This format is more complex, but significantly smaller (at most 1.5 MiB), and supports
         // changes to the ADDRMAN_ parameters without breaking the on-disk structure.
+        CAddrMan *am = const_cast<CAddrMan*>(this);
+        if (fWrite)
         {
+            // Only the copy is made under the lock
+            CAddrManSnapshot snap;
+            am->GetSnapshot(snap);
+            nSerSize += snap.Write(s, nType, ser_action);
+        } else {
             LOCK(cs);
+            am->Clear_();
             unsigned char nVersion = 0;
             READWRITE(nVersion);
             READWRITE(nKey);
             READWRITE(nNew);
             READWRITE(nTried);
 
-            CAddrMan *am = const_cast<CAddrMan*>(this);
-            if (fWrite)
+            if (nNew < 0 || nNew > ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_NEW_BUCKET_SIZE ||
+                nTried < 0 || nTried > ADDRMAN_TRIED_BUCKET_COUNT * ADDRMAN_TRIED_BUCKET_SIZE)
             {
-                int nUBuckets = ADDRMAN_NEW_BUCKET_COUNT;
-                READWRITE(nUBuckets);
-                std::map<int, int> mapUnkIds;
-                int nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
-                {
-                    if (nIds == nNew) break; // this means nNew was wrong, oh ow
-                    mapUnkIds[(*it).first] = nIds;
-                    CAddrInfo &info = (*it).second;
-                    if (info.nRefCount)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
-                }
-                nIds = 0;
-                for (std::map<int, CAddrInfo>::iterator it = am->mapInfo.begin(); it != am->mapInfo.end(); it++)
-                {
-                    if (nIds == nTried) break; // this means nTried was wrong, oh ow
-                    CAddrInfo &info = (*it).second;
-                    if (info.fInTried)
-                    {
-                        READWRITE(info);
-                        nIds++;
-                    }
-                }
-                for (std::vector<std::set<int> >::iterator it = am->vvNew.begin(); it != am->vvNew.end(); it++)
-                {
-                    const std::set<int> &vNew = (*it);
-                    int nSize = vNew.size();
-                    READWRITE(nSize);
-                    for (std::set<int>::iterator it2 = vNew.begin(); it2 != vNew.end(); it2++)
-                    {
-                        int nIndex = mapUnkIds[*it2];
-                        READWRITE(nIndex);
-                    }
-                }
-            } else {
-                int nUBuckets = 0;
-                READWRITE(nUBuckets);
-                am->nIdCount = 0;
-                am->mapInfo.clear();
-                am->mapAddr.clear();
-                am->vRandom.clear();
-                am->vvTried = std::vector<std::vector<int> >(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0));
-                am->vvNew = std::vector<std::set<int> >(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>());
-                for (int n = 0; n < am->nNew; n++)
+                am->Clear_();
+                throw std::ios_base::failure("CAddrMan::Unserialize() : table sizes out of range");
+            }
+
+            int nUBuckets = 0;
+            READWRITE(nUBuckets);
+            am->vInfo.resize(am->nNew);
+            for (int n = 0; n < am->nNew; n++)
+            {
+                CAddrInfo &info = am->vInfo[n];
+                READWRITE(info);
+                am->mapAddr[info] = n;
+                info.nRandomPos = vRandom.size();
+                am->vRandom.push_back(n);
+                if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
                 {
-                    CAddrInfo &info = am->mapInfo[n];
-                    READWRITE(info);
-                    am->mapAddr[info] = n;
-                    info.nRandomPos = vRandom.size();
-                    am->vRandom.push_back(n);
-                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT)
+                    int nUBucket = info.GetNewBucket(am->nKey);
+                    if (am->vnNewSize[nUBucket] < ADDRMAN_NEW_BUCKET_SIZE)
                     {
-                        am->vvNew[info.GetNewBucket(am->nKey)].insert(n);
+                        am->vvNew[nUBucket][am->vnNewSize[nUBucket]++] = n;
                         info.nRefCount++;
                     }
                 }
-                am->nIdCount = am->nNew;
-                int nLost = 0;
-                for (int n = 0; n < am->nTried; n++)
+            }
+            int nLost = 0;
+            for (int n = 0; n < am->nTried; n++)
+            {
+                CAddrInfo info;
+                READWRITE(info);
+                int nKBucket = info.GetTriedBucket(am->nKey);
+                if (am->vnTriedSize[nKBucket] < ADDRMAN_TRIED_BUCKET_SIZE)
                 {
-                    CAddrInfo info;
-                    READWRITE(info);
-                    std::vector<int> &vTried = am->vvTried[info.GetTriedBucket(am->nKey)];
-                    if (vTried.size() < ADDRMAN_TRIED_BUCKET_SIZE)
-                    {
-                        info.nRandomPos = vRandom.size();
-                        info.fInTried = true;
-                        am->vRandom.push_back(am->nIdCount);
-                        am->mapInfo[am->nIdCount] = info;
-                        am->mapAddr[info] = am->nIdCount;
-                        vTried.push_back(am->nIdCount);
-                        am->nIdCount++;
-                    } else {
-                        nLost++;
-                    }
+                    int nId = am->vInfo.size();
+                    info.nRandomPos = vRandom.size();
+                    info.fInTried = true;
+                    am->vRandom.push_back(nId);
+                    am->vInfo.push_back(info);
+                    am->mapAddr[info] = nId;
+                    am->vvTried[nKBucket][am->vnTriedSize[nKBucket]++] = nId;
+                } else {
+                    nLost++;
                 }
-                am->nTried -= nLost;
-                for (int b = 0; b < nUBuckets; b++)
+            }
+            am->nTried -= nLost;
+            for (int b = 0; b < nUBuckets; b++)
+            {
+                int nSize = 0;
+                READWRITE(nSize);
+                for (int n = 0; n < nSize; n++)
                 {
-                    std::set<int> &vNew = am->vvNew[b];
-                    int nSize = 0;
-                    READWRITE(nSize);
-                    for (int n = 0; n < nSize; n++)
+                    int nIndex = 0;
+                    READWRITE(nIndex);
+                    if (nUBuckets != ADDRMAN_NEW_BUCKET_COUNT || nIndex < 0 || nIndex >= am->nNew)
+                        continue;
+                    CAddrInfo &info = am->vInfo[nIndex];
+                    if (info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS &&
+                        am->vnNewSize[b] < ADDRMAN_NEW_BUCKET_SIZE && am->NewBucketFind(b, nIndex) < 0)
                     {
-                        int nIndex = 0;
-                        READWRITE(nIndex);
-                        CAddrInfo &info = am->mapInfo[nIndex];
-                        if (nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS)
-                        {
-                            info.nRefCount++;
-                            vNew.insert(nIndex);
-                        }
+                        info.nRefCount++;
+                        am->vvNew[b][am->vnNewSize[b]++] = nIndex;
                     }
                 }
             }
         }
     });)
 
-    CAddrMan() : vRandom(0), vvTried(ADDRMAN_TRIED_BUCKET_COUNT, std::vector<int>(0)), vvNew(ADDRMAN_NEW_BUCKET_COUNT, std::set<int>())
+    CAddrMan()
     {
          nKey.resize(32);
          RAND_bytes(&nKey[0], 32);
 
-         nIdCount = 0;
-         nTried = 0;
-         nNew = 0;
+         Clear_();
+    }
+
+    // Copy out what is written to peers.dat.
+    void GetSnapshot(CAddrManSnapshot& snap) const
+    {
+        LOCK(cs);
+        snap.nKey = nKey;
+        snap.nNew = nNew;
+        snap.nTried = nTried;
+        snap.vInfo = vInfo;
+        snap.vNew.assign(&vvNew[0][0], &vvNew[0][0] + ADDRMAN_NEW_BUCKET_COUNT * ADDRMAN_NEW_BUCKET_SIZE);
+        snap.vnNewSize.assign(vnNewSize, vnNewSize + ADDRMAN_NEW_BUCKET_COUNT);
     }
 
     // Return the number of (unique) addresses in all tables.
@@ -395,6 +462,14 @@ public:
         return vRandom.size();
     }
 
+    // Approximate memory of the tables, the fixed size buckets included
+    size_t DynamicUsage() const
+    {
+        LOCK(cs);
+        return sizeof(CAddrMan) + VectorUsage(nKey) + VectorUsage(vInfo) + VectorUsage(vFreeIds) +
+               MapUsage(mapAddr) + VectorUsage(vRandom);
+    }
+
     // Consistency check
     void Check()
     {
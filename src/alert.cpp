@@ -144,13 +144,41 @@ bool CAlert::RelayTo(CNode* pnode) const
     return false;
 }
 
+// Outcome of each signature verified, by hash of the signed message and
+// signature, so an alert relayed by many peers is only verified once
+static const unsigned int MAX_ALERT_SIG_CACHE = 1000;
+static CCriticalSection cs_mapAlertSigs;
+static map<uint256, bool> mapAlertSigs;
+
 bool CAlert::CheckSignature() const
 {
-    CKey key;
-    if (!key.SetPubKey(ParseHex(fTestNet ? pszTestKey : pszMainKey)))
-        return error("CAlert::CheckSignature() : SetPubKey failed");
-    if (!key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig))
-        return error("CAlert::CheckSignature() : verify signature failed");
+    uint256 hashSigned = Hash(vchMsg.begin(), vchMsg.end(), vchSig.begin(), vchSig.end());
+    bool fKnown = false;
+    {
+        LOCK(cs_mapAlertSigs);
+        map<uint256, bool>::const_iterator mi = mapAlertSigs.find(hashSigned);
+        if (mi != mapAlertSigs.end())
+        {
+            if (!mi->second)
+                return false;
+            fKnown = true;
+        }
+    }
+
+    if (!fKnown)
+    {
+        CKey key;
+        bool fValid = key.SetPubKey(ParseHex(fTestNet ? pszTestKey : pszMainKey)) &&
+                      key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig);
+        {
+            LOCK(cs_mapAlertSigs);
+            if (mapAlertSigs.size() >= MAX_ALERT_SIG_CACHE)
+                mapAlertSigs.clear();
+            mapAlertSigs[hashSigned] = fValid;
+        }
+        if (!fValid)
+            return error("CAlert::CheckSignature() : verify signature failed");
+    }
 
     // Now unserialize the data
     CDataStream sMsg(vchMsg, SER_NETWORK, PROTOCOL_VERSION);
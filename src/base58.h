@@ -27,41 +27,40 @@ static const char* pszBase58 = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnop
 // Encode a byte sequence as a base58-encoded string
 inline std::string EncodeBase58(const unsigned char* pbegin, const unsigned char* pend)
 {
-    CAutoBN_CTX pctx;
-    CBigNum bn58 = 58;
-    CBigNum bn0 = 0;
-
-    // Convert big endian data to little endian
-    // Extra zero at the end make sure bignum will interpret as a positive number
-    std::vector<unsigned char> vchTmp(pend-pbegin+1, 0);
-    reverse_copy(pbegin, pend, vchTmp.begin());
-
-    // Convert little endian data to bignum
-    CBigNum bn;
-    bn.setvch(vchTmp);
-
-    // Convert bignum to std::string
-    std::string str;
-    // Expected size increase from base58 conversion is approximately 137%
-    // use 138% to be safe
-    str.reserve((pend - pbegin) * 500 / 100 + 1);
-    CBigNum dv;
-    CBigNum rem;
-    while (bn > bn0)
+    // Leading zeroes are encoded as base58 zeros
+    int nZeroes = 0;
+    while (pbegin != pend && *pbegin == 0)
     {
-        if (!BN_div(&dv, &rem, &bn, &bn58, pctx))
-            throw bignum_error("EncodeBase58 : BN_div failed");
-        bn = dv;
-        unsigned int c = rem.getulong();
-        str += pszBase58[c];
+        pbegin++;
+        nZeroes++;
     }
 
-    // Leading zeroes encoded as base58 zeros
-    for (const unsigned char* p = pbegin; p < pend && *p == 0; p++)
-        str += pszBase58[0];
+    // Big endian base58 digits, worked on in place: for each byte,
+    // b58 = b58 * 256 + byte. log(256) / log(58) is below 1.38.
+    std::vector<unsigned char> b58((pend - pbegin) * 138 / 100 + 1);
+    int nLength = 0;
+    for (; pbegin != pend; pbegin++)
+    {
+        int carry = *pbegin;
+        int i = 0;
+        // Only the digits in use and those the carry reaches
+        for (std::vector<unsigned char>::reverse_iterator it = b58.rbegin(); (carry != 0 || i < nLength) && it != b58.rend(); ++it, i++)
+        {
+            carry += 256 * (*it);
+            *it = carry % 58;
+            carry /= 58;
+        }
+        nLength = i;
+    }
 
-    // Convert little endian std::string to big endian
-    reverse(str.begin(), str.end());
+    std::vector<unsigned char>::const_iterator it = b58.begin() + (b58.size() - nLength);
+    while (it != b58.end() && *it == 0)
+        ++it;
+    std::string str;
+    str.reserve(nZeroes + (b58.end() - it));
+    str.assign(nZeroes, pszBase58[0]);
+    while (it != b58.end())
+        str += pszBase58[*(it++)];
     return str;
 }
 
@@ -75,47 +74,50 @@ inline std::string EncodeBase58(const std::vector<unsigned char>& vch)
 // returns true if decoding is successful
 inline bool DecodeBase58(const char* psz, std::vector<unsigned char>& vchRet)
 {
-    CAutoBN_CTX pctx;
     vchRet.clear();
-    CBigNum bn58 = 58;
-    CBigNum bn = 0;
-    CBigNum bnChar;
     while (isspace(*psz))
         psz++;
 
-    // Convert big endian string to bignum
-    for (const char* p = psz; *p; p++)
+    // Leading base58 zeros are zero bytes
+    int nZeroes = 0;
+    while (*psz == pszBase58[0])
+    {
+        nZeroes++;
+        psz++;
+    }
+
+    // Big endian bytes, b256 = b256 * 58 + digit for each digit.
+    // log(58) / log(256) is below 0.733.
+    std::vector<unsigned char> b256(strlen(psz) * 733 / 1000 + 1);
+    int nLength = 0;
+    for (; *psz && !isspace(*psz); psz++)
     {
-        const char* p1 = strchr(pszBase58, *p);
+        const char* p1 = strchr(pszBase58, *psz);
         if (p1 == NULL)
+            return false;
+        int carry = p1 - pszBase58;
+        int i = 0;
+        for (std::vector<unsigned char>::reverse_iterator it = b256.rbegin(); (carry != 0 || i < nLength) && it != b256.rend(); ++it, i++)
         {
-            while (isspace(*p))
-                p++;
-            if (*p != '\0')
-                return false;
-            break;
+            carry += 58 * (*it);
+            *it = carry % 256;
+            carry /= 256;
         }
-        bnChar.setulong(p1 - pszBase58);
-        if (!BN_mul(&bn, &bn, &bn58, pctx))
-            throw bignum_error("DecodeBase58 : BN_mul failed");
-        bn += bnChar;
+        nLength = i;
     }
 
-    // Get bignum as little endian data
-    std::vector<unsigned char> vchTmp = bn.getvch();
-
-    // Trim off sign byte if present
-    if (vchTmp.size() >= 2 && vchTmp.end()[-1] == 0 && vchTmp.end()[-2] >= 0x80)
-        vchTmp.erase(vchTmp.end()-1);
-
-    // Restore leading zeros
-    int nLeadingZeros = 0;
-    for (const char* p = psz; *p == pszBase58[0]; p++)
-        nLeadingZeros++;
-    vchRet.assign(nLeadingZeros + vchTmp.size(), 0);
+    // Only whitespace may follow
+    while (isspace(*psz))
+        psz++;
+    if (*psz != '\0')
+        return false;
 
-    // Convert little endian data to big endian
-    reverse_copy(vchTmp.begin(), vchTmp.end(), vchRet.end() - vchTmp.size());
+    std::vector<unsigned char>::iterator it = b256.begin() + (b256.size() - nLength);
+    while (it != b256.end() && *it == 0)
+        ++it;
+    vchRet.reserve(nZeroes + (b256.end() - it));
+    vchRet.assign(nZeroes, 0x00);
+    vchRet.insert(vchRet.end(), it, b256.end());
     return true;
 }
 
@@ -0,0 +1,115 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+int64_t BenchTimeNanos()
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return (boost::posix_time::microsec_clock::universal_time() -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds() * 1000;
+#endif
+}
+
+CBenchState::CBenchState(int64_t nWarmupNanosIn, int64_t nSampleNanosIn, unsigned int nSamplesIn) :
+    nWarmupNanos(nWarmupNanosIn), nSampleNanos(nSampleNanosIn), nSamples(max(1U, nSamplesIn)),
+    fWarmup(true), nBatch(1), nLeft(1), nIterations(0)
+{
+    nWarmupStart = nBatchStart = BenchTimeNanos();
+}
+
+bool CBenchState::NextBatch()
+{
+    int64_t nNow = BenchTimeNanos();
+    int64_t nElapsed = nNow - nBatchStart;
+    if (fWarmup)
+    {
+        // Grow the batch until it fills a sample, and keep at it until the
+        // caches are warm and the CPU has ramped up
+        if (nElapsed < nSampleNanos && nBatch < ((uint64_t)1 << 40))
+            nBatch *= 2;
+        else if (nNow - nWarmupStart >= nWarmupNanos)
+            fWarmup = false;
+    }
+    else
+    {
+        vSamples.push_back((double)nElapsed / nBatch);
+        nIterations += nBatch;
+        if (vSamples.size() >= nSamples)
+            return false;
+    }
+    nLeft = nBatch - 1;
+    nBatchStart = BenchTimeNanos();
+    return true;
+}
+
+CBenchRunner::BenchmarkMap& CBenchRunner::Benchmarks()
+{
+    static BenchmarkMap mapBenchmarks;
+    return mapBenchmarks;
+}
+
+CBenchRunner::CBenchRunner(const char* pszName, BenchFunction func)
+{
+    Benchmarks()[pszName] = func;
+}
+
+// Nearest-rank percentile of sorted samples
+static double Percentile(const vector<double>& vSorted, double dFraction)
+{
+    if (vSorted.empty())
+        return 0;
+    size_t n = (size_t)(dFraction * (vSorted.size() - 1) + 0.5);
+    return vSorted[min(n, vSorted.size() - 1)];
+}
+
+void CBenchRunner::RunAll(const string& strFilter, int64_t nWarmupNanos, int64_t nSampleNanos, unsigned int nSamples)
+{
+    Array results;
+    for (BenchmarkMap::const_iterator it = Benchmarks().begin(); it != Benchmarks().end(); ++it)
+    {
+        if (it->first.find(strFilter) == string::npos)
+            continue;
+        fprintf(stderr, "Running %s\n", it->first.c_str());
+
+        CBenchState state(nWarmupNanos, nSampleNanos, nSamples);
+        it->second(state);
+
+        vector<double> vSorted = state.Samples();
+        sort(vSorted.begin(), vSorted.end());
+        double dTotal = 0;
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            dTotal += vSorted[i];
+
+        Object result;
+        result.push_back(Pair("name",       it->first));
+        result.push_back(Pair("iterations", (boost::int64_t)state.Iterations()));
+        result.push_back(Pair("batch",      (boost::int64_t)state.BatchSize()));
+        result.push_back(Pair("samples",    (int)vSorted.size()));
+        result.push_back(Pair("min_ns",     vSorted.empty() ? 0 : vSorted.front()));
+        result.push_back(Pair("median_ns",  Percentile(vSorted, 0.5)));
+        result.push_back(Pair("mean_ns",    vSorted.empty() ? 0 : dTotal / vSorted.size()));
+        result.push_back(Pair("p90_ns",     Percentile(vSorted, 0.9)));
+        result.push_back(Pair("p99_ns",     Percentile(vSorted, 0.99)));
+        result.push_back(Pair("max_ns",     vSorted.empty() ? 0 : vSorted.back()));
+        results.push_back(result);
+    }
+    printf("%s\n", write_string(Value(results), true).c_str());
+}
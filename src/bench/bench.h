@@ -0,0 +1,93 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_BENCH_H
+#define BITCOIN_BENCH_BENCH_H
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+/** Micro-benchmarks for bench_iocoin.
+ *
+ *  A benchmark is a function that sets up what it needs and then runs the
+ *  code being measured in a loop:
+ *
+ *      static void Hash9Header(CBenchState& state)
+ *      {
+ *          ... setup, not timed ...
+ *          while (state.KeepRunning())
+ *              Hash9(...);
+ *      }
+ *      BENCHMARK(Hash9Header);
+ *
+ *  KeepRunning first runs warmup batches, doubling their size until one
+ *  takes long enough to time, then times a number of batches of that size.
+ *  Each sample is the mean time of one iteration within a batch.
+ */
+class CBenchState
+{
+public:
+    CBenchState(int64_t nWarmupNanosIn, int64_t nSampleNanosIn, unsigned int nSamplesIn);
+
+    bool KeepRunning()
+    {
+        if (nLeft > 0)
+        {
+            nLeft--;
+            return true;
+        }
+        return NextBatch();
+    }
+
+    // Per-iteration times of the timed batches, in nanoseconds
+    const std::vector<double>& Samples() const { return vSamples; }
+    uint64_t Iterations() const { return nIterations; }
+    uint64_t BatchSize() const { return nBatch; }
+
+private:
+    int64_t nWarmupNanos;
+    int64_t nSampleNanos;
+    unsigned int nSamples;
+
+    bool fWarmup;
+    int64_t nWarmupStart;
+    int64_t nBatchStart;
+    uint64_t nBatch;
+    uint64_t nLeft;
+    uint64_t nIterations;
+    std::vector<double> vSamples;
+
+    bool NextBatch();
+};
+
+typedef void (*BenchFunction)(CBenchState&);
+
+class CBenchRunner
+{
+public:
+    CBenchRunner(const char* pszName, BenchFunction func);
+
+    // Runs every benchmark whose name contains strFilter and prints the
+    // results as a JSON array
+    static void RunAll(const std::string& strFilter, int64_t nWarmupNanos, int64_t nSampleNanos, unsigned int nSamples);
+
+private:
+    typedef std::map<std::string, BenchFunction> BenchmarkMap;
+    static BenchmarkMap& Benchmarks();
+};
+
+// Monotonic clock for timing the batches
+int64_t BenchTimeNanos();
+
+// Keeps the compiler from dropping a result nothing reads
+template<typename T>
+inline void DoNotOptimize(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+#define BENCHMARK(n) static CBenchRunner bench_##n(#n, n)
+
+#endif
@@ -0,0 +1,53 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "netsim.h"
+#include "replay.h"
+
+#include "main.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+// Runs the benchmarks in a throwaway data directory, for those that open
+// the databases, and prints the results as JSON on stdout.
+//
+//   bench_iocoin [-filter=<substring>] [-samples=<n>] [-warmupms=<n>] [-samplems=<n>]
+//   bench_iocoin -replay=<file>... [-replaystart=<h>] [-replayend=<h>] [-datadir=<dir>]
+//   bench_iocoin -netsim [-netsimpeers=<n>] [-netsimrate=<n>] [-netsimtime=<s>] [-datadir=<dir>]
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToDebugger = true; // keep the databases' messages out of debug.log
+    bool fReplay = mapArgs.count("-replay");
+    bool fNetSim = GetBoolArg("-netsim");
+
+    // A replay or network simulation may use a copy of a node's data directory
+    boost::filesystem::path pathTemp;
+    if (!(fReplay || fNetSim) || !mapArgs.count("-datadir"))
+    {
+        pathTemp = boost::filesystem::temp_directory_path() /
+            boost::filesystem::unique_path("bench_iocoin_%%%%-%%%%");
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+    }
+
+    int nRet = 0;
+    if (fReplay)
+        nRet = RunBlockReplay();
+    else if (fNetSim)
+        nRet = RunNetSim();
+    else
+        CBenchRunner::RunAll(GetArg("-filter", ""),
+                             GetArg("-warmupms", 100) * 1000000,
+                             GetArg("-samplems", 10) * 1000000,
+                             GetArg("-samples", 20));
+
+    if (!pathTemp.empty())
+        boost::filesystem::remove_all(pathTemp);
+    return nRet;
+}
@@ -0,0 +1,148 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "kernel.h"
+#include "main.h"
+#include "txdb.h"
+
+using namespace std;
+
+// A transaction shaped like a typical payment: two signed inputs, two outputs
+static CTransaction RandomTransaction(const uint256& hashPrev)
+{
+    CTransaction tx;
+    tx.nTime = 1500000000;
+    tx.vin.resize(2);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        tx.vin[i].prevout = COutPoint(i ? GetRandHash() : hashPrev, i);
+        vector<unsigned char> vchSig(72), vchPubKey(33);
+        RAND_bytes(&vchSig[0], vchSig.size());
+        RAND_bytes(&vchPubKey[0], vchPubKey.size());
+        tx.vin[i].scriptSig << vchSig << vchPubKey;
+    }
+    tx.vout.resize(2);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        tx.vout[i].nValue = (i + 1) * COIN;
+        vector<unsigned char> vchKey(33);
+        RAND_bytes(&vchKey[0], vchKey.size());
+        tx.vout[i].scriptPubKey.SetDestination(CKeyID(Hash160(vchKey)));
+    }
+    return tx;
+}
+
+static void MakeBlock(CBlock& block, unsigned int nTx)
+{
+    block.nVersion = CBlock::CURRENT_VERSION;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    for (unsigned int i = 0; i < nTx; i++)
+        block.vtx.push_back(RandomTransaction(GetRandHash()));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+}
+
+static void CheckStakeKernel(CBenchState& state)
+{
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = 100000;
+    indexPrev.nTime = 1500000000;
+    indexPrev.nStakeModifier = 0x0123456789abcdefULL;
+
+    CBlock blockFrom;
+    blockFrom.nTime = 1490000000;
+    CTransaction txPrev = RandomTransaction(GetRandHash());
+    txPrev.nTime = blockFrom.nTime;
+    COutPoint prevout(txPrev.GetHash(), 0);
+
+    unsigned int nTimeTx = 1500000000;
+    uint256 hashProofOfStake, targetProofOfStake;
+    while (state.KeepRunning())
+    {
+        bool fHit = CheckStakeKernelHash(&indexPrev, 0x1d00ffff, blockFrom, 0, txPrev, prevout, nTimeTx++,
+                                         hashProofOfStake, targetProofOfStake);
+        DoNotOptimize(fHit);
+    }
+}
+BENCHMARK(CheckStakeKernel);
+
+static void SerializeBlock(CBenchState& state)
+{
+    CBlock block;
+    MakeBlock(block, 1000);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    while (state.KeepRunning())
+    {
+        ss.clear();
+        ss << block;
+    }
+}
+BENCHMARK(SerializeBlock);
+
+static void DeserializeBlock(CBenchState& state)
+{
+    CBlock block;
+    MakeBlock(block, 1000);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    while (state.KeepRunning())
+    {
+        CDataStream ss(ssBlock);
+        CBlock blockRead;
+        ss >> blockRead;
+        DoNotOptimize(blockRead);
+    }
+}
+BENCHMARK(DeserializeBlock);
+
+// A hundred chained transactions into the pool and out again
+static void MempoolAddRemove(CBenchState& state)
+{
+    vector<CTransaction> vtx;
+    vector<uint256> vHash;
+    uint256 hashPrev = GetRandHash();
+    for (int i = 0; i < 100; i++)
+    {
+        vtx.push_back(RandomTransaction(hashPrev));
+        hashPrev = vtx.back().GetHash();
+        vHash.push_back(hashPrev);
+    }
+    CTxMemPool pool;
+    while (state.KeepRunning())
+    {
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            pool.addUnchecked(vHash[i], vtx[i], CTxMemPoolEntry(MIN_TX_FEE, 1000, 0, 0, 0));
+        for (unsigned int i = vtx.size(); i-- > 0; )
+            pool.remove(vtx[i]);
+    }
+}
+BENCHMARK(MempoolAddRemove);
+
+// Random lookups among 20000 tx index entries, as ConnectInputs does
+static void TxDBReadTxIndex(CBenchState& state)
+{
+    CTxDB txdb("cr+");
+    vector<uint256> vHash;
+    txdb.TxnBegin();
+    for (unsigned int i = 0; i < 20000; i++)
+    {
+        vHash.push_back(GetRandHash());
+        txdb.UpdateTxIndex(vHash.back(), CTxIndex(CDiskTxPos(1, i * 1000, i * 1000 + 81), 2));
+    }
+    txdb.TxnCommit();
+    CTxDB::Flush();
+
+    unsigned int n = 0;
+    CTxIndex txindex;
+    while (state.KeepRunning())
+    {
+        bool fFound = txdb.ReadTxIndex(vHash[n++ % vHash.size()], txindex);
+        assert(fFound);
+    }
+}
+BENCHMARK(TxDBReadTxIndex);
@@ -0,0 +1,112 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "base58.h"
+#include "hashblock.h"
+#include "key.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+// The proof-of-work hash of an 80 byte header
+static void Hash9Header(CBenchState& state)
+{
+    CBlock block;
+    block.nVersion = CBlock::CURRENT_VERSION;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    block.nNonce = 0;
+    while (state.KeepRunning())
+    {
+        uint256 hash = Hash9(BEGIN(block.nVersion), END(block.nNonce));
+        DoNotOptimize(hash);
+        block.nNonce++;
+    }
+}
+BENCHMARK(Hash9Header);
+
+// Double SHA-256 of a txid-sized and of a transaction-sized buffer
+static void SHA256D32(CBenchState& state)
+{
+    vector<unsigned char> vch(32, 0);
+    while (state.KeepRunning())
+    {
+        uint256 hash = Hash(vch.begin(), vch.end());
+        vch[0]++;
+        DoNotOptimize(hash);
+    }
+}
+BENCHMARK(SHA256D32);
+
+static void SHA256D1K(CBenchState& state)
+{
+    vector<unsigned char> vch(1024, 0);
+    while (state.KeepRunning())
+    {
+        uint256 hash = Hash(vch.begin(), vch.end());
+        vch[0]++;
+        DoNotOptimize(hash);
+    }
+}
+BENCHMARK(SHA256D1K);
+
+static void ECDSAVerify(CBenchState& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    key.Sign(hash, vchSig);
+    while (state.KeepRunning())
+    {
+        bool fValid = key.Verify(hash, vchSig);
+        assert(fValid);
+    }
+}
+BENCHMARK(ECDSAVerify);
+
+static void ECDSASign(CBenchState& state)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    vector<unsigned char> vchSig;
+    while (state.KeepRunning())
+    {
+        key.Sign(hash, vchSig);
+        DoNotOptimize(vchSig);
+    }
+}
+BENCHMARK(ECDSASign);
+
+// An address: version byte, hash160 and checksum
+static void Base58Encode(CBenchState& state)
+{
+    vector<unsigned char> vch(25);
+    RAND_bytes(&vch[0], vch.size());
+    while (state.KeepRunning())
+    {
+        string str = EncodeBase58(vch);
+        DoNotOptimize(str);
+    }
+}
+BENCHMARK(Base58Encode);
+
+static void Base58Decode(CBenchState& state)
+{
+    vector<unsigned char> vch(25);
+    RAND_bytes(&vch[0], vch.size());
+    string str = EncodeBase58(vch);
+    while (state.KeepRunning())
+    {
+        bool fValid = DecodeBase58(str.c_str(), vch);
+        assert(fValid);
+    }
+}
+BENCHMARK(Base58Decode);
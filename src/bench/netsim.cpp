@@ -0,0 +1,558 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netsim.h"
+
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <limits>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace json_spirit;
+using namespace std;
+
+// In net.cpp; started here without the threads that make connections
+void ThreadSocketHandler(void* parg);
+void ThreadMessageHandler(void* parg);
+
+enum SimKind
+{
+    SIM_PING,
+    SIM_INV,
+    SIM_TX,
+    SIM_GETDATA,
+    SIM_GETHEADERS,
+    SIM_KINDS
+};
+
+static const char* pszSimKinds[SIM_KINDS] = { "ping", "inv", "tx", "getdata", "getheaders" };
+
+// Answers still missing this long after the sending stops are given up on
+static const int64_t SIM_DRAIN_MICROS = 2000000;
+
+struct CSimKindStats
+{
+    uint64_t nSent;
+    // Microseconds from sending to the answer, of those answered
+    vector<int64_t> vLatency;
+
+    CSimKindStats() : nSent(0) {}
+};
+
+/** What every peer sends from, set up before the peers start and only read
+ *  by them */
+struct CSimConfig
+{
+    int nWeight[SIM_KINDS];
+    int nTotalWeight;
+    int64_t nInterval; // microseconds between messages of a peer
+    int64_t nTimeStop;
+    bool fCompact;
+    // A sample of the active chain for getdata and getheaders
+    vector<uint256> vBlockHash;
+    vector<CBlockLocator> vLocator;
+};
+
+/** The harness end of one socketpair. Its socket is non-blocking and
+ *  written from a buffer, so a node slow to read can't stall the replies
+ *  it is sending back. */
+class CSimPeer
+{
+public:
+    CSimKindStats stats[SIM_KINDS];
+    uint64_t nBytesSent;
+    uint64_t nBytesRecv;
+    bool fDisconnected;
+    int64_t nCPUMicros;
+
+    CSimPeer(SOCKET hSocketIn, const CSimConfig& configIn) :
+        nBytesSent(0), nBytesRecv(0), fDisconnected(false), nCPUMicros(0),
+        hSocket(hSocketIn), config(configIn), fHandshake(false), nNextSend(0), nSendOffset(0) {}
+
+    void Run()
+    {
+        RenameThread("iocoin-netsim");
+        CDataStream ssVersion(SER_NETWORK, INIT_PROTO_VERSION);
+        ssVersion << PROTOCOL_VERSION << (uint64_t)0 << GetAdjustedTime() << CAddress() << CAddress()
+                  << GetRand(numeric_limits<uint64_t>::max()) << string("/netsim/") << 0 << true;
+        Send(MakeNetMessage("version", ssVersion));
+
+        while (!fDisconnected)
+        {
+            int64_t nNow = GetTimeMicros();
+            if (fHandshake && nNow < config.nTimeStop)
+            {
+                while (nNextSend <= nNow)
+                {
+                    SendNext(nNow);
+                    nNextSend += config.nInterval;
+                }
+            }
+            if (nNow >= config.nTimeStop && (Unanswered() == 0 || nNow >= config.nTimeStop + SIM_DRAIN_MICROS))
+                break;
+
+            int64_t nWait = 100000;
+            if (fHandshake && nNow < config.nTimeStop)
+                nWait = min(nWait, nNextSend - nNow);
+            struct pollfd pfd;
+            pfd.fd = hSocket;
+            pfd.events = POLLIN | (strSend.size() > nSendOffset ? POLLOUT : 0);
+            pfd.revents = 0;
+            if (poll(&pfd, 1, max((int64_t)1, nWait / 1000)) < 0 && errno != EINTR)
+                break;
+            if (pfd.revents & POLLIN)
+                Receive(GetTimeMicros());
+            if (pfd.revents & (POLLOUT | POLLERR | POLLHUP))
+                Flush();
+        }
+
+#ifdef RUSAGE_THREAD
+        struct rusage usage;
+        if (getrusage(RUSAGE_THREAD, &usage) == 0)
+            nCPUMicros = CPUMicros(usage);
+#endif
+    }
+
+    static int64_t CPUMicros(const struct rusage& usage)
+    {
+        return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * (int64_t)1000000 +
+            usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+
+private:
+    SOCKET hSocket;
+    const CSimConfig& config;
+    bool fHandshake;
+    int64_t nNextSend;
+
+    string strSend;
+    size_t nSendOffset;
+    string strRecv;
+
+    // Sent and not answered yet. The node answers a peer's getdata and
+    // getheaders in order, so those only need the times.
+    map<uint64_t, int64_t> mapPing;
+    map<uint256, int64_t> mapInv;
+    deque<int64_t> dequeGetData;
+    deque<int64_t> dequeGetHeaders;
+
+    size_t Unanswered() const
+    {
+        return mapPing.size() + mapInv.size() + dequeGetData.size() + dequeGetHeaders.size();
+    }
+
+    void Send(const CNetMessageRef& msg)
+    {
+        if (nSendOffset == strSend.size())
+        {
+            strSend.clear();
+            nSendOffset = 0;
+        }
+        strSend.append(msg->begin(), msg->end());
+        Flush();
+    }
+
+    void Flush()
+    {
+        while (nSendOffset < strSend.size())
+        {
+            int nBytes = send(hSocket, &strSend[nSendOffset], strSend.size() - nSendOffset, MSG_NOSIGNAL);
+            if (nBytes <= 0)
+            {
+                if (nBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    return;
+                fDisconnected = true;
+                return;
+            }
+            nSendOffset += nBytes;
+            nBytesSent += nBytes;
+        }
+    }
+
+    SimKind PickKind()
+    {
+        int nPick = GetRand(config.nTotalWeight);
+        int kind = 0;
+        while (nPick >= config.nWeight[kind])
+            nPick -= config.nWeight[kind++];
+        return (SimKind)kind;
+    }
+
+    void SendNext(int64_t nNow)
+    {
+        SimKind kind = PickKind();
+        stats[kind].nSent++;
+        switch (kind)
+        {
+        case SIM_PING:
+        {
+            uint64_t nNonce = GetRand(numeric_limits<uint64_t>::max());
+            mapPing[nNonce] = nNow;
+            Send(MakeNetMessage("ping", nNonce));
+            break;
+        }
+        case SIM_INV:
+        {
+            CInv inv(MSG_TX, GetRandHash());
+            mapInv[inv.hash] = nNow;
+            Send(MakeNetMessage("inv", vector<CInv>(1, inv)));
+            break;
+        }
+        case SIM_TX:
+            Send(MakeNetMessage("tx", OrphanTransaction()));
+            break;
+        case SIM_GETDATA:
+        {
+            const uint256& hash = config.vBlockHash[GetRand(config.vBlockHash.size())];
+            dequeGetData.push_back(nNow);
+            Send(MakeNetMessage("getdata", vector<CInv>(1, CInv(config.fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, hash))));
+            break;
+        }
+        case SIM_GETHEADERS:
+        {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << config.vLocator[GetRand(config.vLocator.size())] << uint256(0);
+            dequeGetHeaders.push_back(nNow);
+            Send(MakeNetMessage("getheaders", ss));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // A payment shaped transaction whose inputs nobody has
+    static CTransaction OrphanTransaction()
+    {
+        CTransaction tx;
+        tx.nTime = GetAdjustedTime();
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        vector<unsigned char> vchSig(72), vchPubKey(33);
+        RAND_bytes(&vchSig[0], vchSig.size());
+        RAND_bytes(&vchPubKey[0], vchPubKey.size());
+        tx.vin[0].scriptSig << vchSig << vchPubKey;
+        tx.vout.resize(2);
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            tx.vout[i].nValue = (i + 1) * COIN;
+            vector<unsigned char> vchKey(33);
+            RAND_bytes(&vchKey[0], vchKey.size());
+            tx.vout[i].scriptPubKey.SetDestination(CKeyID(Hash160(vchKey)));
+        }
+        return tx;
+    }
+
+    void Answered(SimKind kind, int64_t nSent, int64_t nNow)
+    {
+        stats[kind].vLatency.push_back(nNow - nSent);
+    }
+
+    void Receive(int64_t nNow)
+    {
+        char pchBuf[0x10000];
+        while (true)
+        {
+            int nBytes = recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+            if (nBytes <= 0)
+            {
+                if (nBytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                    fDisconnected = true;
+                break;
+            }
+            nBytesRecv += nBytes;
+            strRecv.append(pchBuf, nBytes);
+        }
+
+        size_t nOffset = 0;
+        while (strRecv.size() - nOffset >= CMessageHeader::HEADER_SIZE)
+        {
+            CDataStream ssHeader(strRecv.begin() + nOffset, strRecv.begin() + nOffset + CMessageHeader::HEADER_SIZE, SER_NETWORK, PROTOCOL_VERSION);
+            CMessageHeader hdr;
+            ssHeader >> hdr;
+            if (strRecv.size() - nOffset - CMessageHeader::HEADER_SIZE < hdr.nMessageSize)
+                break;
+            string::iterator itPayload = strRecv.begin() + nOffset + CMessageHeader::HEADER_SIZE;
+            CDataStream vRecv(itPayload, itPayload + hdr.nMessageSize, SER_NETWORK, PROTOCOL_VERSION);
+            nOffset += CMessageHeader::HEADER_SIZE + hdr.nMessageSize;
+            try {
+                ProcessMessage(hdr.GetCommand(), vRecv, nNow);
+            }
+            catch (std::exception& e) {
+                printf("netsim: bad %s message: %s\n", hdr.GetCommand().c_str(), e.what());
+            }
+        }
+        strRecv.erase(0, nOffset);
+    }
+
+    void ProcessMessage(const string& strCommand, CDataStream& vRecv, int64_t nNow)
+    {
+        if (strCommand == "version")
+            Send(MakeNetMessage("verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION)));
+        else if (strCommand == "verack")
+        {
+            fHandshake = true;
+            // Spread the peers' messages over the interval
+            nNextSend = nNow + GetRand(config.nInterval);
+        }
+        else if (strCommand == "ping")
+        {
+            uint64_t nNonce = 0;
+            vRecv >> nNonce;
+            Send(MakeNetMessage("pong", nNonce));
+        }
+        else if (strCommand == "pong")
+        {
+            uint64_t nNonce = 0;
+            vRecv >> nNonce;
+            map<uint64_t, int64_t>::iterator mi = mapPing.find(nNonce);
+            if (mi != mapPing.end())
+            {
+                Answered(SIM_PING, mi->second, nNow);
+                mapPing.erase(mi);
+            }
+        }
+        else if (strCommand == "getdata")
+        {
+            vector<CInv> vInv;
+            vRecv >> vInv;
+            BOOST_FOREACH(const CInv& inv, vInv)
+            {
+                map<uint256, int64_t>::iterator mi = mapInv.find(inv.hash);
+                if (mi != mapInv.end())
+                {
+                    Answered(SIM_INV, mi->second, nNow);
+                    mapInv.erase(mi);
+                }
+            }
+        }
+        else if ((strCommand == "block" || strCommand == "cmpctblock") && !dequeGetData.empty())
+        {
+            Answered(SIM_GETDATA, dequeGetData.front(), nNow);
+            dequeGetData.pop_front();
+        }
+        else if (strCommand == "headers" && !dequeGetHeaders.empty())
+        {
+            Answered(SIM_GETHEADERS, dequeGetHeaders.front(), nNow);
+            dequeGetHeaders.pop_front();
+        }
+    }
+};
+
+static bool ParseMix(const string& strMix, CSimConfig& config)
+{
+    for (int kind = 0; kind < SIM_KINDS; kind++)
+        config.nWeight[kind] = 0;
+    vector<string> vEntries;
+    boost::split(vEntries, strMix, boost::is_any_of(","));
+    BOOST_FOREACH(const string& strEntry, vEntries)
+    {
+        vector<string> vPair;
+        boost::split(vPair, strEntry, boost::is_any_of(":"));
+        int kind = 0;
+        while (kind < SIM_KINDS && vPair[0] != pszSimKinds[kind])
+            kind++;
+        if (vPair.size() != 2 || kind == SIM_KINDS || atoi(vPair[1]) < 0)
+            return false;
+        config.nWeight[kind] = atoi(vPair[1]);
+    }
+    config.nTotalWeight = 0;
+    for (int kind = 0; kind < SIM_KINDS; kind++)
+        config.nTotalWeight += config.nWeight[kind];
+    return config.nTotalWeight > 0;
+}
+
+static int64_t GetResidentBytes()
+{
+    long nPages = 0, nResident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%ld %ld", &nPages, &nResident) != 2)
+        nResident = 0;
+    fclose(file);
+    return (int64_t)nResident * sysconf(_SC_PAGESIZE);
+}
+
+static int64_t Percentile(const vector<int64_t>& vSorted, double dFraction)
+{
+    if (vSorted.empty())
+        return 0;
+    return vSorted[min(vSorted.size() - 1, (size_t)(vSorted.size() * dFraction))];
+}
+
+int RunNetSim()
+{
+    int nPeers = GetArg("-netsimpeers", 16);
+    int nRate = GetArg("-netsimrate", 50);
+    int nSeconds = GetArg("-netsimtime", 10);
+    CSimConfig config;
+    if (nPeers < 1 || nRate < 1 || nSeconds < 1)
+    {
+        fprintf(stderr, "Error: -netsimpeers, -netsimrate and -netsimtime must be positive\n");
+        return 1;
+    }
+    if (!ParseMix(GetArg("-netsimmix", "ping:1,inv:4,tx:4,getdata:1,getheaders:1"), config))
+    {
+        fprintf(stderr, "Error: -netsimmix wants <kind>:<weight>,... with kinds ping, inv, tx, getdata, getheaders\n");
+        return 1;
+    }
+    config.nInterval = max((int64_t)1, 1000000 / (int64_t)nRate);
+    config.fCompact = GetBoolArg("-netsimcmpct");
+
+    {
+        LOCK(cs_main);
+        if (!LoadBlockIndex(true))
+        {
+            fprintf(stderr, "Error: could not load the block index in %s\n", GetDataDir().string().c_str());
+            return 1;
+        }
+        int nStep = max(1, nBestHeight / 1000);
+        for (int nHeight = nBestHeight; nHeight >= 0; nHeight -= nStep)
+        {
+            CBlockIndex* pindex = FindBlockByHeight(nHeight);
+            config.vBlockHash.push_back(pindex->GetBlockHash());
+            config.vLocator.push_back(CBlockLocator(pindex));
+        }
+    }
+    fprintf(stderr, "Best height %d, %d peers sending %d messages a second each for %d seconds\n",
+            nBestHeight, nPeers, nRate, nSeconds);
+
+    int nMsgHandlers = max(1, min(16, (int)GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS)));
+    if (!NewThread(ThreadSocketHandler, NULL))
+    {
+        fprintf(stderr, "Error: NewThread(ThreadSocketHandler) failed\n");
+        return 1;
+    }
+    for (int i = 0; i < nMsgHandlers; i++)
+        NewThread(ThreadMessageHandler, NULL);
+
+    int64_t nRSSStart = GetResidentBytes();
+    struct rusage usageStart;
+    getrusage(RUSAGE_SELF, &usageStart);
+    int64_t nTimeStart = GetTimeMicros();
+    config.nTimeStop = nTimeStart + nSeconds * (int64_t)1000000;
+
+    vector<CSimPeer*> vPeers;
+    for (int i = 0; i < nPeers; i++)
+    {
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        {
+            fprintf(stderr, "Error: socketpair failed: %s\n", strerror(errno));
+            break;
+        }
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        fcntl(sv[1], F_SETFL, O_NONBLOCK);
+        // Addresses of their own, so nothing keyed by address is shared
+        CAddress addr(CService(strprintf("10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff), GetDefaultPort()));
+        CNode* pnode = new CNode(sv[0], addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        vPeers.push_back(new CSimPeer(sv[1], config));
+    }
+
+    boost::thread_group threads;
+    BOOST_FOREACH(CSimPeer* ppeer, vPeers)
+        threads.create_thread(boost::bind(&CSimPeer::Run, ppeer));
+    threads.join_all();
+
+    int64_t nTimeEnd = GetTimeMicros();
+    struct rusage usageEnd;
+    getrusage(RUSAGE_SELF, &usageEnd);
+    int64_t nRSSEnd = GetResidentBytes();
+    unsigned int nMempool = mempool.size();
+
+    fShutdown = true;
+    for (int i = 0; i < 2000 && (vnThreadsRunning[THREAD_SOCKETHANDLER] > 0 || vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0); i++)
+        MilliSleep(10);
+
+    CSimKindStats total[SIM_KINDS];
+    uint64_t nBytesSent = 0, nBytesRecv = 0, nMessages = 0;
+    int64_t nHarnessCPU = 0;
+    int nDisconnected = 0;
+    BOOST_FOREACH(CSimPeer* ppeer, vPeers)
+    {
+        for (int kind = 0; kind < SIM_KINDS; kind++)
+        {
+            total[kind].nSent += ppeer->stats[kind].nSent;
+            total[kind].vLatency.insert(total[kind].vLatency.end(), ppeer->stats[kind].vLatency.begin(), ppeer->stats[kind].vLatency.end());
+            nMessages += ppeer->stats[kind].nSent;
+        }
+        nBytesSent += ppeer->nBytesSent;
+        nBytesRecv += ppeer->nBytesRecv;
+        nHarnessCPU += ppeer->nCPUMicros;
+        if (ppeer->fDisconnected)
+            nDisconnected++;
+        delete ppeer;
+    }
+
+    Object kinds;
+    for (int kind = 0; kind < SIM_KINDS; kind++)
+    {
+        if (total[kind].nSent == 0)
+            continue;
+        vector<int64_t>& vLatency = total[kind].vLatency;
+        sort(vLatency.begin(), vLatency.end());
+        int64_t nSum = 0;
+        BOOST_FOREACH(int64_t n, vLatency)
+            nSum += n;
+        Object entry;
+        entry.push_back(Pair("sent", (boost::int64_t)total[kind].nSent));
+        if (kind != SIM_TX)
+        {
+            entry.push_back(Pair("answered", (int)vLatency.size()));
+            entry.push_back(Pair("avgms", vLatency.empty() ? 0.0 : nSum / 1000.0 / vLatency.size()));
+            entry.push_back(Pair("p50ms", Percentile(vLatency, 0.5) / 1000.0));
+            entry.push_back(Pair("p90ms", Percentile(vLatency, 0.9) / 1000.0));
+            entry.push_back(Pair("p99ms", Percentile(vLatency, 0.99) / 1000.0));
+            entry.push_back(Pair("maxms", vLatency.empty() ? 0.0 : vLatency.back() / 1000.0));
+        }
+        kinds.push_back(Pair(pszSimKinds[kind], entry));
+    }
+
+    double dSeconds = max((int64_t)1, nTimeEnd - nTimeStart) / 1000000.0;
+    // The harness threads' own CPU is taken out where the kernel reports it
+    int64_t nNodeCPU = CSimPeer::CPUMicros(usageEnd) - CSimPeer::CPUMicros(usageStart) - nHarnessCPU;
+
+    Object result;
+    result.push_back(Pair("peers",           nPeers));
+    result.push_back(Pair("rate",            nRate));
+    result.push_back(Pair("msghandlers",     nMsgHandlers));
+    result.push_back(Pair("seconds",         dSeconds));
+    result.push_back(Pair("messages",        (boost::int64_t)nMessages));
+    result.push_back(Pair("messagespersec",  nMessages / dSeconds));
+    result.push_back(Pair("bytessent",       (boost::int64_t)nBytesSent));
+    result.push_back(Pair("bytesreceived",   (boost::int64_t)nBytesRecv));
+    result.push_back(Pair("disconnected",    nDisconnected));
+    result.push_back(Pair("nodecpuseconds",  nNodeCPU / 1000000.0));
+    result.push_back(Pair("cpuusecpermsg",   nMessages ? (double)nNodeCPU / nMessages : 0.0));
+    result.push_back(Pair("rssstart",        nRSSStart));
+    result.push_back(Pair("rssend",          nRSSEnd));
+    result.push_back(Pair("rssmax",          (boost::int64_t)usageEnd.ru_maxrss * 1024));
+    result.push_back(Pair("mempool",         (int)nMempool));
+    result.push_back(Pair("kinds",           kinds));
+    printf("%s\n", write_string(Value(result), true).c_str());
+    return 0;
+}
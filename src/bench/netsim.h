@@ -0,0 +1,31 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_NETSIM_H
+#define BITCOIN_BENCH_NETSIM_H
+
+/** bench_iocoin -netsim [-netsimpeers=<n>] [-netsimrate=<n>] [-netsimtime=<s>]
+ *                       [-netsimmix=<kind>:<weight>,...] [-netsimcmpct] [-msghandlers=<n>]
+ *
+ *  Load tests net.cpp and ProcessMessage() without real peers. Each of the
+ *  -netsimpeers peers is an inbound CNode on one end of a socketpair,
+ *  served by the node's own socket and message handler threads, with a
+ *  harness thread on the other end. After the version handshake the
+ *  harness thread sends -netsimrate messages a second for -netsimtime
+ *  seconds, picked by the -netsimmix weights from:
+ *
+ *    ping        answered with a pong
+ *    inv         a transaction the node doesn't have, answered with getdata
+ *    tx          a transaction spending unknown outputs, kept as an orphan
+ *    getdata     a block of the active chain, answered with it (or with a
+ *                cmpctblock when -netsimcmpct is given)
+ *    getheaders  the headers following a block of the active chain
+ *
+ *  Prints, as JSON, the messages sent, the latency of the answers by kind,
+ *  the CPU the node spent per message and its memory use. The block
+ *  requests pick from the chain in the data directory, so -datadir should
+ *  name a copy of a synced node's for them to mean much.
+ */
+int RunNetSim();
+
+#endif
@@ -0,0 +1,182 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "replay.h"
+
+#include "blockimport.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include "json/json_spirit_value.h"
+#include "json/json_spirit_writer_template.h"
+
+#include <boost/foreach.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+// Transactions and legacy sigops of the blocks fed while timing, until
+// they join the best chain (orphans may do so much later)
+typedef map<uint256, pair<unsigned int, unsigned int> > BlockCountMap;
+
+static void StartVerifyThreads()
+{
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+    {
+        NewThread(ThreadScriptCheck, NULL);
+        NewThread(ThreadBlockCheck, NULL);
+        NewThread(ThreadHeaderHash, NULL);
+    }
+}
+
+int RunBlockReplay()
+{
+    int nStart = GetArg("-replaystart", 1);
+    int nEnd = GetArg("-replayend", INT_MAX);
+    if (nStart < 1 || nEnd < nStart)
+    {
+        fprintf(stderr, "Error: need 1 <= -replaystart <= -replayend\n");
+        return 1;
+    }
+
+    StartVerifyThreads();
+    {
+        LOCK(cs_main);
+        if (!LoadBlockIndex(true))
+        {
+            fprintf(stderr, "Error: could not load the block index in %s\n", GetDataDir().string().c_str());
+            return 1;
+        }
+    }
+    fprintf(stderr, "Best height %d, replaying %d to %d\n", nBestHeight, nStart, nEnd);
+    if (nBestHeight >= nStart)
+    {
+        fprintf(stderr, "Error: the data directory is already past -replaystart\n");
+        return 1;
+    }
+
+    bool fTiming = false;
+    int64_t nTimeStart = 0, nTimeEnd = 0;
+    int nHeightStart = 0;
+    uint64_t nTxs = 0, nSigOps = 0;
+    BlockCountMap mapCounts;
+
+    BOOST_FOREACH(const string& strFile, mapMultiArgs["-replay"])
+    {
+        FILE* file = fopen(strFile.c_str(), "rb");
+        if (!file)
+        {
+            fprintf(stderr, "Error: cannot open %s\n", strFile.c_str());
+            return 1;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        fprintf(stderr, "Reading %s\n", strFile.c_str());
+        CBlockFileReader reader(file);
+        CBlock block;
+        while (nBestHeight < nEnd && reader.ReadNext(block))
+        {
+            // The clock starts with the first block past the start height,
+            // so only the replayed range is timed
+            if (!fTiming && nBestHeight >= nStart - 1)
+            {
+                fTiming = true;
+                nHeightStart = nBestHeight;
+                LOCK(cs_main);
+                blockConnectStats = CBlockConnectStats();
+                nTimeStart = GetTimeMicros();
+            }
+            uint256 hash = block.GetHash();
+            if (fTiming)
+            {
+                unsigned int nBlockSigOps = 0;
+                BOOST_FOREACH(const CTransaction& tx, block.vtx)
+                    nBlockSigOps += tx.GetLegacySigOpCount();
+                mapCounts[hash] = make_pair((unsigned int)block.vtx.size(), nBlockSigOps);
+            }
+
+            int nHeightBefore = nBestHeight;
+            {
+                LOCK(cs_main);
+                ProcessBlock(NULL, &block);
+            }
+            if (fTiming && nBestHeight > nHeightBefore)
+            {
+                for (CBlockIndex* pindex = pindexBest; pindex && pindex->nHeight > nHeightBefore; pindex = pindex->pprev)
+                {
+                    BlockCountMap::iterator mi = mapCounts.find(pindex->GetBlockHash());
+                    if (mi == mapCounts.end())
+                        continue;
+                    if (pindex->nHeight <= nEnd)
+                    {
+                        nTxs += mi->second.first;
+                        nSigOps += mi->second.second;
+                    }
+                    mapCounts.erase(mi);
+                }
+            }
+        }
+        fclose(file);
+        if (nBestHeight >= nEnd)
+            break;
+    }
+    nTimeEnd = GetTimeMicros();
+
+    if (!fTiming)
+    {
+        fprintf(stderr, "Error: the block files end at height %d, before -replaystart\n", nBestHeight);
+        return 1;
+    }
+
+    // Writing out the last of the txdb cache isn't part of the range
+    int64_t nTimeFlush = GetTimeMicros();
+    CTxDB::Flush();
+    nTimeFlush = GetTimeMicros() - nTimeFlush;
+
+    int nBlocks = min(nBestHeight, nEnd) - nHeightStart;
+    double dSeconds = max((int64_t)1, nTimeEnd - nTimeStart) / 1000000.0;
+
+    Object stages;
+    {
+        LOCK(cs_main);
+        for (int stage = 0; stage < BENCH_STAGES; stage++)
+        {
+            int64_t nCount = blockConnectStats.nCount[stage];
+            if (nCount == 0)
+                continue;
+            Object entry;
+            entry.push_back(Pair("count",   nCount));
+            entry.push_back(Pair("total",   blockConnectStats.nTotalMicros[stage]));
+            entry.push_back(Pair("average", blockConnectStats.nTotalMicros[stage] / nCount));
+            entry.push_back(Pair("max",     blockConnectStats.nMaxMicros[stage]));
+            entry.push_back(Pair("share",   blockConnectStats.nTotalMicros[stage] / (dSeconds * 1000000.0)));
+            stages.push_back(Pair(GetBlockConnectStageName(stage), entry));
+        }
+    }
+
+    Object result;
+    result.push_back(Pair("start",         nHeightStart + 1));
+    result.push_back(Pair("end",           min(nBestHeight, nEnd)));
+    result.push_back(Pair("blocks",        nBlocks));
+    result.push_back(Pair("txs",           (boost::int64_t)nTxs));
+    result.push_back(Pair("sigops",        (boost::int64_t)nSigOps));
+    result.push_back(Pair("seconds",       dSeconds));
+    result.push_back(Pair("blockspersec",  nBlocks / dSeconds));
+    result.push_back(Pair("txspersec",     nTxs / dSeconds));
+    result.push_back(Pair("sigopspersec",  nSigOps / dSeconds));
+    result.push_back(Pair("scriptthreads", nScriptCheckThreads));
+    result.push_back(Pair("flushseconds",  nTimeFlush / 1000000.0));
+    result.push_back(Pair("stages",        stages));
+    printf("%s\n", write_string(Value(result), true).c_str());
+    return 0;
+}
@@ -0,0 +1,19 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BENCH_REPLAY_H
+#define BITCOIN_BENCH_REPLAY_H
+
+/** bench_iocoin -replay=<file> [-replay=<file>...] [-replaystart=<h>] [-replayend=<h>]
+ *
+ *  Feeds the blocks of blkNNNN.dat or bootstrap.dat style files, in file
+ *  order, through ProcessBlock() as an import would. The blocks up to
+ *  -replaystart build the tx database; the ones from there to -replayend
+ *  are timed. With -datadir the replay continues from that data directory,
+ *  a copy of a node stopped below -replaystart, instead of from genesis in
+ *  a fresh one. Prints blocks, transactions and legacy sigops per second
+ *  and the ConnectBlock stage timings as JSON.
+ */
+int RunBlockReplay();
+
+#endif
@@ -0,0 +1,81 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "keystore.h"
+#include "main.h"
+#include "script.h"
+
+using namespace std;
+
+// A pay-to-pubkey-hash output and a transaction spending it
+static void MakeSpend(CKey& key, CTransaction& txFrom, CTransaction& txTo)
+{
+    CBasicKeyStore keystore;
+    key.MakeNewKey(true);
+    keystore.ak(key);
+
+    txFrom.vout.resize(1);
+    txFrom.vout[0].nValue = COIN;
+    txFrom.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+    txTo.vin.resize(1);
+    txTo.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = COIN;
+    txTo.vout[0].scriptPubKey = txFrom.vout[0].scriptPubKey;
+    bool fSigned = SignSignature(keystore, txFrom, txTo, 0);
+    assert(fSigned);
+}
+
+static void SolverP2PKH(CBenchState& state)
+{
+    CKey key;
+    CTransaction txFrom, txTo;
+    MakeSpend(key, txFrom, txTo);
+    txnouttype type;
+    vector<vector<unsigned char> > vSolutions;
+    while (state.KeepRunning())
+    {
+        bool fSolved = Solver(txFrom.vout[0].scriptPubKey, type, vSolutions);
+        assert(fSolved);
+    }
+}
+BENCHMARK(SolverP2PKH);
+
+// The whole scriptSig plus scriptPubKey, bypassing the signature cache
+static void VerifyScriptP2PKH(CBenchState& state)
+{
+    CKey key;
+    CTransaction txFrom, txTo;
+    MakeSpend(key, txFrom, txTo);
+    int flags = STANDARD_SCRIPT_VERIFY_FLAGS | SCRIPT_VERIFY_NOCACHE;
+    while (state.KeepRunning())
+    {
+        bool fValid = VerifyScript(txTo.vin[0].scriptSig, txFrom.vout[0].scriptPubKey, txTo, 0, flags, 0);
+        assert(fValid);
+    }
+}
+BENCHMARK(VerifyScriptP2PKH);
+
+// The interpreter alone on a script without signatures
+static void EvalScriptArithmetic(CBenchState& state)
+{
+    CTransaction txTo;
+    txTo.vin.resize(1);
+    txTo.vout.resize(1);
+    CScript script;
+    for (int i = 0; i < 50; i++)
+        script << OP_1 << OP_2 << OP_ADD << OP_3 << OP_EQUALVERIFY;
+    script << OP_TRUE;
+    vector<vector<unsigned char> > stack;
+    while (state.KeepRunning())
+    {
+        stack.clear();
+        bool fValid = EvalScript(stack, script, txTo, 0, SCRIPT_VERIFY_NONE, 0);
+        assert(fValid);
+    }
+}
+BENCHMARK(EvalScriptArithmetic);
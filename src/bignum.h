@@ -480,6 +480,24 @@ public:
         return ret;
     }
 
+    /**
+     * simultaneous modular exponentiation: (this^e1 * b^e2) mod m
+     * Both powers share one pass of squarings when m is odd.
+     * @param e1 exponent of this
+     * @param b second base
+     * @param e2 exponent of b
+     * @param m modulus
+     */
+    CBigNum mul_pow_mod(const CBigNum& e1, const CBigNum& b, const CBigNum& e2, const CBigNum& m) const {
+        if (e1 < 0 || e2 < 0 || !BN_is_odd(&m))
+            return pow_mod(e1, m).mul_mod(b.pow_mod(e2, m), m);
+        CAutoBN_CTX pctx;
+        CBigNum ret;
+        if (!BN_mod_exp2_mont(&ret, this, &e1, &b, &e2, &m, pctx, NULL))
+            throw bignum_error("CBigNum::mul_pow_mod : BN_mod_exp2_mont failed");
+        return ret;
+    }
+
     /**
     * Calculates the inverse of this element mod m.
     * i.e. i such this*i = 1 mod m
@@ -723,4 +741,62 @@ inline std::ostream& operator<<(std::ostream &strm, const CBigNum &b) { return s
 
 typedef  CBigNum Bignum;
 
+/** The Montgomery form of one fixed odd modulus. Build it once before a run
+ *  of exponentiations mod m instead of letting each pow_mod derive it again.
+ *  It is only read after construction, so threads may share one. */
+class CMontModulus
+{
+private:
+    CBigNum m;
+    BN_MONT_CTX* pmont;
+
+    CMontModulus(const CMontModulus&);
+    CMontModulus& operator=(const CMontModulus&);
+
+public:
+    explicit CMontModulus(const CBigNum& mIn) : m(mIn), pmont(NULL)
+    {
+        if (!BN_is_odd(&m))
+            throw bignum_error("CMontModulus : modulus is even");
+        CAutoBN_CTX pctx;
+        pmont = BN_MONT_CTX_new();
+        if (pmont == NULL || !BN_MONT_CTX_set(pmont, &m, pctx))
+        {
+            BN_MONT_CTX_free(pmont);
+            throw bignum_error("CMontModulus : BN_MONT_CTX_set failed");
+        }
+    }
+
+    ~CMontModulus()
+    {
+        BN_MONT_CTX_free(pmont);
+    }
+
+    const CBigNum& modulus() const { return m; }
+
+    /** base^e mod m, as base.pow_mod(e, m) */
+    CBigNum pow_mod(const CBigNum& base, const CBigNum& e) const
+    {
+        if (e < 0)
+            return pow_mod(base.inverse(m), e * -1);
+        CAutoBN_CTX pctx;
+        CBigNum ret;
+        if (!BN_mod_exp_mont(&ret, &base, &e, &m, pctx, pmont))
+            throw bignum_error("CMontModulus::pow_mod : BN_mod_exp_mont failed");
+        return ret;
+    }
+
+    /** (a^e1 * b^e2) mod m, as a.mul_pow_mod(e1, b, e2, m) */
+    CBigNum mul_pow_mod(const CBigNum& a, const CBigNum& e1, const CBigNum& b, const CBigNum& e2) const
+    {
+        if (e1 < 0 || e2 < 0)
+            return pow_mod(a, e1).mul_mod(pow_mod(b, e2), m);
+        CAutoBN_CTX pctx;
+        CBigNum ret;
+        if (!BN_mod_exp2_mont(&ret, &a, &e1, &b, &e2, &m, pctx, pmont))
+            throw bignum_error("CMontModulus::mul_pow_mod : BN_mod_exp2_mont failed");
+        return ret;
+    }
+};
+
 #endif
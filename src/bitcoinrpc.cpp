@@ -9,7 +9,9 @@
 #include "ui_interface.h"
 #include "base58.h"
 #include "bitcoinrpc.h"
+#include "rpcjson.h"
 #include "db.h"
+#include "metrics.h"
 
 #undef printf
 #include <boost/asio.hpp>
@@ -229,22 +231,43 @@ static const CRPCCommand vRPCCommands[] =
   //  ------------------------  -----------------------  ------  --------
     { "help",                   &help,                   true,   true },
     { "stop",                   &stop,                   true,   true },
-    { "getbestblockhash",       &getbestblockhash,       true,   false },
-    { "getblockcount",          &getblockcount,          true,   false },
+    { "getbestblockhash",       &getbestblockhash,       true,   true },
+    { "getblockcount",          &getblockcount,          true,   true },
     { "getpowblocks",           &getpowblocks,           true,   false },
     { "getpowblocksleft",       &getpowblocksleft,       true,   false },
+    { "getblockstats",          &getblockstats,          true,   false },
+    { "getchainstats",          &getchainstats,          true,   false },
     { "getpowtimeleft",         &getpowtimeleft,         true,   false },
     { "getconnectioncount",     &getconnectioncount,     true,   false },
     { "getnumblocksofpeers",    &getnumblocksofpeers,    true,   false },
     { "getpeerinfo",            &getpeerinfo,            true,   false },
-    { "getdifficulty",          &getdifficulty,          true,   false },
+    { "getnetworkinfo",         &getnetworkinfo,         true,   false },
+    { "getdifficulty",          &getdifficulty,          true,   true },
+    { "getdbcacheinfo",         &getdbcacheinfo,         true,   false },
+    { "getdbstats",             &getdbstats,             true,   false },
+    { "getleveldbinfo",         &getleveldbinfo,         true,   true },
+    { "compactdb",              &compactdb,              true,   true },
+    { "getmemoryinfo",          &getmemoryinfo,          true,   false },
+    { "getthreadinfo",          &getthreadinfo,          true,   true },
+    { "getrpcinfo",             &getrpcinfo,             true,   true },
+    { "getrpcstats",            &getrpcstats,            true,   true },
+    { "getimportinfo",          &getimportinfo,          true,   false },
+    { "dumpsnapshot",           &dumpsnapshot,           true,   false },
+    { "getsnapshotinfo",        &getsnapshotinfo,        true,   true },
+    { "getlockstats",           &getlockstats,           true,   true },
+    { "setlockstats",           &setlockstats,           true,   true },
+    { "getorphanblockinfo",     &getorphanblockinfo,     true,   false },
+    { "getblockconnectstats",   &getblockconnectstats,   true,   false },
+    { "benchdions",             &benchdions,             true,   false },
     { "gw1",          &gw1,          true,   false },
     { "getnetworkmhashps",      &getnetworkmhashps,      true,   false },
-    { "getinfo",                &getinfo,                true,   false },
+    { "getinfo",                &getinfo,                true,   true },
+    { "getwalletinfo",          &getwalletinfo,          true,   false },
     { "getsubsidy",             &getsubsidy,             true,   false },
-    { "getmininginfo",          &getmininginfo,          true,   false },
+    { "getmininginfo",          &getmininginfo,          true,   true },
     { "center__base__0",          &center__base__0,          true,   false },
-    { "getstakinginfo",         &getstakinginfo,         true,   false },
+    { "getstakinginfo",         &getstakinginfo,         true,   true },
+    { "simulatestake",          &simulatestake,          true,   true },
     { "getnewaddress",          &getnewaddress,          true,   false },
     { "sectionlog",          &sectionlog,          true,   false },
     { "xtu_url",   &xtu_url,   false,  false },
@@ -280,18 +303,21 @@ static const CRPCCommand vRPCCommands[] =
     { "validateLocator",        &validateLocator,        true,   false },
     { "validatepubkey",         &validatepubkey,         true,   false },
     { "pending",             &pending,             false,  false },
-    { "getbalance",             &getbalance,             false,  false },
+    { "getbalance",             &getbalance,             false,  true },
     { "move",                   &movecmd,                false,  false },
     { "sublimateYdwi",     &sublimateYdwi,     false,  false },
     { "sendfrom",               &sendfrom,               false,  false },
     { "sendmany",               &sendmany,               false,  false },
+    { "sendbatch",              &sendbatch,              false,  false },
     { "addmultisigaddress",     &addmultisigaddress,     false,  false },
     { "addredeemscript",        &addredeemscript,        false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   true },
+    { "estimatefee",            &estimatefee,            true,   true },
     { "gettxout",               &gettxout,          true,   false },
-    { "getblock",               &getblock,               false,  false },
-    { "getblockbynumber",       &getblockbynumber,       false,  false },
-    { "getblockhash",           &getblockhash,           false,  false },
+    { "getblock",               &getblock,               false,  true },
+    { "getblockbynumber",       &getblockbynumber,       false,  true },
+    { "getblockhash",           &getblockhash,           false,  true },
     { "gettransaction",         &gettransaction,         false,  false },
     { "listtransactions",       &listtransactions,       false,  false },
     { "listtransactions__",       &listtransactions__,       false,  false },
@@ -302,20 +328,29 @@ static const CRPCCommand vRPCCommands[] =
     { "tmpTest",                &tmpTest,                true,   false },
     { "getworkex",              &getworkex,              true,   false },
     { "listaccounts",           &listaccounts,           false,  false },
+    { "listwallets",            &listwallets,            true,   true },
     { "settxfee",               &settxfee,               false,  false },
-    { "getblocktemplate",       &getblocktemplate,       true,   false },
+    { "getblocktemplate",       &getblocktemplate,       true,   true },
     { "submitblock",            &submitblock,            false,  false },
     { "listsinceblock",         &listsinceblock,         false,  false },
     { "dumpprivkey",            &dumpprivkey,            false,  false },
     { "dumpwalletRT",             &dumpwalletRT,             true,   false },
-    { "dumpwallet",             &dumpwallet,             true,   false },
+    { "dumpwallet",             &dumpwallet,             true,   true },
     { "importwalletRT",           &importwalletRT,           false,  false },
-    { "importwallet",           &importwallet,           false,  false },
+    { "importwallet",           &importwallet,           false,  true },
     { "crawgen",                &crawgen,   false,  false },
     { "rmtx",                   &rmtx,   false,  false },
-    { "importprivkey",          &importprivkey,          false,  false },
+    { "importprivkey",          &importprivkey,          false,  true },
+    { "abortrescan",            &abortrescan,            true,   true },
+    { "startjob",               &startjob,               false,  true },
+    { "getjob",                 &getjob,                 true,   true },
+    { "listjobs",               &listjobs,               true,   true },
+    { "canceljob",              &canceljob,              true,   true },
     { "listunspent",            &listunspent,            false,  false },
-    { "getrawtransaction",      &getrawtransaction,      false,  false },
+    { "getrawtransaction",      &getrawtransaction,      false,  true },
+    { "getaddressbalance",      &getaddressbalance,      false,  true },
+    { "getaddresstxids",        &getaddresstxids,        false,  true },
+    { "getaddressutxos",        &getaddressutxos,        false,  true },
     { "trcbase",          &trcbase,          false,  false },
     { "createrawtransaction",   &createrawtransaction,   false,  false },
     { "trc",           &trc,           false,  false },
@@ -326,6 +361,7 @@ static const CRPCCommand vRPCCommands[] =
     { "sendPlainMessage",     &sendPlainMessage,     false,  false },
     { "vtx",     &vtx,     false,  false },
     { "sendMessage",     &sendMessage,     false,  false },
+    { "sendBatch",     &sendBatch,     false,  false },
     { "publicKey",     &publicKey,     false,  false },
     { "sendPublicKey",     &sendPublicKey,     false,  false },
     { "sendSymmetric",     &sendSymmetric,     false,  false },
@@ -377,6 +413,7 @@ static const CRPCCommand vRPCCommands[] =
     { "sendrawtransaction",     &sendrawtransaction,     false,  false },
     { "getcheckpoint",          &getcheckpoint,          true,   false },
     { "reservebalance",         &reservebalance,         false,  true},
+    { "getcompactioninfo",      &getcompactioninfo,      true,   false },
     { "checkwallet",            &checkwallet,            false,  true},
     { "repairwallet",           &repairwallet,           false,  true},
     { "resendtx",               &resendtx,               false,  true},
@@ -426,10 +463,10 @@ const json_spirit::Value CRPCTable::operator()() const
 // and to be compatible with other JSON-RPC implementations.
 //
 
-string HTTPPost(const string& strMsg, const map<string,string>& mapRequestHeaders)
+string HTTPPost(const string& strMsg, const map<string,string>& mapRequestHeaders, const string& strPath)
 {
     ostringstream s;
-    s << "POST / HTTP/1.1\r\n"
+    s << "POST " << strPath << " HTTP/1.1\r\n"
       << "User-Agent: iocoin-json-rpc/" << FormatFullVersion() << "\r\n"
       << "Host: 127.0.0.1\r\n"
       << "Content-Type: application/json\r\n"
@@ -456,6 +493,17 @@ string rfc1123Time()
     return string(buffer);
 }
 
+static const char* HTTPStatusText(int nStatus)
+{
+    if (nStatus == HTTP_OK) return "OK";
+    if (nStatus == HTTP_BAD_REQUEST) return "Bad Request";
+    if (nStatus == HTTP_FORBIDDEN) return "Forbidden";
+    if (nStatus == HTTP_NOT_FOUND) return "Not Found";
+    if (nStatus == HTTP_INTERNAL_SERVER_ERROR) return "Internal Server Error";
+    if (nStatus == HTTP_SERVICE_UNAVAILABLE) return "Service Unavailable";
+    return "";
+}
+
 static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
@@ -475,13 +523,6 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "</HEAD>\r\n"
             "<BODY><H1>401 Unauthorized.</H1></BODY>\r\n"
             "</HTML>\r\n", rfc1123Time().c_str(), FormatFullVersion().c_str());
-    const char *cStatus;
-         if (nStatus == HTTP_OK) cStatus = "OK";
-    else if (nStatus == HTTP_BAD_REQUEST) cStatus = "Bad Request";
-    else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
-    else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
-    else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
-    else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
             "Date: %s\r\n"
@@ -492,7 +533,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "\r\n"
             "%s",
         nStatus,
-        cStatus,
+        HTTPStatusText(nStatus),
         rfc1123Time().c_str(),
         keepalive ? "keep-alive" : "close",
         strMsg.size(),
@@ -500,7 +541,29 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         strMsg.c_str());
 }
 
-int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
+// Reply with an arbitrary body, which for REST may be binary and hold NULs
+static void HTTPReplyRaw(std::ostream& stream, int nStatus, const string& strContentType, const string& strBody, bool keepalive)
+{
+    stream << strprintf(
+            "HTTP/1.1 %d %s\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Content-Length: %"PRIszu"\r\n"
+            "Content-Type: %s\r\n"
+            "Server: iocoin-json-rpc/%s\r\n"
+            "\r\n",
+        nStatus,
+        HTTPStatusText(nStatus),
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        strBody.size(),
+        strContentType.c_str(),
+        FormatFullVersion().c_str());
+    stream.write(strBody.data(), strBody.size());
+    stream << std::flush;
+}
+
+int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto, string* pstrURI = NULL)
 {
     string str;
     getline(stream, str);
@@ -508,6 +571,9 @@ int ReadHTTPStatus(std::basic_istream<char>& stream, int &proto)
     boost::split(vWords, str, boost::is_any_of(" "));
     if (vWords.size() < 2)
         return HTTP_INTERNAL_SERVER_ERROR;
+    // On a request line the second word is the URI rather than a status
+    if (pstrURI)
+        *pstrURI = vWords[1];
     proto = 0;
     const char *ver = strstr(str.c_str(), "HTTP/1.");
     if (ver != NULL)
@@ -540,14 +606,41 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
-int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
+// Body of a reply sent with chunked transfer encoding
+static bool ReadHTTPChunked(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    while (true)
+    {
+        string str;
+        std::getline(stream, str);
+        if (!stream)
+            return false;
+        unsigned int nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (strMessageRet.size() + nChunk > MAX_SIZE)
+            return false;
+        size_t nOld = strMessageRet.size();
+        strMessageRet.resize(nOld + nChunk);
+        stream.read(&strMessageRet[nOld], nChunk);
+        std::getline(stream, str);
+    }
+    // Trailers, up to the blank line
+    map<string, string> mapTrailers;
+    ReadHTTPHeader(stream, mapTrailers);
+    return true;
+}
+
+int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet, string* pstrURI = NULL, int* pnProto = NULL)
 {
     mapHeadersRet.clear();
     strMessageRet = "";
 
     // Read status
     int nProto = 0;
-    int nStatus = ReadHTTPStatus(stream, nProto);
+    int nStatus = ReadHTTPStatus(stream, nProto, pstrURI);
+    if (pnProto)
+        *pnProto = nProto;
 
     // Read header
     int nLen = ReadHTTPHeader(stream, mapHeadersRet);
@@ -555,7 +648,12 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (mapHeadersRet["transfer-encoding"] == "chunked")
+    {
+        if (!ReadHTTPChunked(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -601,7 +699,7 @@ string JSONRPCRequest(const string& strMethod, const Array& params, const Value&
     request.push_back(Pair("method", strMethod));
     request.push_back(Pair("params", params));
     request.push_back(Pair("id", id));
-    return write_string(Value(request), false) + "\n";
+    return WriteJSON(Value(request)) + "\n";
 }
 
 Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
@@ -616,10 +714,112 @@ Object JSONRPCReplyObj(const Value& result, const Value& error, const Value& id)
     return reply;
 }
 
+// The text of JSONRPCReplyObj, without copying result into it first
 string JSONRPCReply(const Value& result, const Value& error, const Value& id)
 {
-    Object reply = JSONRPCReplyObj(result, error, id);
-    return write_string(Value(reply), false) + "\n";
+    string strReply = "{\"result\":";
+    strReply += WriteJSON(error.type() != null_type ? Value::null : result);
+    strReply += ",\"error\":";
+    strReply += WriteJSON(error);
+    strReply += ",\"id\":";
+    strReply += WriteJSON(id);
+    strReply += "}\n";
+    return strReply;
+}
+
+static const unsigned int DEFAULT_RPC_STREAM_THRESHOLD = 1000;
+static const unsigned int RPC_STREAM_CHUNK_SIZE = 64 * 1024;
+
+/** Stream buffer that frames what is written through it as HTTP/1.1 chunks
+ *  of at most RPC_STREAM_CHUNK_SIZE bytes. Finish() writes the last chunk.
+ */
+class CChunkedStreamBuf : public std::streambuf
+{
+public:
+    explicit CChunkedStreamBuf(std::ostream& streamIn) : stream(streamIn), vBuf(RPC_STREAM_CHUNK_SIZE)
+    {
+        setp(&vBuf[0], &vBuf[0] + vBuf.size());
+    }
+
+    void Finish()
+    {
+        WriteChunk();
+        stream << "0\r\n\r\n" << std::flush;
+    }
+
+protected:
+    int overflow(int c)
+    {
+        WriteChunk();
+        if (c != traits_type::eof())
+        {
+            *pptr() = (char)c;
+            pbump(1);
+        }
+        return stream ? 0 : traits_type::eof();
+    }
+
+    int sync()
+    {
+        WriteChunk();
+        return stream ? 0 : -1;
+    }
+
+private:
+    void WriteChunk()
+    {
+        std::ptrdiff_t n = pptr() - pbase();
+        if (n <= 0)
+            return;
+        stream << strprintf("%x\r\n", (unsigned int)n);
+        stream.write(pbase(), n);
+        stream << "\r\n";
+        setp(&vBuf[0], &vBuf[0] + vBuf.size());
+    }
+
+    std::ostream& stream;
+    std::vector<char> vBuf;
+};
+
+// Worth streaming: an array or object with at least -rpcstreamthreshold entries
+static bool IsLargeResult(const Value& result)
+{
+    unsigned int nThreshold = GetArg("-rpcstreamthreshold", DEFAULT_RPC_STREAM_THRESHOLD);
+    if (nThreshold == 0)
+        return false;
+    if (result.type() == array_type)
+        return result.get_array().size() >= nThreshold;
+    if (result.type() == obj_type)
+        return result.get_obj().size() >= nThreshold;
+    return false;
+}
+
+// Send a successful reply with chunked transfer encoding, serializing
+// result straight onto the connection instead of into a string first
+static void HTTPReplyChunked(std::ostream& stream, const Value& result, const Value& id, bool keepalive)
+{
+    stream << strprintf(
+            "HTTP/1.1 %d OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "Transfer-Encoding: chunked\r\n"
+            "Content-Type: application/json\r\n"
+            "Server: iocoin-json-rpc/%s\r\n"
+            "\r\n",
+        HTTP_OK,
+        rfc1123Time().c_str(),
+        keepalive ? "keep-alive" : "close",
+        FormatFullVersion().c_str());
+
+    CChunkedStreamBuf buf(stream);
+    std::ostream os(&buf);
+    os << "{\"result\":";
+    WriteJSON(result, os);
+    os << ",\"error\":null,\"id\":";
+    WriteJSON(id, os);
+    os << "}\n";
+    os.flush();
+    buf.Finish();
 }
 
 void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
@@ -628,7 +828,7 @@ void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
-    else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
+    else if (code == RPC_METHOD_NOT_FOUND || code == RPC_WALLET_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
     stream << HTTPReply(nStatus, strReply, false) << std::flush;
 }
@@ -717,6 +917,10 @@ public:
     virtual std::iostream& stream() = 0;
     virtual std::string peer_address_to_string() const = 0;
     virtual void close() = 0;
+    // Call handler on the listener's io_service once the peer sends more
+    virtual void async_wait_readable(const boost::function<void (const boost::system::error_code&)>& handler) = 0;
+    // Have a pending async_wait_readable() call its handler with an error
+    virtual void cancel() = 0;
 };
 
 template <typename Protocol>
@@ -748,6 +952,17 @@ public:
         _stream.close();
     }
 
+    virtual void async_wait_readable(const boost::function<void (const boost::system::error_code&)>& handler)
+    {
+        sslStream.lowest_layer().async_read_some(asio::null_buffers(), handler);
+    }
+
+    virtual void cancel()
+    {
+        boost::system::error_code ec;
+        sslStream.lowest_layer().cancel(ec);
+    }
+
     typename Protocol::endpoint peer;
     asio::ssl::stream<typename Protocol::socket> sslStream;
 
@@ -777,6 +992,186 @@ void ThreadRPCServer(void* parg)
     printf("ThreadRPCServer exited\n");
 }
 
+static const int DEFAULT_RPC_THREADS = 4;
+static const int DEFAULT_RPC_QUEUE = 64;
+
+// Connections with a request ready, waiting for a worker
+static boost::mutex mutexRPCQueue;
+static boost::condition_variable condRPCQueue;
+static deque<AcceptedConnection*> dequeRPCQueue;
+static unsigned int nRPCQueueLimit = DEFAULT_RPC_QUEUE;
+static int nRPCWorkers = 0;
+// Backpressure counters for getrpcinfo, under mutexRPCQueue
+static uint64_t nRPCQueued = 0;
+static uint64_t nRPCRejected = 0;
+static uint64_t nRPCRequests = 0;
+static unsigned int nRPCQueuePeak = 0;
+
+/** Cumulative figures for one RPC method, in microseconds. The histogram
+ *  covers execution time only, bucketed as for getblockconnectstats. */
+struct CRPCMethodStats
+{
+    int64_t nCalls;
+    int64_t nErrors;
+    int64_t nLockMicros;
+    int64_t nExecMicros;
+    int64_t nMaxExecMicros;
+    int64_t nBuckets[BENCH_BUCKETS];
+
+    CRPCMethodStats() : nCalls(0), nErrors(0), nLockMicros(0), nExecMicros(0), nMaxExecMicros(0)
+    {
+        memset(nBuckets, 0, sizeof(nBuckets));
+    }
+};
+
+// Only methods in the table get an entry, so a client can't grow the map
+static boost::mutex mutexRPCStats;
+static map<string, CRPCMethodStats> mapRPCStats;
+
+// Times one call through CRPCTable::execute and records it on the way out,
+// whether the method returned or threw
+class CRPCCallTimer
+{
+private:
+    const string& strMethod;
+    int64_t nStart;
+    int64_t nLockMicros;
+
+public:
+    bool fError;
+
+    CRPCCallTimer(const string& strMethodIn) : strMethod(strMethodIn), nStart(GetTimeMicros()), nLockMicros(0), fError(true) {}
+
+    void Locked()
+    {
+        nLockMicros = GetTimeMicros() - nStart;
+    }
+
+    ~CRPCCallTimer()
+    {
+        int64_t nExecMicros = max((int64_t)0, GetTimeMicros() - nStart - nLockMicros);
+        int nBucket = 0;
+        while (nBucket < BENCH_BUCKETS - 1 && (nExecMicros >> nBucket) > 1)
+            nBucket++;
+
+        boost::unique_lock<boost::mutex> lock(mutexRPCStats);
+        CRPCMethodStats& stats = mapRPCStats[strMethod];
+        stats.nCalls++;
+        if (fError)
+            stats.nErrors++;
+        stats.nLockMicros += nLockMicros;
+        stats.nExecMicros += nExecMicros;
+        stats.nMaxExecMicros = max(stats.nMaxExecMicros, nExecMicros);
+        stats.nBuckets[nBucket]++;
+    }
+};
+
+// Per-method counters in the Prometheus text exposition format, for /metrics
+static string RPCMetricsText()
+{
+    string str;
+    str += "# HELP iocoin_rpc_calls_total RPC calls by method.\n";
+    str += "# TYPE iocoin_rpc_calls_total counter\n";
+    str += "# HELP iocoin_rpc_errors_total RPC calls that returned an error, by method.\n";
+    str += "# TYPE iocoin_rpc_errors_total counter\n";
+    str += "# HELP iocoin_rpc_lock_wait_seconds_total Time spent waiting for cs_main and the wallet lock, by method.\n";
+    str += "# TYPE iocoin_rpc_lock_wait_seconds_total counter\n";
+    str += "# HELP iocoin_rpc_duration_seconds Execution time of RPC calls, by method.\n";
+    str += "# TYPE iocoin_rpc_duration_seconds histogram\n";
+
+    boost::unique_lock<boost::mutex> lock(mutexRPCStats);
+    for (map<string, CRPCMethodStats>::const_iterator it = mapRPCStats.begin(); it != mapRPCStats.end(); ++it)
+    {
+        const string strLabel = "method=\"" + it->first + "\"";
+        const CRPCMethodStats& stats = it->second;
+        str += strprintf("iocoin_rpc_calls_total{%s} %"PRId64"\n", strLabel.c_str(), stats.nCalls);
+        str += strprintf("iocoin_rpc_errors_total{%s} %"PRId64"\n", strLabel.c_str(), stats.nErrors);
+        str += strprintf("iocoin_rpc_lock_wait_seconds_total{%s} %.6f\n", strLabel.c_str(), stats.nLockMicros / 1e6);
+        int64_t nCumulative = 0;
+        for (int i = 0; i < BENCH_BUCKETS - 1; i++)
+        {
+            nCumulative += stats.nBuckets[i];
+            str += strprintf("iocoin_rpc_duration_seconds_bucket{%s,le=\"%.6f\"} %"PRId64"\n", strLabel.c_str(), ((int64_t)2 << i) / 1e6, nCumulative);
+        }
+        str += strprintf("iocoin_rpc_duration_seconds_bucket{%s,le=\"+Inf\"} %"PRId64"\n", strLabel.c_str(), stats.nCalls);
+        str += strprintf("iocoin_rpc_duration_seconds_sum{%s} %.6f\n", strLabel.c_str(), stats.nExecMicros / 1e6);
+        str += strprintf("iocoin_rpc_duration_seconds_count{%s} %"PRId64"\n", strLabel.c_str(), stats.nCalls);
+    }
+    return str;
+}
+
+// Hand a connection to the workers, or turn it away when the queue is full
+static void QueueRPCConnection(AcceptedConnection* conn, bool fUseSSL)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+        if (dequeRPCQueue.size() < nRPCQueueLimit)
+        {
+            dequeRPCQueue.push_back(conn);
+            nRPCQueuePeak = std::max(nRPCQueuePeak, (unsigned int)dequeRPCQueue.size());
+            nRPCQueued++;
+            condRPCQueue.notify_one();
+            return;
+        }
+        nRPCRejected++;
+    }
+    printf("RPC work queue full, dropping connection from %s\n", conn->peer_address_to_string().c_str());
+    // As for 403, stay quiet rather than start an SSL handshake
+    if (!fUseSSL)
+        conn->stream() << HTTPReply(HTTP_SERVICE_UNAVAILABLE, "", false) << std::flush;
+    conn->close();
+    delete conn;
+}
+
+// Connections waiting with the listener's io_service for their client to
+// send a request; once the listener stops, none are parked any more
+static boost::mutex mutexRPCParked;
+static set<AcceptedConnection*> setRPCParked;
+static bool fRPCParkClosed = false;
+
+// The connection has a request, or was closed by the client or the listener
+static void RPCConnectionReadable(AcceptedConnection* conn, bool fUseSSL, const boost::system::error_code& error)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCParked);
+        setRPCParked.erase(conn);
+    }
+    if (error || fShutdown)
+    {
+        conn->close();
+        delete conn;
+        return;
+    }
+    QueueRPCConnection(conn, fUseSSL);
+}
+
+// Wait for conn to send a request without holding a worker, so neither
+// a new connection nor an idle keep-alive one ties one up
+static void ParkRPCConnection(AcceptedConnection* conn, bool fUseSSL)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCParked);
+        if (!fRPCParkClosed)
+        {
+            setRPCParked.insert(conn);
+            conn->async_wait_readable(boost::bind(&RPCConnectionReadable, conn, fUseSSL, _1));
+            return;
+        }
+    }
+    conn->close();
+    delete conn;
+}
+
+// Cancel the parked connections' waits; running the io_service once more
+// then closes and deletes them
+static void CancelParkedRPCConnections()
+{
+    boost::unique_lock<boost::mutex> lock(mutexRPCParked);
+    fRPCParkClosed = true;
+    BOOST_FOREACH(AcceptedConnection* conn, setRPCParked)
+        conn->cancel();
+}
+
 // Forward declaration required for RPCListen
 template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
@@ -844,11 +1239,9 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
         delete conn;
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // hand it to the RPC workers once its request arrives
+    else
+        ParkRPCConnection(conn, fUseSSL);
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
@@ -977,11 +1370,29 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // A fixed pool of workers serves every connection
+    nRPCQueueLimit = std::max((int)GetArg("-rpcqueue", DEFAULT_RPC_QUEUE), 1);
+    int nThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    for (int i = 0; i < nThreads; i++)
+    {
+        if (!NewThread(ThreadRPCServer3, NULL, THREADPOOL_RPC))
+            printf("Error: NewThread(ThreadRPCServer3) failed\n");
+        else
+        {
+            boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+            nRPCWorkers++;
+        }
+    }
+    printf("ThreadRPCServer using %d worker threads\n", nRPCWorkers);
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+    CancelParkedRPCConnections();
+    io_service.reset();
+    io_service.poll();
 }
 
 class JSONRequest
@@ -1047,17 +1458,206 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
+// Batch elements for commands that take no global locks may run
+// alongside each other
+static bool IsParallelRequest(const Value& req)
+{
+    if (req.type() != obj_type)
+        return false;
+    const Value& valMethod = find_value(req.get_obj(), "method");
+    if (valMethod.type() != str_type)
+        return false;
+    const CRPCCommand *pcmd = tableRPC[valMethod.get_str()];
+    return pcmd && pcmd->unlocked;
+}
+
+// Claim requests of vReq below nEnd one at a time until none are left
+static void JSONRPCExecClaim(const Array* pvReq, Array* pvRet, unsigned int* pnNext, unsigned int nEnd,
+                             boost::mutex* pmutex)
+{
+    while (true)
+    {
+        unsigned int reqIdx;
+        {
+            boost::unique_lock<boost::mutex> lock(*pmutex);
+            if (*pnNext >= nEnd)
+                return;
+            reqIdx = (*pnNext)++;
+        }
+        try {
+            (*pvRet)[reqIdx] = JSONRPCExecOne((*pvReq)[reqIdx]);
+        }
+        catch (...) {
+            (*pvRet)[reqIdx] = JSONRPCReplyObj(Value::null, JSONRPCError(RPC_MISC_ERROR, "Unknown exception"), Value::null);
+        }
+    }
+}
+
+// Helper threads act on the wallet of the thread serving the batch
+static void JSONRPCExecHelper(const Array* pvReq, Array* pvRet, unsigned int* pnNext, unsigned int nEnd,
+                              boost::mutex* pmutex, __wx__* pwallet)
+{
+    RenameThread("iocoin-rpcbatch");
+    CRPCWalletScope walletScope(pwallet);
+    JSONRPCExecClaim(pvReq, pvRet, pnNext, nEnd, pmutex);
+}
+
 static string JSONRPCExecBatch(const Array& vReq)
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+    Array ret(vReq.size());
+    const int nThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    __wx__* pwallet = pwalletMain;
+
+    unsigned int reqIdx = 0;
+    while (reqIdx < vReq.size())
+    {
+        // Requests that take cs_main/cs_wallet run alone and in order
+        if (!IsParallelRequest(vReq[reqIdx]))
+        {
+            ret[reqIdx] = JSONRPCExecOne(vReq[reqIdx]);
+            reqIdx++;
+            continue;
+        }
 
-    return write_string(Value(ret), false) + "\n";
+        // so do the unlocked ones between them, but spread over up to
+        // -rpcthreads threads, this one included
+        unsigned int nEnd = reqIdx + 1;
+        while (nEnd < vReq.size() && IsParallelRequest(vReq[nEnd]))
+            nEnd++;
+
+        boost::mutex mutexNext;
+        unsigned int nNext = reqIdx;
+        boost::thread_group threadGroup;
+        int nHelpers = std::min(nThreads, (int)(nEnd - reqIdx)) - 1;
+        for (int i = 0; i < nHelpers; i++)
+            threadGroup.create_thread(boost::bind(&JSONRPCExecHelper, &vReq, &ret, &nNext, nEnd, &mutexNext, pwallet));
+        JSONRPCExecClaim(&vReq, &ret, &nNext, nEnd, &mutexNext);
+        threadGroup.join_all();
+
+        reqIdx = nEnd;
+    }
+
+    return WriteJSON(Value(ret)) + "\n";
+}
+
+// Read one request from conn and send its reply. Returns false once the
+// connection is to be closed.
+static bool ServiceRPCRequest(AcceptedConnection* conn)
+{
+    map<string, string> mapHeaders;
+    string strRequest;
+    string strURI;
+    int nProto = 0;
+
+    ReadHTTP(conn->stream(), mapHeaders, strRequest, &strURI, &nProto);
+    // A keep-alive client that hung up
+    if (!conn->stream())
+        return false;
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+        nRPCRequests++;
+    }
+
+    // Public chain data under /rest/, served without credentials when enabled
+    if (GetBoolArg("-rest") && boost::algorithm::starts_with(strURI, "/rest/"))
+    {
+        bool fRun = mapHeaders["connection"] != "close";
+        string strContentType, strBody;
+        int nStatus = HTTPReq_REST(strURI.substr(5), strContentType, strBody);
+        HTTPReplyRaw(conn->stream(), nStatus, strContentType, strBody, fRun);
+        return fRun;
+    }
+
+    // Check authorization
+    if (mapHeaders.count("authorization") == 0)
+    {
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    if (!HTTPAuthorized(mapHeaders))
+    {
+        printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
+        /* Deter brute-forcing short passwords.
+           If this results in a DOS the user really
+           shouldn't have their RPC port exposed.*/
+        if (mapArgs["-rpcpassword"].size() < 20)
+            MilliSleep(250);
+
+        conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
+        return false;
+    }
+    bool fRun = mapHeaders["connection"] != "close";
+
+    if (strURI == "/metrics" && GetBoolArg("-rpcmetrics"))
+    {
+        HTTPReplyRaw(conn->stream(), HTTP_OK, "text/plain; version=0.0.4", GetMetricsText() + RPCMetricsText(), fRun);
+        return fRun;
+    }
+
+    JSONRequest jreq;
+    try
+    {
+        // Requests for /wallet/<file> act on that wallet instead of the default one
+        __wx__* pwallet = pwalletMain;
+        if (boost::algorithm::starts_with(strURI, "/wallet/"))
+        {
+            pwallet = FindWallet(strURI.substr(8));
+            if (!pwallet)
+                throw JSONRPCError(RPC_WALLET_NOT_FOUND, "Requested wallet is not loaded");
+        }
+        CRPCWalletScope walletScope(pwallet);
+
+        // Parse request
+        Value valRequest;
+        if (!ReadJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        string strReply;
+
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+
+            // Large results go out as they are serialized, to HTTP/1.1 clients
+            if (nProto >= 1 && IsLargeResult(result))
+            {
+                HTTPReplyChunked(conn->stream(), result, jreq.id, fRun);
+                return fRun;
+            }
+
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+    }
+    catch (Object& objError)
+    {
+        ErrorReply(conn->stream(), objError, jreq.id);
+        return false;
+    }
+    catch (std::exception& e)
+    {
+        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+    return fRun;
 }
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
+// One of -rpcthreads workers. A worker serves a connection for as long as
+// requests are already buffered on it, then parks it with the listener's
+// io_service until the client sends the next one, so idle keep-alive
+// connections don't tie up a worker.
 void ThreadRPCServer3(void* parg)
 {
     // Make this thread recognisable as the RPC handler
@@ -1067,93 +1667,111 @@ void ThreadRPCServer3(void* parg)
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]++;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
+    const bool fUseSSL = GetBoolArg("-rpcssl");
 
-    bool fRun = true;
-    while (true)
+    while (!fShutdown)
     {
-        if (fShutdown || !fRun)
+        AcceptedConnection* conn = NULL;
         {
-            conn->close();
-            delete conn;
+            boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+            if (dequeRPCQueue.empty())
             {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
+                // Let StopNode see us as idle while we wait
+                {
+                    LOCK(cs_THREAD_RPCHANDLER);
+                    vnThreadsRunning[THREAD_RPCHANDLER]--;
+                }
+                condRPCQueue.timed_wait(lock, boost::posix_time::milliseconds(500));
+                {
+                    LOCK(cs_THREAD_RPCHANDLER);
+                    vnThreadsRunning[THREAD_RPCHANDLER]++;
+                }
             }
-            return;
+            if (dequeRPCQueue.empty() || fShutdown)
+                continue;
+            conn = dequeRPCQueue.front();
+            dequeRPCQueue.pop_front();
         }
-        map<string, string> mapHeaders;
-        string strRequest;
-
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
-
-        JSONRequest jreq;
         try
         {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-            string strReply;
-
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
-
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
-
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
+            bool fKeepAlive = ServiceRPCRequest(conn);
+            while (fKeepAlive && !fShutdown && conn->stream().rdbuf()->in_avail() > 0)
+                fKeepAlive = ServiceRPCRequest(conn);
+            if (fKeepAlive && !fShutdown)
+            {
+                ParkRPCConnection(conn, fUseSSL);
+                conn = NULL;
+            }
         }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadRPCServer3()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadRPCServer3()");
         }
-        catch (std::exception& e)
+        if (conn)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            conn->close();
+            delete conn;
         }
     }
 
-    delete conn;
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the RPC worker pool and its work queue.");
+
+    boost::unique_lock<boost::mutex> lock(mutexRPCQueue);
+    Object obj;
+    obj.push_back(Pair("threads",       nRPCWorkers));
+    obj.push_back(Pair("queuelimit",    (int)nRPCQueueLimit));
+    obj.push_back(Pair("queued",        (int)dequeRPCQueue.size()));
+    obj.push_back(Pair("queuepeak",     (int)nRPCQueuePeak));
+    obj.push_back(Pair("accepted",      (int64_t)nRPCQueued));
+    obj.push_back(Pair("rejected",      (int64_t)nRPCRejected));
+    obj.push_back(Pair("requests",      (int64_t)nRPCRequests));
+    return obj;
+}
+
+Value getrpcstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcstats\n"
+            "Returns call and error counts for each RPC method called so far, with the\n"
+            "time spent waiting for cs_main and the wallet lock and the execution time.\n"
+            "Times are in microseconds; histogram entry i counts calls below 2^(i+1).");
+
+    boost::unique_lock<boost::mutex> lock(mutexRPCStats);
+    Object obj;
+    for (map<string, CRPCMethodStats>::const_iterator it = mapRPCStats.begin(); it != mapRPCStats.end(); ++it)
+    {
+        const CRPCMethodStats& stats = it->second;
+        Array histogram;
+        for (int i = 0; i < BENCH_BUCKETS; i++)
+            histogram.push_back(stats.nBuckets[i]);
+
+        Object entry;
+        entry.push_back(Pair("calls",     stats.nCalls));
+        entry.push_back(Pair("errors",    stats.nErrors));
+        entry.push_back(Pair("lockwait",  stats.nLockMicros));
+        entry.push_back(Pair("total",     stats.nExecMicros));
+        entry.push_back(Pair("average",   stats.nCalls ? stats.nExecMicros / stats.nCalls : 0));
+        entry.push_back(Pair("max",       stats.nMaxExecMicros));
+        entry.push_back(Pair("histogram", histogram));
+        obj.push_back(Pair(it->first, entry));
+    }
+    return obj;
+}
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
@@ -1167,6 +1785,7 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    CRPCCallTimer timer(pcmd->name);
     try
     {
         // Execute
@@ -1176,9 +1795,11 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
                 result = pcmd->actor(params, false);
             else {
                 LOCK2(cs_main, pwalletMain->cs_wallet);
+                timer.Locked();
                 result = pcmd->actor(params, false);
             }
         }
+        timer.fError = false;
         return result;
     }
     catch (std::exception& e)
@@ -1214,7 +1835,10 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Send request
     string strRequest = JSONRPCRequest(strMethod, params, 1);
-    string strPost = HTTPPost(strRequest, mapRequestHeaders);
+    string strPath = "/";
+    if (mapArgs.count("-rpcwallet"))
+        strPath = "/wallet/" + mapArgs["-rpcwallet"];
+    string strPost = HTTPPost(strRequest, mapRequestHeaders, strPath);
     stream << strPost << std::flush;
 
     // Receive reply
@@ -1230,7 +1854,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ReadJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -1252,7 +1876,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!ReadJSON(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -1276,6 +1900,8 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     // Special case non-string parameter types
     //
     if (strMethod == "stop"                   && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "getlockstats"           && n > 0) ConvertTo<bool>(params[0]);
+    if (strMethod == "setlockstats"           && n > 0) ConvertTo<bool>(params[0]);
     if (strMethod == "sendtoaddress"          && n > 1) ConvertTo<double>(params[1]);
     if (strMethod == "sendtodion"             && n > 1) ConvertTo<double>(params[1]);
     if (strMethod == "settxfee"               && n > 0) ConvertTo<double>(params[0]);
@@ -1288,13 +1914,23 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
     if (strMethod == "listreceivedbyaccount"  && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listreceivedbyaccount"  && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getbalance"             && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "importprivkey"          && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "benchdions"             && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getjob"                 && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "canceljob"              && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getblock"               && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getpowblocks"           && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getpowblocksleft"       && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getblockstats"          && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getchainstats"          && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "getchainstats"          && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getchainstats"          && n > 3) ConvertTo<int64_t>(params[3]);
     if (strMethod == "getpowtimeleft"         && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "getblockbynumber"       && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "getblockbynumber"       && n > 1) ConvertTo<bool>(params[1]);
     if (strMethod == "getblockhash"           && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "estimatefee"            && n > 0) ConvertTo<int64_t>(params[0]);
+    if (strMethod == "simulatestake"          && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "gettxout"           && n == 2) ConvertTo<int64_t>(params[1]);
     if (strMethod == "gettxout"           && n == 3) { ConvertTo<int64_t>(params[1]); ConvertTo<bool>(params[2]); }
     if (strMethod == "getnetworkmhashps"      && n > 0) ConvertTo<int64_t>(params[0]);
@@ -1320,16 +1956,24 @@ Array RPCConvertValues(const std::string &strMethod, const std::vector<std::stri
 
     if (strMethod == "sendmany"               && n > 1) ConvertTo<Object>(params[1]);
     if (strMethod == "sendmany"               && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "sendbatch"              && n > 1) ConvertTo<Object>(params[1]);
+    if (strMethod == "sendbatch"              && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "reservebalance"         && n > 0) ConvertTo<double>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "addmultisigaddress"     && n > 1) ConvertTo<Array>(params[1]);
     if (strMethod == "listunspent"            && n > 0) ConvertTo<int64_t>(params[0]);
     if (strMethod == "listunspent"            && n > 1) ConvertTo<int64_t>(params[1]);
     if (strMethod == "listunspent"            && n > 2) ConvertTo<Array>(params[2]);
+    if (strMethod == "listunspent"            && n > 3) ConvertTo<Object>(params[3]);
     if (strMethod == "crawgen") { ConvertTo<double>(params[0]); ConvertTo<Object>(params[1]); }
     if (strMethod == "getrawtransaction"      && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddresstxids"        && n > 2) ConvertTo<int64_t>(params[2]);
+    if (strMethod == "getaddressutxos"        && n > 1) ConvertTo<int64_t>(params[1]);
+    if (strMethod == "getaddressutxos"        && n > 2) ConvertTo<int64_t>(params[2]);
     if (strMethod == "createrawtransaction"   && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "createrawtransaction"   && n > 1) ConvertTo<Object>(params[1]);
+    if (strMethod == "sendBatch"              && n > 0) ConvertTo<Array>(params[0]);
     if (strMethod == "signrawtransaction"     && n > 1) ConvertTo<Array>(params[1], true);
     if (strMethod == "signrawtransaction"     && n > 2) ConvertTo<Array>(params[2], true);
 
@@ -28,6 +28,7 @@ enum HTTPStatusCode
     HTTP_FORBIDDEN             = 403,
     HTTP_NOT_FOUND             = 404,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_SERVICE_UNAVAILABLE   = 503,
 };
 
 // Bitcoin RPC error codes
@@ -64,6 +65,7 @@ enum RPCErrorCode
     RPC_WALLET_WRONG_ENC_STATE      = -15, // Command given in wrong wallet encryption state (encrypting an encrypted wallet etc.)
     RPC_WALLET_ENCRYPTION_FAILED    = -16, // Failed to encrypt the wallet
     RPC_WALLET_ALREADY_UNLOCKED     = -17, // Wallet is already unlocked
+    RPC_WALLET_NOT_FOUND            = -18, // No wallet is loaded under the requested file name
 };
 
 json_spirit::Object JSONRPCError(int code, const std::string& message);
@@ -150,6 +152,7 @@ extern std::vector<unsigned char> ParseHexO(const json_spirit::Object& o, std::s
 extern json_spirit::Value getnumblocksofpeers(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getconnectioncount(const json_spirit::Array& params, bool fHelp); // in rpcnet.cpp
 extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gw1(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwalletRT(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpwalletRT(const json_spirit::Array& params, bool fHelp);
@@ -157,6 +160,24 @@ extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fH
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value dumpprivkey(const json_spirit::Array& params, bool fHelp); // in rpcdump.cpp
 extern json_spirit::Value importprivkey(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value abortrescan(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value startjob(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getjob(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value listjobs(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value canceljob(const json_spirit::Array& params, bool fHelp);
+
+// rpcjobs.cpp: for commands run by startjob, report progress in percent
+// and the stage they are in, and see whether canceljob asked them to stop.
+// Outside a job the first does nothing and the second is always false.
+void SetRPCJobProgress(int nPercent, const std::string& strStage);
+bool IsRPCJobCancelled();
+
+// Run an already converted command as a job, as startjob does, and ask it
+// to stop. TakeRPCJobResult waits for the job to finish and forgets it;
+// false if it failed or was cancelled, with strError saying why.
+int StartRPCJob(const std::string& strMethod, const json_spirit::Array& params);
+bool CancelRPCJob(int nId);
+bool TakeRPCJobResult(int nId, json_spirit::Value& result, std::string& strError);
 
 extern json_spirit::Value sendalert(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value trc(const json_spirit::Array& params, bool fHelp);
@@ -165,6 +186,7 @@ extern json_spirit::Value trcbase(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getsubsidy(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getmininginfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getstakinginfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value simulatestake(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getwork(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value tmpTest(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getworkex(const json_spirit::Array& params, bool fHelp);
@@ -197,6 +219,7 @@ extern json_spirit::Value getbalance(const json_spirit::Array& params, bool fHel
 extern json_spirit::Value movecmd(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendfrom(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendmany(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value sendbatch(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addmultisigaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addredeemscript(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listreceivedbyaddress(const json_spirit::Array& params, bool fHelp);
@@ -205,6 +228,12 @@ extern json_spirit::Value listtransactions(const json_spirit::Array& params, boo
 extern json_spirit::Value listtransactions__(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaddressgroupings(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listaccounts(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value listwallets(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getrpcstats(const json_spirit::Array& params, bool fHelp);
+
+// rest.cpp: serve GET /rest/<path>, returning the HTTP status
+int HTTPReq_REST(const std::string& strPath, std::string& strContentType, std::string& strBody);
 extern json_spirit::Value listsinceblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value backupwallet(const json_spirit::Array& params, bool fHelp);
@@ -220,7 +249,9 @@ extern json_spirit::Value sublimateYdwi(const json_spirit::Array& params, bool f
 extern json_spirit::Value transform(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value validateLocator(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getwalletinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value reservebalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getcompactioninfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value checkwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value repairwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value resendtx(const json_spirit::Array& params, bool fHelp);
@@ -231,6 +262,9 @@ extern json_spirit::Value crawgen(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value rmtx(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
+extern json_spirit::Value getaddressbalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddresstxids(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getaddressutxos(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value createrawtransaction(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value decoderawtransaction(const json_spirit::Array& params, bool fHelp);
@@ -242,11 +276,29 @@ extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, boo
 extern json_spirit::Value getblockcount(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getpowblocks(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getpowblocksleft(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
+extern json_spirit::Value getblockstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getchainstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getpowtimeleft(const json_spirit::Array& params, bool fHelp); // in rpcblockchain.cpp
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbcacheinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getleveldbinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value compactdb(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmemoryinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getthreadinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getimportinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumpsnapshot(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getsnapshotinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getlockstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value setlockstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getorphanblockinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getblockconnectstats(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value benchdions(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnetworkmhashps(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmempoolinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value estimatefee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
@@ -262,6 +314,7 @@ extern json_spirit::Value mapVertex(const json_spirit::Array& params, bool fHelp
 extern json_spirit::Value vtxtrace(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value svtx(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendMessage(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value sendBatch(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value registerAlias(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value uC(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value registerAliasGenerate(const json_spirit::Array& params, bool fHelp);
@@ -0,0 +1,292 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "net.h"
+#include "util.h"
+#include "version.h"
+
+#include <limits>
+
+using namespace std;
+
+bool fCompactBlocks = true;
+
+// Seconds a compact block may wait for its blocktxn
+static const int64_t COMPACT_BLOCK_TIMEOUT = 30;
+
+// Smallest possible serialized transaction, to bound the transaction count
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+static uint64_t GetShortID(uint64_t k0, uint64_t k1, const uint256& txid)
+{
+    return SipHashUint256(k0, k1, txid) & 0xffffffffffffULL;
+}
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+
+    // The receiver can't have the coinbase or coinstake yet
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    uint64_t k0, k1;
+    GetShortIDKeys(k0, k1);
+    vchShortTxIDs.reserve(block.vtx.size() * SHORTTXID_SIZE);
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            vPrefilledTxn.push_back(CPrefilledTransaction(i, block.vtx[i]));
+            continue;
+        }
+        uint64_t nShortID = GetShortID(k0, k1, block.GetTxHash(i));
+        for (unsigned int j = 0; j < SHORTTXID_SIZE; j++)
+            vchShortTxIDs.push_back((nShortID >> (8 * j)) & 0xff);
+    }
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortTxID(unsigned int i) const
+{
+    uint64_t nShortID = 0;
+    for (unsigned int j = 0; j < SHORTTXID_SIZE; j++)
+        nShortID |= (uint64_t)vchShortTxIDs[i * SHORTTXID_SIZE + j] << (8 * j);
+    return nShortID;
+}
+
+void CBlockHeaderAndShortTxIDs::GetShortIDKeys(uint64_t& k0, uint64_t& k1) const
+{
+    uint256 hashBlock = header.GetHash();
+    uint256 hashKey = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    k0 = hashKey.Get64(0);
+    k1 = hashKey.Get64(1);
+}
+
+bool CPartiallyDownloadedBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool)
+{
+    if (cmpctblock.vchShortTxIDs.size() % SHORTTXID_SIZE != 0)
+        return false;
+    unsigned int nTx = cmpctblock.GetTransactionCount();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return false;
+
+    block = cmpctblock.header;
+    block.vtx.resize(nTx);
+    vMissing.clear();
+
+    vector<bool> vHave(nTx, false);
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return false;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+
+    // The short ids take the remaining slots in order
+    map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nShortID = 0;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        if (vHave[i])
+            continue;
+        if (!mapShortIDs.insert(make_pair(cmpctblock.GetShortTxID(nShortID++), i)).second)
+            return false;
+    }
+
+    uint64_t k0, k1;
+    cmpctblock.GetShortIDKeys(k0, k1);
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::TxMap::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+        {
+            map<uint64_t, unsigned int>::const_iterator mi = mapShortIDs.find(GetShortID(k0, k1, it->first));
+            if (mi == mapShortIDs.end())
+                continue;
+            if (vHave[mi->second])
+                return false;
+            block.vtx[mi->second] = *it->second;
+            vHave[mi->second] = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < nTx; i++)
+        if (!vHave[i])
+            vMissing.push_back(i);
+    return true;
+}
+
+bool CPartiallyDownloadedBlock::Fill(const vector<CTransaction>& vtxMissing)
+{
+    if (vtxMissing.size() != vMissing.size())
+        return false;
+    for (unsigned int i = 0; i < vMissing.size(); i++)
+        block.vtx[vMissing[i]] = vtxMissing[i];
+    vMissing.clear();
+    return block.BuildMerkleTree() == block.hashMerkleRoot;
+}
+
+struct CPendingCompactBlock
+{
+    int64_t nTime;
+    CPartiallyDownloadedBlock partial;
+};
+
+// Compact blocks waiting for a blocktxn, by block hash and the peer that
+// sent them; each peer that announces a block rebuilds it on its own
+typedef map<pair<uint256, NodeId>, CPendingCompactBlock> PendingCompactBlockMap;
+static PendingCompactBlockMap mapPendingCompactBlocks;
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// Once a block is complete, the other peers' copies are no longer needed
+static void ErasePendingCompactBlocks(const uint256& hash)
+{
+    PendingCompactBlockMap::iterator it = mapPendingCompactBlocks.lower_bound(make_pair(hash, std::numeric_limits<NodeId>::min()));
+    while (it != mapPendingCompactBlocks.end() && it->first.first == hash)
+        mapPendingCompactBlocks.erase(it++);
+}
+
+void CompactBlocksSendMessages(CNode* pto)
+{
+    int64_t nNow = GetTime();
+    PendingCompactBlockMap::iterator it = mapPendingCompactBlocks.begin();
+    while (it != mapPendingCompactBlocks.end())
+    {
+        if (it->first.second != pto->id || nNow - it->second.nTime <= COMPACT_BLOCK_TIMEOUT)
+        {
+            ++it;
+            continue;
+        }
+        if (!mapBlockIndex.count(it->first.first))
+        {
+            printf("compact block %s from %s timed out, asking for the full block\n", it->first.first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            RequestFullBlock(pto, it->first.first);
+        }
+        mapPendingCompactBlocks.erase(it++);
+    }
+}
+
+void CompactBlocksFinalizeNode(NodeId id)
+{
+    PendingCompactBlockMap::iterator it = mapPendingCompactBlocks.begin();
+    while (it != mapPendingCompactBlocks.end())
+    {
+        if (it->first.second == id)
+            mapPendingCompactBlocks.erase(it++);
+        else
+            ++it;
+    }
+}
+
+bool CanRequestCompactBlock(const CNode* pnode)
+{
+    return fCompactBlocks && pnode->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload();
+}
+
+void SendCompactBlock(CNode* pto, const CBlock& block)
+{
+    pto->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+}
+
+bool ProcessCompactBlock(CNode* pfrom, const CBlockHeaderAndShortTxIDs& cmpctblock, CBlock& blockRet)
+{
+    uint256 hash = cmpctblock.header.GetHash();
+    if (mapBlockIndex.count(hash) || mapPendingCompactBlocks.count(make_pair(hash, pfrom->id)))
+        return false;
+
+    // Without the parent it goes to the orphan pool, which wants it whole
+    if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock))
+    {
+        RequestFullBlock(pfrom, hash);
+        return false;
+    }
+
+    CPartiallyDownloadedBlock partial;
+    if (!partial.Init(cmpctblock, mempool))
+    {
+        printf("ProcessCompactBlock() : can't use compact block %s from %s\n", hash.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+        RequestFullBlock(pfrom, hash);
+        return false;
+    }
+
+    if (fDebugNet)
+        printf("received compact block %s, %"PRIszu" of %"PRIszu" transactions missing\n",
+               hash.ToString().substr(0,20).c_str(), partial.vMissing.size(), partial.block.vtx.size());
+
+    if (partial.vMissing.empty())
+    {
+        if (!partial.Fill(vector<CTransaction>()))
+        {
+            RequestFullBlock(pfrom, hash);
+            return false;
+        }
+        blockRet = partial.block;
+        return true;
+    }
+
+    CBlockTransactionsRequest req;
+    req.hashBlock = hash;
+    req.vIndexes = partial.vMissing;
+    pfrom->PushMessage("getblocktxn", req);
+
+    CPendingCompactBlock& pending = mapPendingCompactBlocks[make_pair(hash, pfrom->id)];
+    pending.nTime = GetTime();
+    pending.partial = partial;
+    return false;
+}
+
+bool ProcessBlockTransactions(CNode* pfrom, const CBlockTransactions& blocktxn, CBlock& blockRet)
+{
+    PendingCompactBlockMap::iterator it = mapPendingCompactBlocks.find(make_pair(blocktxn.hashBlock, pfrom->id));
+    if (it == mapPendingCompactBlocks.end())
+        return false;
+
+    CPartiallyDownloadedBlock& partial = it->second.partial;
+    if (partial.Fill(blocktxn.vtx))
+    {
+        blockRet = partial.block;
+        ErasePendingCompactBlocks(blocktxn.hashBlock);
+        return true;
+    }
+    printf("ProcessBlockTransactions() : can't complete block %s from %s\n", blocktxn.hashBlock.ToString().substr(0,20).c_str(), pfrom->addr.ToString().c_str());
+    RequestFullBlock(pfrom, blocktxn.hashBlock);
+    mapPendingCompactBlocks.erase(it);
+    return false;
+}
+
+void ProcessGetBlockTransactions(CNode* pfrom, const CBlockTransactionsRequest& req)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(req.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return;
+    CBlock block;
+    if (!block.ReadFromDisk(mi->second))
+        return;
+
+    CBlockTransactions resp;
+    resp.hashBlock = req.hashBlock;
+    resp.vtx.reserve(req.vIndexes.size());
+    BOOST_FOREACH(unsigned int nIndex, req.vIndexes)
+    {
+        if (nIndex >= block.vtx.size())
+        {
+            pfrom->Misbehaving(100);
+            return;
+        }
+        resp.vtx.push_back(block.vtx[nIndex]);
+    }
+    pfrom->PushMessage("blocktxn", resp);
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CNode;
+
+/** Compact block relay (-compactblocks). A peer that already has most of a
+ *  new block's transactions in its memory pool is sent the header, 6-byte
+ *  short ids of the transactions and, in full, the coinbase and coinstake.
+ *  Whatever it can't match is fetched with a getblocktxn/blocktxn round
+ *  trip; if that fails too it falls back to asking for the whole block.
+ *  The handlers below must be called with cs_main held.
+ */
+extern bool fCompactBlocks;
+
+static const unsigned int SHORTTXID_SIZE = 6;
+
+/** A transaction sent in full within a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+    CPrefilledTransaction(unsigned int nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** The "cmpctblock" message */
+class CBlockHeaderAndShortTxIDs
+{
+public:
+    // Header and block signature, without transactions
+    CBlock header;
+    // Salt for the short ids, so that collisions differ from block to block
+    uint64_t nNonce;
+    // SHORTTXID_SIZE bytes per transaction not in vPrefilledTxn, in block order
+    std::vector<unsigned char> vchShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    CBlockHeaderAndShortTxIDs() : nNonce(0) {}
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vchShortTxIDs);
+        READWRITE(vPrefilledTxn);
+    )
+
+    unsigned int GetShortTxIDCount() const { return vchShortTxIDs.size() / SHORTTXID_SIZE; }
+    uint64_t GetShortTxID(unsigned int i) const;
+    /** SipHash keys for the short ids, from the block hash and nNonce */
+    void GetShortIDKeys(uint64_t& k0, uint64_t& k1) const;
+    unsigned int GetTransactionCount() const { return GetShortTxIDCount() + vPrefilledTxn.size(); }
+};
+
+/** The "getblocktxn" message: indexes into the block's transactions */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned int> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** The "blocktxn" message: the transactions asked for, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block */
+class CPartiallyDownloadedBlock
+{
+public:
+    CBlock block;
+    // Indexes into block.vtx still to be filled in
+    std::vector<unsigned int> vMissing;
+
+    /** Take what the prefilled transactions and pool provide. Returns false
+     *  if the encoding is bad or two pool transactions share a short id. */
+    bool Init(const CBlockHeaderAndShortTxIDs& cmpctblock, CTxMemPool& pool);
+
+    /** Put vtxMissing into the missing slots. Returns false if the count is
+     *  wrong or the result doesn't match the merkle root, which can also be
+     *  a short id collision with a transaction that isn't in the block. */
+    bool Fill(const std::vector<CTransaction>& vtxMissing);
+};
+
+/** Whether block requests to pnode should ask for a compact block */
+bool CanRequestCompactBlock(const CNode* pnode);
+
+/** Answer a getdata for a compact block */
+void SendCompactBlock(CNode* pto, const CBlock& block);
+
+/** Handle "cmpctblock". Returns true with blockRet set once the block is
+ *  complete; otherwise the missing transactions or the full block have
+ *  been asked for. */
+bool ProcessCompactBlock(CNode* pfrom, const CBlockHeaderAndShortTxIDs& cmpctblock, CBlock& blockRet);
+
+/** Handle "blocktxn", with the same result as ProcessCompactBlock() */
+bool ProcessBlockTransactions(CNode* pfrom, const CBlockTransactions& blocktxn, CBlock& blockRet);
+
+/** Handle "getblocktxn" */
+void ProcessGetBlockTransactions(CNode* pfrom, const CBlockTransactionsRequest& req);
+
+/** Ask pto for the whole of each compact block whose blocktxn it hasn't
+ *  sent in time */
+void CompactBlocksSendMessages(CNode* pto);
+
+/** Forget the compact blocks a disconnected peer was sending */
+void CompactBlocksFinalizeNode(NodeId id);
+
+#endif
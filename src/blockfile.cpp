@@ -0,0 +1,126 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+#include "sync.h"
+#include "util.h"
+
+#include <map>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Mapping whole 2GB block files is only sensible with a 64-bit address space
+bool fMapBlockFiles = (sizeof(void*) >= 8);
+
+static CCriticalSection cs_mapMappedBlockFiles;
+static map<unsigned int, boost::shared_ptr<CMappedBlockFile> > mapMappedBlockFiles;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile)
+{
+    string strBlockFn = strprintf("blk%04u.dat", nFile);
+    return GetDataDir() / strBlockFn;
+}
+
+FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
+{
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return NULL;
+    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
+    if (!file)
+        return NULL;
+    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
+    {
+        if (fseek(file, nBlockPos, SEEK_SET) != 0)
+        {
+            fclose(file);
+            return NULL;
+        }
+    }
+    return file;
+}
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    if (pbegin)
+        munmap((void*)pbegin, nSize);
+#endif
+}
+
+boost::shared_ptr<CMappedBlockFile> GetMappedBlockFile(unsigned int nFile, unsigned int nPos)
+{
+    boost::shared_ptr<CMappedBlockFile> pmap;
+#ifndef WIN32
+    if (!fMapBlockFiles || nFile < 1 || nFile == (unsigned int) -1)
+        return pmap;
+
+    LOCK(cs_mapMappedBlockFiles);
+    map<unsigned int, boost::shared_ptr<CMappedBlockFile> >::iterator mi = mapMappedBlockFiles.find(nFile);
+    if (mi != mapMappedBlockFiles.end() && nPos < mi->second->size())
+        return mi->second;
+
+    // Not mapped yet, or the file has grown past the old mapping since
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return pmap;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= (off_t)nPos)
+    {
+        close(fd);
+        return pmap;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        printf("GetMappedBlockFile() : mmap of blk%04u.dat failed, errno %d\n", nFile, errno);
+        return pmap;
+    }
+    // Reads are mostly for single blocks or transactions scattered over the file
+    madvise(p, st.st_size, MADV_RANDOM);
+
+    pmap.reset(new CMappedBlockFile((const char*)p, st.st_size));
+    mapMappedBlockFiles[nFile] = pmap;
+#endif
+    return pmap;
+}
+
+void PrefetchBlockFile(unsigned int nFile, unsigned int nBegin, unsigned int nEnd)
+{
+#ifndef WIN32
+    if (nEnd <= nBegin)
+        return;
+    boost::shared_ptr<CMappedBlockFile> pmap = GetMappedBlockFile(nFile, nBegin);
+    if (pmap)
+    {
+        // madvise wants a page aligned start
+        size_t nPageSize = sysconf(_SC_PAGESIZE);
+        size_t nStart = nBegin - nBegin % nPageSize;
+        size_t nStop = min((size_t)nEnd, pmap->size());
+        madvise((void*)(pmap->begin() + nStart), nStop - nStart, MADV_WILLNEED);
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, nBegin, nEnd - nBegin, POSIX_FADV_WILLNEED);
+    close(fd);
+#endif
+#endif
+}
+
+void UnmapBlockFiles()
+{
+    LOCK(cs_mapMappedBlockFiles);
+    mapMappedBlockFiles.clear();
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <ios>
+
+/** Whether blkNNNN.dat files are read through memory mappings (-mmapblocks) */
+extern bool fMapBlockFiles;
+
+boost::filesystem::path BlockFilePath(unsigned int nFile);
+FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode);
+
+/** A read-only mapping of a whole block file. The mapping stays valid for as
+ *  long as someone holds a reference, even if the cache has since remapped
+ *  the file because it grew.
+ */
+class CMappedBlockFile
+{
+private:
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+};
+
+/** Return a mapping of block file nFile that covers offset nPos, mapping or
+ *  remapping it as needed. Returns an empty pointer if mappings are disabled
+ *  or the file can't be mapped, in which case the caller should fall back to
+ *  stdio. */
+boost::shared_ptr<CMappedBlockFile> GetMappedBlockFile(unsigned int nFile, unsigned int nPos);
+
+/** Ask the kernel to start reading bytes nBegin to nEnd of block file nFile
+ *  into the page cache, without waiting for them. Many of these in a row
+ *  keep the disk's queue full while the readers go one block at a time. */
+void PrefetchBlockFile(unsigned int nFile, unsigned int nBegin, unsigned int nEnd);
+
+/** Drop all cached mappings, e.g. before block files are removed */
+void UnmapBlockFiles();
+
+/** Deserialize obj from block file nFile at offset nPos, through the mapping
+ *  cache if possible. Throws on I/O or deserialization errors like CAutoFile. */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType, int nVersion)
+{
+    boost::shared_ptr<CMappedBlockFile> pmap = GetMappedBlockFile(nFile, nPos);
+    if (pmap)
+    {
+        try {
+            CBufferReader reader(pmap->begin() + nPos, pmap->end(), nType, nVersion);
+            reader >> obj;
+            return true;
+        }
+        catch (std::ios_base::failure &e) {
+            // The mapping may predate the tail of a block that was still
+            // being appended; remap once if the file has grown since
+            boost::shared_ptr<CMappedBlockFile> pmapNew = GetMappedBlockFile(nFile, pmap->size());
+            if (!pmapNew || pmapNew->size() <= pmap->size())
+                throw;
+            CBufferReader reader(pmapNew->begin() + nPos, pmapNew->end(), nType, nVersion);
+            reader >> obj;
+            return true;
+        }
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nPos, "rb"), nType, nVersion);
+    if (!filein)
+        return false;
+    filein >> obj;
+    return true;
+}
+
+#endif
@@ -0,0 +1,427 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockimport.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <map>
+#include <memory>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+using namespace boost;
+
+bool fReindex = false;
+bool fImporting = false;
+
+static CCriticalSection cs_importprogress;
+static CImportProgress importprogress;
+
+// Read ahead of the connect stage by at most this many blocks, so that a
+// long run of orphans or a slow ConnectBlock can't use unbounded memory
+static const unsigned int MAX_IMPORT_INFLIGHT = 512;
+
+// Large enough for several of the biggest possible blocks
+static const unsigned int IMPORT_BUFFER_SIZE = 4 * MAX_BLOCK_SIZE;
+
+void GetImportProgress(CImportProgress& progress)
+{
+    LOCK(cs_importprogress);
+    progress = importprogress;
+}
+
+CBlockFileReader::CBlockFileReader(FILE* fileIn) :
+    file(fileIn), vBuf(IMPORT_BUFFER_SIZE), nBegin(0), nEnd(0), nBufPos(0), nBytesRead(0), fEof(false)
+{
+}
+
+bool CBlockFileReader::ReadNext(CBlock& block)
+{
+    while (true)
+    {
+        // Keep at least one maximum sized record buffered
+        if (nEnd - nBegin < MAX_BLOCK_SIZE + 8 && !fEof)
+        {
+            memmove(&vBuf[0], &vBuf[nBegin], nEnd - nBegin);
+            nBufPos += nBegin;
+            nEnd -= nBegin;
+            nBegin = 0;
+            size_t nWant = vBuf.size() - nEnd;
+            size_t nGot = fread(&vBuf[nEnd], 1, nWant, file);
+            if (nGot < nWant)
+                fEof = true;
+            nEnd += nGot;
+            nBytesRead += nGot;
+        }
+
+        size_t nAvail = nEnd - nBegin;
+        if (nAvail < sizeof(pchMessageStart) + 4)
+            return false;
+        char* pfind = (char*)memchr(&vBuf[nBegin], pchMessageStart[0], nAvail + 1 - sizeof(pchMessageStart));
+        if (!pfind)
+        {
+            nBegin = nEnd + 1 - sizeof(pchMessageStart);
+            continue;
+        }
+        nBegin = pfind - &vBuf[0];
+        if (memcmp(pfind, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        {
+            nBegin++;
+            continue;
+        }
+        nAvail = nEnd - nBegin;
+
+        // Message start, size, then the block itself. Like the rest of the
+        // record, the size may lie past what is buffered so far.
+        size_t nHeader = sizeof(pchMessageStart) + 4;
+        if (nAvail < nHeader)
+        {
+            if (fEof)
+                return false;
+            continue;
+        }
+        unsigned int nSize;
+        CBufferReader(&vBuf[nBegin + sizeof(pchMessageStart)], &vBuf[nEnd], SER_DISK, CLIENT_VERSION) >> nSize;
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+        {
+            nBegin += sizeof(pchMessageStart);
+            continue;
+        }
+        if (nAvail < nHeader + nSize)
+        {
+            // Truncated record at the end of the file, otherwise
+            // the refill above brings in the rest of it
+            if (fEof)
+                return false;
+            continue;
+        }
+
+        try {
+            CBufferReader(&vBuf[nBegin + nHeader], &vBuf[nBegin + nHeader + nSize], SER_DISK, CLIENT_VERSION) >> block;
+        }
+        catch (std::exception &e) {
+            nBegin += sizeof(pchMessageStart);
+            continue;
+        }
+        nBegin += nHeader + nSize;
+        return true;
+    }
+}
+
+/** Three stage import pipeline: a reader thread that scans the file for
+ *  block records and deserializes them, a pool of threads running the
+ *  context-free CheckBlock(), and the calling thread which hands checked
+ *  blocks to ProcessBlock() in the order they appear in the file.
+ */
+class CBlockImporter
+{
+private:
+    FILE* file;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condCheck;
+    boost::condition_variable condConnect;
+
+    // Read but not checked yet, with their sequence number in the file
+    std::deque<std::pair<unsigned int, CBlock*> > queueRead;
+    // Checked, waiting for their turn; NULL if the block failed CheckBlock
+    std::map<unsigned int, CBlock*> mapChecked;
+    unsigned int nRead;
+    unsigned int nConnect;
+    bool fReadDone;
+    bool fStop;
+
+    bool Stopping() const { return fShutdown || fRequestShutdown; }
+
+    bool Push(CBlock* pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (nRead - nConnect >= MAX_IMPORT_INFLIGHT && !fStop)
+            condRead.wait(lock);
+        if (fStop)
+            return false;
+        queueRead.push_back(make_pair(nRead++, pblock));
+        condCheck.notify_one();
+        return true;
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("iocoin-importread");
+
+        CBlockFileReader reader(file);
+        int64_t nBytesCounted = 0;
+        try {
+            while (!Stopping())
+            {
+                std::auto_ptr<CBlock> pblock(new CBlock());
+                bool fRead = reader.ReadNext(*pblock);
+                {
+                    LOCK(cs_importprogress);
+                    importprogress.nFilePos = reader.GetFilePos();
+                    importprogress.nBytesRead += reader.GetBytesRead() - nBytesCounted;
+                    nBytesCounted = reader.GetBytesRead();
+                    if (fRead)
+                        importprogress.nBlocksRead++;
+                }
+                if (!fRead || !Push(pblock.get()))
+                    break;
+                pblock.release();
+            }
+        }
+        catch (std::exception &e) {
+            printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fReadDone = true;
+        condCheck.notify_all();
+        condConnect.notify_all();
+    }
+
+    void ThreadCheck()
+    {
+        RenameThread("iocoin-importchk");
+
+        while (true)
+        {
+            std::pair<unsigned int, CBlock*> item;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queueRead.empty() && !fReadDone && !fStop)
+                    condCheck.wait(lock);
+                if (queueRead.empty() || fStop)
+                    return;
+                item = queueRead.front();
+                queueRead.pop_front();
+            }
+
+            if (item.second->CheckBlock())
+                item.second->fChecked = true;
+            else
+            {
+                printf("CBlockImporter : CheckBlock failed for block %s\n", item.second->GetHash().ToString().substr(0,20).c_str());
+                delete item.second;
+                item.second = NULL;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            mapChecked[item.first] = item.second;
+            if (item.first == nConnect)
+                condConnect.notify_one();
+        }
+    }
+
+public:
+    CBlockImporter(FILE* fileIn) : file(fileIn), nRead(0), nConnect(0), fReadDone(false), fStop(false) {}
+
+    ~CBlockImporter()
+    {
+        for (std::deque<std::pair<unsigned int, CBlock*> >::iterator it = queueRead.begin(); it != queueRead.end(); ++it)
+            delete it->second;
+        for (std::map<unsigned int, CBlock*>::iterator it = mapChecked.begin(); it != mapChecked.end(); ++it)
+            delete it->second;
+    }
+
+    int Run()
+    {
+        int nCheckThreads = max(1, nScriptCheckThreads);
+        boost::thread_group threads;
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+        for (int i = 0; i < nCheckThreads; i++)
+            threads.create_thread(boost::bind(&CBlockImporter::ThreadCheck, this));
+
+        int nLoaded = 0;
+        int64_t nLastLog = GetTimeMillis();
+        while (!Stopping())
+        {
+            CBlock* pblock;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                std::map<unsigned int, CBlock*>::iterator mi;
+                while ((mi = mapChecked.find(nConnect)) == mapChecked.end())
+                {
+                    if ((fReadDone && nConnect == nRead) || Stopping())
+                        break;
+                    condConnect.timed_wait(lock, boost::posix_time::milliseconds(250));
+                }
+                if (mi == mapChecked.end())
+                    break;
+                pblock = mi->second;
+                mapChecked.erase(mi);
+                nConnect++;
+                condRead.notify_one();
+            }
+
+            bool fAccepted = false;
+            if (pblock)
+            {
+                LOCK(cs_main);
+                fAccepted = ProcessBlock(NULL, pblock);
+                delete pblock;
+            }
+            if (fAccepted)
+                nLoaded++;
+
+            LOCK(cs_importprogress);
+            if (fAccepted)
+                importprogress.nBlocksConnected++;
+            else
+                importprogress.nBlocksRejected++;
+
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nLastLog >= 10000)
+            {
+                nLastLog = nNow;
+                double dElapsed = max((int64_t)1, nNow - importprogress.nStartTime) / 1000.0;
+                printf("Importing %s: %.1f%%, height %d, %d blocks connected, %.2f MB/s, %.1f blocks/s\n",
+                       importprogress.strFile.c_str(),
+                       importprogress.nFileSize ? 100.0 * importprogress.nFilePos / importprogress.nFileSize : 0.0,
+                       nBestHeight, importprogress.nBlocksConnected,
+                       importprogress.nBytesRead / dElapsed / 1048576.0,
+                       importprogress.nBlocksConnected / dElapsed);
+            }
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condRead.notify_all();
+            condCheck.notify_all();
+        }
+        threads.join_all();
+        return nLoaded;
+    }
+};
+
+bool LoadExternalBlockFile(FILE* fileIn, const std::string& strName)
+{
+    int64_t nStart = GetTimeMillis();
+
+    {
+        LOCK(cs_importprogress);
+        importprogress.fActive = true;
+        importprogress.strFile = strName;
+        importprogress.nFilePos = 0;
+        importprogress.nFileSize = 0;
+        if (fseek(fileIn, 0, SEEK_END) == 0)
+            importprogress.nFileSize = ftell(fileIn);
+        rewind(fileIn);
+#ifdef POSIX_FADV_SEQUENTIAL
+        // Read front to back; a wider readahead keeps the disk busy
+        posix_fadvise(fileno(fileIn), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (importprogress.nStartTime == 0)
+            importprogress.nStartTime = nStart;
+    }
+
+    int nLoaded;
+    {
+        CBlockImporter importer(fileIn);
+        nLoaded = importer.Run();
+    }
+    fclose(fileIn);
+
+    {
+        LOCK(cs_importprogress);
+        importprogress.fActive = false;
+    }
+    printf("Loaded %i blocks from external file in %"PRId64"ms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
+
+boost::filesystem::path ReindexFilePath(unsigned int nFile)
+{
+    return GetDataDir() / strprintf("blk%04u.dat.reindex", nFile);
+}
+
+// Files already re-imported are removed, but their rebuilt blkNNNN.dat
+// counterparts carry the numbering across the gap
+unsigned int GetPendingReindexFile()
+{
+    for (unsigned int nFile = 1; ; nFile++)
+    {
+        if (filesystem::exists(ReindexFilePath(nFile)))
+            return nFile;
+        if (!filesystem::exists(BlockFilePath(nFile)))
+            return 0;
+    }
+}
+
+bool PrepareReindex()
+{
+    if (GetPendingReindexFile())
+    {
+        printf("PrepareReindex() : resuming unfinished reindex\n");
+        return true;
+    }
+
+    unsigned int nFile = 1;
+    for (; filesystem::exists(BlockFilePath(nFile)); nFile++)
+        if (!RenameOver(BlockFilePath(nFile), ReindexFilePath(nFile)))
+            return error("PrepareReindex() : unable to move %s aside", BlockFilePath(nFile).string().c_str());
+    printf("PrepareReindex() : %u block files to re-import\n", nFile - 1);
+
+    filesystem::remove_all(GetDataDir() / "txleveldb");
+    filesystem::remove_all(GetDataDir() / "blkindexleveldb");
+    filesystem::remove(GetDataDir() / "blkindex.snapshot");
+    // Whatever an interrupted -loadsnapshot left is re-imported with the rest
+    filesystem::remove(GetDataDir() / "snapshot.loading");
+    return true;
+}
+
+void ThreadImport(void* parg)
+{
+    RenameThread("iocoin-loadblk");
+    vnThreadsRunning[THREAD_IMPORT]++;
+    fImporting = true;
+
+    if (fReindex)
+    {
+        unsigned int nFile = GetPendingReindexFile();
+        for (; nFile && !fShutdown && !fRequestShutdown; nFile++)
+        {
+            filesystem::path path = ReindexFilePath(nFile);
+            FILE* file = fopen(path.string().c_str(), "rb");
+            if (!file)
+                break;
+            printf("Reindexing block file blk%04u.dat...\n", nFile);
+            LoadExternalBlockFile(file, strprintf("blk%04u.dat", nFile));
+            if (fShutdown || fRequestShutdown)
+                break;
+            filesystem::remove(path);
+        }
+        if (!fShutdown && !fRequestShutdown)
+        {
+            printf("Reindexing finished\n");
+            fReindex = false;
+        }
+    }
+
+    filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
+    if (filesystem::exists(pathBootstrap) && !fShutdown && !fRequestShutdown)
+    {
+        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
+        if (file)
+        {
+            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
+            LoadExternalBlockFile(file, "bootstrap.dat");
+            RenameOver(pathBootstrap, pathBootstrapOld);
+        }
+    }
+
+    fImporting = false;
+    vnThreadsRunning[THREAD_IMPORT]--;
+}
@@ -0,0 +1,86 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKIMPORT_H
+#define BITCOIN_BLOCKIMPORT_H
+
+#include <boost/filesystem/path.hpp>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+class CBlock;
+
+/** Set while the block files are being re-imported (-reindex) */
+extern bool fReindex;
+/** Set while ThreadImport is running */
+extern bool fImporting;
+
+/** Counters for the import in progress, reported by getimportinfo */
+struct CImportProgress
+{
+    bool fActive;
+    std::string strFile;
+    int64_t nFileSize;
+    int64_t nFilePos;
+    int64_t nBytesRead;
+    int nBlocksRead;
+    int nBlocksRejected;
+    int nBlocksConnected;
+    int64_t nStartTime;
+
+    CImportProgress()
+    {
+        fActive = false;
+        nFileSize = nFilePos = nBytesRead = 0;
+        nBlocksRead = nBlocksRejected = nBlocksConnected = 0;
+        nStartTime = 0;
+    }
+};
+
+void GetImportProgress(CImportProgress& progress);
+
+/** Reads the blocks of a bootstrap/blkNNNN.dat style file in order, skipping
+ *  anything between records that is not a valid block. Does not own file. */
+class CBlockFileReader
+{
+public:
+    explicit CBlockFileReader(FILE* fileIn);
+
+    // False at the end of the file or on a read error
+    bool ReadNext(CBlock& block);
+    // File offset just past the data read so far, and bytes read in total
+    int64_t GetFilePos() const { return nBufPos + nEnd; }
+    int64_t GetBytesRead() const { return nBytesRead; }
+
+private:
+    FILE* file;
+    std::vector<char> vBuf;
+    size_t nBegin;
+    size_t nEnd;
+    int64_t nBufPos; // file offset of vBuf[0]
+    int64_t nBytesRead;
+    bool fEof;
+};
+
+/** Import the blocks in a bootstrap/blkNNNN.dat style file. Blocks are read
+ *  and deserialized by one thread, checked with CheckBlock() on several, and
+ *  handed to ProcessBlock() in file order. Takes ownership of fileIn. */
+bool LoadExternalBlockFile(FILE* fileIn, const std::string& strName = "");
+
+boost::filesystem::path ReindexFilePath(unsigned int nFile);
+
+/** First block file still waiting to be re-imported, or 0 if there is none */
+unsigned int GetPendingReindexFile();
+
+/** Move the block files aside to be re-imported and drop the tx database.
+ *  Must run before the block index is loaded. */
+bool PrepareReindex();
+
+/** Re-import pending -reindex files and bootstrap.dat in the background */
+void ThreadImport(void* parg);
+
+#endif
@@ -0,0 +1,92 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockprefetch.h"
+
+using namespace std;
+
+CBlockPrefetcher::CBlockPrefetcher(const vector<CBlockIndex*>& vIndexIn, unsigned int nAheadIn, int nThreadsIn, bool fReadTransactionsIn) :
+    vIndex(vIndexIn), nAhead(max(nAheadIn, 1U)), nThreads(nThreadsIn), fReadTransactions(fReadTransactionsIn),
+    nRead(0), nNext(0), fStop(false)
+{
+    if (nThreads <= 0)
+        nThreads = max(1, nScriptCheckThreads);
+}
+
+CBlockPrefetcher::~CBlockPrefetcher()
+{
+    Stop();
+    for (map<unsigned int, CPrefetchedBlock*>::iterator it = mapRead.begin(); it != mapRead.end(); ++it)
+        delete it->second;
+}
+
+void CBlockPrefetcher::Start()
+{
+    for (int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CBlockPrefetcher::ThreadRead, this));
+}
+
+void CBlockPrefetcher::Stop()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        condRead.notify_all();
+    }
+    threads.join_all();
+}
+
+CPrefetchedBlock* CBlockPrefetcher::Read(unsigned int nPos)
+{
+    CPrefetchedBlock* pblock = new CPrefetchedBlock();
+    pblock->fRead = pblock->block.ReadFromDisk(vIndex[nPos], fReadTransactions);
+    return pblock;
+}
+
+void CBlockPrefetcher::ThreadRead()
+{
+    while (true)
+    {
+        unsigned int nPos;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (!fStop && nRead < vIndex.size() && nRead >= nNext + nAhead)
+                condRead.wait(lock);
+            if (fStop || nRead >= vIndex.size())
+                return;
+            nPos = nRead++;
+        }
+
+        // Keep a window of reads ahead in flight
+        if (nPos % BLOCK_PREFETCH_COUNT == 0)
+            PrefetchBlocks(vIndex, nPos == 0 ? 0 : nPos + BLOCK_PREFETCH_COUNT, nPos + 2 * BLOCK_PREFETCH_COUNT);
+
+        CPrefetchedBlock* pblock = Read(nPos);
+        pblock->nPos = nPos;
+        pblock->pindex = vIndex[nPos];
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        mapRead[nPos] = pblock;
+        if (nPos == nNext)
+            condNext.notify_one();
+    }
+}
+
+auto_ptr<CPrefetchedBlock> CBlockPrefetcher::Next()
+{
+    auto_ptr<CPrefetchedBlock> pblock;
+    boost::unique_lock<boost::mutex> lock(mutex);
+    map<unsigned int, CPrefetchedBlock*>::iterator mi;
+    while ((mi = mapRead.find(nNext)) == mapRead.end())
+    {
+        if (nNext >= vIndex.size() || fStop || Interrupted())
+            return pblock;
+        condNext.timed_wait(lock, boost::posix_time::milliseconds(250));
+    }
+    pblock.reset(mi->second);
+    mapRead.erase(mi);
+    nNext++;
+    condRead.notify_all();
+    return pblock;
+}
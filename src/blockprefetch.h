@@ -0,0 +1,83 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKPREFETCH_H
+#define BITCOIN_BLOCKPREFETCH_H
+
+#include "main.h"
+
+#include <boost/thread.hpp>
+
+#include <map>
+#include <memory>
+#include <vector>
+
+/** A block read ahead of the one taking it. Subclasses carry what a
+ *  prefetcher's Read() worked out on the reader threads. */
+class CPrefetchedBlock
+{
+public:
+    unsigned int nPos;
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+
+    CPrefetchedBlock() : nPos(0), pindex(NULL), fRead(false) {}
+    virtual ~CPrefetchedBlock() {}
+};
+
+/** Walks the blocks of vIndex in order for a rescan or index rebuild. Reader
+ *  threads read up to nAhead blocks past the one last taken with Next(),
+ *  asking the kernel for the block file ranges they are about to need, so
+ *  that the consumer rarely waits on the disk.
+ *
+ *  Subclasses may override Read() to do their per-block work on the reader
+ *  threads too; such a subclass has to Stop() before it is destroyed.
+ */
+class CBlockPrefetcher
+{
+public:
+    // With nThreads 0, one reader per script check thread (-par)
+    CBlockPrefetcher(const std::vector<CBlockIndex*>& vIndexIn, unsigned int nAheadIn, int nThreads = 0, bool fReadTransactionsIn = true);
+    virtual ~CBlockPrefetcher();
+
+    void Start();
+    void Stop();
+
+    /** The next block in order, or NULL at the end or once Interrupted().
+     *  fRead is false in blocks that couldn't be read. */
+    std::auto_ptr<CPrefetchedBlock> Next();
+
+    // Position of the block Next() will return
+    unsigned int GetPos() const { return nNext; }
+    unsigned int size() const { return vIndex.size(); }
+
+protected:
+    const std::vector<CBlockIndex*> vIndex;
+
+    /** Runs on the reader threads; the default only reads the block */
+    virtual CPrefetchedBlock* Read(unsigned int nPos);
+    /** Checked while Next() waits for a block */
+    virtual bool Interrupted() const { return fShutdown; }
+
+private:
+    unsigned int nAhead;
+    int nThreads;
+    bool fReadTransactions;
+
+    boost::mutex mutex;
+    boost::condition_variable condRead;
+    boost::condition_variable condNext;
+    std::map<unsigned int, CPrefetchedBlock*> mapRead;
+    unsigned int nRead;    // next position for a reader
+    unsigned int nNext;    // next position for Next()
+    bool fStop;
+    boost::thread_group threads;
+
+    void ThreadRead();
+
+    CBlockPrefetcher(const CBlockPrefetcher&);
+    CBlockPrefetcher& operator=(const CBlockPrefetcher&);
+};
+
+#endif
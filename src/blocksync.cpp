@@ -0,0 +1,457 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blocksync.h"
+#include "checkpoints.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+#include <deque>
+
+using namespace std;
+
+bool fHeadersFirst = true;
+
+struct CHeaderIndex
+{
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nBits;
+    uint256 nChainTrust;
+    // Peer the header came from, 0 for blocks we have
+    NodeId nPeer;
+};
+
+// Headers we have no block for yet, and how many of them each peer sent
+static map<uint256, CHeaderIndex> mapHeaders;
+static map<NodeId, unsigned int> mapHeadersPerPeer;
+// The best header chain above the first block it has in common with
+// mapBlockIndex; vHeaderChain[0] is at height nHeaderChainStart
+static deque<uint256> vHeaderChain;
+static int nHeaderChainStart = 0;
+// Outstanding block requests over all peers, with the time they were sent
+static map<uint256, int64_t> mapBlocksInFlight;
+// Last sign of life from the peer we take headers from
+static int64_t nHeadersSyncActivity = 0;
+// When a block on the header chain last arrived, or the chain last changed
+static int64_t nHeaderChainProgress = 0;
+
+bool IsHeadersSyncActive()
+{
+    return fHeadersFirst && !vHeaderChain.empty();
+}
+
+bool IsHeaderChainBlock(const uint256& hash)
+{
+    return mapHeaders.count(hash) > 0;
+}
+
+int GetBestHeaderHeight()
+{
+    if (vHeaderChain.empty())
+        return nBestHeight;
+    return nHeaderChainStart + vHeaderChain.size() - 1;
+}
+
+unsigned int GetBlocksInFlight()
+{
+    return mapBlocksInFlight.size();
+}
+
+static bool GetHeaderInfo(const uint256& hash, CHeaderIndex& headerRet)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        const CBlockIndex* pindex = mi->second;
+        headerRet.hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : uint256(0);
+        headerRet.nHeight = pindex->nHeight;
+        headerRet.nTime = pindex->nTime;
+        headerRet.nBits = pindex->nBits;
+        headerRet.nChainTrust = pindex->nChainTrust;
+        headerRet.nPeer = 0;
+        return true;
+    }
+    map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hash);
+    if (it != mapHeaders.end())
+    {
+        headerRet = it->second;
+        return true;
+    }
+    return false;
+}
+
+static void EraseHeader(map<uint256, CHeaderIndex>::iterator it)
+{
+    map<NodeId, unsigned int>::iterator mi = mapHeadersPerPeer.find(it->second.nPeer);
+    if (mi != mapHeadersPerPeer.end() && --mi->second == 0)
+        mapHeadersPerPeer.erase(mi);
+    mapHeaders.erase(it);
+}
+
+static void ResetHeaderChain()
+{
+    mapHeaders.clear();
+    mapHeadersPerPeer.clear();
+    vHeaderChain.clear();
+    nHeaderChainStart = 0;
+}
+
+// Drop headers whose blocks have arrived in the meantime
+static void PruneHeaderChain()
+{
+    while (!vHeaderChain.empty() && mapBlockIndex.count(vHeaderChain.front()))
+    {
+        map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(vHeaderChain.front());
+        if (it != mapHeaders.end())
+            EraseHeader(it);
+        vHeaderChain.pop_front();
+        nHeaderChainStart++;
+        nHeaderChainProgress = GetTime();
+    }
+    // Headers of abandoned branches only go away once the chain is done
+    if (vHeaderChain.empty())
+        ResetHeaderChain();
+}
+
+static uint256 GetBestHeaderTrust()
+{
+    if (vHeaderChain.empty())
+        return nBestChainTrust;
+    return mapHeaders[vHeaderChain.back()].nChainTrust;
+}
+
+static void SetBestHeader(const uint256& hash, const CHeaderIndex& header)
+{
+    if (!vHeaderChain.empty() && header.hashPrev == vHeaderChain.back())
+    {
+        vHeaderChain.push_back(hash);
+        return;
+    }
+
+    // Rebuild from the last block we already have, which is where the new
+    // chain leaves ours or the old header chain
+    deque<uint256> vChain;
+    uint256 hashWalk = hash;
+    map<uint256, CHeaderIndex>::iterator it;
+    while (!mapBlockIndex.count(hashWalk) && (it = mapHeaders.find(hashWalk)) != mapHeaders.end())
+    {
+        vChain.push_front(hashWalk);
+        hashWalk = it->second.hashPrev;
+    }
+    if (vHeaderChain.empty())
+        nHeaderChainProgress = GetTime();
+    vHeaderChain.swap(vChain);
+    nHeaderChainStart = header.nHeight - vHeaderChain.size() + 1;
+}
+
+// Whether the trust a header claims through nBits can be right. A header
+// that meets its own target carries its proof of work. Otherwise it stands
+// for a proof-of-stake block, whose kernel needs the block's transactions;
+// what can be checked is that nBits is no harder than the retarget from
+// the two blocks before it allows, so that a peer can't make up a header
+// chain of more trust than ours for free.
+static bool CheckHeaderTrust(const uint256& hash, const CHeaderIndex& index, const CHeaderIndex& prev)
+{
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(index.nBits, &fNegative, &fOverflow);
+    if (fNegative || fOverflow || !bnTarget)
+        return error("CheckHeaderTrust() : bad nBits");
+    if (bnTarget <= bnProofOfWorkLimit && hash <= bnTarget)
+        return true;
+
+    // Up to the last proof-of-work block the two kinds take turns, and it is
+    // the hardened checkpoints that keep those heights honest
+    if (index.nHeight <= LAST_POW_BLOCK + 2)
+        return true;
+
+    CHeaderIndex prevPrev;
+    if (!GetHeaderInfo(prev.hashPrev, prevPrev))
+        return error("CheckHeaderTrust() : predecessors unknown");
+    uint256 bnHardest = GetHardestStakeTarget(index.nHeight, prev.nBits, prev.nTime, prevPrev.nTime);
+    if (bnTarget < bnHardest)
+        return error("CheckHeaderTrust() : nBits %08x harder than the retarget allows", index.nBits);
+    return true;
+}
+
+// Checks on a header short of having the block. Proof-of-stake kernels and
+// coinstake timestamps need the block's transactions, so those are left to
+// ProcessBlock() once the block itself arrives.
+static bool AcceptHeader(CNode* pfrom, const CBlock& header, bool& fNewBest)
+{
+    uint256 hash = header.GetHash();
+    CHeaderIndex prev;
+    CHeaderIndex known;
+    if (GetHeaderInfo(hash, known))
+        return true;
+    if (!GetHeaderInfo(header.hashPrevBlock, prev))
+        return error("AcceptHeader() : header %s does not connect", hash.ToString().substr(0,20).c_str());
+    if (mapHeadersPerPeer[pfrom->id] >= MAX_HEADERS_PER_PEER)
+        return error("AcceptHeader() : too many headers from %s", pfrom->addr.ToString().c_str());
+
+    CHeaderIndex index;
+    index.hashPrev = header.hashPrevBlock;
+    index.nHeight = prev.nHeight + 1;
+    index.nTime = header.nTime;
+    index.nBits = header.nBits;
+    index.nChainTrust = prev.nChainTrust + GetBlockTrust(header.nBits);
+    index.nPeer = pfrom->id;
+
+    if (!Checkpoints::CheckHardened(index.nHeight, hash))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptHeader() : rejected by hardened checkpoint at height %d", index.nHeight);
+    }
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime(), index.nHeight))
+        return error("AcceptHeader() : header timestamp too far in the future");
+    if (IsProtocolV2(index.nHeight) && header.nTime <= prev.nTime)
+    {
+        pfrom->Misbehaving(20);
+        return error("AcceptHeader() : header timestamp too early");
+    }
+
+    if (!CheckHeaderTrust(hash, index, prev))
+    {
+        pfrom->Misbehaving(100);
+        return error("AcceptHeader() : header %s fails its trust check", hash.ToString().substr(0,20).c_str());
+    }
+
+    mapHeaders.insert(make_pair(hash, index));
+    mapHeadersPerPeer[pfrom->id]++;
+    if (index.nChainTrust > GetBestHeaderTrust())
+    {
+        SetBestHeader(hash, index);
+        fNewBest = true;
+    }
+    return true;
+}
+
+static void PushGetHeaders(CNode* pnode)
+{
+    // Most recent headers first, then exponentially further back, the
+    // same shape as CBlockLocator
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vHeaderChain.size() - 1; i >= 0; i -= nStep)
+    {
+        vHave.push_back(vHeaderChain[i]);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+
+    // Continue with the block the header chain builds on
+    CBlockIndex* pindex = pindexBest;
+    if (!vHeaderChain.empty())
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(mapHeaders[vHeaderChain.front()].hashPrev);
+        if (mi != mapBlockIndex.end())
+            pindex = mi->second;
+    }
+    AppendLocatorHashes(vHave, pindex, nStep);
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+
+    pnode->PushMessage("getheaders", CBlockLocator(vHave), uint256(0));
+    pnode->nGetHeadersTime = GetTime();
+}
+
+static bool CanSyncHeadersFrom(const CNode* pnode)
+{
+    return !pnode->fClient && !pnode->fOneShot && !pnode->fDisconnect &&
+           pnode->nStartingHeight > GetBestHeaderHeight();
+}
+
+bool StartHeadersSync(CNode* pfrom)
+{
+    if (!fHeadersFirst)
+        return false;
+    if (pfrom->fHeadersSyncPeer || !CanSyncHeadersFrom(pfrom))
+        return true;
+    if (GetTime() - nHeadersSyncActivity < HEADERS_RESPONSE_TIMEOUT)
+        return true;
+
+    printf("headers-first: syncing headers from %s, height %d\n", pfrom->addr.ToString().c_str(), pfrom->nStartingHeight);
+    pfrom->fHeadersSyncPeer = true;
+    nHeadersSyncActivity = GetTime();
+    PushGetHeaders(pfrom);
+    return true;
+}
+
+bool ProcessHeaders(CNode* pfrom, const vector<CBlock>& vHeaders)
+{
+    if (vHeaders.size() > MAX_HEADERS_RESULTS)
+    {
+        pfrom->Misbehaving(20);
+        return error("message headers size() = %"PRIszu"", vHeaders.size());
+    }
+    pfrom->nGetHeadersTime = 0;
+    if (pfrom->fHeadersSyncPeer)
+        nHeadersSyncActivity = GetTime();
+
+    // Hash them side by side first; AcceptHeader then hits the caches
+    HashBlockHeaders(vHeaders);
+
+    bool fNewBest = false;
+    bool fOk = true;
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+    {
+        if (!AcceptHeader(pfrom, header, fNewBest))
+        {
+            fOk = false;
+            break;
+        }
+    }
+
+    if (fDebugNet || fNewBest)
+        printf("headers-first: %"PRIszu" headers from %s, best header height %d\n",
+            vHeaders.size(), pfrom->addr.ToString().c_str(), GetBestHeaderHeight());
+
+    // A short reply means the peer has nothing more to give us. The next
+    // batch is requested from SendMessages, once there is room for it.
+    if (pfrom->fHeadersSyncPeer && (!fOk || vHeaders.size() < MAX_HEADERS_RESULTS))
+    {
+        pfrom->fHeadersSyncPeer = false;
+        nHeadersSyncActivity = 0;
+    }
+    return fOk;
+}
+
+bool IsHeaderChainAncestor(const uint256& hashTip, const CBlockIndex* pindex, bool& fKnownRet)
+{
+    fKnownRet = false;
+    map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hashTip);
+    if (it == mapHeaders.end())
+        return false;
+    int nHeightTip = it->second.nHeight;
+    int nOffset = nHeightTip - nHeaderChainStart;
+    if (nOffset < 0 || nOffset >= (int)vHeaderChain.size() || vHeaderChain[nOffset] != hashTip)
+        return false;
+    fKnownRet = true;
+
+    if (pindex->nHeight > nHeightTip)
+        return false;
+    if (pindex->nHeight >= nHeaderChainStart)
+        return vHeaderChain[pindex->nHeight - nHeaderChainStart] == pindex->GetBlockHash();
+
+    // Further down, the header chain builds on a block we already have
+    BlockMap::iterator mi = mapBlockIndex.find(mapHeaders[vHeaderChain.front()].hashPrev);
+    return mi != mapBlockIndex.end() && mi->second->GetAncestor(pindex->nHeight) == pindex;
+}
+
+void HeadersSyncBlockAnnounced(CNode* pfrom, const uint256& hash)
+{
+    if (mapHeaders.count(hash) || pfrom->fHeadersSyncPeer || pfrom->nGetHeadersTime)
+        return;
+    PushGetHeaders(pfrom);
+}
+
+void HeadersSyncBlockReceived(CNode* pfrom, const uint256& hash)
+{
+    pfrom->mapBlocksInFlight.erase(hash);
+    mapBlocksInFlight.erase(hash);
+}
+
+void HeadersSyncBlockProcessed(const uint256& hash)
+{
+    if (!mapHeaders.count(hash) || mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+        return;
+
+    // The block for one of our headers was rejected, so the header chain
+    // past it can't be trusted either
+    printf("headers-first: block %s on the header chain was rejected, dropping %"PRIszu" headers\n",
+        hash.ToString().substr(0,20).c_str(), vHeaderChain.size());
+    ResetHeaderChain();
+}
+
+void HeadersSyncSendMessages(CNode* pto, vector<CInv>& vGetData)
+{
+    if (!fHeadersFirst)
+        return;
+    int64_t nNow = GetTime();
+
+    // Header source: ask for more while there is room, or give up on it
+    if (pto->fHeadersSyncPeer)
+    {
+        if (pto->nGetHeadersTime && nNow - pto->nGetHeadersTime > HEADERS_RESPONSE_TIMEOUT)
+        {
+            printf("headers-first: %s stalled sending headers\n", pto->addr.ToString().c_str());
+            pto->fHeadersSyncPeer = false;
+            pto->nGetHeadersTime = 0;
+        }
+        else
+        {
+            nHeadersSyncActivity = nNow;
+            if (!pto->nGetHeadersTime && vHeaderChain.size() < MAX_HEADERS_AHEAD)
+                PushGetHeaders(pto);
+        }
+    }
+    else if (pto->fSuccessfullyConnected)
+        StartHeadersSync(pto);
+
+    PruneHeaderChain();
+
+    // A header chain none of whose blocks turn up is most likely made up;
+    // drop it, and the peer it came from, and let getblocks carry on
+    if (!vHeaderChain.empty() && nNow - nHeaderChainProgress > HEADERS_CHAIN_STALL_TIMEOUT)
+    {
+        NodeId nPeer = mapHeaders[vHeaderChain.back()].nPeer;
+        printf("headers-first: no blocks of the header chain for %"PRId64"s, dropping %"PRIszu" headers\n",
+            nNow - nHeaderChainProgress, vHeaderChain.size());
+        ResetHeaderChain();
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (pnode->id == nPeer)
+                {
+                    pnode->fHeadersSyncPeer = false;
+                    pnode->fDisconnect = true;
+                }
+            }
+        }
+        nHeadersSyncActivity = 0;
+        if (!pto->fDisconnect)
+            pto->PushGetBlocks(pindexBest, uint256(0));
+    }
+
+    // Requests this peer let time out go back into the pool
+    for (map<uint256, int64_t>::iterator it = pto->mapBlocksInFlight.begin(); it != pto->mapBlocksInFlight.end(); )
+    {
+        if (nNow - it->second > BLOCK_DOWNLOAD_TIMEOUT)
+        {
+            if (fDebugNet)
+                printf("headers-first: block %s from %s timed out\n", it->first.ToString().substr(0,20).c_str(), pto->addr.ToString().c_str());
+            map<uint256, int64_t>::iterator mi = mapBlocksInFlight.find(it->first);
+            if (mi != mapBlocksInFlight.end() && mi->second == it->second)
+                mapBlocksInFlight.erase(mi);
+            pto->mapBlocksInFlight.erase(it++);
+        }
+        else
+            ++it;
+    }
+
+    if (vHeaderChain.empty() || pto->fClient || pto->fDisconnect || !pto->fSuccessfullyConnected)
+        return;
+
+    // Fill this peer's slots from the low end of the window
+    int nWindowEnd = min(nHeaderChainStart + (int)vHeaderChain.size(), nHeaderChainStart + BLOCK_DOWNLOAD_WINDOW);
+    for (int nHeight = nHeaderChainStart; nHeight < nWindowEnd && pto->mapBlocksInFlight.size() < MAX_BLOCKS_IN_TRANSIT_PER_PEER; nHeight++)
+    {
+        if (nHeight > pto->nStartingHeight)
+            break;
+        const uint256& hash = vHeaderChain[nHeight - nHeaderChainStart];
+        if (mapBlockIndex.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+        map<uint256, int64_t>::iterator mi = mapBlocksInFlight.find(hash);
+        if (mi != mapBlocksInFlight.end() && nNow - mi->second <= BLOCK_DOWNLOAD_TIMEOUT)
+            continue;
+
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        mapBlocksInFlight[hash] = nNow;
+        pto->mapBlocksInFlight[hash] = nNow;
+    }
+}
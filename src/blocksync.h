@@ -0,0 +1,77 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKSYNC_H
+#define BITCOIN_BLOCKSYNC_H
+
+#include "uint256.h"
+
+#include <vector>
+
+class CBlock;
+class CBlockIndex;
+class CInv;
+class CNode;
+
+/** Headers-first block download (-headersfirst). One peer at a time feeds us
+ *  the header chain through getheaders; the blocks on it are then requested
+ *  from every suitable peer at once, a moving window ahead of the best block.
+ *  Everything here must be called with cs_main held.
+ */
+extern bool fHeadersFirst;
+
+/** Headers a getheaders reply holds at most; a full reply means there are more */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Stop asking for headers while this many are still waiting for blocks */
+static const unsigned int MAX_HEADERS_AHEAD = 100000;
+/** How far past the first missing block downloads may run */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Blocks simultaneously requested from a single peer */
+static const unsigned int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Seconds before an unanswered block request goes to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** Seconds before an unanswered getheaders makes us pick another peer */
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 120;
+/** Headers kept from a single peer at most: what may wait for blocks, and a
+ *  reply's worth of headers of abandoned branches */
+static const unsigned int MAX_HEADERS_PER_PEER = MAX_HEADERS_AHEAD + 2 * MAX_HEADERS_RESULTS;
+/** Seconds without a block of the header chain arriving before the chain
+ *  is dropped as one nobody has the blocks for */
+static const int64_t HEADERS_CHAIN_STALL_TIMEOUT = 600;
+
+/** Whether there are header chain blocks still to be downloaded. While this
+ *  is true, blocks on the header chain are left to the window; getblocks and
+ *  inv-driven requests still fetch any others. */
+bool IsHeadersSyncActive();
+
+/** Whether hash is a header we are waiting for the block of */
+bool IsHeaderChainBlock(const uint256& hash);
+
+/** Try to make pfrom our header source. Returns false if headers-first sync
+ *  is disabled, in which case the caller should fall back to getblocks. */
+bool StartHeadersSync(CNode* pfrom);
+
+/** Handle a "headers" message */
+bool ProcessHeaders(CNode* pfrom, const std::vector<CBlock>& vHeaders);
+
+/** A block inv that isn't on our header chain: ask the peer for its headers */
+void HeadersSyncBlockAnnounced(CNode* pfrom, const uint256& hash);
+
+/** Book-keeping around ProcessBlock() for a block received from pfrom */
+void HeadersSyncBlockReceived(CNode* pfrom, const uint256& hash);
+void HeadersSyncBlockProcessed(const uint256& hash);
+
+/** Called from SendMessages(): keep header sync going and queue block
+ *  requests for pto into vGetData */
+void HeadersSyncSendMessages(CNode* pto, std::vector<CInv>& vGetData);
+
+/** Whether pindex is hashTip or one of its ancestors according to the best
+ *  header chain. fKnownRet is set to false if hashTip isn't on it. */
+bool IsHeaderChainAncestor(const uint256& hashTip, const CBlockIndex* pindex, bool& fKnownRet);
+
+/** Progress for getinfo-style reporting */
+int GetBestHeaderHeight();
+unsigned int GetBlocksInFlight();
+
+#endif
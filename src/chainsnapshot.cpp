@@ -0,0 +1,473 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainsnapshot.h"
+#include "blockfile.h"
+#include "blockprefetch.h"
+#include "checkpoints.h"
+#include "init.h"
+#include "main.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace boost;
+
+static const char pchChainSnapshotMagic[8] = { 'I', 'O', 'C', 'S', 'N', 'A', 'P', '1' };
+
+struct CChainSnapshotHeader
+{
+    char pchMagic[8];
+    uint32_t nVersion;
+    int32_t nDatabaseVersion;
+    int32_t nHeight;
+    uint32_t nUnused;
+    uint256 hashBlock;
+};
+
+// Block files are copied this much at a time
+static const size_t SNAPSHOT_COPY_CHUNK = 1 << 20;
+
+CChainSnapshotFile::CChainSnapshotFile(FILE* fileIn)
+{
+    file = fileIn;
+    nBytes = 0;
+    SHA256_Init(&ctx);
+}
+
+CChainSnapshotFile::~CChainSnapshotFile()
+{
+    if (file)
+        fclose(file);
+}
+
+bool CChainSnapshotFile::Write(const void* pch, size_t nSize)
+{
+    if (!file || fwrite(pch, 1, nSize, file) != nSize)
+        return false;
+    SHA256_Update(&ctx, pch, nSize);
+    nBytes += nSize;
+    return true;
+}
+
+bool CChainSnapshotFile::Read(void* pch, size_t nSize)
+{
+    if (!file || fread(pch, 1, nSize, file) != nSize)
+        return false;
+    SHA256_Update(&ctx, pch, nSize);
+    nBytes += nSize;
+    return true;
+}
+
+bool CChainSnapshotFile::Commit()
+{
+    if (!file)
+        return false;
+    bool fOk = (fflush(file) == 0);
+    if (fOk)
+        FileCommit(file);
+    fOk = (fclose(file) == 0) && fOk;
+    file = NULL;
+    return fOk;
+}
+
+uint256 CChainSnapshotFile::GetHash() const
+{
+    SHA256_CTX ctxCopy = ctx;
+    uint256 hash;
+    SHA256_Final((unsigned char*)&hash, &ctxCopy);
+    return hash;
+}
+
+static filesystem::path SnapshotLoadingPath()
+{
+    return GetDataDir() / "snapshot.loading";
+}
+
+static bool CopyBlockFileOut(CChainSnapshotFile& file, unsigned int nFile)
+{
+    FILE* filein = fopen(BlockFilePath(nFile).string().c_str(), "rb");
+    if (!filein)
+        return error("DumpChainSnapshot() : unable to open blk%04u.dat", nFile);
+    uint64_t nSize = 0;
+    if (fseek(filein, 0, SEEK_END) == 0)
+        nSize = ftell(filein);
+    fseek(filein, 0, SEEK_SET);
+
+    uint32_t nFileOut = nFile;
+    bool fOk = file.Write(&nFileOut, sizeof(nFileOut)) && file.Write(&nSize, sizeof(nSize));
+    vector<char> vBuf(SNAPSHOT_COPY_CHUNK);
+    for (uint64_t nLeft = nSize; fOk && nLeft > 0; )
+    {
+        size_t nChunk = (size_t)min(nLeft, (uint64_t)vBuf.size());
+        fOk = (fread(&vBuf[0], 1, nChunk, filein) == nChunk) && file.Write(&vBuf[0], nChunk);
+        nLeft -= nChunk;
+    }
+    fclose(filein);
+    if (!fOk)
+        return error("DumpChainSnapshot() : copying blk%04u.dat failed", nFile);
+    return true;
+}
+
+bool DumpChainSnapshot(const filesystem::path& path, CChainSnapshotInfo& info, string& strError)
+{
+    AssertLockHeld(cs_main);
+    if (nPruneTarget || !filesystem::exists(BlockFilePath(1)))
+    {
+        strError = "a pruned node can't write a snapshot";
+        return false;
+    }
+    if (!pindexBest)
+    {
+        strError = "no best block";
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    filesystem::path pathTmp = filesystem::path(path.string() + ".new");
+    FILE* fileout = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileout)
+    {
+        strError = strprintf("unable to open %s", pathTmp.string().c_str());
+        return false;
+    }
+    CChainSnapshotFile file(fileout);
+
+    info = CChainSnapshotInfo();
+    info.nHeight = nBestHeight;
+    info.hashBlock = hashBestChain;
+
+    CChainSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.pchMagic, pchChainSnapshotMagic, sizeof(header.pchMagic));
+    header.nVersion = CHAINSNAPSHOT_VERSION;
+    header.nDatabaseVersion = DATABASE_VERSION;
+    header.nHeight = info.nHeight;
+    header.hashBlock = info.hashBlock;
+    bool fOk = file.Write(&header, sizeof(header));
+
+    // Blocks are only appended under cs_main, so the files hold exactly what
+    // the records point at while we have it
+    for (unsigned int nFile = 1; fOk && filesystem::exists(BlockFilePath(nFile)); nFile++)
+    {
+        fOk = CopyBlockFileOut(file, nFile);
+        info.nBlockFiles++;
+    }
+    uint32_t nEnd = 0;
+    fOk = fOk && file.Write(&nEnd, sizeof(nEnd));
+    fOk = fOk && CTxDB::WriteSnapshotRecords(file, info.nRecords);
+
+    info.hashContent = file.GetHash();
+    fOk = fOk && file.Write(&info.hashContent, sizeof(info.hashContent));
+    info.nBytes = file.GetBytes();
+    fOk = file.Commit() && fOk;
+    if (!fOk || !RenameOver(pathTmp, path))
+    {
+        filesystem::remove(pathTmp);
+        strError = "writing the snapshot failed";
+        return false;
+    }
+    printf("Wrote chainstate snapshot at height %d, %u block files and %"PRIu64" records in %"PRId64"ms\n",
+           info.nHeight, info.nBlockFiles, info.nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+// Everything a load may have written so far
+static void RemoveChainState()
+{
+    for (unsigned int nFile = 1; filesystem::exists(BlockFilePath(nFile)); nFile++)
+        filesystem::remove(BlockFilePath(nFile));
+    filesystem::remove_all(GetDataDir() / "txleveldb");
+    filesystem::remove_all(GetDataDir() / "blkindexleveldb");
+    filesystem::remove(GetDataDir() / "blkindex.snapshot");
+}
+
+static bool CopyBlockFilesIn(CChainSnapshotFile& file, CChainSnapshotInfo& info)
+{
+    vector<char> vBuf(SNAPSHOT_COPY_CHUNK);
+    while (true)
+    {
+        uint32_t nFile;
+        if (!file.Read(&nFile, sizeof(nFile)))
+            return error("LoadChainSnapshot() : read failed");
+        if (nFile == 0)
+            return true;
+        uint64_t nSize;
+        if (nFile != info.nBlockFiles + 1 || !file.Read(&nSize, sizeof(nSize)) || nSize > 0x7F000000)
+            return error("LoadChainSnapshot() : bad block file entry");
+
+        FILE* fileout = fopen(BlockFilePath(nFile).string().c_str(), "wb");
+        if (!fileout)
+            return error("LoadChainSnapshot() : unable to create blk%04u.dat", nFile);
+        bool fOk = true;
+        for (uint64_t nLeft = nSize; fOk && nLeft > 0 && !fRequestShutdown; )
+        {
+            size_t nChunk = (size_t)min(nLeft, (uint64_t)vBuf.size());
+            fOk = file.Read(&vBuf[0], nChunk) && fwrite(&vBuf[0], 1, nChunk, fileout) == nChunk;
+            nLeft -= nChunk;
+        }
+        fOk = fOk && !fRequestShutdown && fflush(fileout) == 0;
+        if (fOk)
+            FileCommit(fileout);
+        fclose(fileout);
+        if (!fOk)
+            return error("LoadChainSnapshot() : copying blk%04u.dat failed", nFile);
+        info.nBlockFiles++;
+    }
+}
+
+static bool LoadChainSnapshotFile(CChainSnapshotFile& file, const string& strName, CChainSnapshotInfo& info, string& strError, bool& fOpenedTxDB)
+{
+    CChainSnapshotHeader header;
+    if (!file.Read(&header, sizeof(header)) ||
+        memcmp(header.pchMagic, pchChainSnapshotMagic, sizeof(header.pchMagic)) != 0 ||
+        header.nVersion != CHAINSNAPSHOT_VERSION)
+    {
+        strError = strprintf(_("%s is not a chainstate snapshot this version can load"), strName.c_str());
+        return false;
+    }
+    if (header.nDatabaseVersion != DATABASE_VERSION)
+    {
+        strError = strprintf(_("%s was written by a version with another database format"), strName.c_str());
+        return false;
+    }
+    info.nHeight = header.nHeight;
+    info.hashBlock = header.hashBlock;
+
+    uint256 hashExpected;
+    if (!Checkpoints::GetSnapshotHash(info.nHeight, info.hashBlock, hashExpected))
+    {
+        strError = strprintf(_("%s is not a published snapshot: there is none for block %s at height %d"),
+                             strName.c_str(), info.hashBlock.ToString().c_str(), info.nHeight);
+        return false;
+    }
+
+    uiInterface.InitMessage(_("Loading chainstate snapshot..."));
+    printf("Loading chainstate snapshot at height %d from %s\n", info.nHeight, strName.c_str());
+    if (!CopyBlockFilesIn(file, info))
+    {
+        strError = strprintf(_("Error copying the block files out of %s"), strName.c_str());
+        return false;
+    }
+
+    CTxDB txdb("cr+");
+    fOpenedTxDB = true;
+    if (!CTxDB::ReadSnapshotRecords(file, info.nRecords))
+    {
+        strError = strprintf(_("Error loading the chainstate records of %s"), strName.c_str());
+        return false;
+    }
+
+    info.hashContent = file.GetHash();
+    uint256 hashTrailer;
+    if (!file.Read(&hashTrailer, sizeof(hashTrailer)) || hashTrailer != info.hashContent)
+    {
+        strError = strprintf(_("%s is damaged"), strName.c_str());
+        return false;
+    }
+    if (info.hashContent != hashExpected)
+    {
+        strError = strprintf(_("%s doesn't match the published snapshot at height %d"), strName.c_str(), info.nHeight);
+        return false;
+    }
+    info.nBytes = file.GetBytes();
+
+    CChainSnapshotState state;
+    state.nHeight = info.nHeight;
+    state.hashBlock = info.hashBlock;
+    if (!txdb.WriteChainSnapshotState(state) || !CTxDB::Flush())
+    {
+        strError = _("Error writing to the tx database");
+        return false;
+    }
+    return true;
+}
+
+bool LoadChainSnapshot(const filesystem::path& path, CChainSnapshotInfo& info, string& strError)
+{
+    info = CChainSnapshotInfo();
+    if (filesystem::exists(SnapshotLoadingPath()))
+    {
+        printf("LoadChainSnapshot() : removing what an interrupted load left behind\n");
+        RemoveChainState();
+    }
+    else if (filesystem::exists(BlockFilePath(1)) || filesystem::exists(GetDataDir() / "txleveldb"))
+    {
+        printf("LoadChainSnapshot() : the data directory already has a block chain, ignoring -loadsnapshot\n");
+        return true;
+    }
+
+    FILE* filein = fopen(path.string().c_str(), "rb");
+    if (!filein)
+    {
+        strError = strprintf(_("Unable to open %s"), path.string().c_str());
+        return false;
+    }
+    uint64_t nFileSize = filesystem::file_size(path);
+    if (!CheckDiskSpace(nFileSize))
+    {
+        fclose(filein);
+        strError = _("Not enough disk space to load the snapshot");
+        return false;
+    }
+
+    // Until the content hash has been checked at the very end nothing that
+    // was loaded may be used, not even after a crash
+    FILE* fileMarker = fopen(SnapshotLoadingPath().string().c_str(), "wb");
+    if (fileMarker)
+        fclose(fileMarker);
+
+    int64_t nStart = GetTimeMillis();
+    bool fOpenedTxDB = false;
+    bool fOk;
+    {
+        CChainSnapshotFile file(filein);
+        fOk = LoadChainSnapshotFile(file, path.string(), info, strError, fOpenedTxDB);
+    }
+    if (!fOk)
+    {
+        if (fOpenedTxDB)
+            CTxDB().Close();
+        RemoveChainState();
+        filesystem::remove(SnapshotLoadingPath());
+        return false;
+    }
+    filesystem::remove(SnapshotLoadingPath());
+    printf("Loaded chainstate snapshot at height %d, %u block files and %"PRIu64" records in %"PRId64"ms\n",
+           info.nHeight, info.nBlockFiles, info.nRecords, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool IsChainSnapshotLoadPending()
+{
+    return filesystem::exists(SnapshotLoadingPath());
+}
+
+bool GetChainSnapshotState(CChainSnapshotState& state)
+{
+    CTxDB txdb("r");
+    return txdb.ReadChainSnapshotState(state);
+}
+
+static bool VerifySnapshotBlock(CTxDB& txdb, const CBlockIndex* pindex, const CPrefetchedBlock& prefetched)
+{
+    const CBlock& block = prefetched.block;
+    if (!prefetched.fRead)
+        return error("VerifySnapshotBlock() : unable to read block %d", pindex->nHeight);
+    if (block.GetHash() != pindex->GetBlockHash())
+        return error("VerifySnapshotBlock() : block %d doesn't match the block index", pindex->nHeight);
+    uint256 hashPrev = pindex->pprev ? pindex->pprev->GetBlockHash() : 0;
+    if (block.hashPrevBlock != hashPrev)
+        return error("VerifySnapshotBlock() : block %d doesn't follow its parent", pindex->nHeight);
+    if (!block.CheckBlock(true, true, pindex->pprev != NULL))
+        return error("VerifySnapshotBlock() : block %d failed CheckBlock", pindex->nHeight);
+
+    // The flags ConnectBlock used at this height
+    unsigned int flags = SCRIPT_VERIFY_NOCACHE;
+    if (V3(pindex->nHeight))
+        flags |= MANDATORY_SCRIPT_VERIFY_FLAGS;
+
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (!txdb.ContainsTx(tx.GetHash()))
+            return error("VerifySnapshotBlock() : %s of block %d isn't in the tx index", tx.GetHash().ToString().c_str(), pindex->nHeight);
+        if (tx.IsCoinBase())
+            continue;
+
+        int64_t nValueIn = 0;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        {
+            const COutPoint& prevout = tx.vin[i].prevout;
+            CTransaction txPrev;
+            CTxIndex txindexPrev;
+            if (!txdb.ReadDiskTx(prevout.hash, txPrev, txindexPrev))
+                return error("VerifySnapshotBlock() : %s spends unknown %s", tx.GetHash().ToString().c_str(), prevout.hash.ToString().c_str());
+            if (prevout.n >= txPrev.vout.size() || prevout.n >= txindexPrev.vSpent.size() || txindexPrev.vSpent[prevout.n].IsNull())
+                return error("VerifySnapshotBlock() : %s spends %s, which the tx index has unspent", tx.GetHash().ToString().c_str(), prevout.ToString().c_str());
+            if (!VerifySignature(txPrev, tx, i, flags, 0))
+                return error("VerifySnapshotBlock() : %s VerifySignature failed", tx.GetHash().ToString().c_str());
+            nValueIn += txPrev.vout[prevout.n].nValue;
+        }
+        // The stake reward is checked with the proof-of-stake at connect time
+        if (!tx.IsCoinStake() && nValueIn < tx.GetValueOut())
+            return error("VerifySnapshotBlock() : %s spends more than its inputs", tx.GetHash().ToString().c_str());
+    }
+    return true;
+}
+
+// Progress is saved this often
+static const int SNAPSHOT_VERIFY_SAVE_INTERVAL = 1000;
+
+void ThreadVerifyChainSnapshot(void* parg)
+{
+    RenameThread("iocoin-snapcheck");
+    vnThreadsRunning[THREAD_SNAPSHOTCHECK]++;
+
+    CChainSnapshotState state;
+    if (GetChainSnapshotState(state) && !state.fFailed && !state.IsVerified())
+    {
+        printf("Verifying chainstate snapshot history from height %d to %d\n", state.nVerifiedHeight, state.nHeight);
+        int64_t nStart = GetTimeMillis();
+        CTxDB txdb("r");
+        std::vector<CBlockIndex*> vIndex;
+        {
+            READ_LOCK(cs_chainstate);
+            for (int nHeight = state.nVerifiedHeight; nHeight <= state.nHeight; nHeight++)
+            {
+                CBlockIndex* pindex = FindBlockByHeight(nHeight);
+                if (!pindex)
+                    break;
+                vIndex.push_back(pindex);
+            }
+        }
+
+        // One reader is enough to keep the checks, which are what costs, fed
+        CBlockPrefetcher prefetcher(vIndex, BLOCK_PREFETCH_COUNT, 1);
+        prefetcher.Start();
+        int nHeight = state.nVerifiedHeight;
+        for (; nHeight <= state.nHeight && !fShutdown; nHeight++)
+        {
+            auto_ptr<CPrefetchedBlock> pblock = prefetcher.Next();
+            if (!pblock.get())
+            {
+                // A block missing from the best chain, unless shutting down
+                state.fFailed = !fShutdown;
+                break;
+            }
+            const CBlockIndex* pindex = pblock->pindex;
+            if ((nHeight == state.nHeight && pindex->GetBlockHash() != state.hashBlock) || !VerifySnapshotBlock(txdb, pindex, *pblock))
+            {
+                state.fFailed = true;
+                break;
+            }
+            if (nHeight % SNAPSHOT_VERIFY_SAVE_INTERVAL == SNAPSHOT_VERIFY_SAVE_INTERVAL - 1 || nHeight == state.nHeight)
+            {
+                state.nVerifiedHeight = nHeight + 1;
+                LOCK(cs_main);
+                CTxDB("r+").WriteChainSnapshotState(state);
+            }
+        }
+
+        if (state.fFailed)
+        {
+            {
+                LOCK(cs_main);
+                CTxDB("r+").WriteChainSnapshotState(state);
+            }
+            // Nothing past a bad history can be trusted, so the node stops
+            // and won't start again before a -reindex
+            strMiscWarning = strprintf(_("Error: block %d of the chainstate snapshot failed verification. Please restart with -reindex."), nHeight);
+            printf("*** %s\n", strMiscWarning.c_str());
+            uiInterface.ThreadSafeMessageBox(strMiscWarning, "I/OCoin", CClientUIInterface::OK | CClientUIInterface::ICON_ERROR | CClientUIInterface::MODAL);
+            StartShutdown();
+        }
+        else if (state.IsVerified())
+            printf("Chainstate snapshot history verified in %"PRId64"s\n", (GetTimeMillis() - nStart) / 1000);
+    }
+    vnThreadsRunning[THREAD_SNAPSHOTCHECK]--;
+}
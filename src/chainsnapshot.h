@@ -0,0 +1,133 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_CHAINSNAPSHOT_H
+#define BITCOIN_CHAINSNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <boost/filesystem/path.hpp>
+
+#include <openssl/sha.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+/** A chainstate snapshot lets a new node start from a checkpoint instead of
+ *  connecting every block since the genesis block. It holds everything the
+ *  node keeps about the chain up to that height:
+ *
+ *    header    magic, format and database versions, height and block hash
+ *    blocks    each blkNNNN.dat file: its number, size and contents
+ *    records   every record of the tx and block index databases: the tx
+ *              index, the unspent outputs, undo data, block index, alias
+ *              index and whatever optional indexes the writer kept
+ *    trailer   the SHA-256 of everything before it
+ *
+ *  The block files are copied unchanged so that the positions in the
+ *  records stay valid. A snapshot is only loaded (-loadsnapshot) if the
+ *  block is a checkpoint and Checkpoints::GetSnapshotHash() has the file's
+ *  hash; blocks after it are then checked as usual, while the history
+ *  before it is checked by ThreadVerifyChainSnapshot in the background.
+ */
+
+static const unsigned int CHAINSNAPSHOT_VERSION = 1;
+
+/** Writes or reads a snapshot file, hashing everything that goes through.
+ *  Takes ownership of fileIn. */
+class CChainSnapshotFile
+{
+public:
+    explicit CChainSnapshotFile(FILE* fileIn);
+    ~CChainSnapshotFile();
+
+    bool Write(const void* pch, size_t nSize);
+    bool Read(void* pch, size_t nSize);
+    // Sync and close a file that was written to
+    bool Commit();
+
+    // SHA-256 of the bytes written or read so far
+    uint256 GetHash() const;
+    uint64_t GetBytes() const { return nBytes; }
+
+private:
+    FILE* file;
+    SHA256_CTX ctx;
+    uint64_t nBytes;
+
+    CChainSnapshotFile(const CChainSnapshotFile&);
+    CChainSnapshotFile& operator=(const CChainSnapshotFile&);
+};
+
+/** What dumpsnapshot wrote or -loadsnapshot loaded */
+struct CChainSnapshotInfo
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint256 hashContent;
+    uint64_t nBytes;
+    unsigned int nBlockFiles;
+    uint64_t nRecords;
+
+    CChainSnapshotInfo()
+    {
+        nHeight = -1;
+        nBytes = 0;
+        nBlockFiles = 0;
+        nRecords = 0;
+    }
+};
+
+/** Kept in the tx database of a node that started from a snapshot */
+class CChainSnapshotState
+{
+public:
+    int nHeight;
+    uint256 hashBlock;
+    // Blocks below this height have been checked in the background
+    int nVerifiedHeight;
+    bool fFailed;
+
+    CChainSnapshotState()
+    {
+        nHeight = -1;
+        nVerifiedHeight = 0;
+        fFailed = false;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nHeight);
+        READWRITE(hashBlock);
+        READWRITE(nVerifiedHeight);
+        READWRITE(fFailed);
+    )
+
+    bool IsVerified() const { return nVerifiedHeight > nHeight; }
+};
+
+/** Write a snapshot of the chainstate at the current best block. Needs
+ *  cs_main, which is held for the whole copy. */
+bool DumpChainSnapshot(const boost::filesystem::path& path, CChainSnapshotInfo& info, std::string& strError);
+
+/** Load a snapshot into an empty data directory. Must run before the block
+ *  index is loaded. Does nothing if the data directory already has a chain. */
+bool LoadChainSnapshot(const boost::filesystem::path& path, CChainSnapshotInfo& info, std::string& strError);
+
+/** True if a load was interrupted and left a data directory that can't be
+ *  used until it is loaded again */
+bool IsChainSnapshotLoadPending();
+
+/** False if this node didn't start from a snapshot */
+bool GetChainSnapshotState(CChainSnapshotState& state);
+
+/** Check the blocks below the snapshot height: that they match the block
+ *  index, their proofs, merkle roots and block signatures, and the scripts
+ *  and amounts of their inputs against the transactions they spend. Picks
+ *  up where it stopped on the next start. A failure shuts the node down,
+ *  and it won't start again until it is reindexed. */
+void ThreadVerifyChainSnapshot(void* parg);
+
+#endif
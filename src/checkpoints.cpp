@@ -51,6 +51,14 @@ namespace Checkpoints
         ( 0, hashGenesisBlockTestNet )
         ;
 
+    typedef std::map<int, uint256> MapSnapshots;
+
+    // Chainstate snapshots (see chainsnapshot.h), by the height of the
+    // checkpoint they were taken at, and the SHA-256 of the snapshot file.
+    // Added together with the checkpoint when a snapshot is published.
+    static MapSnapshots mapSnapshots;
+    static MapSnapshots mapSnapshotsTestnet;
+
     bool CheckHardened(int nHeight, const uint256& hash)
     {
         MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
@@ -67,14 +75,46 @@ namespace Checkpoints
         return checkpoints.rbegin()->first;
     }
 
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex)
+    uint256 GetLastCheckpointHash()
+    {
+        MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
+
+        return checkpoints.rbegin()->second;
+    }
+
+    int GetCheckpointHeight(const uint256& hash)
+    {
+        MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
+
+        BOOST_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
+            if (i.second == hash)
+                return i.first;
+        return -1;
+    }
+
+    bool GetSnapshotHash(int nHeight, const uint256& hashBlock, uint256& hashContent)
+    {
+        MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
+        MapSnapshots& snapshots = (fTestNet ? mapSnapshotsTestnet : mapSnapshots);
+
+        MapCheckpoints::const_iterator i = checkpoints.find(nHeight);
+        if (i == checkpoints.end() || i->second != hashBlock)
+            return false;
+        MapSnapshots::const_iterator j = snapshots.find(nHeight);
+        if (j == snapshots.end())
+            return false;
+        hashContent = j->second;
+        return true;
+    }
+
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex)
     {
         MapCheckpoints& checkpoints = (fTestNet ? mapCheckpointsTestnet : mapCheckpoints);
 
         BOOST_REVERSE_FOREACH(const MapCheckpoints::value_type& i, checkpoints)
         {
             const uint256& hash = i.second;
-            std::map<uint256, CBlockIndex*>::const_iterator t = mapBlockIndex.find(hash);
+            BlockMap::const_iterator t = mapBlockIndex.find(hash);
             if (t != mapBlockIndex.end())
                 return t->second;
         }
@@ -116,10 +156,9 @@ namespace Checkpoints
             // Received an older checkpoint, trace back from current checkpoint
             // to the same height of the received checkpoint to verify
             // that current checkpoint should be a descendant block
-            CBlockIndex* pindex = pindexSyncCheckpoint;
-            while (pindex->nHeight > pindexCheckpointRecv->nHeight)
-                if (!(pindex = pindex->pprev))
-                    return error("ValidateSyncCheckpoint: pprev null - block index structure failure");
+            CBlockIndex* pindex = pindexSyncCheckpoint->GetAncestor(pindexCheckpointRecv->nHeight);
+            if (!pindex)
+                return error("ValidateSyncCheckpoint: pprev null - block index structure failure");
             if (pindex->GetBlockHash() != hashCheckpoint)
             {
                 hashInvalidCheckpoint = hashCheckpoint;
@@ -131,10 +170,9 @@ namespace Checkpoints
         // Received checkpoint should be a descendant block of the current
         // checkpoint. Trace back to the same height of current checkpoint
         // to verify.
-        CBlockIndex* pindex = pindexCheckpointRecv;
-        while (pindex->nHeight > pindexSyncCheckpoint->nHeight)
-            if (!(pindex = pindex->pprev))
-                return error("ValidateSyncCheckpoint: pprev2 null - block index structure failure");
+        CBlockIndex* pindex = pindexCheckpointRecv->GetAncestor(pindexSyncCheckpoint->nHeight);
+        if (!pindex)
+            return error("ValidateSyncCheckpoint: pprev2 null - block index structure failure");
         if (pindex->GetBlockHash() != hashSyncCheckpoint)
         {
             hashInvalidCheckpoint = hashCheckpoint;
@@ -205,7 +243,8 @@ namespace Checkpoints
     // Automatically select a suitable sync-checkpoint
     uint256 AutoSelectSyncCheckpoint()
     {
-        const CBlockIndex *pindex = pindexBest;
+        // Nothing within nCheckpointSpan blocks of the tip qualifies
+        const CBlockIndex *pindex = pindexBest->GetAncestor(std::max(0, pindexBest->nHeight - nCheckpointSpan));
         // Search backward for a block within max span and maturity window
         while (pindex->pprev && (pindex->GetBlockTime() + nCheckpointSpan * GetTargetSpacing(nBestHeight) > pindexBest->GetBlockTime() || pindex->nHeight + nCheckpointSpan > pindexBest->nHeight))
             pindex = pindex->pprev;
@@ -226,10 +265,9 @@ namespace Checkpoints
         if (nHeight > pindexSync->nHeight)
         {
             // trace back to same height as sync-checkpoint
-            const CBlockIndex* pindex = pindexPrev;
-            while (pindex->nHeight > pindexSync->nHeight)
-                if (!(pindex = pindex->pprev))
-                    return error("CheckSync: pprev null - block index structure failure");
+            const CBlockIndex* pindex = pindexPrev->GetAncestor(pindexSync->nHeight);
+            if (!pindex)
+                return error("CheckSync: pprev null - block index structure failure");
             if (pindex->nHeight < pindexSync->nHeight || pindex->GetBlockHash() != hashSyncCheckpoint)
                 return false; // only descendant of sync-checkpoint can pass check
         }
@@ -248,7 +286,7 @@ namespace Checkpoints
         if (hashBlock == hashPendingCheckpoint)
             return true;
         if (mapOrphanBlocks.count(hashPendingCheckpoint)
-            && hashBlock == WantedByOrphan(mapOrphanBlocks[hashPendingCheckpoint]))
+            && hashBlock == WantedByOrphan(hashPendingCheckpoint))
             return true;
         return false;
     }
@@ -369,14 +407,42 @@ const std::string CSyncCheckpoint::strMasterPubKey = "0400df1d33140bd7ef27eaafb9
 
 std::string CSyncCheckpoint::strMasterPrivKey = "";
 
+// Every peer relays the same checkpoint, so each signed message is
+// verified once and the outcome kept, good or bad
+static const unsigned int MAX_CHECKPOINT_SIG_CACHE = 1000;
+static CCriticalSection cs_mapCheckpointSigs;
+static std::map<uint256, bool> mapCheckpointSigs;
+
 // ppcoin: verify signature of sync-checkpoint message
 bool CSyncCheckpoint::CheckSignature()
 {
-    CKey key;
-    if (!key.SetPubKey(ParseHex(CSyncCheckpoint::strMasterPubKey)))
-        return error("CSyncCheckpoint::CheckSignature() : SetPubKey failed");
-    if (!key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig))
-        return error("CSyncCheckpoint::CheckSignature() : verify signature failed");
+    uint256 hashSigned = Hash(vchMsg.begin(), vchMsg.end(), vchSig.begin(), vchSig.end());
+    bool fKnown = false;
+    {
+        LOCK(cs_mapCheckpointSigs);
+        std::map<uint256, bool>::const_iterator mi = mapCheckpointSigs.find(hashSigned);
+        if (mi != mapCheckpointSigs.end())
+        {
+            if (!mi->second)
+                return false;
+            fKnown = true;
+        }
+    }
+
+    if (!fKnown)
+    {
+        CKey key;
+        bool fValid = key.SetPubKey(ParseHex(CSyncCheckpoint::strMasterPubKey)) &&
+                      key.Verify(Hash(vchMsg.begin(), vchMsg.end()), vchSig);
+        {
+            LOCK(cs_mapCheckpointSigs);
+            if (mapCheckpointSigs.size() >= MAX_CHECKPOINT_SIG_CACHE)
+                mapCheckpointSigs.clear();
+            mapCheckpointSigs[hashSigned] = fValid;
+        }
+        if (!fValid)
+            return error("CSyncCheckpoint::CheckSignature() : verify signature failed");
+    }
 
     // Now unserialize the data
     CDataStream sMsg(vchMsg, SER_NETWORK, PROTOCOL_VERSION);
@@ -391,6 +457,12 @@ bool CSyncCheckpoint::ProcessSyncCheckpoint(CNode* pfrom)
         return false;
 
     LOCK(Checkpoints::cs_hashSyncCheckpoint);
+    // Another peer relaying the checkpoint we are at: it has it, nothing else to do
+    if (pfrom && hashCheckpoint == Checkpoints::hashSyncCheckpoint)
+    {
+        pfrom->hashCheckpointKnown = hashCheckpoint;
+        return false;
+    }
     if (!mapBlockIndex.count(hashCheckpoint))
     {
         // We haven't received the checkpoint chain, keep the checkpoint as pending
@@ -403,7 +475,7 @@ bool CSyncCheckpoint::ProcessSyncCheckpoint(CNode* pfrom)
             pfrom->PushGetBlocks(pindexBest, hashCheckpoint);
             // ask directly as well in case rejected earlier by duplicate
             // proof-of-stake because getblocks may not get it this time
-            pfrom->AskFor(CInv(MSG_BLOCK, mapOrphanBlocks.count(hashCheckpoint)? WantedByOrphan(mapOrphanBlocks[hashCheckpoint]) : hashCheckpoint));
+            pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(hashCheckpoint)));
         }
         return false;
     }
@@ -5,6 +5,7 @@
 #define  BITCOIN_CHECKPOINT_H
 
 #include <map>
+#include <boost/unordered_map.hpp>
 #include "net.h"
 #include "util.h"
 
@@ -17,6 +18,8 @@
 class uint256;
 class CBlockIndex;
 class CSyncCheckpoint;
+struct BlockHasher;
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 
 /** Block-chain checkpoints are compiled-in sanity checks.
  * They are updated every release or three.
@@ -40,8 +43,18 @@ namespace Checkpoints
     // Return conservative estimate of total number of blocks, 0 if unknown
     int GetTotalBlocksEstimate();
 
+    // Hash of the last hard-coded checkpoint
+    uint256 GetLastCheckpointHash();
+
+    // Height of hash if it is a hard-coded checkpoint, otherwise -1
+    int GetCheckpointHeight(const uint256& hash);
+
+    // Content hash of the published chainstate snapshot at the checkpoint
+    // at nHeight, false if hashBlock isn't that checkpoint or there is none
+    bool GetSnapshotHash(int nHeight, const uint256& hashBlock, uint256& hashContent);
+
     // Returns last CBlockIndex* in mapBlockIndex that is a checkpoint
-    CBlockIndex* GetLastCheckpoint(const std::map<uint256, CBlockIndex*>& mapBlockIndex);
+    CBlockIndex* GetLastCheckpoint(const BlockMap& mapBlockIndex);
 
     extern uint256 hashSyncCheckpoint;
     extern CSyncCheckpoint checkpointMessage;
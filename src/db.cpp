@@ -79,17 +79,20 @@ bool CDBEnv::Open(boost::filesystem::path pathEnv_)
     if (GetBoolArg("-privdb", true))
         nEnvFlags |= DB_PRIVATE;
 
-    int nDbCache = GetArg("-dbcache", 25);
+    // The wallets have their own budget; -dbcache is LevelDB's
+    int nDbCache = max((int64_t)1, GetArg("-walletdbcache", DEFAULT_WALLET_DB_CACHE));
     dbenv.set_lg_dir(pathLogDir.string().c_str());
     dbenv.set_cachesize(nDbCache / 1024, (nDbCache % 1024)*1048576, 1);
-    dbenv.set_lg_bsize(1048576);
-    dbenv.set_lg_max(10485760);
+    // A log file must hold at least four log buffers
+    unsigned int nLogBuffer = max((int64_t)64, GetArg("-dblogbuffer", 1024)) * 1024;
+    dbenv.set_lg_bsize(nLogBuffer);
+    dbenv.set_lg_max(max(10485760U, 4 * nLogBuffer));
 
     // Bugfix: Bump lk_max_locks default to 537000, to safely handle reorgs with up to 5 blocks reversed
     // dbenv.set_lk_max_locks(10000);
-    dbenv.set_lk_max_locks(537000);
+    dbenv.set_lk_max_locks(max((int64_t)1000, GetArg("-dbmaxlocks", 537000)));
 
-    dbenv.set_lk_max_objects(10000);
+    dbenv.set_lk_max_objects(max((int64_t)1000, GetArg("-dbmaxlockobjects", 10000)));
     dbenv.set_errfile(fopen(pathErrorFile.string().c_str(), "a")); /// debug
     dbenv.set_flags(DB_AUTO_COMMIT, 1);
     dbenv.set_flags(DB_TXN_WRITE_NOSYNC, 1);
@@ -303,12 +306,9 @@ void CDB::Close()
     activeTxn = NULL;
     pdb = NULL;
 
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
-
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100)*1024 : 0, nMinutes, 0);
+    // Changes are already in the disk log; move them into the data file
+    // once the log has grown or -dbcheckpointmins have passed, not on every close
+    bitdb.dbenv.txn_checkpoint(GetArg("-dblogsize", 100)*1024, max((int64_t)0, GetArg("-dbcheckpointmins", 1)), 0);
 
     {
         LOCK(bitdb.cs_db);
@@ -316,6 +316,66 @@ void CDB::Close()
     }
 }
 
+bool CDBEnv::GetStats(CDBEnvStats& stats)
+{
+    if (!fDbEnvInit || fMockDb)
+        return false;
+
+    DB_MPOOL_STAT* pmpstat = NULL;
+    DB_MPOOL_FSTAT** ppfstat = NULL;
+    int ret = dbenv.memp_stat(&pmpstat, &ppfstat, 0);
+    if (ret != 0)
+        return error("CDBEnv::GetStats() : memp_stat failed %s (%d)", DbEnv::strerror(ret), ret);
+    stats.nCacheSize = (uint64_t)pmpstat->st_gbytes * 1073741824 + pmpstat->st_bytes;
+    stats.nHits = pmpstat->st_cache_hit;
+    stats.nMisses = pmpstat->st_cache_miss;
+    stats.nPages = pmpstat->st_pages;
+    stats.nPagesDirty = pmpstat->st_page_dirty;
+    stats.nPagesIn = pmpstat->st_page_in;
+    stats.nPagesOut = pmpstat->st_page_out;
+    stats.nEvictions = pmpstat->st_ro_evict + pmpstat->st_rw_evict;
+    stats.vFiles.clear();
+    for (DB_MPOOL_FSTAT** pp = ppfstat; pp && *pp; pp++)
+    {
+        CDBFileStats file;
+        file.strFile = (*pp)->file_name ? (*pp)->file_name : "";
+        file.nPageSize = (*pp)->st_pagesize;
+        file.nHits = (*pp)->st_cache_hit;
+        file.nMisses = (*pp)->st_cache_miss;
+        file.nPagesCreated = (*pp)->st_page_create;
+        file.nPagesIn = (*pp)->st_page_in;
+        file.nPagesOut = (*pp)->st_page_out;
+        stats.vFiles.push_back(file);
+    }
+    free(pmpstat);
+    free(ppfstat);
+
+    DB_LOCK_STAT* plockstat = NULL;
+    ret = dbenv.lock_stat(&plockstat, 0);
+    if (ret != 0)
+        return error("CDBEnv::GetStats() : lock_stat failed %s (%d)", DbEnv::strerror(ret), ret);
+    stats.nMaxLocks = plockstat->st_maxlocks;
+    stats.nLocks = plockstat->st_nlocks;
+    stats.nLocksPeak = plockstat->st_maxnlocks;
+    stats.nMaxObjects = plockstat->st_maxobjects;
+    stats.nObjects = plockstat->st_nobjects;
+    stats.nObjectsPeak = plockstat->st_maxnobjects;
+    stats.nLockWaits = plockstat->st_lock_wait;
+    stats.nDeadlocks = plockstat->st_ndeadlocks;
+    free(plockstat);
+
+    DB_LOG_STAT* plogstat = NULL;
+    ret = dbenv.log_stat(&plogstat, 0);
+    if (ret != 0)
+        return error("CDBEnv::GetStats() : log_stat failed %s (%d)", DbEnv::strerror(ret), ret);
+    stats.nLogBuffer = plogstat->st_lg_bsize;
+    stats.nLogWritten = (uint64_t)plogstat->st_w_mbytes * 1048576 + plogstat->st_w_bytes;
+    stats.nLogWrites = plogstat->st_wcount;
+    stats.nLogSyncs = plogstat->st_scount;
+    free(plogstat);
+    return true;
+}
+
 void CDBEnv::CloseDb(const string& strFile)
 {
     {
@@ -449,17 +509,17 @@ void CDBEnv::Flush(bool fShutdown)
         {
             string strFile = (*mi).first;
             int nRefCount = (*mi).second;
-            printf("%s refcount=%d\n", strFile.c_str(), nRefCount);
+            LogPrint("db", "%s refcount=%d\n", strFile.c_str(), nRefCount);
             if (nRefCount == 0)
             {
                 // Move log data to the dat file
                 CloseDb(strFile);
-                printf("%s checkpoint\n", strFile.c_str());
+                LogPrint("db", "%s checkpoint\n", strFile.c_str());
                 dbenv.txn_checkpoint(0, 0, 0);
-                printf("%s detach\n", strFile.c_str());
+                LogPrint("db", "%s detach\n", strFile.c_str());
                 if (!fMockDb)
                     dbenv.lsn_reset(strFile.c_str(), 0);
-                printf("%s closed\n", strFile.c_str());
+                LogPrint("db", "%s closed\n", strFile.c_str());
                 mapFileUseCount.erase(mi++);
             }
             else
@@ -584,76 +644,135 @@ bool CAddrDB::Read(CAddrMan& addr)
       return false;
     }
 
-    void LocatorNodeDB::filter(CBlockIndex* p__)
-    {
-      {
-        CBlock block;
-        block.ReadFromDisk(p__);
-        uint256 h;
+bool CAliasCacheDB::ReadAll(vector<pair<vector<unsigned char>, vector<AliasIndex> > >& vRet)
+{
+    vRet.clear();
+    Dbc* pcursor = GetCursor();
+    if (!pcursor)
+        return false;
 
-        unsigned int nTxPos = p__->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
-        BOOST_FOREACH(CTransaction& tx, block.vtx) 
+    bool fRet = true;
+    try {
+        while (true)
         {
-          if(tx.nVersion == CTransaction::DION_TX_VERSION)
-          {
-            vector<vector<unsigned char> > vvchArgs;
-            int op, nOut;
-
-            aliasTx(tx, op, nOut, vvchArgs);
-            if((op == OP_ALIAS_SET || op == OP_ALIAS_RELAY))
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            if (ret == DB_NOTFOUND)
+                break;
+            if (ret != 0)
             {
-              const vector<unsigned char>& v = vvchArgs[0];
-              string a = stringFromVch(v);
-           
-              if (GetTransaction(tx.GetHash(), tx, h))
-              {
-                const CTxOut& txout = tx.vout[nOut];
-                const CScript& scriptPubKey = aliasStrip(txout.scriptPubKey);
-                string s = scriptPubKey.GetBitcoinAddress();
-                CTxIndex txI;
-                CTxDB txdb("r");
-                if(txdb.ReadTxIndex(tx.GetHash(), txI))
-                {
-                  vector<unsigned char> vchValue;
-                  vector<AliasIndex> vtxPos;
-                  uint256 hash;
-                  AliasIndex txPos2;
-                  CDiskTxPos txPos(p__->nFile, p__->nBlockPos, nTxPos);
-            
-                  txPos2.nHeight = p__->nHeight;
-                  txPos2.vValue = vchValue;
-                  txPos2.vAddress = s;
-                  txPos2.txPos = txPos;
-                  if(op == OP_ALIAS_SET && !lKey(vvchArgs[0]))
-                  {
-                  vtxPos.push_back(txPos2);
-                    lPut(vvchArgs[0], vtxPos);
-                  }
-                  else if(op == OP_ALIAS_SET && lKey(vvchArgs[0]))
-                  {
-                    vector<AliasIndex> v;
-                    lGet(vvchArgs[0], v);
-                    AliasIndex t = v.back();
-                    if(p__->nHeight - t.nHeight >= scaleMonitor())
-                    {
-                  vtxPos.push_back(txPos2);
-                      lPut(vvchArgs[0], vtxPos);
-                    }
-                  }
-                  else if(op == OP_ALIAS_RELAY && lKey(vvchArgs[0]))
-                  {
-                    txPos2.vValue = vvchArgs[1];
-                  vtxPos.push_back(txPos2);
-                    lPut(vvchArgs[0], vtxPos);
-                  }
-                  else
-                    vtxPos.push_back(txPos2);
-
-                }
-              }
+                fRet = false;
+                break;
             }
-          }
-          nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+
+            string strType;
+            ssKey >> strType;
+            if (strType != "alias_")
+                continue;
+            pair<vector<unsigned char>, vector<AliasIndex> > entry;
+            ssKey >> entry.first;
+            ssValue >> entry.second;
+            vRet.push_back(entry);
         }
-      }
-    } 
+    }
+    catch (std::exception &e) {
+        fRet = false;
+    }
+    pcursor->close();
+    return fRet;
+}
+
+bool MigrateAliasCache()
+{
+    filesystem::path pathCache = GetDataDir() / "aliascache.dat";
+    if (!filesystem::exists(pathCache))
+        return true;
+
+    vector<pair<vector<unsigned char>, vector<AliasIndex> > > vAliases;
+    {
+        CAliasCacheDB aliasCacheDB("r");
+        if (!aliasCacheDB.ReadAll(vAliases))
+            return error("MigrateAliasCache() : error reading aliascache.dat");
+    }
+    bitdb.CloseDb("aliascache.dat");
+
+    // Records of the same kind under the same keys, so an interrupted move
+    // is simply done again on the next start. Only the latest entry of each
+    // is read, as alias updates write them.
+    CTxDB txdb("r+");
+    for (unsigned int i = 0; i < vAliases.size(); i++)
+    {
+        vector<AliasIndex>& vtxPos = vAliases[i].second;
+        if (vtxPos.size() > 1)
+            vtxPos.erase(vtxPos.begin(), vtxPos.end() - 1);
+        if (!txdb.WriteAliasIndex(vAliases[i].first, vtxPos))
+            return error("MigrateAliasCache() : error writing alias index");
+    }
+    if (!CTxDB::Flush())
+        return error("MigrateAliasCache() : error flushing alias index");
+
+    RenameOver(pathCache, GetDataDir() / "aliascache.dat.old");
+    printf("Moved %"PRIszu" aliases from aliascache.dat to the alias index\n", vAliases.size());
+    return true;
+}
+
+void LocatorNodeDB::ScanBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, vector<CAliasUpdate>& vRet)
+{
+    vRet.clear();
+    unsigned int nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        vector<vector<unsigned char> > vvchArgs;
+        int op, nOut;
+        CTxIndex txindex;
+        // Through txdb, which may hold this block's tx index in its pending
+        // batch still
+        if (tx.nVersion == CTransaction::DION_TX_VERSION && aliasTx(tx, op, nOut, vvchArgs) &&
+            (op == OP_ALIAS_SET || op == OP_ALIAS_RELAY) && txdb.ReadTxIndex(tx.GetHash(), txindex))
+        {
+            CAliasUpdate update;
+            update.op = op;
+            update.vchAlias = vvchArgs[0];
+            update.pos.txPos = CDiskTxPos(pindex->nFile, pindex->nBlockPos, nTxPos);
+            update.pos.nHeight = pindex->nHeight;
+            if (op == OP_ALIAS_RELAY)
+                update.pos.vValue = vvchArgs[1];
+            update.pos.vAddress = aliasStrip(tx.vout[nOut].scriptPubKey).GetBitcoinAddress();
+            vRet.push_back(update);
+        }
+        nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+}
+
+void LocatorNodeDB::Apply(const vector<CAliasUpdate>& vUpdates)
+{
+    BOOST_FOREACH(const CAliasUpdate& update, vUpdates)
+    {
+        vector<AliasIndex> vtxPos;
+        bool fHave = lGet(update.vchAlias, vtxPos);
+        // A set takes a free or expired alias, a relay updates a taken one;
+        // either way the new entry becomes the alias's history
+        bool fWrite;
+        if (update.op == OP_ALIAS_SET)
+            fWrite = !fHave || vtxPos.empty() || update.pos.nHeight - vtxPos.back().nHeight >= scaleMonitor();
+        else
+            fWrite = fHave;
+        if (fWrite)
+            lPut(update.vchAlias, vector<AliasIndex>(1, update.pos));
+    }
+}
+
+void LocatorNodeDB::filter(const CBlock& block, CBlockIndex* pindex)
+{
+    vector<CAliasUpdate> vUpdates;
+    ScanBlock(txdb, block, pindex, vUpdates);
+    Apply(vUpdates);
+}
+
+void LocatorNodeDB::filter(CBlockIndex* pindex)
+{
+    CBlock block;
+    if (block.ReadFromDisk(pindex))
+        filter(block, pindex);
+}
@@ -31,6 +31,9 @@ class CTxDB;
 
 extern unsigned int nWalletDBUpdated;
 
+// Megabytes of BerkeleyDB cache shared by the wallets, see -walletdbcache
+static const int64_t DEFAULT_WALLET_DB_CACHE = 25;
+
 void ThreadFlushWalletDB(void* parg);
 bool BackupWallet(const __wx__& wallet, const std::string& strDest);
 
@@ -38,6 +41,47 @@ extern bool aliasTx(const CTransaction& tx, int& op, int& nOut, vector<vector<un
 extern CScript aliasStrip(const CScript& scriptIn);
 extern bool txTrace(CDiskTxPos& txPos, vector<unsigned char>& vchValue, uint256& hash, int& nHeight);
 
+/** Memory pool statistics of one database file in the environment */
+struct CDBFileStats
+{
+    std::string strFile;
+    uint64_t nPageSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nPagesCreated;
+    uint64_t nPagesIn;
+    uint64_t nPagesOut;
+};
+
+/** Cache, lock and log counters of the BerkeleyDB environment, from the
+ *  memp_stat, lock_stat and log_stat calls. Sizes are in bytes. */
+struct CDBEnvStats
+{
+    uint64_t nCacheSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nPages;
+    uint64_t nPagesDirty;
+    uint64_t nPagesIn;
+    uint64_t nPagesOut;
+    uint64_t nEvictions;
+    std::vector<CDBFileStats> vFiles;
+
+    uint64_t nMaxLocks;
+    uint64_t nLocks;
+    uint64_t nLocksPeak;
+    uint64_t nMaxObjects;
+    uint64_t nObjects;
+    uint64_t nObjectsPeak;
+    uint64_t nLockWaits;
+    uint64_t nDeadlocks;
+
+    uint64_t nLogBuffer;
+    uint64_t nLogWritten;
+    uint64_t nLogWrites;
+    uint64_t nLogSyncs;
+};
+
 class CDBEnv
 {
 private:
@@ -81,6 +125,7 @@ public:
     void Close();
     void Flush(bool fShutdown);
     void CheckpointLSN(std::string strFile);
+    bool GetStats(CDBEnvStats& stats);
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
@@ -327,68 +372,138 @@ public:
     bool Write(const CAddrMan& addr);
     bool Read(CAddrMan& addr);
 };
-class AliasIndex
-{
-  public:
-    CDiskTxPos txPos;
-    unsigned int nHeight;
-    std::vector<unsigned char> vValue;
-    std::string vAddress;
 
-    AliasIndex()
+/** The aliascache.dat of earlier versions, read once to move its alias
+ *  histories into the LevelDB alias index */
+class CAliasCacheDB : public CDB
+{
+public:
+    CAliasCacheDB(const char* pszMode="r") : CDB("aliascache.dat", pszMode)
     {
     }
 
-    AliasIndex(CDiskTxPos txPosIn, unsigned int nHeightIn, std::vector<unsigned char> vValueIn, std::string vAddressIn)
-    {
-        txPos = txPosIn;
-        nHeight = nHeightIn;
-        vValue = vValueIn;
-        vAddress = vAddressIn;
-    }
+    bool ReadAll(std::vector<std::pair<std::vector<unsigned char>, std::vector<AliasIndex> > >& vRet);
+};
+
+// Move aliascache.dat, if there still is one, into the alias index
+bool MigrateAliasCache();
 
-    IMPLEMENT_SERIALIZE
-    (
-        READWRITE(txPos);
-        READWRITE(nHeight);
-        READWRITE(vValue);
-        READWRITE(vAddress);
-    )
+/** An alias set or relay found in a block, in the form the alias index
+ *  keeps it */
+class CAliasUpdate
+{
+public:
+    int op;
+    vchType vchAlias;
+    AliasIndex pos;
 };
 
-class LocatorNodeDB : public CDB
+// Drop the resolved record of an alias, or of all of them, from memory
+void InvalidateAliasRecord(const vchType& vchAlias);
+void ClearAliasRecords();
+// Resolved records held and the bytes they take, as charged to -aliascache
+void GetAliasRecordUsage(size_t& nEntries, size_t& nUsage);
+
+/** DIONS alias histories, kept in the LevelDB alias index. As cheap to make
+ *  as the CTxDB it sits on; built on a caller's CTxDB, its writes go in that
+ *  one's batch and commit with the block being connected. */
+class LocatorNodeDB
 {
+private:
+    CTxDB txdbOwn;
+    CTxDB& txdb;
+    // Written into the caller's batch, to forget again once it committed
+    std::vector<vchType> vWritten;
+
+    void Written(const vchType& alias)
+    {
+        InvalidateAliasRecord(alias);
+        if (&txdb != &txdbOwn)
+            vWritten.push_back(alias);
+    }
+
 public:
-    LocatorNodeDB(const char* pszMode="cr+") : CDB("aliascache.dat", pszMode)
-    {     
+    LocatorNodeDB(const char* pszMode="cr+") : txdbOwn(pszMode), txdb(txdbOwn)
+    {
+    }
+
+    explicit LocatorNodeDB(CTxDB& txdbIn) : txdb(txdbIn)
+    {
+    }
+
+    // A lookup made while the batch was pending still saw the old record
+    ~LocatorNodeDB()
+    {
+        for (unsigned int i = 0; i < vWritten.size(); i++)
+            InvalidateAliasRecord(vWritten[i]);
     }
 
     bool lPut(const vchType& alias, const std::vector<AliasIndex>& vtxPos)
     {
-        return Write(make_pair(std::string("alias_"), alias), vtxPos, true);
+        Written(alias);
+        return txdb.WriteAliasIndex(alias, vtxPos);
     }
 
     bool lGet(const vchType& alias, std::vector<AliasIndex>& vtxPos)
     {
-        return Read(make_pair(std::string("alias_"), alias), vtxPos);
+        return txdb.ReadAliasIndex(alias, vtxPos);
     }
 
     bool lKey(const vchType& alias)
     {
-        return Exists(make_pair(std::string("alias_"), alias));
+        return txdb.HaveAliasIndex(alias);
     }
 
     bool EraseName(const vchType& alias)
     {
-        return Erase(make_pair(std::string("alias_"), alias));
+        Written(alias);
+        return txdb.EraseAliasIndex(alias);
+    }
+
+    // Every alias with its history, in key order
+    bool lGetAll(std::vector<std::pair<vchType, std::vector<AliasIndex> > >& vRet)
+    {
+        return txdb.ReadAllAliasIndex(vRet);
+    }
+
+    bool ReadIndexedHeight(int& nHeight)
+    {
+        return txdb.ReadAliasIndexHeight(nHeight);
+    }
+
+    bool WriteIndexedHeight(int nHeight)
+    {
+        return txdb.WriteAliasIndexHeight(nHeight);
     }
 
+    // The alias updates of a main chain block, found without touching the
+    // index so that blocks can be scanned on several threads
+    static void ScanBlock(CTxDB& txdb, const CBlock& block, const CBlockIndex* pindex, std::vector<CAliasUpdate>& vRet);
+    // Applies one block's updates, in the order ScanBlock found them
+    void Apply(const std::vector<CAliasUpdate>& vUpdates);
+
     bool ydwiWhldw();
     bool test();
+    void filter(const CBlock& block, CBlockIndex* pindex);
     void filter(CBlockIndex*);
     void filter() { return; };
 };
 
+/** What resolving an alias comes to: its latest history entry, the
+ *  transaction that set it, its owner and its value */
+class CAliasRecord
+{
+public:
+    AliasIndex index;
+    CTransaction tx;
+    std::string strAddress;
+    vchType vchValue;
+};
+
+// The record of an alias, expired or not, from memory when it was resolved
+// lately. False if the alias has no history.
+bool aliasRecord(LocatorNodeDB& db, const vchType& vchAlias, CAliasRecord& rec);
+
 
 
 #endif // BITCOIN_DB_H
@@ -7,10 +7,13 @@
 #include "wallet.h"
 #include "init.h"
 #include "dions.h"
+#include "metrics.h"
+#include "blockprefetch.h"
 
 #include "bitcoinrpc.h"
 #include "main.h"
 #include "state.h"
+#include "ui_interface.h"
 #include "json/json_spirit_reader_template.h"
 #include "json/json_spirit_writer_template.h"
 #include "json/json_spirit_utils.h"
@@ -29,6 +32,11 @@
 #include <boost/iostreams/stream.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
 using namespace std;
 using namespace json_spirit;
 using namespace boost::iostreams;
@@ -42,14 +50,15 @@ template<typename T> void ConvertTo(Value& value, bool fAllowNull=false);
 
 std::map<vchType, uint256> mapMyMessages;
 std::map<vchType, uint256> mapLocator;
-std::map<vchType, set<uint256> > mapState;
+PendingAliasMap mapState;
+boost::unordered_map<uint256, vchType, SaltedTxidHasher> mapStateByTx;
 std::map<vchType, set<uint256> > k1Export;
 
-void xsc(CBlockIndex*);
 static bool vclose(string&,string&);
-static int linkSet(vector<vchType>, CBlockIndex*, CDiskTxPos&, const string&, LocatorNodeDB&);
+static int linkSet(const vector<vchType>&, CBlockIndex*, CDiskTxPos&, const string&, LocatorNodeDB&);
 
 CScript aliasStrip(const CScript& scriptIn);
+bool aliasAddress(const CTransaction& tx, std::string& strAddress);
 #ifdef GUI
 extern std::map<uint160, vchType> mapLocatorHashes;
 #endif
@@ -118,9 +127,9 @@ Value downloadDecryptEPID(const Array& params, bool fHelp);
 extern unsigned int LR_SHIFT__[LR_R];
 
 bool searchAliasEncrypted2(string l, uint256& wtxInHash);
-bool getImportedPubKey(string senderAddress, string recipientAddress, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch, bool& thresholdCount);
-bool getImportedPubKey(string senderAddress, string recipientAddress, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch);
-bool getImportedPubKey(string recipientAddress, vchType& recipientPubKeyVch);
+bool getImportedPubKey(const string& senderAddress, const string& recipientAddress, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch, bool& thresholdCount);
+bool getImportedPubKey(const string& senderAddress, const string& recipientAddress, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch);
+bool getImportedPubKey(const string& recipientAddress, vchType& recipientPubKeyVch);
 bool internalReference__(string recipientAddress, vchType& recipientPubKeyVch);
 bool pk(string senderAddress, string recipientAddress, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch);
 
@@ -141,6 +150,42 @@ vchType vchFromString(const std::string& str)
   return vchType(strbeg, strbeg + str.size());
 }
 
+// Read from upload files this much at a time
+static const size_t XUNIT_CHUNK_SIZE = 64 * 1024;
+
+// Gzip a file the way uploads store it, one chunk at a time. Stops reading
+// and returns false once the output passes nMax, however large the file.
+static bool CompressXUnitFile(const char* pszPath, string& strRet, size_t nMax)
+{
+  strRet.clear();
+  ifstream file(pszPath, ios_base::in | ios_base::binary);
+  filtering_ostream out;
+  out.push(gzip_compressor());
+  out.push(boost::iostreams::back_inserter(strRet));
+
+  vector<char> vBuf(XUNIT_CHUNK_SIZE);
+  while(file)
+  {
+    file.read(&vBuf[0], vBuf.size());
+    out.write(&vBuf[0], file.gcount());
+    if(strRet.size() > nMax)
+      return false;
+  }
+  // Flushes the rest of the deflate stream and the gzip trailer
+  out.reset();
+  return strRet.size() <= nMax;
+}
+
+// Gunzip a stored payload straight into a file, without a copy of it
+static void WriteXUnitFile(const string& value, const char* pszPath)
+{
+  filtering_streambuf<input> in;
+  in.push(gzip_decompressor());
+  in.push(array_source(value.data(), value.size()));
+  ofstream file(pszPath, ios_base::out | ios_base::binary);
+  boost::iostreams::copy(in, file);
+}
+
 string stringFromVch(const vector<unsigned char> &vch)
 {
   string res;
@@ -157,10 +202,11 @@ bool channelPredicate(string ext, string& tor)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_PUBLIC_KEY, vchFromString(ext), vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vchType vchS, vchR, vchKey, vchAes, vchSig;
         int nOut;
@@ -200,76 +246,39 @@ Value gw1(const Array& params, bool fHelp)
     Array oRes;
     LocatorNodeDB ln1Db("r");
 
-    Dbc* cursorp;
-    try 
+    vector<pair<vchType, vector<AliasIndex> > > vAliases;
+    ln1Db.lGetAll(vAliases);
+    for (unsigned int n = 0; n < vAliases.size(); n++)
     {
-      cursorp = ln1Db.GetCursor(); 
+      const vector<AliasIndex>& vtxPos = vAliases[n].second;
+      if (vtxPos.empty())
+        continue;
 
-      Dbt key, data;
-      int ret;
+      Object o;
+      string a = stringFromVch(vAliases[n].first);
+      o.push_back(Pair("alias", a));
 
-      while ((ret = cursorp->get(&key, &data, DB_NEXT)) == 0) 
-      {
-        printf("  key \n");
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write((char*)key.get_data(), key.get_size());
-
-        string k1;
-        ssKey >> k1;
-        if(k1 == "alias_")
-        {
-          Object o;
-          printf("  k1 %s\n", k1.c_str());
-          vchType k2;
-          ssKey >> k2; 
-          string a = stringFromVch(k2);
-          printf("  k2 %s\n", a.c_str());
-          o.push_back(Pair("alias", a));
-
-          vector<AliasIndex> vtxPos;
-          CDataStream ssValue((char*)data.get_data(), (char*)data.get_data() + data.get_size(), SER_DISK, CLIENT_VERSION);
-          ssValue >> vtxPos;
-
-          AliasIndex i = vtxPos.back();
-          string i_address = i.vAddress;
-          o.push_back(Pair("address", i_address));
-          o.push_back(Pair("h", (int)i.nHeight));
-          oRes.push_back(o);
-        }
-      }
-      if (ret != DB_NOTFOUND) 
-      {
-        // ret should be DB_NOTFOUND upon exiting the loop.
-        // Dbc::get() will by default throw an exception if any
-        // significant errors occur, so by default this if block
-        // can never be reached. 
-      }
-    } 
-    catch(DbException &e) 
-    {
-      //ln1Db.err(e.get_errno(), "Error!");
-    } 
-    catch(std::exception &e) 
-    {
-      //ln1Db.errx("Error! %s", e.what());
+      AliasIndex i = vtxPos.back();
+      string i_address = i.vAddress;
+      o.push_back(Pair("address", i_address));
+      o.push_back(Pair("h", (int)i.nHeight));
+      oRes.push_back(o);
     }
 
-    if (cursorp != NULL) 
-      cursorp->close();
-
   printf("XXXX xsc scanning for current dions\n");
   LocatorNodeDB l("cr+");
   CTxDB txdb("r");
 
-  CBlockIndex* p = pindexGenesisBlock;
-  for(; p; p=p->pnext) 
-  {
-    if(p->nHeight < 1625000)
-      continue;
+  std::vector<CBlockIndex*> vIndex;
+  for(CBlockIndex* p = FindBlockByHeight(1625000); p; p=p->pnext) 
+    vIndex.push_back(p);
 
-    CBlock block;
-    CDiskTxPos txPos;
-    block.ReadFromDisk(p);
+  CBlockPrefetcher prefetcher(vIndex, 256);
+  prefetcher.Start();
+  for(auto_ptr<CPrefetchedBlock> pblock = prefetcher.Next(); pblock.get(); pblock = prefetcher.Next()) 
+  {
+    CBlockIndex* p = pblock->pindex;
+    CBlock& block = pblock->block;
     uint256 h;
 
     BOOST_FOREACH(CTransaction& tx, block.vtx) 
@@ -349,7 +358,7 @@ int GetTxPosHeight(CDiskTxPos& txPos)
     CBlock block;
     if(!block.ReadFromDisk(txPos.nFile, txPos.nBlockPos, false))
         return 0;
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if(mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex =(*mi).second;
@@ -500,7 +509,6 @@ bool txPost(const vector<pair<CScript, int64_t> >& vecSend, const __wx__Tx& wtxI
               continue;
             }
 
-            wtxNew.AddSupportingTransactions(txdb);
             wtxNew.fTimeReceivedIsTxTime = true;
             break;
           }
@@ -525,59 +533,28 @@ int atod(const std::string& addr, std::string& d)
       AliasIndex i = vtxPos_.back();
     }
 
-    Dbc* cursorp;
-    try 
+    vector<pair<vchType, vector<AliasIndex> > > vAliases;
+    ln1Db->lGetAll(vAliases);
+    for (unsigned int n = 0; n < vAliases.size(); n++)
     {
-      cursorp = ln1Db->GetCursor(); 
-
-      Dbt key, data;
-      int ret;
+      string a = stringFromVch(vAliases[n].first);
 
-      while ((ret = cursorp->get(&key, &data, DB_NEXT)) == 0) 
+      BOOST_FOREACH(const AliasIndex& i, vAliases[n].second) 
       {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write((char*)key.get_data(), key.get_size());
-
-        string k1;
-        ssKey >> k1;
-        if(k1 == "alias_")
+        int k = i.nHeight + scaleMonitor() - pindexBest->nHeight;
+        if(k<=0) 
         {
-          vchType k2;
-          ssKey >> k2; 
-          string a = stringFromVch(k2);
-
-          vector<AliasIndex> vtxPos;
-          CDataStream ssValue((char*)data.get_data(), (char*)data.get_data() + data.get_size(), SER_DISK, CLIENT_VERSION);
-          ssValue >> vtxPos;
-
-          BOOST_FOREACH(AliasIndex& i, vtxPos) 
-          {
-            int k = i.nHeight + scaleMonitor() - pindexBest->nHeight;
-            if(k<=0) 
-            {
-              continue;
-            }
-            string i_address = (i.vAddress).c_str();
-            if(i_address == addr)
-            {
-              d = a;
-              break;
-            }
-          }
+          continue;
+        }
+        string i_address = (i.vAddress).c_str();
+        if(i_address == addr)
+        {
+          d = a;
+          break;
         }
       }
-    } 
-    catch(DbException &e) 
-    { 
-   
-    } 
-    catch(std::exception &e) 
-    {
     }
 
-    if (cursorp != NULL) 
-      cursorp->close(); 
-
     if(d == "")
       return -1;
 
@@ -647,24 +624,113 @@ bool txTrace(CDiskTxPos& txPos, vector<unsigned char>& vchValue, uint256& hash,
     hash = tx.GetHash();
     return true;
 }
-bool aliasTx(LocatorNodeDB& aliasCacheDB, const vector<unsigned char> &vchAlias, CTransaction& tx)
+// Resolved alias records, most recently used first, and the bytes they
+// take. nAliasRecordGeneration counts invalidations, so that a record read
+// while one happened isn't kept.
+static CCriticalSection cs_aliasrecords;
+typedef list<pair<vchType, CAliasRecord> > AliasRecordList;
+static AliasRecordList lruAliasRecords;
+static map<vchType, AliasRecordList::iterator> mapAliasRecords;
+static uint64_t nAliasRecordBytes = 0;
+static uint64_t nAliasRecordGeneration = 0;
+
+static unsigned int AliasRecordSize(const pair<vchType, CAliasRecord>& item)
+{
+    return item.first.size() + ::GetSerializeSize(item.second.tx, SER_NETWORK, PROTOCOL_VERSION) +
+           item.second.strAddress.size() + item.second.vchValue.size() + item.second.index.vValue.size() + 128;
+}
+
+static void EraseAliasRecord(map<vchType, AliasRecordList::iterator>::iterator mi)
+{
+    nAliasRecordBytes -= AliasRecordSize(*mi->second);
+    lruAliasRecords.erase(mi->second);
+    mapAliasRecords.erase(mi);
+}
+
+void InvalidateAliasRecord(const vchType& vchAlias)
+{
+    LOCK(cs_aliasrecords);
+    nAliasRecordGeneration++;
+    map<vchType, AliasRecordList::iterator>::iterator mi = mapAliasRecords.find(vchAlias);
+    if (mi != mapAliasRecords.end())
+        EraseAliasRecord(mi);
+}
+
+void ClearAliasRecords()
+{
+    LOCK(cs_aliasrecords);
+    nAliasRecordGeneration++;
+    lruAliasRecords.clear();
+    mapAliasRecords.clear();
+    nAliasRecordBytes = 0;
+}
+
+void GetAliasRecordUsage(size_t& nEntries, size_t& nUsage)
 {
+    LOCK(cs_aliasrecords);
+    nEntries = mapAliasRecords.size();
+    nUsage = nAliasRecordBytes;
+}
+
+static CMetric metricAliasLookups("iocoin_alias_lookups_total", "DIONS alias records looked up.", METRIC_COUNTER);
+static CMetric metricAliasCacheHits("iocoin_alias_cache_hits_total", "DIONS alias lookups answered by the record cache.", METRIC_COUNTER);
+
+bool aliasRecord(LocatorNodeDB& db, const vchType& vchAlias, CAliasRecord& rec)
+{
+    metricAliasLookups.Inc();
+    uint64_t nGeneration;
+    {
+        LOCK(cs_aliasrecords);
+        map<vchType, AliasRecordList::iterator>::iterator mi = mapAliasRecords.find(vchAlias);
+        if (mi != mapAliasRecords.end())
+        {
+            lruAliasRecords.splice(lruAliasRecords.begin(), lruAliasRecords, mi->second);
+            rec = mi->second->second;
+            metricAliasCacheHits.Inc();
+            return true;
+        }
+        nGeneration = nAliasRecordGeneration;
+    }
 
     vector<AliasIndex> vtxPos;
-    if(!aliasCacheDB.lGet(vchAlias, vtxPos) || vtxPos.empty())
+    if(!db.lGet(vchAlias, vtxPos) || vtxPos.empty())
         return false;
 
-    AliasIndex& txPos = vtxPos.back();
+    rec.index = vtxPos.back();
+    if(!rec.tx.ReadFromDisk(rec.index.txPos))
+        return error("aliasRecord() : could not read tx from disk");
+    rec.strAddress = "";
+    aliasAddress(rec.tx, rec.strAddress);
+    rec.vchValue.clear();
+    aliasTxValue(rec.tx, rec.vchValue);
+
+    uint64_t nLimit = (uint64_t)GetArg("-aliascache", DEFAULT_ALIAS_CACHE) << 20;
+    LOCK(cs_aliasrecords);
+    if (nGeneration == nAliasRecordGeneration && !mapAliasRecords.count(vchAlias))
+    {
+        lruAliasRecords.push_front(make_pair(vchAlias, rec));
+        mapAliasRecords[vchAlias] = lruAliasRecords.begin();
+        nAliasRecordBytes += AliasRecordSize(lruAliasRecords.front());
+        while (nAliasRecordBytes > nLimit && !lruAliasRecords.empty())
+            EraseAliasRecord(mapAliasRecords.find(lruAliasRecords.back().first));
+    }
+    return true;
+}
+
+bool aliasTx(LocatorNodeDB& aliasCacheDB, const vector<unsigned char> &vchAlias, CTransaction& tx)
+{
+    CAliasRecord rec;
+    if(!aliasRecord(aliasCacheDB, vchAlias, rec))
+        return false;
 
-    int nHeight = txPos.nHeight;
+    int nHeight = rec.index.nHeight;
     if(nHeight + scaleMonitor() <= pindexBest->nHeight)
     {
         string alias = stringFromVch(vchAlias);
         return false;
     }
 
-    if(!tx.ReadFromDisk(txPos.txPos))
-        return error("aliasTx() : could not read tx from disk");
+    tx = rec.tx;
     return true;
 }
 bool aliasAddress(const CTransaction& tx, std::string& strAddress)
@@ -803,10 +869,11 @@ Value publicKeyExports(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_PUBLIC_KEY, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
             int nOut;
@@ -861,10 +928,11 @@ Value publicKeys(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_PUBLIC_KEY, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchS, vchR, vchKey, vchAes, vchSig;
             int nOut;
@@ -944,6 +1012,19 @@ Value publicKeys(const Array& params, bool fHelp)
     return oRes;
 }
 
+// DecryptMessage for the wallet's encrypted alias names and keys, keyed by
+// the ciphertext so an RSA private-key operation is done once per unlock
+static bool DecryptMessageCached(const string& rsaPrivKey, const string& encrypted, string& decryptedMsg)
+{
+  const uint256 hash = Hash(encrypted.begin(), encrypted.end());
+  if(pwalletMain->GetPlaintext(hash, decryptedMsg))
+    return true;
+  if(!DecryptMessage(rsaPrivKey, encrypted, decryptedMsg))
+    return false;
+  pwalletMain->SetPlaintext(hash, decryptedMsg);
+  return true;
+}
+
 bool hk(string addrStr)
 {
   cba r(addrStr);
@@ -981,10 +1062,11 @@ Value decryptedMessageList(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_ENCRYPTED_MESSAGE, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
         {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchSender, vchRecipient, vchEncryptedMessage, ivVch, vchSig;
             int nOut;
@@ -1016,62 +1098,67 @@ Value decryptedMessageList(const Array& params, bool fHelp)
             aliasObj.push_back(Pair("time", t));
 
 
-            string rsaPrivKey;
-            string recipient = stringFromVch(vchRecipient);
-
-            cba r(myAddr);
-            if(!r.IsValid())
-            {
-              continue;
-            }
-
-            CKeyID keyID;
-            if(!r.GetKeyID(keyID))
-              throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to key");
-            CKey key;
-            if(!pwalletMain->GetKey(keyID, key))
+            // Decrypted once per unlock; later listings reuse the plaintext
+            string decrypted;
+            if(!pwalletMain->GetPlaintext(tx.GetHash(), decrypted))
             {
-              continue;
-            }
+              string rsaPrivKey;
+              string recipient = stringFromVch(vchRecipient);
 
-            CPubKey pubKey = key.GetPubKey();
+              cba r(myAddr);
+              if(!r.IsValid())
+              {
+                continue;
+              }
 
-            string aesBase64Plain;
-            vector<unsigned char> aesRawVector;
-            if(pwalletMain->aes_(pubKey, fKey, aesBase64Plain))
-            {
-              bool fInvalid = false;
-              aesRawVector = DecodeBase64(aesBase64Plain.c_str(), &fInvalid);
-            }
-            else
-            {
-              vchType aesKeyBase64EncryptedVch;
-              vchType pub_key = pubKey.Raw();
-              if(getImportedPubKey(myAddr, fKey, pub_key, aesKeyBase64EncryptedVch))
+              CKeyID keyID;
+              if(!r.GetKeyID(keyID))
+                throw JSONRPCError(RPC_TYPE_ERROR, "Address does not refer to key");
+              CKey key;
+              if(!pwalletMain->GetKey(keyID, key))
               {
-                string aesKeyBase64Encrypted = stringFromVch(aesKeyBase64EncryptedVch);
+                continue;
+              }
 
-                string privRSAKey;
-                if(!pwalletMain->envCP0(pubKey, privRSAKey))
-                  throw JSONRPCError(RPC_TYPE_ERROR, "Failed to retrieve private RSA key");
+              CPubKey pubKey = key.GetPubKey();
 
-                string decryptedAESKeyBase64;
-                DecryptMessage(privRSAKey, aesKeyBase64Encrypted, decryptedAESKeyBase64);
+              string aesBase64Plain;
+              vector<unsigned char> aesRawVector;
+              if(pwalletMain->aes_(pubKey, fKey, aesBase64Plain))
+              {
                 bool fInvalid = false;
-                aesRawVector = DecodeBase64(decryptedAESKeyBase64.c_str(), &fInvalid);
+                aesRawVector = DecodeBase64(aesBase64Plain.c_str(), &fInvalid);
               }
               else
               {
-                throw JSONRPCError(RPC_WALLET_ERROR, "No local symmetric key and no imported symmetric key found for recipient");
+                vchType aesKeyBase64EncryptedVch;
+                vchType pub_key = pubKey.Raw();
+                if(getImportedPubKey(myAddr, fKey, pub_key, aesKeyBase64EncryptedVch))
+                {
+                  string aesKeyBase64Encrypted = stringFromVch(aesKeyBase64EncryptedVch);
+
+                  string privRSAKey;
+                  if(!pwalletMain->envCP0(pubKey, privRSAKey))
+                    throw JSONRPCError(RPC_TYPE_ERROR, "Failed to retrieve private RSA key");
+
+                  string decryptedAESKeyBase64;
+                  DecryptMessageCached(privRSAKey, aesKeyBase64Encrypted, decryptedAESKeyBase64);
+                  bool fInvalid = false;
+                  aesRawVector = DecodeBase64(decryptedAESKeyBase64.c_str(), &fInvalid);
+                }
+                else
+                {
+                  throw JSONRPCError(RPC_WALLET_ERROR, "No local symmetric key and no imported symmetric key found for recipient");
+                }
               }
-            }
 
-            string decrypted;
-            string iv128Base64 = stringFromVch(ivVch);
-            DecryptMessageAES(stringFromVch(vchEncryptedMessage),
-                              decrypted,
-                              aesRawVector,
-                              iv128Base64);
+              string iv128Base64 = stringFromVch(ivVch);
+              DecryptMessageAES(stringFromVch(vchEncryptedMessage),
+                                decrypted,
+                                aesRawVector,
+                                iv128Base64);
+              pwalletMain->SetPlaintext(tx.GetHash(), decrypted);
+            }
 
             aliasObj.push_back(Pair("plain_text", decrypted));
             aliasObj.push_back(Pair("iv128Base64", stringFromVch(ivVch)));
@@ -1109,10 +1196,11 @@ Value plainTextMessageList(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_ENCRYPTED_MESSAGE, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
         {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
 
 
@@ -1478,10 +1566,11 @@ Value aliasOut(const Array& params, bool fHelp)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                  pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vchType vchAlias, vchValue;
         int nOut;
@@ -1526,7 +1615,7 @@ Value aliasOut(const Array& params, bool fHelp)
         }
           mapAliasVchInt[vchFromString(decrypted)] = nHeight;
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
           if(k1 != decrypted) 
           {
             continue;
@@ -1563,12 +1652,7 @@ Value aliasOut(const Array& params, bool fHelp)
 
   if(found == true)
   {
-    stringstream is(value, ios_base::in | ios_base::binary);   
-    filtering_streambuf<input> in__;
-    in__.push(gzip_decompressor());
-    in__.push(is);
-    ofstream file__(out__, ios_base::out | ios_base::binary);
-    boost::iostreams::copy(in__, file__);
+    WriteXUnitFile(value, out__);
     return true;
   }
 
@@ -1595,10 +1679,11 @@ Value nodeValidate(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchAlias, vchValue;
             int nOut;
@@ -1643,7 +1728,7 @@ Value nodeValidate(const Array& params, bool fHelp)
               continue;
             }
 
-            DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+            DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
 
             aliasObj.push_back(Pair("alias", decrypted));
           }
@@ -1758,10 +1843,11 @@ Value nodeRetrieve(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_ALIAS, vchFromString(k1), vDionTx, 1 << OP_ALIAS_ENCRYPTED);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchAlias, vchValue;
             int nOut;
@@ -1805,7 +1891,7 @@ Value nodeRetrieve(const Array& params, bool fHelp)
             continue;
           }
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
           if(k1 != decrypted) 
           {
             continue;
@@ -1895,10 +1981,11 @@ Value getNodeRecord(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchAlias, vchValue;
             int nOut;
@@ -1942,7 +2029,7 @@ Value getNodeRecord(const Array& params, bool fHelp)
             continue;
           }
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
           if(k1 != decrypted) 
           {
             continue;
@@ -2034,10 +2121,11 @@ bool searchAliasEncrypted2(string alias, uint256& wtxInHash)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                    pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vchType vchAlias, vchValue;
         int nOut;
@@ -2085,7 +2173,7 @@ bool searchAliasEncrypted2(string alias, uint256& wtxInHash)
             continue;
           }
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
           std::transform(decrypted.begin(), decrypted.end(), decrypted.begin(), ::tolower);
           if(decrypted == alias)
           {
@@ -2110,10 +2198,11 @@ bool searchAliasEncrypted(string alias, uint256& wtxInHash)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                    pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vchType vchAlias, vchValue;
         int nOut;
@@ -2155,7 +2244,7 @@ bool searchAliasEncrypted(string alias, uint256& wtxInHash)
             throw JSONRPCError(RPC_WALLET_ERROR, "error p0");
           }
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
           if(decrypted == alias)
           {
             found=true;
@@ -2195,10 +2284,14 @@ Value aliasList__(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        if(vchNodeLocator.empty())
+          pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+        else
+          pwalletMain->ListDionTxs(DION_OPS_ALIAS, vchNodeLocator, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchAlias, vchValue;
             int nOut;
@@ -2238,7 +2331,7 @@ Value aliasList__(const Array& params, bool fHelp)
             CPubKey pubKey = key.GetPubKey();
             if(pwalletMain->envCP0(pubKey, rsaPrivKey) == true)
             {
-              DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+              DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
               aliasObj.push_back(Pair("alias", decrypted));
             }
           }
@@ -2273,7 +2366,7 @@ Value aliasList__(const Array& params, bool fHelp)
                   CPubKey pubKey = key0.GetPubKey();
                   if(pwalletMain->envCP0(pubKey, rsaPrivKey) == true)
                   {
-                    DecryptMessage(rsaPrivKey, stringFromVch(vvchPrevArgsRead[0]), decrypted);
+                    DecryptMessageCached(rsaPrivKey, stringFromVch(vvchPrevArgsRead[0]), decrypted);
                     aliasObj.push_back(Pair("alias", decrypted));
                   }
                 }
@@ -2383,10 +2476,14 @@ Value aliasList(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        if(vchNodeLocator.empty())
+          pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+        else
+          pwalletMain->ListDionTxs(DION_OPS_ALIAS, vchNodeLocator, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            __wx__Tx& tx = item.second;
+            __wx__Tx& tx = *ptx;
 
             vchType vchAlias, vchValue;
             int nOut;
@@ -2426,7 +2523,7 @@ Value aliasList(const Array& params, bool fHelp)
             CPubKey pubKey = key.GetPubKey();
             if(pwalletMain->envCP0(pubKey, rsaPrivKey) == true)
             {
-              DecryptMessage(rsaPrivKey, stringFromVch(vchAlias), decrypted);
+              DecryptMessageCached(rsaPrivKey, stringFromVch(vchAlias), decrypted);
               aliasObj.push_back(Pair("alias", decrypted));
             }
           }
@@ -2460,7 +2557,7 @@ Value aliasList(const Array& params, bool fHelp)
                   CPubKey pubKey = key0.GetPubKey();
                   if(pwalletMain->envCP0(pubKey, rsaPrivKey) == true)
                   {
-                    DecryptMessage(rsaPrivKey, stringFromVch(vvchPrevArgsRead[0]), decrypted);
+                    DecryptMessageCached(rsaPrivKey, stringFromVch(vvchPrevArgsRead[0]), decrypted);
                     aliasObj.push_back(Pair("alias", decrypted));
                   }
                 }
@@ -2660,12 +2757,7 @@ Value transform(const Array& params, bool fHelp)
     aesRawVector,
     reference);
 
-  stringstream is(decrypted, ios_base::in | ios_base::binary);   
-  filtering_streambuf<input> in__;
-  in__.push(gzip_decompressor());
-  in__.push(is);
-  ofstream file__("T", ios_base::binary);
-  boost::iostreams::copy(in__, file__);
+  WriteXUnitFile(decrypted, "T");
 
   return true;
 }
@@ -3008,10 +3100,11 @@ Value vEPID(const Array& params, bool fHelp)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                  pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vector< vector<unsigned char> > vv;
         int nOut;
@@ -3063,14 +3156,14 @@ Value vEPID(const Array& params, bool fHelp)
         }
           mapAliasVchInt[vchFromString(decrypted)] = nHeight;
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vv[0]), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vv[0]), decrypted);
           if(k1.ToString() != r.ToString()) 
           {
             continue;
           }
           else
           {
-            printf(">>>> decrypted %s\n", decrypted.c_str());
+            LogPrint("dions", ">>>> decrypted %s\n", decrypted.c_str());
             vchNodeLocator = vchFromString(decrypted);
             vvch = vv;
             found=true;
@@ -3157,12 +3250,7 @@ Value vEPID(const Array& params, bool fHelp)
 
     try
     {
-      stringstream is(value, ios_base::in | ios_base::binary);   
-      filtering_streambuf<input> in__;
-      in__.push(gzip_decompressor());
-      in__.push(is);
-      ofstream file__(out__, ios_base::binary);
-      boost::iostreams::copy(in__, file__);
+      WriteXUnitFile(value, out__);
     }
     catch(std::exception& e)
     {
@@ -3201,10 +3289,11 @@ Value validate(const Array& params, bool fHelp)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                  pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_ALIAS, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
       {
-        const __wx__Tx& tx = item.second;
+        const __wx__Tx& tx = *ptx;
 
         vector< vector<unsigned char> > vv;
         int nOut;
@@ -3256,7 +3345,7 @@ Value validate(const Array& params, bool fHelp)
         }
           mapAliasVchInt[vchFromString(decrypted)] = nHeight;
 
-          DecryptMessage(rsaPrivKey, stringFromVch(vv[0]), decrypted);
+          DecryptMessageCached(rsaPrivKey, stringFromVch(vv[0]), decrypted);
           if(k1 != decrypted) 
           {
             continue;
@@ -3348,12 +3437,7 @@ Value validate(const Array& params, bool fHelp)
 
     try
     {
-      stringstream is(value, ios_base::in | ios_base::binary);   
-      filtering_streambuf<input> in__;
-      in__.push(gzip_decompressor());
-      in__.push(is);
-      ofstream file__(out__, ios_base::binary);
-      boost::iostreams::copy(in__, file__);
+      WriteXUnitFile(value, out__);
     }
     catch(std::exception& e)
     {
@@ -3387,23 +3471,15 @@ Value transientStatus__C(const Array& params, bool fHelp)
       return ret;
     }
 
-    ifstream file(locatorFile, ios_base::in | ios_base::binary);
-    filtering_streambuf<input> in;
-    in.push(gzip_compressor());
-    in.push(file);
-
-    stringstream ss;
-    boost::iostreams::copy(in, ss);
-
-    string s = ss.str();
-    if(s.size() > MAX_XUNIT_LENGTH) 
+    string s;
+    if(!CompressXUnitFile(locatorFile, s, MAX_XUNIT_LENGTH))
     {
       ret.push_back(Pair("status", "error"));
       ret.push_back(Pair("message", "Locator file compressed size too large"));
       return ret;
     }
-   
-    const vchType vchValue = vchFromValue(s);
+
+    const vchType vchValue = vchFromString(s);
 
 
     __wx__Tx wtx;
@@ -3566,19 +3642,11 @@ Value updateEncryptedAliasFile(const Array& params, bool fHelp)
     if(!fs::exists(p))
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Locator file does not exist");
 
-    ifstream file(locatorFile, ios_base::in | ios_base::binary);
-    filtering_streambuf<input> in;
-    in.push(gzip_compressor());
-    in.push(file);
-
-    stringstream ss;
-    boost::iostreams::copy(in, ss);
-
-    string s = ss.str();
-    if(s.size() > MAX_XUNIT_LENGTH) 
+    string s;
+    if(!CompressXUnitFile(locatorFile, s, MAX_XUNIT_LENGTH))
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Locator file too large");
-   
-    const vchType vchValue = vchFromValue(s);
+
+    const vchType vchValue = vchFromString(s);
 
     int CRC__KEY = relay_inv(INTERN_REF0__, EXTERN_REF0__);
 
@@ -4870,23 +4938,15 @@ Value transientStatus__(const Array& params, bool fHelp)
       return ret;
     }
 
-    ifstream file(locatorFile, ios_base::in | ios_base::binary);
-    filtering_streambuf<input> in;
-    in.push(gzip_compressor());
-    in.push(file);
-
-    stringstream ss;
-    boost::iostreams::copy(in, ss);
-
-    string s = ss.str();
-    if(s.size() > MAX_XUNIT_LENGTH) 
+    string s;
+    if(!CompressXUnitFile(locatorFile, s, MAX_XUNIT_LENGTH))
     {
       ret.push_back(Pair("status", "error"));
       ret.push_back(Pair("message", "Locator file compressed size too large"));
       return ret;
     }
-   
-    const vchType vchValue = vchFromValue(s);
+
+    const vchType vchValue = vchFromString(s);
 
 
     __wx__Tx wtx;
@@ -4991,19 +5051,11 @@ Value updateAliasFile(const Array& params, bool fHelp)
     if(!fs::exists(p))
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Locator file does not exist");
 
-    ifstream file(locatorFile, ios_base::in | ios_base::binary);
-    filtering_streambuf<input> in;
-    in.push(gzip_compressor());
-    in.push(file);
-
-    stringstream ss;
-    boost::iostreams::copy(in, ss);
-
-    string s = ss.str();
-    if(s.size() > MAX_XUNIT_LENGTH) 
+    string s;
+    if(!CompressXUnitFile(locatorFile, s, MAX_XUNIT_LENGTH))
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Locator file too large");
-   
-    const vchType vchValue = vchFromValue(s);
+
+    const vchType vchValue = vchFromString(s);
 
 
     __wx__Tx wtx;
@@ -5360,109 +5412,60 @@ bool internalReference__(string ref__, vchType& recipientPubKeyVch)
 
   return s__;
 }
-bool getImportedPubKey(string fKey, vchType& recipientPubKeyVch)
+bool getImportedPubKey(const string& fKey, vchType& recipientPubKeyVch)
 {
+  bool fFound = false;
   ENTER_CRITICAL_SECTION(cs_main)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+      __wx__Tx* ptx = pwalletMain->FindDionKeyTx(DION_OPS_PUBLIC_KEY, vchFromString(fKey));
+      vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
+      int nOut;
+      if(ptx && ptx->GetPublicKeyUpdate(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
       {
-        const __wx__Tx& tx = item.second;
-
-        vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
-        int nOut;
-        if(!tx.GetPublicKeyUpdate(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
-          continue;
-
-        string senderAddr = stringFromVch(vchSender);
-        if(senderAddr == fKey)
-        {
-          recipientPubKeyVch = vchKey;
-    LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
-  LEAVE_CRITICAL_SECTION(cs_main)
-          return true;
-        }
+        recipientPubKeyVch = vchKey;
+        fFound = true;
       }
     }
     LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
   }
   LEAVE_CRITICAL_SECTION(cs_main)
 
-  return false;
+  return fFound;
 }
-bool getImportedPubKey(string myAddress, string fKey, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch, bool& transientThreshold)
+bool getImportedPubKey(const string& myAddress, const string& fKey, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch, bool& transientThreshold)
 {
-  ENTER_CRITICAL_SECTION(cs_main)
-  {
-    ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
-    {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
-      {
-        const __wx__Tx& tx = item.second;
-
-        vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
-        int nOut;
-        if(!tx.GetPublicKeyUpdate(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
-          continue;
-
-        string keyRecipientAddr = stringFromVch(vchRecipient);
-        string ext = stringFromVch(vchSender);
-        if(keyRecipientAddr == myAddress && ext == fKey )
-        {
-          recipientPubKeyVch = vchKey;
-          aesKeyBase64EncryptedVch = vchAes;
-
-          string a = stringFromVch(vchAes);
-          if(a == "I") transientThreshold = true;
-    LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
-  LEAVE_CRITICAL_SECTION(cs_main)
-          return true;
-        }
-      }
-    }
-    LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
-  }
-  LEAVE_CRITICAL_SECTION(cs_main)
+  if(!getImportedPubKey(myAddress, fKey, recipientPubKeyVch, aesKeyBase64EncryptedVch))
+    return false;
 
-  return false;
+  string a = stringFromVch(aesKeyBase64EncryptedVch);
+  if(a == "I") transientThreshold = true;
+  return true;
 }
 
-bool getImportedPubKey(string myAddress, string fKey, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch)
+bool getImportedPubKey(const string& myAddress, const string& fKey, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch)
 {
+  bool fFound = false;
   ENTER_CRITICAL_SECTION(cs_main)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+      __wx__Tx* ptx = pwalletMain->FindDionKeyTx(DION_OPS_PUBLIC_KEY, vchFromString(fKey), vchFromString(myAddress));
+      vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
+      int nOut;
+      if(ptx && ptx->GetPublicKeyUpdate(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
       {
-        const __wx__Tx& tx = item.second;
-
-        vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
-        int nOut;
-        if(!tx.GetPublicKeyUpdate(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
-          continue;
-
-        string keyRecipientAddr = stringFromVch(vchRecipient);
-        string ext = stringFromVch(vchSender);
-        if(keyRecipientAddr == myAddress && ext == fKey )
-        {
-          recipientPubKeyVch = vchKey;
-          aesKeyBase64EncryptedVch = vchAes;
-    LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
-  LEAVE_CRITICAL_SECTION(cs_main)
-          return true;
-        }
+        recipientPubKeyVch = vchKey;
+        aesKeyBase64EncryptedVch = vchAes;
+        fFound = true;
       }
     }
     LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
   }
   LEAVE_CRITICAL_SECTION(cs_main)
 
-  return false;
+  return fFound;
 }
 
 int checkAddress(string addr, cba& a)
@@ -5699,73 +5702,66 @@ Value sendPlainMessage(const Array& params, bool fHelp)
     return res;
 
 }
-Value sendMessage(const Array& params, bool fHelp)
+// The sender's signing key and the AES key it shares with recipient f
+static void MessageKeys(string myAddress, string f, CKey& key, vector<unsigned char>& aesRawVector)
 {
-    if(fHelp || params.size() > 3)
-        throw runtime_error(
-                "sendMessage <addr> <message> <addr>"
-                + HelpRequiringPassphrase());
+    vchType recipientPubKeyVch;
 
-    string myAddress = params[0].get_str();
-    string strMessage = params[1].get_str();
-    string f = params[2].get_str();
+    cba senderAddr(myAddress);
+    if(!senderAddr.IsValid())
+      throw JSONRPCError(RPC_TYPE_ERROR, "Invalid sender address");
 
-    cba recipientAddr(f);
-    if(!recipientAddr.IsValid())
-        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid recipient address");
+    CKeyID keyID;
+    if(!senderAddr.GetKeyID(keyID))
+      throw JSONRPCError(RPC_TYPE_ERROR, "senderAddr does not refer to key");
 
-    CKeyID rkeyID;
-    if(!recipientAddr.GetKeyID(rkeyID))
-        throw JSONRPCError(RPC_TYPE_ERROR, "recipientAddr does not refer to key");
+    if(!pwalletMain->GetKey(keyID, key))
+      throw JSONRPCError(RPC_WALLET_ERROR, "Private key not available");
 
-    vchType recipientAddressVch = vchFromString(f);
-    vchType recipientPubKeyVch;
-    vector<unsigned char> aesRawVector;
+    CPubKey vchPubKey;
+    pwalletMain->GetPubKey(keyID, vchPubKey);
 
-    CKey key;
-    if(params.size() == 3)
+    string aesBase64Plain;
+    if(pwalletMain->aes_(vchPubKey, f, aesBase64Plain))
     {
-      cba senderAddr(myAddress);
-      if(!senderAddr.IsValid())
-        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid sender address");
-
-      CKeyID keyID;
-      if(!senderAddr.GetKeyID(keyID))
-        throw JSONRPCError(RPC_TYPE_ERROR, "senderAddr does not refer to key");
-
-      if(!pwalletMain->GetKey(keyID, key))
-        throw JSONRPCError(RPC_WALLET_ERROR, "Private key not available");
-
-      CPubKey vchPubKey;
-      pwalletMain->GetPubKey(keyID, vchPubKey);
-
-      string aesBase64Plain;
-      if(pwalletMain->aes_(vchPubKey, f, aesBase64Plain))
+      bool fInvalid = false;
+      aesRawVector = DecodeBase64(aesBase64Plain.c_str(), &fInvalid);
+    }
+    else
+    {
+      vchType aesKeyBase64EncryptedVch;
+      if(getImportedPubKey(myAddress, f, recipientPubKeyVch, aesKeyBase64EncryptedVch))
       {
+        string aesKeyBase64Encrypted = stringFromVch(aesKeyBase64EncryptedVch);
+        string privRSAKey;
+        if(!pwalletMain->envCP0(vchPubKey, privRSAKey))
+          throw JSONRPCError(RPC_TYPE_ERROR, "Failed to retrieve private RSA key");
+        string decryptedAESKeyBase64;
+        DecryptMessage(privRSAKey, aesKeyBase64Encrypted, decryptedAESKeyBase64);
         bool fInvalid = false;
-        aesRawVector = DecodeBase64(aesBase64Plain.c_str(), &fInvalid);
+        aesRawVector = DecodeBase64(decryptedAESKeyBase64.c_str(), &fInvalid);
       }
       else
       {
-        vchType aesKeyBase64EncryptedVch;
-        if(getImportedPubKey(myAddress, f, recipientPubKeyVch, aesKeyBase64EncryptedVch))
-        {
-          string aesKeyBase64Encrypted = stringFromVch(aesKeyBase64EncryptedVch);
-          string privRSAKey;
-          if(!pwalletMain->envCP0(vchPubKey, privRSAKey))
-            throw JSONRPCError(RPC_TYPE_ERROR, "Failed to retrieve private RSA key");
-          string decryptedAESKeyBase64;
-          DecryptMessage(privRSAKey, aesKeyBase64Encrypted, decryptedAESKeyBase64);
-          bool fInvalid = false;
-          aesRawVector = DecodeBase64(decryptedAESKeyBase64.c_str(), &fInvalid);
-        }
-        else
-        {
-          throw JSONRPCError(RPC_WALLET_ERROR, "No local symmetric key and no imported symmetric key found for recipient");
-        }
+        throw JSONRPCError(RPC_WALLET_ERROR, "No local symmetric key and no imported symmetric key found for recipient");
       }
     }
+}
 
+static void CheckMessageRecipient(const string& f)
+{
+    cba recipientAddr(f);
+    if(!recipientAddr.IsValid())
+        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid recipient address");
+
+    CKeyID rkeyID;
+    if(!recipientAddr.GetKeyID(rkeyID))
+        throw JSONRPCError(RPC_TYPE_ERROR, "recipientAddr does not refer to key");
+}
+
+// Encrypt, sign and send one message. The caller holds cs_main with the wallet unlocked.
+static uint256 SendEncryptedMessage(const string& myAddress, const string& strMessage, const string& f, const CKey& key, vector<unsigned char>& aesRawVector)
+{
     string encrypted;
     string iv128Base64;
     EncryptMessageAES(strMessage, encrypted, aesRawVector, iv128Base64);
@@ -5796,28 +5792,131 @@ Value sendMessage(const Array& params, bool fHelp)
     scriptPubKey << OP_ENCRYPTED_MESSAGE << vchFromString(myAddress) << vchFromString(f) << vchEncryptedMessage << iv128Base64Vch << vchFromString(sigBase64) << OP_2DROP << OP_2DROP << OP_DROP;
     scriptPubKey += scriptPubKeyOrig;
 
-    ENTER_CRITICAL_SECTION(cs_main)
-    {
-        EnsureWalletIsUnlocked();
+    string strError = pwalletMain->SendMoney__(scriptPubKey, CTRL__, wtx, false);
+    if(strError != "")
+      throw JSONRPCError(RPC_WALLET_ERROR, strError);
+    mapMyMessages[vchEncryptedMessage] = wtx.GetHash();
+    return wtx.GetHash();
+}
 
-       string strError = pwalletMain->SendMoney__(scriptPubKey, CTRL__, wtx, false);
+Value sendMessage(const Array& params, bool fHelp)
+{
+    if(fHelp || params.size() > 3)
+        throw runtime_error(
+                "sendMessage <addr> <message> <addr>"
+                + HelpRequiringPassphrase());
 
-        if(strError != "")
-        {
-    LEAVE_CRITICAL_SECTION(cs_main)
-          throw JSONRPCError(RPC_WALLET_ERROR, strError);
-        }
-        mapMyMessages[vchEncryptedMessage] = wtx.GetHash();
-    }
-    LEAVE_CRITICAL_SECTION(cs_main)
+    string myAddress = params[0].get_str();
+    string strMessage = params[1].get_str();
+    string f = params[2].get_str();
 
+    CheckMessageRecipient(f);
 
+    vector<unsigned char> aesRawVector;
+    CKey key;
+    if(params.size() == 3)
+      MessageKeys(myAddress, f, key, aesRawVector);
+
+    uint256 hash;
+    {
+        LOCK(cs_main);
+        EnsureWalletIsUnlocked();
+        hash = SendEncryptedMessage(myAddress, strMessage, f, key, aesRawVector);
+    }
 
     vector<Value> res;
-    res.push_back(wtx.GetHash().GetHex());
+    res.push_back(hash.GetHex());
     return res;
 
 }
+
+// Commands sendBatch may run, all of them one DIONS transaction each
+static const char* const vBatchMethods[] = {
+    "registerAlias", "updateAlias", "transferAlias", "sendPublicKey", "sendMessage", "sendPlainMessage"
+};
+
+Value sendBatch(const Array& params, bool fHelp)
+{
+    if(fHelp || params.size() != 1)
+        throw runtime_error(
+                "sendBatch [{\"method\":<method>,\"params\":[...]},...]\n"
+                "Runs registerAlias, updateAlias, transferAlias, sendPublicKey, sendMessage\n"
+                "and sendPlainMessage requests under one lock and one unlock check, sharing\n"
+                "the keys of each sender and recipient between messages.\n"
+                "Returns for each request its result or the error it failed with."
+                + HelpRequiringPassphrase());
+
+    const Array& items = params[0].get_array();
+
+    // (sender, recipient) -> signing key and shared AES key
+    map<pair<string, string>, pair<CKey, vector<unsigned char> > > mapMessageKeys;
+
+    Array ret;
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    EnsureWalletIsUnlocked();
+    BOOST_FOREACH(const Value& item, items)
+    {
+        Object entry;
+        try
+        {
+            if(item.type() != obj_type)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Batch entry must be an object");
+            const Object& req = item.get_obj();
+            const Value& valMethod = find_value(req, "method");
+            if(valMethod.type() != str_type)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Batch entry has no method");
+            string strMethod = valMethod.get_str();
+            entry.push_back(Pair("method", strMethod));
+
+            const Value& valParams = find_value(req, "params");
+            Array itemParams;
+            if(valParams.type() == array_type)
+                itemParams = valParams.get_array();
+            else if(valParams.type() != null_type)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Params must be an array");
+
+            bool fAllowed = false;
+            for(unsigned int i = 0; i < sizeof(vBatchMethods) / sizeof(vBatchMethods[0]); i++)
+                if(strMethod == vBatchMethods[i])
+                    fAllowed = true;
+            if(!fAllowed)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, strMethod + " cannot run in a batch");
+
+            Value result;
+            if(strMethod == "sendMessage")
+            {
+                if(itemParams.size() != 3)
+                    throw runtime_error("sendMessage <addr> <message> <addr>");
+                string myAddress = itemParams[0].get_str();
+                string f = itemParams[2].get_str();
+                CheckMessageRecipient(f);
+
+                pair<string, string> correspondents(myAddress, f);
+                map<pair<string, string>, pair<CKey, vector<unsigned char> > >::iterator mi = mapMessageKeys.find(correspondents);
+                if(mi == mapMessageKeys.end())
+                {
+                    pair<CKey, vector<unsigned char> > keys;
+                    MessageKeys(myAddress, f, keys.first, keys.second);
+                    mi = mapMessageKeys.insert(make_pair(correspondents, keys)).first;
+                }
+                result = SendEncryptedMessage(myAddress, itemParams[1].get_str(), f, mi->second.first, mi->second.second).GetHex();
+            }
+            else
+                result = tableRPC[strMethod]->actor(itemParams, false);
+            entry.push_back(Pair("result", result));
+        }
+        catch(Object& objError)
+        {
+            entry.push_back(Pair("error", objError));
+        }
+        catch(std::exception& e)
+        {
+            entry.push_back(Pair("error", JSONRPCError(RPC_MISC_ERROR, e.what())));
+        }
+        ret.push_back(entry);
+    }
+    return ret;
+}
 bool sign_verifymessage(string address)
 {
   string message = "test";
@@ -5856,14 +5955,14 @@ bool sign_verifymessage(string address)
     if(fInvalid)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-    CDataStream ss__(SER_GETHASH, 0);
+    CHashWriter ss__(SER_GETHASH, 0);
     ss__ << message;
 
-    CKey key__;
-    if(!key__.SetCompactSignature(Hash(ss__.begin(), ss__.end()), vchSig__))
+    CKeyID keyIDSigner;
+    if(!RecoverCompactKeyID(ss__.GetHash(), vchSig__, keyIDSigner))
         return false;
 
-    return(key__.GetPubKey().GetID() == keyID__);
+    return(keyIDSigner == keyID__);
 }
 Value registerAliasGenerate(const Array& params, bool fHelp)
 {
@@ -6263,7 +6362,7 @@ bool aliasTx(const CTransaction& tx, int& op, int& nOut, vector<vector<unsigned
     return found;
 }
 
-int linkSet(vector<vchType> v, CBlockIndex* p, CDiskTxPos& txPos, const string& s, LocatorNodeDB& ln1)
+int linkSet(const vector<vchType>& v, CBlockIndex* p, CDiskTxPos& txPos, const string& s, LocatorNodeDB& ln1)
 {
   if(ln1.lKey(v[0]))
   {
@@ -6361,17 +6460,17 @@ bool verifymessage(const string& strAddress, const string& strSig, const string&
     if(fInvalid)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-    CDataStream ss(SER_GETHASH, 0);
+    CHashWriter ss(SER_GETHASH, 0);
     ss << m1;
     ss << m2;
     ss << m3;
     ss << m4;
 
-    CKey key;
-    if(!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+    CKeyID keyIDSigner;
+    if(!RecoverCompactKeyID(ss.GetHash(), vchSig, keyIDSigner))
         return false;
 
-    return(key.GetPubKey().GetID() == keyID);
+    return(keyIDSigner == keyID);
 }
 bool verifymessage(const string& strAddress, const string& strSig, const string& strMessage)
 {
@@ -6389,14 +6488,14 @@ bool verifymessage(const string& strAddress, const string& strSig, const string&
     if(fInvalid)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-    CDataStream ss(SER_GETHASH, 0);
+    CHashWriter ss(SER_GETHASH, 0);
     ss << strMessage;
 
-    CKey key;
-    if(!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+    CKeyID keyIDSigner;
+    if(!RecoverCompactKeyID(ss.GetHash(), vchSig, keyIDSigner))
         return false;
 
-    return(key.GetPubKey().GetID() == keyID);
+    return(keyIDSigner == keyID);
 }
 bool IsMinePost(const CTransaction& tx, const CTxOut& txout, bool ignore_registerAlias )
 {
@@ -6420,6 +6519,30 @@ bool IsMinePost(const CTransaction& tx, const CTxOut& txout, bool ignore_registe
     return false;
 }
 
+void AddPendingAlias(const vchType& vchAlias, const uint256& hash)
+{
+    AssertLockHeld(cs_main);
+    if(!mapStateByTx.insert(make_pair(hash, vchAlias)).second)
+        return;
+    mapState[vchAlias].insert(hash);
+}
+
+void RemovePendingAlias(const uint256& hash)
+{
+    AssertLockHeld(cs_main);
+    boost::unordered_map<uint256, vchType, SaltedTxidHasher>::iterator ti = mapStateByTx.find(hash);
+    if(ti == mapStateByTx.end())
+        return;
+    PendingAliasMap::iterator mi = mapState.find(ti->second);
+    if(mi != mapState.end())
+    {
+        mi->second.erase(hash);
+        if(mi->second.empty())
+            mapState.erase(mi);
+    }
+    mapStateByTx.erase(ti);
+}
+
 bool
 AcceptToMemoryPoolPost(const CTransaction& tx)
 {
@@ -6453,7 +6576,7 @@ AcceptToMemoryPoolPost(const CTransaction& tx)
     {
       ENTER_CRITICAL_SECTION(cs_main)
       {
-        mapState[vvch[0]].insert(tx.GetHash());
+        AddPendingAlias(vvch[0], tx.GetHash());
       }
       LEAVE_CRITICAL_SECTION(cs_main)
     }
@@ -6465,6 +6588,12 @@ void RemoveFromMemoryPoolPost(const CTransaction& tx)
     if(tx.nVersion != CTransaction::DION_TX_VERSION)
         return;
 
+    ENTER_CRITICAL_SECTION(cs_main)
+    {
+        RemovePendingAlias(tx.GetHash());
+    }
+    LEAVE_CRITICAL_SECTION(cs_main)
+
     if(tx.vout.size() < 1)
         return;
 
@@ -6476,17 +6605,6 @@ void RemoveFromMemoryPoolPost(const CTransaction& tx)
     if(!aliasTx(tx, op, nOut, vvch))
         return;
 
-    if(op != OP_ALIAS_ENCRYPTED)
-    {
-        ENTER_CRITICAL_SECTION(cs_main)
-        {
-            std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = mapState.find(vvch[0]);
-            if(mi != mapState.end())
-                mi->second.erase(tx.GetHash());
-        }
-        LEAVE_CRITICAL_SECTION(cs_main)
-    }
-
     if(op == OP_PUBLIC_KEY || op == OP_VERTEX)
     {
         vchType k;
@@ -6511,7 +6629,7 @@ int CheckTransactionAtRelativeDepth(CBlockIndex* pindexBlock, CTxIndex& txindex,
     return -1;
 }
 bool
-ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
+ConnectInputsPost(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool,
                                const CTransaction& tx,
                                vector<CTransaction>& vTxPrev,
                                vector<CTxIndex>& vTxindex,
@@ -6537,13 +6655,15 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
 
       return true;
     }
-    LocatorNodeDB ln1Db("r+");
+    // Reads through the caller's txdb, so they see the block's pending
+    // writes and share its handle rather than opening one per transaction
+    LocatorNodeDB ln1Db(txdb);
     int nInput;
     bool found = false;
 
     int prevOp;
     std::vector<vchType> vvchPrevArgs;
-    printf("CIP tx %s\n",
+    LogPrint("dions", "CIP tx %s\n",
               tx.GetHash().GetHex().c_str());
 
     for(int i = 0; i < tx.vin.size(); i++)
@@ -6606,14 +6726,14 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
            if(fInvalid)
                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-           CDataStream ss(SER_GETHASH, 0);
+           CHashWriter ss(SER_GETHASH, 0);
            ss << pkey + aesEncrypted;
 
-           CKey key;
-           if(!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+           CKeyID keyIDSigner;
+           if(!RecoverCompactKeyID(ss.GetHash(), vchSig, keyIDSigner))
                return false;
 
-           if(key.GetPubKey().GetID() != keyID)
+           if(keyIDSigner != keyID)
            {
                 return error("public key plus aes key tx verification failed");
            }
@@ -6657,14 +6777,14 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
            if(fInvalid)
                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-           CDataStream ss(SER_GETHASH, 0);
+           CHashWriter ss(SER_GETHASH, 0);
            ss << encrypted + iv128Base64;
 
-           CKey key;
-           if(!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+           CKeyID keyIDSigner;
+           if(!RecoverCompactKeyID(ss.GetHash(), vchSig, keyIDSigner))
                return false;
 
-           if(key.GetPubKey().GetID() != keyID)
+           if(keyIDSigner != keyID)
            {
                 return error("encrypted message tx verification failed");
            }
@@ -6692,14 +6812,14 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
            if(fInvalid)
                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Malformed base64 encoding");
 
-           CDataStream ss(SER_GETHASH, 0);
+           CHashWriter ss(SER_GETHASH, 0);
            ss << message;
 
-           CKey key;
-           if(!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+           CKeyID keyIDSigner;
+           if(!RecoverCompactKeyID(ss.GetHash(), vchSig, keyIDSigner))
                return false;
 
-           if(key.GetPubKey().GetID() != keyID)
+           if(keyIDSigner != keyID)
            {
                 return error("encrypted message tx verification failed");
            }
@@ -6832,12 +6952,16 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
                 if(nDepth == -1)
                     return error("cannot be mined if not already in chain and unexpired");
 
-                set<uint256>& setPending = mapState[vvchArgs[0]];
-                BOOST_FOREACH(const PAIRTYPE(uint256, CTxIndex)& s, mapTestPool)
+                // The alias' few pending txs against the whole test pool
+                PendingAliasMap::const_iterator mi = mapState.find(vvchArgs[0]);
+                if(mi != mapState.end())
                 {
-                    if(setPending.count(s.first))
+                    BOOST_FOREACH(const uint256& hashPending, mi->second)
                     {
-                        return false;
+                        if(mapTestPool.count(hashPending))
+                        {
+                            return false;
+                        }
                     }
                 }
             }
@@ -6864,12 +6988,10 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
     }
     if(!fBlock && op == OP_ALIAS_RELAY)
     {
-        vector<AliasIndex> vtxPos;
-        if(ln1Db.lKey(vvchArgs[0])
-            && !ln1Db.lGet(vvchArgs[0], vtxPos))
-          return error("ConnectInputsPost() : failed to read from alias DB");
-        if(!aliasTxPos(vtxPos, vTxindex[nInput].pos))
-            return error("ConnectInputsPost() : tx %s rejected, since previous tx(%s) is not in the alias DB\n", tx.GetHash().ToString().c_str(), vTxPrev[nInput].GetHash().ToString().c_str());
+        // Only the latest entry matters, which the record cache has
+        CAliasRecord rec;
+        if(!aliasRecord(ln1Db, vvchArgs[0], rec) || rec.index.txPos != vTxindex[nInput].pos)
+            return error("ConnectInputsPost() : tx %s rejected, since previous tx(%s) is not in the alias DB\n", tx.GetHash().ToString().c_str(), tx.vin[nInput].prevout.hash.ToString().c_str());
     }
     if(fBlock)
     {
@@ -6884,7 +7006,7 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
             CTransaction tx;
             if(aliasTx(ln1Db, vchFromString(locatorStr), tx))
             {
-              printf("%s flagged active with tx %s\n", locatorStr.c_str(),
+              LogPrint("dions", "%s flagged active with tx %s\n", locatorStr.c_str(),
               tx.GetHash().GetHex().c_str());
             }
           }
@@ -6894,9 +7016,7 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
         {
             ENTER_CRITICAL_SECTION(cs_main)
             {
-                std::map<std::vector<unsigned char>, std::set<uint256> >::iterator mi = mapState.find(vvchArgs[0]);
-                if(mi != mapState.end())
-                    mi->second.erase(tx.GetHash());
+                RemovePendingAlias(tx.GetHash());
 
             }
             LEAVE_CRITICAL_SECTION(cs_main)
@@ -6906,17 +7026,240 @@ ConnectInputsPost(map<uint256, CTxIndex>& mapTestPool,
     return true;
 }
 
-void xsc(CBlockIndex* p)
+// Blocks the alias index rebuild commits at a time; readers keep at most
+// two batches ahead of it
+static const unsigned int ALIAS_INDEX_BATCH = 1000;
+
+/** Brings the alias index up to the best block from the height it was
+ *  last committed at. Reader threads decode blocks ahead of the writer,
+ *  which applies them in chain order and commits a batch, together with
+ *  the height it reached, every ALIAS_INDEX_BATCH blocks.
+ */
+class CAliasIndexer : private CBlockPrefetcher
 {
-  for(; p; p=p->pnext)
-  {
-    if(!fTestNet && p->nHeight < 1625000)
-      continue;
+private:
+    struct CAliasScanBlock : public CPrefetchedBlock
+    {
+        std::vector<CAliasUpdate> vUpdates;
+    };
 
-    ln1Db->filter(p);
-  }
- 
-  return;
+    CPrefetchedBlock* Read(unsigned int nPos)
+    {
+        CAliasScanBlock* pscan = new CAliasScanBlock();
+        pscan->fRead = pscan->block.ReadFromDisk(vIndex[nPos]);
+        if (pscan->fRead)
+        {
+            CTxDB txdb("r");
+            LocatorNodeDB::ScanBlock(txdb, pscan->block, vIndex[nPos], pscan->vUpdates);
+            // Only the updates are needed from here on
+            pscan->block.SetNull();
+        }
+        else
+            printf("CAliasIndexer : failed to read block at height %d\n", vIndex[nPos]->nHeight);
+        return pscan;
+    }
+
+public:
+    CAliasIndexer(const std::vector<CBlockIndex*>& vIndexIn) : CBlockPrefetcher(vIndexIn, 2 * ALIAS_INDEX_BATCH) {}
+
+    bool Run()
+    {
+        Start();
+
+        bool fOk = true;
+        int64_t nLastLog = GetTimeMillis();
+        CTxDB txdb("r+");
+        while (GetPos() < vIndex.size() && !fShutdown)
+        {
+            CBlockIndex* pindexLast = NULL;
+            {
+                LocatorNodeDB aliasdb(txdb);
+                txdb.TxnBegin();
+                for (unsigned int n = 0; n < ALIAS_INDEX_BATCH; n++)
+                {
+                    auto_ptr<CPrefetchedBlock> pblock = Next();
+                    if (!pblock.get())
+                        break;
+                    pindexLast = pblock->pindex;
+                    aliasdb.Apply(static_cast<CAliasScanBlock*>(pblock.get())->vUpdates);
+                }
+                if (pindexLast)
+                    aliasdb.WriteIndexedHeight(pindexLast->nHeight);
+                if (!txdb.TxnCommit())
+                {
+                    fOk = error("CAliasIndexer : TxnCommit failed");
+                    break;
+                }
+            }
+
+            int nPercent = (int)(100LL * GetPos() / vIndex.size());
+            uiInterface.InitMessage(strprintf(_("Indexing aliases... %d%%"), nPercent));
+            int64_t nNow = GetTimeMillis();
+            if (pindexLast && nNow - nLastLog >= 10000)
+            {
+                nLastLog = nNow;
+                printf("Indexing aliases: %d%%, height %d\n", nPercent, pindexLast->nHeight);
+            }
+        }
+
+        Stop();
+        return fOk;
+    }
+};
+
+// The last rebuild UpdateAliasIndex made, for benchdions
+static int64_t nAliasIndexBlocks = 0;
+static int64_t nAliasIndexMillis = 0;
+
+bool UpdateAliasIndex()
+{
+    int nIndexed;
+    std::vector<CBlockIndex*> vIndex;
+    {
+        LocatorNodeDB aliasdb("r+");
+        if (!aliasdb.ReadIndexedHeight(nIndexed))
+        {
+            // Indexed block by block as they connected, before the height
+            // was recorded
+            aliasdb.WriteIndexedHeight(nBestHeight);
+            return true;
+        }
+        if (nIndexed >= nBestHeight)
+            return true;
+
+        LOCK(cs_main);
+        // No aliases before this height on the main chain
+        int nStart = max(nIndexed + 1, fTestNet ? 0 : 1625000);
+        if (nStart > nBestHeight)
+            return true;
+        for (CBlockIndex* pindex = FindBlockByHeight(nStart); pindex; pindex = pindex->pnext)
+            vIndex.push_back(pindex);
+    }
+    if (vIndex.empty())
+        return true;
+
+    printf("Indexing aliases of %"PRIszu" blocks from height %d...\n", vIndex.size(), vIndex[0]->nHeight);
+    int64_t nStart = GetTimeMillis();
+    CAliasIndexer indexer(vIndex);
+    bool fOk = indexer.Run();
+    nAliasIndexMillis = GetTimeMillis() - nStart;
+    nAliasIndexBlocks = vIndex.size();
+    printf(" alias index %15"PRId64"ms\n", nAliasIndexMillis);
+    return fOk;
+}
+
+static Object BenchResult(int64_t nOps, int64_t nMicros)
+{
+    Object obj;
+    obj.push_back(Pair("ops", nOps));
+    obj.push_back(Pair("micros", nMicros));
+    obj.push_back(Pair("ops_per_sec", nMicros > 0 ? (double)nOps * 1000000 / nMicros : 0.0));
+    return obj;
+}
+
+static Object BenchRPC(rpcfn_type fn, const Array& params, int nIterations)
+{
+    int64_t nStart = GetTimeMicros();
+    for(int i = 0; i < nIterations; i++)
+        fn(params, false);
+    return BenchResult(nIterations, GetTimeMicros() - nStart);
+}
+
+// Peak resident set of the process in kilobytes, -1 where unknown
+static int64_t GetPeakResidentKB()
+{
+#ifdef WIN32
+    return -1;
+#else
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#ifdef MAC_OSX
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// Aliases benchmarked one by one, so that a large index doesn't stall the node
+static const unsigned int MAX_BENCH_ALIASES = 1000;
+
+Value benchdions(const Array& params, bool fHelp)
+{
+    if(fHelp || params.size() > 1)
+        throw runtime_error(
+                "benchdions [iterations=10]\n"
+                "Times the DIONS read paths against this node's alias index and wallet:\n"
+                "resolving up to 1000 aliases cold and warm, nodeValidate on each, and\n"
+                "aliasList and decryptedMessageList <iterations> times each. Also reports\n"
+                "ConnectInputsPost throughput since startup, the last alias index rebuild\n"
+                "and the peak resident memory. The cold pass empties the alias record cache.");
+
+    int nIterations = 10;
+    if(params.size() > 0)
+        nIterations = params[0].get_int();
+    if(nIterations < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "iterations must be positive");
+
+    vector<vchType> vAliases;
+    {
+        LocatorNodeDB aliasdb("r");
+        vector<pair<vchType, vector<AliasIndex> > > vAll;
+        if(!aliasdb.lGetAll(vAll))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Failed to read the alias index");
+        for(unsigned int i = 0; i < vAll.size() && vAliases.size() < MAX_BENCH_ALIASES; i++)
+            vAliases.push_back(vAll[i].first);
+    }
+
+    Object ret;
+    ret.push_back(Pair("aliases", (int)vAliases.size()));
+    {
+        LocatorNodeDB aliasdb("r");
+        ClearAliasRecords();
+        for(int nPass = 0; nPass < 2; nPass++)
+        {
+            int64_t nStart = GetTimeMicros();
+            BOOST_FOREACH(const vchType& vchAlias, vAliases)
+            {
+                CAliasRecord rec;
+                aliasRecord(aliasdb, vchAlias, rec);
+            }
+            ret.push_back(Pair(nPass ? "resolve_warm" : "resolve_cold", BenchResult(vAliases.size(), GetTimeMicros() - nStart)));
+        }
+    }
+
+    {
+        int64_t nStart = GetTimeMicros();
+        BOOST_FOREACH(const vchType& vchAlias, vAliases)
+        {
+            Array validateParams;
+            validateParams.push_back(stringFromVch(vchAlias));
+            nodeValidate(validateParams, false);
+        }
+        ret.push_back(Pair("nodeValidate", BenchResult(vAliases.size(), GetTimeMicros() - nStart)));
+    }
+
+    ret.push_back(Pair("aliasList", BenchRPC(aliasList, Array(), nIterations)));
+    if(pwalletMain->as())
+        ret.push_back(Pair("decryptedMessageList", "skipped, wallet locked"));
+    else
+        ret.push_back(Pair("decryptedMessageList", BenchRPC(decryptedMessageList, Array(), nIterations)));
+
+    int64_t nTxs, nMicros;
+    {
+        LOCK(cs_main);
+        GetAliasConnectStats(nTxs, nMicros);
+    }
+    ret.push_back(Pair("connectinputspost", BenchResult(nTxs, nMicros)));
+
+    Object rebuild;
+    rebuild.push_back(Pair("blocks", nAliasIndexBlocks));
+    rebuild.push_back(Pair("millis", nAliasIndexMillis));
+    ret.push_back(Pair("aliasindexrebuild", rebuild));
+
+    ret.push_back(Pair("peakmemory_kb", GetPeakResidentKB()));
+    return ret;
 }
 
 unsigned char GetAddressVersion() 
@@ -7158,37 +7501,26 @@ Value mapVertex(const Array& params, bool fHelp)
 }
 bool pk(string myAddress, string fKey, vchType& recipientPubKeyVch, vchType& aesKeyBase64EncryptedVch)
 {
+  bool fFound = false;
   ENTER_CRITICAL_SECTION(cs_main)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+      __wx__Tx* ptx = pwalletMain->FindDionKeyTx(DION_OPS_VERTEX, vchFromString(fKey), vchFromString(myAddress));
+      vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
+      int nOut;
+      if(ptx && ptx->vtx(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
       {
-        const __wx__Tx& tx = item.second;
-
-        vchType vchSender, vchRecipient, vchKey, vchAes, vchSig;
-        int nOut;
-        if(!tx.vtx(nOut, vchSender, vchRecipient, vchKey, vchAes, vchSig))
-          continue;
-
-        string keyRecipientAddr = stringFromVch(vchRecipient);
-        string ext = stringFromVch(vchSender);
-        if(keyRecipientAddr == myAddress && ext == fKey )
-        {
-          recipientPubKeyVch = vchKey;
-          aesKeyBase64EncryptedVch = vchAes;
-    LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
-  LEAVE_CRITICAL_SECTION(cs_main)
-          return true;
-        }
+        recipientPubKeyVch = vchKey;
+        aesKeyBase64EncryptedVch = vchAes;
+        fFound = true;
       }
     }
     LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
   }
   LEAVE_CRITICAL_SECTION(cs_main)
 
-  return false;
+  return fFound;
 }
 
 Value vtxtrace(const Array& params, bool fHelp)
@@ -7209,10 +7541,11 @@ Value vtxtrace(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_VERTEX, vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
           {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchS, vchR, vchKey, vchAes, vchSig;
             int nOut;
@@ -7486,10 +7819,11 @@ Value projection(const Array& params, bool fHelp)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_MAP_PROJECT, vchFromString(alpha.ToString()), vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
         {
-            const __wx__Tx& tx = item.second;
+            const __wx__Tx& tx = *ptx;
 
             vchType vchV0, vchV1, vchEncryptedMessage, ivVch, vchSig;
             int nOut;
@@ -7654,103 +7988,38 @@ bool collx(const CTransaction& t)
   return false;
 }
 
+// The first correspondent, in wallet order, that v has confirmed vertices
+// with in both directions
 bool vclose(string& v, string& w)
 {
-    std::map<vchType, int> mapAliasVchInt;
-    std::map<vchType, Object> aliasMapVchObj;
-
-    Array oRes;
+    bool fFound = false;
     ENTER_CRITICAL_SECTION(cs_main)
     {
       ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
       {
-        BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                      pwalletMain->mapWallet)
-          {
-            const __wx__Tx& tx = item.second;
-
+        vector<__wx__Tx*> vDionTx;
+        pwalletMain->ListDionTxs(DION_OPS_VERTEX, vchFromString(v), vDionTx);
+        BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
+        {
             vchType vchS, vchR, vchKey, vchAes, vchSig;
             int nOut;
-            if(!tx.vtx(nOut, vchS, vchR, vchKey, vchAes, vchSig))
+            if(!ptx->vtx(nOut, vchS, vchR, vchKey, vchAes, vchSig))
               continue;
-
-            string keySenderAddr = stringFromVch(vchS);
-            cba r(keySenderAddr);
-            CKeyID keyID;
-            r.GetKeyID(keyID);
-            CKey key;
-            bool imported=false;
-            if(!pwalletMain->GetKey(keyID, key))
-            {
-              imported=true;
-            }
-
-            const int nHeight = tx.GetHeightInMainChain();
-            if(nHeight == -1)
+            if(ptx->GetHeightInMainChain() == -1)
+              continue;
+            if(!pwalletMain->HaveDionKeyTxInMainChain(DION_OPS_VERTEX, vchR, vchS, ptx->GetHash()))
               continue;
-            assert(nHeight >= 0);
-
-            string recipient = stringFromVch(vchR);
-
-            Object aliasObj;
-            aliasObj.push_back(Pair("sender", stringFromVch(vchS)));
-
-            
-            aliasObj.push_back(Pair("recipient", recipient));
-            if(imported)
-              aliasObj.push_back(Pair("status", "imported"));
-            else
-              aliasObj.push_back(Pair("status", "exported"));
-
-            vchType k;
-            k.reserve(vchS.size() + vchR.size());
-            k.insert(k.end(), vchR.begin(), vchR.end());
-            k.insert(k.end(), vchS.begin(), vchS.end());
-            if(k1Export.count(k) && k1Export[k].size())
-            {
-              aliasObj.push_back(Pair("pending", "true"));
-            }
-            
-            aliasObj.push_back(Pair("confirmed", "false"));
 
-            aliasObj.push_back(Pair("key", stringFromVch(vchKey)));
-            aliasObj.push_back(Pair("aes256_encrypted", stringFromVch(vchAes)));
-            aliasObj.push_back(Pair("signature", stringFromVch(vchSig)));
-            string a;
-            if(atod(stringFromVch(vchS), a) == 0)
-              aliasObj.push_back(Pair("alias", a));
-            oRes.push_back(aliasObj);
+            w = stringFromVch(stringFromVch(vchS) == v ? vchR : vchS);
+            fFound = true;
+            break;
         }
       }
       LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet)
     }
     LEAVE_CRITICAL_SECTION(cs_main)
 
-    for(unsigned int i=0; i<oRes.size(); i++)
-    {
-       Object& o = oRes[i].get_obj();
-
-       string s = o[0].value_.get_str();
-       string r = o[1].value_.get_str();
-       string status = o[2].value_.get_str();
-       for(unsigned int j=i+1; j<oRes.size(); j++)
-       {
-         Object& o1 = oRes[j].get_obj();
-         if(s == o1[1].value_.get_str() && r == o1[0].value_.get_str())
-         {
-           if(s == v)
-           {
-             w=r; return true;
-           }
-           else if(r == v) 
-           {
-             w=s; return true;
-           }
-         }
-       }
-    }
-
-    return false;
+    return fFound;
 }
 
 Value xstat(const Array& params, bool fHelp)
@@ -7888,10 +8157,11 @@ Value svtx(const Array& params, bool fHelp)
   {
     ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet)
     {
-      BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item,
-                    pwalletMain->mapWallet)
+      vector<__wx__Tx*> vDionTx;
+      pwalletMain->ListDionTxs(DION_OPS_VERTEX, vDionTx);
+      BOOST_FOREACH(__wx__Tx* ptx, vDionTx)
         {
-          const __wx__Tx& tx = item.second;
+          const __wx__Tx& tx = *ptx;
 
           vchType vchS, vchR, vchKey, vchAes, vchSig;
           int nOut;
@@ -7994,16 +8264,11 @@ Value simplexU(const Array& params, bool fHelp) { if(fHelp || params.size() != 2
     if(!fs::exists(p))
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Locator file does not exist");
 
-    ifstream file(locatorFile, ios_base::in | ios_base::binary);
-    filtering_streambuf<input> in;
-    in.push(gzip_compressor());
-    in.push(file);
-
-    stringstream ss;
-    boost::iostreams::copy(in, ss);
-    string s = ss.str();
-    vchType sv = vchFromString(s);
-    string r = EncodeBase64(&sv[0], sv.size());
+    // Base64 only grows it, so give up as soon as it can't fit
+    string s;
+    if(!CompressXUnitFile(locatorFile, s, MAX_XUNIT_LENGTH))
+      throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "xunit size exceeded");
+    string r = EncodeBase64((const unsigned char*)s.data(), s.size());
 
     if(r.size() > MAX_XUNIT_LENGTH) 
       throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "xunit size exceeded");
@@ -8143,12 +8408,7 @@ Value psimplex(const Array& params, bool fHelp) { if(fHelp || params.size() != 2
   string v = stringFromVch(asK);
   try
   {
-    stringstream is(v, ios_base::in | ios_base::binary);   
-    filtering_streambuf<input> in__;
-    in__.push(gzip_decompressor());
-    in__.push(is);
-    ofstream file__(out__, ios_base::binary);
-    boost::iostreams::copy(in__, file__);
+    WriteXUnitFile(v, out__);
   }
   catch(std::exception& e)
   {
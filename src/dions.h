@@ -4,6 +4,8 @@
 
 #include "json/json_spirit.h"
 
+#include <boost/unordered_map.hpp>
+
 #include "reactor_relay.h"
 
 static const int64_t CTRL__ = 0;
@@ -24,28 +26,66 @@ static const int OP_VERTEX = 0x09;
 static const int OP_MAP_PROJECT = 0x10;
 static const int MIN_SET_DEPTH = 1;
 
+// Op sets for __wx__::ListDionTxs, one bit per op
+static const int DION_OPS_ALIAS = (1 << OP_ALIAS_SET) | (1 << OP_ALIAS_RELAY) | (1 << OP_ALIAS_ENCRYPTED);
+static const int DION_OPS_PUBLIC_KEY = 1 << OP_PUBLIC_KEY;
+static const int DION_OPS_ENCRYPTED_MESSAGE = 1 << OP_ENCRYPTED_MESSAGE;
+static const int DION_OPS_VERTEX = 1 << OP_VERTEX;
+static const int DION_OPS_MAP_PROJECT = 1 << OP_MAP_PROJECT;
+
 static const int UI_MAX_XUNIT_LENGTH = 520;
 
+// Megabytes of resolved alias records kept in memory by default
+static const int64_t DEFAULT_ALIAS_CACHE = 16;
+
 extern std::map<vchType, uint256> mapLocator;
 extern std::map<vchType, uint256> mapMyMessages;
-extern std::map<vchType, std::set<uint256> > mapState;
+
+/** Hashes alias names for the pending alias maps. Salted per process like
+ *  SaltedTxidHasher, since the names come from whoever relays the tx. */
+class SaltedAliasHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedAliasHasher()
+    {
+        uint256 salt = GetRandHash();
+        k0 = salt.Get64(0);
+        k1 = salt.Get64(1);
+    }
+
+    size_t operator()(const vchType& vch) const { return SipHashBytes(k0, k1, vch.empty() ? NULL : &vch[0], vch.size()); }
+};
+
+typedef boost::unordered_map<vchType, std::set<uint256>, SaltedAliasHasher> PendingAliasMap;
+// Mempool alias txs by the alias they are on, and each one's alias, so that
+// it leaves without its script being decoded again. Entries go with the tx.
+extern PendingAliasMap mapState;
+extern boost::unordered_map<uint256, vchType, SaltedTxidHasher> mapStateByTx;
+void AddPendingAlias(const vchType& vchAlias, const uint256& hash);
+void RemovePendingAlias(const uint256& hash);
 extern std::set<vchType> setNewHashes;
 
 
 unsigned char GetAddressVersion();
 class cba;
+class CTxDB;
 
 int checkAddress(string addr, cba& a);
 
 std::vector<unsigned char> vchFromString(const std::string &str);
 string stringFromVch(const vector<unsigned char> &vch);
 int aliasOutIndex(const CTransaction& tx);
+// Catch the alias index up with the best chain, from where it was left
+bool UpdateAliasIndex();
 bool aliasTxValue(const CTransaction& tx, std::vector<unsigned char>& value);
 bool mTx(const CTransaction& tx, int& op, int& nOut, std::vector<std::vector<unsigned char> >& vvch);
 bool aliasTx(const CTransaction& tx, int& op, int& nOut, std::vector<std::vector<unsigned char> >& vvch);
 bool aliasScript(const CScript& script, int& op, std::vector<std::vector<unsigned char> > &vvch, CScript::const_iterator& pc);
 bool aliasScript(const CScript& script, int& op, std::vector<std::vector<unsigned char> > &vvch);
-          bool ConnectInputsPost( map<uint256, CTxIndex>& mapTestPool,
+          bool ConnectInputsPost(CTxDB& txdb, map<uint256, CTxIndex>& mapTestPool,
            const CTransaction& tx,
            vector<CTransaction>& vTxPrev,
            vector<CTxIndex>& vTxindex,
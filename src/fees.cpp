@@ -0,0 +1,223 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "fees.h"
+#include "main.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+
+using namespace std;
+
+int nTxConfirmTarget = DEFAULT_TX_CONFIRM_TARGET;
+CFeeEstimator feeEstimator;
+
+// Bucket bounds run from MIN_BUCKET_FEE to MAX_BUCKET_FEE per kB, below
+// that is the free bucket
+static const double MIN_BUCKET_FEE = 1000;
+static const double MAX_BUCKET_FEE = 1e8;
+static const double BUCKET_SPACING = 1.25;
+// Counts lose this much per block, a half-life of about 350 blocks
+static const double FEE_DECAY = 0.998;
+// Share that must confirm in time for a bucket to meet its target
+static const double SUCCESS_PCT = 0.85;
+// Decayed transactions per block a range of buckets needs to be judged
+static const double SUFFICIENT_TXS = 0.1;
+
+static const int FEE_ESTIMATES_VERSION = 1;
+
+CFeeEstimator::CFeeEstimator()
+{
+    nBestHeight = 0;
+    vBucketBounds.push_back(0);
+    for (double dBound = MIN_BUCKET_FEE; dBound <= MAX_BUCKET_FEE; dBound *= BUCKET_SPACING)
+        vBucketBounds.push_back(dBound);
+    vConfirmed.assign(MAX_CONFIRM_TARGET, vector<double>(vBucketBounds.size(), 0));
+    vTotal.assign(vBucketBounds.size(), 0);
+    vFeeSum.assign(vBucketBounds.size(), 0);
+}
+
+unsigned int CFeeEstimator::GetBucket(double dFeePerKb) const
+{
+    vector<double>::const_iterator it = upper_bound(vBucketBounds.begin(), vBucketBounds.end(), dFeePerKb);
+    return (it - vBucketBounds.begin()) - 1;
+}
+
+void CFeeEstimator::AddTx(const uint256& hash, double dFeePerKb, int nHeight)
+{
+    LOCK(cs);
+    CTrackedTx tracked;
+    tracked.nHeight = nHeight;
+    tracked.nBucket = GetBucket(max(dFeePerKb, 0.0));
+    tracked.dFeePerKb = dFeePerKb;
+    mapTracked[hash] = tracked;
+}
+
+void CFeeEstimator::RemoveTx(const uint256& hash)
+{
+    LOCK(cs);
+    mapTracked.erase(hash);
+}
+
+void CFeeEstimator::ProcessBlock(int nHeight, const vector<CTransaction>& vtx)
+{
+    LOCK(cs);
+
+    // A block we've counted before, after a reorganization
+    if (nHeight <= nBestHeight)
+    {
+        nBestHeight = nHeight;
+        return;
+    }
+    nBestHeight = nHeight;
+
+    for (unsigned int i = 0; i < vBucketBounds.size(); i++)
+    {
+        for (int nTarget = 0; nTarget < MAX_CONFIRM_TARGET; nTarget++)
+            vConfirmed[nTarget][i] *= FEE_DECAY;
+        vTotal[i] *= FEE_DECAY;
+        vFeeSum[i] *= FEE_DECAY;
+    }
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        map<uint256, CTrackedTx>::iterator mi = mapTracked.find(tx.GetHash());
+        if (mi == mapTracked.end())
+            continue;
+        const CTrackedTx& tracked = mi->second;
+        int nBlocks = nHeight - tracked.nHeight;
+        if (nBlocks > 0)
+        {
+            for (int nTarget = nBlocks; nTarget <= MAX_CONFIRM_TARGET; nTarget++)
+                vConfirmed[nTarget - 1][tracked.nBucket] += 1;
+            vTotal[tracked.nBucket] += 1;
+            vFeeSum[tracked.nBucket] += tracked.dFeePerKb;
+        }
+        mapTracked.erase(mi);
+    }
+}
+
+double CFeeEstimator::EstimateFee(int nBlocks) const
+{
+    if (nBlocks < 1)
+        return -1;
+    nBlocks = min(nBlocks, MAX_CONFIRM_TARGET);
+
+    LOCK(cs);
+
+    // What is still waiting past the target counts against its bucket
+    vector<double> vWaiting(vBucketBounds.size(), 0);
+    for (map<uint256, CTrackedTx>::const_iterator mi = mapTracked.begin(); mi != mapTracked.end(); ++mi)
+        if (nBestHeight - mi->second.nHeight >= nBlocks)
+            vWaiting[mi->second.nBucket] += 1;
+
+    // Walk down from the highest fee rates, grouping buckets until there is
+    // enough data to judge; the cheapest group that still meets the target
+    // gives the estimate, the first that misses it ends the search
+    double dEstimate = -1;
+    double dConfirmed = 0, dTotal = 0, dWaiting = 0, dFeeSum = 0;
+    for (int i = vBucketBounds.size() - 1; i >= 0; i--)
+    {
+        dConfirmed += vConfirmed[nBlocks - 1][i];
+        dTotal += vTotal[i];
+        dWaiting += vWaiting[i];
+        dFeeSum += vFeeSum[i];
+        if (dTotal < SUFFICIENT_TXS / (1 - FEE_DECAY))
+            continue;
+        if (dConfirmed / (dTotal + dWaiting) < SUCCESS_PCT)
+            break;
+        dEstimate = dFeeSum / dTotal;
+        dConfirmed = dTotal = dWaiting = dFeeSum = 0;
+    }
+    return dEstimate;
+}
+
+bool CFeeEstimator::Write() const
+{
+    CDataStream ssFees(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(cs);
+        ssFees << FLATDATA(pchMessageStart) << FEE_ESTIMATES_VERSION << nBestHeight;
+        ssFees << vBucketBounds << vConfirmed << vTotal << vFeeSum;
+    }
+    uint256 hash = Hash(ssFees.begin(), ssFees.end());
+    ssFees << hash;
+
+    boost::filesystem::path pathTmp = GetDataDir() / "fee_estimates.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("CFeeEstimator::Write() : open failed");
+    try {
+        fileout << ssFees;
+    }
+    catch (std::exception &e) {
+        return error("CFeeEstimator::Write() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetDataDir() / "fee_estimates.dat"))
+        return error("CFeeEstimator::Write() : rename-into-place failed");
+    return true;
+}
+
+bool CFeeEstimator::Read()
+{
+    boost::filesystem::path pathFees = GetDataDir() / "fee_estimates.dat";
+    FILE *file = fopen(pathFees.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nDataSize = boost::filesystem::file_size(pathFees) - sizeof(uint256);
+    if (nDataSize < 0)
+        return error("CFeeEstimator::Read() : file too short");
+    vector<unsigned char> vchData(nDataSize);
+    uint256 hashIn;
+    try {
+        if (nDataSize)
+            filein.read((char *)&vchData[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("CFeeEstimator::Read() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssFees(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssFees.begin(), ssFees.end()))
+        return error("CFeeEstimator::Read() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    int nHeight;
+    vector<double> vBoundsIn, vTotalIn, vFeeSumIn;
+    vector<vector<double> > vConfirmedIn;
+    try {
+        ssFees >> FLATDATA(pchMsgTmp) >> nVersion >> nHeight;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("CFeeEstimator::Read() : invalid network magic number");
+        if (nVersion != FEE_ESTIMATES_VERSION)
+            return error("CFeeEstimator::Read() : unknown version %d", nVersion);
+        ssFees >> vBoundsIn >> vConfirmedIn >> vTotalIn >> vFeeSumIn;
+    }
+    catch (std::exception &e) {
+        return error("CFeeEstimator::Read() : I/O error or stream data corrupted");
+    }
+
+    // Counts kept with other buckets are of no use
+    LOCK(cs);
+    if (vBoundsIn != vBucketBounds || vConfirmedIn.size() != vConfirmed.size() ||
+        vTotalIn.size() != vTotal.size() || vFeeSumIn.size() != vFeeSum.size())
+        return error("CFeeEstimator::Read() : bucket layout changed");
+    for (unsigned int i = 0; i < vConfirmedIn.size(); i++)
+        if (vConfirmedIn[i].size() != vBucketBounds.size())
+            return error("CFeeEstimator::Read() : bucket layout changed");
+    nBestHeight = nHeight;
+    vConfirmed.swap(vConfirmedIn);
+    vTotal.swap(vTotalIn);
+    vFeeSum.swap(vFeeSumIn);
+    return true;
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_FEES_H
+#define BITCOIN_FEES_H
+
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <vector>
+
+class CTransaction;
+
+/** Longest confirmation target that can be estimated, in blocks */
+static const int MAX_CONFIRM_TARGET = 25;
+/** Default for -txconfirmtarget, the blocks the wallet's fee aims for */
+static const int DEFAULT_TX_CONFIRM_TARGET = 6;
+
+extern int nTxConfirmTarget;
+
+/** Fee rates that get transactions confirmed in time. Transactions are
+ *  filed by fee rate into exponentially spaced buckets when they enter the
+ *  memory pool; each block records how many blocks the ones it confirms
+ *  took, with older counts decaying. A bucket meets a target if enough of
+ *  its transactions confirmed within it, counting those still waiting past
+ *  the target as failures so a congested pool shows up right away.
+ *  Transactions with unconfirmed parents are left out, their fee pays for
+ *  the parents too. */
+class CFeeEstimator
+{
+private:
+    mutable CCriticalSection cs;
+
+    // Lower bound of each bucket, per kB
+    std::vector<double> vBucketBounds;
+    // [target - 1][bucket]: transactions that confirmed within target blocks
+    std::vector<std::vector<double> > vConfirmed;
+    // [bucket]: all confirmed transactions, and their summed fee rates
+    std::vector<double> vTotal;
+    std::vector<double> vFeeSum;
+    int nBestHeight;
+
+    struct CTrackedTx
+    {
+        int nHeight;
+        unsigned int nBucket;
+        double dFeePerKb;
+    };
+    std::map<uint256, CTrackedTx> mapTracked;
+
+    unsigned int GetBucket(double dFeePerKb) const;
+
+public:
+    CFeeEstimator();
+
+    /** hash entered the memory pool at nHeight */
+    void AddTx(const uint256& hash, double dFeePerKb, int nHeight);
+    /** hash left the memory pool without being confirmed */
+    void RemoveTx(const uint256& hash);
+    /** The block at nHeight on top of the best chain confirmed vtx */
+    void ProcessBlock(int nHeight, const std::vector<CTransaction>& vtx);
+
+    /** Fee per kB that confirms within nBlocks, or -1 without enough data */
+    double EstimateFee(int nBlocks) const;
+
+    /** fee_estimates.dat in the data directory */
+    bool Write() const;
+    bool Read();
+};
+
+extern CFeeEstimator feeEstimator;
+
+#endif
@@ -10,12 +10,21 @@
 #include "util.h"
 #include "ui_interface.h"
 #include "checkpoints.h"
+#include "blockimport.h"
+#include "blockencodings.h"
+#include "chainsnapshot.h"
+#include "kernel.h"
+#include "blocksync.h"
+#include "fees.h"
+#include "notify.h"
 #include "zerocoin/ZeroTest.h"
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/convenience.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <openssl/crypto.h>
 
 #include "main.h"
@@ -28,18 +37,42 @@
 using namespace std;
 using namespace boost;
 
-extern void xsc(CBlockIndex*);
-__wx__* pwalletMain;
+CWalletRef pwalletMain;
+std::map<std::string, __wx__*> mapWallets;
 CClientUIInterface uiInterface;
 bool fConfChange;
 bool fEnforceCanonical;
 unsigned int nNodeLifespan;
 unsigned int nDerivationMethodIndex;
 unsigned int nMinerSleep;
-string strDNSSeedNode;
 bool fUseFastIndex;
 enum Checkpoints::CPMode CheckpointsMode;
 LocatorNodeDB* ln1Db = NULL;
+static void NoWalletCleanup(__wx__* pwallet) {}
+static boost::thread_specific_ptr<__wx__> pwalletRPCThread(NoWalletCleanup);
+
+__wx__* CWalletRef::get() const
+{
+    __wx__* pwalletThread = pwalletRPCThread.get();
+    return pwalletThread ? pwalletThread : pwallet;
+}
+
+CRPCWalletScope::CRPCWalletScope(__wx__* pwallet)
+{
+    pwalletRPCThread.reset(pwallet);
+}
+
+CRPCWalletScope::~CRPCWalletScope()
+{
+    pwalletRPCThread.reset(NULL);
+}
+
+__wx__* FindWallet(const std::string& strWalletFile)
+{
+    std::map<std::string, __wx__*>::const_iterator mi = mapWallets.find(strWalletFile);
+    return mi == mapWallets.end() ? NULL : (*mi).second;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Shutdown
@@ -88,10 +121,21 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        if (GetBoolArg("-persistmempool", true))
+            DumpMempool();
+        feeEstimator.Write();
+        {
+            LOCK(cs_main);
+            CTxDB::Flush(true);
+            CTxDB::WriteBlockIndexSnapshot();
+        }
         bitdb.Flush(true);
         boost::filesystem::remove(GetPidFile());
-        UnregisterWallet(pwalletMain);
-        delete pwalletMain;
+        BOOST_FOREACH(const PAIRTYPE(string, __wx__*)& item, mapWallets)
+        {
+            UnregisterWallet(item.second);
+            delete item.second;
+        }
         delete ln1Db;
         NewThread(ExitTimeout, NULL);
         MilliSleep(50);
@@ -187,6 +231,8 @@ bool AppInit(int argc, char* argv[])
 }
 
 extern void noui_connect();
+// bench_iocoin links this file for the node's globals and brings its own main
+#ifndef BENCH_IOCOIN
 int main(int argc, char* argv[])
 {
     bool fRet = false;
@@ -202,6 +248,7 @@ int main(int argc, char* argv[])
     return 1;
 }
 #endif
+#endif
 
 bool static InitError(const std::string &str)
 {
@@ -236,19 +283,49 @@ std::string HelpMessage()
         "  -conf=<file>           " + _("Specify configuration file (default: iocoin.conf)") + "\n" +
         "  -pid=<file>            " + _("Specify pid file (default: iocoind.pid)") + "\n" +
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
-        "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n" +
+        "  -wallet=<dir>          " + _("Specify wallet file (within data directory); repeat to load several, the first is the default") + "\n" +
+        "  -stakewallet=<file>    " + _("Also stake with this further -wallet") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
+        "  -maxsigcachesize=<n>   " + strprintf(_("Keep at most <n> MB of verified signatures (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n" +
+        "  -dbwritebuffer=<n>     " + _("Set the tx database write buffer size in megabytes (default: 4)") + "\n" +
+        "  -dbblocksize=<n>       " + _("Set the tx database block size in kilobytes (default: 4)") + "\n" +
+        "  -dbmaxopenfiles=<n>    " + _("Maximum number of database files kept open (default: 1000)") + "\n" +
+        "  -dbcompactiontrigger=<n> " + _("Compact the databases once they have this many level-0 files (default: 4)") + "\n" +
+        "  -dbslowdowntrigger=<n> " + _("Delay database writes at this many level-0 files (default: 8)") + "\n" +
+        "  -dbstoptrigger=<n>     " + _("Hold database writes until a compaction finishes at this many level-0 files (default: 12)") + "\n" +
+        "  -dbcompression         " + _("Compress database blocks with snappy (default: 1)") + "\n" +
+        "  -splitblockindex       " + _("Keep the block index in a separate database from the tx index") + "\n" +
+        "  -blockindexsnapshot    " + _("Save the block index on shutdown and load it from there at startup (default: 1)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -walletdbcache=<n>     " + strprintf(_("Set the wallet database cache size in megabytes (default: %"PRId64")"), DEFAULT_WALLET_DB_CACHE) + "\n" +
+        "  -dblogbuffer=<n>       " + _("Set the wallet database log buffer size in kilobytes (default: 1024)") + "\n" +
+        "  -dbcheckpointmins=<n>  " + _("Checkpoint the wallet database log at least every <n> minutes (default: 1)") + "\n" +
+        "  -dbmaxlocks=<n>        " + _("Maximum number of wallet database locks (default: 537000)") + "\n" +
+        "  -dbmaxlockobjects=<n>  " + _("Maximum number of wallet database lock objects (default: 10000)") + "\n" +
+        "  -prune=<n>             " + _("Reduce storage by deleting old block files once their contents are spent, keeping about <n> MB (default: 0 = disable)") + "\n" +
+        "  -mmapblocks            " + _("Read block files through memory mappings (default: 1 on 64-bit systems)") + "\n" +
+        "  -maxorphanblocksmb=<n> " + strprintf(_("Keep at most <n> MB of blocks whose parent is missing (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS_MB) + "\n" +
+        "  -servecachemb=<n>      " + strprintf(_("Keep up to <n> MB of recently served blocks ready to send (default: %u)"), DEFAULT_BLOCK_MESSAGE_CACHE_MB) + "\n" +
+        "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> MB (default: %u)"), DEFAULT_MAX_MEMPOOL_MB) + "\n" +
+        "  -persistmempool        " + _("Save the memory pool on shutdown and load it on startup (default: 1)") + "\n" +
+        "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_SCRIPTCHECK_THREADS) + "\n" +
+        "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_STAKESEARCH_THREADS) + "\n" +
+        "  -threadpriority=<pool>:<priority> " + _("Run the threads of a pool (validation, network, rpc, staking, background) at lowest, low, normal or high priority (default: staking lowest, background low, others normal)") + "\n" +
+        "  -threadaffinity=<pool>:<cpus> " + _("Pin the threads of a pool to a list of CPUs such as 0-3,6") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
-        "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n"
+        "  -tor=<ip:port>         " + _("Use proxy to reach tor hidden services (default: same as -proxy)") + "\n" +
+        "  -proxypool=<n>         " + _("Keep <n> connections open to each socks5 proxy, ready for outbound connections (default: 2)") + "\n"
         "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n" +
         "  -port=<port>           " + _("Listen for connections on <port> (default: 33764 or testnet: 43764)") + "\n" +
         "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n" +
         "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n" +
         "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n" +
         "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n" +
+        "  -assumevalid=<hash>    " + _("Skip script checks for this block and its ancestors, 0 to check all (default: last checkpoint)") + "\n" +
+        "  -compactblocks         " + _("Ask peers for new blocks as short transaction ids, filled in from the memory pool (default: 1)") + "\n" +
+        "  -headersfirst          " + _("Download the header chain first, then blocks from several peers in parallel (default: 1)") + "\n" +
         "  -externalip=<ip>       " + _("Specify your own public address") + "\n" +
         "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or Tor)") + "\n" +
         "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n" +
@@ -256,12 +333,20 @@ std::string HelpMessage()
         "  -listen                " + _("Accept connections from outside (default: 1 if no -proxy or -connect)") + "\n" +
         "  -bind=<addr>           " + _("Bind to given address. Use [host]:port notation for IPv6") + "\n" +
         "  -dnsseed               " + _("Find peers using DNS lookup (default: 1)") + "\n" +
+        "  -dnsseednode=<host>    " + _("Look up <host> for peers when there are no saved addresses, can be given more than once") + "\n" +
+        "  -forcednsseed          " + _("Query DNS seeds even with saved addresses (default: 0)") + "\n" +
         "  -synctime              " + _("Sync time with other nodes. Disable if time on your system is precise e.g. syncing with NTP (default: 1)") + "\n" +
         "  -cppolicy              " + _("Sync checkpoints policy (default: strict)") + "\n" +
         "  -banscore=<n>          " + _("Threshold for disconnecting misbehaving peers (default: 100)") + "\n" +
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -msghandlers=<n>       " + _("Number of threads processing peer messages (1-16, default: 4)") + "\n" +
+        "  -maxuploadtarget=<n>   " + _("Tries to keep outbound traffic under the given target (in MiB per 24h), 0 = no limit (default: 0)") + "\n" +
+        "  -maxsendrate=<n>       " + _("Send to all peers together at most <n> KB per second, 0 = no limit (default: 0)") + "\n" +
+        "  -compress              " + _("Compress blocks and transactions sent to peers that support it (default: 1)") + "\n" +
+        "  -peerbloomfilters      " + _("Support filtering of blocks and transactions with bloom filters (default: 1)") + "\n" +
+        "  -fastpeer=<ip>         " + _("Trust the peer at <ip>: never ban it, and relay blocks to it first and as soon as they pass initial checks") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -270,7 +355,14 @@ std::string HelpMessage()
 #endif
 #endif
         "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n" +
+        "  -walletrbf             " + _("Send transactions that a higher fee can replace in the memory pool (default: 0)") + "\n" +
+        "  -coinselectiontries=<n> " + strprintf(_("Steps of the search for inputs that need no change before falling back (default: %d)"), DEFAULT_COIN_SELECTION_TRIES) + "\n" +
+        "  -txconfirmtarget=<n>   " + strprintf(_("Raise the fee of transactions you send to confirm within <n> blocks, 0 to pay -paytxfee only (default: %d)"), DEFAULT_TX_CONFIRM_TARGET) + "\n" +
         "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.01)") + "\n" +
+        "  -compactwallet         " + _("Merge small outputs of an address into outputs big enough to stake, in the background (default: 0)") + "\n" +
+        "  -compactinterval=<n>   " + _("Seconds between two merges of -compactwallet (default: 600)") + "\n" +
+        "  -compactmaxfee=<amt>   " + _("Largest fee for one merge of -compactwallet (default: 0.01)") + "\n" +
+        "  -compactfeebudget=<amt> " + _("Most fees -compactwallet pays in 24 hours (default: 0.1)") + "\n" +
 #ifdef QT_GUI
         "  -server                " + _("Accept command line and JSON-RPC commands") + "\n" +
 #endif
@@ -280,7 +372,10 @@ std::string HelpMessage()
         "  -testnet               " + _("Use the test network") + "\n" +
         "  -viewwallet               " + _("view wallet only") + "\n" +
         "  -debug                 " + _("Output extra debugging information. Implies all other -debug* options") + "\n" +
+        "  -debug=<category>      " + _("Output debugging information for one category: net, mempool, dions, stake or db. Can be given more than once") + "\n" +
         "  -debugnet              " + _("Output extra network debugging information") + "\n" +
+        "  -debugbench            " + _("Output per-stage block connect timings") + "\n" +
+        "  -lockstats             " + _("Count lock acquisitions, waits and hold times per call site from startup (see getlockstats)") + "\n" +
         "  -logtimestamps         " + _("Prepend debug output with timestamp") + "\n" +
         "  -shrinkdebugfile       " + _("Shrink debug.log file on client startup (default: 1 when no -debug)") + "\n" +
         "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n" +
@@ -291,9 +386,17 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 33765 or testnet: 43765)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Serve JSON-RPC calls on <n> threads (default: 4)") + "\n" +
+        "  -rpcqueue=<n>          " + _("Queue at most <n> JSON-RPC connections for the threads, refuse the rest (default: 64)") + "\n" +
+        "  -rpcstreamthreshold=<n> " + _("Stream JSON-RPC results with at least <n> entries as chunked replies, 0 to never (default: 1000)") + "\n" +
+        "  -rest                  " + _("Serve public block, transaction and header data unauthenticated under /rest/ on the RPC port") + "\n" +
+        "  -rpcmetrics            " + _("Serve node and per-method RPC metrics in Prometheus text format under /metrics on the RPC port") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
+        "  -rpcwallet=<file>      " + _("Send commands to the wallet loaded from <file> (default: the first -wallet)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
+        "  -notifyport=<port>     " + _("Publish wallet transaction and best block events to local connections on <port>") + "\n" +
+        "  -notifytopics=<list>   " + _("Also publish these events to -notifyport connections as they happen, comma separated: hashblock, rawblock, hashtx, rawtx, alias") + "\n" +
          "  -zapwallettxes=<mode>" +  _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
         "  -enforcecanonical      " + _("Enforce transaction scripts to use canonical PUSH operators (default: 1)") + "\n" +
@@ -302,10 +405,16 @@ std::string HelpMessage()
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -xscan                " + _("Rescan the block chain for aliases") + "\n" +
+        "  -aliascache=<n>        " + _("Keep up to <n> MB of resolved alias records in memory (default: 16)") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
         "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n" +
         "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n" +
+        "  -reindex               " + _("Rebuild the block index and tx database from the blk000?.dat files on disk") + "\n" +
+        "  -loadsnapshot=<file>   " + _("Start an empty data directory from a published chainstate snapshot, and verify the history before it in the background") + "\n" +
+        "  -addrindex             " + _("Maintain an index of the outputs paid to and spent from each address, for the getaddress* calls (default: 0)") + "\n" +
+        "  -spentindex            " + _("Maintain an index of which input spent each output and of the block of each transaction, for getrawtransaction verbose=2 (default: 0)") + "\n" +
+        "  -blockstatsindex       " + _("Maintain per-block stake, reward, fee and size statistics, for getblockstats and getchainstats (default: 0)") + "\n" +
 
         "\n" + _("Block creation options:") + "\n" +
         "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n" +
@@ -338,11 +447,135 @@ bool InitSanityCheck(void)
     return true;
 }
 
+/** Load a wallet named by a further -wallet and catch it up with the chain.
+ *  It shares the database environment and chain state with the default
+ *  wallet and has its own cs_wallet; upgrades and alias rescans are left to
+ *  the default wallet.
+ */
+static bool LoadExtraWallet(const std::string& strWalletFile, std::ostringstream& strErrors)
+{
+    printf("Loading wallet %s...\n", strWalletFile.c_str());
+    int64_t nStart = GetTimeMillis();
+    bool fFirstRun = true;
+    __wx__* pwallet = new __wx__(strWalletFile);
+    DBErrors nLoadWalletRet = pwallet->LoadWallet(fFirstRun);
+    if (nLoadWalletRet != DB_LOAD_OK && nLoadWalletRet != DB_NONCRITICAL_ERROR)
+    {
+        if (nLoadWalletRet == DB_CORRUPT)
+            strErrors << strprintf(_("Error loading %s: Wallet corrupted"), strWalletFile.c_str()) << "\n";
+        else if (nLoadWalletRet == DB_TOO_NEW)
+            strErrors << strprintf(_("Error loading %s: Wallet requires newer version of I/OCoin"), strWalletFile.c_str()) << "\n";
+        else
+            strErrors << strprintf(_("Error loading %s"), strWalletFile.c_str()) << "\n";
+        delete pwallet;
+        return false;
+    }
+    if (nLoadWalletRet == DB_NONCRITICAL_ERROR)
+        printf("Warning: error reading %s, transaction data or address book entries might be missing\n", strWalletFile.c_str());
+
+    if (fFirstRun)
+    {
+        RandAddSeedPerfmon();
+        CPubKey newDefaultKey;
+        LOCK(pwallet->cs_wallet);
+        if (pwallet->GetKeyFromPool(newDefaultKey, false)) {
+            pwallet->SetDefaultKey(newDefaultKey);
+            if (!pwallet->SetAddressBookName(pwallet->vchDefaultKey.GetID(), ""))
+                strErrors << strprintf(_("Cannot write default address to %s"), strWalletFile.c_str()) << "\n";
+        }
+    }
+
+    RegisterWallet(pwallet);
+    mapWallets[strWalletFile] = pwallet;
+
+    CBlockIndex *pindexRescan = pindexBest;
+    if (GetBoolArg("-rescan") || fFirstRun)
+        pindexRescan = pindexGenesisBlock;
+    else
+    {
+        __wx__DB walletdb(strWalletFile);
+        CBlockLocator locator;
+        if (walletdb.ReadBestBlock(locator))
+            pindexRescan = locator.GetBlockIndex();
+    }
+    if (pindexBest && pindexRescan && pindexBest->nHeight > pindexRescan->nHeight)
+    {
+        printf("Rescanning last %i blocks for %s...\n", pindexBest->nHeight - pindexRescan->nHeight, strWalletFile.c_str());
+        pwallet->ScanForWalletTransactions(pindexRescan, true);
+    }
+    printf(" wallet %s %15"PRId64"ms\n", strWalletFile.c_str(), GetTimeMillis() - nStart);
+    return true;
+}
+
+// How long each stage of AppInit2 took, printed once it is done. Stages
+// run alongside others are marked as such.
+static vector<pair<string, int64_t> > vInitTimes;
+
+static void AddInitTime(const string& strStage, int64_t nTime)
+{
+    vInitTimes.push_back(make_pair(strStage, nTime));
+}
+
+// wallet.dat only holds the wallet's own records, so it is read while
+// LoadBlockIndex runs; nothing is taken from the chain until the join
+static void ThreadLoadWallet(__wx__* pwallet, bool* pfFirstRun, DBErrors* pnRet, int64_t* pnTime)
+{
+    RenameThread("iocoin-loadwlt");
+    int64_t nStart = GetTimeMillis();
+    try
+    {
+        *pnRet = pwallet->LoadWallet(*pfFirstRun);
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadLoadWallet()");
+        *pnRet = DB_CORRUPT;
+    }
+    *pnTime = GetTimeMillis() - nStart;
+}
+
+// Nothing uses addrman until the node starts, after the join
+static void ThreadLoadPeers(bool* pfOk, int64_t* pnTime)
+{
+    RenameThread("iocoin-loadpeer");
+    int64_t nStart = GetTimeMillis();
+    try
+    {
+        CAddrDB adb;
+        *pfOk = adb.Read(addrman);
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadLoadPeers()");
+        *pfOk = false;
+    }
+    *pnTime = GetTimeMillis() - nStart;
+}
+
+/** A loader run alongside AppInit2. It writes through pointers into
+ *  AppInit2's frame, so it is joined on every way out of it. */
+class CInitThread
+{
+private:
+    boost::thread thread;
+
+public:
+    template<typename F>
+    explicit CInitThread(F f) : thread(f) {}
+    ~CInitThread() { join(); }
+
+    void join()
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+};
+
 /** Initialize bitcoin.
  *  @pre Parameters should be parsed and config file should be read.
  */
 bool AppInit2()
 {
+    int64_t nInitStart = GetTimeMillis();
+
     // ********************************************************* Step 1: setup
 #ifdef _MSC_VER
     // Turn off Microsoft heap dump noise
@@ -389,13 +622,38 @@ bool AppInit2()
 
     nNodeLifespan = GetArg("-addrlifespan", 7);
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fMapBlockFiles = GetBoolArg("-mmapblocks", fMapBlockFiles);
+
+    if (GetArg("-prune", 0) > 0)
+    {
+        nPruneTarget = (uint64_t)GetArg("-prune", 0) * 1024 * 1024;
+        if (nPruneTarget < MIN_PRUNE_TARGET)
+            return InitError(strprintf(_("Prune configured below the minimum of %d MB.  Please use a higher number."), (int)(MIN_PRUNE_TARGET / 1024 / 1024)));
+        if (GetBoolArg("-rescan"))
+            return InitError(_("Rescans are not possible in pruned mode."));
+        // We can't serve the full chain any more
+        nLocalServices &= ~NODE_NETWORK;
+    }
+    if (GetBoolArg("-compress", true))
+        nLocalServices |= NODE_COMPRESS;
+    if (GetBoolArg("-peerbloomfilters", true))
+        nLocalServices |= NODE_BLOOM;
     nMinerSleep = GetArg("-minersleep", 500);
+    fReindex = GetBoolArg("-reindex");
+    fHeadersFirst = GetBoolArg("-headersfirst", true);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
+    // Room for at least one block of the largest size
+    nMaxOrphanBlocksSize = max((int64_t)MAX_BLOCK_SIZE, GetArg("-maxorphanblocksmb", DEFAULT_MAX_ORPHAN_BLOCKS_MB) * 1000000);
+    nBlockMessageCacheSize = max((int64_t)0, GetArg("-servecachemb", DEFAULT_BLOCK_MESSAGE_CACHE_MB) * 1000000);
+    SetMaxOutboundTarget(max((int64_t)0, GetArg("-maxuploadtarget", 0)) * 1024 * 1024);
+    SetMaxSendRate(GetArg("-maxsendrate", 0) * 1000);
+    // Room for a few full blocks of transactions
+    nMaxMempoolSize = max((int64_t)(5 * MAX_BLOCK_SIZE), GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_MB) * 1000000);
 
 
     CheckpointsMode = Checkpoints::STRICT;
     std::string strCpMode = GetArg("-cppolicy", "strict");
 
-    strDNSSeedNode = GetArg("-dnsseednode", "default");
 
     if(strCpMode == "strict")
         CheckpointsMode = Checkpoints::STRICT;
@@ -409,9 +667,14 @@ bool AppInit2()
     nDerivationMethodIndex = 0;
 
     fTestNet = GetBoolArg("-testnet");
-    if (fTestNet) {
-        SoftSetBoolArg("-irc", true);
-    }
+
+    // Trust the scripts up to the last hard-coded checkpoint unless told otherwise
+    if (mapArgs.count("-assumevalid"))
+        hashAssumeValid = uint256(mapArgs["-assumevalid"]);
+    else
+        hashAssumeValid = Checkpoints::GetLastCheckpointHash();
+    if (hashAssumeValid != 0)
+        printf("Assuming scripts valid for block %s and its ancestors\n", hashAssumeValid.ToString().c_str());
 
     fViewWallet = GetBoolArg("-viewwallet");
     if(fViewWallet)
@@ -462,12 +725,20 @@ bool AppInit2()
     // ********************************************************* Step 3: parameter-to-internal-flags
 
     fDebug = GetBoolArg("-debug");
+    if (mapMultiArgs.count("-debug"))
+        SetDebugCategories(mapMultiArgs["-debug"]);
 
     // -debug implies fDebug*
     if (fDebug)
+    {
         fDebugNet = true;
+        fDebugBench = true;
+    }
     else
-        fDebugNet = GetBoolArg("-debugnet");
+    {
+        fDebugNet = GetBoolArg("-debugnet") || LogAcceptCategory("net");
+        fDebugBench = GetBoolArg("-debugbench");
+    }
 
 #if !defined(WIN32) && !defined(QT_GUI)
     fDaemon = GetBoolArg("-daemon");
@@ -487,6 +758,30 @@ bool AppInit2()
     fPrintToConsole = GetBoolArg("-printtoconsole");
     fPrintToDebugger = GetBoolArg("-printtodebugger");
     fLogTimestamps = GetBoolArg("-logtimestamps");
+    fLockProfiling = GetBoolArg("-lockstats");
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    nStakeSearchThreads = GetArg("-stakethreads", 0);
+    if (nStakeSearchThreads <= 0)
+        nStakeSearchThreads += boost::thread::hardware_concurrency();
+    if (nStakeSearchThreads <= 1)
+        nStakeSearchThreads = 0;
+    else if (nStakeSearchThreads > MAX_STAKESEARCH_THREADS)
+        nStakeSearchThreads = MAX_STAKESEARCH_THREADS;
+
+    {
+        string strError;
+        if (!InitThreadPools(strError))
+            return InitError(strError);
+    }
 
     if (mapArgs.count("-timeout"))
     {
@@ -502,6 +797,9 @@ bool AppInit2()
         if (nTransactionFee > 0.25 * COIN)
             InitWarning(_("Warning: -paytxfee is set very high! This is the transaction fee you will pay if you send a transaction."));
     }
+    fWalletRbf = GetBoolArg("-walletrbf", false);
+    nCoinSelectionTries = max(0, (int)GetArg("-coinselectiontries", DEFAULT_COIN_SELECTION_TRIES));
+    nTxConfirmTarget = min((int)GetArg("-txconfirmtarget", DEFAULT_TX_CONFIRM_TARGET), MAX_CONFIRM_TARGET);
 
     fConfChange = GetBoolArg("-confchange", false);
     fEnforceCanonical = GetBoolArg("-enforcecanonical", true);
@@ -518,11 +816,25 @@ bool AppInit2()
         return InitError(_("Initialization sanity check failed. I/OCoin is shutting down."));
 
     std::string strDataDir = GetDataDir().string();
-    std::string strWalletFileName = GetArg("-wallet", "wallet.dat");
 
-    // strWalletFileName must be a plain filename without a directory
-    if (strWalletFileName != boost::filesystem::basename(strWalletFileName) + boost::filesystem::extension(strWalletFileName))
-        return InitError(strprintf(_("Wallet %s resides outside data directory %s."), strWalletFileName.c_str(), strDataDir.c_str()));
+    // The first -wallet is the default wallet, the others are reached
+    // over RPC at /wallet/<file>
+    std::vector<std::string> vWalletFiles;
+    if (mapMultiArgs.count("-wallet"))
+        vWalletFiles = mapMultiArgs["-wallet"];
+    else
+        vWalletFiles.push_back("wallet.dat");
+    std::string strWalletFileName = vWalletFiles[0];
+
+    std::set<std::string> setWalletFiles;
+    BOOST_FOREACH(const std::string& strFile, vWalletFiles)
+    {
+        // each wallet must be a plain filename without a directory
+        if (strFile != boost::filesystem::basename(strFile) + boost::filesystem::extension(strFile))
+            return InitError(strprintf(_("Wallet %s resides outside data directory %s."), strFile.c_str(), strDataDir.c_str()));
+        if (!setWalletFiles.insert(strFile).second)
+            return InitError(strprintf(_("Wallet %s is loaded more than once."), strFile.c_str()));
+    }
 
     // Make sure only a single Bitcoin process is using the data directory.
     boost::filesystem::path pathLockFile = GetDataDir() / ".lock";
@@ -556,6 +868,8 @@ bool AppInit2()
 
     if (GetBoolArg("-shrinkdebugfile", !fDebug))
         ShrinkDebugFile();
+    if (!NewThread(ThreadDebugLog, NULL))
+        fprintf(stderr, "Error: NewThread(ThreadDebugLog) failed\n");
     printf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     printf("I/OCoin version %s (%s)\n", FormatFullVersion().c_str(), CLIENT_DATE.c_str());
     printf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
@@ -568,11 +882,28 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "I/OCoin server starting\n");
 
+    if (nScriptCheckThreads) {
+        printf("Using %u threads for script and block verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+        {
+            NewThread(ThreadScriptCheck, NULL, THREADPOOL_VALIDATION);
+            NewThread(ThreadBlockCheck, NULL, THREADPOOL_VALIDATION);
+            NewThread(ThreadHeaderHash, NULL, THREADPOOL_VALIDATION);
+        }
+    }
+
+    if (nStakeSearchThreads) {
+        printf("Using %u threads for stake kernel search\n", nStakeSearchThreads);
+        for (int i=0; i<nStakeSearchThreads-1; i++)
+            NewThread(ThreadStakeSearch, NULL, THREADPOOL_STAKING);
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
 
     uiInterface.InitMessage(_("Verifying database integrity..."));
+    nStart = GetTimeMillis();
 
     if (!bitdb.Open(GetDataDir()))
     {
@@ -589,9 +920,11 @@ bool AppInit2()
             return false;
     }
 
-    if (filesystem::exists(GetDataDir() / strWalletFileName))
+    BOOST_FOREACH(const std::string& strFile, vWalletFiles)
     {
-        CDBEnv::VerifyResult r = bitdb.Verify(strWalletFileName, __wx__DB::Recover);
+        if (!filesystem::exists(GetDataDir() / strFile))
+            continue;
+        CDBEnv::VerifyResult r = bitdb.Verify(strFile, __wx__DB::Recover);
         if (r == CDBEnv::RECOVER_OK)
         {
             string msg = strprintf(_("Warning: wallet.dat corrupt, data salvaged!"
@@ -603,6 +936,7 @@ bool AppInit2()
         if (r == CDBEnv::RECOVER_FAIL)
             return InitError(_("wallet.dat corrupt, salvage failed"));
     }
+    AddInitTime("verify db", GetTimeMillis() - nStart);
 
     // ********************************************************* Step 6: network initialization
 
@@ -715,6 +1049,14 @@ bool AppInit2()
     BOOST_FOREACH(string strDest, mapMultiArgs["-seednode"])
         AddOneShot(strDest);
 
+    BOOST_FOREACH(string strAddr, mapMultiArgs["-fastpeer"])
+    {
+        CNetAddr addr(strAddr);
+        if (!addr.IsValid())
+            return InitError(strprintf(_("Invalid -fastpeer address: '%s'"), strAddr.c_str()));
+        AddFastPeer(addr);
+    }
+
     // ********************************************************* Step 7: load blockchain
 
     if (!bitdb.Open(GetDataDir()))
@@ -733,11 +1075,67 @@ bool AppInit2()
         return false;
     }
 
+    if (fReindex)
+    {
+        uiInterface.InitMessage(_("Preparing to reindex..."));
+        if (!PrepareReindex())
+            return InitError(_("Unable to move the block files aside for -reindex"));
+    }
+    else if (GetPendingReindexFile())
+    {
+        printf("Resuming unfinished reindex\n");
+        fReindex = true;
+    }
+    else if (mapArgs.count("-loadsnapshot"))
+    {
+        CChainSnapshotInfo info;
+        string strError;
+        nStart = GetTimeMillis();
+        if (!LoadChainSnapshot(mapArgs["-loadsnapshot"], info, strError))
+            return InitError(strError);
+        AddInitTime("chainstate snapshot", GetTimeMillis() - nStart);
+    }
+    if (IsChainSnapshotLoadPending())
+        return InitError(_("Loading a chainstate snapshot was interrupted; restart with -loadsnapshot or -reindex"));
+
+      if (GetBoolArg("-zapwallettxes", false)) 
+      {
+        printf("Zapping all transactions from wallet...");
+
+        pwalletMain = new __wx__("wallet.dat");
+        DBErrors nZapWalletRet = pwalletMain->ZapWalletTx();
+        if (nZapWalletRet != DB_LOAD_OK) 
+        {
+          printf("Error loading wallet.dat: Wallet corrupted");
+          return false;
+        }
+
+        delete pwalletMain;
+        pwalletMain = NULL;
+      }
+
+    // wallet.dat and peers.dat are read while the block index loads; the
+    // wallet is joined at Step 8 and the peers at Step 10
+    bool fFirstRun = true;
+    DBErrors nLoadWalletRet = DB_LOAD_OK;
+    int64_t nWalletTime = 0;
+    pwalletMain = new __wx__(strWalletFileName);
+    CInitThread threadLoadWallet(boost::bind(&ThreadLoadWallet, pwalletMain.get(), &fFirstRun, &nLoadWalletRet, &nWalletTime));
+    bool fPeersOk = false;
+    int64_t nPeersTime = 0;
+    CInitThread threadLoadPeers(boost::bind(&ThreadLoadPeers, &fPeersOk, &nPeersTime));
+
     uiInterface.InitMessage(_("Loading block index..."));
     printf("Loading block index...\n");
     nStart = GetTimeMillis();
     if (!LoadBlockIndex())
       return InitError(_("Error loading blkindex.dat"));
+    if (GetBoolArg("-addrindex") && !fAddrIndex)
+        return InitError(_("The address index has to be built from the genesis block on; restart with -reindex to enable -addrindex"));
+    if (GetBoolArg("-spentindex") && !fSpentIndex)
+        return InitError(_("The spent index has to be built from the genesis block on; restart with -reindex to enable -spentindex"));
+    if (GetBoolArg("-blockstatsindex") && !fBlockStatsIndex)
+        return InitError(_("The block stats index has to be built from the genesis block on; restart with -reindex to enable -blockstatsindex"));
 
 
     // as LoadBlockIndex can take several minutes, it's possible the user
@@ -749,6 +1147,17 @@ bool AppInit2()
         return false;
     }
     printf(" block index %15"PRId64"ms\n", GetTimeMillis() - nStart);
+    AddInitTime("block index", GetTimeMillis() - nStart);
+    if (!fBlockIndexVerified)
+        NewThread(ThreadVerifyBlockIndex, NULL, THREADPOOL_BACKGROUND);
+    CChainSnapshotState snapshotState;
+    if (GetChainSnapshotState(snapshotState))
+    {
+        if (snapshotState.fFailed)
+            return InitError(_("The chainstate snapshot this node started from failed verification; restart with -reindex"));
+        if (!snapshotState.IsVerified())
+            NewThread(ThreadVerifyChainSnapshot, NULL, THREADPOOL_BACKGROUND);
+    }
 
     if (GetBoolArg("-printblockindex") || GetBoolArg("-printblocktree"))
     {
@@ -760,7 +1169,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -789,30 +1198,22 @@ bool AppInit2()
         printf("=== ZeroCoin tests end ===\n\n");
     }
 
-    // ********************************************************* Step 8: load wallet
-
-      if (GetBoolArg("-zapwallettxes", false)) 
-      {
-        printf("Zapping all transactions from wallet...");
-
-        pwalletMain = new __wx__("wallet.dat");
-        DBErrors nZapWalletRet = pwalletMain->ZapWalletTx();
-        if (nZapWalletRet != DB_LOAD_OK) 
-        {
-          printf("Error loading wallet.dat: Wallet corrupted");
-          return false;
-        }
+    if (GetArg("-zerobench", 0) > 0)
+    {
+        printf("\n=== ZeroCoin benchmark start ===\n");
+        Benchmark_RunAll(GetArg("-zerobenchlevel", ZEROCOIN_DEFAULT_SECURITYLEVEL), GetArg("-zerobench", 0));
+        printf("=== ZeroCoin benchmark end ===\n\n");
+    }
 
-        delete pwalletMain;
-        pwalletMain = NULL;
-      }
+    // ********************************************************* Step 8: load wallet
 
     uiInterface.InitMessage(_("Loading wallet..."));
     printf("Loading wallet...\n");
     nStart = GetTimeMillis();
-    bool fFirstRun = true;
-    pwalletMain = new __wx__(strWalletFileName);
-    DBErrors nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
+    threadLoadWallet.join();
+    printf(" wallet read %15"PRId64"ms, waited %"PRId64"ms for it\n", nWalletTime, GetTimeMillis() - nStart);
+    AddInitTime("wallet read (alongside)", nWalletTime);
+    nStart = GetTimeMillis();
     if (nLoadWalletRet != DB_LOAD_OK)
     {
         if (nLoadWalletRet == DB_CORRUPT)
@@ -874,8 +1275,13 @@ bool AppInit2()
 
     printf("%s", strErrors.str().c_str());
     printf(" wallet      %15"PRId64"ms\n", GetTimeMillis() - nStart);
+    AddInitTime("wallet setup", GetTimeMillis() - nStart);
 
     RegisterWallet(pwalletMain);
+    mapWallets[strWalletFileName] = pwalletMain;
+
+    if (!CTxDB("r+").UpgradeAliasIndex())
+      return InitError(_("Error upgrading the alias index"));
 
     if(GetBoolArg("-xscan"))
     {
@@ -883,10 +1289,21 @@ bool AppInit2()
       FILE *file = fopen(dc.string().c_str(), "rb");
       if (file) 
       {
+        fclose(file);
         filesystem::path dc__ = GetDataDir() / "aliascache.dat.old";
         RenameOver(dc, dc__);
       }
+
+      // Rebuilt from the chain by UpdateAliasIndex() below
+      LocatorNodeDB aliasdb("r+");
+      vector<pair<vchType, vector<AliasIndex> > > vAliases;
+      aliasdb.lGetAll(vAliases);
+      for (unsigned int i = 0; i < vAliases.size(); i++)
+        aliasdb.EraseName(vAliases[i].first);
+      aliasdb.WriteIndexedHeight(-1);
     }
+    else if (!MigrateAliasCache())
+      return InitError(_("Error moving aliascache.dat into the alias index"));
 
     ln1Db = new LocatorNodeDB("cr+");
     CBlockIndex *pindexRescan = pindexBest;
@@ -910,12 +1327,22 @@ bool AppInit2()
           nStart = GetTimeMillis();
           pwalletMain->ScanForWalletTransactions(pindexRescan, true);
           printf(" rescan      %15"PRId64"ms\n", GetTimeMillis() - nStart);
+          AddInitTime("rescan", GetTimeMillis() - nStart);
         }
+    }
 
-        if(GetBoolArg("-xscan") || GetBoolArg("-upgradewallet"))
-        {
-          xsc(pindexGenesisBlock);
-        }
+    // From the start after -xscan or -upgradewallet, otherwise from where
+    // an interrupted run stopped
+    if (GetBoolArg("-upgradewallet"))
+        LocatorNodeDB("r+").WriteIndexedHeight(-1);
+    if (!UpdateAliasIndex())
+        return InitError(_("Error indexing aliases"));
+
+    for (unsigned int i = 1; i < vWalletFiles.size(); i++)
+    {
+        uiInterface.InitMessage(_("Loading wallet..."));
+        if (!LoadExtraWallet(vWalletFiles[i], strErrors))
+            return InitError(strErrors.str());
     }
 
     // ********************************************************* Step 9: import blocks
@@ -928,37 +1355,42 @@ bool AppInit2()
         {
             FILE *file = fopen(strFile.c_str(), "rb");
             if (file)
-                LoadExternalBlockFile(file);
+                LoadExternalBlockFile(file, strFile);
         }
         exit(0);
     }
 
-    filesystem::path pathBootstrap = GetDataDir() / "bootstrap.dat";
-    if (filesystem::exists(pathBootstrap)) {
-        uiInterface.InitMessage(_("Importing bootstrap blockchain data file."));
+    // -reindex and bootstrap.dat run alongside the node, blocks from peers
+    // are accepted as usual in the meantime
+    if (fReindex || filesystem::exists(GetDataDir() / "bootstrap.dat"))
+        NewThread(ThreadImport, NULL, THREADPOOL_BACKGROUND);
 
-        FILE *file = fopen(pathBootstrap.string().c_str(), "rb");
-        if (file) {
-            filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
-            LoadExternalBlockFile(file);
-            RenameOver(pathBootstrap, pathBootstrapOld);
-        }
-    }
+    // Confirmation history from the last run
+    feeEstimator.Read();
+
+    // Revalidated alongside the node as well
+    if (GetBoolArg("-persistmempool", true))
+        NewThread(ThreadLoadMempool, NULL, THREADPOOL_BACKGROUND);
+
+    // Takes what reorganizations and the wallet hand back to the pool
+    NewThread(ThreadRevalidateMempool, NULL, THREADPOOL_BACKGROUND);
+
+    // Block files are removed away from the block connect path
+    if (nPruneTarget)
+        NewThread(ThreadPruneBlockFiles, NULL, THREADPOOL_BACKGROUND);
 
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
     printf("Loading addresses...\n");
     nStart = GetTimeMillis();
-
-    {
-        CAddrDB adb;
-        if (!adb.Read(addrman))
-            printf("Invalid or missing peers.dat; recreating\n");
-    }
+    threadLoadPeers.join();
+    if (!fPeersOk)
+        printf("Invalid or missing peers.dat; recreating\n");
 
     printf("Loaded %i addresses from peers.dat  %"PRId64"ms\n",
-           addrman.size(), GetTimeMillis() - nStart);
+           addrman.size(), nPeersTime);
+    AddInitTime("peers.dat (alongside)", nPeersTime);
 
 
 
@@ -974,16 +1406,24 @@ bool AppInit2()
     printf("mapWallet.size() = %"PRIszu"\n",       pwalletMain->mapWallet.size());
     printf("mapAddressBook.size() = %"PRIszu"\n",  pwalletMain->mapAddressBook.size());
 
-    if (!NewThread(StartNode, NULL))
+    std::string strNotifyError;
+    if (!StartNotify(strNotifyError))
+        return InitError(strNotifyError);
+
+    if (!NewThread(StartNode, NULL, THREADPOOL_NETWORK))
         InitError(_("Error: could not start node"));
 
     if (fServer)
-        NewThread(ThreadRPCServer, NULL);
+        NewThread(ThreadRPCServer, NULL, THREADPOOL_RPC);
 
     // ********************************************************* Step 12: finished
 
     uiInterface.InitMessage(_("Done loading"));
     printf("Done loading\n");
+    printf("Startup stages:\n");
+    for (unsigned int i = 0; i < vInitTimes.size(); i++)
+        printf(" %-30s %10"PRId64"ms\n", vInitTimes[i].first.c_str(), vInitTimes[i].second);
+    printf(" %-30s %10"PRId64"ms\n", "total", GetTimeMillis() - nInitStart);
 
     if (!strErrors.str().empty())
         return InitError(strErrors.str());
@@ -7,7 +7,34 @@
 
 #include "wallet.h"
 
-extern __wx__* pwalletMain;
+/** The wallet the wallet RPCs and the node act on: the first -wallet file,
+ *  except on an RPC thread serving a request for /wallet/<file>, which sees
+ *  that wallet while a CRPCWalletScope is alive. Behaves as a __wx__*. */
+class CWalletRef
+{
+public:
+    CWalletRef() : pwallet(NULL) {}
+    CWalletRef& operator=(__wx__* pwalletIn) { pwallet = pwalletIn; return *this; }
+    __wx__* get() const;
+    operator __wx__*() const { return get(); }
+    __wx__* operator->() const { return get(); }
+    __wx__& operator*() const { return *get(); }
+
+private:
+    __wx__* pwallet;
+};
+
+class CRPCWalletScope
+{
+public:
+    explicit CRPCWalletScope(__wx__* pwallet);
+    ~CRPCWalletScope();
+};
+
+extern CWalletRef pwalletMain;
+// Every wallet loaded with -wallet, by file name
+extern std::map<std::string, __wx__*> mapWallets;
+__wx__* FindWallet(const std::string& strWalletFile);
 void StartShutdown();
 void Shutdown(void* parg);
 bool AppInit2();
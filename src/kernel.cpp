@@ -6,6 +6,8 @@
 #include <boost/assign/list_of.hpp>
 
 #include "kernel.h"
+#include "checkqueue.h"
+#include "metrics.h"
 #include "txdb.h"
 
 using namespace std;
@@ -208,12 +210,43 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
+struct CKernelStakeModifier
+{
+    uint64_t nStakeModifier;
+    int nStakeModifierHeight;
+    int64_t nStakeModifierTime;
+};
+
+// Results of GetKernelStakeModifier() by hashBlockFrom. An entry only depends
+// on the main chain after its block, so it stays good until a reorganize.
+static std::map<uint256, CKernelStakeModifier> mapKernelStakeModifiers;
+static CCriticalSection cs_mapKernelStakeModifiers;
+
+void ClearKernelStakeModifierCache()
+{
+    LOCK(cs_mapKernelStakeModifiers);
+    mapKernelStakeModifiers.clear();
+}
+
 static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
+    {
+        LOCK(cs_mapKernelStakeModifiers);
+        std::map<uint256, CKernelStakeModifier>::const_iterator it = mapKernelStakeModifiers.find(hashBlockFrom);
+        if (it != mapKernelStakeModifiers.end())
+        {
+            nStakeModifier = it->second.nStakeModifier;
+            nStakeModifierHeight = it->second.nStakeModifierHeight;
+            nStakeModifierTime = it->second.nStakeModifierTime;
+            return true;
+        }
+    }
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end())
         return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexFrom = mi->second;
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -239,6 +272,17 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+
+    // Only a walk off the main chain can come out differently later
+    if (pindexFrom->IsInMainChain())
+    {
+        CKernelStakeModifier entry;
+        entry.nStakeModifier = nStakeModifier;
+        entry.nStakeModifierHeight = nStakeModifierHeight;
+        entry.nStakeModifierTime = nStakeModifierTime;
+        LOCK(cs_mapKernelStakeModifiers);
+        mapKernelStakeModifiers[hashBlockFrom] = entry;
+    }
     return true;
 }
 
@@ -288,7 +332,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
     if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
         return false;
 
-    printf("CheckStakeKernelHashV1 modifier ok\n");
+    LogPrint("stake", "CheckStakeKernelHashV1 modifier ok\n");
 
     ss << nStakeModifier;
 
@@ -404,9 +448,11 @@ static bool CheckStakeKernelHashV2(CBlockIndex* pindexPrev, unsigned int nBits,
     return true;
 }
 
+static CMetric metricKernelChecks("iocoin_stake_kernel_checks_total", "Stake kernel hashes evaluated.", METRIC_COUNTER);
+
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
 {
-   
+    metricKernelChecks.Inc();
     if (V3(nBestHeight) || IsProtocolV2(pindexPrev->nHeight+1))
     {
       return CheckStakeKernelHashV2(pindexPrev, nBits, blockFrom.GetBlockTime(), txPrev, prevout, nTimeTx, hashProofOfStake, targetProofOfStake, fPrintProofOfStake);
@@ -455,6 +501,219 @@ bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, con
     return true;
 }
 
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidateRet)
+{
+    CTransaction txPrev;
+    CTxIndex txindex;
+    if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
+        return false;
+
+    CBlock block;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+    uint256 hashBlock = block.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+        return false;
+
+    candidateRet.prevout = prevout;
+    candidateRet.hashBlockFrom = hashBlock;
+    candidateRet.nHeightFrom = mi->second->nHeight;
+    candidateRet.nTimeBlockFrom = block.GetBlockTime();
+    candidateRet.nTimeTxPrev = txPrev.nTime;
+    candidateRet.nValue = txPrev.vout[prevout.n].nValue;
+    return true;
+}
+
+// Serialized kernel of a candidate with nTimeTx at the end, laid out as
+// CheckStakeKernelHashV2() streams it
+static const unsigned int KERNEL_SIZE = 8 + 4 + 4 + 32 + 4 + 4;
+static const unsigned int KERNEL_TIMETX_OFFSET = KERNEL_SIZE - 4;
+
+struct CKernelSearchEntry
+{
+    unsigned char vchKernel[KERNEL_SIZE];
+    uint256 target;
+    // The weighted target is past 2^256, so every hash meets it
+    bool fAlwaysMeets;
+    unsigned int nTimeTxPrev;
+};
+
+template<typename T>
+static unsigned char* WriteKernelField(unsigned char* p, const T& obj)
+{
+    memcpy(p, BEGIN(obj), sizeof(obj));
+    return p + sizeof(obj);
+}
+
+/** Best kernel the shards of one search have found: the latest timestamp,
+ *  then the lowest candidate index, so the outcome doesn't depend on how
+ *  the candidates were split */
+struct CKernelSearchResult
+{
+    CCriticalSection cs;
+    int nIndex;
+    unsigned int nOffset;
+    uint64_t nEvaluations;
+
+    CKernelSearchResult() : nIndex(-1), nOffset(0), nEvaluations(0) {}
+
+    // Whether a kernel at least as good as one at offset n is known
+    bool Beats(unsigned int n)
+    {
+        LOCK(cs);
+        return nIndex >= 0 && nOffset < n;
+    }
+
+    void AddEvaluations(uint64_t nCount)
+    {
+        LOCK(cs);
+        nEvaluations += nCount;
+    }
+
+    void Found(int i, unsigned int n)
+    {
+        LOCK(cs);
+        if (nIndex < 0 || n < nOffset || (n == nOffset && i < nIndex))
+        {
+            nIndex = i;
+            nOffset = n;
+        }
+    }
+};
+
+/** One shard of the candidates of a FindStakeKernel() search */
+class CKernelSearch
+{
+private:
+    std::vector<CKernelSearchEntry>* pvEntries;
+    const int* pbegin;
+    const int* pend;
+    unsigned int nTimeTx;
+    unsigned int nSearch;
+    CKernelSearchResult* presult;
+
+public:
+    CKernelSearch() : pvEntries(0), pbegin(0), pend(0), nTimeTx(0), nSearch(0), presult(0) {}
+    CKernelSearch(std::vector<CKernelSearchEntry>& vEntries, const int* pbeginIn, const int* pendIn, unsigned int nTimeTxIn, unsigned int nSearchIn, CKernelSearchResult& result) :
+        pvEntries(&vEntries), pbegin(pbeginIn), pend(pendIn), nTimeTx(nTimeTxIn), nSearch(nSearchIn), presult(&result) { }
+
+    bool operator()() const
+    {
+        uint64_t nCount = 0;
+        // Latest timestamp first, as CreateCoinStake() always searched
+        for (unsigned int n = 0; n < nSearch && !fShutdown && !presult->Beats(n); n++)
+        {
+            unsigned int nTime = nTimeTx - n;
+            for (const int* pi = pbegin; pi != pend; pi++)
+            {
+                CKernelSearchEntry& entry = (*pvEntries)[*pi];
+                if (nTime < entry.nTimeTxPrev)
+                    continue;
+                WriteKernelField(entry.vchKernel + KERNEL_TIMETX_OFFSET, nTime);
+                nCount++;
+                if (entry.fAlwaysMeets || Hash(entry.vchKernel, entry.vchKernel + KERNEL_SIZE) <= entry.target)
+                {
+                    presult->AddEvaluations(nCount);
+                    presult->Found(*pi, n);
+                    return true;
+                }
+            }
+        }
+        presult->AddEvaluations(nCount);
+        return true;
+    }
+
+    void swap(CKernelSearch &check) {
+        std::swap(pvEntries, check.pvEntries);
+        std::swap(pbegin, check.pbegin);
+        std::swap(pend, check.pend);
+        std::swap(nTimeTx, check.nTimeTx);
+        std::swap(nSearch, check.nSearch);
+        std::swap(presult, check.presult);
+    }
+};
+
+int nStakeSearchThreads = 0;
+
+static CCheckQueue<CKernelSearch> kernelsearchqueue(1);
+
+// A queue takes one master at a time
+static CCriticalSection cs_kernelsearchqueue;
+
+// Fewer candidates than this per thread aren't worth handing out
+static const unsigned int MIN_KERNEL_SEARCH_SHARD = 64;
+
+void ThreadStakeSearch(void*)
+{
+    RenameThread("iocoin-stakesrch");
+    kernelsearchqueue.Thread();
+}
+
+int FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeCandidate>& vCandidates, unsigned int nTimeTx, unsigned int nSearch, unsigned int& nOffsetRet, uint64_t* pnEvaluations)
+{
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    uint64_t nStakeModifier = pindexPrev->nStakeModifier;
+
+    // Everything but the timestamp is fixed for the whole search
+    std::vector<CKernelSearchEntry> vEntries(vCandidates.size());
+    std::vector<int> vIndexes;
+    vIndexes.reserve(vCandidates.size());
+    for (unsigned int i = 0; i < vCandidates.size(); i++)
+    {
+        const CStakeCandidate& candidate = vCandidates[i];
+
+        // Same depth rule as minBase() in CheckKernel()
+        if (pindexPrev->nHeight - candidate.nHeightFrom < nStakeMinConfirmations - 1)
+            continue;
+
+        CKernelSearchEntry& entry = vEntries[i];
+        unsigned char* p = entry.vchKernel;
+        p = WriteKernelField(p, nStakeModifier);
+        p = WriteKernelField(p, candidate.nTimeBlockFrom);
+        p = WriteKernelField(p, candidate.nTimeTxPrev);
+        p = WriteKernelField(p, candidate.prevout.hash);
+        p = WriteKernelField(p, candidate.prevout.n);
+
+        CBigNum bnTarget = bnTargetPerCoinDay * CBigNum(candidate.nValue);
+        entry.fAlwaysMeets = bnTarget.bitSize() > 256;
+        if (!entry.fAlwaysMeets)
+            entry.target = bnTarget.getuint256();
+        entry.nTimeTxPrev = candidate.nTimeTxPrev;
+        vIndexes.push_back(i);
+    }
+    if (vIndexes.empty())
+        return -1;
+
+    CKernelSearchResult result;
+    const int* pbegin = &vIndexes[0];
+    const int* pend = pbegin + vIndexes.size();
+
+    unsigned int nShards = 1;
+    if (nStakeSearchThreads > 1)
+        nShards = std::max(1U, std::min((unsigned int)nStakeSearchThreads, (unsigned int)vIndexes.size() / MIN_KERNEL_SEARCH_SHARD));
+    TRY_LOCK(cs_kernelsearchqueue, lockQueue);
+    if (nShards > 1 && lockQueue)
+    {
+        CCheckQueueControl<CKernelSearch> control(&kernelsearchqueue);
+        std::vector<CKernelSearch> vSearches;
+        vSearches.reserve(nShards);
+        for (unsigned int i = 0; i < nShards; i++)
+            vSearches.push_back(CKernelSearch(vEntries, pbegin + vIndexes.size() * i / nShards,
+                                              pbegin + vIndexes.size() * (i + 1) / nShards, nTimeTx, nSearch, result));
+        control.Add(vSearches);
+        control.Wait();
+    }
+    else
+        CKernelSearch(vEntries, pbegin, pend, nTimeTx, nSearch, result)();
+
+    nOffsetRet = result.nOffset;
+    if (pnEvaluations)
+        *pnEvaluations += result.nEvaluations;
+    return result.nIndex;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(CBlockIndex* pindexPrev, const CTransaction& tx, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
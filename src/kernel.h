@@ -20,8 +20,41 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Forget the kernel stake modifiers found so far; a reorganize changes the
+// blocks they were found from
+void ClearKernelStakeModifierCache();
+
+static const int MAX_STAKESEARCH_THREADS = 16;
+extern int nStakeSearchThreads;
+void ThreadStakeSearch(void* parg);
+
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+/** What the kernel of the current protocol needs to know about a staking
+ *  output, so that timestamps can be tried without reading the disk */
+struct CStakeCandidate
+{
+    COutPoint prevout;
+    uint256 hashBlockFrom;
+    int nHeightFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTimeTxPrev;
+    int64_t nValue;
+};
+
+// Read the kernel inputs of prevout; the block must be in the main chain
+bool GetStakeCandidate(CTxDB& txdb, const COutPoint& prevout, CStakeCandidate& candidateRet);
+
+// CheckKernel() over cached candidates once V3 is active, trying every
+// candidate at a timestamp before moving nTimeTx back by one, for up to
+// nSearch timestamps. The per-candidate part of the kernel and its target
+// are computed once, so each try is a single double SHA256. Returns the
+// index of the first candidate that meets its target with nOffsetRet set
+// to how far back from nTimeTx, or -1. Large searches are split between
+// nStakeSearchThreads threads (-stakethreads). The number of kernel hashes
+// tried is added to *pnEvaluations.
+int FindStakeKernel(const CBlockIndex* pindexPrev, unsigned int nBits, const std::vector<CStakeCandidate>& vCandidates, unsigned int nTimeTx, unsigned int nSearch, unsigned int& nOffsetRet, uint64_t* pnEvaluations = NULL);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(CBlockIndex* pindexPrev, unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
@@ -7,7 +7,45 @@
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
 
+#include <boost/thread/once.hpp>
+
 #include "key.h"
+#include "sync.h"
+
+// The secp256k1 group every key shares, with the multiples of its
+// generator precomputed once so signing and verifying don't rebuild
+// the curve or its tables per key. Read-only after InitSecp256k1Group.
+static EC_GROUP* pgroupSecp256k1 = NULL;
+static boost::once_flag secp256k1GroupOnce = BOOST_ONCE_INIT;
+
+static void InitSecp256k1Group()
+{
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    if (group == NULL)
+        return;
+    BN_CTX* ctx = BN_CTX_new();
+    if (ctx == NULL || !EC_GROUP_precompute_mult(group, ctx))
+        printf("InitSecp256k1Group() : EC_GROUP_precompute_mult failed\n");
+    if (ctx != NULL)
+        BN_CTX_free(ctx);
+    pgroupSecp256k1 = group;
+}
+
+// A fresh key on the shared group. EC_KEY_set_group takes a copy, which
+// carries the precomputed table along by reference.
+static EC_KEY* NewSecp256k1Key()
+{
+    boost::call_once(InitSecp256k1Group, secp256k1GroupOnce);
+    if (pgroupSecp256k1 == NULL)
+        return EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY* pkey = EC_KEY_new();
+    if (pkey != NULL && !EC_KEY_set_group(pkey, pgroupSecp256k1))
+    {
+        EC_KEY_free(pkey);
+        return NULL;
+    }
+    return pkey;
+}
 
 
 class __fbase__
@@ -214,9 +252,9 @@ void CKey::Reset()
     fCompressedPubKey = false;
     if (pkey != NULL)
         EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (pkey == NULL)
-        throw key_error("CKey::CKey() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CKey::CKey() : NewSecp256k1Key failed");
     fSet = false;
 }
 
@@ -341,9 +379,9 @@ bool CKey::SetPrivKey(const CPrivKey& vchPrivKey)
 bool CKey::SetSecret(const CSecret& vchSecret, bool fCompressed)
 {
     EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
     if (pkey == NULL)
-        throw key_error("CKey::SetSecret() : EC_KEY_new_by_curve_name failed");
+        throw key_error("CKey::SetSecret() : NewSecp256k1Key failed");
     if (vchSecret.size() != 32)
         throw key_error("CKey::SetSecret() : secret must be 32 bytes");
     BIGNUM *bn = BN_bin2bn(&vchSecret[0],32,BN_new());
@@ -508,7 +546,12 @@ bool CKey::SetCompactSignature(uint256 hash, const std::vector<unsigned char>& v
     BN_bin2bn(&vchSig[33],32,sig->s);
 
     EC_KEY_free(pkey);
-    pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    pkey = NewSecp256k1Key();
+    if (pkey == NULL)
+    {
+        ECDSA_SIG_free(sig);
+        return false;
+    }
     if (nV >= 31)
     {
         SetCompressedPubKey();
@@ -549,7 +592,7 @@ bool CKey::IsValid()
 }
 
 bool ECC_InitSanityCheck() {
-    EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+    EC_KEY *pkey = NewSecp256k1Key();
     if(pkey == NULL)
         return false;
     EC_KEY_free(pkey);
@@ -1020,3 +1063,38 @@ int __synth_piv__conv71__outer(__im__& t, __im__& i,
   return 0;
 }
 
+// Keyed by the hash of the signed hash and the signature
+static const unsigned int MAX_RECOVERED_KEYS = 10000;
+static std::map<uint256, CKeyID> mapRecoveredKeys;
+static CCriticalSection cs_recoveredkeys;
+
+bool RecoverCompactKeyID(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet)
+{
+    uint256 hashEntry = Hash(hash.begin(), hash.end(), vchSig.begin(), vchSig.end());
+    {
+        LOCK(cs_recoveredkeys);
+        std::map<uint256, CKeyID>::const_iterator mi = mapRecoveredKeys.find(hashEntry);
+        if (mi != mapRecoveredKeys.end())
+        {
+            keyIDRet = mi->second;
+            return true;
+        }
+    }
+
+    CKey key;
+    if (!key.SetCompactSignature(hash, vchSig))
+        return false;
+    keyIDRet = key.GetPubKey().GetID();
+
+    LOCK(cs_recoveredkeys);
+    if (mapRecoveredKeys.size() >= MAX_RECOVERED_KEYS)
+    {
+        // Evict a random entry
+        std::map<uint256, CKeyID>::iterator it = mapRecoveredKeys.lower_bound(GetRandHash());
+        if (it == mapRecoveredKeys.end())
+            it = mapRecoveredKeys.begin();
+        mapRecoveredKeys.erase(it);
+    }
+    mapRecoveredKeys.insert(std::make_pair(hashEntry, keyIDRet));
+    return true;
+}
@@ -174,4 +174,9 @@ class CKey
 /** Check that required EC support is available at runtime */
 bool ECC_InitSanityCheck(void);
 
+/** The ID of the key that made compact signature vchSig of hash, as
+ *  SetCompactSignature recovers it. Recent answers are remembered, since
+ *  listing signed messages checks the same signatures over and over. */
+bool RecoverCompactKeyID(const uint256& hash, const std::vector<unsigned char>& vchSig, CKeyID& keyIDRet);
+
 #endif
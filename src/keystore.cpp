@@ -23,6 +23,7 @@ bool CBasicKeyStore::ak(const CKey& key)
         LOCK(cs_KeyStore);
         mapKeys[key.GetPubKey().GetID()] = make_pair(secret, fCompressed);
         mapPubKeys[Hash160(key.GetPubKey().Raw())] = key.GetPubKey().Raw();
+        nGeneration++;
     }
     return true;
 }
@@ -35,6 +36,7 @@ bool CBasicKeyStore::AddCScript(const CScript& redeemScript)
     {
         LOCK(cs_KeyStore);
         mapScripts[redeemScript.GetID()] = redeemScript;
+        nGeneration++;
     }
     return true;
 }
@@ -88,6 +90,7 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        mapDecryptedSecrets.clear();
     }
 
     NotifyStatusChanged(this);
@@ -158,6 +161,7 @@ bool CCryptoKeyStore::sync(const CPubKey &vchPubKey, const std::vector<unsigned
             return false;
 
         mapCryptedKeys[vchPubKey.GetID()] = make_pair(vchPubKey, vchCryptedSecret);
+        nGeneration++;
     }
     return true;
 }
@@ -173,14 +177,21 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
         if (mi != mapCryptedKeys.end())
         {
             const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CSecret vchSecret;
-            if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-                return false;
-            if (vchSecret.size() != 32)
+            if (vMasterKey.empty())
                 return false;
+            std::map<CKeyID, CSecret>::const_iterator md = mapDecryptedSecrets.find(address);
+            if (md == mapDecryptedSecrets.end())
+            {
+                const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
+                CSecret vchSecret;
+                if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+                    return false;
+                if (vchSecret.size() != 32)
+                    return false;
+                md = mapDecryptedSecrets.insert(make_pair(address, vchSecret)).first;
+            }
             keyOut.SetPubKey(vchPubKey);
-            keyOut.SetSecret(vchSecret);
+            keyOut.SetSecret((*md).second);
             return true;
         }
     }
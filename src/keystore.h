@@ -18,10 +18,21 @@ class CKeyStore
 protected:
     mutable CCriticalSection cs_KeyStore;
 
+    // Bumped whenever a key or script is added, so that whoever remembers
+    // which scripts are ours knows to look again
+    unsigned int nGeneration;
+
 public:
     std::map<uint160, std::vector<unsigned char> > mapPubKeys;
+    CKeyStore() : nGeneration(0) {}
     virtual ~CKeyStore() {}
 
+    unsigned int GetGeneration() const
+    {
+        LOCK(cs_KeyStore);
+        return nGeneration;
+    }
+
     // Add a key to the store.
     virtual bool ak(const CKey& key) =0;
     mutable CCriticalSection cs_mapKeys;
@@ -112,6 +123,10 @@ private:
 
     CKeyingMaterial vMasterKey;
 
+    // Secrets decrypted since the last unlock, in locked memory like
+    // vMasterKey; filled by GetKey as keys are used and wiped by Lock()
+    mutable std::map<CKeyID, CSecret> mapDecryptedSecrets;
+
     // if fUseCrypto is true, mapKeys must be empty
     // if fUseCrypto is false, vMasterKey must be empty
     bool fUseCrypto;
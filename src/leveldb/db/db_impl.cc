@@ -97,6 +97,11 @@ Options SanitizeOptions(const std::string& dbname,
   ClipToRange(&result.max_open_files,    64 + kNumNonTableCacheFiles, 50000);
   ClipToRange(&result.write_buffer_size, 64<<10,                      1<<30);
   ClipToRange(&result.block_size,        1<<10,                       4<<20);
+  ClipToRange(&result.l0_compaction_trigger, 1, 1000);
+  ClipToRange(&result.l0_slowdown_writes_trigger,
+              result.l0_compaction_trigger, 1000);
+  ClipToRange(&result.l0_stop_writes_trigger,
+              result.l0_slowdown_writes_trigger, 1000);
   if (result.info_log == NULL) {
     // Open a log file in the same directory as the db
     src.env->CreateDir(dbname);  // In case it does not exist
@@ -133,7 +138,10 @@ DBImpl::DBImpl(const Options& raw_options, const std::string& dbname)
       seed_(0),
       tmp_batch_(new WriteBatch),
       bg_compaction_scheduled_(false),
-      manual_compaction_(NULL) {
+      manual_compaction_(NULL),
+      stall_slowdowns_(0),
+      stall_waits_(0),
+      stall_micros_(0) {
   mem_->Ref();
   has_imm_.Release_Store(NULL);
 
@@ -1295,7 +1303,7 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       break;
     } else if (
         allow_delay &&
-        versions_->NumLevelFiles(0) >= config::kL0_SlowdownWritesTrigger) {
+        versions_->NumLevelFiles(0) >= options_.l0_slowdown_writes_trigger) {
       // We are getting close to hitting a hard limit on the number of
       // L0 files.  Rather than delaying a single write by several
       // seconds when we hit the hard limit, start delaying each
@@ -1306,6 +1314,8 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       env_->SleepForMicroseconds(1000);
       allow_delay = false;  // Do not delay a single write more than once
       mutex_.Lock();
+      stall_slowdowns_++;
+      stall_micros_ += 1000;
     } else if (!force &&
                (mem_->ApproximateMemoryUsage() <= options_.write_buffer_size)) {
       // There is room in current memtable
@@ -1314,11 +1324,11 @@ Status DBImpl::MakeRoomForWrite(bool force) {
       // We have filled up the current memtable, but the previous
       // one is still being compacted, so we wait.
       Log(options_.info_log, "Current memtable full; waiting...\n");
-      bg_cv_.Wait();
-    } else if (versions_->NumLevelFiles(0) >= config::kL0_StopWritesTrigger) {
+      WaitForBackgroundWork();
+    } else if (versions_->NumLevelFiles(0) >= options_.l0_stop_writes_trigger) {
       // There are too many level-0 files.
       Log(options_.info_log, "Too many L0 files; waiting...\n");
-      bg_cv_.Wait();
+      WaitForBackgroundWork();
     } else {
       // Attempt to switch to a new memtable and trigger compaction of old
       assert(versions_->PrevLogNumber() == 0);
@@ -1346,6 +1356,14 @@ Status DBImpl::MakeRoomForWrite(bool force) {
   return s;
 }
 
+void DBImpl::WaitForBackgroundWork() {
+  mutex_.AssertHeld();
+  const uint64_t start_micros = env_->NowMicros();
+  bg_cv_.Wait();
+  stall_waits_++;
+  stall_micros_ += env_->NowMicros() - start_micros;
+}
+
 bool DBImpl::GetProperty(const Slice& property, std::string* value) {
   value->clear();
 
@@ -1392,6 +1410,16 @@ bool DBImpl::GetProperty(const Slice& property, std::string* value) {
       }
     }
     return true;
+  } else if (in == "write-stalls") {
+    // Delayed writes, writes that waited for a compaction, and the
+    // microseconds writers spent on both
+    char buf[100];
+    snprintf(buf, sizeof(buf), "%llu %llu %llu",
+             static_cast<unsigned long long>(stall_slowdowns_),
+             static_cast<unsigned long long>(stall_waits_),
+             static_cast<unsigned long long>(stall_micros_));
+    *value = buf;
+    return true;
   } else if (in == "sstables") {
     *value = versions_->current()->DebugString();
     return true;
@@ -190,6 +190,13 @@ class DBImpl : public DB {
   };
   CompactionStats stats_[config::kNumLevels];
 
+  // Writes delayed at the slowdown trigger, writes that waited for a
+  // compaction to finish, and the time writers spent on both
+  uint64_t stall_slowdowns_;
+  uint64_t stall_waits_;
+  uint64_t stall_micros_;
+  void WaitForBackgroundWork() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   // No copying allowed
   DBImpl(const DBImpl&);
   void operator=(const DBImpl&);
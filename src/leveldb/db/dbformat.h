@@ -21,6 +21,7 @@ namespace leveldb {
 namespace config {
 static const int kNumLevels = 7;
 
+// Defaults for Options::l0_compaction_trigger and the two below.
 // Level-0 compaction is started when we hit this many files.
 static const int kL0_CompactionTrigger = 4;
 
@@ -115,6 +115,9 @@ class DB {
   //     about the internal operation of the DB.
   //  "leveldb.sstables" - returns a multi-line string that describes all
   //     of the sstables that make up the db contents.
+  //  "leveldb.write-stalls" - returns "<slowdowns> <waits> <micros>": the
+  //     writes delayed at the level-0 slowdown trigger, the writes that
+  //     waited for a compaction, and the microseconds spent on both.
   virtual bool GetProperty(const Slice& property, std::string* value) = 0;
 
   // For each i in [0,n-1], store in "sizes[i]", the approximate
@@ -135,6 +135,17 @@ struct Options {
   // Default: NULL
   const FilterPolicy* filter_policy;
 
+  // Level-0 compaction is started when we hit this many files.  Writes
+  // are delayed by 1ms each once level-0 reaches the slowdown trigger,
+  // and stop until a compaction finishes at the stop trigger.  Lower
+  // values keep reads fast at the cost of more compaction work; higher
+  // ones absorb write bursts before writers have to wait.
+  //
+  // Default: 4, 8 and 12
+  int l0_compaction_trigger;
+  int l0_slowdown_writes_trigger;
+  int l0_stop_writes_trigger;
+
   // Create an Options object with default values for all fields.
   Options();
 };
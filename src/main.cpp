@@ -11,11 +11,22 @@
 #include "init.h"
 #include "ui_interface.h"
 #include "kernel.h"
+#include "checkqueue.h"
+#include "blockimport.h"
+#include "blockencodings.h"
+#include "merkleblock.h"
+#include "blocksync.h"
 #include "bitcoinrpc.h"
+#include "chainsnapshot.h"
+#include "fees.h"
+#include "memusage.h"
+#include "metrics.h"
+#include "notify.h"
 #include "zerocoin/Zerocoin.h"
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/make_shared.hpp>
 
 using namespace json_spirit;
 using namespace std;
@@ -33,18 +44,26 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
+boost::mutex csBestBlock;
+boost::condition_variable cvBlockChange;
 
 int nStakeMinConfirmations = 500;
 bool fReindex = false;
+bool fAddrIndex = false;
+bool fSpentIndex = false;
+bool fBlockStatsIndex = false;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
-libzerocoin::Params* ZCParams;
+// Built from bnTrustedModulus by GetZCParams() the first time it is asked for
+static libzerocoin::Params* pZCParams = NULL;
+static CBigNum bnTrustedModulus;
+static CCriticalSection cs_zcparams;
 
-CBigNum bnProofOfWorkLimit(~uint256(0) >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
-CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
-CBigNum bnProofOfStakeLimitV2(~uint256(0) >> 48);
-CBigNum bnProofOfWorkLimitTestNet(~uint256(0) >> 1);
+uint256 bnProofOfWorkLimit(~uint256(0) >> 20); // "standard" scrypt target limit for proof of work, results with 0,000244140625 proof-of-work difficulty
+uint256 bnProofOfStakeLimit(~uint256(0) >> 20);
+uint256 bnProofOfStakeLimitV2(~uint256(0) >> 48);
+uint256 bnProofOfWorkLimitTestNet(~uint256(0) >> 1);
 
 unsigned int nStakeMinAge = 8 * 60 * 60; // 8 hours
 unsigned int nStakeMaxAge = -1; // unlimited
@@ -56,6 +75,8 @@ bool FEATURE_SET_SHADE_ACTIVE = false;
 
 unsigned int CONSISTENCY_MARGIN = 100;
 int nCoinbaseMaturity = 100;
+int nScriptCheckThreads = 0;
+uint64_t nPruneTarget = 0;
 CBlockIndex* pindexGenesisBlock = NULL;
 CBlockIndex* p__ = NULL;
 int nBestHeight = -1;
@@ -125,16 +146,51 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CSharedCriticalSection cs_chainstate;
 int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
-map<uint256, CBlock*> mapOrphanBlocks;
+map<uint256, COrphanBlock> mapOrphanBlocks;
 multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+set<pair<int64_t, uint256> > setOrphanBlocksByTime;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+uint64_t nOrphanBlocksSize = 0;
+uint64_t nMaxOrphanBlocksSize = DEFAULT_MAX_ORPHAN_BLOCKS_MB * 1000000;
+uint64_t nMaxMempoolSize = DEFAULT_MAX_MEMPOOL_MB * 1000000;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// Most "tx" messages from one peer accepted together by ProcessMessages()
+static const unsigned int MAX_TX_BATCH_SIZE = 100;
+
+struct COrphanTx
+{
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nSize;
+    // Index into vOrphanList
+    size_t nListPos;
+};
+boost::unordered_map<uint256, COrphanTx, SaltedTxidHasher> mapOrphanTransactions;
+boost::unordered_map<uint256, set<uint256>, SaltedTxidHasher> mapOrphanTransactionsByPrev;
+// Every orphan once, for picking one at random
+static vector<uint256> vOrphanList;
+static set<pair<int64_t, uint256> > setOrphansByExpiry;
+// Orphans and their bytes by the peer that sent them
+static map<NodeId, pair<unsigned int, unsigned int> > mapOrphanPeerUsage;
+static unsigned int nOrphanTxBytes = 0;
+
+static CMetric metricBlocksConnected("iocoin_blocks_connected_total", "Blocks connected to the best chain.", METRIC_COUNTER);
+static CMetric metricBlockConnectTime("iocoin_block_connect_seconds_total", "Time spent in ConnectBlock.", METRIC_COUNTER, 1e-6);
+static CMetric metricBlockConnectLast("iocoin_block_connect_last_seconds", "ConnectBlock time of the last block connected.", METRIC_GAUGE, 1e-6);
+static CMetric metricBestHeight("iocoin_best_height", "Height of the best chain.", METRIC_GAUGE);
+static CMetric metricMempoolTxs("iocoin_mempool_transactions", "Transactions in the memory pool.", METRIC_GAUGE);
+static CMetric metricMempoolBytes("iocoin_mempool_bytes", "Serialized size of the memory pool transactions.", METRIC_GAUGE);
+static CMetric metricMempoolUsage("iocoin_mempool_usage_bytes", "Heap memory used by the memory pool.", METRIC_GAUGE);
+static CMetric metricOrphanTxs("iocoin_orphan_transactions", "Transactions waiting for their inputs.", METRIC_GAUGE);
+static CMetric metricOrphanTxBytes("iocoin_orphan_transaction_bytes", "Serialized size of the orphan transactions.", METRIC_GAUGE);
+static CMetric metricOrphanBlocks("iocoin_orphan_blocks", "Blocks waiting for their parent.", METRIC_GAUGE);
+static CMetric metricOrphanBlockBytes("iocoin_orphan_block_bytes", "Serialized size of the orphan blocks.", METRIC_GAUGE);
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -283,12 +339,196 @@ void ResendWalletTransactions(bool fForce)
 
 
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// mempool.dat
+//
+
+static const int MEMPOOL_DUMP_VERSION = 1;
+// Transactions accepted under one cs_main lock while loading
+static const unsigned int MEMPOOL_LOAD_BATCH_SIZE = 100;
+
+// Set once mempool.dat has been read back; an interrupted load leaves the
+// file alone rather than overwrite it with the part that made it in
+static bool fMempoolLoaded = false;
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    vector<CTransaction> vtx;
+    {
+        // Ancestors always have fewer ancestors of their own
+        LOCK(mempool.cs);
+        vector<pair<unsigned int, uint256> > vSorted;
+        vSorted.reserve(mempool.mapInfo.size());
+        for (CTxMemPool::InfoMap::const_iterator mi = mempool.mapInfo.begin(); mi != mempool.mapInfo.end(); ++mi)
+            vSorted.push_back(make_pair(mi->second.nCountWithAncestors, mi->first));
+        sort(vSorted.begin(), vSorted.end());
+        vtx.reserve(vSorted.size());
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            vtx.push_back(*mempool.mapTx[vSorted[i].second]);
+    }
+
+    CDataStream ssPool(SER_DISK, CLIENT_VERSION);
+    ssPool << FLATDATA(pchMessageStart) << MEMPOOL_DUMP_VERSION << vtx;
+    uint256 hash = Hash(ssPool.begin(), ssPool.end());
+    ssPool << hash;
+
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : open failed");
+    try {
+        fileout << ssPool;
+    }
+    catch (std::exception &e) {
+        return error("DumpMempool() : I/O error");
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+    if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+        return error("DumpMempool() : rename-into-place failed");
+
+    printf("Dumped %"PRIszu" mempool transactions in %"PRId64"ms\n", vtx.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+static bool ReadMempool(vector<CTransaction>& vtx)
+{
+    boost::filesystem::path pathPool = GetDataDir() / "mempool.dat";
+    FILE *file = fopen(pathPool.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+
+    int nDataSize = boost::filesystem::file_size(pathPool) - sizeof(uint256);
+    if (nDataSize < 0)
+        return error("ReadMempool() : file too short");
+    vector<unsigned char> vchData(nDataSize);
+    uint256 hashIn;
+    try {
+        if (nDataSize)
+            filein.read((char *)&vchData[0], nDataSize);
+        filein >> hashIn;
+    }
+    catch (std::exception &e) {
+        return error("ReadMempool() : I/O error or stream data corrupted");
+    }
+    filein.fclose();
+
+    CDataStream ssPool(vchData, SER_DISK, CLIENT_VERSION);
+    if (hashIn != Hash(ssPool.begin(), ssPool.end()))
+        return error("ReadMempool() : checksum mismatch; data corrupted");
+
+    unsigned char pchMsgTmp[4];
+    int nVersion;
+    try {
+        ssPool >> FLATDATA(pchMsgTmp) >> nVersion;
+        if (memcmp(pchMsgTmp, pchMessageStart, sizeof(pchMsgTmp)))
+            return error("ReadMempool() : invalid network magic number");
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+            return error("ReadMempool() : unknown version %d", nVersion);
+        ssPool >> vtx;
+    }
+    catch (std::exception &e) {
+        return error("ReadMempool() : I/O error or stream data corrupted");
+    }
+    return true;
+}
+
+void ThreadLoadMempool(void* parg)
+{
+    RenameThread("iocoin-loadpool");
+    vnThreadsRunning[THREAD_MEMPOOLLOAD]++;
+
+    int64_t nStart = GetTimeMillis();
+    vector<CTransaction> vtx;
+    ReadMempool(vtx);
+
+    unsigned int nAccepted = 0;
+    unsigned int i = 0;
+    while (i < vtx.size() && !fShutdown)
+    {
+        vector<CTransaction> vBatch(vtx.begin() + i, vtx.begin() + min(i + MEMPOOL_LOAD_BATCH_SIZE, (unsigned int)vtx.size()));
+        i += vBatch.size();
+
+        vector<bool> vAccepted;
+        vector<bool> vMissingInputs;
+        {
+            LOCK(cs_main);
+            AcceptToMemoryPoolBatch(mempool, vBatch, vAccepted, vMissingInputs);
+        }
+        for (unsigned int j = 0; j < vAccepted.size(); j++)
+            if (vAccepted[j])
+                nAccepted++;
+    }
+
+    if (!fShutdown)
+    {
+        fMempoolLoaded = true;
+        printf("Loaded %u of %"PRIszu" mempool transactions in %"PRId64"ms\n", nAccepted, vtx.size(), GetTimeMillis() - nStart);
+    }
+    vnThreadsRunning[THREAD_MEMPOOLLOAD]--;
+}
+
+// Transactions waiting for ThreadRevalidateMempool, parents first
+static CCriticalSection cs_revalidate;
+static deque<CTransaction> dequeRevalidate;
+
+void QueueMempoolRevalidation(const vector<CTransaction>& vtx)
+{
+    LOCK(cs_revalidate);
+    dequeRevalidate.insert(dequeRevalidate.end(), vtx.begin(), vtx.end());
+}
+
+void ThreadRevalidateMempool(void* parg)
+{
+    RenameThread("iocoin-revalid");
+    vnThreadsRunning[THREAD_REVALIDATE]++;
+
+    while (!fShutdown)
+    {
+        vector<CTransaction> vBatch;
+        {
+            LOCK(cs_revalidate);
+            unsigned int nBatch = min((size_t)MEMPOOL_LOAD_BATCH_SIZE, dequeRevalidate.size());
+            vBatch.assign(dequeRevalidate.begin(), dequeRevalidate.begin() + nBatch);
+            dequeRevalidate.erase(dequeRevalidate.begin(), dequeRevalidate.begin() + nBatch);
+        }
+        if (vBatch.empty())
+        {
+            MilliSleep(100);
+            continue;
+        }
+
+        // cs_main is held for one batch at a time, its scripts are checked
+        // on the script check threads
+        vector<bool> vAccepted;
+        vector<bool> vMissingInputs;
+        {
+            LOCK(cs_main);
+            AcceptToMemoryPoolBatch(mempool, vBatch, vAccepted, vMissingInputs);
+        }
+        if (fDebug)
+            printf("ThreadRevalidateMempool : accepted %"PRIszu" of %"PRIszu"\n",
+                   (size_t)count(vAccepted.begin(), vAccepted.end(), true), vBatch.size());
+    }
+
+    vnThreadsRunning[THREAD_REVALIDATE]--;
+}
+
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx)
+bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
     if (mapOrphanTransactions.count(hash))
@@ -299,20 +539,39 @@ bool AddOrphanTx(const CTransaction& tx)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // MAX_ORPHAN_TX_BYTES bounds them all, MAX_ORPHAN_BYTES_PER_PEER
+    // those of one peer, so no single peer can push everyone else out.
+
+    unsigned int nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
 
-    size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (nSize > MAX_ORPHAN_TX_SIZE)
+    {
+        printf("ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        return false;
+    }
 
-    if (nSize > 5000)
+    pair<unsigned int, unsigned int>& usage = mapOrphanPeerUsage[peer];
+    if (usage.first >= MAX_ORPHANS_PER_PEER || usage.second + nSize > MAX_ORPHAN_BYTES_PER_PEER)
     {
-        printf("ignoring large orphan tx (size: %"PRIszu", hash: %s)\n", nSize, hash.ToString().substr(0,10).c_str());
+        printf("ignoring orphan tx %s, peer %d is over its quota\n", hash.ToString().substr(0,10).c_str(), peer);
         return false;
     }
 
-    mapOrphanTransactions[hash] = tx;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nSize = nSize;
+    orphan.nListPos = vOrphanList.size();
+    vOrphanList.push_back(hash);
+    setOrphansByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    usage.first++;
+    usage.second += nSize;
+    nOrphanTxBytes += nSize;
+    metricOrphanTxs.Set(mapOrphanTransactions.size());
+    metricOrphanTxBytes.Set(nOrphanTxBytes);
 
     printf("stored orphan tx %s (mapsz %"PRIszu")\n", hash.ToString().substr(0,10).c_str(),
         mapOrphanTransactions.size());
@@ -321,29 +580,54 @@ bool AddOrphanTx(const CTransaction& tx)
 
 void static EraseOrphanTx(uint256 hash)
 {
-    if (!mapOrphanTransactions.count(hash))
+    boost::unordered_map<uint256, COrphanTx, SaltedTxidHasher>::iterator mi = mapOrphanTransactions.find(hash);
+    if (mi == mapOrphanTransactions.end())
         return;
-    const CTransaction& tx = mapOrphanTransactions[hash];
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    const COrphanTx& orphan = mi->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
     {
         mapOrphanTransactionsByPrev[txin.prevout.hash].erase(hash);
         if (mapOrphanTransactionsByPrev[txin.prevout.hash].empty())
             mapOrphanTransactionsByPrev.erase(txin.prevout.hash);
     }
-    mapOrphanTransactions.erase(hash);
+
+    // The last in the list takes its place
+    uint256 hashLast = vOrphanList.back();
+    vOrphanList[orphan.nListPos] = hashLast;
+    mapOrphanTransactions[hashLast].nListPos = orphan.nListPos;
+    vOrphanList.pop_back();
+
+    setOrphansByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+    map<NodeId, pair<unsigned int, unsigned int> >::iterator it = mapOrphanPeerUsage.find(orphan.fromPeer);
+    if (it != mapOrphanPeerUsage.end())
+    {
+        it->second.first--;
+        it->second.second -= orphan.nSize;
+        if (it->second.first == 0)
+            mapOrphanPeerUsage.erase(it);
+    }
+    nOrphanTxBytes -= orphan.nSize;
+    mapOrphanTransactions.erase(mi);
+    metricOrphanTxs.Set(mapOrphanTransactions.size());
+    metricOrphanTxBytes.Set(nOrphanTxBytes);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+
+    // Those whose parents didn't show up in time go first
+    int64_t nNow = GetTime();
+    while (!setOrphansByExpiry.empty() && setOrphansByExpiry.begin()->first <= nNow)
+    {
+        EraseOrphanTx(setOrphansByExpiry.begin()->second);
+        ++nEvicted;
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxBytes > nMaxBytes)
+    {
+        // Evict a random orphan
+        EraseOrphanTx(vOrphanList[GetRand(vOrphanList.size())]);
         ++nEvicted;
     }
     return nEvicted;
@@ -484,6 +768,14 @@ bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
     return true;
 }
 
+bool SignalsOptInRBF(const CTransaction &tx)
+{
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (txin.nSequence <= MAX_RBF_SEQUENCE)
+            return true;
+    return false;
+}
+
 //
 // Check transaction inputs, and make sure any
 // pay-to-script-hash transactions are evaluating IsStandard scripts
@@ -610,7 +902,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -708,7 +1000,7 @@ int64_t CTransaction::GetMinFee(unsigned int nBlockSize, enum GetMinFee_mode mod
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
-                        bool* pfMissingInputs)
+                        bool* pfMissingInputs, std::vector<CScriptCheck>* pvChecks)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -737,37 +1029,26 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
     if (pool.exists(hash))
         return false;
 
-    // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    // Check for conflicts with in-memory transactions. They can be replaced
+    // if they all opted in and the newcomer pays for all it evicts.
+    set<uint256> setConflicts;
     {
       LOCK(pool.cs); // protect pool.mapNextTx
-      for (unsigned int i = 0; i < tx.vin.size(); i++)
+      BOOST_FOREACH(const CTxIn& txin, tx.vin)
       {
-        COutPoint outpoint = tx.vin[i].prevout;
-        if (pool.mapNextTx.count(outpoint))
-        {
-            // Disable replacement feature for now
+        CTxMemPool::NextTxMap::const_iterator it = pool.mapNextTx.find(txin.prevout);
+        if (it == pool.mapNextTx.end())
+            continue;
+        const CTransaction* ptxConflict = it->second.ptx;
+        if (!SignalsOptInRBF(*ptxConflict))
             return false;
-
-            // Allow replacing with a newer version of the same transaction
-            if (i != 0)
-                return false;
-            ptxOld = pool.mapNextTx[outpoint].ptx;
-            if (IsFinalTx(*ptxOld))
-                return false;
-            if (!tx.IsNewerThan(*ptxOld))
-                return false;
-            for (unsigned int i = 0; i < tx.vin.size(); i++)
-            {
-                COutPoint outpoint = tx.vin[i].prevout;
-                if (!pool.mapNextTx.count(outpoint) || pool.mapNextTx[outpoint].ptx != ptxOld)
-                    return false;
-            }
-            break;
-        }
+        if (tx.nVersion == CTransaction::DION_TX_VERSION || ptxConflict->nVersion == CTransaction::DION_TX_VERSION)
+            return false;
+        setConflicts.insert(ptxConflict->GetHash());
       }
     }
 
+    CTxMemPoolEntry entry;
     {
         CTxDB txdb("r");
 
@@ -799,6 +1080,45 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
             hash.ToString().c_str(),
             nFees, txMinFee);
 
+        // A full pool prices out whatever it evicted last
+        int64_t nPoolMinFee = (int64_t)(pool.GetMinFeePerKb(nMaxMempoolSize) * nSize / 1000);
+        if (nFees < nPoolMinFee)
+          return error("AcceptToMemoryPool : mempool min fee not met %s, %"PRId64" < %"PRId64,
+            hash.ToString().c_str(),
+            nFees, nPoolMinFee);
+
+        if (!setConflicts.empty())
+        {
+            LOCK(pool.cs);
+            set<uint256> setEvicted;
+            int64_t nEvictedFees = 0;
+            BOOST_FOREACH(const uint256& hashConflict, setConflicts)
+            {
+                const CTxMemPoolEntry& conflict = pool.mapInfo[hashConflict];
+                // A lower fee rate would take the place of a better one
+                if ((double)nFees * 1000 / nSize <= conflict.GetFeePerKb())
+                    return error("AcceptToMemoryPool : replacement %s does not raise the fee rate of %s",
+                        hash.ToString().substr(0,10).c_str(), hashConflict.ToString().substr(0,10).c_str());
+                setEvicted.insert(hashConflict);
+                pool.GetDescendants(hashConflict, setEvicted);
+                if (setEvicted.size() > MAX_REPLACEMENT_CANDIDATES)
+                    return error("AcceptToMemoryPool : replacement %s would evict more than %u transactions",
+                        hash.ToString().substr(0,10).c_str(), MAX_REPLACEMENT_CANDIDATES);
+            }
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                if (setEvicted.count(txin.prevout.hash))
+                    return tx.DoS(10, error("AcceptToMemoryPool : replacement %s spends a transaction it replaces",
+                        hash.ToString().substr(0,10).c_str()));
+            BOOST_FOREACH(const uint256& hashEvicted, setEvicted)
+                nEvictedFees += pool.mapInfo[hashEvicted].nFee;
+
+            // What is evicted was relayed already, the newcomer pays for
+            // its own relay on top
+            if (nFees < nEvictedFees + txMinFee)
+                return error("AcceptToMemoryPool : replacement %s pays %"PRId64", less than %"PRId64" evicted plus %"PRId64" relay fee",
+                    hash.ToString().substr(0,10).c_str(), nFees, nEvictedFees, txMinFee);
+        }
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -818,17 +1138,32 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
             // At default rate it would take over a month to fill 1GB
             if (dFreeCount > GetArg("-limitfreerelay", 15)*10*1000 && !IsFromMe(tx))
               return error("AcceptToMemoryPool : free transaction rejected by rate limiter");
-            if (fDebug)
-              printf("Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
+            LogPrint("mempool", "Rate limit dFreeCount: %g => %g\n", dFreeCount, dFreeCount+nSize);
             dFreeCount += nSize;
           }
         }
 
         CDiskTxPos cDiskTxPos = CDiskTxPos(1,1,1);
-        if(!tx.ConnectInputs(txdb, mapInputs, mapUnused, cDiskTxPos, pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
+        // A replacement evicts for good, so its scripts are checked before
+        // rather than with the rest of a batch
+        if(!tx.ConnectInputs(txdb, mapInputs, mapUnused, cDiskTxPos, pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS, setConflicts.empty() ? pvChecks : NULL))
         {
           return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString().substr(0,10).c_str());
         }
+
+        // Inputs from other pool transactions don't count for priority
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            if (txindex.pos == CDiskTxPos(1,1,1))
+                continue;
+            int64_t nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            dPriority += (double)nValueIn * txindex.GetDepthInMainChain();
+            nValueInChain += nValueIn;
+        }
+        entry = CTxMemPoolEntry(nFees, nSize, dPriority, nValueInChain, nBestHeight);
     }
 
     AcceptToMemoryPoolPost(tx);
@@ -836,38 +1171,132 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
     // Store transaction in memory
     {
         LOCK(pool.cs);
-        if (ptxOld)
+        BOOST_FOREACH(const uint256& hashConflict, setConflicts)
         {
-            printf("AcceptToMemoryPool : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
-            pool.remove(*ptxOld);
+            CTxMemPool::TxMap::iterator mi = pool.mapTx.find(hashConflict);
+            if (mi == pool.mapTx.end())
+                continue;
+            LogPrint("mempool", "AcceptToMemoryPool : replacing tx %s with %s\n", hashConflict.ToString().substr(0,10).c_str(), hash.ToString().substr(0,10).c_str());
+            CTransactionRef ptxConflict = mi->second;
+            pool.remove(*ptxConflict, true);
         }
-        pool.addUnchecked(hash, tx);
-    }
+        pool.addUnchecked(hash, tx, entry);
+        pool.TrimToSize(nMaxMempoolSize);
+        if (!pool.mapTx.count(hash))
+            return error("AcceptToMemoryPool : mempool full, %s evicted", hash.ToString().substr(0,10).c_str());
 
-    ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
-    if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+        // Only transactions whose own fee decides when they confirm tell
+        // the estimator anything
+        if (&pool == &mempool && pool.mapInfo[hash].nCountWithAncestors == 1 && !IsInitialBlockDownload())
+            feeEstimator.AddTx(hash, (double)entry.nFee * 1000 / max(entry.nSize, 1U), nBestHeight);
+    }
 
-    printf("AcceptToMemoryPool : accepted %s (poolsz %"PRIszu")\n",
+    LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %"PRIszu")\n",
            hash.ToString().substr(0,10).c_str(),
            pool.mapTx.size());
     return true;
 }
 
+size_t TransactionUsage(const CTransaction& tx)
+{
+    size_t nUsage = VectorUsage(tx.vin) + VectorUsage(tx.vout) + MallocUsage(tx.strTxInfo.capacity());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += MallocUsage(txin.scriptSig.capacity());
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += MallocUsage(txout.scriptPubKey.capacity());
+    return nUsage;
+}
+
+/** Heap memory for a pool transaction: its vectors and scripts plus the
+ *  nodes indexing it in mapTx, mapInfo, mapNextTx and both fee rate sets */
+static size_t MemPoolUsage(const CTransaction& tx)
+{
+    return UnorderedNodeUsage<std::pair<const uint256, CTransactionRef> >() +
+           MallocUsage(sizeof(CTransaction) + 2 * sizeof(int) + 2 * sizeof(void*)) +
+           UnorderedNodeUsage<std::pair<const uint256, CTxMemPoolEntry> >() +
+           2 * MapNodeUsage<std::pair<double, uint256> >() +
+           tx.vin.size() * UnorderedNodeUsage<std::pair<const COutPoint, CInPoint> >() +
+           TransactionUsage(tx);
+}
+
+void GetMainMemoryUsage(CMainMemoryUsage& usage)
+{
+    LOCK(cs_main);
+    {
+        READ_LOCK(cs_chainstate);
+        usage.nBlockIndexEntries = mapBlockIndex.size();
+        usage.nBlockIndex = mapBlockIndex.size() * (UnorderedNodeUsage<BlockMap::value_type>() + MallocUsage(sizeof(CBlockIndex))) +
+                            mapBlockIndex.bucket_count() * sizeof(void*);
+    }
+
+    usage.nOrphanBlockEntries = mapOrphanBlocks.size();
+    usage.nOrphanBlocks = MapUsage(mapOrphanBlocks) + SetUsage(setOrphanBlocksByTime) +
+                          mapOrphanBlocksByPrev.size() * MapNodeUsage<pair<const uint256, CBlock*> >();
+    for (map<uint256, COrphanBlock>::const_iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+    {
+        const CBlock& block = *mi->second.pblock;
+        usage.nOrphanBlocks += MallocUsage(sizeof(CBlock)) + VectorUsage(block.vtx) + VectorUsage(block.vchBlockSig);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            usage.nOrphanBlocks += TransactionUsage(tx);
+    }
+
+    usage.nOrphanTxEntries = mapOrphanTransactions.size();
+    usage.nOrphanTxs = mapOrphanTransactions.size() * UnorderedNodeUsage<pair<const uint256, COrphanTx> >() +
+                       mapOrphanTransactions.bucket_count() * sizeof(void*) +
+                       VectorUsage(vOrphanList) + SetUsage(setOrphansByExpiry) + MapUsage(mapOrphanPeerUsage);
+    for (boost::unordered_map<uint256, COrphanTx, SaltedTxidHasher>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+        usage.nOrphanTxs += TransactionUsage(mi->second.tx);
+    for (boost::unordered_map<uint256, set<uint256>, SaltedTxidHasher>::const_iterator mi = mapOrphanTransactionsByPrev.begin(); mi != mapOrphanTransactionsByPrev.end(); ++mi)
+        usage.nOrphanTxs += UnorderedNodeUsage<pair<const uint256, set<uint256> > >() + SetUsage(mi->second);
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+{
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    return addUnchecked(hash, tx, CTxMemPoolEntry(0, nSize, 0, 0, nBestHeight));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call AcceptToMemoryPool to properly check the transaction first.
     {
-        mapTx[hash] = tx;
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+        CTransactionRef ptx = boost::make_shared<CTransaction>(tx);
+        mapTx[hash] = ptx;
+        for (unsigned int i = 0; i < ptx->vin.size(); i++)
+            mapNextTx[ptx->vin[i].prevout] = CInPoint(ptx.get(), i);
+        CTxMemPoolEntry& entryNew = mapInfo[hash];
+        entryNew = entry;
+        entryNew.nUsage = MemPoolUsage(*ptx);
+        nTotalTxSize += entryNew.nSize;
+        nDynamicUsage += entryNew.nUsage;
+
+        // Children already here (after a reorg) gain an ancestor, and
+        // ancestors gain a descendant
+        set<uint256> setDescendants;
+        GetDescendants(hash, setDescendants);
+        UpdateAncestorState(hash);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+            UpdateAncestorState(hashDescendant);
+        vector<uint256> vAncestors;
+        GetAncestors(hash, vAncestors);
+        UpdateDescendantState(hash);
+        BOOST_FOREACH(const uint256& hashAncestor, vAncestors)
+            UpdateDescendantState(hashAncestor);
+        PublishTransaction(tx);
         nTransactionsUpdated++;
+        UpdateMetrics();
     }
     return true;
 }
 
+void CTxMemPool::UpdateMetrics()
+{
+    metricMempoolTxs.Set(mapTx.size());
+    metricMempoolBytes.Set(nTotalTxSize);
+    metricMempoolUsage.Set(nDynamicUsage);
+}
+
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
@@ -879,17 +1308,41 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
+            feeEstimator.RemoveTx(hash);
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    NextTxMap::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it != mapNextTx.end())
                         remove(*it->second.ptx, true);
                 }
             }
+
+            // Whatever still spends it loses an ancestor, what it spends
+            // loses a descendant
+            set<uint256> setDescendants;
+            GetDescendants(hash, setDescendants);
+            vector<uint256> vAncestors;
+            GetAncestors(hash, vAncestors);
+
+            InfoMap::iterator mi = mapInfo.find(hash);
+            if (mi != mapInfo.end())
+            {
+                setByAncestorFeeRate.erase(make_pair(mi->second.dAncestorFeePerKb, hash));
+                setByDescendantFeeRate.erase(make_pair(mi->second.dDescendantFeePerKb, hash));
+                nTotalTxSize -= mi->second.nSize;
+                nDynamicUsage -= mi->second.nUsage;
+                mapInfo.erase(mi);
+            }
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
                 mapNextTx.erase(txin.prevout);
             mapTx.erase(hash);
             nTransactionsUpdated++;
+
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+                UpdateAncestorState(hashDescendant);
+            BOOST_FOREACH(const uint256& hashAncestor, vAncestors)
+                UpdateDescendantState(hashAncestor);
+            UpdateMetrics();
         }
     }
     return true;
@@ -900,7 +1353,7 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     // Remove transactions which depend on inputs of tx, recursively
     LOCK(cs);
     BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        NextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction &txConflict = *it->second.ptx;
             if (txConflict != tx)
@@ -915,7 +1368,13 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapInfo.clear();
+    setByAncestorFeeRate.clear();
+    setByDescendantFeeRate.clear();
+    nTotalTxSize = 0;
+    nDynamicUsage = 0;
     ++nTransactionsUpdated;
+    UpdateMetrics();
 }
 
 void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
@@ -924,10 +1383,154 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
+static void AddMemPoolAncestors(const CTxMemPool& pool, const uint256& hash, set<uint256>& setSeen, vector<uint256>& vAncestors)
+{
+    CTxMemPool::TxMap::const_iterator mi = pool.mapTx.find(hash);
+    if (mi == pool.mapTx.end())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, mi->second->vin)
+    {
+        const uint256& hashParent = txin.prevout.hash;
+        if (pool.mapTx.count(hashParent) && setSeen.insert(hashParent).second)
+        {
+            AddMemPoolAncestors(pool, hashParent, setSeen, vAncestors);
+            vAncestors.push_back(hashParent);
+        }
+    }
+}
+
+void CTxMemPool::GetAncestors(const uint256& hash, std::vector<uint256>& vAncestors) const
+{
+    LOCK(cs);
+    vAncestors.clear();
+    set<uint256> setSeen;
+    AddMemPoolAncestors(*this, hash, setSeen, vAncestors);
+}
+
+void CTxMemPool::GetDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    TxMap::const_iterator mi = mapTx.find(hash);
+    if (mi == mapTx.end())
+        return;
+    for (unsigned int i = 0; i < mi->second->vout.size(); i++)
+    {
+        NextTxMap::const_iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it == mapNextTx.end())
+            continue;
+        uint256 hashChild = it->second.ptx->GetHash();
+        if (setDescendants.insert(hashChild).second)
+            GetDescendants(hashChild, setDescendants);
+    }
+}
+
+void CTxMemPool::UpdateAncestorState(const uint256& hash)
+{
+    InfoMap::iterator mi = mapInfo.find(hash);
+    if (mi == mapInfo.end())
+        return;
+    CTxMemPoolEntry& entry = mi->second;
+    if (entry.nCountWithAncestors)
+        setByAncestorFeeRate.erase(make_pair(entry.dAncestorFeePerKb, hash));
+
+    vector<uint256> vAncestors;
+    GetAncestors(hash, vAncestors);
+    entry.nFeesWithAncestors = entry.nFee;
+    entry.nSizeWithAncestors = entry.nSize;
+    entry.nCountWithAncestors = 1;
+    BOOST_FOREACH(const uint256& hashAncestor, vAncestors)
+    {
+        InfoMap::const_iterator it = mapInfo.find(hashAncestor);
+        if (it == mapInfo.end())
+            continue;
+        entry.nFeesWithAncestors += it->second.nFee;
+        entry.nSizeWithAncestors += it->second.nSize;
+        entry.nCountWithAncestors++;
+    }
+    entry.dAncestorFeePerKb = entry.nSizeWithAncestors ? entry.nFeesWithAncestors / (entry.nSizeWithAncestors / 1000.0) : 0;
+    setByAncestorFeeRate.insert(make_pair(entry.dAncestorFeePerKb, hash));
+}
+
+void CTxMemPool::UpdateDescendantState(const uint256& hash)
+{
+    InfoMap::iterator mi = mapInfo.find(hash);
+    if (mi == mapInfo.end())
+        return;
+    CTxMemPoolEntry& entry = mi->second;
+    if (entry.nCountWithDescendants)
+        setByDescendantFeeRate.erase(make_pair(entry.dDescendantFeePerKb, hash));
+
+    set<uint256> setDescendants;
+    GetDescendants(hash, setDescendants);
+    entry.nFeesWithDescendants = entry.nFee;
+    entry.nSizeWithDescendants = entry.nSize;
+    entry.nCountWithDescendants = 1;
+    BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+    {
+        InfoMap::const_iterator it = mapInfo.find(hashDescendant);
+        if (it == mapInfo.end())
+            continue;
+        entry.nFeesWithDescendants += it->second.nFee;
+        entry.nSizeWithDescendants += it->second.nSize;
+        entry.nCountWithDescendants++;
+    }
+    entry.dDescendantFeePerKb = entry.nSizeWithDescendants ? entry.nFeesWithDescendants / (entry.nSizeWithDescendants / 1000.0) : 0;
+    setByDescendantFeeRate.insert(make_pair(entry.dDescendantFeePerKb, hash));
+}
+
+unsigned int CTxMemPool::TrimToSize(size_t nLimit)
+{
+    LOCK(cs);
+    unsigned int nEvicted = 0;
+    while (nDynamicUsage > nLimit && !setByDescendantFeeRate.empty())
+    {
+        // A transaction and everything spending it go together, so a child
+        // paying for its parent keeps both
+        uint256 hash = setByDescendantFeeRate.begin()->second;
+        double dFeePerKb = setByDescendantFeeRate.begin()->first + MIN_RELAY_TX_FEE;
+        if (dFeePerKb > dRollingMinFeePerKb)
+            dRollingMinFeePerKb = dFeePerKb;
+        nLastRollingFeeUpdate = GetTime();
+
+        CTransactionRef ptx = mapTx[hash];
+        size_t nCount = mapTx.size();
+        remove(*ptx, true);
+        nEvicted += nCount - mapTx.size();
+    }
+    if (nEvicted)
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, minimum fee now %.0f per kB\n", nEvicted, dRollingMinFeePerKb);
+    return nEvicted;
+}
+
+double CTxMemPool::GetMinFeePerKb(size_t nLimit)
+{
+    LOCK(cs);
+    if (dRollingMinFeePerKb == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster the emptier the pool is
+        double dHalfLife = MEMPOOL_FEE_HALFLIFE;
+        if (nDynamicUsage < nLimit / 4)
+            dHalfLife /= 4;
+        else if (nDynamicUsage < nLimit / 2)
+            dHalfLife /= 2;
+        dRollingMinFeePerKb /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+        if (dRollingMinFeePerKb < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinFeePerKb = 0;
+            return 0;
+        }
+    }
+    return max(dRollingMinFeePerKb, (double)MIN_RELAY_TX_FEE);
+}
+
 
 
 
@@ -938,7 +1541,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -987,7 +1590,9 @@ bool __wx__Tx::AcceptWalletTransaction(CTxDB& txdb)
 
     {
         // Add previous supporting transactions first
-        BOOST_FOREACH(CMerkleTx& tx, vtxPrev)
+        vector<CMerkleTx> vSupporting;
+        GetSupportingTransactions(vSupporting);
+        BOOST_FOREACH(CMerkleTx& tx, vSupporting)
         {
             if (!(tx.IsCoinBase() || tx.IsCoinStake()))
             {
@@ -1014,7 +1619,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1042,6 +1647,10 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock,
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
         {
+            // -spentindex knows the block, saving the read of its header
+            int nHeight;
+            if (fSpentIndex && txdb.ReadTxBlock(hash, nHeight, hashBlock))
+                return true;
             CBlock block;
             if (block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
                 hashBlock = block.GetHash();
@@ -1063,117 +1672,552 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock,
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
-CBlockIndex* FindBlockByHeight(int nHeight)
+// Turn the lowest set bit of n off
+static inline int InvertLowestOne(int n) { return n & (n - 1); }
+
+// Height that the skip pointer of a block at nHeight points to. Any block
+// can reach any of its ancestors in O(log n) skips this way.
+static inline int GetSkipHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    if (nHeight < 2)
+        return 0;
+
+    // Jump back further for odd heights, which keeps the worst case down
+    // while still letting every block skip a large distance
+    return (nHeight & 1) ? InvertLowestOne(InvertLowestOne(nHeight - 1)) + 1 : InvertLowestOne(nHeight);
 }
 
-bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
+void CBlockIndex::BuildSkip()
 {
-    if (!fReadTransactions)
-    {
-        *this = pindex->GetBlockHeader();
-        return true;
-    }
-    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
-        return false;
-    if (GetHash() != pindex->GetBlockHash())
-        return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
-    return true;
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-uint256 static GetOrphanRoot(const CBlock* pblock)
+CBlockIndex* CBlockIndex::GetAncestor(int nHeightAncestor)
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblock->hashPrevBlock))
-        pblock = mapOrphanBlocks[pblock->hashPrevBlock];
-    return pblock->GetHash();
+    if (nHeightAncestor > nHeight || nHeightAncestor < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int nHeightWalk = nHeight;
+    while (nHeightWalk > nHeightAncestor)
+    {
+        int nHeightSkip = GetSkipHeight(nHeightWalk);
+        int nHeightSkipPrev = GetSkipHeight(nHeightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (nHeightSkip == nHeightAncestor ||
+             (nHeightSkip > nHeightAncestor && !(nHeightSkipPrev < nHeightSkip - 2 && nHeightSkipPrev >= nHeightAncestor))))
+        {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev
+            pindexWalk = pindexWalk->pskip;
+            nHeightWalk = nHeightSkip;
+        }
+        else
+        {
+            pindexWalk = pindexWalk->pprev;
+            nHeightWalk--;
+        }
+    }
+    return pindexWalk;
 }
 
-// ppcoin: find block wanted by given orphan block
-uint256 WantedByOrphan(const CBlock* pblockOrphan)
+const CBlockIndex* CBlockIndex::GetAncestor(int nHeightAncestor) const
 {
-    // Work back to the first block in the orphan chain
-    while (mapOrphanBlocks.count(pblockOrphan->hashPrevBlock))
-        pblockOrphan = mapOrphanBlocks[pblockOrphan->hashPrevBlock];
-    return pblockOrphan->hashPrevBlock;
+    return const_cast<CBlockIndex*>(this)->GetAncestor(nHeightAncestor);
 }
 
-// static int FINAL_POW_HEIGHT = 118986;
-// static int FINAL_POW_COUNT = 24000;
-int GetPowHeight(const CBlockIndex* pindex)
+/** Block index entries are allocated in large contiguous chunks instead of
+ *  one heap node each, so chain walks over pprev/pnext stay within a few
+ *  cache lines and freeing the whole index is cheap. Entries are never freed
+ *  individually. */
+class CBlockIndexArena
 {
-    int count = 0;
-    int index = -1;
-    int height = pindex->nHeight;
-    int maxCheck = height;
+private:
+    static const unsigned int CHUNK_SIZE = 4096;
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed;
 
-    // if(height > FINAL_POW_HEIGHT)
-    //     return FINAL_POW_COUNT;
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
 
-    if(NUM_OF_POW_CHECKPOINT != 0)
+    CBlockIndex* Alloc()
     {
-        for(int i = 1; i <= NUM_OF_POW_CHECKPOINT; i++)
+        if (nUsed == CHUNK_SIZE)
         {
-            if(height > checkpointPoWHeight[NUM_OF_POW_CHECKPOINT - i][0])
-            {
-                index = NUM_OF_POW_CHECKPOINT - i;
-                break;
-            }
+            vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+            nUsed = 0;
         }
+        return &vChunks.back()[nUsed++];
     }
 
-    if(index != -1)
-        maxCheck = height - checkpointPoWHeight[index][0];
-
-    for (int j = 0; j < maxCheck; j++)
+    void Clear()
     {
-        if(!pindex->IsProofOfStake())
-        {
-            ++count;
-        }
-        pindex = pindex->pprev;
+        BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+            delete[] pchunk;
+        vChunks.clear();
+        nUsed = CHUNK_SIZE;
     }
 
-    if(index != -1)
+    void swap(CBlockIndexArena& other)
     {
-        count += checkpointPoWHeight[index][1];
+        vChunks.swap(other.vChunks);
+        std::swap(nUsed, other.nUsed);
     }
-    return count;
+};
+
+static CBlockIndexArena blockIndexArena;
+std::vector<CBlockIndex*> vChainActive;
+
+CBlockIndex* AllocBlockIndex()
+{
+    return blockIndexArena.Alloc();
 }
 
+static void TruncateHeaderCache(int nHeight);
 
-int GetPosHeight(const CBlockIndex* pindex)
+void FreeBlockIndexes()
 {
-    int posH = pindex->nHeight - GetPowHeight(pindex);
-    return posH;
+    vChainActive.clear();
+    TruncateHeaderCache(0);
+    blockIndexArena.Clear();
 }
 
-static CBigNum GetProofOfStakeLimit(int nHeight)
+static CBlockIndex* RelocatedIndex(const std::vector<std::pair<CBlockIndex*, CBlockIndex*> >& vMoved, CBlockIndex* pindex)
 {
-    if (IsProtocolV2(nHeight))
-        return bnProofOfStakeLimitV2;
-    else
-        return bnProofOfStakeLimit;
+    if (!pindex)
+        return NULL;
+    std::vector<std::pair<CBlockIndex*, CBlockIndex*> >::const_iterator it =
+        std::lower_bound(vMoved.begin(), vMoved.end(), std::make_pair(pindex, (CBlockIndex*)NULL));
+    assert(it != vMoved.end() && it->first == pindex);
+    return it->second;
 }
 
-// miner's coin base reward
-int64_t GetProofOfWorkReward(int64_t nPowHeight, int64_t nFees)
+struct CompareBlockIndexHeight
 {
-    int64_t nBaseSubsidy = 1250 * COIN;
+    bool operator()(const CBlockIndex* a, const CBlockIndex* b) const
+    {
+        if (a->nHeight != b->nHeight)
+            return a->nHeight < b->nHeight;
+        return a < b;
+    }
+};
+
+// Re-lay the loaded block index out in height order and build the skip
+// links. Entries are allocated in whatever order the database hands them
+// back, which is hash order for LevelDB, so without this neighbouring blocks
+// end up far apart in memory.
+void CompactBlockIndex()
+{
+    std::vector<CBlockIndex*> vSorted;
+    vSorted.reserve(mapBlockIndex.size());
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        vSorted.push_back(mi->second);
+    std::sort(vSorted.begin(), vSorted.end(), CompareBlockIndexHeight());
+
+    CBlockIndexArena arenaNew;
+    std::vector<std::pair<CBlockIndex*, CBlockIndex*> > vMoved;
+    vMoved.reserve(vSorted.size());
+    BOOST_FOREACH(CBlockIndex* pindex, vSorted)
+    {
+        CBlockIndex* pindexNew = arenaNew.Alloc();
+        *pindexNew = *pindex;
+        vMoved.push_back(std::make_pair(pindex, pindexNew));
+    }
+    std::sort(vMoved.begin(), vMoved.end());
+
+    for (unsigned int i = 0; i < vMoved.size(); i++)
+    {
+        CBlockIndex* pindexNew = vMoved[i].second;
+        pindexNew->pprev = RelocatedIndex(vMoved, pindexNew->pprev);
+        pindexNew->pnext = RelocatedIndex(vMoved, pindexNew->pnext);
+    }
+    // Skip links are rebuilt rather than relocated: neither loader sets
+    // them, and height order guarantees every pprev is done first
+    BOOST_FOREACH(CBlockIndex* pindex, vSorted)
+        RelocatedIndex(vMoved, pindex)->BuildSkip();
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        mi->second = RelocatedIndex(vMoved, mi->second);
+    pindexGenesisBlock = RelocatedIndex(vMoved, pindexGenesisBlock);
+    pindexBest = RelocatedIndex(vMoved, pindexBest);
+    for (unsigned int i = 0; i < vChainActive.size(); i++)
+        vChainActive[i] = RelocatedIndex(vMoved, vChainActive[i]);
+
+    blockIndexArena.swap(arenaNew);
+}
+
+// Make vChainActive end at pindexTip. Only the part that differs from the
+// previous chain is rewritten, which is a single entry for a new tip.
+void SetActiveChainTip(CBlockIndex* pindexTip)
+{
+    if (!pindexTip)
+    {
+        vChainActive.clear();
+        TruncateHeaderCache(0);
+        return;
+    }
+    int nFork = pindexTip->nHeight + 1;
+    vChainActive.resize(pindexTip->nHeight + 1);
+    for (CBlockIndex* pindex = pindexTip; pindex && vChainActive[pindex->nHeight] != pindex; pindex = pindex->pprev)
+    {
+        vChainActive[pindex->nHeight] = pindex;
+        nFork = pindex->nHeight;
+    }
+    TruncateHeaderCache(nFork);
+}
+
+// "headers" entries of the active chain, serialized once, in runs of
+// HEADER_CACHE_CHUNK heights that fill in as they are asked for. The least
+// recently used runs are dropped past MAX_HEADER_CACHE_CHUNKS, so a peer
+// syncing from genesis doesn't make us hold the whole chain.
+static const int HEADER_CACHE_CHUNK = 2000;
+static const unsigned int MAX_HEADER_CACHE_CHUNKS = 64;
+static CCriticalSection cs_mapHeaderCache;
+static list<int> listHeaderCache;
+static map<int, pair<CSerializeData, list<int>::iterator> > mapHeaderCache;
+
+// Each entry is a header with empty vtx and vchBlockSig
+static unsigned int HeaderEntrySize()
+{
+    static unsigned int nSize = ::GetSerializeSize(CBlock(), SER_NETWORK, PROTOCOL_VERSION);
+    return nSize;
+}
+
+// Forget the cached headers from nHeight up
+static void TruncateHeaderCache(int nHeight)
+{
+    LOCK(cs_mapHeaderCache);
+    map<int, pair<CSerializeData, list<int>::iterator> >::iterator mi = mapHeaderCache.lower_bound(nHeight / HEADER_CACHE_CHUNK);
+    if (mi != mapHeaderCache.end() && (*mi).first == nHeight / HEADER_CACHE_CHUNK)
+    {
+        CSerializeData& vch = (*mi).second.first;
+        unsigned int nKeep = (nHeight % HEADER_CACHE_CHUNK) * HeaderEntrySize();
+        if (vch.size() > nKeep)
+            vch.resize(nKeep);
+        mi++;
+    }
+    while (mi != mapHeaderCache.end())
+    {
+        listHeaderCache.erase((*mi).second.second);
+        mapHeaderCache.erase(mi++);
+    }
+}
+
+// Append the "headers" entries for active chain heights nFirst to nLast
+// requires LOCK(cs_main)
+static void WriteCachedHeaders(CDataStream& ss, int nFirst, int nLast)
+{
+    LOCK(cs_mapHeaderCache);
+    unsigned int nEntrySize = HeaderEntrySize();
+    for (int nChunk = nFirst / HEADER_CACHE_CHUNK; nChunk <= nLast / HEADER_CACHE_CHUNK; nChunk++)
+    {
+        map<int, pair<CSerializeData, list<int>::iterator> >::iterator mi = mapHeaderCache.find(nChunk);
+        if (mi == mapHeaderCache.end())
+        {
+            list<int>::iterator it = listHeaderCache.insert(listHeaderCache.end(), nChunk);
+            mi = mapHeaderCache.insert(make_pair(nChunk, make_pair(CSerializeData(), it))).first;
+        }
+        else
+            listHeaderCache.splice(listHeaderCache.end(), listHeaderCache, (*mi).second.second);
+        CSerializeData& vch = (*mi).second.first;
+
+        int nStart = nChunk * HEADER_CACHE_CHUNK;
+        int nEnd = min(nLast, nStart + HEADER_CACHE_CHUNK - 1);
+        for (int nHeight = nStart + vch.size() / nEntrySize; nHeight <= nEnd; nHeight++)
+        {
+            CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+            ssHeader << vChainActive[nHeight]->GetBlockHeader();
+            vch.insert(vch.end(), ssHeader.begin(), ssHeader.end());
+        }
+
+        int nFrom = max(nFirst, nStart);
+        ss.write(&vch[(nFrom - nStart) * nEntrySize], (nEnd - nFrom + 1) * nEntrySize);
+    }
+
+    while (listHeaderCache.size() > MAX_HEADER_CACHE_CHUNKS)
+    {
+        mapHeaderCache.erase(listHeaderCache.front());
+        listHeaderCache.pop_front();
+    }
+}
+
+CBlockIndex* FindBlockByHeight(int nHeight)
+{
+    if (nHeight < 0 || nHeight >= (int)vChainActive.size())
+        return NULL;
+    return vChainActive[nHeight];
+}
+
+void AppendLocatorHashes(vector<uint256>& vHave, const CBlockIndex* pindex, int nStep)
+{
+    // Off the main chain the skip list finds each ancestor, until the
+    // branch meets the main chain
+    bool fActive = false;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        int nHeight = pindex->nHeight - nStep;
+        if (vHave.size() > 10)
+            nStep *= 2;
+        if (nHeight < 0)
+            break;
+
+        if (!fActive)
+            fActive = FindBlockByHeight(pindex->nHeight) == pindex;
+        pindex = fActive ? vChainActive[nHeight] : pindex->GetAncestor(nHeight);
+    }
+}
+
+uint256 hashAssumeValid = 0;
+
+// Whether ConnectBlock can leave out script checks for pindex. Everything
+// else, amounts, merkle root and proof-of-stake included, is still checked.
+bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashAssumeValid);
+    if (mi != mapBlockIndex.end())
+        return mi->second->GetAncestor(pindex->nHeight) == pindex;
+
+    bool fKnown;
+    bool fAncestor = IsHeaderChainAncestor(hashAssumeValid, pindex, fKnown);
+    if (fKnown)
+        return fAncestor;
+
+    // Without even its header all we have to go by is height, and only a
+    // hard-coded checkpoint, whose hash AcceptBlock enforces, is good for that
+    int nHeight = Checkpoints::GetCheckpointHeight(hashAssumeValid);
+    return nHeight >= 0 && pindex->nHeight <= nHeight;
+}
+
+bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
+{
+    if (!fReadTransactions)
+    {
+        *this = pindex->GetBlockHeader();
+        return true;
+    }
+    if (!ReadFromDisk(pindex->nFile, pindex->nBlockPos, fReadTransactions))
+        return false;
+    if (GetHash() != pindex->GetBlockHash())
+        return error("CBlock::ReadFromDisk() : GetHash() doesn't match index");
+    return true;
+}
+
+// Work back to the first block in the orphan chain. The hashRoot hints skip
+// over whole stretches of the chain, and are refreshed on the way, so
+// repeated lookups for a growing chain stay cheap.
+static map<uint256, COrphanBlock>::iterator GetOrphanRoot(map<uint256, COrphanBlock>::iterator it)
+{
+    map<uint256, COrphanBlock>::iterator itRoot = it;
+    while (true)
+    {
+        map<uint256, COrphanBlock>::iterator itHint = mapOrphanBlocks.find(itRoot->second.hashRoot);
+        if (itHint != mapOrphanBlocks.end())
+            itRoot = itHint;
+        map<uint256, COrphanBlock>::iterator itPrev = mapOrphanBlocks.find(itRoot->second.pblock->hashPrevBlock);
+        if (itPrev == mapOrphanBlocks.end())
+            break;
+        itRoot = itPrev;
+    }
+    it->second.hashRoot = itRoot->first;
+    return itRoot;
+}
+
+// ppcoin: find block wanted by given orphan block
+uint256 WantedByOrphan(const uint256& hashOrphan)
+{
+    map<uint256, COrphanBlock>::iterator it = mapOrphanBlocks.find(hashOrphan);
+    if (it == mapOrphanBlocks.end())
+        return hashOrphan;
+    return GetOrphanRoot(it)->second.pblock->hashPrevBlock;
+}
+
+void static EraseOrphanBlock(const uint256& hash)
+{
+    map<uint256, COrphanBlock>::iterator it = mapOrphanBlocks.find(hash);
+    if (it == mapOrphanBlocks.end())
+        return;
+    CBlock* pblock = it->second.pblock;
+    for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(pblock->hashPrevBlock);
+         mi != mapOrphanBlocksByPrev.upper_bound(pblock->hashPrevBlock); ++mi)
+    {
+        if (mi->second == pblock)
+        {
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    if (pblock->IsProofOfStake())
+        setStakeSeenOrphan.erase(pblock->GetProofOfStake());
+    setOrphanBlocksByTime.erase(make_pair(it->second.nTimeReceived, hash));
+    nOrphanBlocksSize -= it->second.nSize;
+    mapOrphanBlocks.erase(it);
+    delete pblock;
+    metricOrphanBlocks.Set(mapOrphanBlocks.size());
+    metricOrphanBlockBytes.Set(nOrphanBlocksSize);
+}
+
+// Drop orphans that waited too long for their parent, then the oldest ones
+// until the pool fits in nMaxOrphanBlocksSize
+unsigned int static LimitOrphanBlocks()
+{
+    unsigned int nEvicted = 0;
+    int64_t nExpire = GetTime() - ORPHAN_BLOCK_EXPIRE_TIME;
+    while (!setOrphanBlocksByTime.empty() &&
+           (setOrphanBlocksByTime.begin()->first < nExpire || nOrphanBlocksSize > nMaxOrphanBlocksSize))
+    {
+        EraseOrphanBlock(setOrphanBlocksByTime.begin()->second);
+        nEvicted++;
+    }
+    return nEvicted;
+}
+
+static map<uint256, COrphanBlock>::iterator AddOrphanBlock(const CBlock& block, const uint256& hash)
+{
+    COrphanBlock orphan;
+    orphan.pblock = new CBlock(block);
+    orphan.hashRoot = hash;
+    orphan.nTimeReceived = GetTime();
+    orphan.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+    map<uint256, COrphanBlock>::iterator it = mapOrphanBlocks.insert(make_pair(hash, orphan)).first;
+    mapOrphanBlocksByPrev.insert(make_pair(block.hashPrevBlock, orphan.pblock));
+    setOrphanBlocksByTime.insert(make_pair(orphan.nTimeReceived, hash));
+    nOrphanBlocksSize += orphan.nSize;
+    metricOrphanBlocks.Set(mapOrphanBlocks.size());
+    metricOrphanBlockBytes.Set(nOrphanBlocksSize);
+
+    // Inherit the parent's root so the next lookup starts from there
+    map<uint256, COrphanBlock>::iterator itPrev = mapOrphanBlocks.find(block.hashPrevBlock);
+    if (itPrev != mapOrphanBlocks.end())
+        it->second.hashRoot = GetOrphanRoot(itPrev)->first;
+    return it;
+}
+
+void GetOrphanBlockStats(unsigned int& nCountRet, uint64_t& nBytesRet)
+{
+    nCountRet = mapOrphanBlocks.size();
+    nBytesRet = nOrphanBlocksSize;
+}
+
+CBlockConnectStats blockConnectStats;
+
+// Time spent in ConnectInputsPost(), which runs inside ConnectInputs(),
+// and the DIONS transactions it was spent on
+static int64_t nTimeConnectAliases = 0;
+static int64_t nAliasTxsConnected = 0;
+
+void GetAliasConnectStats(int64_t& nTxsRet, int64_t& nMicrosRet)
+{
+    nTxsRet = nAliasTxsConnected;
+    nMicrosRet = nTimeConnectAliases;
+}
+
+CBlockConnectStats::CBlockConnectStats()
+{
+    memset(nCount, 0, sizeof(nCount));
+    memset(nTotalMicros, 0, sizeof(nTotalMicros));
+    memset(nMaxMicros, 0, sizeof(nMaxMicros));
+    memset(nBuckets, 0, sizeof(nBuckets));
+}
+
+void CBlockConnectStats::Add(BlockConnectStage stage, int64_t nMicros)
+{
+    if (nMicros < 0)
+        nMicros = 0;
+    int nBucket = 0;
+    while (nBucket < BENCH_BUCKETS - 1 && (nMicros >> nBucket) > 1)
+        nBucket++;
+    nCount[stage]++;
+    nTotalMicros[stage] += nMicros;
+    nMaxMicros[stage] = max(nMaxMicros[stage], nMicros);
+    nBuckets[stage][nBucket]++;
+}
+
+const char* GetBlockConnectStageName(int stage)
+{
+    switch (stage)
+    {
+    case BENCH_CHECK_BLOCK:      return "checkblock";
+    case BENCH_FETCH_INPUTS:     return "fetchinputs";
+    case BENCH_CONNECT_INPUTS:   return "connectinputs";
+    case BENCH_CONNECT_ALIASES:  return "connectaliases";
+    case BENCH_SCRIPT_WAIT:      return "scriptwait";
+    case BENCH_WRITE_INDEX:      return "writeindex";
+    case BENCH_CONNECT_BLOCK:    return "connectblock";
+    case BENCH_DISCONNECT_BLOCK: return "disconnectblock";
+    case BENCH_COMMIT:           return "commit";
+    case BENCH_SET_BEST_CHAIN:   return "setbestchain";
+    case BENCH_REORGANIZE:       return "reorganize";
+    }
+    return "unknown";
+}
+
+// static int FINAL_POW_HEIGHT = 118986;
+// static int FINAL_POW_COUNT = 24000;
+int GetPowHeight(const CBlockIndex* pindex)
+{
+    int count = 0;
+    int index = -1;
+    int height = pindex->nHeight;
+    int maxCheck = height;
+
+    // if(height > FINAL_POW_HEIGHT)
+    //     return FINAL_POW_COUNT;
+
+    if(NUM_OF_POW_CHECKPOINT != 0)
+    {
+        for(int i = 1; i <= NUM_OF_POW_CHECKPOINT; i++)
+        {
+            if(height > checkpointPoWHeight[NUM_OF_POW_CHECKPOINT - i][0])
+            {
+                index = NUM_OF_POW_CHECKPOINT - i;
+                break;
+            }
+        }
+    }
+
+    if(index != -1)
+        maxCheck = height - checkpointPoWHeight[index][0];
+
+    for (int j = 0; j < maxCheck; j++)
+    {
+        if(!pindex->IsProofOfStake())
+        {
+            ++count;
+        }
+        pindex = pindex->pprev;
+    }
+
+    if(index != -1)
+    {
+        count += checkpointPoWHeight[index][1];
+    }
+    return count;
+}
+
+
+int GetPosHeight(const CBlockIndex* pindex)
+{
+    int posH = pindex->nHeight - GetPowHeight(pindex);
+    return posH;
+}
+
+static uint256 GetProofOfStakeLimit(int nHeight)
+{
+    if (IsProtocolV2(nHeight))
+        return bnProofOfStakeLimitV2;
+    else
+        return bnProofOfStakeLimit;
+}
+
+// miner's coin base reward
+int64_t GetProofOfWorkReward(int64_t nPowHeight, int64_t nFees)
+{
+    int64_t nBaseSubsidy = 1250 * COIN;
     int64_t nSubsidy = 0 * COIN;
 
     // first 30 block half reward to gives pools a change to get setup
@@ -1288,10 +2332,14 @@ static const int64_t nTargetTimespan = 16 * 60;  // 16 mins
 //
 // maximum nBits value could possible be required nTime after
 //
-unsigned int ComputeMaxBits(CBigNum bnTargetLimit, unsigned int nBase, int64_t nTime)
+unsigned int ComputeMaxBits(uint256 bnTargetLimit, unsigned int nBase, int64_t nTime)
 {
-    CBigNum bnResult;
-    bnResult.SetCompact(nBase);
+    bool fNegative, fOverflow;
+    uint256 bnResult;
+    bnResult.SetCompact(nBase, &fNegative, &fOverflow);
+    // The doubling below would pass the limit at once, or wrap
+    if (fNegative || fOverflow || bnResult > (bnTargetLimit >> 1))
+        return bnTargetLimit.GetCompact();
     bnResult *= 2;
     while (nTime > 0 && bnResult < bnTargetLimit)
     {
@@ -1332,9 +2380,30 @@ const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfSta
     return pindex;
 }
 
+// Retargeting used to be done in CBigNum, signed and unbounded. A uint512
+// holds any product of a 256-bit target and a 64-bit factor, and the sign
+// is kept beside it, so the results stay the same to the bit.
+static uint512 WidenTarget(uint256 bn)
+{
+    uint512 ret;
+    memcpy(ret.begin(), bn.begin(), bn.size());
+    return ret;
+}
+
+// bn = bn * nMul / nDiv, rounding toward zero as BN_div does
+static void MulDivTarget(uint512& bn, bool& fNegative, int64_t nMul, int64_t nDiv)
+{
+    bn *= uint512(nMul < 0 ? 0 - (uint64_t)nMul : (uint64_t)nMul);
+    bn /= uint512(nDiv < 0 ? 0 - (uint64_t)nDiv : (uint64_t)nDiv);
+    if ((nMul < 0) != (nDiv < 0))
+        fNegative = !fNegative;
+    if (!bn)
+        fNegative = false;
+}
+
 static unsigned int GetNextTargetRequiredV1(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit;
+    uint256 bnTargetLimit = fProofOfStake ? bnProofOfStakeLimit : bnProofOfWorkLimit;
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -1351,21 +2420,22 @@ static unsigned int GetNextTargetRequiredV1(const CBlockIndex* pindexLast, bool
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bool fNegative;
+    uint512 bnNew;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative);
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    MulDivTarget(bnNew, fNegative, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                 (nInterval + 1) * nTargetSpacing);
 
-    if (bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
+    if (!fNegative && bnNew > WidenTarget(bnTargetLimit))
+        return bnTargetLimit.GetCompact();
 
-    return bnNew.GetCompact();
+    return bnNew.GetCompact(fNegative);
 }
 
 static unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool fProofOfStake)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : bnProofOfWorkLimit;
+    uint256 bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : bnProofOfWorkLimit;
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -1384,21 +2454,22 @@ static unsigned int GetNextTargetRequiredV2(const CBlockIndex* pindexLast, bool
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bool fNegative;
+    uint512 bnNew;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative);
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
+    MulDivTarget(bnNew, fNegative, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                 (nInterval + 1) * nTargetSpacing);
 
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
-        bnNew = bnTargetLimit;
+    if (fNegative || !bnNew || bnNew > WidenTarget(bnTargetLimit))
+        return bnTargetLimit.GetCompact();
 
     return bnNew.GetCompact();
 }
 
 static unsigned int GetNextTargetRequiredV3(const CBlockIndex* pindexLast, bool fProofOfStake, int64_t nFees)
 {
-    CBigNum bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : bnProofOfWorkLimit;
+    uint256 bnTargetLimit = fProofOfStake ? GetProofOfStakeLimit(pindexLast->nHeight) : bnProofOfWorkLimit;
 
     if (pindexLast == NULL)
         return bnTargetLimit.GetCompact(); // genesis block
@@ -1423,29 +2494,63 @@ static unsigned int GetNextTargetRequiredV3(const CBlockIndex* pindexLast, bool
 
     // ppcoin: target change every block
     // ppcoin: retarget with exponential moving toward target spacing
-    CBigNum bnNew, bnMit;
-    bnNew.SetCompact(pindexPrev->nBits);
+    bool fNegative;
+    uint512 bnNew;
+    bnNew.SetCompact(pindexPrev->nBits, &fNegative);
     int64_t nFeesMitigation = nFees / ( MIN_TX_FEE * 10) + 1;
     int64_t nInterval = nTargetTimespan / nTargetSpacing;
-    bnNew *= ((nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing);
-    bnNew /= ((nInterval + 1) * nTargetSpacing);
-    if (bnNew <= 0 || bnNew > bnTargetLimit)
-        {bnNew = bnTargetLimit;}
-    else
-      if (bnNew < bnTargetLimit/4)
-        {
-            bnMit = bnNew*nFeesMitigation;
-            if (bnMit > bnTargetLimit/4)
-                {bnNew=bnTargetLimit/4;}
-            else
-                {bnNew=bnMit;}
-        }
+    MulDivTarget(bnNew, fNegative, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                 (nInterval + 1) * nTargetSpacing);
+    uint512 bnLimit = WidenTarget(bnTargetLimit);
+    uint512 bnLimitQuarter = bnLimit >> 2;
+    if (fNegative || !bnNew || bnNew > bnLimit)
+        return bnTargetLimit.GetCompact();
+    if (bnNew < bnLimitQuarter)
+    {
+        MulDivTarget(bnNew, fNegative, nFeesMitigation, 1);
+        if (!fNegative && bnNew > bnLimitQuarter)
+            bnNew = bnLimitQuarter;
+    }
 
-    return bnNew.GetCompact();
+    return bnNew.GetCompact(fNegative);
 }
 
 
 
+uint256 GetHardestStakeTarget(int nHeight, unsigned int nBitsPrev, int64_t nTimePrev, int64_t nTimePrevPrev)
+{
+    // The same steps as GetNextTargetRequired() for pindexLast at nHeight - 1
+    int nHeightLast = nHeight - 1;
+    uint256 bnTargetLimit = nHeightLast < 24376 ? bnProofOfStakeLimit : GetProofOfStakeLimit(nHeightLast);
+    int64_t nTargetSpacing = GetTargetSpacing(nHeightLast);
+    int64_t nActualSpacing = nTimePrev - nTimePrevPrev;
+    if (nActualSpacing < 0)
+    {
+        // Version 1 retargets to a negative target here
+        if (nHeightLast < 24376)
+            return 0;
+        nActualSpacing = nTargetSpacing;
+    }
+    if (nHeightLast >= (int)POS_v3_DIFFICULTY_HEIGHT && V3(nHeightLast) && nActualSpacing > nTargetSpacing * 10)
+        nActualSpacing = nTargetSpacing;
+
+    bool fNegative;
+    uint512 bnNew;
+    bnNew.SetCompact(nBitsPrev, &fNegative);
+    int64_t nInterval = nTargetTimespan / nTargetSpacing;
+    MulDivTarget(bnNew, fNegative, (nInterval - 1) * nTargetSpacing + nActualSpacing + nActualSpacing,
+                 (nInterval + 1) * nTargetSpacing);
+    if (fNegative || !bnNew)
+        return 0;
+    if (bnNew > WidenTarget(bnTargetLimit))
+        return bnTargetLimit;
+
+    // Version 3 only ever eases this for block fees
+    uint256 bnHardest;
+    bnHardest.SetCompact(bnNew.GetCompact());
+    return bnHardest;
+}
+
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake, int64_t nFees)
 {
     if(pindexLast->nHeight < 24376)
@@ -1461,15 +2566,16 @@ unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfS
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
     // Check range
-    if (bnTarget <= 0 || bnTarget > bnProofOfWorkLimit)
+    if (fNegative || fOverflow || !bnTarget || bnTarget > bnProofOfWorkLimit)
         return error("CheckProofOfWork() : nBits below minimum work");
 
     // Check proof of work matches claimed amount
-    if (hash > bnTarget.getuint256())
+    if (hash > bnTarget)
         return error("CheckProofOfWork() : hash doesn't match nBits");
 
     return true;
@@ -1484,6 +2590,8 @@ int GetNumBlocksOfPeers()
 bool IsInitialBlockDownload()
 {
     LOCK(cs_main);
+    if (fImporting || fReindex)
+        return true;
     if (pindexBest == NULL || nBestHeight < Checkpoints::GetTotalBlocksEstimate())
     {
         return true;
@@ -1541,14 +2649,17 @@ void CBlock::UpdateTime(const CBlockIndex* pindexPrev)
 
 
 
-bool CTransaction::DisconnectInputs(CTxDB& txdb)
+bool CTransaction::DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo)
 {
+    if (ptxundo && !IsCoinBase() && ptxundo->vprevout.size() != vin.size())
+        return error("DisconnectInputs() : undo data doesn't match transaction");
+
     // Relinquish previous transactions' spent pointers
     if (!IsCoinBase())
     {
-        BOOST_FOREACH(const CTxIn& txin, vin)
+        for (unsigned int i = 0; i < vin.size(); i++)
         {
-            COutPoint prevout = txin.prevout;
+            COutPoint prevout = vin[i].prevout;
 
             // Get prev txindex from disk
             CTxIndex txindex;
@@ -1564,9 +2675,30 @@ bool CTransaction::DisconnectInputs(CTxDB& txdb)
             // Write back
             if (!txdb.UpdateTxIndex(prevout.hash, txindex))
                 return error("DisconnectInputs() : UpdateTxIndex failed");
+
+            // Return the output to the unspent set
+            if (ptxundo && !ptxundo->vprevout[i].IsNull())
+            {
+                if (!txdb.WriteUnspent(prevout, ptxundo->vprevout[i]))
+                    return error("DisconnectInputs() : WriteUnspent failed");
+                continue;
+            }
+            CTransaction txPrev;
+            CBlock block;
+            if (!txPrev.ReadFromDisk(txindex.pos) || !block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+                return error("DisconnectInputs() : ReadFromDisk prev tx failed");
+            BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
+            if (mi == mapBlockIndex.end())
+                return error("DisconnectInputs() : prev tx block not in index");
+            if (!txdb.WriteUnspent(prevout, CUnspent(txPrev, prevout.n, mi->second->nHeight)))
+                return error("DisconnectInputs() : WriteUnspent failed");
         }
     }
 
+    // Remove our own outputs from the unspent set
+    for (unsigned int i = 0; i < vout.size(); i++)
+        txdb.EraseUnspent(COutPoint(GetHash(), i));
+
     // Remove transaction from index
     // This can fail if a duplicate of this transaction was in a chain that got
     // reorganized away. This is only possible if this transaction was completely
@@ -1620,7 +2752,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
-        else
+        else if (!(fBlock && !fMiner && FetchUnspentInputs(txdb, prevout.hash, txindex, txPrev)))
         {
             // Get prev tx from disk
             if (!txPrev.ReadFromDisk(txindex.pos))
@@ -1647,6 +2779,49 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     return true;
 }
 
+void CUnspent::ApplyTo(CTransaction& txPrev, unsigned int n) const
+{
+    if (txPrev.vout.empty())
+    {
+        txPrev.nTime = nTime;
+        txPrev.vout.resize(nOutputs);
+        if (IsCoinBase())
+            txPrev.vin.resize(1);
+        else if (IsCoinStake())
+        {
+            // IsCoinStake() wants a non-null first input and an empty first output
+            txPrev.vin.resize(1);
+            txPrev.vin[0].prevout.n = 0;
+            txPrev.vout[0].SetEmpty();
+        }
+    }
+    if (n < txPrev.vout.size())
+        txPrev.vout[n] = txout;
+}
+
+// Rebuild the outputs of hashPrev spent by this transaction from the unspent
+// set. Returns false if any of them is missing, in which case the caller has
+// to read the previous transaction back from the block file.
+bool CTransaction::FetchUnspentInputs(CTxDB& txdb, const uint256& hashPrev, const CTxIndex& txindex, CTransaction& txPrev) const
+{
+    txPrev.SetNull();
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        const COutPoint& prevout = vin[i].prevout;
+        if (prevout.hash != hashPrev)
+            continue;
+
+        CUnspent unspent;
+        if (!txdb.ReadUnspent(prevout, unspent) || unspent.nOutputs != txindex.vSpent.size())
+        {
+            txPrev.SetNull();
+            return false;
+        }
+        unspent.ApplyTo(txPrev, prevout.n);
+    }
+    return !txPrev.vout.empty();
+}
+
 const CTxOut& CTransaction::GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const
 {
     MapPrevTx::const_iterator mi = inputs.find(input.prevout.hash);
@@ -1689,26 +2864,203 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
-bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos& posThisTx,
-    CBlockIndex* pindexBlock, bool fBlock, bool fMiner, int flags)
+bool CScriptCheck::operator()() const
 {
-    // Take over previous transactions' spent pointers
-    // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
-    // fMiner is true when called from the internal bitcoin miner
-    // ... both are false when called from CTransaction::AcceptToMemoryPool
-    if (!IsCoinBase())
-    {
-        vector<CTransaction> vTxPrev;
-        vector<CTxIndex> vTxindex;
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType, pcache.get()))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString().substr(0,10).c_str());
+    return true;
+}
 
-        int64_t nValueIn = 0;
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck(void*)
+{
+    RenameThread("iocoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CTransaction>& vtx,
+                             std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    vAccepted.assign(vtx.size(), false);
+    vMissingInputs.assign(vtx.size(), false);
+
+    // Look up every input's index in one sorted pass, so the lookups
+    // below are served from the txdb cache
+    {
+        CTxDB txdb("r");
+        set<uint256> setPrev;
+        BOOST_FOREACH(const CTransaction& tx, vtx)
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                setPrev.insert(txin.prevout.hash);
+        CTxIndex txindex;
+        BOOST_FOREACH(const uint256& hashPrev, setPrev)
+            txdb.ReadTxIndex(hashPrev, txindex);
+    }
+
+    // Everything but the scripts, which are collected for all of them; a
+    // transaction may spend one before it in the batch as that one is
+    // already in the pool
+    vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        bool fMissingInputs = false;
+        vAccepted[i] = AcceptToMemoryPool(pool, vtx[i], &fMissingInputs, nScriptCheckThreads ? &vChecks : NULL);
+        vMissingInputs[i] = fMissingInputs;
+    }
+    if (vChecks.empty())
+        return;
+
+    bool fValid;
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        fValid = control.Wait();
+    }
+    if (fValid)
+        return;
+
+    // Some script failed: take the batch back out and accept it again one
+    // at a time, which finds the culprit and scores it
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        if (vAccepted[i])
+            pool.remove(vtx[i], true);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (!vAccepted[i])
+            continue;
+        bool fMissingInputs = false;
+        vAccepted[i] = AcceptToMemoryPool(pool, vtx[i], &fMissingInputs);
+        vMissingInputs[i] = fMissingInputs;
+    }
+}
+
+/** Context-free checks of one transaction of a block for CheckBlock(),
+ *  which also hand back its txid and legacy sigop count */
+class CTxCheck
+{
+private:
+    const CTransaction *ptx;
+    int64_t nBlockTime;
+    uint256 *phashRet;
+    unsigned int *pnSigOpsRet;
+
+public:
+    CTxCheck() : ptx(0), nBlockTime(0), phashRet(0), pnSigOpsRet(0) {}
+    CTxCheck(const CTransaction& txIn, int64_t nBlockTimeIn, uint256& hashRet, unsigned int& nSigOpsRet) :
+        ptx(&txIn), nBlockTime(nBlockTimeIn), phashRet(&hashRet), pnSigOpsRet(&nSigOpsRet) { }
+
+    bool operator()() const
+    {
+        if (!ptx->CheckTransaction() || nBlockTime < (int64_t)ptx->nTime)
+            return false;
+        *phashRet = ptx->GetHash();
+        *pnSigOpsRet = ptx->GetLegacySigOpCount();
+        return true;
+    }
+
+    void swap(CTxCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(nBlockTime, check.nBlockTime);
+        std::swap(phashRet, check.phashRet);
+        std::swap(pnSigOpsRet, check.pnSigOpsRet);
+    }
+};
+
+static CCheckQueue<CTxCheck> blockcheckqueue(16);
+
+// A queue takes one master at a time; CheckBlock() runs on several threads
+static CCriticalSection cs_blockcheckqueue;
+
+// Blocks with fewer transactions aren't worth handing out
+static const unsigned int MIN_PARALLEL_CHECK_TXS = 32;
+
+void ThreadBlockCheck(void*)
+{
+    RenameThread("iocoin-blockchk");
+    blockcheckqueue.Thread();
+}
+
+/** Hashing of one header, so a batch of them can run side by side. Old
+ *  version headers are identified by their X11 hash, which costs far more
+ *  than the rest of their checks. */
+class CHeaderHash
+{
+private:
+    const CBlock *pheader;
+
+public:
+    CHeaderHash() : pheader(0) {}
+    CHeaderHash(const CBlock& headerIn) : pheader(&headerIn) { }
+
+    bool operator()() const
+    {
+        pheader->GetHash();
+        return true;
+    }
+
+    void swap(CHeaderHash &check) {
+        std::swap(pheader, check.pheader);
+    }
+};
+
+static CCheckQueue<CHeaderHash> headerhashqueue(64);
+static CCriticalSection cs_headerhashqueue;
+
+// Fewer headers are hashed faster than they are handed out
+static const unsigned int MIN_PARALLEL_HASH_HEADERS = 16;
+
+void ThreadHeaderHash(void*)
+{
+    RenameThread("iocoin-hdrhash");
+    headerhashqueue.Thread();
+}
+
+// Otherwise the headers are left to be hashed as they are used
+void HashBlockHeaders(const vector<CBlock>& vHeaders)
+{
+    if (!nScriptCheckThreads || vHeaders.size() < MIN_PARALLEL_HASH_HEADERS)
+        return;
+    TRY_LOCK(cs_headerhashqueue, lockQueue);
+    if (!lockQueue)
+        return;
+    CCheckQueueControl<CHeaderHash> control(&headerhashqueue);
+    vector<CHeaderHash> vChecks;
+    vChecks.reserve(vHeaders.size());
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+        vChecks.push_back(CHeaderHash(header));
+    control.Add(vChecks);
+    control.Wait();
+}
+
+bool CTransaction::ConnectInputs(CTxDB& txdb, const MapPrevTx& inputs, map<uint256, CTxIndex>& mapTestPool, CDiskTxPos& posThisTx,
+    CBlockIndex* pindexBlock, bool fBlock, bool fMiner, int flags, std::vector<CScriptCheck> *pvChecks)
+{
+    // Take over previous transactions' spent pointers
+    // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
+    // fMiner is true when called from the internal bitcoin miner
+    // ... both are false when called from CTransaction::AcceptToMemoryPool
+    if (!IsCoinBase())
+    {
+        // Only ConnectInputsPost() on a dions transaction reads these
+        vector<CTransaction> vTxPrev;
+        vector<CTxIndex> vTxindex;
+        bool fDions = (nVersion == DION_TX_VERSION);
+        // The spent flags this transaction sets, on copies of the input indexes
+        map<uint256, CTxIndex> mapSpentIndex;
+
+        int64_t nValueIn = 0;
         int64_t nFees = 0;
+        bool fVerifyScripts = !(fBlock && IsAssumedValid(pindexBlock));
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
-            assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            assert(mi != inputs.end());
+            const CTxIndex& txindex = mi->second.first;
+            const CTransaction& txPrev = mi->second.second;
 
             if (prevout.n >= txPrev.vout.size() || prevout.n >= txindex.vSpent.size())
                 return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %"PRIszu" %"PRIszu" prev tx %s\n%s", GetHash().ToString().substr(0,10).c_str(), prevout.n, txPrev.vout.size(), txindex.vSpent.size(), prevout.hash.ToString().substr(0,10).c_str(), txPrev.ToString().c_str()));
@@ -1727,19 +3079,29 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             nValueIn += txPrev.vout[prevout.n].nValue;
             if (!MoneyRange(txPrev.vout[prevout.n].nValue) || !MoneyRange(nValueIn))
                 return DoS(100, error("ConnectInputs() : txin values out of range"));
-            vTxPrev.push_back(txPrev);
-            vTxindex.push_back(txindex);
+            if (fDions)
+            {
+                vTxPrev.push_back(txPrev);
+                vTxindex.push_back(txindex);
+            }
 
         }
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        boost::shared_ptr<const CSignatureHashCache> pcache;
+        if (fVerifyScripts && vin.size() > 1)
+            pcache.reset(new CSignatureHashCache(*this));
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
-            assert(inputs.count(prevout.hash) > 0);
-            CTxIndex& txindex = inputs[prevout.hash].first;
-            CTransaction& txPrev = inputs[prevout.hash].second;
+            MapPrevTx::const_iterator mi = inputs.find(prevout.hash);
+            assert(mi != inputs.end());
+            const CTransaction& txPrev = mi->second.second;
+            map<uint256, CTxIndex>::iterator mit = mapSpentIndex.find(prevout.hash);
+            if (mit == mapSpentIndex.end())
+                mit = mapSpentIndex.insert(make_pair(prevout.hash, mi->second.first)).first;
+            CTxIndex& txindex = mit->second;
 
             // Check for conflicts (double-spend)
             // This doesn't trigger the DoS code on purpose; if it did, it would make it easier
@@ -1748,12 +3110,21 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
               return fMiner ? false : error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString().substr(0,10).c_str(), txindex.vSpent[prevout.n].ToString().c_str());
 
             // Skip ECDSA signature verification when connecting blocks (fBlock=true)
-            // before the last blockchain checkpoint. This is safe because block merkle hashes are
-            // still computed and checked, and any change will be caught at the next checkpoint.
-            if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
+            // that are ancestors of the -assumevalid block. This is safe because block
+            // merkle hashes are still computed and checked, and any change would give a
+            // chain that doesn't lead to that block.
+            if (fVerifyScripts)
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
+                // Verify signature. txPrev may only carry the spent outputs
+                // (see FetchUnspentInputs), so check against the output itself;
+                // inputs are keyed by prevout.hash so the txid already matches.
+                const CScript& scriptPubKey = txPrev.vout[prevout.n].scriptPubKey;
+
+                // Alias transactions update the locator db in ConnectInputsPost,
+                // so only ordinary transactions have their scripts deferred.
+                if (pvChecks && nVersion != DION_TX_VERSION)
+                    pvChecks->push_back(CScriptCheck(txPrev.vout[prevout.n], *this, i, flags, 0, pcache));
+                else if (!VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags, 0, pcache.get()))
                 {
                     if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
                         // Check whether the failure was caused by a
@@ -1762,7 +3133,7 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
                         // if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+                        if (VerifyScript(vin[i].scriptSig, scriptPubKey, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0, pcache.get()))
                             return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString().c_str());
                     }
                     // Failures of other flags indicate a transaction that is
@@ -1791,8 +3162,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             if (nValueIn < GetValueOut())
                 return DoS(100, error("ConnectInputs() : %s value in < value out", GetHash().ToString().substr(0,10).c_str()));
 
-          if (!ConnectInputsPost (mapTestPool, *this, vTxPrev, vTxindex,
-                                   pindexBlock, posThisTx, fBlock, fMiner))
+          int64_t nTimeStart = GetTimeMicros();
+          bool fPost = ConnectInputsPost (txdb, mapTestPool, *this, vTxPrev, vTxindex,
+                                   pindexBlock, posThisTx, fBlock, fMiner);
+          nTimeConnectAliases += GetTimeMicros() - nTimeStart;
+          if (nVersion == DION_TX_VERSION)
+              nAliasTxsConnected++;
+          if (!fPost)
           {
             return DoS(100, error("pre forward %s\n", GetHash().ToString().substr(0,10).c_str()));
           }
@@ -1815,12 +3191,147 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
+// -addrindex: output n of hashTx paid in a block at nHeight
+static bool IndexAddressOutput(CTxDB& txdb, const CTxOut& txout, const uint256& hashTx, unsigned int n, int nHeight)
+{
+    uint160 hashScript = Hash160(txout.scriptPubKey);
+    if (!txdb.WriteAddressIndex(CAddressIndexKey(hashScript, nHeight, hashTx, n, false), txout.nValue))
+        return false;
+    return txdb.WriteAddressUnspent(CAddressUnspentKey(hashScript, COutPoint(hashTx, n)), CAddressUnspentValue(txout, nHeight));
+}
+
+// -addrindex: txoutPrev at prevout spent by input n of hashTx
+static bool IndexAddressSpend(CTxDB& txdb, const CTxOut& txoutPrev, const COutPoint& prevout, const uint256& hashTx, unsigned int n, int nHeight)
+{
+    uint160 hashScript = Hash160(txoutPrev.scriptPubKey);
+    if (!txdb.WriteAddressIndex(CAddressIndexKey(hashScript, nHeight, hashTx, n, true), -txoutPrev.nValue))
+        return false;
+    return txdb.EraseAddressUnspent(CAddressUnspentKey(hashScript, prevout));
+}
+
+// -addrindex: undo the above for a transaction whose inputs DisconnectInputs
+// has just returned to the unspent set
+static bool UnindexAddresses(CTxDB& txdb, const CTransaction& tx, const uint256& hashTx, int nHeight)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        if (tx.vout[i].IsEmpty())
+            continue;
+        uint160 hashScript = Hash160(tx.vout[i].scriptPubKey);
+        txdb.EraseAddressIndex(CAddressIndexKey(hashScript, nHeight, hashTx, i, false));
+        txdb.EraseAddressUnspent(CAddressUnspentKey(hashScript, COutPoint(hashTx, i)));
+    }
+    if (tx.IsCoinBase())
+        return true;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        CUnspent unspent;
+        if (!txdb.ReadUnspent(tx.vin[i].prevout, unspent))
+            return error("UnindexAddresses() : spent output %s:%u not restored", tx.vin[i].prevout.hash.ToString().substr(0,10).c_str(), tx.vin[i].prevout.n);
+        uint160 hashScript = Hash160(unspent.txout.scriptPubKey);
+        txdb.EraseAddressIndex(CAddressIndexKey(hashScript, nHeight, hashTx, i, true));
+        if (!txdb.WriteAddressUnspent(CAddressUnspentKey(hashScript, tx.vin[i].prevout), CAddressUnspentValue(unspent.txout, unspent.nHeight)))
+            return false;
+    }
+    return true;
+}
+
+// -blockstatsindex: add the block at nHeight to the summaries of its stride,
+// or with nSign -1 take it out of them again
+static bool UpdateBlockStatsSummaries(CTxDB& txdb, int nHeight, const CBlockStats& stats, int nSign)
+{
+    int nStride = nHeight / BLOCK_STATS_STRIDE;
+    CBlockStatsSummary summary;
+    txdb.ReadBlockStatsSummary(nStride, summary);
+    summary.Add(stats, nSign);
+    if (!txdb.WriteBlockStatsSummary(nStride, summary))
+        return false;
+    if (stats.scriptMinter.empty())
+        return true;
+
+    uint160 hashScript = Hash160(stats.scriptMinter);
+    CBlockStatsSummary summaryMinter;
+    txdb.ReadMinterStats(hashScript, nStride, summaryMinter);
+    summaryMinter.Add(stats, nSign);
+    return txdb.WriteMinterStats(hashScript, nStride, summaryMinter);
+}
+
+bool GetBlockStatsRange(int nStart, int nEnd, const CScript& scriptMinter, CBlockStatsSummary& summary)
+{
+    summary = CBlockStatsSummary();
+    if (!fBlockStatsIndex)
+        return false;
+
+    CTxDB txdb("r");
+    uint160 hashScript = scriptMinter.empty() ? 0 : Hash160(scriptMinter);
+    int nHeight = max(nStart, 0);
+    while (nHeight <= nEnd)
+    {
+        if (nHeight % BLOCK_STATS_STRIDE == 0 && nHeight + BLOCK_STATS_STRIDE - 1 <= nEnd)
+        {
+            int nStride = nHeight / BLOCK_STATS_STRIDE;
+            CBlockStatsSummary summaryStride;
+            if (scriptMinter.empty())
+                txdb.ReadBlockStatsSummary(nStride, summaryStride);
+            else
+                txdb.ReadMinterStats(hashScript, nStride, summaryStride);
+            summary.Add(summaryStride);
+            nHeight += BLOCK_STATS_STRIDE;
+            continue;
+        }
+
+        // The genesis block is never connected, so it has no record
+        CBlockStats stats;
+        if (txdb.ReadBlockStats(nHeight, stats))
+        {
+            if (scriptMinter.empty() || stats.scriptMinter == scriptMinter)
+                summary.Add(stats);
+        }
+        else if (nHeight > 0)
+            return error("GetBlockStatsRange() : no record of block %d", nHeight);
+        nHeight++;
+    }
+    return true;
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
+    // Alias records resolved against the chain being unwound
+    ClearAliasRecords();
+
+    // Use the undo record written by ConnectBlock if we still have it
+    uint256 hashBlock = pindex->GetBlockHash();
+    CBlockUndo undo;
+    bool fUndo = txdb.ReadBlockUndo(hashBlock, undo) && undo.vtxundo.size() == vtx.size();
+
     // Disconnect in reverse order
     for (int i = vtx.size()-1; i >= 0; i--)
-        if (!vtx[i].DisconnectInputs(txdb))
+    {
+        if (!vtx[i].DisconnectInputs(txdb, fUndo ? &undo.vtxundo[i] : NULL))
             return false;
+        if (fAddrIndex && !UnindexAddresses(txdb, vtx[i], GetTxHash(i), pindex->nHeight))
+            return error("DisconnectBlock() : address index update failed");
+        if (fSpentIndex)
+        {
+            if (!vtx[i].IsCoinBase())
+            {
+                BOOST_FOREACH(const CTxIn& txin, vtx[i].vin)
+                    txdb.EraseSpentIndex(txin.prevout);
+            }
+            txdb.EraseTxBlock(GetTxHash(i));
+        }
+    }
+    if (fBlockStatsIndex)
+    {
+        CBlockStats stats;
+        if (txdb.ReadBlockStats(pindex->nHeight, stats))
+        {
+            if (!UpdateBlockStatsSummaries(txdb, pindex->nHeight, stats, -1))
+                return error("DisconnectBlock() : block stats index update failed");
+            txdb.EraseBlockStats(pindex->nHeight);
+        }
+    }
+    txdb.EraseBlockUndo(hashBlock);
 
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
@@ -1841,10 +3352,17 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
+    int64_t nTimeStart = GetTimeMicros();
+
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
     if (!CheckBlock(!fJustCheck, !fJustCheck, false))
         return false;
 
+    int64_t nTimeCheck = GetTimeMicros() - nTimeStart;
+    int64_t nTimeFetch = 0;
+    int64_t nTimeInputs = 0;
+    int64_t nTimeAliasesStart = nTimeConnectAliases;
+
      unsigned int flags = SCRIPT_VERIFY_NOCACHE;
 
     if(V3(pindex->nHeight))
@@ -1870,10 +3388,22 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     int64_t nValueIn = 0;
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
+    int64_t nStakeValue = 0;
     unsigned int nSigOps = 0;
+
+    // Script checks are handed to the worker threads and joined before
+    // anything is written below
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    CBlockUndo undo;
+    undo.vtxundo.resize(vtx.size());
+    unsigned int nTx = 0;
+    // Outputs spent by the block in input order, for the optional indexes
+    vector<CTxOut> vSpentOutputs;
+
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
-        uint256 hashTx = tx.GetHash();
+        uint256 hashTx = GetTxHash(nTx);
 
         // Do not allow blocks that contain transactions which 'overwrite' older transactions,
         // unless those are already completely spent.
@@ -1908,8 +3438,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
         else
         {
             bool fInvalid;
+            int64_t nTimeFetchStart = GetTimeMicros();
             if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
                 return false;
+            nTimeFetch += GetTimeMicros() - nTimeFetchStart;
 
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
@@ -1932,14 +3464,46 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (!tx.IsCoinStake())
                 nFees += nTxValueIn - nTxValueOut;
             if (tx.IsCoinStake())
+            {
                 nStakeReward = nTxValueOut - nTxValueIn;
+                nStakeValue = nTxValueIn;
+            }
 
-            bool pre = tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags);
+            std::vector<CScriptCheck> vChecks;
+            int64_t nTimeInputsStart = GetTimeMicros();
+            bool pre = tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL);
+            nTimeInputs += GetTimeMicros() - nTimeInputsStart;
             if(!pre && tx.nVersion == CTransaction::DION_TX_VERSION)
               return DoS(100, error("pre count"));
             else if(!pre)
               return false;
+            control.Add(vChecks);
+
+            // Remember what was spent, for DisconnectBlock
+            if (!fJustCheck)
+            {
+                CTxUndo& txundo = undo.vtxundo[nTx];
+                txundo.vprevout.resize(tx.vin.size());
+                for (unsigned int i = 0; i < tx.vin.size(); i++)
+                {
+                    const COutPoint& prevout = tx.vin[i].prevout;
+                    if (txdb.ReadUnspent(prevout, txundo.vprevout[i]))
+                        continue;
+                    // Not in the unspent set: created earlier in this block, or
+                    // before the set existed, in which case the height is unknown
+                    const CTxIndex& txindexPrev = mapInputs[prevout.hash].first;
+                    const CTransaction& txPrev = mapInputs[prevout.hash].second;
+                    if (txindexPrev.pos.nFile == pindex->nFile && txindexPrev.pos.nBlockPos == pindex->nBlockPos)
+                        txundo.vprevout[i] = CUnspent(txPrev, prevout.n, pindex->nHeight);
+                }
+                if (fAddrIndex || fSpentIndex)
+                {
+                    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                        vSpentOutputs.push_back(mapInputs[txin.prevout.hash].second.vout[txin.prevout.n]);
+                }
+            }
         }
+        nTx++;
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
@@ -1966,6 +3530,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%"PRId64" vs calculated=%"PRId64")", nStakeReward, nCalculatedStakeReward));
     }
 
+    int64_t nTimeWaitStart = GetTimeMicros();
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+    int64_t nTimeWait = GetTimeMicros() - nTimeWaitStart;
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -1982,6 +3551,77 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Record the undo data, keeping only the most recent blocks'
+    if (!txdb.WriteBlockUndo(pindex->GetBlockHash(), undo))
+        return error("ConnectBlock() : WriteBlockUndo failed");
+    CBlockIndex* pindexOld = pindex;
+    for (int i = 0; i < UNDO_KEEP_DEPTH && pindexOld; i++)
+        pindexOld = pindexOld->pprev;
+    if (pindexOld)
+        txdb.EraseBlockUndo(pindexOld->GetBlockHash());
+
+    // Update the unspent set, and the optional indexes with it, in block
+    // order, so that outputs created and spent within this block end up erased
+    uint256 hashBlock = pindex->GetBlockHash();
+    unsigned int nSpent = 0;
+    for (unsigned int nTxWrite = 0; nTxWrite < vtx.size(); nTxWrite++)
+    {
+        const CTransaction& tx = vtx[nTxWrite];
+        uint256 hashTx = GetTxHash(nTxWrite);
+        if (fSpentIndex && !txdb.WriteTxBlock(hashTx, pindex->nHeight, hashBlock))
+            return error("ConnectBlock() : WriteTxBlock failed");
+        if (!tx.IsCoinBase())
+            for (unsigned int i = 0; i < tx.vin.size(); i++)
+            {
+                if (!txdb.EraseUnspent(tx.vin[i].prevout))
+                    return error("ConnectBlock() : EraseUnspent failed");
+                if (!(fAddrIndex || fSpentIndex))
+                    continue;
+                const CTxOut& txoutPrev = vSpentOutputs[nSpent++];
+                if (fAddrIndex && !IndexAddressSpend(txdb, txoutPrev, tx.vin[i].prevout, hashTx, i, pindex->nHeight))
+                    return error("ConnectBlock() : address index update failed");
+                if (fSpentIndex && !txdb.WriteSpentIndex(tx.vin[i].prevout, CSpentIndexValue(hashTx, i, pindex->nHeight, txoutPrev)))
+                    return error("ConnectBlock() : WriteSpentIndex failed");
+            }
+
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            if (tx.vout[i].IsEmpty())
+                continue;
+            if (!txdb.WriteUnspent(COutPoint(hashTx, i), CUnspent(tx, i, pindex->nHeight)))
+                return error("ConnectBlock() : WriteUnspent failed");
+            if (fAddrIndex && !IndexAddressOutput(txdb, tx.vout[i], hashTx, i, pindex->nHeight))
+                return error("ConnectBlock() : address index update failed");
+        }
+    }
+
+    if (fBlockStatsIndex)
+    {
+        CBlockStats stats;
+        stats.nTime = nTime;
+        stats.fProofOfStake = IsProofOfStake();
+        stats.nTx = vtx.size();
+        stats.nSize = ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION);
+        stats.nFees = nFees;
+        stats.nReward = pindex->nMint;
+        stats.nStakeValue = nStakeValue;
+        // The staker is paid by the coinstake's second output, the miner by
+        // the coinbase's first
+        unsigned int nMintOut = IsProofOfStake() ? 1 : 0;
+        const CTransaction& txMint = vtx[nMintOut];
+        if (txMint.vout.size() > nMintOut)
+        {
+            const CScript& scriptPaid = txMint.vout[nMintOut].scriptPubKey;
+            CTxDestination destMinter;
+            if (ExtractDestination(scriptPaid, destMinter))
+                stats.scriptMinter.SetDestination(destMinter);
+            else
+                stats.scriptMinter = scriptPaid;
+        }
+        if (!txdb.WriteBlockStats(pindex->nHeight, stats) || !UpdateBlockStatsSummaries(txdb, pindex->nHeight, stats, 1))
+            return error("ConnectBlock() : block stats index update failed");
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1995,6 +3635,28 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
+    PublishConnectedBlock(*this);
+
+    int64_t nTimeAliases = nTimeConnectAliases - nTimeAliasesStart;
+    int64_t nTimeEnd = GetTimeMicros();
+    int64_t nTimeWrite = nTimeEnd - nTimeWaitStart - nTimeWait;
+    blockConnectStats.Add(BENCH_CHECK_BLOCK, nTimeCheck);
+    blockConnectStats.Add(BENCH_FETCH_INPUTS, nTimeFetch);
+    blockConnectStats.Add(BENCH_CONNECT_INPUTS, nTimeInputs - nTimeAliases);
+    blockConnectStats.Add(BENCH_CONNECT_ALIASES, nTimeAliases);
+    blockConnectStats.Add(BENCH_SCRIPT_WAIT, nTimeWait);
+    blockConnectStats.Add(BENCH_WRITE_INDEX, nTimeWrite);
+    blockConnectStats.Add(BENCH_CONNECT_BLOCK, nTimeEnd - nTimeStart);
+    if (!fJustCheck)
+    {
+        metricBlocksConnected.Inc();
+        metricBlockConnectTime.Add(nTimeEnd - nTimeStart);
+        metricBlockConnectLast.Set(nTimeEnd - nTimeStart);
+    }
+    if (fDebugBench)
+        printf("ConnectBlock() : %d txs at height %d in %.2fms (check %.2fms, fetch %.2fms, inputs %.2fms, aliases %.2fms, scripts %.2fms, write %.2fms)\n",
+               (int)vtx.size(), pindex->nHeight, 0.001 * (nTimeEnd - nTimeStart), 0.001 * nTimeCheck, 0.001 * nTimeFetch,
+               0.001 * (nTimeInputs - nTimeAliases), 0.001 * nTimeAliases, 0.001 * nTimeWait, 0.001 * nTimeWrite);
 
     return true;
 }
@@ -2002,6 +3664,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 {
     printf("REORGANIZE\n");
+    int64_t nTimeStart = GetTimeMicros();
 
     // Find the fork
     CBlockIndex* pfork = pindexBest;
@@ -2038,8 +3701,10 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         CBlock block;
         if (!block.ReadFromDisk(pindex))
             return error("Reorganize() : ReadFromDisk for disconnect failed");
+        int64_t nTimeDisconnectStart = GetTimeMicros();
         if (!block.DisconnectBlock(txdb, pindex))
             return error("Reorganize() : DisconnectBlock %s failed", pindex->GetBlockHash().ToString().substr(0,20).c_str());
+        blockConnectStats.Add(BENCH_DISCONNECT_BLOCK, GetTimeMicros() - nTimeDisconnectStart);
 
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
@@ -2071,22 +3736,30 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         return error("Reorganize() : WriteHashBestChain failed");
 
     // Make sure it's successfully written to disk before changing memory structure
+    int64_t nTimeCommitStart = GetTimeMicros();
     if (!txdb.TxnCommit())
         return error("Reorganize() : TxnCommit failed");
+    blockConnectStats.Add(BENCH_COMMIT, GetTimeMicros() - nTimeCommitStart);
 
-    // Disconnect shorter branch
-    BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = NULL;
+    {
+        WRITE_LOCK(cs_chainstate);
 
-    // Connect longer branch
-    BOOST_FOREACH(CBlockIndex* pindex, vConnect)
-        if (pindex->pprev)
-            pindex->pprev->pnext = pindex;
+        // Disconnect shorter branch
+        BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = NULL;
+        if (!vDisconnect.empty())
+            ClearKernelStakeModifierCache();
+
+        // Connect longer branch
+        BOOST_FOREACH(CBlockIndex* pindex, vConnect)
+            if (pindex->pprev)
+                pindex->pprev->pnext = pindex;
+    }
 
-    // Resurrect memory transactions that were in the disconnected branch
-    BOOST_FOREACH(CTransaction& tx, vResurrect)
-        AcceptToMemoryPool(mempool, tx, NULL);
+    // Resurrect memory transactions that were in the disconnected branch,
+    // in the background rather than under cs_main here
+    QueueMempoolRevalidation(vector<CTransaction>(vResurrect.begin(), vResurrect.end()));
 
     // Delete redundant memory transactions that are in the connected branch
     BOOST_FOREACH(CTransaction& tx, vDelete) {
@@ -2094,13 +3767,58 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         mempool.removeConflicts(tx);
     }
 
-    printf("REORGANIZE: done\n");
+    int64_t nTimeReorganize = GetTimeMicros() - nTimeStart;
+    blockConnectStats.Add(BENCH_REORGANIZE, nTimeReorganize);
+    printf("REORGANIZE: done in %.2fms\n", 0.001 * nTimeReorganize);
 
     return true;
 }
 
 
 // Called from inside SetBestChain: attaches a block to the new best chain being built
+// Published by SetBestChain; cs_tipSummary is only held to copy the pointer
+static CCriticalSection cs_tipSummary;
+static CChainTipSummaryRef ptipSummary;
+
+// Needs cs_main. The RPC helpers all look at pindexBest.
+static CChainTipSummaryRef BuildChainTipSummary()
+{
+    CChainTipSummary* psummary = new CChainTipSummary();
+    psummary->nHeight = pindexBest->nHeight;
+    psummary->hashBlock = pindexBest->GetBlockHash();
+    psummary->nTime = pindexBest->GetBlockTime();
+    psummary->nPowHeight = GetPowHeight(pindexBest);
+    psummary->dDifficultyPoW = GetDifficulty();
+    psummary->dDifficultyPoS = GetDifficulty(GetLastBlockIndex(pindexBest, true));
+    psummary->dNetMHashPS = GetPoWMHashPS();
+    psummary->dNetStakeWeight = GetPoSKernelPS();
+    psummary->nBlockValue = GetProofOfWorkReward(pindexBest->nHeight, 0);
+    psummary->nStakeInterest = GetProofOfStakeInterest(pindexBest->nHeight);
+    return CChainTipSummaryRef(psummary);
+}
+
+CChainTipSummaryRef GetChainTipSummary()
+{
+    {
+        LOCK(cs_tipSummary);
+        if (ptipSummary)
+            return ptipSummary;
+    }
+
+    // None yet: SetBestChain doesn't publish one for every block of the
+    // initial download
+    LOCK(cs_main);
+    if (pindexBest == NULL)
+        return CChainTipSummaryRef(new CChainTipSummary());
+    CChainTipSummaryRef psummary = BuildChainTipSummary();
+    if (!IsInitialBlockDownload())
+    {
+        LOCK(cs_tipSummary);
+        ptipSummary = psummary;
+    }
+    return psummary;
+}
+
 bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 {
     uint256 hash = GetHash();
@@ -2112,23 +3830,38 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
         InvalidChainFound(pindexNew);
         return false;
     }
+
+    // Aliases go in the same batch, so the alias index can't get ahead of
+    // or fall behind the chain
+    LocatorNodeDB aliasdb(txdb);
+    aliasdb.filter(*this, pindexNew);
+    aliasdb.WriteIndexedHeight(pindexNew->nHeight);
+
+    int64_t nTimeCommitStart = GetTimeMicros();
     if (!txdb.TxnCommit())
         return error("SetBestChain() : TxnCommit failed");
+    int64_t nTimeCommit = GetTimeMicros() - nTimeCommitStart;
+    blockConnectStats.Add(BENCH_COMMIT, nTimeCommit);
+    if (fDebugBench)
+        printf("SetBestChain() : commit %.2fms\n", 0.001 * nTimeCommit);
 
     // Add to current best branch
-    pindexNew->pprev->pnext = pindexNew;
+    {
+        WRITE_LOCK(cs_chainstate);
+        pindexNew->pprev->pnext = pindexNew;
+    }
 
-    // Delete redundant memory transactions
+    // Delete redundant memory transactions, after timing their confirmation
+    feeEstimator.ProcessBlock(pindexNew->nHeight, vtx);
     BOOST_FOREACH(CTransaction& tx, vtx)
         mempool.remove(tx);
 
-  
-    ln1Db->filter(pindexNew);
     return true;
 }
 
 bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
 {
+    int64_t nTimeStart = GetTimeMicros();
     uint256 hash = GetHash();
 
     if (!txdb.TxnBegin())
@@ -2202,13 +3935,28 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     }
 
     // New best block
-    hashBestChain = hash;
-    pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexNew->nChainTrust;
+    {
+        WRITE_LOCK(cs_chainstate);
+        hashBestChain = hash;
+        pindexBest = pindexNew;
+        SetActiveChainTip(pindexBest);
+        nBestHeight = pindexBest->nHeight;
+        metricBestHeight.Set(nBestHeight);
+        nBestChainTrust = pindexNew->nChainTrust;
+    }
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
+    {
+        boost::unique_lock<boost::mutex> lock(csBestBlock);
+        cvBlockChange.notify_all();
+    }
+    {
+        CChainTipSummaryRef psummary;
+        if (!fIsInitialDownload)
+            psummary = BuildChainTipSummary();
+        LOCK(cs_tipSummary);
+        ptipSummary = psummary;
+    }
 
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
@@ -2236,6 +3984,11 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
             strMiscWarning = _("Warning: This version is obsolete, upgrade required!");
     }
 
+    int64_t nTimeSetBestChain = GetTimeMicros() - nTimeStart;
+    blockConnectStats.Add(BENCH_SET_BEST_CHAIN, nTimeSetBestChain);
+    if (fDebugBench)
+        printf("SetBestChain() : %.2fms\n", 0.001 * nTimeSetBestChain);
+
     std::string strCmd = GetArg("-blocknotify", "");
 
     if (!fIsInitialDownload && !strCmd.empty())
@@ -2243,6 +3996,16 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         boost::replace_all(strCmd, "%s", hashBestChain.GetHex());
         boost::thread t(runCommand, strCmd); // thread runs free
     }
+    if (!fIsInitialDownload)
+    {
+        QueueBlockNotification(hashBestChain, nBestHeight);
+        // A reorganisation that stopped short leaves an earlier block on top
+        CBlock blockBest;
+        if (hashBestChain == hash)
+            PublishBlock(*this, nBestHeight);
+        else if (blockBest.ReadFromDisk(pindexBest))
+            PublishBlock(blockBest, nBestHeight);
+    }
 
     return true;
 }
@@ -2352,15 +4115,15 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString().substr(0,20).c_str());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = AllocBlockIndex();
+    *pindexNew = CBlockIndex(nFile, nBlockPos, *this);
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
 
     // ppcoin: compute chain trust score
@@ -2384,10 +4147,13 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016"PRIx64, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    {
+        WRITE_LOCK(cs_chainstate);
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-    pindexNew->phashBlock = &((*mi).first);
 
     // Write to disk block index
     CTxDB txdb;
@@ -2423,6 +4189,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
+    if (fChecked && fCheckPOW && fCheckMerkleRoot && fCheckSig)
+        return true;
 
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
@@ -2457,37 +4225,67 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
             return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
     }
 
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, vtx)
+    // Check transactions, hashing them and counting their sigops on the
+    // way, on the block check threads if the block is big enough
+    vector<uint256> vTxHashes(vtx.size());
+    vector<unsigned int> vTxSigOps(vtx.size(), 0);
+    bool fChecksDone = false;
+    if (nScriptCheckThreads && vtx.size() >= MIN_PARALLEL_CHECK_TXS)
+    {
+        TRY_LOCK(cs_blockcheckqueue, lockQueue);
+        if (lockQueue)
+        {
+            CCheckQueueControl<CTxCheck> control(&blockcheckqueue);
+            vector<CTxCheck> vChecks;
+            vChecks.reserve(vtx.size());
+            for (unsigned int i = 0; i < vtx.size(); i++)
+                vChecks.push_back(CTxCheck(vtx[i], GetBlockTime(), vTxHashes[i], vTxSigOps[i]));
+            control.Add(vChecks);
+            fChecksDone = control.Wait();
+        }
+        // Rerun serially below to report the failing transaction
+        if (!fChecksDone)
+        {
+            BOOST_FOREACH(const CTransaction& tx, vtx)
+                tx.nDoS = 0;
+        }
+    }
+    if (!fChecksDone)
     {
-        if (!tx.CheckTransaction())
-            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
+        for (unsigned int i = 0; i < vtx.size(); i++)
+        {
+            const CTransaction& tx = vtx[i];
+            if (!tx.CheckTransaction())
+                return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
+
+            // ppcoin: check transaction timestamp
+            if (GetBlockTime() < (int64_t)tx.nTime)
+                return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
 
-        // ppcoin: check transaction timestamp
-        if (GetBlockTime() < (int64_t)tx.nTime)
-            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
+            vTxHashes[i] = tx.GetHash();
+            vTxSigOps[i] = tx.GetLegacySigOpCount();
+        }
     }
 
+    // Build the merkle tree up front, so the txids in ConnectBlock come
+    // from its leaves instead of being hashed again
+    vMerkleTree.assign(vTxHashes.begin(), vTxHashes.end());
+    uint256 hashMerkleRootBuilt = BuildMerkleBranches();
+
     // Check for duplicate txids. This is caught by ConnectInputs(),
     // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uniqueTx.insert(tx.GetHash());
-    }
+    set<uint256> uniqueTx(vTxHashes.begin(), vTxHashes.end());
     if (uniqueTx.size() != vtx.size())
         return DoS(100, error("CheckBlock() : duplicate transaction"));
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += tx.GetLegacySigOpCount();
-    }
+    BOOST_FOREACH(unsigned int nTxSigOps, vTxSigOps)
+        nSigOps += nTxSigOps;
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
 
     // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+    if (fCheckMerkleRoot && hashMerkleRoot != hashMerkleRootBuilt)
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
 
@@ -2510,7 +4308,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2640,13 +4438,27 @@ bool CBlock::AcceptBlock()
 
 uint256 CBlockIndex::GetBlockTrust() const
 {
-    CBigNum bnTarget;
-    bnTarget.SetCompact(nBits);
+    return ::GetBlockTrust(nBits);
+}
+
+uint256 GetBlockTrust(unsigned int nBits)
+{
+    bool fNegative, fOverflow;
+    uint256 bnTarget;
+    bnTarget.SetCompact(nBits, &fNegative, &fOverflow);
 
-    if (bnTarget <= 0)
+    // A target past 2**256 leaves less than one
+    if (fNegative || fOverflow || !bnTarget)
         return 0;
 
-    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    // 2**256 / (bnTarget+1) doesn't fit, but ~bnTarget / (bnTarget+1) + 1
+    // is the same
+    uint256 bnDivisor = bnTarget;
+    bnDivisor += 1;
+    uint256 bnTrust = ~bnTarget;
+    bnTrust /= bnDivisor;
+    bnTrust += 1;
+    return bnTrust;
 }
 
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
@@ -2731,18 +4543,24 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             else
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
         }
-        CBlock* pblock2 = new CBlock(*pblock);
-        mapOrphanBlocks.insert(make_pair(hash, pblock2));
-        mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
+        AddOrphanBlock(*pblock, hash);
+        unsigned int nEvicted = LimitOrphanBlocks();
+        if (nEvicted > 0)
+            printf("ProcessBlock: orphan block pool over its limit, evicted %u blocks\n", nEvicted);
+        map<uint256, COrphanBlock>::iterator itOrphan = mapOrphanBlocks.find(hash);
+        if (itOrphan == mapOrphanBlocks.end())
+            return true;
 
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        // Ask this guy to fill in what we're missing, unless the download
+        // window is already fetching the block the orphans build on
+        map<uint256, COrphanBlock>::iterator itRoot = GetOrphanRoot(itOrphan);
+        if (pfrom && !(IsHeadersSyncActive() && IsHeaderChainBlock(itRoot->second.pblock->hashPrevBlock)))
         {
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            pfrom->PushGetBlocks(pindexBest, itRoot->first);
             // ppcoin: getblocks may not obtain the ancestor block rejected
             // earlier by duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
-                pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
+                pfrom->AskFor(CInv(MSG_BLOCK, itRoot->second.pblock->hashPrevBlock));
         }
         return true;
     }
@@ -2757,21 +4575,22 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     for (unsigned int i = 0; i < vWorkQueue.size(); i++)
     {
         uint256 hashPrev = vWorkQueue[i];
+        vector<uint256> vChildren;
         for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
              mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
              ++mi)
+            vChildren.push_back(mi->second->GetHash());
+        BOOST_FOREACH(const uint256& hashOrphan, vChildren)
         {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
-            delete pblockOrphan;
+            if (mapOrphanBlocks[hashOrphan].pblock->AcceptBlock())
+                vWorkQueue.push_back(hashOrphan);
+            EraseOrphanBlock(hashOrphan);
         }
-        mapOrphanBlocksByPrev.erase(hashPrev);
     }
 
     printf("ProcessBlock: ACCEPTED\n");
+    if (fDebug)
+        printf("ProcessBlock: %u header hash evaluations for %s\n", pblock->nHashEvaluations, hash.ToString().substr(0,20).c_str());
 
     // ppcoin: if responsible for sync-checkpoint send it
     if (pfrom && !CSyncCheckpoint::strMasterPrivKey.empty())
@@ -2881,30 +4700,6 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
-{
-    string strBlockFn = strprintf("blk%04u.dat", nFile);
-    return GetDataDir() / strBlockFn;
-}
-
-FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode)
-{
-    if ((nFile < 1) || (nFile == (unsigned int) -1))
-        return NULL;
-    FILE* file = fopen(BlockFilePath(nFile).string().c_str(), pszMode);
-    if (!file)
-        return NULL;
-    if (nBlockPos != 0 && !strchr(pszMode, 'a') && !strchr(pszMode, 'w'))
-    {
-        if (fseek(file, nBlockPos, SEEK_SET) != 0)
-        {
-            fclose(file);
-            return NULL;
-        }
-    }
-    return file;
-}
-
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -2917,8 +4712,11 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
             return NULL;
         if (fseek(file, 0, SEEK_END) != 0)
             return NULL;
-        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB
-        if (ftell(file) < (long)(0x7F000000 - MAX_SIZE))
+        // FAT32 file size max 4GB, fseek and ftell max 2GB, so we must stay under 2GB.
+        // Pruning nodes roll over much earlier so that old history can be
+        // released in reasonably small pieces.
+        long nMaxFileSize = nPruneTarget ? (long)MAX_PRUNE_BLOCKFILE_SIZE : (long)(0x7F000000 - MAX_SIZE);
+        if (ftell(file) < nMaxFileSize)
         {
             nFileRet = nCurrentBlockFile;
             return file;
@@ -2928,15 +4726,225 @@ FILE* AppendBlockFile(unsigned int& nFileRet)
     }
 }
 
-bool LoadBlockIndex(bool fAllowNew)
+// Block files written to since they were last synced
+static CCriticalSection cs_setUncommittedBlockFiles;
+static set<unsigned int> setUncommittedBlockFiles;
+
+void MarkBlockFileUncommitted(unsigned int nFile)
 {
-    LOCK(cs_main);
+    LOCK(cs_setUncommittedBlockFiles);
+    setUncommittedBlockFiles.insert(nFile);
+}
+
+void CommitBlockFiles()
+{
+    set<unsigned int> setFiles;
+    {
+        LOCK(cs_setUncommittedBlockFiles);
+        setFiles.swap(setUncommittedBlockFiles);
+    }
+    BOOST_FOREACH(unsigned int nFile, setFiles)
+    {
+        // Not "ab", which would bring back a file pruned in the meantime
+        FILE* file = OpenBlockFile(nFile, 0, "rb+");
+        if (!file)
+            continue;
+        FileCommit(file);
+        fclose(file);
+    }
+}
 
-    CBigNum bnTrustedModulus;
+// A block's size isn't in the index, so the last of a run is prefetched
+// this far past its start; blocks this far apart are read as runs of their own
+static const unsigned int BLOCK_PREFETCH_TAIL = 128 * 1024;
+static const unsigned int BLOCK_PREFETCH_GAP = 1024 * 1024;
 
-    if (fTestNet)
+void PrefetchBlocks(const vector<CBlockIndex*>& vIndex, unsigned int nBegin, unsigned int nEnd)
+{
+    nEnd = min(nEnd, (unsigned int)vIndex.size());
+    unsigned int nFile = 0, nRunBegin = 0, nRunEnd = 0;
+    for (unsigned int i = nBegin; i < nEnd; i++)
     {
-        pchMessageStart[0] = 0xff;
+        const CBlockIndex* pindex = vIndex[i];
+        // The size of the block sits in the 8 bytes before it
+        unsigned int nPos = pindex->nBlockPos >= 8 ? pindex->nBlockPos - 8 : 0;
+        if (pindex->nFile == nFile && nPos >= nRunBegin && nPos <= nRunEnd + BLOCK_PREFETCH_GAP)
+        {
+            nRunEnd = max(nRunEnd, pindex->nBlockPos + BLOCK_PREFETCH_TAIL);
+            continue;
+        }
+        if (nFile)
+            PrefetchBlockFile(nFile, nRunBegin, nRunEnd);
+        nFile = pindex->nFile;
+        nRunBegin = nPos;
+        nRunEnd = pindex->nBlockPos + BLOCK_PREFETCH_TAIL;
+    }
+    if (nFile)
+        PrefetchBlockFile(nFile, nRunBegin, nRunEnd);
+}
+
+// Files found to still hold something we need, and the height at which
+// that was last checked. Only ThreadPruneBlockFiles uses them.
+static map<unsigned int, int> mapBlockFilePinned;
+static int nLastPruneHeight = 0;
+
+// A block file can go once nothing in it is needed any more: every output
+// of its main chain transactions has been spent (unspent outputs are read
+// back from disk by the stake kernel, coin age and wallet code), and it has
+// no alias transactions, which the DIONS index reads back by position.
+// A spend in one of setRecentBlocks, the blocks within MIN_BLOCKS_TO_KEEP
+// of the tip, doesn't count yet: a reorganization could still undo it.
+static bool IsBlockFilePrunable(CTxDB& txdb, unsigned int nFile, const vector<CBlockIndex*>& vBlocks,
+                                const set<pair<unsigned int, unsigned int> >& setRecentBlocks)
+{
+    BOOST_FOREACH(CBlockIndex* pindex, vBlocks)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return false;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (tx.nVersion == CTransaction::DION_TX_VERSION)
+                return false;
+            CTxIndex txindex;
+            if (!txdb.ReadTxIndex(tx.GetHash(), txindex) || txindex.pos.nFile != nFile)
+                continue;
+            for (unsigned int i = 0; i < txindex.vSpent.size() && i < tx.vout.size(); i++)
+            {
+                const CDiskTxPos& posSpent = txindex.vSpent[i];
+                if (posSpent.IsNull() ? tx.vout[i].nValue > 0 : setRecentBlocks.count(make_pair(posSpent.nFile, posSpent.nBlockPos)) > 0)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The chain is looked at under cs_main, the files are read without it and
+// cs_main is only taken again to remove one
+void PruneBlockFiles()
+{
+    if (!nPruneTarget)
+        return;
+
+    // Main chain blocks by file
+    int nHeight;
+    unsigned int nLastBlockFile;
+    map<unsigned int, vector<CBlockIndex*> > mapFileBlocks;
+    map<unsigned int, int> mapFileMaxHeight;
+    set<pair<unsigned int, unsigned int> > setRecentBlocks;
+    {
+        LOCK(cs_main);
+        if (nBestHeight < nLastPruneHeight + PRUNE_CHECK_INTERVAL)
+            return;
+        nHeight = nBestHeight;
+        nLastBlockFile = nCurrentBlockFile;
+        for (CBlockIndex* pindex = pindexGenesisBlock; pindex; pindex = pindex->pnext)
+        {
+            mapFileBlocks[pindex->nFile].push_back(pindex);
+            mapFileMaxHeight[pindex->nFile] = pindex->nHeight;
+            if (pindex->nHeight > nHeight - MIN_BLOCKS_TO_KEEP)
+                setRecentBlocks.insert(make_pair(pindex->nFile, pindex->nBlockPos));
+        }
+    }
+    nLastPruneHeight = nHeight;
+
+    // The snapshot's history has to be there until it has been verified
+    CChainSnapshotState snapshotState;
+    if (GetChainSnapshotState(snapshotState) && !snapshotState.IsVerified())
+        return;
+
+    uint64_t nTotalSize = 0;
+    map<unsigned int, uint64_t> mapFileSize;
+    for (unsigned int nFile = 1; nFile <= nLastBlockFile; nFile++)
+    {
+        boost::system::error_code ec;
+        uint64_t nSize = filesystem::file_size(BlockFilePath(nFile), ec);
+        if (ec)
+            continue;
+        mapFileSize[nFile] = nSize;
+        nTotalSize += nSize;
+    }
+    if (nTotalSize <= nPruneTarget)
+        return;
+
+    CTxDB txdb("r");
+    for (map<unsigned int, uint64_t>::iterator mi = mapFileSize.begin(); mi != mapFileSize.end() && nTotalSize > nPruneTarget && !fShutdown; ++mi)
+    {
+        unsigned int nFile = mi->first;
+        if (nFile >= nLastBlockFile || mapFileMaxHeight[nFile] > nHeight - MIN_BLOCKS_TO_KEEP)
+            break;
+        if (mapBlockFilePinned.count(nFile) && mapBlockFilePinned[nFile] > nHeight - PRUNE_RECHECK_DEPTH)
+            continue;
+        if (!IsBlockFilePrunable(txdb, nFile, mapFileBlocks[nFile], setRecentBlocks))
+        {
+            mapBlockFilePinned[nFile] = nHeight;
+            continue;
+        }
+
+        boost::system::error_code ec;
+        {
+            LOCK(cs_main);
+            UnmapBlockFiles();
+            filesystem::remove(BlockFilePath(nFile), ec);
+        }
+        if (ec)
+        {
+            printf("PruneBlockFiles() : failed to remove blk%04u.dat: %s\n", nFile, ec.message().c_str());
+            continue;
+        }
+        printf("PruneBlockFiles() : removed blk%04u.dat (%"PRIu64" bytes)\n", nFile, mi->second);
+        mapBlockFilePinned.erase(nFile);
+        nTotalSize -= mi->second;
+    }
+}
+
+void ThreadPruneBlockFiles(void* parg)
+{
+    RenameThread("iocoin-prune");
+    vnThreadsRunning[THREAD_PRUNE]++;
+
+    while (!fShutdown)
+    {
+        PruneBlockFiles();
+        MilliSleep(1000);
+    }
+
+    vnThreadsRunning[THREAD_PRUNE]--;
+}
+
+// An optional index is only complete if it was kept from the genesis block
+// on, so it can be turned on for a new database only; init asks for -reindex
+// otherwise. Turning it off leaves the records unused.
+static bool InitOptionalIndex(CTxDB& txdb, const string& strName)
+{
+    bool fIndex = false;
+    txdb.ReadIndexFlag(strName, fIndex);
+    if (mapBlockIndex.empty())
+        fIndex = GetBoolArg("-" + strName);
+    else if (fIndex && !GetBoolArg("-" + strName))
+        fIndex = false;
+    txdb.WriteIndexFlag(strName, fIndex);
+    return fIndex;
+}
+
+// Deriving the group and accumulator parameters is a long run of prime
+// searches, and nothing on the block path needs them
+libzerocoin::Params* GetZCParams()
+{
+    LOCK(cs_zcparams);
+    if (!pZCParams)
+        pZCParams = new libzerocoin::Params(bnTrustedModulus);
+    return pZCParams;
+}
+
+bool LoadBlockIndex(bool fAllowNew)
+{
+    LOCK(cs_main);
+
+    if (fTestNet)
+    {
+        pchMessageStart[0] = 0xff;
         pchMessageStart[1] = 0xc4;
         pchMessageStart[2] = 0xbb;
         pchMessageStart[3] = 0xdf;
@@ -2953,11 +4961,6 @@ bool LoadBlockIndex(bool fAllowNew)
         bnTrustedModulus.SetHex("d01f952e1090a5a72a3eda261083256596ccc192935ae1454c2bafd03b09e6ed11811be9f3a69f5783bbbced8c6a0c56621f42c2d19087416facf2f13cc7ed7159d1c5253119612b8449f0c7f54248e382d30ecab1928dbf075c5425dcaee1a819aa13550e0f3227b8c685b14e0eae094d65d8a610a6f49fff8145259d1187e4c6a472fa5868b2b67f957cb74b787f4311dbc13c97a2ca13acdb876ff506ebecbb904548c267d68868e07a32cd9ed461fbc2f920e9940e7788fed2e4817f274df5839c2196c80abe5c486df39795186d7bc86314ae1e8342f3c884b158b4b05b4302754bf351477d35370bad6639b2195d30006b77bf3dbb28b848fd9ecff5662bf39dde0c974e83af51b0d3d642d43834827b8c3b189065514636b8f2a59c42ba9b4fc4975d4827a5d89617a3873e4b377b4d559ad165748632bd928439cfbc5a8ef49bc2220e0b15fb0aa302367d5e99e379a961c1bc8cf89825da5525e3c8f14d7d8acca2fa9c133a2176ae69874d8b1d38b26b9c694e211018005a97b40848681b9dd38feb2de141626fb82591aad20dc629b2b6421cef1227809551a0e4e943ab99841939877f18f2d9c0addc93cf672e26b02ed94da3e6d329e8ac8f3736eebbf37bb1a21e5aadf04ee8e3b542f876aa88b2adf2608bd86329b7f7a56fd0dc1c40b48188731d11082aea360c62a0840c2db3dad7178fd7e359317ae081");
     }
 
-#if 0
-    // Set up the Zerocoin Params object
-    ZCParams = new libzerocoin::Params(bnTrustedModulus);
-#endif
-
     //
     // Load block index
     //
@@ -2965,6 +4968,10 @@ bool LoadBlockIndex(bool fAllowNew)
     if (!txdb.LoadBlockIndex())
         return false;
 
+    fAddrIndex = InitOptionalIndex(txdb, "addrindex");
+    fSpentIndex = InitOptionalIndex(txdb, "spentindex");
+    fBlockStatsIndex = InitOptionalIndex(txdb, "blockstatsindex");
+
     //
     // Init with genesis block
     //
@@ -3082,7 +5089,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3152,66 +5159,6 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
-{
-    int64_t nStart = GetTimeMillis();
-
-    int nLoaded = 0;
-    {
-        LOCK(cs_main);
-        try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good() && !fRequestShutdown)
-            {
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
-                        break;
-                    }
-                    void* nFind = memchr(pchData, pchMessageStart[0], nRead+1-sizeof(pchMessageStart));
-                    if (nFind)
-                    {
-                        if (memcmp(nFind, pchMessageStart, sizeof(pchMessageStart))==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + sizeof(pchMessageStart);
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
-                    }
-                    else
-                        nPos += sizeof(pchData) - sizeof(pchMessageStart) + 1;
-                } while(!fRequestShutdown);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
-                {
-                    CBlock block;
-                    blkdat >> block;
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
-                }
-            }
-        }
-        catch (std::exception &e) {
-            printf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
-        }
-    }
-    printf("Loaded %i blocks from external file in %"PRId64"ms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
-}
-
 //////////////////////////////////////////////////////////////////////////////
 //
 // CAlert
@@ -3236,85 +5183,463 @@ string GetWarnings(string strFor)
         strStatusBar = strMiscWarning;
     }
 
-    // if detected invalid checkpoint enter safe mode
-    if (Checkpoints::hashInvalidCheckpoint != 0)
-    {
-        nPriority = 3000;
-        strStatusBar = strRPC = _("WARNING: Invalid checkpoint found! Displayed transactions may not be correct! You may need to upgrade, or notify developers.");
+    // if detected invalid checkpoint enter safe mode
+    if (Checkpoints::hashInvalidCheckpoint != 0)
+    {
+        nPriority = 3000;
+        strStatusBar = strRPC = _("WARNING: Invalid checkpoint found! Displayed transactions may not be correct! You may need to upgrade, or notify developers.");
+    }
+
+    // Alerts
+    {
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+        {
+            const CAlert& alert = item.second;
+            if (alert.AppliesToMe() && alert.nPriority > nPriority)
+            {
+                nPriority = alert.nPriority;
+                strStatusBar = alert.strStatusBar;
+                if (nPriority > 1000)
+                    strRPC = strStatusBar;
+            }
+        }
+    }
+
+    if (strFor == "statusbar")
+        return strStatusBar;
+    else if (strFor == "rpc")
+        return strRPC;
+    assert(!"GetWarnings() : invalid parameter");
+    return "error";
+}
+
+
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Messages
+//
+
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+        bool txInMap = false;
+        txInMap = mempool.exists(inv.hash);
+        return txInMap ||
+               mapOrphanTransactions.count(inv.hash) ||
+               txdb.ContainsTx(inv.hash);
+        }
+
+    case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
+        return mapBlockIndex.count(inv.hash) ||
+               mapOrphanBlocks.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+
+
+
+// The message start string is designed to be unlikely to occur in normal data.
+// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
+// a large 4-byte int at any alignment.
+unsigned char pchMessageStart[4] = { 0xfe, 0xc3, 0xba, 0xde };
+
+// Context-free checks of a block from the network, done by ProcessMessages()
+// before it takes cs_main. Blocks we already have aren't worth the work.
+void static PreCheckBlock(CBlock& block)
+{
+    {
+        READ_LOCK(cs_chainstate);
+        if (mapBlockIndex.count(block.GetHash()))
+            return;
+    }
+
+    if (block.CheckBlock())
+    {
+        block.fChecked = true;
+        return;
+    }
+
+    // ProcessBlock() repeats the checks, and scores the peer for them
+    block.nDoS = 0;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        tx.nDoS = 0;
+}
+
+// The signature of a checkpoint or alert, checked on a copy of the
+// message so that ProcessMessage() still reads it whole. The outcome is
+// cached by the message's own CheckSignature().
+void static PreCheckSignedMessage(const string& strCommand, const CDataStream& vRecv)
+{
+    CDataStream vPeek(vRecv);
+    if (strCommand == "checkpoint")
+    {
+        CSyncCheckpoint checkpoint;
+        vPeek >> checkpoint;
+        checkpoint.CheckSignature();
+    }
+    else
+    {
+        CAlert alert;
+        vPeek >> alert;
+        if (CAlert::getAlertByHash(alert.GetHash()).IsNull())
+            alert.CheckSignature();
+    }
+}
+
+// Fast peers get a new block as soon as it passes CheckBlock(), which for
+// proof-of-stake covers the block signature, ahead of it being connected
+void static RelayToFastPeers(CNode* pfrom, const CBlock& block)
+{
+    if (!block.fChecked || !HaveFastPeers())
+        return;
+
+    uint256 hash = block.GetHash();
+    {
+        READ_LOCK(cs_chainstate);
+        if (mapBlockIndex.count(hash) || !mapBlockIndex.count(block.hashPrevBlock))
+            return;
+    }
+
+    CInv inv(MSG_BLOCK, hash);
+    pfrom->AddInventoryKnown(inv);
+    CNetMessageRef msg;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (!pnode->fFastPeer || pnode == pfrom || pnode->nVersion == 0 || pnode->fDisconnect)
+            continue;
+        {
+            LOCK(pnode->cs_inventory);
+            if (!pnode->filterInventoryKnown.insert(inv))
+                continue;
+        }
+        if (!msg)
+            msg = MakeNetMessage("block", block);
+        pnode->PushNetMessage(msg);
+    }
+}
+
+// A whole block from pfrom, sent as is or rebuilt from a compact block
+// Recently served "block" messages, least recently used first. A new block
+// is asked for by most peers within seconds, so they share one read from
+// disk and one serialization.
+uint64_t nBlockMessageCacheSize = DEFAULT_BLOCK_MESSAGE_CACHE_MB * 1000000;
+static list<uint256> listBlockMessages;
+static map<uint256, pair<CNetMessageRef, list<uint256>::iterator> > mapBlockMessages;
+static uint64_t nBlockMessageBytes = 0;
+static uint64_t nBlockMessageHits = 0;
+static uint64_t nBlockMessageMisses = 0;
+
+// requires LOCK(cs_main)
+static void AddBlockMessage(const uint256& hash, const CNetMessageRef& msg)
+{
+    if (mapBlockMessages.count(hash) || msg->size() > nBlockMessageCacheSize)
+        return;
+    while (nBlockMessageBytes + msg->size() > nBlockMessageCacheSize)
+    {
+        map<uint256, pair<CNetMessageRef, list<uint256>::iterator> >::iterator mi = mapBlockMessages.find(listBlockMessages.front());
+        nBlockMessageBytes -= (*mi).second.first->size();
+        mapBlockMessages.erase(mi);
+        listBlockMessages.pop_front();
+    }
+    list<uint256>::iterator it = listBlockMessages.insert(listBlockMessages.end(), hash);
+    mapBlockMessages.insert(make_pair(hash, make_pair(msg, it)));
+    nBlockMessageBytes += msg->size();
+}
+
+// requires LOCK(cs_main)
+static CNetMessageRef GetBlockMessage(CBlockIndex* pindex)
+{
+    uint256 hash = pindex->GetBlockHash();
+    map<uint256, pair<CNetMessageRef, list<uint256>::iterator> >::iterator mi = mapBlockMessages.find(hash);
+    if (mi != mapBlockMessages.end())
+    {
+        nBlockMessageHits++;
+        listBlockMessages.splice(listBlockMessages.end(), listBlockMessages, (*mi).second.second);
+        return (*mi).second.first;
+    }
+
+    nBlockMessageMisses++;
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return CNetMessageRef();
+    CNetMessageRef msg = MakeNetMessage("block", block);
+    AddBlockMessage(hash, msg);
+    return msg;
+}
+
+void GetBlockMessageCacheStats(unsigned int& nCountRet, uint64_t& nBytesRet, uint64_t& nHitsRet, uint64_t& nMissesRet)
+{
+    LOCK(cs_main);
+    nCountRet = mapBlockMessages.size();
+    nBytesRet = nBlockMessageBytes;
+    nHitsRet = nBlockMessageHits;
+    nMissesRet = nBlockMessageMisses;
+}
+
+void static ProcessReceivedBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+
+    HeadersSyncBlockReceived(pfrom, hashBlock);
+    if (ProcessBlock(pfrom, &block))
+    {
+        pfrom->nLastBlockTime = GetTime();
+        mapAlreadyAskedFor.erase(inv);
+        mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hashBlock));
+
+        // A new tip is about to be asked for by everyone we announce it to
+        if (!IsInitialBlockDownload() && pindexBest->GetBlockHash() == hashBlock)
+            AddBlockMessage(hashBlock, MakeNetMessage("block", block));
+    }
+    HeadersSyncBlockProcessed(hashBlock);
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
+
+/** Accept transactions relayed by pfrom, then the orphans that were waiting
+ *  for them a generation at a time */
+static void ProcessTransactions(CNode* pfrom, vector<CTransaction>& vtx)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    vector<bool> vAccepted;
+    vector<bool> vMissingInputs;
+
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+        pfrom->AddInventoryKnown(CInv(MSG_TX, tx.GetHash()));
+
+    // Accepted transactions go out together, one pass over the peers per generation
+    vector<CTransaction> vRelay;
+
+    AcceptToMemoryPoolBatch(mempool, vtx, vAccepted, vMissingInputs);
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        const CTransaction& tx = vtx[i];
+        uint256 hash = tx.GetHash();
+        if (vAccepted[i])
+        {
+            SyncWithWallets(tx, NULL, true);
+            vRelay.push_back(tx);
+            pfrom->nLastTXTime = GetTime();
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, hash));
+            vWorkQueue.push_back(hash);
+            vEraseQueue.push_back(hash);
+        }
+        else if (vMissingInputs[i])
+        {
+            AddOrphanTx(tx, pfrom->id);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, MAX_ORPHAN_TX_BYTES);
+            if (nEvicted > 0)
+                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        }
+        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+    }
+    RelayTransactions(vRelay);
+
+    while (!vWorkQueue.empty())
+    {
+        vRelay.clear();
+        vector<CTransaction> vOrphans;
+        set<uint256> setSeen;
+        BOOST_FOREACH(const uint256& hashPrev, vWorkQueue)
+        {
+            boost::unordered_map<uint256, set<uint256>, SaltedTxidHasher>::const_iterator mi = mapOrphanTransactionsByPrev.find(hashPrev);
+            if (mi == mapOrphanTransactionsByPrev.end())
+                continue;
+            BOOST_FOREACH(const uint256& orphanTxHash, mi->second)
+                if (setSeen.insert(orphanTxHash).second)
+                    vOrphans.push_back(mapOrphanTransactions[orphanTxHash].tx);
+        }
+        vWorkQueue.clear();
+
+        AcceptToMemoryPoolBatch(mempool, vOrphans, vAccepted, vMissingInputs);
+        for (unsigned int i = 0; i < vOrphans.size(); i++)
+        {
+            const CTransaction& orphanTx = vOrphans[i];
+            uint256 orphanTxHash = orphanTx.GetHash();
+            if (vAccepted[i])
+            {
+                printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+                SyncWithWallets(orphanTx, NULL, true);
+                vRelay.push_back(orphanTx);
+                mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
+                vWorkQueue.push_back(orphanTxHash);
+                vEraseQueue.push_back(orphanTxHash);
+            }
+            else if (!vMissingInputs[i])
+            {
+                // invalid orphan
+                vEraseQueue.push_back(orphanTxHash);
+                printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
+            }
+        }
+        RelayTransactions(vRelay);
+    }
+
+    BOOST_FOREACH(uint256 hash, vEraseQueue)
+        EraseOrphanTx(hash);
+}
+
+// Blocks this deep in the main chain are historical: fetched by peers
+// catching up, which can wait behind relay of the tip to everyone
+static const int GETDATA_RECENT_DEPTH = 16;
+// Bytes of historical blocks sent to a peer per message handler pass
+static const unsigned int GETDATA_HISTORICAL_BUDGET = 1000000;
+
+static bool IsHistoricalGetData(const CInv& inv)
+{
+    if (inv.type != MSG_BLOCK && inv.type != MSG_CMPCT_BLOCK && inv.type != MSG_FILTERED_BLOCK)
+        return false;
+    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+    if (mi == mapBlockIndex.end())
+        return false;
+    return (*mi).second->IsInMainChain() && nBestHeight - (*mi).second->nHeight >= GETDATA_RECENT_DEPTH;
+}
+
+// Send what inv asks for, adding the bytes of full blocks sent to nBytes.
+// False if the peer is being disconnected for it. Needs cs_main.
+static bool ServeGetData(CNode* pfrom, const CInv& inv, unsigned int& nBytes)
+{
+    if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+    {
+        // Send block from disk
+        BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+        if (mi != mapBlockIndex.end())
+        {
+            // Past -maxuploadtarget's share for old blocks, a peer
+            // catching up is better off syncing from someone else
+            if (!pfrom->fFastPeer &&
+                pindexBest->GetBlockTime() - (*mi).second->GetBlockTime() > HISTORICAL_BLOCK_AGE &&
+                OutboundTargetReached(true))
+            {
+                printf("historical block serving limit reached, disconnect peer %s\n", pfrom->addr.ToString().c_str());
+                pfrom->fDisconnect = true;
+                return false;
+            }
+
+            if (inv.type == MSG_CMPCT_BLOCK)
+            {
+                CBlock block;
+                if (!block.ReadFromDisk((*mi).second))
+                    return true; // pruned, we don't have it any more
+                SendCompactBlock(pfrom, block);
+            }
+            else if (inv.type == MSG_FILTERED_BLOCK)
+            {
+                CBlock block;
+                if (!block.ReadFromDisk((*mi).second))
+                    return true; // pruned, we don't have it any more
+                LOCK(pfrom->cs_filter);
+                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                pfrom->PushMessage("merkleblock", merkleBlock);
+                // CMerkleBlock only has the txids; send the matched
+                // transactions the peer hasn't seen yet right after
+                // it, which the peer expects in this order
+                typedef pair<unsigned int, uint256> PairType;
+                BOOST_FOREACH(const PairType& pair, merkleBlock.vMatchedTxn)
+                {
+                    bool fKnown;
+                    {
+                        LOCK(pfrom->cs_inventory);
+                        fKnown = pfrom->filterInventoryKnown.contains(CInv(MSG_TX, pair.second));
+                    }
+                    if (!fKnown)
+                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                }
+            }
+            else
+            {
+                CNetMessageRef msg = GetBlockMessage((*mi).second);
+                if (!msg)
+                    return true; // pruned, we don't have it any more
+                pfrom->PushNetMessage(msg);
+                nBytes += msg->size();
+            }
+
+            // Trigger them to send a getblocks request for the next batch of inventory
+            if (inv.hash == pfrom->hashContinue)
+            {
+                // ppcoin: send latest proof-of-work block to allow the
+                // download node to accept as orphan (proof-of-stake
+                // block might be rejected by stake connection check)
+                vector<CInv> vInv;
+                vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
+                pfrom->PushMessage("inv", vInv);
+                pfrom->hashContinue = 0;
+            }
+        }
     }
-
-    // Alerts
+    else if (inv.IsKnownType())
     {
-        LOCK(cs_mapAlerts);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+        // Send stream from relay memory
+        bool pushed = false;
         {
-            const CAlert& alert = item.second;
-            if (alert.AppliesToMe() && alert.nPriority > nPriority)
-            {
-                nPriority = alert.nPriority;
-                strStatusBar = alert.strStatusBar;
-                if (nPriority > 1000)
-                    strRPC = strStatusBar;
+            LOCK(cs_mapRelay);
+            map<CInv, CNetMessageRef>::iterator mi = mapRelay.find(inv);
+            if (mi != mapRelay.end()) {
+                pfrom->PushNetMessage((*mi).second);
+                pushed = true;
+            }
+        }
+        if (!pushed && inv.type == MSG_TX) {
+            CTransactionRef ptx = mempool.get(inv.hash);
+            if (ptx) {
+                CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+                ss.reserve(1000);
+                ss << *ptx;
+                pfrom->PushMessage("tx", ss);
             }
         }
     }
 
-    if (strFor == "statusbar")
-        return strStatusBar;
-    else if (strFor == "rpc")
-        return strRPC;
-    assert(!"GetWarnings() : invalid parameter");
-    return "error";
-}
-
-
-
-
-
-
-
-
-//////////////////////////////////////////////////////////////////////////////
-//
-// Messages
-//
 
+    // Track requests for our stuff
+    Inventory(inv.hash);
+    return true;
+}
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+// Send what pfrom has queued, from its first historical block on,
+// GETDATA_HISTORICAL_BUDGET bytes of it or until its send buffer fills.
+// Needs cs_main.
+static void ProcessGetData(CNode* pfrom)
 {
-    switch (inv.type)
+    unsigned int nBytes = 0;
+    while (!pfrom->vRecvGetData.empty() && !fShutdown &&
+           nBytes < GETDATA_HISTORICAL_BUDGET && pfrom->nSendSize < SendBufferSize())
     {
-    case MSG_TX:
+        CInv inv = pfrom->vRecvGetData.front();
+        pfrom->vRecvGetData.pop_front();
+        if (!ServeGetData(pfrom, inv, nBytes))
         {
-        bool txInMap = false;
-        txInMap = mempool.exists(inv.hash);
-        return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
-               txdb.ContainsTx(inv.hash);
+            pfrom->vRecvGetData.clear();
+            break;
         }
-
-    case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
     }
-    // Don't know what it is, just say we already got one
-    return true;
 }
 
-
-
-
-// The message start string is designed to be unlikely to occur in normal data.
-// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
-// a large 4-byte int at any alignment.
-unsigned char pchMessageStart[4] = { 0xfe, 0xc3, 0xba, 0xde };
-
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, CBlock* pblockRecv)
 {
     static map<CService, CPubKey> mapReuseKey;
     RandAddSeedPerfmon();
-    if (fDebug)
-        printf("received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
+    LogPrint("net", "received: %s (%"PRIszu" bytes)\n", strCommand.c_str(), vRecv.size());
     if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
         printf("dropmessagestest DROPPING RECV MESSAGE\n");
@@ -3351,6 +5676,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             vRecv >> pfrom->strSubVer;
         if (!vRecv.empty())
             vRecv >> pfrom->nStartingHeight;
+        {
+            LOCK(pfrom->cs_filter);
+            if (!vRecv.empty())
+                vRecv >> pfrom->fRelayTxes; // set to true after we get the first filter* message
+            else
+                pfrom->fRelayTxes = true;
+        }
 
         if (pfrom->fInbound && addrMe.IsRoutable())
         {
@@ -3375,6 +5707,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->PushVersion();
 
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+        {
+            LOCK(pfrom->cs_vSend);
+            pfrom->fCompress = (pfrom->nServices & NODE_COMPRESS) && (nLocalServices & NODE_COMPRESS);
+        }
 
         if (GetBoolArg("-synctime", true))
             AddTimeData(pfrom->addr, nTime);
@@ -3417,7 +5753,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
              (nAskedForBlocks < 1 || vNodes.size() <= 1))
         {
             nAskedForBlocks++;
-            pfrom->PushGetBlocks(pindexBest, uint256(0));
+            if (!StartHeadersSync(pfrom))
+                pfrom->PushGetBlocks(pindexBest, uint256(0));
         }
 
         // Relay alerts
@@ -3554,13 +5891,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pfrom->AddInventoryKnown(inv);
 
             bool fAlreadyHave = AlreadyHave(txdb, inv);
-            if (fDebug)
-                printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
-
-            if (!fAlreadyHave)
-                pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+            LogPrint("net", "  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+
+            if (inv.type == MSG_BLOCK && IsHeadersSyncActive() && IsHeaderChainBlock(inv.hash)) {
+                // Blocks on the header chain come through the download window
+            } else if (!fAlreadyHave) {
+                // A block off the header chain means the peer knows more
+                // headers; it is asked for all the same, in case the header
+                // chain we have never delivers
+                if (inv.type == MSG_BLOCK && IsHeadersSyncActive())
+                    HeadersSyncBlockAnnounced(pfrom, inv.hash);
+                if (inv.type == MSG_BLOCK && CanRequestCompactBlock(pfrom))
+                    pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    pfrom->AskFor(inv);
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks.find(inv.hash))->first);
             } else if (nInv == nLastBlock) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
@@ -3589,6 +5935,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (fDebugNet || (vInv.size() != 1))
             printf("received getdata (%"PRIszu" invsz)\n", vInv.size());
 
+        // The blocks asked for are read one after another below
+        if (vInv.size() > 1)
+        {
+            vector<CBlockIndex*> vPrefetch;
+            BOOST_FOREACH(const CInv& inv, vInv)
+            {
+                if (inv.type != MSG_BLOCK && inv.type != MSG_CMPCT_BLOCK && inv.type != MSG_FILTERED_BLOCK)
+                    continue;
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                if (mi != mapBlockIndex.end())
+                    vPrefetch.push_back((*mi).second);
+            }
+            if (vPrefetch.size() > 1)
+                PrefetchBlocks(vPrefetch, 0, vPrefetch.size());
+        }
+
+        // Transactions and recent blocks go out now, unless something is
+        // queued already: from the first historical block on, every item
+        // joins the peer's queue, so replies keep the order asked for
         BOOST_FOREACH(const CInv& inv, vInv)
         {
             if (fShutdown)
@@ -3596,55 +5961,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebugNet || (vInv.size() == 1))
                 printf("received getdata for: %s\n", inv.ToString().c_str());
 
-            if (inv.type == MSG_BLOCK)
-            {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
-                {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
-
-                    // Trigger them to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
-                    {
-                        // ppcoin: send latest proof-of-work block to allow the
-                        // download node to accept as orphan (proof-of-stake
-                        // block might be rejected by stake connection check)
-                        vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, GetLastBlockIndex(pindexBest, false)->GetBlockHash()));
-                        pfrom->PushMessage("inv", vInv);
-                        pfrom->hashContinue = 0;
-                    }
-                }
-            }
-            else if (inv.IsKnownType())
+            if (!pfrom->vRecvGetData.empty() || IsHistoricalGetData(inv))
+                pfrom->vRecvGetData.push_back(inv);
+            else
             {
-                // Send stream from relay memory
-                bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
-                    }
-                }
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                    }
-                }
+                unsigned int nBytes = 0;
+                if (!ServeGetData(pfrom, inv, nBytes))
+                    break;
             }
-
-            // Track requests for our stuff
-            Inventory(inv.hash);
         }
+        ProcessGetData(pfrom);
     }
 
 
@@ -3662,26 +5988,41 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             pindex = pindex->pnext;
         int nLimit = 500;
         printf("getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str(), nLimit);
-        for (; pindex; pindex = pindex->pnext)
+        if (!pindex)
+            return true;
+
+        // The rest of the chain by height, up to the stop block if it's
+        // one of them
+        int nLast = min(nBestHeight, pindex->nHeight + nLimit - 1);
+        CBlockIndex* pindexStop = NULL;
+        BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi != mapBlockIndex.end() && (*mi).second->nHeight >= pindex->nHeight && (*mi).second->nHeight <= nLast &&
+            FindBlockByHeight((*mi).second->nHeight) == (*mi).second)
         {
-            if (pindex->GetBlockHash() == hashStop)
-            {
-                printf("  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
-                // ppcoin: tell downloading node about the latest block if it's
-                // without risk being rejected due to stake connection check
-                if (hashStop != hashBestChain && pindex->GetBlockTime() + nStakeMinAge > pindexBest->GetBlockTime())
-                    pfrom->PushInventory(CInv(MSG_BLOCK, hashBestChain));
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0)
-            {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                printf("  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString().substr(0,20).c_str());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
-            }
+            pindexStop = (*mi).second;
+            nLast = pindexStop->nHeight - 1;
+        }
+
+        vector<CInv> vInv;
+        vInv.reserve(max(0, nLast - pindex->nHeight + 1));
+        for (int nHeight = pindex->nHeight; nHeight <= nLast; nHeight++)
+            vInv.push_back(CInv(MSG_BLOCK, vChainActive[nHeight]->GetBlockHash()));
+        pfrom->PushInventory(vInv);
+
+        if (pindexStop)
+        {
+            printf("  getblocks stopping at %d %s\n", pindexStop->nHeight, hashStop.ToString().substr(0,20).c_str());
+            // ppcoin: tell downloading node about the latest block if it's
+            // without risk being rejected due to stake connection check
+            if (hashStop != hashBestChain && pindexStop->GetBlockTime() + nStakeMinAge > pindexBest->GetBlockTime())
+                pfrom->PushInventory(CInv(MSG_BLOCK, hashBestChain));
+        }
+        else if ((int)vInv.size() == nLimit)
+        {
+            // When this block is requested, we'll send an inv that'll make them
+            // getblocks the next batch of inventory.
+            printf("  getblocks stopping at limit %d %s\n", nLast, vInv.back().hash.ToString().substr(0,20).c_str());
+            pfrom->hashContinue = vInv.back().hash;
         }
     }
     else if (strCommand == "checkpoint")
@@ -3709,7 +6050,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3722,9 +6063,26 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 pindex = pindex->pnext;
         }
 
-        vector<CBlock> vHeaders;
         int nLimit = 2000;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().substr(0,20).c_str());
+        if (pindex && FindBlockByHeight(pindex->nHeight) == pindex)
+        {
+            // On the active chain, answered straight from the header cache
+            int nLast = min(nBestHeight, pindex->nHeight + nLimit - 1);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
+            if (mi != mapBlockIndex.end() && (*mi).second->nHeight >= pindex->nHeight && (*mi).second->nHeight < nLast &&
+                FindBlockByHeight((*mi).second->nHeight) == (*mi).second)
+                nLast = (*mi).second->nHeight;
+
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss << CMessageHeader("headers", 0);
+            WriteCompactSize(ss, nLast - pindex->nHeight + 1);
+            WriteCachedHeaders(ss, pindex->nHeight, nLast);
+            pfrom->PushNetMessage(FinalizeNetMessage(ss));
+            return true;
+        }
+
+        vector<CBlock> vHeaders;
         for (; pindex; pindex = pindex->pnext)
         {
             vHeaders.push_back(pindex->GetBlockHeader());
@@ -3735,86 +6093,66 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        ProcessHeaders(pfrom, vHeaders);
+    }
+
+
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        vector<CTransaction> vtx(1);
+        vRecv >> vtx[0];
+        ProcessTransactions(pfrom, vtx);
+    }
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
 
-        bool fMissingInputs = false;
-        if (AcceptToMemoryPool(mempool, tx, &fMissingInputs))
-        {
-            SyncWithWallets(tx, NULL, true);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+    else if (strCommand == "block")
+    {
+        // Deserialized and pre-checked by ProcessMessages()
+        CBlock& block = *pblockRecv;
+        printf("received block %s\n", block.GetHash().ToString().substr(0,20).c_str());
+        // block.print();
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                uint256 hashPrev = vWorkQueue[i];
-                for (set<uint256>::iterator mi = mapOrphanTransactionsByPrev[hashPrev].begin();
-                     mi != mapOrphanTransactionsByPrev[hashPrev].end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
+        ProcessReceivedBlock(pfrom, block);
+    }
 
-                    if (AcceptToMemoryPool(mempool, orphanTx, &fMissingInputs2))
-                    {
-                        printf("   accepted orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                        SyncWithWallets(tx, NULL, true);
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanTxHash));
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        printf("   removed invalid orphan tx %s\n", orphanTxHash.ToString().substr(0,10).c_str());
-                    }
-                }
-            }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
+    else if (strCommand == "cmpctblock")
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                printf("mapOrphan overflow, removed %u tx\n", nEvicted);
+        CBlock block;
+        if (ProcessCompactBlock(pfrom, cmpctblock, block))
+        {
+            printf("received block %s (compact)\n", block.GetHash().ToString().substr(0,20).c_str());
+            ProcessReceivedBlock(pfrom, block);
         }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
     }
 
 
-    else if (strCommand == "block")
+    else if (strCommand == "getblocktxn")
     {
-        CBlock block;
-        vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+        ProcessGetBlockTransactions(pfrom, req);
+    }
 
-        printf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
-        // block.print();
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions blocktxn;
+        vRecv >> blocktxn;
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        CBlock block;
+        if (ProcessBlockTransactions(pfrom, blocktxn, block))
+        {
+            printf("received block %s (compact, %"PRIszu" transactions fetched)\n", block.GetHash().ToString().substr(0,20).c_str(), blocktxn.vtx.size());
+            ProcessReceivedBlock(pfrom, block);
+        }
     }
 
 
@@ -3835,10 +6173,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         std::vector<uint256> vtxid;
         mempool.queryHashes(vtxid);
         vector<CInv> vInv;
+        LOCK(pfrom->cs_filter);
         for (unsigned int i = 0; i < vtxid.size(); i++) {
+            CTransactionRef ptx = mempool.get(vtxid[i]);
+            if (!ptx)
+                continue;
+            if (!pfrom->pfilter->IsRelevantAndUpdate(*ptx, vtxid[i]))
+                continue;
             CInv inv(MSG_TX, vtxid[i]);
             vInv.push_back(inv);
-            if (i == (MAX_INV_SZ - 1))
+            if (vInv.size() == MAX_INV_SZ)
                     break;
         }
         if (vInv.size() > 0)
@@ -3846,6 +6190,62 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (!(nLocalServices & NODE_BLOOM) &&
+             (strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear"))
+    {
+        // -peerbloomfilters=0: we never offered this
+        pfrom->Misbehaving(100);
+        return false;
+    }
+
+
+    else if (strCommand == "filterload")
+    {
+        CBloomFilter filter;
+        vRecv >> filter;
+
+        if (!filter.IsWithinSizeConstraints())
+            // There is no excuse for sending a too-large filter
+            pfrom->Misbehaving(100);
+        else
+        {
+            LOCK(pfrom->cs_filter);
+            delete pfrom->pfilter;
+            pfrom->pfilter = new CBloomFilter(filter);
+            pfrom->pfilter->UpdateEmptyFull();
+        }
+        pfrom->fRelayTxes = true;
+    }
+
+
+    else if (strCommand == "filteradd")
+    {
+        vector<unsigned char> vData;
+        vRecv >> vData;
+
+        // Nodes must NEVER send a data item > MAX_FILTERADD_SIZE bytes (the
+        // max size for a script data object), as it would be useless
+        if (vData.size() > MAX_FILTERADD_SIZE)
+        {
+            pfrom->Misbehaving(100);
+        }
+        else
+        {
+            LOCK(pfrom->cs_filter);
+            pfrom->pfilter->insert(vData);
+        }
+    }
+
+
+    else if (strCommand == "filterclear")
+    {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter();
+        pfrom->fRelayTxes = true;
+    }
+
+
     else if (strCommand == "checkorder")
     {
         uint256 hashReply;
@@ -3915,13 +6315,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "pong")
+    {
+        uint64_t nonce = 0;
+        vRecv >> nonce;
+        if (nonce != 0 && nonce == pfrom->nPingNonceSent)
+        {
+            int64_t nPingUsecTime = GetTimeMicros() - pfrom->nPingUsecStart;
+            if (nPingUsecTime >= 0)
+            {
+                pfrom->nPingUsecTime = nPingUsecTime;
+                pfrom->nMinPingUsecTime = min(pfrom->nMinPingUsecTime, nPingUsecTime);
+            }
+            pfrom->nPingNonceSent = 0;
+        }
+    }
+
+
     else if (strCommand == "alert")
     {
         CAlert alert;
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        // Already taken in from another peer, which relayed it on
+        if (pfrom->setKnown.count(alertHash) == 0 && !CAlert::getAlertByHash(alertHash).IsNull())
+            pfrom->setKnown.insert(alertHash);
+        else if (pfrom->setKnown.count(alertHash) == 0)
         {
             if (alert.ProcessAlert())
             {
@@ -3976,12 +6396,24 @@ bool ProcessMessages(CNode* pfrom)
     //  (x) data
     //
     bool fOk = true;
+    // A run of "tx" messages, deserialized and checked without cs_main
+    vector<CTransaction> vtxBatch;
+
+    // Items still owed from earlier getdata
+    if (!pfrom->vRecvGetData.empty())
+    {
+        LOCK(cs_main);
+        ProcessGetData(pfrom);
+    }
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
             break;
+        // Nor while a backlog of getdata is still being worked off
+        if (pfrom->vRecvGetData.size() >= MAX_INV_SZ)
+            break;
 
         // get next message
         CNetMessage& msg = *it;
@@ -4017,9 +6449,9 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, hashed as the data came in
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        uint256 hash = msg.GetMessageHash();
         unsigned int nChecksum = 0;
         memcpy(&nChecksum, &hash, sizeof(nChecksum));
         if (nChecksum != hdr.nChecksum)
@@ -4033,9 +6465,68 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            if (strCommand == "compressed")
+            {
+                if (!pfrom->fCompress || !DecompressNetMessage(vRecv, strCommand))
+                {
+                    LOCK(cs_main);
+                    pfrom->Misbehaving(20);
+                    continue;
+                }
+                nMessageSize = vRecv.size();
+            }
+
+            CBlock block;
+            if (strCommand == "block" && pfrom->nVersion != 0)
+            {
+                vRecv >> block;
+                PreCheckBlock(block);
+                RelayToFastPeers(pfrom, block);
+            }
+            // Verify signed messages before taking cs_main; ProcessMessage
+            // then finds the outcome in their signature caches
+            if (strCommand == "checkpoint" || strCommand == "alert")
+                PreCheckSignedMessage(strCommand, vRecv);
+            if (strCommand == "tx" && pfrom->nVersion != 0)
+            {
+                CTransaction tx;
+                vRecv >> tx;
+                if (!tx.CheckTransaction())
+                {
+                    LOCK(cs_main);
+                    pfrom->Misbehaving(tx.nDoS);
+                    error("ProcessMessages() : CheckTransaction failed");
+                }
+                else
+                    vtxBatch.push_back(tx);
+
+                // Wait for the rest of the run
+                fRet = true;
+                if (it != pfrom->vRecvMsg.end() && it->complete() && it->hdr.GetCommand() == "tx" &&
+                    vtxBatch.size() < MAX_TX_BATCH_SIZE)
+                    continue;
+                vector<CTransaction> vtx;
+                vtx.swap(vtxBatch);
+                if (!vtx.empty())
+                {
+                    LOCK(cs_main);
+                    ProcessTransactions(pfrom, vtx);
+                }
+            }
+            else if (strCommand == "ping" && pfrom->nVersion > BIP0031_VERSION)
+            {
+                // Only touches pfrom, so it needn't wait behind other peers' blocks
+                uint64_t nonce = 0;
+                vRecv >> nonce;
+                pfrom->PushMessage("pong", nonce);
+                if (pfrom->fNetworkNode)
+                    AddressCurrentlyConnected(pfrom->addr);
+                fRet = true;
+            }
+            else
             {
                 LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vRecv);
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, &block);
             }
             if (fShutdown)
                 break;
@@ -4067,6 +6558,21 @@ bool ProcessMessages(CNode* pfrom)
             printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
     }
 
+    // The run was cut short by one of the breaks above
+    if (!vtxBatch.empty() && !fShutdown)
+    {
+        try
+        {
+            LOCK(cs_main);
+            ProcessTransactions(pfrom, vtxBatch);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ProcessMessages()");
+        }
+    }
+
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
@@ -4075,6 +6581,12 @@ bool ProcessMessages(CNode* pfrom)
 }
 
 
+void FinalizeNode(NodeId id)
+{
+    AssertLockHeld(cs_main);
+    CompactBlocksFinalizeNode(id);
+}
+
 bool SendMessages(CNode* pto, bool fSendTrickle)
 {
     TRY_LOCK(cs_main, lockMain);
@@ -4083,15 +6595,24 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
-        // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
-        // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
-            uint64_t nonce = 0;
-            if (pto->nVersion > BIP0031_VERSION)
+        // Ping with a nonce to time the round trip, which also keeps the
+        // connection alive; older peers only get the keep-alive
+        int64_t nNowUsec = GetTimeMicros();
+        if (pto->nVersion > BIP0031_VERSION)
+        {
+            if (pto->nPingNonceSent == 0 ? nNowUsec > pto->nPingUsecStart + PING_INTERVAL * 1000000LL
+                                         : nNowUsec > pto->nPingUsecStart + PING_TIMEOUT * 1000000LL)
+            {
+                uint64_t nonce = 0;
+                while (nonce == 0)
+                    nonce = GetRand(std::numeric_limits<uint64_t>::max());
+                pto->nPingNonceSent = nonce;
+                pto->nPingUsecStart = nNowUsec;
                 pto->PushMessage("ping", nonce);
-            else
-                pto->PushMessage("ping");
+            }
         }
+        else if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty())
+            pto->PushMessage("ping");
 
         // Resend wallet transactions that haven't gotten in a block yet
         ResendWalletTransactions();
@@ -4151,55 +6672,40 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
+            pto->TakeQueuedInventory();
+
+            // Transactions wait for the peer's next Poisson-timed flush,
+            // so their timing across peers doesn't give away where they
+            // came from; blocks go right away
+            int64_t nNow = GetTimeMicros();
+            bool fSendTxs = (nNow >= pto->nNextInvSend) || pto->fFastPeer;
+            if (fSendTxs)
+                pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL / 2);
+
+            vector<CInv> vInvWait;
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
+                if (inv.type == MSG_TX && !fSendTxs)
                 {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    // always trickle our own transactions
-                    if (!fTrickleWait)
-                    {
-                        __wx__Tx wtx;
-                        if (GetTransaction(inv.hash, wtx))
-                            if (wtx.fFromMe)
-                                fTrickleWait = true;
-                    }
-
-                    if (fTrickleWait)
-                    {
+                    if (!pto->filterInventoryKnown.contains(inv))
                         vInvWait.push_back(inv);
-                        continue;
-                    }
+                    continue;
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // returns true if wasn't already known
+                if (pto->filterInventoryKnown.insert(inv))
                 {
                     vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
+                    if (vInv.size() >= MAX_INV_SZ)
                     {
                         pto->PushMessage("inv", vInv);
                         vInv.clear();
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.swap(vInvWait);
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
@@ -4228,6 +6734,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        HeadersSyncSendMessages(pto, vGetData);
+        CompactBlocksSendMessages(pto);
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
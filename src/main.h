@@ -10,10 +10,14 @@
 #include "net.h"
 #include "script.h"
 #include "hashblock.h"
+#include "blockfile.h"
 #include "zerocoin/Zerocoin.h"
 
 #include <list>
 
+#include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
+
 
 class __wx__;
 class CBlock;
@@ -31,8 +35,39 @@ class CTxMemPool;
 
 #include "constants.h"
 
+/** Block hashes are already uniformly distributed, so their low 64 bits make
+ *  a good bucket index */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+/** Transaction ids are picked by whoever sends them, so their buckets are
+ *  keyed with a per-container secret that nobody can aim collisions at */
+class SaltedTxidHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedTxidHasher()
+    {
+        uint256 salt = GetRandHash();
+        k0 = salt.Get64(0);
+        k1 = salt.Get64(1);
+    }
+
+    size_t operator()(const uint256& hash) const { return SipHashUint256(k0, k1, hash); }
+};
+
 
 extern bool fReindex;
+extern bool fAddrIndex;
+extern bool fSpentIndex;
+extern bool fBlockStatsIndex;
+/** Scripts of this block and its ancestors are not verified (-assumevalid) */
+extern uint256 hashAssumeValid;
 
 static const int LAST_POW_BLOCK = 12815;
 
@@ -52,7 +87,16 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 0.6 * MAX_BLOCK_SIZE_GEN;
 /** The maximum allowed number of signature check operations in a block (network rule) */
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** The maximum number of orphan transactions kept in memory */
-static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+static const unsigned int MAX_ORPHAN_TRANSACTIONS = 10000;
+/** The most serialized bytes of orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_TX_BYTES = 5000000;
+/** The largest orphan transaction kept */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** How many orphans, and how many bytes of them, one peer may have us keep */
+static const unsigned int MAX_ORPHANS_PER_PEER = 100;
+static const unsigned int MAX_ORPHAN_BYTES_PER_PEER = 100 * MAX_ORPHAN_TX_SIZE;
+/** Seconds an orphan waits for its parents before it is dropped */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
@@ -60,6 +104,10 @@ static const int64_t MIN_TX_FEE = 10000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
 static const int64_t MIN_RELAY_TX_FEE = MIN_TX_FEE;
 static const int64_t S_MIN_TX_FEE = 100000;
+/** Inputs with nSequence at or below this let a higher fee replace their transaction in the memory pool */
+static const unsigned int MAX_RBF_SEQUENCE = 0xfffffffd;
+/** The most memory pool transactions one replacement may evict, descendants included */
+static const unsigned int MAX_REPLACEMENT_CANDIDATES = 100;
 /** No amount larger than this (in satoshi) is valid */
 static const int64_t MAX_MONEY = 22000000 * COIN;
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
@@ -87,12 +135,20 @@ inline unsigned int GetTargetSpacing(int nHeight) { return IsProtocolV2(nHeight)
 
 
 extern unsigned int nCoinCacheSize;
-extern libzerocoin::Params* ZCParams;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
+/** The main chain by height: vChainActive[nBestHeight] == pindexBest */
+extern std::vector<CBlockIndex*> vChainActive;
+/** Lets RPC readers look at mapBlockIndex, vChainActive, the pnext links and
+ *  the best chain globals without cs_main. Code changing them at runtime
+ *  holds cs_main and takes this exclusively; cs_main holders may read
+ *  without it. Loading happens before the RPC server starts and doesn't
+ *  take it. */
+extern CSharedCriticalSection cs_chainstate;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
+extern uint256 bnProofOfWorkLimit;
 extern unsigned int nStakeMinAge;
 extern unsigned int nStakeMaxAge;
 extern unsigned int nNodeLifespan;
@@ -103,6 +159,9 @@ extern uint256 nBestInvalidTrust;
 extern uint256 hashBestChain;
 extern CBlockIndex* pindexBest;
 extern unsigned int nTransactionsUpdated;
+// Notified under csBestBlock whenever the best block changes
+extern boost::mutex csBestBlock;
+extern boost::condition_variable cvBlockChange;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
 extern int64_t nLastCoinStakeSearchInterval;
@@ -111,7 +170,50 @@ extern int64_t nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<__wx__*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
-extern std::map<uint256, CBlock*> mapOrphanBlocks;
+
+/** What getinfo, getmininginfo, getstakinginfo and getdifficulty report
+ *  about the best block. Worked out once per new tip by SetBestChain and
+ *  never changed after, so readers share it without cs_main. */
+class CChainTipSummary
+{
+public:
+    int nHeight;
+    uint256 hashBlock;
+    int64_t nTime;
+    int nPowHeight;
+    double dDifficultyPoW;
+    double dDifficultyPoS;
+    double dNetMHashPS;
+    double dNetStakeWeight;
+    int64_t nBlockValue;
+    int64_t nStakeInterest;
+
+    CChainTipSummary()
+    {
+        nHeight = -1;
+        nTime = 0;
+        nPowHeight = 0;
+        dDifficultyPoW = 1.0;
+        dDifficultyPoS = 1.0;
+        dNetMHashPS = 0;
+        dNetStakeWeight = 0;
+        nBlockValue = 0;
+        nStakeInterest = 0;
+    }
+};
+typedef boost::shared_ptr<const CChainTipSummary> CChainTipSummaryRef;
+
+/** A block whose parent we don't have yet */
+struct COrphanBlock
+{
+    CBlock* pblock;
+    // First block of the orphan chain this one belongs to, as of the last
+    // lookup. Only a hint: an ancestor may have arrived or been evicted since.
+    uint256 hashRoot;
+    int64_t nTimeReceived;
+    unsigned int nSize;
+};
+extern std::map<uint256, COrphanBlock> mapOrphanBlocks;
 
 // Settings
 extern int64_t nTransactionFee;
@@ -125,9 +227,44 @@ extern int nStakeMinConfirmations;
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
 
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Default for -maxorphanblocksmb, the memory held by orphan blocks at most */
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_MB = 40;
+/** Orphan blocks are dropped after this many seconds without their parent */
+static const int64_t ORPHAN_BLOCK_EXPIRE_TIME = 20 * 60;
+extern uint64_t nMaxOrphanBlocksSize;
+/** Default for -servecachemb, recently served blocks kept serialized for getdata */
+static const unsigned int DEFAULT_BLOCK_MESSAGE_CACHE_MB = 16;
+extern uint64_t nBlockMessageCacheSize;
+/** Default for -maxmempool, the memory held by the transaction pool at most */
+static const unsigned int DEFAULT_MAX_MEMPOOL_MB = 300;
+/** The pool's minimum fee rate halves this often once it stops evicting */
+static const int64_t MEMPOOL_FEE_HALFLIFE = 12 * 60 * 60;
+extern uint64_t nMaxMempoolSize;
+extern int nScriptCheckThreads;
+
+/** Number of blocks below the tip whose block files are never pruned */
+static const int MIN_BLOCKS_TO_KEEP = 2880;
+/** Smallest -prune target accepted, in bytes */
+static const uint64_t MIN_PRUNE_TARGET = 256 * 1024 * 1024;
+/** Size at which a pruning node starts a new block file */
+static const unsigned int MAX_PRUNE_BLOCKFILE_SIZE = 64 * 1024 * 1024;
+/** Blocks a sequential reader asks to be prefetched at a time */
+static const unsigned int BLOCK_PREFETCH_COUNT = 64;
+/** Block files are given disk space in pieces of this size, ahead of the writes */
+static const unsigned int BLOCKFILE_CHUNK_SIZE = 16 * 1024 * 1024;
+/** Blocks between attempts to prune, and before a file found in use is looked at again */
+static const int PRUNE_CHECK_INTERVAL = 100;
+static const int PRUNE_RECHECK_DEPTH = 10000;
+/** Target total size of block files stored, 0 if not pruning (-prune) */
+extern uint64_t nPruneTarget;
+
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
+class CTxUndo;
 
 void RegisterWallet(__wx__* pwalletIn);
 void UnregisterWallet(__wx__* pwalletIn);
@@ -136,16 +273,49 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+/** During initial download block files are only flushed to the OS as blocks
+ *  are written. CommitBlockFiles syncs them to disk, and CTxDB::Flush calls
+ *  it before the index that points into them is written. */
+void MarkBlockFileUncommitted(unsigned int nFile);
+/** Prefetch the blocks vIndex[nBegin] to vIndex[nEnd-1], reading neighbours
+ *  in the same file as one range. For readers that go through the chain. */
+void PrefetchBlocks(const std::vector<CBlockIndex*>& vIndex, unsigned int nBegin, unsigned int nEnd);
+void CommitBlockFiles();
 bool LoadBlockIndex(bool fAllowNew=true);
+/** The Zerocoin parameters for this network, derived on first use */
+libzerocoin::Params* GetZCParams();
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
+bool IsAssumedValid(const CBlockIndex* pindex);
+void SetActiveChainTip(CBlockIndex* pindexTip);
+CBlockIndex* AllocBlockIndex();
+void CompactBlockIndex();
+void FreeBlockIndexes();
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
-bool LoadExternalBlockFile(FILE* fileIn);
+/** Drop what is kept about a peer that is being deleted; cs_main must be held */
+void FinalizeNode(NodeId id);
+void ThreadScriptCheck(void* parg);
+void ThreadBlockCheck(void* parg);
+void ThreadHeaderHash(void* parg);
+/** Fill the hash caches of a batch of headers, across the header hash
+ *  threads when there are enough of them to be worth handing out */
+void HashBlockHeaders(const std::vector<CBlock>& vHeaders);
+/** Remove the oldest block files nothing needs any more until the rest fit
+ *  in -prune, every PRUNE_CHECK_INTERVAL blocks */
+void PruneBlockFiles();
+void ThreadPruneBlockFiles(void* parg);
 
 int GetPowHeight(const CBlockIndex* pindex);
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake, int64_t nFees);
+/** The lowest target GetNextTargetRequired() can give a proof-of-stake block
+ *  at nHeight whose two predecessors were proof-of-stake, from their nBits
+ *  and times alone; 0 if there is no such bound. Lets a header's claimed
+ *  trust be checked before its block arrives. */
+uint256 GetHardestStakeTarget(int nHeight, unsigned int nBitsPrev, int64_t nTimePrev, int64_t nTimePrevPrev);
+/** Trust a block with this nBits adds to its chain */
+uint256 GetBlockTrust(unsigned int nBits);
 int64_t GetProofOfWorkReward(int64_t nPowHeight, int64_t nFees);
 int64_t GetProofOfStakeInterest(int nHeight);
 int64_t GetProofOfStakeReward(int64_t nCoinAge, int64_t nFees, int nHeight);
@@ -154,17 +324,72 @@ unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBl
 bool minBase(const CTxIndex& txindex, const CBlockIndex* pindexFrom, int nMaxDepth, int& nActualDepth);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+/** The summary of the current best block; first call during initial
+ *  download or at startup works it out under cs_main */
+CChainTipSummaryRef GetChainTipSummary();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool s=false);
-uint256 WantedByOrphan(const CBlock* pblockOrphan);
+uint256 WantedByOrphan(const uint256& hashOrphan);
+void GetOrphanBlockStats(unsigned int& nCountRet, uint64_t& nBytesRet);
+void GetBlockMessageCacheStats(unsigned int& nCountRet, uint64_t& nBytesRet, uint64_t& nHitsRet, uint64_t& nMissesRet);
+
+/** Stages of connecting blocks to the best chain that are timed separately */
+enum BlockConnectStage
+{
+    BENCH_CHECK_BLOCK,
+    BENCH_FETCH_INPUTS,
+    BENCH_CONNECT_INPUTS,
+    BENCH_CONNECT_ALIASES,
+    BENCH_SCRIPT_WAIT,
+    BENCH_WRITE_INDEX,
+    BENCH_CONNECT_BLOCK,
+    BENCH_DISCONNECT_BLOCK,
+    BENCH_COMMIT,
+    BENCH_SET_BEST_CHAIN,
+    BENCH_REORGANIZE,
+    BENCH_STAGES
+};
+
+/** Power-of-two microsecond buckets; the last one also takes anything slower */
+static const int BENCH_BUCKETS = 24;
+
+/** Cumulative timings for each stage, guarded by cs_main */
+struct CBlockConnectStats
+{
+    int64_t nCount[BENCH_STAGES];
+    int64_t nTotalMicros[BENCH_STAGES];
+    int64_t nMaxMicros[BENCH_STAGES];
+    int64_t nBuckets[BENCH_STAGES][BENCH_BUCKETS];
+
+    CBlockConnectStats();
+    void Add(BlockConnectStage stage, int64_t nMicros);
+};
+
+extern CBlockConnectStats blockConnectStats;
+const char* GetBlockConnectStageName(int stage);
+// DIONS transactions through ConnectInputsPost() and the time they took
+void GetAliasConnectStats(int64_t& nTxsRet, int64_t& nMicrosRet);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void StakeMiner(__wx__ *pwallet);
 void ResendWalletTransactions(bool fForce = false);
 
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; with pvChecks the script checks
+ *  are handed back instead of run and the transaction goes in regardless **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx,
-                        bool* pfMissingInputs);
+                        bool* pfMissingInputs, std::vector<CScriptCheck>* pvChecks = NULL);
+/** Write the memory pool to mempool.dat, parents before children */
+bool DumpMempool();
+/** Read mempool.dat back into the pool, revalidating every transaction */
+void ThreadLoadMempool(void* parg);
+/** Accept a run of transactions together, verifying their scripts on the
+ *  script check threads; vAccepted and vMissingInputs get one entry each */
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CTransaction>& vtx,
+                             std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs);
+/** Have ThreadRevalidateMempool accept vtx into the memory pool in batches,
+ *  parents must come before their children */
+void QueueMempoolRevalidation(const std::vector<CTransaction>& vtx);
+void ThreadRevalidateMempool(void* parg);
 
 
 
@@ -199,6 +424,55 @@ public:
     void SetNull() { nFile = (unsigned int) -1; nBlockPos = 0; nTxPos = 0; }
     bool IsNull() const { return (nFile == (unsigned int) -1); }
 
+    // Compact form used by CTxIndex: a type byte, then varints relative to
+    // a nearby position in the same file where possible
+    enum
+    {
+        POS_SAME_BLOCK = 0,
+        POS_SAME_FILE  = 1,
+        POS_ABSOLUTE   = 2,
+    };
+
+    template<typename Stream>
+    void WriteCompact(Stream& s, const CDiskTxPos& ref) const
+    {
+        unsigned char chType = POS_ABSOLUTE;
+        if (!ref.IsNull() && nFile == ref.nFile && nBlockPos >= ref.nBlockPos && nTxPos >= nBlockPos)
+            chType = (nBlockPos == ref.nBlockPos) ? POS_SAME_BLOCK : POS_SAME_FILE;
+        WRITEDATA(s, chType);
+        if (chType == POS_ABSOLUTE)
+        {
+            WriteVarInt(s, nFile);
+            WriteVarInt(s, nBlockPos);
+            WriteVarInt(s, nTxPos);
+            return;
+        }
+        if (chType == POS_SAME_FILE)
+            WriteVarInt(s, nBlockPos - ref.nBlockPos);
+        WriteVarInt(s, nTxPos - nBlockPos);
+    }
+
+    template<typename Stream>
+    void ReadCompact(Stream& s, const CDiskTxPos& ref)
+    {
+        unsigned char chType;
+        READDATA(s, chType);
+        if (chType == POS_ABSOLUTE)
+        {
+            nFile = ReadVarInt<Stream, unsigned int>(s);
+            nBlockPos = ReadVarInt<Stream, unsigned int>(s);
+            nTxPos = ReadVarInt<Stream, unsigned int>(s);
+            return;
+        }
+        if (chType != POS_SAME_BLOCK && chType != POS_SAME_FILE)
+            throw std::ios_base::failure("CDiskTxPos::ReadCompact() : unknown position type");
+        nFile = ref.nFile;
+        nBlockPos = ref.nBlockPos;
+        if (chType == POS_SAME_FILE)
+            nBlockPos += ReadVarInt<Stream, unsigned int>(s);
+        nTxPos = nBlockPos + ReadVarInt<Stream, unsigned int>(s);
+    }
+
     friend bool operator==(const CDiskTxPos& a, const CDiskTxPos& b)
     {
         return (a.nFile     == b.nFile &&
@@ -232,11 +506,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -285,6 +559,23 @@ public:
     }
 };
 
+/** SaltedTxidHasher for outpoints */
+class SaltedOutpointHasher
+{
+private:
+    uint64_t k0, k1;
+
+public:
+    SaltedOutpointHasher()
+    {
+        uint256 salt = GetRandHash();
+        k0 = salt.Get64(0);
+        k1 = salt.Get64(1);
+    }
+
+    size_t operator()(const COutPoint& outpoint) const { return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n); }
+};
+
 
 
 
@@ -469,6 +760,8 @@ enum GetMinFee_mode
 };
 
 typedef std::map<uint256, std::pair<CTxIndex, CTransaction> > MapPrevTx;
+/** A transaction that whoever shares it only reads */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
 
 /** The basic transaction that is broadcasted on the network and contained in
  * blocks.  A transaction can contain multiple inputs and outputs.
@@ -621,6 +914,18 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            try {
+                if (!ReadFromBlockFile(pos.nFile, pos.nTxPos, *this, SER_DISK, CLIENT_VERSION))
+                    return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -697,7 +1002,7 @@ public:
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout, CTxIndex& txindexRet);
     bool ReadFromDisk(CTxDB& txdb, COutPoint prevout);
     bool ReadFromDisk(COutPoint prevout);
-    bool DisconnectInputs(CTxDB& txdb);
+    bool DisconnectInputs(CTxDB& txdb, const CTxUndo* ptxundo = NULL);
 
     /** Fetch from memory and/or disk. inputsRet keys are transaction hashes.
 
@@ -721,12 +1026,15 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock       true if called from ConnectBlock
         @param[in] fMiner       true if called from CreateNewBlock
+        @param[out] pvChecks    if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
-    bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
+    bool ConnectInputs(CTxDB& txdb, const MapPrevTx& inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, CDiskTxPos& posThisTx,
-                       CBlockIndex* pindexBlock, bool fBlock, bool fMiner, int flags);
+                       CBlockIndex* pindexBlock, bool fBlock, bool fMiner, int flags,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
+    bool FetchUnspentInputs(CTxDB& txdb, const uint256& hashPrev, const CTxIndex& txindex, CTransaction& txPrev) const;
     bool GetCoinAge(CTxDB& txdb, uint64_t& nCoinAge) const;  // ppcoin: get tran
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 
@@ -741,6 +1049,40 @@ protected:
 bool IsStandardTx(const CTransaction& tx);
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
+/** Whether tx may be replaced in the memory pool by one paying more */
+bool SignalsOptInRBF(const CTransaction &tx);
+
+/** Closure representing one script verification.
+ *  Note that this stores references to the spending transaction. */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nFlags;
+    int nHashType;
+    // Shared by the checks of every input of ptxTo
+    boost::shared_ptr<const CSignatureHashCache> pcache;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTxOut& txoutFrom, const CTransaction& txToIn, unsigned int nInIn, int nFlagsIn, int nHashTypeIn,
+                 const boost::shared_ptr<const CSignatureHashCache>& pcacheIn = boost::shared_ptr<const CSignatureHashCache>()) :
+        scriptPubKey(txoutFrom.scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn), pcache(pcacheIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+        pcache.swap(check.pcache);
+    }
+};
 
 
 
@@ -834,13 +1176,94 @@ public:
         vSpent.resize(nOutputs);
     }
 
-    IMPLEMENT_SERIALIZE
-    (
+    // Records written with this bit set in their version field use the
+    // compact encoding: positions as varints relative to pos, and only the
+    // spent outputs stored, after a bitmap unless none or all are spent.
+    // Records without it hold a full CDiskTxPos per output and are still
+    // read, so the database migrates as entries get rewritten.
+    enum
+    {
+        TXINDEX_COMPACT = (1 << 30),
+    };
+
+    enum
+    {
+        SPENT_NONE   = 0,
+        SPENT_ALL    = 1,
+        SPENT_BITMAP = 2,
+    };
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CDataStream ss(nType, nVersion);
+        Serialize(ss, nType, nVersion);
+        return ss.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        if (nType & SER_GETHASH)
+        {
+            ::Serialize(s, pos, nType, nVersion);
+            ::Serialize(s, vSpent, nType, nVersion);
+            return;
+        }
+        int nStoredVersion = nVersion | TXINDEX_COMPACT;
+        ::Serialize(s, nStoredVersion, nType, nVersion);
+        pos.WriteCompact(s, CDiskTxPos());
+        WriteCompactSize(s, vSpent.size());
+
+        unsigned int nSpent = 0;
+        BOOST_FOREACH(const CDiskTxPos& posSpent, vSpent)
+            if (!posSpent.IsNull())
+                nSpent++;
+        unsigned char chMode = (nSpent == 0) ? SPENT_NONE : (nSpent == vSpent.size() ? SPENT_ALL : SPENT_BITMAP);
+        WRITEDATA(s, chMode);
+        if (chMode == SPENT_BITMAP)
+        {
+            std::vector<unsigned char> vBits((vSpent.size() + 7) / 8, 0);
+            for (unsigned int i = 0; i < vSpent.size(); i++)
+                if (!vSpent[i].IsNull())
+                    vBits[i / 8] |= (1 << (i % 8));
+            s.write((char*)&vBits[0], vBits.size());
+        }
+        BOOST_FOREACH(const CDiskTxPos& posSpent, vSpent)
+            if (!posSpent.IsNull())
+                posSpent.WriteCompact(s, pos);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
         if (!(nType & SER_GETHASH))
-            READWRITE(nVersion);
-        READWRITE(pos);
-        READWRITE(vSpent);
-    )
+            ::Unserialize(s, nVersion, nType, nVersion);
+        if ((nType & SER_GETHASH) || !(nVersion & TXINDEX_COMPACT))
+        {
+            ::Unserialize(s, pos, nType, nVersion);
+            ::Unserialize(s, vSpent, nType, nVersion);
+            return;
+        }
+        pos.ReadCompact(s, CDiskTxPos());
+        vSpent.assign(ReadCompactSize(s), CDiskTxPos());
+
+        unsigned char chMode;
+        READDATA(s, chMode);
+        std::vector<unsigned char> vBits;
+        if (chMode == SPENT_BITMAP)
+        {
+            vBits.resize((vSpent.size() + 7) / 8);
+            if (!vBits.empty())
+                s.read((char*)&vBits[0], vBits.size());
+        }
+        else if (chMode != SPENT_NONE && chMode != SPENT_ALL)
+            throw std::ios_base::failure("CTxIndex::Unserialize() : unknown spent encoding");
+        if (chMode == SPENT_NONE)
+            return;
+        for (unsigned int i = 0; i < vSpent.size(); i++)
+            if (chMode == SPENT_ALL || (vBits[i / 8] & (1 << (i % 8))))
+                vSpent[i].ReadCompact(s, pos);
+    }
 
     void SetNull()
     {
@@ -868,6 +1291,337 @@ public:
 };
 
 
+/** A single unspent transaction output, stored in the transaction database
+ *  next to CTxIndex so that ConnectBlock can validate inputs without seeking
+ *  back into blkNNNN.dat for the previous transaction.
+ */
+class CUnspent
+{
+public:
+    enum
+    {
+        UNSPENT_COINBASE  = (1U << 0),
+        UNSPENT_COINSTAKE = (1U << 1),
+    };
+
+    CTxOut txout;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nOutputs;
+    unsigned char nFlags;
+
+    CUnspent()
+    {
+        SetNull();
+    }
+
+    CUnspent(const CTransaction& tx, unsigned int n, int nHeightIn)
+    {
+        txout = tx.vout[n];
+        nHeight = nHeightIn;
+        nTime = tx.nTime;
+        nOutputs = tx.vout.size();
+        nFlags = 0;
+        if (tx.IsCoinBase())
+            nFlags |= UNSPENT_COINBASE;
+        if (tx.IsCoinStake())
+            nFlags |= UNSPENT_COINSTAKE;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        if (!(nType & SER_GETHASH))
+            READWRITE(nVersion);
+        READWRITE(nFlags);
+        READWRITE(nHeight);
+        READWRITE(nTime);
+        READWRITE(nOutputs);
+        READWRITE(txout);
+    )
+
+    void SetNull()
+    {
+        txout.SetNull();
+        nHeight = -1;
+        nTime = 0;
+        nOutputs = 0;
+        nFlags = 0;
+    }
+
+    bool IsNull() const
+    {
+        return (nHeight == -1);
+    }
+
+    bool IsCoinBase() const { return (nFlags & UNSPENT_COINBASE) != 0; }
+    bool IsCoinStake() const { return (nFlags & UNSPENT_COINSTAKE) != 0; }
+
+    /** Fill output n of txPrev, shaping an empty txPrev so that nTime,
+        IsCoinBase() and IsCoinStake() answer as the original transaction did. */
+    void ApplyTo(CTransaction& txPrev, unsigned int n) const;
+};
+
+/** Undo information for one transaction: the outputs its inputs spent, in
+ *  vin order. An entry with a null CUnspent was not recorded and has to be
+ *  rebuilt from the block files. */
+class CTxUndo
+{
+public:
+    std::vector<CUnspent> vprevout;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vprevout);
+    )
+};
+
+/** Undo information for a block, one CTxUndo per transaction. Written by
+ *  ConnectBlock so that DisconnectBlock doesn't have to go back to the
+ *  previous transactions on disk. */
+class CBlockUndo
+{
+public:
+    std::vector<CTxUndo> vtxundo;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(vtxundo);
+    )
+};
+
+/** Undo records are kept for this many blocks below the tip; deeper
+ *  reorganisations fall back to reading the block files. */
+static const int UNDO_KEEP_DEPTH = 2880;
+
+/** -addrindex history record: an output paid to a script, or spent from it
+ *  by input nIndex of txid. The height is written big-endian so that one
+ *  script's records sort by height and a height range is a single scan. */
+class CAddressIndexKey
+{
+public:
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    unsigned int nIndex;
+    bool fSpending;
+
+    CAddressIndexKey()
+    {
+        hashScript = 0;
+        nHeight = 0;
+        txid = 0;
+        nIndex = 0;
+        fSpending = false;
+    }
+
+    CAddressIndexKey(const uint160& hashScriptIn, int nHeightIn, const uint256& txidIn, unsigned int nIndexIn, bool fSpendingIn)
+        : hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s << hashScript;
+        unsigned char pchHeight[4] = { (unsigned char)(nHeight >> 24), (unsigned char)(nHeight >> 16),
+                                       (unsigned char)(nHeight >> 8), (unsigned char)nHeight };
+        s.write((const char*)pchHeight, sizeof(pchHeight));
+        s << txid << nIndex << fSpending;
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        s >> hashScript;
+        unsigned char pchHeight[4];
+        s.read((char*)pchHeight, sizeof(pchHeight));
+        nHeight = (pchHeight[0] << 24) | (pchHeight[1] << 16) | (pchHeight[2] << 8) | pchHeight[3];
+        s >> txid >> nIndex >> fSpending;
+    }
+};
+
+/** -addrindex unspent output of a script */
+class CAddressUnspentKey
+{
+public:
+    uint160 hashScript;
+    COutPoint outpoint;
+
+    CAddressUnspentKey()
+    {
+        hashScript = 0;
+    }
+
+    CAddressUnspentKey(const uint160& hashScriptIn, const COutPoint& outpointIn)
+        : hashScript(hashScriptIn), outpoint(outpointIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashScript);
+        READWRITE(outpoint);
+    )
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    int nHeight;
+    CScript scriptPubKey;
+
+    CAddressUnspentValue()
+    {
+        nValue = 0;
+        nHeight = -1;
+    }
+
+    CAddressUnspentValue(const CTxOut& txout, int nHeightIn)
+        : nValue(txout.nValue), nHeight(nHeightIn), scriptPubKey(txout.scriptPubKey) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nHeight);
+        READWRITE(scriptPubKey);
+    )
+};
+
+/** -spentindex record of a spent output: input nIndex of txid spent it at
+ *  nHeight. The output itself is repeated, so that resolving an input
+ *  doesn't need the transaction it came from. */
+class CSpentIndexValue
+{
+public:
+    uint256 txid;
+    unsigned int nIndex;
+    int nHeight;
+    CTxOut txout;
+
+    CSpentIndexValue()
+    {
+        txid = 0;
+        nIndex = 0;
+        nHeight = -1;
+    }
+
+    CSpentIndexValue(const uint256& txidIn, unsigned int nIndexIn, int nHeightIn, const CTxOut& txoutIn)
+        : txid(txidIn), nIndex(nIndexIn), nHeight(nHeightIn), txout(txoutIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txid);
+        READWRITE(nIndex);
+        READWRITE(nHeight);
+        READWRITE(txout);
+    )
+};
+
+/** -blockstatsindex record of a block of the main chain, by height. nReward
+ *  is what the block minted, fees included, and nStakeValue what the
+ *  coinstake's inputs were worth. scriptMinter is the output paid, as the
+ *  script of its address where it has one, so that pay-to-pubkey stakes
+ *  are found by address too. */
+class CBlockStats
+{
+public:
+    unsigned int nTime;
+    bool fProofOfStake;
+    unsigned int nTx;
+    unsigned int nSize;
+    int64_t nFees;
+    int64_t nReward;
+    int64_t nStakeValue;
+    CScript scriptMinter;
+
+    CBlockStats()
+    {
+        nTime = 0;
+        fProofOfStake = false;
+        nTx = nSize = 0;
+        nFees = nReward = nStakeValue = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nTime);
+        READWRITE(fProofOfStake);
+        READWRITE(nTx);
+        READWRITE(nSize);
+        READWRITE(nFees);
+        READWRITE(nReward);
+        READWRITE(nStakeValue);
+        READWRITE(scriptMinter);
+    )
+};
+
+/** Heights per -blockstatsindex summary, about a day of blocks */
+static const int BLOCK_STATS_STRIDE = 1440;
+
+/** Totals over the blocks of one stride, for the whole chain or for the
+ *  blocks of one minter script */
+class CBlockStatsSummary
+{
+public:
+    unsigned int nBlocks;
+    unsigned int nProofOfStake;
+    uint64_t nTx;
+    uint64_t nSize;
+    int64_t nFees;
+    int64_t nReward;
+    int64_t nStakeValue;
+
+    CBlockStatsSummary()
+    {
+        nBlocks = nProofOfStake = 0;
+        nTx = nSize = 0;
+        nFees = nReward = nStakeValue = 0;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nBlocks);
+        READWRITE(nProofOfStake);
+        READWRITE(nTx);
+        READWRITE(nSize);
+        READWRITE(nFees);
+        READWRITE(nReward);
+        READWRITE(nStakeValue);
+    )
+
+    void Add(const CBlockStats& stats, int nSign = 1)
+    {
+        nBlocks += nSign;
+        nProofOfStake += stats.fProofOfStake ? nSign : 0;
+        nTx += (int64_t)nSign * stats.nTx;
+        nSize += (int64_t)nSign * stats.nSize;
+        nFees += nSign * stats.nFees;
+        nReward += nSign * stats.nReward;
+        nStakeValue += nSign * stats.nStakeValue;
+    }
+
+    void Add(const CBlockStatsSummary& summary)
+    {
+        nBlocks += summary.nBlocks;
+        nProofOfStake += summary.nProofOfStake;
+        nTx += summary.nTx;
+        nSize += summary.nSize;
+        nFees += summary.nFees;
+        nReward += summary.nReward;
+        nStakeValue += summary.nStakeValue;
+    }
+
+    bool IsEmpty() const { return nBlocks == 0; }
+};
+
+/** Totals of -blockstatsindex over heights nStart to nEnd inclusive, of the
+ *  blocks minted by scriptMinter only if it isn't empty. Reads a summary
+ *  per full stride and single blocks at the edges. Needs cs_main. */
+bool GetBlockStatsRange(int nStart, int nEnd, const CScript& scriptMinter, CBlockStatsSummary& summary);
+
+
 
 
 
@@ -902,6 +1656,25 @@ public:
     // memory only
     mutable std::vector<uint256> vMerkleTree;
 
+    // Header hashes as of the header bytes in pchHashedHeader. The header is
+    // compared before use, so assigning to nNonce, nTime etc. directly is
+    // still safe; it just costs a recomputation.
+    mutable unsigned char pchHashedHeader[80];
+    mutable uint256 hashCached;
+    mutable uint256 hashPoWCached;
+    mutable unsigned char nCachedHashes;
+    enum
+    {
+        CACHED_HASH    = (1 << 0),
+        CACHED_POWHASH = (1 << 1),
+    };
+    // Header hashes actually computed for this block, for profiling
+    mutable unsigned int nHashEvaluations;
+
+    // Set once the context-free checks in CheckBlock() have passed, e.g. by
+    // the block importer, so that ProcessBlock() doesn't repeat them
+    bool fChecked;
+
     // Denial-of-service detection:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
@@ -945,6 +1718,9 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        nCachedHashes = 0;
+        nHashEvaluations = 0;
+        fChecked = false;
         nDoS = 0;
     }
 
@@ -953,17 +1729,40 @@ public:
         return (nBits == 0);
     }
 
+    // Drop the cached hashes if the header changed since they were computed
+    void CheckHashCache() const
+    {
+        assert(END(nNonce) - BEGIN(nVersion) == sizeof(pchHashedHeader));
+        if (nCachedHashes && memcmp(pchHashedHeader, BEGIN(nVersion), sizeof(pchHashedHeader)) == 0)
+            return;
+        memcpy(pchHashedHeader, BEGIN(nVersion), sizeof(pchHashedHeader));
+        nCachedHashes = 0;
+    }
+
     uint256 GetHash() const
     {
-        if (nVersion > 6)
-            return Hash(BEGIN(nVersion), END(nNonce));
-        else
+        if (nVersion <= 6)
             return GetPoWHash();
+        CheckHashCache();
+        if (!(nCachedHashes & CACHED_HASH))
+        {
+            hashCached = Hash(BEGIN(nVersion), END(nNonce));
+            nCachedHashes |= CACHED_HASH;
+            nHashEvaluations++;
+        }
+        return hashCached;
     }
 
     uint256 GetPoWHash() const
     {
-        return Hash9(BEGIN(nVersion), END(nNonce));
+        CheckHashCache();
+        if (!(nCachedHashes & CACHED_POWHASH))
+        {
+            hashPoWCached = Hash9(BEGIN(nVersion), END(nNonce));
+            nCachedHashes |= CACHED_POWHASH;
+            nHashEvaluations++;
+        }
+        return hashPoWCached;
     }
 
     int64_t GetBlockTime() const
@@ -1013,20 +1812,73 @@ public:
         vMerkleTree.clear();
         BOOST_FOREACH(const CTransaction& tx, vtx)
             vMerkleTree.push_back(tx.GetHash());
+        return BuildMerkleBranches();
+    }
+
+    static uint256 HashMerkleNode(uint256 left, uint256 right)
+    {
+        unsigned char pchPair[64];
+        memcpy(pchPair, left.begin(), 32);
+        memcpy(pchPair + 32, right.begin(), 32);
+        return Hash64(pchPair);
+    }
+
+    // Complete the tree above the txids already in vMerkleTree
+    uint256 BuildMerkleBranches() const
+    {
+        vMerkleTree.reserve(GetMerkleTreeSize(vtx.size()));
         int j = 0;
         for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
         {
             for (int i = 0; i < nSize; i += 2)
             {
                 int i2 = std::min(i+1, nSize-1);
-                vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                           BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+                vMerkleTree.push_back(HashMerkleNode(vMerkleTree[j+i], vMerkleTree[j+i2]));
             }
             j += nSize;
         }
         return (vMerkleTree.empty() ? 0 : vMerkleTree.back());
     }
 
+    // The merkle root after vtx[nLeaf], and nothing else, changed since the
+    // tree was last built, as the coinbase does between extra nonces. Only
+    // the path from that leaf up is rehashed.
+    uint256 UpdateMerkleLeaf(unsigned int nLeaf) const
+    {
+        if (nLeaf >= vtx.size() || vMerkleTree.size() != GetMerkleTreeSize(vtx.size()))
+            return BuildMerkleTree();
+        vMerkleTree[nLeaf] = vtx[nLeaf].GetHash();
+        int j = 0;
+        int nIndex = nLeaf;
+        for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
+        {
+            int i = nIndex & ~1;
+            int i2 = std::min(i+1, nSize-1);
+            vMerkleTree[j + nSize + nIndex/2] = HashMerkleNode(vMerkleTree[j+i], vMerkleTree[j+i2]);
+            nIndex >>= 1;
+            j += nSize;
+        }
+        return vMerkleTree.back();
+    }
+
+    // Hash of vtx[i], taken from the merkle tree when it is known to match
+    // hashMerkleRoot, as it is after CheckBlock()
+    uint256 GetTxHash(unsigned int i) const
+    {
+        if (!vMerkleTree.empty() && vMerkleTree.back() == hashMerkleRoot &&
+            vMerkleTree.size() == GetMerkleTreeSize(vtx.size()))
+            return vMerkleTree[i];
+        return vtx[i].GetHash();
+    }
+
+    static unsigned int GetMerkleTreeSize(unsigned int nLeaves)
+    {
+        unsigned int nTreeSize = nLeaves;
+        for (unsigned int nSize = nLeaves; nSize > 1; nSize = (nSize + 1) / 2)
+            nTreeSize += (nSize + 1) / 2;
+        return nTreeSize;
+    }
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const
     {
         if (vMerkleTree.empty())
@@ -1050,9 +1902,9 @@ public:
         BOOST_FOREACH(const uint256& otherside, vMerkleBranch)
         {
             if (nIndex & 1)
-                hash = Hash(BEGIN(otherside), END(otherside), BEGIN(hash), END(hash));
+                hash = HashMerkleNode(otherside, hash);
             else
-                hash = Hash(BEGIN(hash), END(hash), BEGIN(otherside), END(otherside));
+                hash = HashMerkleNode(hash, otherside);
             nIndex >>= 1;
         }
         return hash;
@@ -1075,12 +1927,20 @@ public:
         if (fileOutPos < 0)
             return error("CBlock::WriteToDisk() : ftell failed");
         nBlockPosRet = fileOutPos;
+
+        // Reserve the next chunk of the file once this block runs into it
+        unsigned int nChunkEnd = (nBlockPosRet + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE * BLOCKFILE_CHUNK_SIZE;
+        if (nBlockPosRet + nSize > nChunkEnd)
+            AllocateFileRange(fileout, nChunkEnd, (nBlockPosRet + nSize - nChunkEnd + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE * BLOCKFILE_CHUNK_SIZE);
         fileout << *this;
 
-        // Flush stdio buffers and commit to disk before returning
+        // Flush stdio buffers and, once synced, commit to disk before
+        // returning. In initial download the commit waits for the txdb.
         fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        if (!IsInitialBlockDownload())
             FileCommit(fileout);
+        else
+            MarkBlockFileUncommitted(nFileRet);
 
         return true;
     }
@@ -1089,16 +1949,11 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
+        // Read block, from the block file mapping if there is one
         try {
-            filein >> *this;
+            int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+            if (!ReadFromBlockFile(nFile, nBlockPos, *this, nType, CLIENT_VERSION))
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -1167,6 +2022,8 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    // Skip-list link to an ancestor further back, see GetAncestor()
+    CBlockIndex* pskip;
     unsigned int nFile;
     unsigned int nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
@@ -1184,7 +2041,7 @@ public:
     };
 
     uint64_t nStakeModifier; // hash modifier for proof-of-stake
-    unsigned int nStakeModifierChecksum; // checksum of index; in-memeory only
+    unsigned int nStakeModifierChecksum; // checksum of index; stored from BLOCKINDEX_CHECKSUM_VERSION on
 
     // proof-of-stake specific fields
     COutPoint prevoutStake;
@@ -1204,6 +2061,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -1229,6 +2087,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -1283,6 +2142,14 @@ public:
 
     uint256 GetBlockTrust() const;
 
+    /** Set pskip from pprev, whose own skip links must already be built */
+    void BuildSkip();
+
+    /** The ancestor of this block at nHeightAncestor, or NULL if it is out of
+     *  range. Follows pskip where possible, so it takes O(log n) steps. */
+    CBlockIndex* GetAncestor(int nHeightAncestor);
+    const CBlockIndex* GetAncestor(int nHeightAncestor) const;
+
     bool IsInMainChain() const
     {
         return (pnext || this == pindexBest);
@@ -1395,18 +2262,21 @@ private:
 public:
     uint256 hashPrev;
     uint256 hashNext;
+    bool fStakeModifierChecksum; // nStakeModifierChecksum was read from disk
 
     CDiskBlockIndex()
     {
         hashPrev = 0;
         hashNext = 0;
         blockHash = 0;
+        fStakeModifierChecksum = false;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex) : CBlockIndex(*pindex)
     {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         hashNext = (pnext ? pnext->GetBlockHash() : 0);
+        fStakeModifierChecksum = false;
     }
 
     IMPLEMENT_SERIALIZE
@@ -1442,6 +2312,14 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
         READWRITE(blockHash);
+
+        // Older records leave the checksum to LoadBlockIndex()
+        if (!(nType & SER_GETHASH) && nVersion >= BLOCKINDEX_CHECKSUM_VERSION)
+        {
+            READWRITE(nStakeModifierChecksum);
+            if (fRead)
+                const_cast<CDiskBlockIndex*>(this)->fStakeModifierChecksum = true;
+        }
     )
 
     uint256 GetBlockHash() const
@@ -1490,6 +2368,11 @@ public:
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
  */
+/** Add the hashes of pindex and then exponentially further back, starting
+ *  with steps of nStep, to a locator. Once the walk is on the main chain
+ *  each entry is looked up by height. Needs cs_main. */
+void AppendLocatorHashes(std::vector<uint256>& vHave, const CBlockIndex* pindex, int nStep);
+
 class CBlockLocator
 {
 protected:
@@ -1507,7 +2390,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1534,20 +2417,11 @@ public:
         return vHave.empty();
     }
 
+    // Needs cs_main
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
-        int nStep = 1;
-        while (pindex)
-        {
-            vHave.push_back(pindex->GetBlockHash());
-
-            // Exponentially larger steps back
-            for (int i = 0; pindex && i < nStep; i++)
-                pindex = pindex->pprev;
-            if (vHave.size() > 10)
-                nStep *= 2;
-        }
+        AppendLocatorHashes(vHave, pindex, 1);
         vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
     }
 
@@ -1558,7 +2432,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1577,7 +2451,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1593,7 +2467,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1620,18 +2494,116 @@ public:
 
 
 
+/** What CreateNewBlock() needs to know about a pool transaction, worked out
+ *  when it is accepted so that block templates don't read the disk */
+class CTxMemPoolEntry
+{
+public:
+    int64_t nFee;
+    unsigned int nSize;
+    // sum(value in * confirmations) of inputs in the chain at nHeight
+    double dPriority;
+    int64_t nValueInChain;
+    int nHeight;
+
+    // This transaction together with its ancestors still in the pool
+    int64_t nFeesWithAncestors;
+    unsigned int nSizeWithAncestors;
+    unsigned int nCountWithAncestors;
+    // Key in CTxMemPool::setByAncestorFeeRate
+    double dAncestorFeePerKb;
+
+    // This transaction together with its descendants in the pool
+    int64_t nFeesWithDescendants;
+    unsigned int nSizeWithDescendants;
+    unsigned int nCountWithDescendants;
+    // Key in CTxMemPool::setByDescendantFeeRate
+    double dDescendantFeePerKb;
+
+    // Heap memory held by the pool for this transaction
+    size_t nUsage;
+
+    CTxMemPoolEntry() : nFee(0), nSize(0), dPriority(0), nValueInChain(0), nHeight(0),
+        nFeesWithAncestors(0), nSizeWithAncestors(0), nCountWithAncestors(0), dAncestorFeePerKb(0),
+        nFeesWithDescendants(0), nSizeWithDescendants(0), nCountWithDescendants(0), dDescendantFeePerKb(0), nUsage(0) {}
+    CTxMemPoolEntry(int64_t nFeeIn, unsigned int nSizeIn, double dPriorityIn, int64_t nValueInChainIn, int nHeightIn) :
+        nFee(nFeeIn), nSize(nSizeIn), dPriority(dPriorityIn), nValueInChain(nValueInChainIn), nHeight(nHeightIn),
+        nFeesWithAncestors(0), nSizeWithAncestors(0), nCountWithAncestors(0), dAncestorFeePerKb(0),
+        nFeesWithDescendants(0), nSizeWithDescendants(0), nCountWithDescendants(0), dDescendantFeePerKb(0), nUsage(0) {}
+
+    /** Priority as of nHeightNow: the coins in the chain keep aging */
+    double GetPriority(int nHeightNow) const
+    {
+        if (nSize == 0)
+            return 0;
+        return (dPriority + (double)nValueInChain * (nHeightNow - nHeight)) / nSize;
+    }
+
+    double GetFeePerKb() const { return nSize ? nFee / (nSize / 1000.0) : 0; }
+};
+
 class CTxMemPool
 {
 public:
+    // Held by reference so readers can keep a transaction without copying it
+    typedef boost::unordered_map<uint256, CTransactionRef, SaltedTxidHasher> TxMap;
+    typedef boost::unordered_map<COutPoint, CInPoint, SaltedOutpointHasher> NextTxMap;
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, SaltedTxidHasher> InfoMap;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    TxMap mapTx;
+    NextTxMap mapNextTx;
+    InfoMap mapInfo;
+    // Every transaction by the fee rate of its package with its unconfirmed
+    // ancestors; CreateNewBlock() takes from the end
+    std::set<std::pair<double, uint256> > setByAncestorFeeRate;
+    // Every transaction by the fee rate of its package with its descendants;
+    // TrimToSize() evicts from the front
+    std::set<std::pair<double, uint256> > setByDescendantFeeRate;
+
+    CTxMemPool() : nTotalTxSize(0), nDynamicUsage(0), dRollingMinFeePerKb(0), nLastRollingFeeUpdate(0) {}
 
     bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, CTransaction &tx, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+    /** The in-pool ancestors of hash, parents before children */
+    void GetAncestors(const uint256& hash, std::vector<uint256>& vAncestors) const;
+    /** Adds the in-pool descendants of hash to setDescendants */
+    void GetDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    /** Evict the cheapest packages until the pool holds at most nLimit bytes;
+     *  returns the number of transactions evicted */
+    unsigned int TrimToSize(size_t nLimit);
+    /** Fee per kB a new transaction must pay to get into a pool limited to nLimit bytes */
+    double GetMinFeePerKb(size_t nLimit);
+
+private:
+    // Serialized size and heap memory of everything in the pool
+    uint64_t nTotalTxSize;
+    size_t nDynamicUsage;
+    // Raised on eviction, decays back to zero with MEMPOOL_FEE_HALFLIFE
+    double dRollingMinFeePerKb;
+    int64_t nLastRollingFeeUpdate;
+
+    void UpdateAncestorState(const uint256& hash);
+    void UpdateDescendantState(const uint256& hash);
+    // requires LOCK(cs)
+    void UpdateMetrics();
+public:
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nDynamicUsage;
+    }
 
     unsigned long size() const
     {
@@ -1648,13 +2620,41 @@ public:
     bool lookup(uint256 hash, CTransaction& result) const
     {
         LOCK(cs);
-        std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+        TxMap::const_iterator i = mapTx.find(hash);
         if (i == mapTx.end()) return false;
-        result = i->second;
+        result = *i->second;
         return true;
     }
+
+    /** The pool's own copy of a transaction, or NULL. It stays valid after
+     *  the transaction leaves the pool. */
+    CTransactionRef get(const uint256& hash) const
+    {
+        LOCK(cs);
+        TxMap::const_iterator i = mapTx.find(hash);
+        if (i == mapTx.end()) return CTransactionRef();
+        return i->second;
+    }
 };
 
 extern CTxMemPool mempool;
 
+/** Heap memory of a transaction's vectors and scripts, not counting the
+ *  object itself */
+size_t TransactionUsage(const CTransaction& tx);
+
+/** Approximate heap memory of the block index and the orphan pools, for
+ *  getmemoryinfo */
+struct CMainMemoryUsage
+{
+    size_t nBlockIndexEntries;
+    size_t nBlockIndex;
+    size_t nOrphanBlockEntries;
+    size_t nOrphanBlocks;
+    size_t nOrphanTxEntries;
+    size_t nOrphanTxs;
+};
+
+void GetMainMemoryUsage(CMainMemoryUsage& usage);
+
 #endif
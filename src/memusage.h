@@ -0,0 +1,58 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+#include <map>
+#include <set>
+#include <vector>
+
+/** Estimates of the heap memory containers take, from their sizes rather
+ *  than by asking the allocator. Close enough to see which of them
+ *  dominates the resident size, not to account for every byte. */
+
+static inline size_t MallocUsage(size_t nAlloc)
+{
+    // What malloc really hands out: a header word, rounded to its alignment
+    if (nAlloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((nAlloc + 31) >> 4) << 4;
+    return ((nAlloc + 15) >> 3) << 3;
+}
+
+template<typename X>
+static inline size_t MapNodeUsage()
+{
+    // The value plus colour, parent, left and right of a red-black tree node
+    return MallocUsage(sizeof(X) + 4 * sizeof(void*));
+}
+
+template<typename X>
+static inline size_t UnorderedNodeUsage()
+{
+    // The value, the next link and the cached hash, plus its bucket slot
+    return MallocUsage(sizeof(X) + 2 * sizeof(void*)) + sizeof(void*);
+}
+
+template<typename X>
+static inline size_t VectorUsage(const std::vector<X>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(X));
+}
+
+template<typename K, typename V>
+static inline size_t MapUsage(const std::map<K, V>& m)
+{
+    return m.size() * MapNodeUsage<std::pair<const K, V> >();
+}
+
+template<typename X>
+static inline size_t SetUsage(const std::set<X>& s)
+{
+    return s.size() * MapNodeUsage<X>();
+}
+
+#endif
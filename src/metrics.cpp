@@ -0,0 +1,64 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "util.h"
+
+#include <vector>
+
+using namespace std;
+
+// Filled during static initialization and never changed afterwards, so
+// reading them needs no lock. Functions rather than globals, as metrics in
+// other files may be constructed first.
+static vector<const CMetric*>& RegisteredMetrics()
+{
+    static vector<const CMetric*> vMetrics;
+    return vMetrics;
+}
+
+static vector<MetricsCollector>& RegisteredCollectors()
+{
+    static vector<MetricsCollector> vCollectors;
+    return vCollectors;
+}
+
+CMetric::CMetric(const char* pszNameIn, const char* pszHelpIn, MetricType typeIn, double dScaleIn) :
+    pszName(pszNameIn), pszHelp(pszHelpIn), type(typeIn), dScale(dScaleIn), nValue(0)
+{
+    RegisteredMetrics().push_back(this);
+}
+
+void WriteMetricHeader(string& str, const char* pszName, const char* pszHelp, MetricType type)
+{
+    str += strprintf("# HELP %s %s\n", pszName, pszHelp);
+    str += strprintf("# TYPE %s %s\n", pszName, type == METRIC_COUNTER ? "counter" : "gauge");
+}
+
+void CMetric::Write(string& str) const
+{
+    WriteMetricHeader(str, pszName, pszHelp, type);
+    if (dScale == 1.0)
+        str += strprintf("%s %"PRId64"\n", pszName, Get());
+    else
+        str += strprintf("%s %.6f\n", pszName, Get() * dScale);
+}
+
+CMetricsCollector::CMetricsCollector(MetricsCollector fn)
+{
+    RegisteredCollectors().push_back(fn);
+}
+
+string GetMetricsText()
+{
+    string str;
+    const vector<const CMetric*>& vMetrics = RegisteredMetrics();
+    for (unsigned int i = 0; i < vMetrics.size(); i++)
+        vMetrics[i]->Write(str);
+    const vector<MetricsCollector>& vCollectors = RegisteredCollectors();
+    for (unsigned int i = 0; i < vCollectors.size(); i++)
+        vCollectors[i](str);
+    return str;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+/** Node telemetry served under /metrics in the Prometheus text format.
+ *
+ *  A CMetric is a counter or gauge defined at file scope next to the code
+ *  that updates it; it registers itself on construction. Updates and reads
+ *  are single atomic operations, so neither the subsystems nor a scrape
+ *  take a lock for them. Figures that only exist per peer or inside another
+ *  structure are written out at scrape time by a CMetricsCollector.
+ */
+
+enum MetricType
+{
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+};
+
+class CMetric
+{
+public:
+    // dScale turns the stored integer into the exposed unit, e.g. 1e-6 for
+    // microseconds kept by a _seconds metric
+    CMetric(const char* pszNameIn, const char* pszHelpIn, MetricType typeIn, double dScaleIn = 1.0);
+
+    void Add(int64_t n) { __sync_fetch_and_add(&nValue, n); }
+    void Inc() { Add(1); }
+    void Set(int64_t n)
+    {
+        int64_t nOld;
+        do
+            nOld = nValue;
+        while (!__sync_bool_compare_and_swap(&nValue, nOld, n));
+    }
+    int64_t Get() const { return __sync_fetch_and_add(const_cast<volatile int64_t*>(&nValue), 0); }
+
+    void Write(std::string& str) const;
+
+private:
+    const char* pszName;
+    const char* pszHelp;
+    MetricType type;
+    double dScale;
+    volatile int64_t nValue;
+
+    CMetric(const CMetric&);
+    void operator=(const CMetric&);
+};
+
+typedef void (*MetricsCollector)(std::string& str);
+
+/** Registers a function that appends metrics to a scrape */
+class CMetricsCollector
+{
+public:
+    explicit CMetricsCollector(MetricsCollector fn);
+};
+
+// The header lines for a metric a collector writes
+void WriteMetricHeader(std::string& str, const char* pszName, const char* pszHelp, MetricType type);
+
+// Every registered metric and collector, in the text exposition format
+std::string GetMetricsText();
+
+#endif
@@ -53,37 +53,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
-{
-public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
-    {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
-    }
-
-    void print() const
-    {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
-    }
-};
-
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
 
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTransaction*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -106,6 +81,89 @@ public:
     }
 };
 
+// Block CreateNewBlock() is filling in with pool transactions
+class CBlockAssembler
+{
+public:
+    CBlock* pblock;
+    CTxDB& txdb;
+    CBlockIndex* pindexPrev;
+    bool fProofOfStake;
+    unsigned int nBlockMaxSize;
+
+    map<uint256, CTxIndex> mapTestPool;
+    set<uint256> setInBlock;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+
+    CBlockAssembler(CBlock* pblockIn, CTxDB& txdbIn, CBlockIndex* pindexPrevIn, bool fProofOfStakeIn, unsigned int nBlockMaxSizeIn) :
+        pblock(pblockIn), txdb(txdbIn), pindexPrev(pindexPrevIn), fProofOfStake(fProofOfStakeIn), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    // Add tx if it fits and connects; its pool parents must be in already
+    bool Add(const uint256& hash, const CTransaction& tx, double dPriority, double dFeePerKb)
+    {
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
+            return false;
+
+        // Size limits
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Timestamp limit
+        if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
+            return false;
+
+        // Transaction fee
+        int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK);
+
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because the caller adds them in order of dependency
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            return false;
+
+        int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        if (nTxFees < nMinFee)
+            return false;
+
+        nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        CDiskTxPos cDiskTxPos = CDiskTxPos(1,1,1);
+        if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, cDiskTxPos, pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            return false;
+        mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(mapTestPool, mapTestPoolTmp);
+
+        // Added
+        pblock->vtx.push_back(tx);
+        setInBlock.insert(hash);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+
+        if (fDebug && GetBoolArg("-printpriority"))
+        {
+            printf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, dFeePerKb, hash.ToString().c_str());
+        }
+        return true;
+    }
+};
+
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(__wx__* pwallet, bool fProofOfStake, int64_t* pFees)
 {
@@ -175,187 +233,144 @@ CBlock* CreateNewBlock(__wx__* pwallet, bool fProofOfStake, int64_t* pFees)
     {
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
+        CBlockAssembler assembler(pblock.get(), txdb, pindexPrev, fProofOfStake, nBlockMaxSize);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        // Priority and fees were worked out when the transactions were
+        // accepted, see CTxMemPoolEntry, so nothing here reads the disk
+        // but FetchInputs() of what goes in.
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // First the high-priority space, regardless of fees. Transactions
+        // with parents in the pool wait for the fee stage, which adds them
+        // after their parents.
+        if (nBlockPrioritySize > 0)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            vector<TxPriority> vecPriority;
+            vecPriority.reserve(mempool.mapInfo.size());
+            for (CTxMemPool::InfoMap::const_iterator mi = mempool.mapInfo.begin(); mi != mempool.mapInfo.end(); ++mi)
             {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                if (mi->second.nCountWithAncestors != 1)
                     continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
+                CTxMemPool::TxMap::iterator it = mempool.mapTx.find(mi->first);
+                if (it != mempool.mapTx.end())
+                    vecPriority.push_back(TxPriority(mi->second.GetPriority(nBestHeight), mi->second.GetFeePerKb(), it->second.get()));
             }
-            if (fMissingInputs) continue;
 
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
+            TxPriorityCompare comparer(false);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            while (!vecPriority.empty())
+            {
+                // Take highest priority transaction off the priority queue:
+                double dPriority = vecPriority.front().get<0>();
+                double dFeePerKb = vecPriority.front().get<1>();
+                const CTransaction& tx = *(vecPriority.front().get<2>());
 
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+                std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                vecPriority.pop_back();
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                // Prioritize by fee once past the priority size or we run out of high-priority
+                // transactions:
+                unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+                if ((assembler.nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250))
+                    break;
+
+                assembler.Add(tx.GetHash(), tx, dPriority, dFeePerKb);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
         }
 
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        // Then by the fee rate of each transaction together with its
+        // unconfirmed ancestors, so that a child can pay for its parents.
+        // Once some of its ancestors are in the block a transaction is
+        // ranked by what is left of its package, in setModified.
+        typedef pair<double, uint256> FeeRateKey;
+        set<uint256> setTried;
+        map<uint256, double> mapModified;
+        set<FeeRateKey> setModified;
+        set<FeeRateKey>::reverse_iterator it = mempool.setByAncestorFeeRate.rbegin();
+        while (true)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
+            while (it != mempool.setByAncestorFeeRate.rend() &&
+                   (assembler.setInBlock.count(it->second) || setTried.count(it->second) || mapModified.count(it->second)))
+                ++it;
 
-            // Transaction fee
-            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+            FeeRateKey candidate;
+            if (!setModified.empty() && (it == mempool.setByAncestorFeeRate.rend() || *setModified.rbegin() > *it))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                candidate = *setModified.rbegin();
+                setModified.erase(candidate);
+                mapModified.erase(candidate.second);
             }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
+            else if (it != mempool.setByAncestorFeeRate.rend())
+                candidate = *it++;
+            else
+                break;
+            if (assembler.setInBlock.count(candidate.second))
                 continue;
+            setTried.insert(candidate.second);
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            vector<uint256> vPackage;
+            mempool.GetAncestors(candidate.second, vPackage);
+            vPackage.push_back(candidate.second);
+            unsigned int nPackageSize = 0;
+            BOOST_FOREACH(const uint256& hash, vPackage)
+            {
+                CTxMemPool::InfoMap::const_iterator me = mempool.mapInfo.find(hash);
+                if (me != mempool.mapInfo.end() && !assembler.setInBlock.count(hash))
+                    nPackageSize += me->second.nSize;
+            }
 
-            CDiskTxPos cDiskTxPos = CDiskTxPos(1,1,1);
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, cDiskTxPos, pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            // Skip free transactions if we're past the minimum block size:
+            if ((candidate.first < nMinTxFee) && (assembler.nBlockSize + nPackageSize >= nBlockMinSize))
                 continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
+            vector<uint256> vAdded;
+            BOOST_FOREACH(const uint256& hash, vPackage)
             {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+                if (assembler.setInBlock.count(hash))
+                    continue;
+                CTxMemPool::TxMap::const_iterator mt = mempool.mapTx.find(hash);
+                CTxMemPool::InfoMap::const_iterator me = mempool.mapInfo.find(hash);
+                if (mt == mempool.mapTx.end() || me == mempool.mapInfo.end())
+                    break;
+                // The rest of the package needs this one
+                if (!assembler.Add(hash, *mt->second, me->second.GetPriority(nBestHeight), me->second.GetFeePerKb()))
+                    break;
+                vAdded.push_back(hash);
             }
 
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
+            // Whatever spends them no longer pays for them
+            set<uint256> setDescendants;
+            BOOST_FOREACH(const uint256& hash, vAdded)
+                mempool.GetDescendants(hash, setDescendants);
+            BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                if (assembler.setInBlock.count(hashDescendant) || setTried.count(hashDescendant))
+                    continue;
+                vector<uint256> vAncestors;
+                mempool.GetAncestors(hashDescendant, vAncestors);
+                vAncestors.push_back(hashDescendant);
+                int64_t nPackageFees = 0;
+                unsigned int nLeftSize = 0;
+                BOOST_FOREACH(const uint256& hash, vAncestors)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    CTxMemPool::InfoMap::const_iterator me = mempool.mapInfo.find(hash);
+                    if (me == mempool.mapInfo.end() || assembler.setInBlock.count(hash))
+                        continue;
+                    nPackageFees += me->second.nFee;
+                    nLeftSize += me->second.nSize;
                 }
+                double dFeePerKb = nLeftSize ? nPackageFees / (nLeftSize / 1000.0) : 0;
+                map<uint256, double>::iterator mm = mapModified.find(hashDescendant);
+                if (mm != mapModified.end())
+                    setModified.erase(make_pair(mm->second, hashDescendant));
+                mapModified[hashDescendant] = dFeePerKb;
+                setModified.insert(make_pair(dFeePerKb, hashDescendant));
             }
         }
 
+        uint64_t nBlockSize = assembler.nBlockSize;
+        uint64_t nBlockTx = assembler.nBlockTx;
+        nFees = assembler.nFees;
+
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
 
@@ -397,7 +412,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
 
-    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+    pblock->hashMerkleRoot = pblock->UpdateMerkleLeaf(0);
 }
 
 
@@ -524,15 +539,26 @@ bool CheckStake(CBlock* pblock, __wx__& wallet)
     return true;
 }
 
+// Seconds a staking template may go without the newest pool transactions
+static const int64_t STAKE_TEMPLATE_REFRESH = 10;
+
 void StakeMiner(__wx__ *pwallet)
 {
-    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    SetThreadPoolPriority(THREADPOOL_STAKING);
 
     // Make this thread recognisable as the mining thread
     RenameThread("iocoin-miner");
 
     bool fTryToSync = true;
 
+    // Only the coinstake and timestamps change between attempts, which
+    // SignBlock() fills in on a copy, so the template is kept until the tip
+    // moves or the memory pool has changed for a while
+    auto_ptr<CBlock> pblockTemplate;
+    unsigned int nTransactionsUpdatedTemplate = 0;
+    int64_t nTimeTemplate = 0;
+    int64_t nFees = 0;
+
     while (true)
     {
         if (fShutdown)
@@ -568,17 +594,24 @@ void StakeMiner(__wx__ *pwallet)
         //
         // Create new block
         //
-        int64_t nFees;
-        auto_ptr<CBlock> pblock(CreateNewBlock(pwallet, true, &nFees));
-        if (!pblock.get())
-            return;
+        if (!pblockTemplate.get() || pblockTemplate->hashPrevBlock != hashBestChain ||
+            (nTransactionsUpdated != nTransactionsUpdatedTemplate && GetTime() - nTimeTemplate > STAKE_TEMPLATE_REFRESH))
+        {
+            nTransactionsUpdatedTemplate = nTransactionsUpdated;
+            nTimeTemplate = GetTime();
+            pblockTemplate.reset(CreateNewBlock(pwallet, true, &nFees));
+            if (!pblockTemplate.get())
+                return;
+        }
+        auto_ptr<CBlock> pblock(new CBlock(*pblockTemplate));
 
         // Trying to sign a block
         if (pblock->SignBlock(*pwallet, nFees))
         {
-            SetThreadPriority(THREAD_PRIORITY_NORMAL);
+            SetThreadPoolPriority(THREADPOOL_STAKING, true);
             CheckStake(pblock.get(), *pwallet);
-            SetThreadPriority(THREAD_PRIORITY_LOWEST);
+            SetThreadPoolPriority(THREADPOOL_STAKING);
+            pblockTemplate.reset();
             MilliSleep(500);
         }
         else
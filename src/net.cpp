@@ -7,12 +7,18 @@
 #include "db.h"
 #include "net.h"
 #include "init.h"
+#include "metrics.h"
 #include "strlcpy.h"
 #include "addrman.h"
+#include "netpoll.h"
 #include "ui_interface.h"
 
+#include <zlib.h>
+
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -26,6 +32,9 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+// Outbound connects in flight at once, and the head start each gets on the next
+static const unsigned int MAX_PENDING_CONNECTIONS = 8;
+static const int CONNECT_ATTEMPT_DELAY = 250;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -35,8 +44,8 @@ void ThreadOpenAddedConnections2(void* parg);
 void ThreadMapPort2(void* parg);
 #endif
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest);
 
-extern string strDNSSeedNode;
 
 struct LocalServiceInfo {
     int nScore;
@@ -62,7 +71,7 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetMessageRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -433,6 +442,27 @@ void AddressCurrentlyConnected(const CService& addr)
 
 
 
+static vector<CNetAddr> vFastPeers;
+static CCriticalSection cs_vFastPeers;
+
+void AddFastPeer(const CNetAddr& addr)
+{
+    LOCK(cs_vFastPeers);
+    vFastPeers.push_back(addr);
+}
+
+bool IsFastPeer(const CNetAddr& addr)
+{
+    LOCK(cs_vFastPeers);
+    return find(vFastPeers.begin(), vFastPeers.end(), addr) != vFastPeers.end();
+}
+
+bool HaveFastPeers()
+{
+    LOCK(cs_vFastPeers);
+    return !vFastPeers.empty();
+}
+
 CNode* FindNode(const CNetAddr& ip)
 {
     {
@@ -490,36 +520,40 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, GetDefaultPort()) : ConnectSocket(addrConnect, hSocket))
     {
         addrman.Attempt(addrConnect);
+        return AddConnectedNode(hSocket, addrConnect, pszDest);
+    }
+    else
+    {
+        return NULL;
+    }
+}
 
-        /// debug print
-        printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
+static CNode* AddConnectedNode(SOCKET hSocket, const CAddress& addrConnect, const char *pszDest)
+{
+    /// debug print
+    printf("connected %s\n", pszDest ? pszDest : addrConnect.ToString().c_str());
 
-        // Set to non-blocking
+    // Set to non-blocking
 #ifdef WIN32
-        u_long nOne = 1;
-        if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
-            printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
+    u_long nOne = 1;
+    if (ioctlsocket(hSocket, FIONBIO, &nOne) == SOCKET_ERROR)
+        printf("ConnectSocket() : ioctlsocket non-blocking setting failed, error %d\n", WSAGetLastError());
 #else
-        if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
-            printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
+    if (fcntl(hSocket, F_SETFL, O_NONBLOCK) == SOCKET_ERROR)
+        printf("ConnectSocket() : fcntl non-blocking setting failed, error %d\n", errno);
 #endif
 
-        // Add node
-        CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
-        pnode->AddRef();
-
-        {
-            LOCK(cs_vNodes);
-            vNodes.push_back(pnode);
-        }
+    // Add node
+    CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
+    pnode->AddRef();
 
-        pnode->nTimeConnected = GetTime();
-        return pnode;
-    }
-    else
     {
-        return NULL;
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
     }
+
+    pnode->nTimeConnected = GetTime();
+    return pnode;
 }
 
 void CNode::CloseSocketDisconnect()
@@ -556,6 +590,8 @@ void CNode::PushVersion()
 
 std::map<CNetAddr, int64_t> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
+NodeId CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 void CNode::ClearBanned()
 {
@@ -586,6 +622,12 @@ bool CNode::Misbehaving(int howmuch)
         return false;
     }
 
+    if (fFastPeer)
+    {
+        printf("Warning: fast peer %s misbehaving (delta: %d)!\n", addrName.c_str(), howmuch);
+        return false;
+    }
+
     nMisbehavior += howmuch;
     if (nMisbehavior >= GetArg("-banscore", 100))
     {
@@ -617,9 +659,88 @@ void CNode::copyStats(CNodeStats &stats)
     X(fInbound);
     X(nStartingHeight);
     X(nMisbehavior);
+    X(fFastPeer);
+    X(nPingUsecTime);
+    X(nMinPingUsecTime);
+    X(nSendBytes);
+    X(nRecvBytes);
+    {
+        LOCK(cs_msgBytes);
+        X(mapSendBytesPerMsgCmd);
+        X(mapRecvBytesPerMsgCmd);
+    }
 }
 #undef X
 
+static void CollectPeerMetrics(string& str)
+{
+    LOCK(cs_vNodes);
+    WriteMetricHeader(str, "iocoin_peers", "Connected peers.", METRIC_GAUGE);
+    str += strprintf("iocoin_peers %"PRIszu"\n", vNodes.size());
+    WriteMetricHeader(str, "iocoin_peer_received_bytes_total", "Bytes received from each peer.", METRIC_COUNTER);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        str += strprintf("iocoin_peer_received_bytes_total{peer=\"%d\",addr=\"%s\"} %"PRIu64"\n",
+                         (int)pnode->id, pnode->addr.ToString().c_str(), pnode->nRecvBytes);
+    WriteMetricHeader(str, "iocoin_peer_sent_bytes_total", "Bytes sent to each peer.", METRIC_COUNTER);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+        str += strprintf("iocoin_peer_sent_bytes_total{peer=\"%d\",addr=\"%s\"} %"PRIu64"\n",
+                         (int)pnode->id, pnode->addr.ToString().c_str(), pnode->nSendBytes);
+}
+static CMetricsCollector collectPeers(CollectPeerMetrics);
+
+// Commands counted under their own name, anything else a peer makes up is
+// lumped together so the maps stay small
+static const char* pszAccountedCommands[] =
+{
+    "addr", "alert", "block", "blocktxn", "checkorder", "checkpoint", "cmpctblock",
+    "compressed", "getaddr", "getblocks", "getblocktxn", "getdata", "getheaders", "headers", "inv",
+    "mempool", "ping", "pong", "reply", "tx", "verack", "version",
+};
+static const string strOtherCommand = "*other*";
+
+static const string& AccountedCommand(const string& strCommand)
+{
+    static vector<string> vCommands(pszAccountedCommands, pszAccountedCommands + ARRAYLEN(pszAccountedCommands));
+    BOOST_FOREACH(const string& str, vCommands)
+        if (str == strCommand)
+            return str;
+    return strOtherCommand;
+}
+
+static string GetNetMessageCommand(const CSerializeData& msg)
+{
+    // Command is the NUL padded field after the message start
+    const char* pszCommand = &msg[CMessageHeader::MESSAGE_START_SIZE];
+    return string(pszCommand, pszCommand + strnlen(pszCommand, CMessageHeader::COMMAND_SIZE));
+}
+
+void CNode::RecordSendMsg(const CSerializeData& msg)
+{
+    string strCommand = GetNetMessageCommand(msg);
+    LOCK(cs_msgBytes);
+    mapSendBytesPerMsgCmd[AccountedCommand(strCommand)] += msg.size();
+}
+
+bool IsBlockNetMessage(const CSerializeData& msg)
+{
+    string strCommand = GetNetMessageCommand(msg);
+    if (strCommand == "compressed")
+    {
+        // The inner command leads the payload, as a short string
+        unsigned int nPos = CMessageHeader::HEADER_SIZE;
+        unsigned int nLen = (unsigned char)msg[nPos];
+        if (nLen < CMessageHeader::COMMAND_SIZE && msg.size() > nPos + 1 + nLen)
+            strCommand.assign(&msg[nPos + 1], nLen);
+    }
+    return strCommand == "block" || strCommand == "cmpctblock";
+}
+
+void CNode::RecordRecvMsg(const CNetMessage& msg)
+{
+    LOCK(cs_msgBytes);
+    mapRecvBytesPerMsgCmd[AccountedCommand(msg.hdr.GetCommand())] += CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 {
@@ -642,6 +763,9 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         if (handled < 0)
                 return false;
 
+        if (msg.complete())
+            RecordRecvMsg(msg);
+
         pch += handled;
         nBytes -= handled;
     }
@@ -686,11 +810,13 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        // Allocate at least 256 KiB ahead, doubling so a large block is only
+        // moved a few times, but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, std::max(nDataPos + nCopy + 256 * 1024, (unsigned int)vRecv.size() * 2)));
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
+    hasher.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -705,23 +831,308 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 // requires LOCK(cs_vSend)
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds)
+{
+    // Exponentially distributed gaps, from a uniform draw in [0, 1)
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageIntervalSeconds * -1000000.0 + 0.5);
+}
+
+CNetMessageRef FinalizeNetMessage(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    CSerializeData* pdata = new CSerializeData();
+    ss.GetAndClear(*pdata);
+    return CNetMessageRef(pdata);
+}
+
+// Payloads smaller than this go out as they are
+static const unsigned int MIN_COMPRESS_SIZE = 256;
+
+// The last few messages compressed, so a block or transaction relayed to
+// many peers is only deflated once
+static const unsigned int MAX_COMPRESSED_CACHE = 8;
+static CCriticalSection cs_dequeCompressed;
+static deque<pair<CNetMessageRef, CNetMessageRef> > dequeCompressed;
+
+static bool IsCompressibleCommand(const string& strCommand)
+{
+    return strCommand == "block" || strCommand == "tx" || strCommand == "headers";
+}
+
+CNetMessageRef CompressNetMessage(const CNetMessageRef& msg)
+{
+    const CSerializeData& vMsg = *msg;
+    unsigned int nPayloadSize = vMsg.size() - CMessageHeader::HEADER_SIZE;
+    string strCommand = GetNetMessageCommand(vMsg);
+    if (nPayloadSize < MIN_COMPRESS_SIZE || !IsCompressibleCommand(strCommand))
+        return msg;
+
+    {
+        LOCK(cs_dequeCompressed);
+        for (deque<pair<CNetMessageRef, CNetMessageRef> >::iterator it = dequeCompressed.begin(); it != dequeCompressed.end(); ++it)
+            if ((*it).first == msg)
+                return (*it).second;
+    }
+
+    uLongf nCompressedSize = compressBound(nPayloadSize);
+    vector<unsigned char> vchCompressed(nCompressedSize);
+    CNetMessageRef msgRet = msg;
+    if (compress2(&vchCompressed[0], &nCompressedSize, (const Bytef*)&vMsg[CMessageHeader::HEADER_SIZE], nPayloadSize, Z_DEFAULT_COMPRESSION) == Z_OK &&
+        nCompressedSize + strCommand.size() + 5 < nPayloadSize)
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss.reserve(CMessageHeader::HEADER_SIZE + strCommand.size() + 5 + nCompressedSize);
+        ss << CMessageHeader("compressed", 0) << strCommand << nPayloadSize;
+        ss.write((const char*)&vchCompressed[0], nCompressedSize);
+        msgRet = FinalizeNetMessage(ss);
+        if (fDebug)
+            printf("compressed %s %u -> %u bytes\n", strCommand.c_str(), nPayloadSize, (unsigned int)nCompressedSize);
+    }
+
+    // Remember a failure too, so it isn't tried again for every peer
+    LOCK(cs_dequeCompressed);
+    dequeCompressed.push_back(make_pair(msg, msgRet));
+    if (dequeCompressed.size() > MAX_COMPRESSED_CACHE)
+        dequeCompressed.pop_front();
+    return msgRet;
+}
+
+bool DecompressNetMessage(CDataStream& vRecv, string& strCommandRet)
+{
+    string strCommand;
+    unsigned int nSize;
+    vRecv >> strCommand >> nSize;
+    if (!IsCompressibleCommand(strCommand) || nSize == 0 || nSize > MAX_SIZE)
+        return error("DecompressNetMessage() : bad %s of %u bytes", strCommand.c_str(), nSize);
+
+    CDataStream vRaw(vRecv.GetType(), vRecv.GetVersion());
+    vRaw.resize(nSize);
+    uLongf nRawSize = nSize;
+    if (vRecv.empty() ||
+        uncompress((Bytef*)&vRaw[0], &nRawSize, (const Bytef*)&vRecv[0], vRecv.size()) != Z_OK ||
+        nRawSize != nSize)
+        return error("DecompressNetMessage() : %s does not inflate to %u bytes", strCommand.c_str(), nSize);
+
+    vRecv.swap(vRaw);
+    strCommandRet = strCommand;
+    return true;
+}
+
+#ifndef WIN32
+// Most queued messages handed to one sendmsg()
+static const size_t MAX_SEND_IOV = 64;
+#endif
+
+// Totals over all peers, and the -maxuploadtarget cycle
+static CCriticalSection cs_totalBytes;
+static uint64_t nTotalBytesRecv = 0;
+static uint64_t nTotalBytesSent = 0;
+static uint64_t nMaxOutboundLimit = 0;
+static uint64_t nMaxOutboundTotalBytesSentInCycle = 0;
+static int64_t nMaxOutboundCycleStartTime = 0;
+
+static void RecordBytesRecv(uint64_t nBytes)
+{
+    LOCK(cs_totalBytes);
+    nTotalBytesRecv += nBytes;
+}
+
+static void RecordBytesSent(uint64_t nBytes)
+{
+    LOCK(cs_totalBytes);
+    nTotalBytesSent += nBytes;
+
+    int64_t nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME < nNow)
+    {
+        // Start a new cycle
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += nBytes;
+}
+
+uint64_t GetTotalBytesRecv()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesRecv;
+}
+
+uint64_t GetTotalBytesSent()
+{
+    LOCK(cs_totalBytes);
+    return nTotalBytesSent;
+}
+
+void SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytes);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytes);
+    return nMaxOutboundLimit;
+}
+
+int64_t GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+    return max((int64_t)0, nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME - GetTime());
+}
+
+bool OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServingLimit)
+    {
+        // Keep room for a block every ten minutes of what is left of the cycle
+        int64_t nTimeLeft = GetMaxOutboundTimeLeftInCycle();
+        uint64_t nBuffer = nTimeLeft / 600 * MAX_BLOCK_SIZE;
+        if (nBuffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - nBuffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytes);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+// Token bucket behind -maxsendrate, holding at most a second's worth
+static CCriticalSection cs_sendRate;
+static int64_t nMaxSendRate = 0;
+static int64_t nSendTokens = 0;
+static int64_t nSendTokensTime = 0;
+
+void SetMaxSendRate(int64_t nBytesPerSecond)
+{
+    LOCK(cs_sendRate);
+    nMaxSendRate = max((int64_t)0, nBytesPerSecond);
+    nSendTokens = nMaxSendRate;
+    nSendTokensTime = GetTimeMicros();
+}
+
+// How much of nWant may be sent now
+static size_t TakeSendAllowance(size_t nWant)
+{
+    LOCK(cs_sendRate);
+    if (nMaxSendRate == 0)
+        return nWant;
+    int64_t nNow = GetTimeMicros();
+    nSendTokens = min(nMaxSendRate, nSendTokens + (nNow - nSendTokensTime) * nMaxSendRate / 1000000);
+    nSendTokensTime = nNow;
+    size_t nAllow = min((int64_t)nWant, nSendTokens);
+    nSendTokens -= nAllow;
+    return nAllow;
+}
+
+// Give back what a short send didn't use
+static void ReturnSendAllowance(size_t nUnused)
+{
+    LOCK(cs_sendRate);
+    if (nMaxSendRate != 0)
+        nSendTokens = min(nMaxSendRate, nSendTokens + (int64_t)nUnused);
+}
+
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CNetMessageRef>::iterator it = pnode->vSendMsg.begin();
+    pnode->fSendThrottled = false;
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        size_t nWant = data.size() - pnode->nSendOffset;
+        size_t nAllow = pnode->fFastPeer ? nWant : TakeSendAllowance(nWant);
+        if (nAllow == 0) {
+            pnode->fSendThrottled = true;
+            break;
+        }
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nAllow, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as much of the queue as one call takes, straight out of
+        // the (possibly shared) message buffers
+        struct iovec iov[MAX_SEND_IOV];
+        size_t nIov = 0;
+        size_t nWant = 0;
+        for (std::deque<CNetMessageRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++itIov, ++nIov)
+        {
+            const CSerializeData &data = **itIov;
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nWant += iov[nIov].iov_len;
+        }
+        size_t nAllow = pnode->fFastPeer ? nWant : TakeSendAllowance(nWant);
+        if (nAllow == 0) {
+            pnode->fSendThrottled = true;
+            break;
+        }
+        if (nAllow < nWant) {
+            // Cut the gather list down to what the rate limit allows
+            size_t nTotal = 0;
+            size_t i = 0;
+            while (nTotal + iov[i].iov_len < nAllow)
+                nTotal += iov[i++].iov_len;
+            iov[i].iov_len = nAllow - nTotal;
+            nIov = i + 1;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (!pnode->fFastPeer)
+            ReturnSendAllowance(nAllow - (size_t)max(nBytes, 0));
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
-            pnode->nSendOffset += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            pnode->nSendBytes += nBytes;
+            RecordBytesSent(nBytes);
+            // Retire every message the call finished
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nMsgLeft = (*it)->size() - pnode->nSendOffset;
+                if (nLeft < nMsgLeft) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nMsgLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
+            }
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
+                if ((size_t)nBytes == nAllow && nAllow < nWant)
+                    pnode->fSendThrottled = true;
                 break;
             }
         } else {
@@ -746,6 +1157,111 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+static bool CompareNetGroupKeyed(const CNodeEvictionCandidate& a, const CNodeEvictionCandidate& b)
+{
+    return a.nKeyedNetGroup < b.nKeyedNetGroup;
+}
+
+static bool ReverseCompareNodeMinPingTime(const CNodeEvictionCandidate& a, const CNodeEvictionCandidate& b)
+{
+    return a.nMinPingUsecTime > b.nMinPingUsecTime;
+}
+
+static bool ReverseCompareNodeTimeConnected(const CNodeEvictionCandidate& a, const CNodeEvictionCandidate& b)
+{
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool CompareNodeBlockTime(const CNodeEvictionCandidate& a, const CNodeEvictionCandidate& b)
+{
+    if (a.nLastBlockTime != b.nLastBlockTime)
+        return a.nLastBlockTime < b.nLastBlockTime;
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool CompareNodeTXTime(const CNodeEvictionCandidate& a, const CNodeEvictionCandidate& b)
+{
+    if (a.nLastTXTime != b.nLastTXTime)
+        return a.nLastTXTime < b.nLastTXTime;
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+// Sort by comparer and keep the k that come last out of the running
+static void ProtectLastK(vector<CNodeEvictionCandidate>& vCandidates, bool (*comparer)(const CNodeEvictionCandidate&, const CNodeEvictionCandidate&), size_t k)
+{
+    sort(vCandidates.begin(), vCandidates.end(), comparer);
+    vCandidates.erase(vCandidates.end() - min(k, vCandidates.size()), vCandidates.end());
+}
+
+bool SelectNodeToEvict(vector<CNodeEvictionCandidate> vCandidates, NodeId& idRet)
+{
+    // Protect the peers an attacker can't cheaply imitate: a spread of
+    // netgroups, the lowest latency, and the last to give us new
+    // transactions and blocks; then half of the rest, the longest connected
+    ProtectLastK(vCandidates, CompareNetGroupKeyed, 4);
+    ProtectLastK(vCandidates, ReverseCompareNodeMinPingTime, 8);
+    ProtectLastK(vCandidates, CompareNodeTXTime, 4);
+    ProtectLastK(vCandidates, CompareNodeBlockTime, 4);
+    ProtectLastK(vCandidates, ReverseCompareNodeTimeConnected, vCandidates.size() / 2);
+    if (vCandidates.empty())
+        return false;
+
+    // Of the netgroup with the most connections left, the youngest goes.
+    // vCandidates is newest first, so each group's is too.
+    map<uint64_t, vector<CNodeEvictionCandidate> > mapNetGroupNodes;
+    BOOST_FOREACH(const CNodeEvictionCandidate& candidate, vCandidates)
+        mapNetGroupNodes[candidate.nKeyedNetGroup].push_back(candidate);
+
+    const vector<CNodeEvictionCandidate>* pvGroup = NULL;
+    for (map<uint64_t, vector<CNodeEvictionCandidate> >::const_iterator mi = mapNetGroupNodes.begin(); mi != mapNetGroupNodes.end(); ++mi)
+    {
+        const vector<CNodeEvictionCandidate>& vGroup = (*mi).second;
+        if (!pvGroup || vGroup.size() > pvGroup->size() ||
+            (vGroup.size() == pvGroup->size() && vGroup[0].nTimeConnected > (*pvGroup)[0].nTimeConnected))
+            pvGroup = &vGroup;
+    }
+    idRet = (*pvGroup)[0].id;
+    return true;
+}
+
+// Disconnect an inbound peer to make room for a new one
+static bool AttemptToEvictConnection()
+{
+    // Netgroups are compared through a keyed hash, so which ones are
+    // protected can't be predicted from outside
+    static uint64_t nNetGroupKey = GetRand(std::numeric_limits<uint64_t>::max());
+
+    LOCK(cs_vNodes);
+    vector<CNodeEvictionCandidate> vCandidates;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (!pnode->fInbound || pnode->fFastPeer || pnode->fDisconnect)
+            continue;
+        CNodeEvictionCandidate candidate;
+        candidate.id = pnode->id;
+        candidate.nTimeConnected = pnode->nTimeConnected;
+        candidate.nMinPingUsecTime = pnode->nMinPingUsecTime;
+        candidate.nLastBlockTime = pnode->nLastBlockTime;
+        candidate.nLastTXTime = pnode->nLastTXTime;
+        candidate.nKeyedNetGroup = (CHashWriter(SER_GETHASH, 0) << nNetGroupKey << pnode->addr.GetGroup()).GetHash().Get64();
+        vCandidates.push_back(candidate);
+    }
+
+    NodeId id;
+    if (!SelectNodeToEvict(vCandidates, id))
+        return false;
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->id == id)
+        {
+            printf("evicting peer %s to make room\n", pnode->addr.ToString().c_str());
+            pnode->fDisconnect = true;
+            return true;
+        }
+    }
+    return false;
+}
+
 void ThreadSocketHandler(void* parg)
 {
     // Make this thread recognisable as the networking thread
@@ -769,10 +1285,14 @@ void ThreadSocketHandler(void* parg)
 
 void ThreadSocketHandler2(void* parg)
 {
-    printf("ThreadSocketHandler started\n");
+    CSocketPoller poller;
+    printf("ThreadSocketHandler started, waiting with %s\n", poller.GetName());
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
 
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        poller.Add(hListenSocket, false);
+
     while (true)
     {
         //
@@ -823,7 +1343,14 @@ void ThreadSocketHandler2(void* parg)
                                 {
                                     TRY_LOCK(pnode->cs_inventory, lockInv);
                                     if (lockInv)
-                                        fDelete = true;
+                                    {
+                                        TRY_LOCK(cs_main, lockMain);
+                                        if (lockMain)
+                                        {
+                                            FinalizeNode(pnode->id);
+                                            fDelete = true;
+                                        }
+                                    }
                                 }
                             }
                         }
@@ -844,66 +1371,74 @@ void ThreadSocketHandler2(void* parg)
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for sockets to become ready. Peers are watched edge-triggered
+        // where the poller can, and keep fPollRecv and fPollSend set until
+        // recv() or send() would block, so idle ones cost nothing here.
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            poller.Want(hListenSocket, CSocketPoller::POLL_RECV);
+        map<SOCKET, CNode*> mapSocketNode;
+        bool fBusy = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fPollAdded)
             {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend) {
-                        // do not read, if draining write queue
-                        if (!pnode->vSendMsg.empty())
-                            FD_SET(pnode->hSocket, &fdsetSend);
-                        else
-                            FD_SET(pnode->hSocket, &fdsetRecv);
-                        FD_SET(pnode->hSocket, &fdsetError);
-                        hSocketMax = max(hSocketMax, pnode->hSocket);
-                        have_fds = true;
-                    }
-                }
+                pnode->fPollAdded = true;
+                if (!poller.Add(pnode->hSocket, true))
+                    pnode->CloseSocketDisconnect();
             }
+            mapSocketNode[pnode->hSocket] = pnode;
+
+            // do not read, if draining write queue
+            bool fSending = !pnode->vSendMsg.empty();
+            if ((pnode->fPollSend && fSending) || (pnode->fPollRecv && !fSending))
+                fBusy = true;
+            int nWant = 0;
+            if (fSending && !pnode->fPollSend)
+                nWant |= CSocketPoller::POLL_SEND;
+            if (!fSending && !pnode->fPollRecv)
+                nWant |= CSocketPoller::POLL_RECV;
+            poller.Want(pnode->hSocket, nWant);
         }
 
+        // Readiness left over from last round is served again soon
+        vector<pair<SOCKET, int> > vReady;
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        poller.Wait(fBusy ? 10 : 50, vReady);
         vnThreadsRunning[THREAD_SOCKETHANDLER]++;
         if (fShutdown)
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
             return;
-        if (nSelect == SOCKET_ERROR)
+        }
+
+        set<SOCKET> setListenReady;
+        for (unsigned int i = 0; i < vReady.size(); i++)
         {
-            if (have_fds)
+            SOCKET hSocket = vReady[i].first;
+            int nReady = vReady[i].second;
+            map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(hSocket);
+            if (mi != mapSocketNode.end())
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                if (nReady & CSocketPoller::POLL_RECV)
+                    mi->second->fPollRecv = true;
+                if (nReady & CSocketPoller::POLL_SEND)
+                    mi->second->fPollSend = true;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            else if (nReady & CSocketPoller::POLL_RECV)
+                setListenReady.insert(hSocket);
         }
 
 
@@ -911,7 +1446,7 @@ void ThreadSocketHandler2(void* parg)
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        if (hListenSocket != INVALID_SOCKET && setListenReady.count(hListenSocket))
         {
             struct sockaddr_storage sockaddr;
             socklen_t len = sizeof(sockaddr);
@@ -936,13 +1471,15 @@ void ThreadSocketHandler2(void* parg)
                 if (nErr != WSAEWOULDBLOCK)
                     printf("socket error accept failed: %d\n", nErr);
             }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+            else if (CNode::IsBanned(addr))
             {
+                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
                 closesocket(hSocket);
             }
-            else if (CNode::IsBanned(addr))
+            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS && !IsFastPeer(addr) &&
+                     !AttemptToEvictConnection())
             {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+                printf("connection from %s dropped (full)\n", addr.ToString().c_str());
                 closesocket(hSocket);
             }
             else
@@ -961,24 +1498,17 @@ void ThreadSocketHandler2(void* parg)
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
-                return;
+                break;
 
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fPollRecv && pnode->vSendMsg.empty())
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -996,7 +1526,14 @@ void ThreadSocketHandler2(void* parg)
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
+                            else if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+                                WakeMessageHandler(pnode);
                             pnode->nLastRecv = GetTime();
+                            pnode->nRecvBytes += nBytes;
+                            RecordBytesRecv(nBytes);
+                            // A short read drained the socket
+                            if (nBytes < (int)sizeof(pchBuf))
+                                pnode->fPollRecv = false;
                         }
                         else if (nBytes == 0)
                         {
@@ -1009,7 +1546,9 @@ void ThreadSocketHandler2(void* parg)
                         {
                             // error
                             int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                            if (nErr == WSAEWOULDBLOCK)
+                                pnode->fPollRecv = false;
+                            else if (nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                             {
                                 if (!pnode->fDisconnect)
                                     printf("socket recv error %d\n", nErr);
@@ -1025,11 +1564,17 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (pnode->fPollSend && !pnode->vSendMsg.empty())
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
                     SocketSendData(pnode);
+                    // Whatever is left waits for the socket to drain, or
+                    // for -maxsendrate to allow more in a later round
+                    if (!pnode->vSendMsg.empty() && !pnode->fSendThrottled)
+                        pnode->fPollSend = false;
+                }
             }
 
             //
@@ -1061,8 +1606,8 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        MilliSleep(10);
+        if (fShutdown)
+            return;
     }
 }
 
@@ -1205,7 +1750,7 @@ void MapPort()
 {
     if (fUseUPnP && vnThreadsRunning[THREAD_UPNP] < 1)
     {
-        if (!NewThread(ThreadMapPort, NULL))
+        if (!NewThread(ThreadMapPort, NULL, THREADPOOL_NETWORK))
             printf("Error: ThreadMapPort(ThreadMapPort) failed\n");
     }
 }
@@ -1216,19 +1761,139 @@ void MapPort()
 }
 #endif
 
-void DumpAddresses()
-{
-    int64_t nStart = GetTimeMillis();
 
-    CAddrDB adb;
-    adb.Write(addrman);
 
-    printf("Flushed %d addresses to peers.dat  %"PRId64"ms\n",
-           addrman.size(), GetTimeMillis() - nStart);
-}
 
-void ThreadDumpAddress2(void* parg)
-{
+
+
+// DNS seeds are the -dnsseednode hosts. Each one is looked up on a thread
+// of its own, so a slow or dead seed doesn't hold up the others, and
+// whatever they return goes straight into addrman.
+static const int DNSSEED_TIMEOUT = 30;
+static CCriticalSection cs_nDNSSeedPending;
+static int nDNSSeedPending = 0;
+static int nDNSSeedFound = 0;
+
+void ThreadDNSSeedLookup(void* parg)
+{
+    RenameThread("iocoin-dnslookup");
+    std::string* pstrSeed = (std::string*)parg;
+    vnThreadsRunning[THREAD_DNSSEED]++;
+
+    int nFound = 0;
+    try
+    {
+        vector<CNetAddr> vIPs;
+        if (LookupHost(pstrSeed->c_str(), vIPs) && !fShutdown)
+        {
+            vector<CAddress> vAdd;
+            BOOST_FOREACH(CNetAddr& ip, vIPs)
+            {
+                // Seen a few days ago, so they don't crowd out addresses
+                // learned from peers
+                CAddress addr = CAddress(CService(ip, GetDefaultPort()));
+                addr.nTime = GetTime() - 3*24*60*60 - GetRand(4*24*60*60);
+                vAdd.push_back(addr);
+            }
+            if (!vAdd.empty())
+                addrman.Add(vAdd, vIPs[0]);
+            nFound = vAdd.size();
+        }
+        printf("DNS seed %s: %d addresses\n", pstrSeed->c_str(), nFound);
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadDNSSeedLookup()");
+    }
+
+    {
+        LOCK(cs_nDNSSeedPending);
+        nDNSSeedPending--;
+        nDNSSeedFound += nFound;
+    }
+    delete pstrSeed;
+    vnThreadsRunning[THREAD_DNSSEED]--;
+}
+
+void ThreadDNSAddressSeed2(void* parg)
+{
+    // Peers from a previous run are as good a start, and less load on the seeds
+    if (addrman.size() > 0 && !GetBoolArg("-forcednsseed"))
+    {
+        printf("Loaded %d addresses, skipping DNS seeding\n", addrman.size());
+        return;
+    }
+
+    int64_t nStart = GetTime();
+    BOOST_FOREACH(const string& strSeed, mapMultiArgs["-dnsseednode"])
+    {
+        {
+            LOCK(cs_nDNSSeedPending);
+            nDNSSeedPending++;
+        }
+        if (!NewThread(ThreadDNSSeedLookup, new string(strSeed), THREADPOOL_NETWORK))
+        {
+            printf("Error: NewThread(ThreadDNSSeedLookup) failed\n");
+            LOCK(cs_nDNSSeedPending);
+            nDNSSeedPending--;
+        }
+    }
+
+    // Lookups still out after DNSSEED_TIMEOUT finish on their own
+    while (!fShutdown && GetTime() - nStart < DNSSEED_TIMEOUT)
+    {
+        {
+            LOCK(cs_nDNSSeedPending);
+            if (nDNSSeedPending == 0)
+                break;
+        }
+        vnThreadsRunning[THREAD_DNSSEED]--;
+        MilliSleep(100);
+        vnThreadsRunning[THREAD_DNSSEED]++;
+    }
+
+    LOCK(cs_nDNSSeedPending);
+    printf("%d addresses found from DNS seeds in %"PRId64"s, %d lookups pending\n", nDNSSeedFound, GetTime() - nStart, nDNSSeedPending);
+}
+
+void ThreadDNSAddressSeed(void* parg)
+{
+    // Make this thread recognisable as the DNS seeding thread
+    RenameThread("iocoin-dnsseed");
+
+    try
+    {
+        vnThreadsRunning[THREAD_DNSSEED]++;
+        ThreadDNSAddressSeed2(parg);
+        vnThreadsRunning[THREAD_DNSSEED]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_DNSSEED]--;
+        PrintException(&e, "ThreadDNSAddressSeed()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_DNSSEED]--;
+        throw; // support pthread_cancel()
+    }
+    printf("ThreadDNSAddressSeed exited\n");
+}
+
+
+
+
+
+
+void DumpAddresses()
+{
+    int64_t nStart = GetTimeMillis();
+
+    CAddrDB adb;
+    adb.Write(addrman);
+
+    printf("Flushed %d addresses to peers.dat  %"PRId64"ms\n",
+           addrman.size(), GetTimeMillis() - nStart);
+}
+
+void ThreadDumpAddress2(void* parg)
+{
     vnThreadsRunning[THREAD_DUMPADDRESS]++;
     while (!fShutdown)
     {
@@ -1314,6 +1979,263 @@ void static ThreadStakeMiner(void* parg)
     printf("ThreadStakeMiner exiting, %d threads remaining\n", vnThreadsRunning[THREAD_STAKE_MINER]);
 }
 
+/** An outbound connection that hasn't completed yet: a connect() under
+ *  way, then for a proxied one the SOCKS exchange. Sockets of the proxy
+ *  pool are ones too, without a destination or a grant until taken. */
+struct CPendingConnection
+{
+    CAddress addr;
+    SOCKET hSocket;
+    int64_t nStartTime;
+    CSemaphoreGrant grant;
+    bool fConnecting;
+    CService addrProxy;
+    boost::shared_ptr<CSocksHandshake> psocks;
+
+    CPendingConnection() : hSocket(INVALID_SOCKET), nStartTime(0), fConnecting(false) {}
+};
+
+// Time a proxy gets to set up a stream, which over Tor means finding a
+// circuit; and how long a pooled proxy socket is kept before it is
+// replaced, well within the two minutes Tor lets a greeted socket wait
+static const int64_t PROXY_CONNECT_TIMEOUT = 30000;
+static const int64_t PROXY_POOL_MAX_AGE = 60000;
+// Pooled sockets per SOCKS5 proxy (-proxypool), and how often the pool
+// is topped up, so that a proxy that is down isn't hammered
+static const int DEFAULT_PROXY_POOL = 2;
+static const int64_t PROXY_POOL_REFILL_DELAY = 5000;
+
+static void AddPendingConnection(CPendingConnection& conn)
+{
+    CNode* pnode = AddConnectedNode(conn.hSocket, conn.addr, NULL);
+    conn.grant.MoveTo(pnode->grantOutbound);
+    pnode->fNetworkNode = true;
+}
+
+// Start a connection to addrConnect without waiting for it. Proxied ones
+// take a pooled proxy socket that is past the greeting if there is one.
+static void StartOutboundConnection(const CAddress& addrConnect, CSemaphoreGrant& grant, list<CPendingConnection>& listPending, list<CPendingConnection>& listProxyPool)
+{
+    if (IsLocal(addrConnect) || FindNode((CNetAddr)addrConnect) || CNode::IsBanned(addrConnect) ||
+        FindNode(addrConnect.ToStringIPPort().c_str()))
+        return;
+
+    /// debug print
+    printf("trying connection %s lastseen=%.1fhrs\n",
+        addrConnect.ToString().c_str(), (double)(GetAdjustedTime() - addrConnect.nTime)/3600.0);
+
+    addrman.Attempt(addrConnect);
+    proxyType proxy;
+    bool fProxy = GetProxy(addrConnect.GetNetwork(), proxy);
+    if (fProxy)
+    {
+        for (list<CPendingConnection>::iterator it = listProxyPool.begin(); it != listProxyPool.end(); it++)
+        {
+            if (it->addrProxy != proxy.first || it->psocks->GetVersion() != proxy.second ||
+                it->psocks->GetState() != CSocksHandshake::SOCKS_IDLE)
+                continue;
+            listPending.splice(listPending.end(), listProxyPool, it);
+            CPendingConnection& conn = listPending.back();
+            conn.addr = addrConnect;
+            conn.nStartTime = GetTimeMillis();
+            grant.MoveTo(conn.grant);
+            if (!conn.psocks->SetDestination(addrConnect))
+            {
+                closesocket(conn.hSocket);
+                listPending.pop_back();
+            }
+            return;
+        }
+    }
+
+    SOCKET hSocket;
+    bool fInProgress;
+    if (!ConnectSocketStart(fProxy ? proxy.first : (CService)addrConnect, hSocket, fInProgress))
+        return;
+    if (!fInProgress && !fProxy)
+    {
+        CNode* pnode = AddConnectedNode(hSocket, addrConnect, NULL);
+        grant.MoveTo(pnode->grantOutbound);
+        pnode->fNetworkNode = true;
+        return;
+    }
+
+    listPending.push_back(CPendingConnection());
+    CPendingConnection& conn = listPending.back();
+    conn.addr = addrConnect;
+    conn.hSocket = hSocket;
+    conn.nStartTime = GetTimeMillis();
+    conn.fConnecting = fInProgress;
+    grant.MoveTo(conn.grant);
+    if (fProxy)
+    {
+        conn.addrProxy = proxy.first;
+        conn.psocks.reset(new CSocksHandshake(proxy.second));
+        if (!conn.psocks->SetDestination(addrConnect))
+        {
+            closesocket(hSocket);
+            listPending.pop_back();
+        }
+    }
+}
+
+// Keep nPoolSize greeted sockets open to each SOCKS5 proxy outbound
+// connections go through, so that a connection over it costs the CONNECT
+// request alone
+static void FillProxyPool(list<CPendingConnection>& listProxyPool, int nPoolSize)
+{
+    set<CService> setProxies;
+    const enum Network nets[] = { NET_IPV4, NET_IPV6, NET_TOR };
+    for (unsigned int i = 0; i < ARRAYLEN(nets); i++)
+    {
+        proxyType proxy;
+        if (GetProxy(nets[i], proxy) && proxy.second == 5 && !IsLimited(nets[i]))
+            setProxies.insert(proxy.first);
+    }
+
+    BOOST_FOREACH(const CService& addrProxy, setProxies)
+    {
+        int nPooled = 0;
+        BOOST_FOREACH(const CPendingConnection& conn, listProxyPool)
+            if (conn.addrProxy == addrProxy)
+                nPooled++;
+        for (; nPooled < nPoolSize; nPooled++)
+        {
+            SOCKET hSocket;
+            bool fInProgress;
+            if (!ConnectSocketStart(addrProxy, hSocket, fInProgress))
+                break;
+            listProxyPool.push_back(CPendingConnection());
+            CPendingConnection& conn = listProxyPool.back();
+            conn.hSocket = hSocket;
+            conn.nStartTime = GetTimeMillis();
+            conn.fConnecting = fInProgress;
+            conn.addrProxy = addrProxy;
+            conn.psocks.reset(new CSocksHandshake(5));
+        }
+    }
+}
+
+// Move a pending connection on after select(); false once it is done with,
+// when it has become a node or failed and its socket is closed
+static bool AdvancePendingConnection(CPendingConnection& conn, bool fRead, bool fWrite, bool fError, int64_t nNow)
+{
+    string strName = conn.addr.IsValid() ? conn.addr.ToString() : "proxy pool";
+    if (conn.fConnecting)
+    {
+        string strConnect = conn.psocks ? conn.addrProxy.ToString() : strName;
+        if (!fWrite && !fError)
+        {
+            if (nNow - conn.nStartTime <= nConnectTimeout)
+                return true;
+            printf("connection to %s timed out\n", strConnect.c_str());
+            closesocket(conn.hSocket);
+            return false;
+        }
+        int nErr = ConnectSocketFinish(conn.hSocket);
+        if (nErr != 0 || fShutdown)
+        {
+            printf("connect() to %s failed: %s\n", strConnect.c_str(), strerror(nErr));
+            closesocket(conn.hSocket);
+            return false;
+        }
+        conn.fConnecting = false;
+        if (!conn.psocks)
+        {
+            AddPendingConnection(conn);
+            return false;
+        }
+        // Connected to the proxy: the greeting or request can go out now
+        fWrite = true;
+    }
+
+    CSocksHandshake::State state = conn.psocks->GetState();
+    // An idle pooled socket only needs looking at if the proxy hung up
+    if (state != CSocksHandshake::SOCKS_IDLE ? (fRead || fWrite || fError) : (fRead || fError))
+        state = conn.psocks->Advance(conn.hSocket);
+
+    if (state == CSocksHandshake::SOCKS_DONE && !fShutdown)
+    {
+        printf("SOCKS%d connected %s\n", conn.psocks->GetVersion(), strName.c_str());
+        AddPendingConnection(conn);
+        return false;
+    }
+    if (state == CSocksHandshake::SOCKS_FAILED)
+    {
+        printf("SOCKS%d connection to %s failed: %s\n", conn.psocks->GetVersion(), strName.c_str(), conn.psocks->GetError().c_str());
+        closesocket(conn.hSocket);
+        return false;
+    }
+    if (nNow - conn.nStartTime > (state == CSocksHandshake::SOCKS_IDLE ? PROXY_POOL_MAX_AGE : PROXY_CONNECT_TIMEOUT))
+    {
+        if (state != CSocksHandshake::SOCKS_IDLE)
+            printf("SOCKS%d connection to %s timed out\n", conn.psocks->GetVersion(), strName.c_str());
+        closesocket(conn.hSocket);
+        return false;
+    }
+    return true;
+}
+
+// Wait up to nTimeout ms for pending connects and SOCKS exchanges, pooled
+// ones included; the ones that complete become nodes, failed and timed out
+// ones are dropped
+static void WaitPendingConnections(list<CPendingConnection>& listPending, list<CPendingConnection>& listProxyPool, int nTimeout)
+{
+    if (listPending.empty() && listProxyPool.empty())
+    {
+        MilliSleep(nTimeout);
+        return;
+    }
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    list<CPendingConnection>* lists[] = { &listPending, &listProxyPool };
+    for (unsigned int i = 0; i < ARRAYLEN(lists); i++)
+    {
+        BOOST_FOREACH(const CPendingConnection& conn, *lists[i])
+        {
+            if (conn.fConnecting || conn.psocks->WantWrite())
+                FD_SET(conn.hSocket, &fdsetSend);
+            if (!conn.fConnecting)
+                FD_SET(conn.hSocket, &fdsetRecv);
+            FD_SET(conn.hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, conn.hSocket);
+        }
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        printf("select() for pending connections failed: %i\n", WSAGetLastError());
+        MilliSleep(nTimeout);
+        FD_ZERO(&fdsetRecv);
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+    }
+
+    int64_t nNow = GetTimeMillis();
+    for (unsigned int i = 0; i < ARRAYLEN(lists); i++)
+    {
+        list<CPendingConnection>::iterator it = lists[i]->begin();
+        while (it != lists[i]->end())
+        {
+            SOCKET hSocket = it->hSocket;
+            if (AdvancePendingConnection(*it, FD_ISSET(hSocket, &fdsetRecv), FD_ISSET(hSocket, &fdsetSend), FD_ISSET(hSocket, &fdsetError), nNow))
+                it++;
+            else
+                lists[i]->erase(it++);
+        }
+    }
+}
+
 void ThreadOpenConnections2(void* parg)
 {
     printf("ThreadOpenConnections started\n");
@@ -1340,23 +2262,41 @@ void ThreadOpenConnections2(void* parg)
     }
 
     // Initiate network connections
-    int64_t nStart = GetTime();
+    list<CPendingConnection> listPending;
+    list<CPendingConnection> listProxyPool;
+    const int nProxyPool = max(0, (int)GetArg("-proxypool", DEFAULT_PROXY_POOL));
+    int64_t nLastConnectStart = 0;
+    int64_t nLastProxyPoolFill = 0;
+    bool fLastIPv6 = false;
     while (true)
     {
         ProcessOneShot();
+        if (nProxyPool > 0 && GetTimeMillis() - nLastProxyPoolFill >= PROXY_POOL_REFILL_DELAY)
+        {
+            nLastProxyPoolFill = GetTimeMillis();
+            FillProxyPool(listProxyPool, nProxyPool);
+        }
 
+        // Finish connects under way, or rest half a second if there are none
         vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        MilliSleep(500);
+        WaitPendingConnections(listPending, listProxyPool, listPending.empty() ? 500 : CONNECT_ATTEMPT_DELAY);
         vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
         if (fShutdown)
+        {
+            BOOST_FOREACH(CPendingConnection& conn, listPending)
+                closesocket(conn.hSocket);
+            BOOST_FOREACH(CPendingConnection& conn, listProxyPool)
+                closesocket(conn.hSocket);
             return;
+        }
 
-
-        vnThreadsRunning[THREAD_OPENCONNECTIONS]--;
-        CSemaphoreGrant grant(*semOutbound);
-        vnThreadsRunning[THREAD_OPENCONNECTIONS]++;
-        if (fShutdown)
-            return;
+        // Another attempt joins the race every CONNECT_ATTEMPT_DELAY ms,
+        // as long as there are outbound slots to fill
+        if (listPending.size() >= MAX_PENDING_CONNECTIONS || GetTimeMillis() - nLastConnectStart < CONNECT_ATTEMPT_DELAY)
+            continue;
+        CSemaphoreGrant grant(*semOutbound, true);
+        if (!grant)
+            continue;
 
         //
         // Choose an address to connect to based on most recently seen
@@ -1376,6 +2316,12 @@ void ThreadOpenConnections2(void* parg)
                 }
             }
         }
+        BOOST_FOREACH(const CPendingConnection& conn, listPending)
+            setConnected.insert(conn.addr.GetGroup());
+
+        // With both reachable, IPv4 and IPv6 take turns, so one that is
+        // broken here can't hold up every attempt
+        bool fAlternate = IsReachable(CNetAddr("1.2.3.4")) && IsReachable(CNetAddr("2001:db8::1"));
 
         int64_t nANow = GetAdjustedTime();
 
@@ -1407,12 +2353,19 @@ void ThreadOpenConnections2(void* parg)
             if (addr.GetPort() != GetDefaultPort() && nTries < 50)
                 continue;
 
+            if (fAlternate && addr.IsIPv6() == fLastIPv6 && nTries < 20)
+                continue;
+
             addrConnect = addr;
             break;
         }
 
         if (addrConnect.IsValid())
-            OpenNetworkConnection(addrConnect, &grant);
+        {
+            fLastIPv6 = addrConnect.IsIPv6();
+            nLastConnectStart = GetTimeMillis();
+            StartOutboundConnection(addrConnect, grant, listPending, listProxyPool);
+        }
     }
 }
 
@@ -1568,65 +2521,139 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+// Peers wait on dequeMsgProc for a message handler worker, which has each
+// to itself from QUEUED to RUNNING until it is done. A peer is queued when
+// a message of its completes and, every MSGPROC_TICK_MS, for SendMessages.
+enum
+{
+    MSGPROC_IDLE,
+    MSGPROC_QUEUED,
+    MSGPROC_RUNNING,
+    // Woken while running, queued again when done
+    MSGPROC_AGAIN,
+};
+
+static const int64_t MSGPROC_TICK_MS = 100;
+
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+static deque<CNode*> dequeMsgProc;
+static int64_t nNextMsgProcTick = 0;
+static CMetric metricMsgProcQueue("iocoin_net_msghandler_queue", "Peers waiting for a message handler worker.", METRIC_GAUGE);
+
+// requires LOCK(cs_vNodes) and mutexMsgProc
+static void QueueMessageHandler(CNode* pnode)
+{
+    if (pnode->nMsgProcState == MSGPROC_IDLE)
+    {
+        pnode->nMsgProcState = MSGPROC_QUEUED;
+        pnode->AddRef();
+        dequeMsgProc.push_back(pnode);
+        metricMsgProcQueue.Set(dequeMsgProc.size());
+        condMsgProc.notify_one();
+    }
+    else if (pnode->nMsgProcState == MSGPROC_RUNNING)
+        pnode->nMsgProcState = MSGPROC_AGAIN;
+}
+
+void WakeMessageHandler(CNode* pnode)
+{
+    LOCK(cs_vNodes);
+    boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+    QueueMessageHandler(pnode);
+}
+
 void ThreadMessageHandler2(void* parg)
 {
     printf("ThreadMessageHandler started\n");
-    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
-        vector<CNode*> vNodesCopy;
+        CNode* pnode = NULL;
+        bool fTrickle = false;
+        bool fTick = false;
+        bool fMore = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            int64_t nNow = GetTimeMillis();
+            if (dequeMsgProc.empty() && nNow < nNextMsgProcTick)
+            {
+                // Reduce vnThreadsRunning so StopNode has permission to exit while
+                // we're waiting, but we must always check fShutdown after doing this.
+                vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
+                condMsgProc.timed_wait(lock, boost::posix_time::milliseconds(nNextMsgProcTick - nNow));
+                vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
+            }
+            if (!dequeMsgProc.empty())
+            {
+                pnode = dequeMsgProc.front();
+                dequeMsgProc.pop_front();
+                metricMsgProcQueue.Set(dequeMsgProc.size());
+                pnode->nMsgProcState = MSGPROC_RUNNING;
+                fTrickle = pnode->fMsgProcTrickle;
+                pnode->fMsgProcTrickle = false;
+            }
+            else if (GetTimeMillis() >= nNextMsgProcTick)
+            {
+                nNextMsgProcTick = GetTimeMillis() + MSGPROC_TICK_MS;
+                fTick = true;
+            }
         }
+        if (fShutdown)
+            return;
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        // Every peer gets a SendMessages() per tick, one of them trickles
+        if (fTick)
         {
-            if (pnode->fDisconnect)
-                continue;
+            if (fRequestShutdown)
+                StartShutdown();
+            LOCK(cs_vNodes);
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            BOOST_FOREACH(CNode* pnodeQueue, vNodes)
+                QueueMessageHandler(pnodeQueue);
+            if (!vNodes.empty())
+                vNodes[GetRand(vNodes.size())]->fMsgProcTrickle = true;
+            continue;
+        }
+        if (!pnode)
+            continue;
 
+        if (!pnode->fDisconnect)
+        {
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                    if (!ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
+                LOCK(pnode->cs_vRecvMsg);
+                if (!ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
+                // Come back to a getdata backlog after the other peers
+                // waiting, rather than at the next tick
+                fMore = !pnode->vRecvGetData.empty() && pnode->nSendSize < SendBufferSize();
             }
-            if (fShutdown)
-                return;
 
             // Send messages
+            if (!fShutdown)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    SendMessages(pnode, pnode == pnodeTrickle);
+                    SendMessages(pnode, fTrickle);
             }
-            if (fShutdown)
-                return;
         }
 
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            if (pnode->nMsgProcState == MSGPROC_AGAIN || (fMore && !pnode->fDisconnect))
+            {
+                pnode->nMsgProcState = MSGPROC_QUEUED;
+                dequeMsgProc.push_back(pnode);
+                metricMsgProcQueue.Set(dequeMsgProc.size());
+                condMsgProc.notify_one();
+            }
+            else
+            {
+                pnode->nMsgProcState = MSGPROC_IDLE;
                 pnode->Release();
+            }
         }
-
-        // Wait and allow messages to bunch up.
-        // Reduce vnThreadsRunning so StopNode has permission to exit while
-        // we're sleeping, but we must always check fShutdown after doing this.
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
-        if (fRequestShutdown)
-            StartShutdown();
-        vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
-        if (fShutdown)
-            return;
     }
 }
 
@@ -1791,7 +2818,7 @@ void static Discover()
 
     // Don't use external IPv4 discovery, when -onlynet="IPv6"
     if (!IsLimited(NET_IPV4))
-        NewThread(ThreadGetMyExternalIP, NULL);
+        NewThread(ThreadGetMyExternalIP, NULL, THREADPOOL_NETWORK);
 }
 
 void StartNode(void* parg)
@@ -1818,28 +2845,37 @@ void StartNode(void* parg)
     if (fUseUPnP)
         MapPort();
 
+    if (!GetBoolArg("-dnsseed", true) || mapMultiArgs["-dnsseednode"].empty())
+        printf("DNS seeding disabled\n");
+    else
+        if (!NewThread(ThreadDNSAddressSeed, NULL, THREADPOOL_NETWORK))
+            printf("Error: NewThread(ThreadDNSAddressSeed) failed\n");
+
     // Get addresses from IRC and advertise ours
-    if (!NewThread(ThreadIRCSeed, NULL))
-        printf("Error: NewThread(ThreadIRCSeed) failed\n");
+    if (GetBoolArg("-irc", false))
+        if (!NewThread(ThreadIRCSeed, NULL, THREADPOOL_NETWORK))
+            printf("Error: NewThread(ThreadIRCSeed) failed\n");
 
     // Send and receive from sockets, accept connections
-    if (!NewThread(ThreadSocketHandler, NULL))
+    if (!NewThread(ThreadSocketHandler, NULL, THREADPOOL_NETWORK))
         printf("Error: NewThread(ThreadSocketHandler) failed\n");
 
     // Initiate outbound connections from -addnode
-    if (!NewThread(ThreadOpenAddedConnections, NULL))
+    if (!NewThread(ThreadOpenAddedConnections, NULL, THREADPOOL_NETWORK))
         printf("Error: NewThread(ThreadOpenAddedConnections) failed\n");
 
     // Initiate outbound connections
-    if (!NewThread(ThreadOpenConnections, NULL))
+    if (!NewThread(ThreadOpenConnections, NULL, THREADPOOL_NETWORK))
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    int nMsgHandlers = max(1, min(16, (int)GetArg("-msghandlers", DEFAULT_MSGHANDLER_THREADS)));
+    for (int i = 0; i < nMsgHandlers; i++)
+        if (!NewThread(ThreadMessageHandler, NULL, THREADPOOL_NETWORK))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
-    if (!NewThread(ThreadDumpAddress, NULL))
+    if (!NewThread(ThreadDumpAddress, NULL, THREADPOOL_BACKGROUND))
         printf("Error; NewThread(ThreadDumpAddress) failed\n");
 
     // Mine proof-of-stake blocks in the background
@@ -1848,8 +2884,25 @@ void StartNode(void* parg)
     else if(fViewWallet)
         printf("Staking disabled : view wallet only\n");
     else
-        if (!NewThread(ThreadStakeMiner, pwalletMain))
+    {
+        if (!NewThread(ThreadStakeMiner, pwalletMain, THREADPOOL_STAKING))
             printf("Error: NewThread(ThreadStakeMiner) failed\n");
+
+        // Further wallets stake on threads of their own
+        BOOST_FOREACH(const string& strFile, mapMultiArgs["-stakewallet"])
+        {
+            __wx__* pwallet = FindWallet(strFile);
+            if (!pwallet || pwallet == pwalletMain)
+                printf("Not staking with %s : not a further -wallet\n", strFile.c_str());
+            else if (!NewThread(ThreadStakeMiner, pwallet, THREADPOOL_STAKING))
+                printf("Error: NewThread(ThreadStakeMiner) failed\n");
+        }
+    }
+
+    // Merge small wallet outputs in the background
+    if (GetBoolArg("-compactwallet", false) && !fViewWallet)
+        if (!NewThread(ThreadCompactWallet, pwalletMain, THREADPOOL_BACKGROUND))
+            printf("Error: NewThread(ThreadCompactWallet) failed\n");
 }
 
 bool StopNode()
@@ -1884,7 +2937,15 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0) printf("ThreadStakeMiner still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_IMPORT] > 0) printf("ThreadImport still running\n");
+    if (vnThreadsRunning[THREAD_INDEXCHECK] > 0) printf("ThreadVerifyBlockIndex still running\n");
+    if (vnThreadsRunning[THREAD_MEMPOOLLOAD] > 0) printf("ThreadLoadMempool still running\n");
+    if (vnThreadsRunning[THREAD_REVALIDATE] > 0) printf("ThreadRevalidateMempool still running\n");
+    if (vnThreadsRunning[THREAD_NOTIFY] > 0) printf("ThreadNotify still running\n");
+    if (vnThreadsRunning[THREAD_SNAPSHOTCHECK] > 0) printf("ThreadVerifyChainSnapshot still running\n");
+    if (vnThreadsRunning[THREAD_PRUNE] > 0) printf("ThreadPruneBlockFiles still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 || vnThreadsRunning[THREAD_IMPORT] > 0 ||
+           vnThreadsRunning[THREAD_MEMPOOLLOAD] > 0 || vnThreadsRunning[THREAD_REVALIDATE] > 0 || vnThreadsRunning[THREAD_PRUNE] > 0)
         MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
@@ -1924,22 +2985,112 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
     RelayTransaction(tx, hash, ss);
 }
 
+// requires LOCK(cs_mapRelay)
+static void SaveRelayMessage(const CInv& inv, const CDataStream& ss)
+{
+    // Save original serialized message so newer versions are preserved,
+    // every peer asking for it is sent this one copy
+    if (!mapRelay.count(inv))
+        mapRelay.insert(std::make_pair(inv, MakeNetMessage(inv.GetCommand(), ss)));
+    vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+}
+
+// requires LOCK(cs_mapRelay)
+static void ExpireRelayMessages()
+{
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+    {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+}
+
+// Like RelayInventory(), for vInv[i] announcing vtx[i], skipping peers that
+// asked for no transactions or whose bloom filter doesn't match
+static void RelayTransactionInventory(const std::vector<CTransaction>& vtx, const std::vector<CInv>& vInv)
+{
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (!pnode->fRelayTxes)
+            continue;
+        vector<CInv> vInvMatched;
+        {
+            LOCK(pnode->cs_filter);
+            for (unsigned int i = 0; i < vInv.size(); i++)
+                if (pnode->pfilter->IsRelevantAndUpdate(vtx[i], vInv[i].hash))
+                    vInvMatched.push_back(vInv[i]);
+        }
+        if (!vInvMatched.empty())
+            pnode->PushInventory(vInvMatched);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
+
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
     {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        ExpireRelayMessages();
+        SaveRelayMessage(inv, ss);
+    }
+
+    RelayTransactionInventory(vector<CTransaction>(1, tx), vector<CInv>(1, inv));
+}
+
+void RelayTransactions(const std::vector<CTransaction>& vtx)
+{
+    if (vtx.empty())
+        return;
+
+    vector<CInv> vInv;
+    vInv.reserve(vtx.size());
+    {
+        LOCK(cs_mapRelay);
+        ExpireRelayMessages();
+        BOOST_FOREACH(const CTransaction& tx, vtx)
         {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+            ss.reserve(10000);
+            ss << tx;
+            vInv.push_back(CInv(MSG_TX, tx.GetHash()));
+            SaveRelayMessage(vInv.back(), ss);
         }
+    }
+
+    RelayTransactionInventory(vtx, vInv);
+}
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+void RelayInventory(const std::vector<CInv>& vInv)
+{
+    // The references keep the nodes from being deleted in between
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
     }
 
-    RelayInventory(inv);
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        pnode->PushInventory(vInv);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
 }
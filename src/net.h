@@ -6,8 +6,10 @@
 #define BITCOIN_NET_H
 
 #include <deque>
+#include <limits>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <openssl/rand.h>
 
 #ifndef WIN32
@@ -18,9 +20,79 @@
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
+#include "bloom.h"
 
 class CRequestTracker;
 class CNode;
+
+/** Tells peers apart for as long as the process runs, unlike addresses */
+typedef int NodeId;
+
+/** A complete wire message, header included. Never changed once built, so
+ *  one copy can sit in the send queues of any number of peers. */
+typedef boost::shared_ptr<const CSerializeData> CNetMessageRef;
+
+/** Fill in the size and checksum of the header at the front of ss and move
+ *  the message out of it */
+CNetMessageRef FinalizeNetMessage(CDataStream& ss);
+
+/** A message to send to many peers, serialized once */
+template<typename T>
+CNetMessageRef MakeNetMessage(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    return FinalizeNetMessage(ss);
+}
+
+/** The "compressed" form of msg for a peer that takes it, or msg itself if
+ *  it isn't worth compressing */
+CNetMessageRef CompressNetMessage(const CNetMessageRef& msg);
+
+/** Unwrap the payload of a "compressed" message in place */
+bool DecompressNetMessage(CDataStream& vRecv, std::string& strCommandRet);
+
+/** The inventory a peer already knows of, as a direct-mapped table of
+ *  salted 64-bit fingerprints. A newer entry can push an older one out,
+ *  which at worst announces it twice; two entries practically never share
+ *  a fingerprint, so nothing goes unannounced. */
+class CInvKnownFilter
+{
+private:
+    std::vector<uint64_t> vData;
+    uint64_t k0, k1;
+
+    uint64_t Fingerprint(const CInv& inv) const
+    {
+        uint64_t n = SipHashUint256Extra(k0, k1, inv.hash, inv.type);
+        return n ? n : 1;
+    }
+
+public:
+    CInvKnownFilter(unsigned int nSize) : vData(nSize, 0)
+    {
+        uint256 salt = GetRandHash();
+        k0 = salt.Get64(0);
+        k1 = salt.Get64(1);
+    }
+
+    bool contains(const CInv& inv) const
+    {
+        uint64_t n = Fingerprint(inv);
+        return vData[n % vData.size()] == n;
+    }
+
+    /** Returns true if inv wasn't known yet */
+    bool insert(const CInv& inv)
+    {
+        uint64_t n = Fingerprint(inv);
+        uint64_t& nSlot = vData[n % vData.size()];
+        if (nSlot == n)
+            return false;
+        nSlot = n;
+        return true;
+    }
+};
 class CBlockIndex;
 extern int nBestHeight;
 
@@ -36,12 +108,70 @@ void AddressCurrentlyConnected(const CService& addr);
 CNode* FindNode(const CNetAddr& ip);
 CNode* FindNode(const CService& ip);
 CNode* ConnectNode(CAddress addrConnect, const char *strDest = NULL);
+/** Peers given with -fastpeer: trusted, never banned, and sent blocks first */
+void AddFastPeer(const CNetAddr& addr);
+bool IsFastPeer(const CNetAddr& addr);
+bool HaveFastPeers();
 void MapPort();
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+
+/** Have a message handler worker look at pnode soon */
+void WakeMessageHandler(CNode* pnode);
+
+/** Default for -msghandlers, the message handler worker threads */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+
+/** The window -maxuploadtarget applies to */
+static const int64_t MAX_UPLOAD_TIMEFRAME = 24 * 60 * 60;
+/** Blocks this much older than the tip are historical to -maxuploadtarget */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+
+uint64_t GetTotalBytesRecv();
+uint64_t GetTotalBytesSent();
+/** Bytes to send per MAX_UPLOAD_TIMEFRAME at most, 0 for no target */
+void SetMaxOutboundTarget(uint64_t nLimit);
+uint64_t GetMaxOutboundTarget();
+/** Whether the target is used up; with fHistoricalBlockServingLimit, whether
+ *  what is left should be kept for recent blocks and everything else */
+bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+uint64_t GetOutboundTargetBytesLeft();
+int64_t GetMaxOutboundTimeLeftInCycle();
+/** Bytes per second all peers together may be sent, 0 for no limit */
+void SetMaxSendRate(int64_t nBytesPerSecond);
+
 void SocketSendData(CNode *pnode);
+/** A "block" or "cmpctblock" message, compressed or not */
+bool IsBlockNetMessage(const CSerializeData& msg);
+
+/** What eviction looks at in an inbound peer */
+struct CNodeEvictionCandidate
+{
+    NodeId id;
+    int64_t nTimeConnected;
+    int64_t nMinPingUsecTime;
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
+    uint64_t nKeyedNetGroup;
+};
+
+/** The least useful of vCandidates, false if every one of them is protected */
+bool SelectNodeToEvict(std::vector<CNodeEvictionCandidate> vCandidates, NodeId& idRet);
+
+/** Average seconds between transaction announcements to an inbound peer;
+ *  outbound peers get them twice as often */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Seconds between pings timing a peer, and before an unanswered one is sent again */
+static const int PING_INTERVAL = 2 * 60;
+static const int PING_TIMEOUT = 20 * 60;
+/** Entries in a peer's filter of known inventory */
+static const unsigned int INV_KNOWN_FILTER_SIZE = 1 << 15;
+
+/** Time of the next event of a Poisson process with the given average
+ *  interval, in microseconds like nNow */
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds);
 
 enum
 {
@@ -73,6 +203,9 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    // A "merkleblock" against the peer's bloom filter, then the matched "tx"
+    MSG_FILTERED_BLOCK,
+    MSG_CMPCT_BLOCK,
 };
 
 class CRequestTracker
@@ -107,6 +240,13 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_IMPORT,
+    THREAD_INDEXCHECK,
+    THREAD_MEMPOOLLOAD,
+    THREAD_REVALIDATE,
+    THREAD_NOTIFY,
+    THREAD_SNAPSHOTCHECK,
+    THREAD_PRUNE,
 
     THREAD_MAX
 };
@@ -121,7 +261,7 @@ extern CAddrMan addrman;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetMessageRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -129,6 +269,9 @@ extern std::map<CInv, int64_t> mapAlreadyAskedFor;
 
 
 
+/** Bytes a peer moved, by message command */
+typedef std::map<std::string, uint64_t> mapMsgCmdSize;
+
 class CNodeStats
 {
 public:
@@ -142,6 +285,13 @@ public:
     bool fInbound;
     int nStartingHeight;
     int nMisbehavior;
+    bool fFastPeer;
+    int64_t nPingUsecTime;
+    int64_t nMinPingUsecTime;
+    uint64_t nSendBytes;
+    uint64_t nRecvBytes;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
 };
 
 
@@ -158,7 +308,9 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
+    CHashWriter hasher;             // checksum of the data, fed as it arrives
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn), hasher(SER_GETHASH, 0) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
@@ -178,6 +330,12 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    // requires complete(); invalidates the hasher
+    uint256 GetMessageHash()
+    {
+        return hasher.GetHash();
+    }
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
@@ -196,11 +354,15 @@ public:
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CNetMessageRef> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // getdata items not answered yet, from the first historical block on,
+    // in the order asked for; only the message handler worker running this
+    // node touches it
+    std::deque<CInv> vRecvGetData;
     int nRecvVersion;
 
     int64_t nLastSend;
@@ -214,12 +376,42 @@ public:
     std::string strSubVer;
     bool fOneShot;
     bool fClient;
+    bool fCompress; // both sides advertise NODE_COMPRESS
+    bool fFastPeer;
+    // Whether to announce transactions at all, from the version message
+    bool fRelayTxes;
     bool fInbound;
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
+    NodeId id;
+    // Socket readiness as last seen by ThreadSocketHandler, see CSocketPoller
+    bool fPollAdded;
+    bool fPollRecv;
+    bool fPollSend;
+    // Message handler scheduling, guarded by net.cpp's mutexMsgProc
+    int nMsgProcState;
+    bool fMsgProcTrickle;
+    // SocketSendData() stopped for -maxsendrate, not because the socket was full
+    bool fSendThrottled;
+
+    // Bytes through the socket, and by command as messages are queued and completed
+    uint64_t nSendBytes;
+    uint64_t nRecvBytes;
+    mapMsgCmdSize mapSendBytesPerMsgCmd;
+    mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    CCriticalSection cs_msgBytes;
+
+    // Round trip of the last ping answered, and the best one; requires cs_main
+    uint64_t nPingNonceSent;
+    int64_t nPingUsecStart;
+    int64_t nPingUsecTime;
+    int64_t nMinPingUsecTime;
+    // When the peer last gave us a block or transaction we didn't have
+    int64_t nLastBlockTime;
+    int64_t nLastTXTime;
 protected:
 
     // Denial-of-service detection/prevention
@@ -228,6 +420,9 @@ protected:
     static CCriticalSection cs_setBanned;
     int nMisbehavior;
 
+    static NodeId nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
 public:
     std::map<uint256, CRequestTracker> mapRequests;
     CCriticalSection cs_mapRequests;
@@ -236,6 +431,11 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // headers-first sync, see blocksync.h
+    bool fHeadersSyncPeer;
+    int64_t nGetHeadersTime;
+    std::map<uint256, int64_t> mapBlocksInFlight;
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
@@ -244,12 +444,20 @@ public:
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CInvKnownFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    int64_t nNextInvSend;
     CCriticalSection cs_inventory;
+    // Pushed by any thread, taken into vInventoryToSend by SendMessages();
+    // its own lock so relaying never waits on an inventory flush
+    std::vector<CInv> vInventoryQueued;
+    CCriticalSection cs_inventoryQueue;
+    // Light client's "filterload" filter, matching everything until one is loaded
+    CBloomFilter* pfilter;
+    CCriticalSection cs_filter;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(INV_KNOWN_FILTER_SIZE)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -264,6 +472,10 @@ public:
         strSubVer = "";
         fOneShot = false;
         fClient = false; // set by version message
+        fCompress = false; // set by version message
+        fFastPeer = IsFastPeer(addr);
+        fRelayTxes = false; // set by version message
+        pfilter = new CBloomFilter();
         fInbound = fInboundIn;
         fNetworkNode = false;
         fSuccessfullyConnected = false;
@@ -275,10 +487,31 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        fHeadersSyncPeer = false;
+        nGetHeadersTime = 0;
         fGetAddr = false;
         nMisbehavior = 0;
+        nPingNonceSent = 0;
+        nPingUsecStart = 0;
+        nPingUsecTime = 0;
+        nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+        nLastBlockTime = 0;
+        nLastTXTime = 0;
         hashCheckpointKnown = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextInvSend = 0;
+        fPollAdded = false;
+        fPollRecv = false;
+        fPollSend = true;
+        nMsgProcState = 0;
+        fMsgProcTrickle = false;
+        fSendThrottled = false;
+        nSendBytes = 0;
+        nRecvBytes = 0;
+
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
 
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
@@ -292,6 +525,8 @@ public:
             closesocket(hSocket);
             hSocket = INVALID_SOCKET;
         }
+        if (pfilter)
+            delete pfilter;
     }
 
 private:
@@ -358,16 +593,33 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
+    // Inventory the peer already knows is dropped by SendMessages()
     void PushInventory(const CInv& inv)
     {
+        LOCK(cs_inventoryQueue);
+        vInventoryQueued.push_back(inv);
+    }
+
+    void PushInventory(const std::vector<CInv>& vInv)
+    {
+        LOCK(cs_inventoryQueue);
+        vInventoryQueued.insert(vInventoryQueued.end(), vInv.begin(), vInv.end());
+    }
+
+    // requires LOCK(cs_inventory)
+    void TakeQueuedInventory()
+    {
+        LOCK(cs_inventoryQueue);
+        if (vInventoryToSend.empty())
+            vInventoryToSend.swap(vInventoryQueued);
+        else
         {
-            LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
-                vInventoryToSend.push_back(inv);
+            vInventoryToSend.insert(vInventoryToSend.end(), vInventoryQueued.begin(), vInventoryQueued.end());
+            vInventoryQueued.clear();
         }
     }
 
@@ -424,30 +676,45 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%d bytes)\n", (int)(ssSend.size() - CMessageHeader::HEADER_SIZE));
         }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        QueueSendMsg(FinalizeNetMessage(ssSend));
+
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    /** Send a message built by MakeNetMessage() */
+    void PushNetMessage(const CNetMessageRef& msg)
+    {
+        LOCK(cs_vSend);
+        QueueSendMsg(msg);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CNetMessageRef& msgIn)
+    {
+        CNetMessageRef msg = fCompress ? CompressNetMessage(msgIn) : msgIn;
+        RecordSendMsg(*msg);
+        if (fFastPeer && !vSendMsg.empty() && IsBlockNetMessage(*msg))
+        {
+            // Blocks go ahead of everything but the message being sent
+            // and blocks queued before them
+            std::deque<CNetMessageRef>::iterator it = vSendMsg.begin();
+            if (nSendOffset > 0)
+                it++;
+            while (it != vSendMsg.end() && IsBlockNetMessage(**it))
+                it++;
+            vSendMsg.insert(it, msg);
+        }
+        else
+            vSendMsg.push_back(msg);
+        nSendSize += msg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
-
-        LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
     void PushVersion();
@@ -682,21 +949,24 @@ public:
     static bool IsBanned(CNetAddr ip);
     bool Misbehaving(int howmuch); // 1 == a little, 100 == a lot
     void copyStats(CNodeStats &stats);
+    void RecordSendMsg(const CSerializeData& msg);
+    void RecordRecvMsg(const CNetMessage& msg);
 };
 
+/** Put on lists to offer to the other nodes, without holding cs_vNodes
+ *  while each one is handed the inventory */
+void RelayInventory(const std::vector<CInv>& vInv);
+
 inline void RelayInventory(const CInv& inv)
 {
-    // Put on lists to offer to the other nodes
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-            pnode->PushInventory(inv);
-    }
+    RelayInventory(std::vector<CInv>(1, inv));
 }
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+/** Relay a batch of transactions with one pass over the peers */
+void RelayTransactions(const std::vector<CTransaction>& vtx);
 
 
 #endif
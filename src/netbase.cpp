@@ -156,158 +156,240 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault)
     return Lookup(pszName, addr, portDefault, false);
 }
 
-bool static Socks4(const CService &addrDest, SOCKET& hSocket)
+CSocksHandshake::CSocksHandshake(int nVersionIn) : nVersion(nVersionIn), nRecvNeed(0)
 {
-    printf("SOCKS4 connecting %s\n", addrDest.ToString().c_str());
-    if (!addrDest.IsIPv4())
+    if (nVersion == 5)
     {
-        closesocket(hSocket);
-        return error("Proxy destination is not IPv4");
+        // One method offered: no authentication
+        strSend.assign("\5\1\0", 3);
+        nRecvNeed = 2;
+        nState = SOCKS_GREETING;
     }
-    char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
+    else
+        nState = SOCKS_IDLE;
+}
+
+bool CSocksHandshake::Fail(const char* pszError)
+{
+    nState = SOCKS_FAILED;
+    strError = pszError;
+    return error("%s", pszError);
+}
+
+bool CSocksHandshake::SetDestination(const CService& addrDest)
+{
+    if (nVersion == 5)
+        return SetDestination(addrDest.ToStringIP(), addrDest.GetPort());
+
+    if (nState != SOCKS_IDLE || !strRequest.empty())
+        return false;
+    if (!addrDest.IsIPv4())
+        return Fail("Proxy destination is not IPv4");
     struct sockaddr_in addr;
     socklen_t len = sizeof(addr);
     if (!addrDest.GetSockAddr((struct sockaddr*)&addr, &len) || addr.sin_family != AF_INET)
-    {
-        closesocket(hSocket);
-        return error("Cannot get proxy destination address");
-    }
+        return Fail("Cannot get proxy destination address");
+    char pszSocks4IP[] = "\4\1\0\0\0\0\0\0user";
     memcpy(pszSocks4IP + 2, &addr.sin_port, 2);
     memcpy(pszSocks4IP + 4, &addr.sin_addr, 4);
-    char* pszSocks4 = pszSocks4IP;
-    int nSize = sizeof(pszSocks4IP);
+    strRequest.assign(pszSocks4IP, sizeof(pszSocks4IP));
+    SendRequest();
+    return true;
+}
 
-    int ret = send(hSocket, pszSocks4, nSize, MSG_NOSIGNAL);
-    if (ret != nSize)
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet[8];
-    if (recv(hSocket, pchRet, 8, 0) != 8)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet[1] != 0x5a)
-    {
-        closesocket(hSocket);
-        if (pchRet[1] != 0x5b)
-            printf("ERROR: Proxy returned error %d\n", pchRet[1]);
+bool CSocksHandshake::SetDestination(const std::string& strDest, int nPort)
+{
+    if (nVersion != 5)
+        return Fail("Proxy can't connect to names");
+    if ((nState != SOCKS_GREETING && nState != SOCKS_IDLE) || !strRequest.empty())
         return false;
-    }
-    printf("SOCKS4 connected %s\n", addrDest.ToString().c_str());
+    if (strDest.size() > 255)
+        return Fail("Hostname too long");
+    strRequest = "\5\1";
+    strRequest += '\000'; strRequest += '\003';
+    strRequest += static_cast<char>(strDest.size());
+    strRequest += strDest;
+    strRequest += static_cast<char>((nPort >> 8) & 0xFF);
+    strRequest += static_cast<char>((nPort >> 0) & 0xFF);
+    if (nState == SOCKS_IDLE)
+        SendRequest();
     return true;
 }
 
-bool static Socks5(string strDest, int port, SOCKET& hSocket)
+void CSocksHandshake::SendRequest()
 {
-    printf("SOCKS5 connecting %s\n", strDest.c_str());
-    if (strDest.size() > 255)
-    {
-        closesocket(hSocket);
-        return error("Hostname too long");
-    }
-    char pszSocks5Init[] = "\5\1\0";
-    char *pszSocks5 = pszSocks5Init;
-    ssize_t nSize = sizeof(pszSocks5Init) - 1;
+    strSend += strRequest;
+    strRecv.clear();
+    // SOCKS4 replies with 8 bytes; SOCKS5 with 4, then an address whose
+    // length is in its first byte when it is a name, then a port
+    nRecvNeed = (nVersion == 5 ? 5 : 8);
+    nState = SOCKS_REQUEST;
+}
 
-    ssize_t ret = send(hSocket, pszSocks5, nSize, MSG_NOSIGNAL);
-    if (ret != nSize)
-    {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
-    }
-    char pchRet1[2];
-    if (recv(hSocket, pchRet1, 2, 0) != 2)
-    {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
-    }
-    if (pchRet1[0] != 0x05 || pchRet1[1] != 0x00)
+bool CSocksHandshake::ProcessReply()
+{
+    if (nState == SOCKS_GREETING)
     {
-        closesocket(hSocket);
-        return error("Proxy failed to initialize");
+        if (strRecv[0] != 0x05 || strRecv[1] != 0x00)
+            return Fail("Proxy failed to initialize");
+        if (!strRequest.empty())
+            SendRequest();
+        else
+        {
+            nState = SOCKS_IDLE;
+            nRecvNeed = 0;
+        }
+        return true;
     }
-    string strSocks5("\5\1");
-    strSocks5 += '\000'; strSocks5 += '\003';
-    strSocks5 += static_cast<char>(std::min((int)strDest.size(), 255));
-    strSocks5 += strDest;
-    strSocks5 += static_cast<char>((port >> 8) & 0xFF);
-    strSocks5 += static_cast<char>((port >> 0) & 0xFF);
-    ret = send(hSocket, strSocks5.c_str(), strSocks5.size(), MSG_NOSIGNAL);
-    if (ret != (ssize_t)strSocks5.size())
+
+    if (nVersion != 5)
     {
-        closesocket(hSocket);
-        return error("Error sending to proxy");
+        if (strRecv[1] != 0x5a)
+        {
+            if (strRecv[1] != 0x5b)
+                printf("ERROR: Proxy returned error %d\n", strRecv[1]);
+            return Fail("Proxy rejected the request");
+        }
+        nState = SOCKS_DONE;
+        return true;
     }
-    char pchRet2[4];
-    if (recv(hSocket, pchRet2, 4, 0) != 4)
+
+    if (strRecv[0] != 0x05)
+        return Fail("Proxy failed to accept request");
+    switch (strRecv[1])
     {
-        closesocket(hSocket);
-        return error("Error reading proxy response");
+        case 0x00: break;
+        case 0x01: return Fail("Proxy error: general failure");
+        case 0x02: return Fail("Proxy error: connection not allowed");
+        case 0x03: return Fail("Proxy error: network unreachable");
+        case 0x04: return Fail("Proxy error: host unreachable");
+        case 0x05: return Fail("Proxy error: connection refused");
+        case 0x06: return Fail("Proxy error: TTL expired");
+        case 0x07: return Fail("Proxy error: protocol error");
+        case 0x08: return Fail("Proxy error: address type not supported");
+        default:   return Fail("Proxy error: unknown");
     }
-    if (pchRet2[0] != 0x05)
+    if (strRecv[2] != 0x00)
+        return Fail("Error: malformed proxy response");
+    size_t nReply;
+    switch (strRecv[3])
     {
-        closesocket(hSocket);
-        return error("Proxy failed to accept request");
+        case 0x01: nReply = 4 + 4 + 2; break;
+        case 0x04: nReply = 4 + 16 + 2; break;
+        case 0x03: nReply = 4 + 1 + (unsigned char)strRecv[4] + 2; break;
+        default:   return Fail("Error: malformed proxy response");
     }
-    if (pchRet2[1] != 0x00)
+    if (strRecv.size() < nReply)
+        nRecvNeed = nReply;
+    else
+        nState = SOCKS_DONE;
+    return true;
+}
+
+static bool IsSocketWouldBlock(int nErr)
+{
+    return nErr == WSAEWOULDBLOCK || nErr == WSAEINPROGRESS || nErr == WSAEINTR;
+}
+
+CSocksHandshake::State CSocksHandshake::Advance(SOCKET hSocket)
+{
+    while (nState != SOCKS_DONE && nState != SOCKS_FAILED)
     {
-        closesocket(hSocket);
-        switch (pchRet2[1])
+        bool fProgress = false;
+        if (!strSend.empty())
         {
-            case 0x01: return error("Proxy error: general failure");
-            case 0x02: return error("Proxy error: connection not allowed");
-            case 0x03: return error("Proxy error: network unreachable");
-            case 0x04: return error("Proxy error: host unreachable");
-            case 0x05: return error("Proxy error: connection refused");
-            case 0x06: return error("Proxy error: TTL expired");
-            case 0x07: return error("Proxy error: protocol error");
-            case 0x08: return error("Proxy error: address type not supported");
-            default:   return error("Proxy error: unknown");
+            int nSent = send(hSocket, strSend.data(), strSend.size(), MSG_NOSIGNAL);
+            if (nSent > 0)
+            {
+                strSend.erase(0, nSent);
+                fProgress = true;
+            }
+            else if (nSent == 0 || !IsSocketWouldBlock(WSAGetLastError()))
+            {
+                Fail("Error sending to proxy");
+                break;
+            }
         }
-    }
-    if (pchRet2[2] != 0x00)
-    {
-        closesocket(hSocket);
-        return error("Error: malformed proxy response");
-    }
-    char pchRet3[256];
-    switch (pchRet2[3])
-    {
-        case 0x01: ret = recv(hSocket, pchRet3, 4, 0) != 4; break;
-        case 0x04: ret = recv(hSocket, pchRet3, 16, 0) != 16; break;
-        case 0x03:
+
+        if (nState == SOCKS_IDLE)
         {
-            ret = recv(hSocket, pchRet3, 1, 0) != 1;
-            if (ret) {
-                closesocket(hSocket);
-                return error("Error reading from proxy");
-            }
-            int nRecv = pchRet3[0];
-            ret = recv(hSocket, pchRet3, nRecv, 0) != nRecv;
+            // The proxy has nothing to say until it has a request, so a
+            // readable idle socket has been closed or is broken
+            char c;
+            int nRead = recv(hSocket, &c, 1, 0);
+            if (nRead >= 0 || !IsSocketWouldBlock(WSAGetLastError()))
+                Fail("Proxy closed the connection");
             break;
         }
-        default: closesocket(hSocket); return error("Error: malformed proxy response");
-    }
-    if (ret)
-    {
-        closesocket(hSocket);
-        return error("Error reading from proxy");
+
+        if (strRecv.size() < nRecvNeed)
+        {
+            char pchBuf[256];
+            int nRead = recv(hSocket, pchBuf, min(sizeof(pchBuf), nRecvNeed - strRecv.size()), 0);
+            if (nRead > 0)
+            {
+                strRecv.append(pchBuf, nRead);
+                fProgress = true;
+            }
+            else if (nRead == 0 || !IsSocketWouldBlock(WSAGetLastError()))
+            {
+                Fail("Error reading proxy response");
+                break;
+            }
+        }
+        if (strRecv.size() >= nRecvNeed)
+        {
+            ProcessReply();
+            fProgress = true;
+        }
+
+        if (!fProgress)
+            break;
     }
-    if (recv(hSocket, pchRet3, 2, 0) != 2)
+    return nState;
+}
+
+// Run a handshake to the end on a blocking socket, closing it on failure
+bool static SocksConnect(CSocksHandshake& socks, SOCKET& hSocket)
+{
+    while (socks.GetState() != CSocksHandshake::SOCKS_DONE)
     {
-        closesocket(hSocket);
-        return error("Error reading from proxy");
+        if (socks.GetState() == CSocksHandshake::SOCKS_FAILED || socks.GetState() == CSocksHandshake::SOCKS_IDLE)
+        {
+            closesocket(hSocket);
+            return false;
+        }
+        socks.Advance(hSocket);
     }
+    return true;
+}
+
+bool static Socks4(const CService &addrDest, SOCKET& hSocket)
+{
+    printf("SOCKS4 connecting %s\n", addrDest.ToString().c_str());
+    CSocksHandshake socks(4);
+    socks.SetDestination(addrDest);
+    if (!SocksConnect(socks, hSocket))
+        return false;
+    printf("SOCKS4 connected %s\n", addrDest.ToString().c_str());
+    return true;
+}
+
+bool static Socks5(string strDest, int port, SOCKET& hSocket)
+{
+    printf("SOCKS5 connecting %s\n", strDest.c_str());
+    CSocksHandshake socks(5);
+    socks.SetDestination(strDest, port);
+    if (!SocksConnect(socks, hSocket))
+        return false;
     printf("SOCKS5 connected %s\n", strDest.c_str());
     return true;
 }
 
-bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+bool ConnectSocketStart(const CService &addrConnect, SOCKET& hSocketRet, bool& fInProgressRet)
 {
     hSocketRet = INVALID_SOCKET;
+    fInProgressRet = false;
 
     struct sockaddr_storage sockaddr;
     socklen_t len = sizeof(sockaddr);
@@ -341,52 +423,75 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
         int nErr = WSAGetLastError();
         // WSAEINVAL is here because some legacy version of winsock uses it
         if (nErr == WSAEINPROGRESS || nErr == WSAEWOULDBLOCK || nErr == WSAEINVAL)
-        {
-            struct timeval timeout;
-            timeout.tv_sec  = nTimeout / 1000;
-            timeout.tv_usec = (nTimeout % 1000) * 1000;
-
-            fd_set fdset;
-            FD_ZERO(&fdset);
-            FD_SET(hSocket, &fdset);
-            int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
-            if (nRet == 0)
-            {
-                printf("connection timeout\n");
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet == SOCKET_ERROR)
-            {
-                printf("select() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            socklen_t nRetSize = sizeof(nRet);
+            fInProgressRet = true;
 #ifdef WIN32
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
+        else if (nErr != WSAEISCONN)
 #else
-            if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
+        else
 #endif
-            {
-                printf("getsockopt() for connection failed: %i\n",WSAGetLastError());
-                closesocket(hSocket);
-                return false;
-            }
-            if (nRet != 0)
-            {
-                printf("connect() failed after select(): %s\n",strerror(nRet));
-                closesocket(hSocket);
-                return false;
-            }
+        {
+            printf("connect() failed: %i\n", nErr);
+            closesocket(hSocket);
+            return false;
         }
+    }
+
+    hSocketRet = hSocket;
+    return true;
+}
+
+int ConnectSocketFinish(SOCKET hSocket)
+{
+    int nRet = 0;
+    socklen_t nRetSize = sizeof(nRet);
 #ifdef WIN32
-        else if (WSAGetLastError() != WSAEISCONN)
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, (char*)(&nRet), &nRetSize) == SOCKET_ERROR)
 #else
-        else
+    if (getsockopt(hSocket, SOL_SOCKET, SO_ERROR, &nRet, &nRetSize) == SOCKET_ERROR)
 #endif
+    {
+        int nErr = WSAGetLastError();
+        printf("getsockopt() for connection failed: %i\n", nErr);
+        return nErr ? nErr : -1;
+    }
+    return nRet;
+}
+
+bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRet, int nTimeout)
+{
+    hSocketRet = INVALID_SOCKET;
+
+    SOCKET hSocket;
+    bool fInProgress;
+    if (!ConnectSocketStart(addrConnect, hSocket, fInProgress))
+        return false;
+
+    if (fInProgress)
+    {
+        struct timeval timeout;
+        timeout.tv_sec  = nTimeout / 1000;
+        timeout.tv_usec = (nTimeout % 1000) * 1000;
+
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(hSocket, &fdset);
+        int nRet = select(hSocket + 1, NULL, &fdset, NULL, &timeout);
+        if (nRet == 0)
+        {
+            printf("connection timeout\n");
+            closesocket(hSocket);
+            return false;
+        }
+        if (nRet == SOCKET_ERROR)
         {
-            printf("connect() failed: %i\n",WSAGetLastError());
+            printf("select() for connection failed: %i\n",WSAGetLastError());
+            closesocket(hSocket);
+            return false;
+        }
+        nRet = ConnectSocketFinish(hSocket);
+        if (nRet != 0)
+        {
+            printf("connect() failed after select(): %s\n",strerror(nRet));
             closesocket(hSocket);
             return false;
         }
@@ -396,10 +501,10 @@ bool static ConnectSocketDirectly(const CService &addrConnect, SOCKET& hSocketRe
     // CNode::ConnectNode immediately turns the socket back to non-blocking
     // but we'll turn it back to blocking just in case
 #ifdef WIN32
-    fNonblock = 0;
+    u_long fNonblock = 0;
     if (ioctlsocket(hSocket, FIONBIO, &fNonblock) == SOCKET_ERROR)
 #else
-    fFlags = fcntl(hSocket, F_GETFL, 0);
+    int fFlags = fcntl(hSocket, F_GETFL, 0);
     if (fcntl(hSocket, F_SETFL, fFlags & !O_NONBLOCK) == SOCKET_ERROR)
 #endif
     {
@@ -142,5 +142,59 @@ bool Lookup(const char *pszName, std::vector<CService>& vAddr, int portDefault =
 bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
+/** Begin a direct, non-blocking connect; fInProgressRet tells whether to
+ *  wait for the socket to become writable and ask ConnectSocketFinish() */
+bool ConnectSocketStart(const CService &addr, SOCKET& hSocketRet, bool& fInProgressRet);
+/** 0 once a started connect succeeded, otherwise the socket error */
+int ConnectSocketFinish(SOCKET hSocket);
+
+/** The client side of a SOCKS4 or SOCKS5 CONNECT through a socket already
+ *  connected to the proxy. Advance() sends and reads whatever the socket
+ *  allows, so on a non-blocking socket many handshakes can share one
+ *  select() loop; on a blocking one it simply waits.
+ *
+ *  A SOCKS5 handshake may start before its destination is known. It then
+ *  stops at SOCKS_IDLE once the proxy has taken the greeting, which lets a
+ *  pool of proxy sockets be opened ahead of the connections they serve.
+ */
+class CSocksHandshake
+{
+public:
+    enum State
+    {
+        SOCKS_GREETING, // waiting for the proxy to take the SOCKS5 greeting
+        SOCKS_IDLE,     // ready for a destination
+        SOCKS_REQUEST,  // waiting for the reply to the CONNECT request
+        SOCKS_DONE,
+        SOCKS_FAILED,
+    };
+
+    explicit CSocksHandshake(int nVersionIn);
+
+    // SOCKS4 can only reach IPv4 addresses; SOCKS5 takes host names too.
+    // Only valid before the request is sent.
+    bool SetDestination(const CService& addrDest);
+    bool SetDestination(const std::string& strDest, int nPort);
+
+    State Advance(SOCKET hSocket);
+
+    State GetState() const { return nState; }
+    int GetVersion() const { return nVersion; }
+    bool WantWrite() const { return !strSend.empty(); }
+    const std::string& GetError() const { return strError; }
+
+private:
+    int nVersion;
+    State nState;
+    std::string strSend;
+    std::string strRecv;
+    size_t nRecvNeed;
+    std::string strRequest;
+    std::string strError;
+
+    bool Fail(const char* pszError);
+    void SendRequest();
+    bool ProcessReply();
+};
 
 #endif
@@ -0,0 +1,203 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netpoll.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+#if defined(USE_EPOLL)
+#include <sys/epoll.h>
+#elif defined(USE_KQUEUE)
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+using namespace std;
+
+// Most events taken from the kernel per Wait()
+static const int MAX_POLL_EVENTS = 256;
+
+CSocketPoller::CSocketPoller()
+{
+    fdQueue = -1;
+#if defined(USE_EPOLL)
+    fdQueue = epoll_create(MAX_POLL_EVENTS);
+#elif defined(USE_KQUEUE)
+    fdQueue = kqueue();
+#endif
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    if (fdQueue < 0)
+        printf("CSocketPoller() : %s failed with error %d, falling back to select()\n", GetName(), errno);
+#endif
+    ResetSelect();
+}
+
+CSocketPoller::~CSocketPoller()
+{
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+    if (fdQueue >= 0)
+        close(fdQueue);
+#endif
+}
+
+const char* CSocketPoller::GetName() const
+{
+#if defined(USE_EPOLL)
+    if (fdQueue >= 0)
+        return "epoll";
+#elif defined(USE_KQUEUE)
+    if (fdQueue >= 0)
+        return "kqueue";
+#endif
+    return "select";
+}
+
+void CSocketPoller::ResetSelect()
+{
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    hSocketMax = 0;
+    vWanted.clear();
+}
+
+bool CSocketPoller::Add(SOCKET hSocket, bool fEdge)
+{
+#if defined(USE_EPOLL)
+    if (fdQueue >= 0)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | (fEdge ? (uint32_t)EPOLLET : 0u);
+        event.data.fd = hSocket;
+        if (epoll_ctl(fdQueue, EPOLL_CTL_ADD, hSocket, &event) != 0)
+            return error("CSocketPoller::Add() : epoll_ctl failed with error %d", errno);
+        return true;
+    }
+#elif defined(USE_KQUEUE)
+    if (fdQueue >= 0)
+    {
+        struct kevent events[2];
+        unsigned short nFlags = EV_ADD | (fEdge ? EV_CLEAR : 0);
+        EV_SET(&events[0], hSocket, EVFILT_READ, nFlags, 0, 0, NULL);
+        EV_SET(&events[1], hSocket, EVFILT_WRITE, nFlags, 0, 0, NULL);
+        if (kevent(fdQueue, events, 2, NULL, 0, NULL) != 0)
+            return error("CSocketPoller::Add() : kevent failed with error %d", errno);
+        return true;
+    }
+#endif
+    return true;
+}
+
+void CSocketPoller::Want(SOCKET hSocket, int nEvents)
+{
+    if (fdQueue >= 0 || nEvents == 0)
+        return;
+#ifdef WIN32
+    if (vWanted.size() >= FD_SETSIZE)
+        return;
+#else
+    if (hSocket >= FD_SETSIZE)
+        return;
+#endif
+    if (nEvents & POLL_RECV)
+        FD_SET(hSocket, &fdsetRecv);
+    if (nEvents & POLL_SEND)
+        FD_SET(hSocket, &fdsetSend);
+    FD_SET(hSocket, &fdsetError);
+    hSocketMax = max(hSocketMax, hSocket);
+    vWanted.push_back(hSocket);
+}
+
+int CSocketPoller::Wait(int nTimeoutMs, vector<pair<SOCKET, int> >& vReady)
+{
+    vReady.clear();
+
+#if defined(USE_EPOLL)
+    if (fdQueue >= 0)
+    {
+        struct epoll_event events[MAX_POLL_EVENTS];
+        int nEvents = epoll_wait(fdQueue, events, MAX_POLL_EVENTS, nTimeoutMs);
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+                printf("socket epoll_wait error %d\n", errno);
+            return 0;
+        }
+        for (int i = 0; i < nEvents; i++)
+        {
+            int nReady = 0;
+            // Errors and hang-ups show up to recv()
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                nReady |= POLL_RECV;
+            if (events[i].events & EPOLLOUT)
+                nReady |= POLL_SEND;
+            vReady.push_back(make_pair((SOCKET)events[i].data.fd, nReady));
+        }
+        return vReady.size();
+    }
+#elif defined(USE_KQUEUE)
+    if (fdQueue >= 0)
+    {
+        struct kevent events[MAX_POLL_EVENTS];
+        struct timespec timeout;
+        timeout.tv_sec = nTimeoutMs / 1000;
+        timeout.tv_nsec = (nTimeoutMs % 1000) * 1000000;
+        int nEvents = kevent(fdQueue, NULL, 0, events, MAX_POLL_EVENTS, &timeout);
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+                printf("socket kevent error %d\n", errno);
+            return 0;
+        }
+        for (int i = 0; i < nEvents; i++)
+        {
+            int nReady = 0;
+            if (events[i].filter == EVFILT_READ || (events[i].flags & (EV_EOF | EV_ERROR)))
+                nReady |= POLL_RECV;
+            if (events[i].filter == EVFILT_WRITE)
+                nReady |= POLL_SEND;
+            vReady.push_back(make_pair((SOCKET)events[i].ident, nReady));
+        }
+        return vReady.size();
+    }
+#endif
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeoutMs / 1000;
+    timeout.tv_usec = (nTimeoutMs % 1000) * 1000;
+
+    bool fHaveFds = !vWanted.empty();
+    int nSelect = select(fHaveFds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (fHaveFds)
+        {
+            // Have every socket try, whichever is bad finds out
+            int nErr = WSAGetLastError();
+            printf("socket select error %d\n", nErr);
+            BOOST_FOREACH(SOCKET hSocket, vWanted)
+                vReady.push_back(make_pair(hSocket, (int)POLL_RECV));
+        }
+        MilliSleep(nTimeoutMs);
+    }
+    else if (nSelect > 0)
+    {
+        BOOST_FOREACH(SOCKET hSocket, vWanted)
+        {
+            int nReady = 0;
+            if (FD_ISSET(hSocket, &fdsetRecv) || FD_ISSET(hSocket, &fdsetError))
+                nReady |= POLL_RECV;
+            if (FD_ISSET(hSocket, &fdsetSend))
+                nReady |= POLL_SEND;
+            if (nReady)
+                vReady.push_back(make_pair(hSocket, nReady));
+        }
+    }
+    ResetSelect();
+    return vReady.size();
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETPOLL_H
+#define BITCOIN_NETPOLL_H
+
+#include "netbase.h"
+
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define USE_KQUEUE 1
+#endif
+
+/** Waits for sockets to become readable or writable for the socket
+ *  handler thread. epoll on Linux and kqueue on the BSDs and macOS report
+ *  peer sockets edge-triggered, once each time they become ready, so the
+ *  caller remembers readiness until recv() or send() runs dry and idle
+ *  peers cost nothing per round. select() is the fallback elsewhere and if
+ *  the kernel queue can't be created; it is level-triggered and rebuilt
+ *  from Want() every round. */
+class CSocketPoller
+{
+public:
+    enum
+    {
+        POLL_RECV = (1 << 0),
+        POLL_SEND = (1 << 1),
+    };
+
+    CSocketPoller();
+    ~CSocketPoller();
+
+    /** Watch hSocket from now until it is closed; fEdge asks for edge
+     *  triggering, listening sockets are better served level-triggered */
+    bool Add(SOCKET hSocket, bool fEdge);
+    /** What hSocket is waited for this round; only select() needs telling */
+    void Want(SOCKET hSocket, int nEvents);
+    /** Sockets that became ready within nTimeoutMs, with their POLL_ flags */
+    int Wait(int nTimeoutMs, std::vector<std::pair<SOCKET, int> >& vReady);
+
+    bool IsEdgeTriggered() const { return fdQueue >= 0; }
+    const char* GetName() const;
+
+private:
+    // epoll or kqueue descriptor, -1 when select() is used
+    int fdQueue;
+
+    // select() state for the round being built
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    SOCKET hSocketMax;
+    std::vector<SOCKET> vWanted;
+
+    void ResetSelect();
+};
+
+#endif
@@ -0,0 +1,365 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notify.h"
+#include "main.h"
+#include "dions.h"
+#include "net.h"
+#include "ui_interface.h"
+#include "sync.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+static bool fNotifyEnabled = false;
+static SOCKET hNotifySocket = INVALID_SOCKET;
+
+static CCriticalSection cs_notify;
+static vector<string> vNotifyLines;
+static vector<uint256> vNotifyTx;
+static set<uint256> setNotifyTx;
+
+enum PublishTopic
+{
+    PUB_HASHBLOCK,
+    PUB_RAWBLOCK,
+    PUB_HASHTX,
+    PUB_RAWTX,
+    PUB_ALIAS,
+    PUB_TOPICS
+};
+
+static const char* pszPublishTopics[PUB_TOPICS] = { "hashblock", "rawblock", "hashtx", "rawtx", "alias" };
+static bool fPublishTopic[PUB_TOPICS];
+static bool fPublishAny = false;
+static uint64_t nPublishSequence[PUB_TOPICS];
+
+// Lets ThreadNotify send published events right away
+static boost::mutex mutexNotifyWake;
+static boost::condition_variable condNotifyWake;
+static bool fNotifyWake = false;
+
+void QueueWalletTxNotification(const uint256& hashTx)
+{
+    if (!fNotifyEnabled)
+        return;
+    LOCK(cs_notify);
+    if (setNotifyTx.insert(hashTx).second)
+        vNotifyTx.push_back(hashTx);
+}
+
+void QueueBlockNotification(const uint256& hashBlock, int nHeight)
+{
+    if (!fNotifyEnabled || hNotifySocket == INVALID_SOCKET)
+        return;
+    LOCK(cs_notify);
+    vNotifyLines.push_back(strprintf("block %s %d\n", hashBlock.GetHex().c_str(), nHeight));
+}
+
+static bool IsPublishing(PublishTopic topic)
+{
+    return fPublishTopic[topic] && hNotifySocket != INVALID_SOCKET && !IsInitialBlockDownload();
+}
+
+// Caller holds cs_notify
+static void QueuePublish(PublishTopic topic, const string& strData)
+{
+    vNotifyLines.push_back(strprintf("%s %"PRIu64" ", pszPublishTopics[topic], nPublishSequence[topic]++) + strData + "\n");
+}
+
+static void WakeNotify()
+{
+    boost::unique_lock<boost::mutex> lock(mutexNotifyWake);
+    fNotifyWake = true;
+    condNotifyWake.notify_one();
+}
+
+void PublishBlock(const CBlock& block, int nHeight)
+{
+    if (!fPublishAny || !(IsPublishing(PUB_HASHBLOCK) || IsPublishing(PUB_RAWBLOCK)))
+        return;
+    string strRaw;
+    if (fPublishTopic[PUB_RAWBLOCK])
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << block;
+        strRaw = HexStr(ss.begin(), ss.end());
+    }
+    {
+        LOCK(cs_notify);
+        if (fPublishTopic[PUB_HASHBLOCK])
+            QueuePublish(PUB_HASHBLOCK, strprintf("%s %d", block.GetHash().GetHex().c_str(), nHeight));
+        if (fPublishTopic[PUB_RAWBLOCK])
+            QueuePublish(PUB_RAWBLOCK, strRaw);
+    }
+    WakeNotify();
+}
+
+// Caller holds cs_notify
+static void QueuePublishTransaction(const CTransaction& tx)
+{
+    if (fPublishTopic[PUB_HASHTX])
+        QueuePublish(PUB_HASHTX, tx.GetHash().GetHex());
+    if (fPublishTopic[PUB_RAWTX])
+    {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << tx;
+        QueuePublish(PUB_RAWTX, HexStr(ss.begin(), ss.end()));
+    }
+}
+
+void PublishTransaction(const CTransaction& tx)
+{
+    if (!fPublishAny || !(IsPublishing(PUB_HASHTX) || IsPublishing(PUB_RAWTX)))
+        return;
+    {
+        LOCK(cs_notify);
+        QueuePublishTransaction(tx);
+    }
+    WakeNotify();
+}
+
+static string AliasOpName(int op)
+{
+    switch (op)
+    {
+    case OP_ALIAS_ENCRYPTED:        return "encrypted";
+    case OP_ALIAS_SET:              return "set";
+    case OP_ALIAS_RELAY:            return "relay";
+    case OP_ALIAS_RELAY_ENCRYPTED:  return "relayencrypted";
+    default:                        return strprintf("op%d", op);
+    }
+}
+
+void PublishConnectedBlock(const CBlock& block)
+{
+    if (!fPublishAny || !(IsPublishing(PUB_HASHTX) || IsPublishing(PUB_RAWTX) || IsPublishing(PUB_ALIAS)))
+        return;
+    {
+        LOCK(cs_notify);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            QueuePublishTransaction(tx);
+
+            int op, nOut;
+            vector<vector<unsigned char> > vvch;
+            if (!fPublishTopic[PUB_ALIAS] || tx.nVersion != CTransaction::DION_TX_VERSION || !aliasTx(tx, op, nOut, vvch) || vvch.empty())
+                continue;
+            // Names are sent as they are unless they would break the line
+            string strName(vvch[0].begin(), vvch[0].end());
+            BOOST_FOREACH(char c, strName)
+                if (!isgraph((unsigned char)c))
+                {
+                    strName = HexStr(vvch[0].begin(), vvch[0].end());
+                    break;
+                }
+            QueuePublish(PUB_ALIAS, tx.GetHash().GetHex() + " " + AliasOpName(op) + " " + strName);
+        }
+    }
+    WakeNotify();
+}
+
+static bool SetNonBlocking(SOCKET hSocket)
+{
+#ifdef WIN32
+    u_long nOne = 1;
+    return ioctlsocket(hSocket, FIONBIO, &nOne) != SOCKET_ERROR;
+#else
+    return fcntl(hSocket, F_SETFL, O_NONBLOCK) != SOCKET_ERROR;
+#endif
+}
+
+static bool BindNotifyPort(int nPort, string& strError)
+{
+    SOCKET hSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hSocket == INVALID_SOCKET)
+    {
+        strError = strprintf("Error: Couldn't open notification socket (socket returned error %d)", WSAGetLastError());
+        return false;
+    }
+
+    int nOne = 1;
+#ifdef SO_NOSIGPIPE
+    setsockopt(hSocket, SOL_SOCKET, SO_NOSIGPIPE, (void*)&nOne, sizeof(int));
+#endif
+#ifndef WIN32
+    setsockopt(hSocket, SOL_SOCKET, SO_REUSEADDR, (void*)&nOne, sizeof(int));
+#endif
+
+    // Loopback only, the events reveal which transactions are ours
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockaddr.sin_port = htons(nPort);
+    if (!SetNonBlocking(hSocket) ||
+        ::bind(hSocket, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) == SOCKET_ERROR ||
+        listen(hSocket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        strError = strprintf(_("Unable to bind to 127.0.0.1:%d for notifications (error %d)"), nPort, WSAGetLastError());
+        closesocket(hSocket);
+        return false;
+    }
+
+    hNotifySocket = hSocket;
+    printf("Publishing notifications on 127.0.0.1:%d\n", nPort);
+    return true;
+}
+
+// Send what we can of each subscriber's backlog, dropping the ones that
+// went away or stopped reading
+static void FlushSubscribers(vector<pair<SOCKET, string> >& vSubscribers)
+{
+    for (vector<pair<SOCKET, string> >::iterator it = vSubscribers.begin(); it != vSubscribers.end(); )
+    {
+        SOCKET hSocket = (*it).first;
+        string& strPending = (*it).second;
+        bool fDrop = strPending.size() > MAX_NOTIFY_BACKLOG;
+        while (!fDrop && !strPending.empty())
+        {
+            int nBytes = send(hSocket, strPending.data(), strPending.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (nBytes > 0)
+                strPending.erase(0, nBytes);
+            else
+            {
+                int nErr = WSAGetLastError();
+                if (nBytes == 0 || (nErr != WSAEWOULDBLOCK && nErr != WSAEINTR))
+                    fDrop = true;
+                break;
+            }
+        }
+        if (fDrop)
+        {
+            closesocket(hSocket);
+            it = vSubscribers.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+static void ThreadNotify2()
+{
+    vector<pair<SOCKET, string> > vSubscribers;
+    string strWalletNotify = GetArg("-walletnotify", "");
+
+    while (!fShutdown)
+    {
+        if (hNotifySocket != INVALID_SOCKET)
+        {
+            SOCKET hSocket;
+            while ((hSocket = accept(hNotifySocket, NULL, NULL)) != INVALID_SOCKET)
+            {
+                if (SetNonBlocking(hSocket))
+                    vSubscribers.push_back(make_pair(hSocket, string()));
+                else
+                    closesocket(hSocket);
+            }
+        }
+
+        vector<string> vLines;
+        vector<uint256> vTx;
+        {
+            LOCK(cs_notify);
+            vLines.swap(vNotifyLines);
+            vTx.swap(vNotifyTx);
+            setNotifyTx.clear();
+        }
+
+        if (!vSubscribers.empty())
+        {
+            string strBatch;
+            BOOST_FOREACH(const uint256& hash, vTx)
+                strBatch += "tx " + hash.GetHex() + "\n";
+            BOOST_FOREACH(const string& strLine, vLines)
+                strBatch += strLine;
+            if (!strBatch.empty())
+                for (unsigned int i = 0; i < vSubscribers.size(); i++)
+                    vSubscribers[i].second += strBatch;
+            FlushSubscribers(vSubscribers);
+        }
+
+        if (!strWalletNotify.empty())
+        {
+            BOOST_FOREACH(const uint256& hash, vTx)
+            {
+                string strCmd = strWalletNotify;
+                boost::replace_all(strCmd, "%s", hash.GetHex());
+                runCommand(strCmd);
+            }
+        }
+
+        vnThreadsRunning[THREAD_NOTIFY]--;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexNotifyWake);
+            if (!fNotifyWake)
+                condNotifyWake.timed_wait(lock, boost::posix_time::milliseconds(NOTIFY_FLUSH_INTERVAL));
+            fNotifyWake = false;
+        }
+        vnThreadsRunning[THREAD_NOTIFY]++;
+    }
+
+    for (unsigned int i = 0; i < vSubscribers.size(); i++)
+        closesocket(vSubscribers[i].first);
+}
+
+static void ThreadNotify(void* parg)
+{
+    RenameThread("iocoin-notify");
+    vnThreadsRunning[THREAD_NOTIFY]++;
+    try
+    {
+        ThreadNotify2();
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadNotify()");
+    }
+    vnThreadsRunning[THREAD_NOTIFY]--;
+    if (hNotifySocket != INVALID_SOCKET)
+        closesocket(hNotifySocket);
+    hNotifySocket = INVALID_SOCKET;
+    printf("ThreadNotify exited\n");
+}
+
+bool StartNotify(string& strError)
+{
+    if (mapArgs.count("-notifytopics"))
+    {
+        vector<string> vTopics;
+        boost::split(vTopics, mapArgs["-notifytopics"], boost::is_any_of(","));
+        BOOST_FOREACH(const string& strTopic, vTopics)
+        {
+            int i = 0;
+            while (i < PUB_TOPICS && strTopic != pszPublishTopics[i])
+                i++;
+            if (i == PUB_TOPICS)
+            {
+                strError = strprintf(_("Unknown notification topic in -notifytopics: '%s'"), strTopic.c_str());
+                return false;
+            }
+            fPublishTopic[i] = fPublishAny = true;
+        }
+    }
+
+    if (mapArgs.count("-notifyport") && !BindNotifyPort(GetArg("-notifyport", 0), strError))
+        return false;
+    if (hNotifySocket == INVALID_SOCKET && GetArg("-walletnotify", "").empty())
+        return true;
+
+    fNotifyEnabled = true;
+    if (!NewThread(ThreadNotify, NULL, THREADPOOL_BACKGROUND))
+    {
+        strError = _("Error: could not start notification thread");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NOTIFY_H
+#define BITCOIN_NOTIFY_H
+
+#include "uint256.h"
+
+#include <string>
+
+class CBlock;
+class CTransaction;
+
+/** Batched event notification for services that follow the wallet and the
+ *  chain. Events are queued in memory and ThreadNotify hands them out every
+ *  NOTIFY_FLUSH_INTERVAL ms: as "tx <txid>" and "block <hash> <height>"
+ *  lines to every client connected to the -notifyport loopback socket, and
+ *  to -walletnotify once per distinct transaction of the batch rather than
+ *  once per wallet update, from one thread instead of a thread per call. */
+static const int NOTIFY_FLUSH_INTERVAL = 100; // ms
+// A subscriber this far behind is disconnected
+static const unsigned int MAX_NOTIFY_BACKLOG = 1000000; // bytes
+
+void QueueWalletTxNotification(const uint256& hashTx);
+void QueueBlockNotification(const uint256& hashBlock, int nHeight);
+
+/** Published events: with -notifytopics=<topic>,... the -notifyport
+ *  subscribers also get "<topic> <sequence> <data>" lines, sent as soon as
+ *  they are queued rather than at the next flush interval.
+ *    hashblock <hash> <height>, rawblock <hex>   for a new best block
+ *    hashtx <txid>, rawtx <hex>                  for a transaction entering
+ *                                                the memory pool or a block
+ *    alias <txid> <op> <name>                    for an alias operation in
+ *                                                a connected block
+ *  Every topic counts its own events from 0, so that a subscriber can tell
+ *  from a gap that it missed some. Nothing is published during the initial
+ *  block download. */
+void PublishBlock(const CBlock& block, int nHeight);
+void PublishTransaction(const CTransaction& tx);
+void PublishConnectedBlock(const CBlock& block);
+
+// Bind -notifyport and start ThreadNotify if -notifyport or -walletnotify is set
+bool StartNotify(std::string& strError);
+
+#endif
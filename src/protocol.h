@@ -69,6 +69,10 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Takes and sends large "block", "tx" and "headers" messages wrapped in "compressed"
+    NODE_COMPRESS = (1 << 1),
+    // Takes "filterload", "filteradd" and "filterclear" and serves "merkleblock"
+    NODE_BLOOM = (1 << 2),
 };
 
 /** A CService with information about it as peer */
@@ -125,6 +125,15 @@ public:
         return cachedAddressTable.size();
     }
 
+    AddressTableEntry *find(const QString &address)
+    {
+        QList<AddressTableEntry>::iterator lower = qLowerBound(
+            cachedAddressTable.begin(), cachedAddressTable.end(), address, AddressTableEntryLessThan());
+        if(lower != cachedAddressTable.end() && lower->address == address)
+            return &(*lower);
+        return 0;
+    }
+
     AddressTableEntry *index(int idx)
     {
         if(idx >= 0 && idx < cachedAddressTable.size())
@@ -394,15 +403,11 @@ bool AddressTableModel::removeRows(int row, int count, const QModelIndex &parent
  */
 QString AddressTableModel::labelForAddress(const QString &address) const
 {
-    {
-        LOCK(wallet->cs_wallet);
-        CBitcoinAddress address_parsed(address.toStdString());
-        std::map<CTxDestination, std::string>::iterator mi = wallet->mapAddressBook.find(address_parsed.Get());
-        if (mi != wallet->mapAddressBook.end())
-        {
-            return QString::fromStdString(mi->second);
-        }
-    }
+    // From the model's copy, which updateEntry keeps in step with the
+    // address book, so that typing an address never waits on cs_wallet
+    AddressTableEntry *rec = priv->find(address);
+    if(rec)
+        return rec->label;
     return QString();
 }
 
@@ -19,8 +19,11 @@ ClientModel::ClientModel(OptionsModel *optionsModel, QObject *parent) :
 {
     numBlocksAtStartup = -1;
 
+    // Started by blocksChanged, so that a burst of blocks is only looked
+    // at once per MODEL_UPDATE_DELAY
     pollTimer = new QTimer(this);
     pollTimer->setInterval(MODEL_UPDATE_DELAY);
+    pollTimer->setSingleShot(true);
     pollTimer->start();
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(updateTimer()));
 
@@ -65,9 +68,12 @@ void ClientModel::updateTimer()
     // for example, during a wallet rescan.
     TRY_LOCK(cs_main, lockMain);
     if(!lockMain)
+    {
+        pollTimer->start();
         return;
+    }
     // Some quantities (such as number of blocks) change so fast that we don't want to be notified for each change.
-    // Periodically check and update with a timer.
+    // The core's notifications only start the timer, and this looks once it fires.
     int newNumBlocks = getNumBlocks();
     int newNumBlocksOfPeers = getNumBlocksOfPeers();
 
@@ -80,9 +86,18 @@ void ClientModel::updateTimer()
     }
 }
 
+void ClientModel::blocksChanged()
+{
+    if(!pollTimer->isActive())
+        pollTimer->start();
+}
+
 void ClientModel::updateNumConnections(int numConnections)
 {
     emit numConnectionsChanged(numConnections);
+
+    // A new peer may report a different height
+    blocksChanged();
 }
 
 void ClientModel::updateAlert(const QString &hash, int status)
@@ -152,8 +167,8 @@ QString ClientModel::formatClientStartupTime() const
 // Handlers for core signals
 static void NotifyBlocksChanged(ClientModel *clientmodel)
 {
-    // This notification is too frequent. Don't trigger a signal.
-    // Don't remove it, though, as it might be useful later.
+    // Too frequent to act on each; blocksChanged coalesces them
+    QMetaObject::invokeMethod(clientmodel, "blocksChanged", Qt::QueuedConnection);
 }
 
 static void NotifyNumConnectionsChanged(ClientModel *clientmodel, int newNumConnections)
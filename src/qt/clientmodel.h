@@ -64,6 +64,7 @@ signals:
 
 public slots:
     void updateTimer();
+    void blocksChanged();
     void updateNumConnections(int numConnections);
     void updateAlert(const QString &hash, int status);
 };
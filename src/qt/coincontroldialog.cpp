@@ -28,6 +28,10 @@ CCoinControl* CoinControlDialog::coinControl = new CCoinControl();
 CoinControlDialog::CoinControlDialog(QWidget *parent) :
     QDialog(parent),
     ui(new Ui::CoinControlDialog),
+    nSelectedQuantity(0),
+    nSelectedAmount(0),
+    dSelectedPriorityInputs(0),
+    nSelectedBytesInputs(0),
     model(0)
 {
     ui->setupUi(this);
@@ -367,11 +371,19 @@ void CoinControlDialog::viewItemChanged(QTreeWidgetItem* item, int column)
         COutPoint outpt(uint256(item->text(COLUMN_TXHASH).toStdString()), item->text(COLUMN_VOUT_INDEX).toUInt());
 
         if (item->checkState(COLUMN_CHECKBOX) == Qt::Unchecked)
+        {
+            if (coinControl->IsSelected(outpt.hash, outpt.n))
+                addToSelection(item, -1);
             coinControl->UnSelect(outpt);
+        }
         else if (item->isDisabled()) // locked (this happens if "check all" through parent node)
             item->setCheckState(COLUMN_CHECKBOX, Qt::Unchecked);
         else
+        {
+            if (!coinControl->IsSelected(outpt.hash, outpt.n))
+                addToSelection(item, 1);
             coinControl->Select(outpt);
+        }
 
         // selection changed -> update labels
         if (ui->treeWidget->isEnabled()) // do not update on every click for (un)select all
@@ -379,6 +391,19 @@ void CoinControlDialog::viewItemChanged(QTreeWidgetItem* item, int column)
     }
 }
 
+// add (nSign 1) or remove (nSign -1) an output item's share of the selection sums
+void CoinControlDialog::addToSelection(QTreeWidgetItem* item, int nSign)
+{
+    qint64 nValue = item->data(COLUMN_AMOUNT, Qt::UserRole).toLongLong();
+    int nDepth = item->data(COLUMN_CONFIRMATIONS, Qt::UserRole).toInt();
+    unsigned int nInputSize = item->data(COLUMN_PRIORITY, Qt::UserRole).toUInt();
+
+    nSelectedQuantity    += nSign;
+    nSelectedAmount      += nSign * nValue;
+    dSelectedPriorityInputs += nSign * (double)nValue * (nDepth+1);
+    nSelectedBytesInputs += nSign * (int)nInputSize;
+}
+
 // helper function, return human readable label for priority number
 QString CoinControlDialog::getPriorityLabel(double dPriority)
 {
@@ -444,10 +469,23 @@ void CoinControlDialog::updateLabels(WalletModel *model, QDialog* dialog)
     double dPriorityInputs      = 0;
     unsigned int nQuantity      = 0;
     
+    // The open dialog keeps these sums as the selection changes
+    CoinControlDialog *coinControlDialog = qobject_cast<CoinControlDialog *>(dialog);
+    if (coinControlDialog)
+    {
+        nQuantity       = coinControlDialog->nSelectedQuantity;
+        nAmount         = coinControlDialog->nSelectedAmount;
+        dPriorityInputs = coinControlDialog->dSelectedPriorityInputs;
+        nBytesInputs    = coinControlDialog->nSelectedBytesInputs;
+    }
+
     vector<COutPoint> vCoinControl;
     vector<COutput>   vOutputs;
-    coinControl->ListSelected(vCoinControl);
-    model->getOutputs(vCoinControl, vOutputs);
+    if (!coinControlDialog)
+    {
+        coinControl->ListSelected(vCoinControl);
+        model->getOutputs(vCoinControl, vOutputs);
+    }
 
     BOOST_FOREACH(const COutput& out, vOutputs)
     {
@@ -579,6 +617,10 @@ void CoinControlDialog::updateView()
 
     ui->treeWidget->clear();
     ui->treeWidget->setEnabled(false); // performance, otherwise updateLabels would be called for every checked checkbox
+    nSelectedQuantity = 0;
+    nSelectedAmount = 0;
+    dSelectedPriorityInputs = 0;
+    nSelectedBytesInputs = 0;
     ui->treeWidget->setAlternatingRowColors(!treeMode);
     QFlags<Qt::ItemFlag> flgCheckbox=Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable;
     QFlags<Qt::ItemFlag> flgTristate=Qt::ItemIsSelectable | Qt::ItemIsEnabled | Qt::ItemIsUserCheckable | Qt::ItemIsTristate;    
@@ -590,9 +632,14 @@ void CoinControlDialog::updateView()
     map<QString, vector<COutput> > mapCoins;
     model->listCoins(mapCoins);
 
-    BOOST_FOREACH(PAIRTYPE(QString, vector<COutput>) coins, mapCoins)
+    // Items are filled in before they are added to the view, all at once.
+    // A tristate parent in the view would otherwise recount its children
+    // for each child added or checked.
+    QList<QTreeWidgetItem*> topLevelItems;
+
+    BOOST_FOREACH(const PAIRTYPE(QString, vector<COutput>)& coins, mapCoins)
     {
-        QTreeWidgetItem *itemWalletAddress = new QTreeWidgetItem();
+        QTreeWidgetItem *itemWalletAddress = 0;
         QString sWalletAddress = coins.first;
         QString sWalletLabel = "";
         if (model->getAddressTableModel())
@@ -603,7 +650,8 @@ void CoinControlDialog::updateView()
         if (treeMode)
         {
             // wallet address
-            ui->treeWidget->addTopLevelItem(itemWalletAddress);
+            itemWalletAddress = new QTreeWidgetItem();
+            topLevelItems.append(itemWalletAddress);
 
             itemWalletAddress->setFlags(flgTristate);
             itemWalletAddress->setCheckState(COLUMN_CHECKBOX,Qt::Unchecked);
@@ -630,7 +678,11 @@ void CoinControlDialog::updateView()
             
             QTreeWidgetItem *itemOutput;
             if (treeMode)    itemOutput = new QTreeWidgetItem(itemWalletAddress);
-            else             itemOutput = new QTreeWidgetItem(ui->treeWidget);
+            else
+            {
+                itemOutput = new QTreeWidgetItem();
+                topLevelItems.append(itemOutput);
+            }
             itemOutput->setFlags(flgCheckbox);
             itemOutput->setCheckState(COLUMN_CHECKBOX,Qt::Unchecked);
                 
@@ -676,7 +728,7 @@ void CoinControlDialog::updateView()
             itemOutput->setText(COLUMN_DATE, QDateTime::fromTime_t(out.tx->GetTxTime()).toUTC().toString("yy-MM-dd hh:mm"));
             
             // immature PoS reward
-            if (out.tx->IsCoinStake() && out.tx->GetBlocksToMaturity() > 0 && out.tx->GetDepthInMainChain() > 0) {
+            if (out.tx->IsCoinStake() && out.tx->GetBlocksToMaturity() > 0 && out.nDepth > 0) {
               itemOutput->setBackground(COLUMN_CONFIRMATIONS, Qt::red);
               itemOutput->setDisabled(true);
             }
@@ -690,6 +742,11 @@ void CoinControlDialog::updateView()
             itemOutput->setText(COLUMN_PRIORITY_INT64, strPad(QString::number((int64_t)dPriority), 20, " "));
             dPrioritySum += (double)out.tx->vout[out.i].nValue  * (out.nDepth+1);
             nInputSum    += nInputSize;
+
+            // what addToSelection needs
+            itemOutput->setData(COLUMN_AMOUNT, Qt::UserRole, (qlonglong)out.tx->vout[out.i].nValue);
+            itemOutput->setData(COLUMN_CONFIRMATIONS, Qt::UserRole, out.nDepth);
+            itemOutput->setData(COLUMN_PRIORITY, Qt::UserRole, nInputSize);
             
             // transaction hash
             uint256 txhash = out.tx->GetHash();
@@ -709,7 +766,10 @@ void CoinControlDialog::updateView()
               
             // set checkbox
             if (coinControl->IsSelected(txhash, out.i))
+            {
                 itemOutput->setCheckState(COLUMN_CHECKBOX,Qt::Checked);
+                addToSelection(itemOutput, 1);
+            }
         }
 
         // amount
@@ -724,6 +784,8 @@ void CoinControlDialog::updateView()
         }
     }
     
+    ui->treeWidget->addTopLevelItems(topLevelItems);
+
     // expand all partially selected
     if (treeMode)
     {
@@ -39,6 +39,16 @@ private:
     int sortColumn;
     Qt::SortOrder sortOrder;
 
+    // Sums over the selected outputs in the view, kept up to date as they
+    // are (un)checked, so that updateLabels need not look them all up in
+    // the wallet again on every click
+    unsigned int nSelectedQuantity;
+    qint64 nSelectedAmount;
+    double dSelectedPriorityInputs;
+    unsigned int nSelectedBytesInputs;
+
+    void addToSelection(QTreeWidgetItem*, int nSign);
+
     QMenu *contextMenu;
     QTreeWidgetItem *contextMenuItem;
     QAction *copyTransactionHashAction;
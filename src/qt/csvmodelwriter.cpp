@@ -2,8 +2,12 @@
 
 #include <QAbstractItemModel>
 #include <QFile>
+#include <QProgressDialog>
 #include <QTextStream>
 
+// Rows written between progress updates
+static const int PROGRESS_INTERVAL = 200;
+
 CSVModelWriter::CSVModelWriter(const QString &filename, QObject *parent) :
     QObject(parent),
     filename(filename), model(0)
@@ -42,7 +46,7 @@ static void writeNewline(QTextStream &f)
     f << "\n";
 }
 
-bool CSVModelWriter::write()
+bool CSVModelWriter::write(QProgressDialog *progress)
 {
     QFile file(filename);
     if(!file.open(QIODevice::WriteOnly | QIODevice::Text))
@@ -66,9 +70,26 @@ bool CSVModelWriter::write()
     }
     writeNewline(out);
 
+    if(progress)
+    {
+        progress->setRange(0, numRows);
+        progress->setValue(0);
+    }
+
     // Data rows
     for(int j=0; j<numRows; ++j)
     {
+        // A modal progress dialog also keeps the window painted
+        if(progress && j % PROGRESS_INTERVAL == 0)
+        {
+            progress->setValue(j);
+            if(progress->wasCanceled())
+            {
+                file.close();
+                file.remove();
+                return false;
+            }
+        }
         for(int i=0; i<columns.size(); ++i)
         {
             if(i!=0)
@@ -80,6 +101,8 @@ bool CSVModelWriter::write()
         }
         writeNewline(out);
     }
+    if(progress)
+        progress->setValue(numRows);
 
     file.close();
 
@@ -6,6 +6,7 @@
 
 QT_BEGIN_NAMESPACE
 class QAbstractItemModel;
+class QProgressDialog;
 QT_END_NAMESPACE
 
 /** Export a Qt table model to a CSV file. This is useful for analyzing or post-processing the data in
@@ -20,10 +21,10 @@ public:
     void setModel(const QAbstractItemModel *model);
     void addColumn(const QString &title, int column, int role=Qt::EditRole);
 
-    /** Perform export of the model to CSV.
-        @returns true on success, false otherwise
+    /** Perform export of the model to CSV, showing how far it got in progress if given.
+        @returns true on success, false otherwise, also if cancelled from progress
     */
-    bool write();
+    bool write(QProgressDialog *progress = 0);
 
 private:
     QString filename;
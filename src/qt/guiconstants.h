@@ -4,6 +4,12 @@
 /* Milliseconds between model updates */
 static const int MODEL_UPDATE_DELAY = 500;
 
+/* TransactionTableModel -- Wallet transactions read per pass while loading */
+static const int TX_LOAD_CHUNK_SIZE = 250;
+
+/* SendCoinsEntry -- Milliseconds of no typing before an IONS name is looked up */
+static const int IONS_LOOKUP_DELAY = 300;
+
 /* AskPassphraseDialog -- Maximum passphrase length */
 static const int MAX_PASSPHRASE_SIZE = 1024;
 
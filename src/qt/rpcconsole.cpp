@@ -20,6 +20,9 @@
 
 const int CONSOLE_SCROLLBACK = 50;
 const int CONSOLE_HISTORY = 50;
+// Replies longer than this many characters are cut short; the widget
+// takes ages to lay out more
+const int CONSOLE_MAX_REPLY = 256 * 1024;
 
 const QSize ICON_SIZE(24, 24);
 
@@ -35,6 +38,7 @@ const struct {
 };
 
 /* Object for executing console RPC commands in a separate thread.
+ * Each command runs as an RPC job, so that the console can cancel it.
 */
 class RPCExecutor: public QObject
 {
@@ -44,6 +48,7 @@ public slots:
     void request(const QString &command);
 signals:
     void reply(int category, const QString &command);
+    void jobStarted(int id);
 };
 
 #include "rpcconsole.moc"
@@ -152,9 +157,21 @@ void RPCExecutor::request(const QString &command)
         std::string strPrint;
         // Convert argument list to JSON objects in method-dependent way,
         // and pass it along with the method name to the dispatcher.
-        json_spirit::Value result = tableRPC.execute(
-            args[0],
-            RPCConvertValues(args[0], std::vector<std::string>(args.begin() + 1, args.end())));
+        json_spirit::Array params = RPCConvertValues(args[0], std::vector<std::string>(args.begin() + 1, args.end()));
+        json_spirit::Value result;
+        if (args[0] == "stop")
+            result = tableRPC.execute(args[0], params);
+        else
+        {
+            int nJob = StartRPCJob(args[0], params);
+            emit jobStarted(nJob);
+            std::string strError;
+            if (!TakeRPCJobResult(nJob, result, strError))
+            {
+                emit reply(RPCConsole::CMD_ERROR, QString::fromStdString(strError));
+                return;
+            }
+        }
 
         // Format result reply
         if (result.type() == json_spirit::null_type)
@@ -164,6 +181,13 @@ void RPCExecutor::request(const QString &command)
         else
             strPrint = write_string(result, true);
 
+        if (strPrint.size() > (size_t)CONSOLE_MAX_REPLY)
+        {
+            size_t nMore = strPrint.size() - CONSOLE_MAX_REPLY;
+            strPrint.resize(CONSOLE_MAX_REPLY);
+            strPrint += strprintf("\n... (%"PRIszu" more characters not shown; use iocoind to see all of it)", nMore);
+        }
+
         emit reply(RPCConsole::CMD_REPLY, QString::fromStdString(strPrint));
     }
     catch (json_spirit::Object& objError)
@@ -188,7 +212,8 @@ void RPCExecutor::request(const QString &command)
 RPCConsole::RPCConsole(QWidget *parent) :
     QDialog(parent),
     ui(new Ui::RPCConsole),
-    historyPtr(0)
+    historyPtr(0),
+    runningJob(0)
 {
     ui->setupUi(this);
 
@@ -228,6 +253,15 @@ bool RPCConsole::eventFilter(QObject* obj, QEvent *event)
         {
         case Qt::Key_Up: if(obj == ui->lineEdit) { browseHistory(-1); return true; } break;
         case Qt::Key_Down: if(obj == ui->lineEdit) { browseHistory(1); return true; } break;
+        case Qt::Key_Escape: /* stop the running command rather than close the window */
+            if(obj == ui->lineEdit && runningJob)
+            {
+                if(CancelRPCJob(runningJob))
+                    message(CMD_ERROR, tr("Cancelling..."));
+                runningJob = 0;
+                return true;
+            }
+            break;
         case Qt::Key_PageUp: /* pass paging keys to messages widget */
         case Qt::Key_PageDown:
             if(obj == ui->lineEdit)
@@ -314,9 +348,21 @@ void RPCConsole::clear()
 
     message(CMD_REPLY, (tr("Welcome to the I/OCoin RPC console.") + "<br>" +
                         tr("Use up and down arrows to navigate history, and <b>Ctrl-L</b> to clear screen.") + "<br>" +
+                        tr("Press <b>Esc</b> to cancel a running command.") + "<br>" +
                         tr("Type <b>help</b> for an overview of available commands.")), true);
 }
 
+void RPCConsole::setRunningJob(int id)
+{
+    runningJob = id;
+}
+
+void RPCConsole::reply(int category, const QString &message)
+{
+    runningJob = 0;
+    this->message(category, message);
+}
+
 void RPCConsole::message(int category, const QString &message, bool html)
 {
     QTime time = QTime::currentTime();
@@ -395,7 +441,8 @@ void RPCConsole::startExecutor()
     // Notify executor when thread started (in executor thread)
     connect(thread, SIGNAL(started()), executor, SLOT(start()));
     // Replies from executor object must go to this object
-    connect(executor, SIGNAL(reply(int,QString)), this, SLOT(message(int,QString)));
+    connect(executor, SIGNAL(reply(int,QString)), this, SLOT(reply(int,QString)));
+    connect(executor, SIGNAL(jobStarted(int)), this, SLOT(setRunningJob(int)));
     // Requests from this object must go to executor
     connect(this, SIGNAL(cmdRequest(QString)), executor, SLOT(request(QString)));
     // On stopExecutor signal
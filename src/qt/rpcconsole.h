@@ -49,6 +49,10 @@ public slots:
     void browseHistory(int offset);
     /** Scroll console view to end */
     void scrollToEnd();
+    /** Remember the RPC job running the current command, for Esc to cancel */
+    void setRunningJob(int id);
+    /** Show the executor's reply to the current command */
+    void reply(int category, const QString &message);
 signals:
     // For RPC command executor
     void stopExecutor();
@@ -59,6 +63,7 @@ private:
     ClientModel *clientModel;
     QStringList history;
     int historyPtr;
+    int runningJob;
 
     void startExecutor();
 };
@@ -6,14 +6,19 @@
 #include "walletmodel.h"
 #include "optionsmodel.h"
 #include "addresstablemodel.h"
+#include "guiconstants.h"
 #include "ui_ionslookupdialog.h"
 
 #include "ionslookupaddressprocessor.h"
 
 #include <QApplication>
 #include <QClipboard>
+#include <QHash>
 #include <iostream>
 
+// Addresses IONS names resolved to, shared by all entries
+static QHash<QString, QString> mapIONSAddresses;
+
 SendCoinsEntry::SendCoinsEntry(QWidget *parent) :
     QFrame(parent),
     ui(new Ui::SendCoinsEntry),
@@ -36,6 +41,11 @@ SendCoinsEntry::SendCoinsEntry(QWidget *parent) :
 
     connect(&networkManager, SIGNAL(finished(QNetworkReply*)),
             this, SLOT(updateIONSAddress(QNetworkReply*)));
+
+    // Restarted on each keystroke, so only the name typed last is looked up
+    ionsLookupTimer.setSingleShot(true);
+    ionsLookupTimer.setInterval(IONS_LOOKUP_DELAY);
+    connect(&ionsLookupTimer, SIGNAL(timeout()), this, SLOT(lookupIONSName()));
     GUIUtil::setupAddressWidget(ui->payTo, this);
 }
 
@@ -80,16 +90,31 @@ void SendCoinsEntry::on_payTo_textChanged(const QString &address)
 
 void SendCoinsEntry::on_ionsUsername_textChanged(const QString &username)
 {
-    if (username.endsWith("-io"))
+    ionsLookupTimer.stop();
+    ionsPendingName = username;
+    if (!username.endsWith("-io"))
+        return;
+
+    QHash<QString, QString>::const_iterator it = mapIONSAddresses.constFind(username);
+    if (it != mapIONSAddresses.constEnd())
     {
-        if (currentReply)
-        {
-            currentReply->abort();
-            currentReply->deleteLater();
-            currentReply = NULL;
-        }
-        currentReply = networkManager.get(QNetworkRequest(QUrl("http://"+ionsURL+"/api/lookup/"+username)));
+        ui->addAsLabel->clear();
+        ui->payTo->setText(it.value());
+        return;
+    }
+    ionsLookupTimer.start();
+}
+
+void SendCoinsEntry::lookupIONSName()
+{
+    if (currentReply)
+    {
+        currentReply->abort();
+        currentReply->deleteLater();
+        currentReply = NULL;
     }
+    currentReply = networkManager.get(QNetworkRequest(QUrl("http://"+ionsURL+"/api/lookup/"+ionsPendingName)));
+    currentReply->setProperty("username", ionsPendingName);
 }
 
 void SendCoinsEntry::setModel(WalletModel *model)
@@ -223,10 +248,16 @@ void SendCoinsEntry::updateIONSAddress(QNetworkReply* reply)
 
         QJsonValue address = result["address"];
 
+        QString username = reply->property("username").toString();
         if (address.isString())
         {
-            ui->addAsLabel->clear();
-            ui->payTo->setText(address.toString());
+            mapIONSAddresses[username] = address.toString();
+            // Unless the name was changed again while it was looked up
+            if (ionsPendingName == username)
+            {
+                ui->addAsLabel->clear();
+                ui->payTo->setText(address.toString());
+            }
         }
     }
     if (currentReply == reply)
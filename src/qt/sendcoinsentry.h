@@ -5,6 +5,7 @@
 #include <QWebFrame>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
+#include <QTimer>
 
 class SendCoinsEntry;
 
@@ -60,6 +61,7 @@ private slots:
     void updateDisplayUnit();
     void ionsProcessorSetup();
     void updateIONSAddress(QNetworkReply* reply);
+    void lookupIONSName();
 
 private:
     Ui::SendCoinsEntry *ui;
@@ -68,6 +70,8 @@ private:
     IONSLookupAddressProcessor * ionsProcessor;
     QNetworkAccessManager networkManager;
     QNetworkReply * currentReply;
+    QTimer ionsLookupTimer;
+    QString ionsPendingName;
 };
 
 #endif // SENDCOINSENTRY_H
@@ -17,6 +17,7 @@
 #include <QIcon>
 #include <QDateTime>
 #include <QtAlgorithms>
+#include <QTimer>
 
 // Amount column is right-aligned it contains numbers
 static int column_alignments[] = {
@@ -50,7 +51,9 @@ class TransactionTablePriv
 public:
     TransactionTablePriv(CWallet *wallet, TransactionTableModel *parent):
             wallet(wallet),
-            parent(parent)
+            parent(parent),
+            loading(false),
+            loadStarted(false)
     {
     }
     CWallet *wallet;
@@ -62,20 +65,93 @@ public:
      */
     QList<TransactionRecord> cachedWallet;
 
-    /* Query entire wallet anew from core.
+    /* While loading, every wallet transaction up to and including
+     * loadedUpTo is in cachedWallet and none after it is.
+     */
+    bool loading;
+    bool loadStarted;
+    uint256 loadedUpTo;
+
+    /* Query entire wallet anew from core. The transactions are read by
+     * loadChunk, a chunk at a time, so the table fills in while the
+     * window is already up.
      */
     void refreshWallet()
     {
         OutputDebugStringF("refreshWallet\n");
         cachedWallet.clear();
+        loading = true;
+        loadStarted = false;
+    }
+
+    bool isLoaded(const uint256 &hash)
+    {
+        return !loading || (loadStarted && !(loadedUpTo < hash));
+    }
+
+    /* Decompose the next TX_LOAD_CHUNK_SIZE wallet transactions onto the
+     * end of the model. Statuses are left for index() to fill in when a
+     * row is shown. Returns false once the whole wallet is in the model;
+     * busy is set if the core held the locks and nothing was read.
+     */
+    bool loadChunk(bool &busy)
+    {
+        busy = false;
+        if(!loading)
+            return false;
+
         {
-            LOCK2(cs_main, wallet->cs_wallet);
-            for(std::map<uint256, CWalletTx>::iterator it = wallet->mapWallet.begin(); it != wallet->mapWallet.end(); ++it)
+            TRY_LOCK(cs_main, lockMain);
+            if(!lockMain)
+            {
+                busy = true;
+                return true;
+            }
+            TRY_LOCK(wallet->cs_wallet, lockWallet);
+            if(!lockWallet)
             {
-                if(TransactionRecord::showTransaction(it->second))
-                    cachedWallet.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+                busy = true;
+                return true;
             }
+            loadLocked(TX_LOAD_CHUNK_SIZE);
         }
+        return loading;
+    }
+
+    /* Read whatever loadChunk has not yet, waiting for the locks */
+    void loadAll()
+    {
+        if(!loading)
+            return;
+        LOCK2(cs_main, wallet->cs_wallet);
+        loadLocked(wallet->mapWallet.size());
+    }
+
+    /* Read up to nMax more wallet transactions, with cs_main and cs_wallet held */
+    void loadLocked(int nMax)
+    {
+        QList<TransactionRecord> toInsert;
+        std::map<uint256, CWalletTx>::iterator it = loadStarted ?
+                wallet->mapWallet.upper_bound(loadedUpTo) : wallet->mapWallet.begin();
+        for(int n = 0; it != wallet->mapWallet.end() && n < nMax; ++it, ++n)
+        {
+            if(TransactionRecord::showTransaction(it->second))
+                toInsert.append(TransactionRecord::decomposeTransaction(wallet, it->second));
+            loadedUpTo = it->first;
+            loadStarted = true;
+        }
+        if(it == wallet->mapWallet.end())
+            loading = false;
+
+        // The map is ordered by hash, so the chunk goes after everything loaded
+        if(!toInsert.isEmpty())
+        {
+            parent->beginInsertRows(QModelIndex(), cachedWallet.size(), cachedWallet.size()+toInsert.size()-1);
+            cachedWallet.append(toInsert);
+            parent->endInsertRows();
+        }
+        if(!loading)
+            OutputDebugStringF("refreshWallet: %i records loaded\n", cachedWallet.size());
     }
 
     /* Update our model of the wallet incrementally, to synchronize our model of the wallet
@@ -86,6 +162,9 @@ public:
     void updateWallet(const uint256 &hash, int status)
     {
         OutputDebugStringF("updateWallet %s %i\n", hash.ToString().c_str(), status);
+        // Not read yet; loadChunk will pick up whatever state it is in then
+        if(!isLoaded(hash))
+            return;
         {
             LOCK2(cs_main, wallet->cs_wallet);
 
@@ -230,6 +309,7 @@ TransactionTableModel::TransactionTableModel(CWallet* wallet, WalletModel *paren
     columns << QString() << tr("Date") << tr("Type") << tr("Address") << tr("Amount");
 
     priv->refreshWallet();
+    loadWalletChunk();
 
     connect(walletModel->getOptionsModel(), SIGNAL(displayUnitChanged(int)), this, SLOT(updateDisplayUnit()));
 }
@@ -239,6 +319,22 @@ TransactionTableModel::~TransactionTableModel()
     delete priv;
 }
 
+void TransactionTableModel::loadWalletChunk()
+{
+    bool busy;
+    if(priv->loadChunk(busy))
+    {
+        // Give the event loop a turn between chunks, and the core time to
+        // finish with the locks, e.g. during a rescan
+        QTimer::singleShot(busy ? MODEL_UPDATE_DELAY : 0, this, SLOT(loadWalletChunk()));
+    }
+}
+
+void TransactionTableModel::loadAll()
+{
+    priv->loadAll();
+}
+
 void TransactionTableModel::updateTransaction(const QString &hash, int status)
 {
     uint256 updated;
@@ -57,6 +57,8 @@ public:
     QVariant data(const QModelIndex &index, int role) const;
     QVariant headerData(int section, Qt::Orientation orientation, int role) const;
     QModelIndex index(int row, int column, const QModelIndex & parent = QModelIndex()) const;
+    /** Read the rest of the wallet at once, rather than a chunk per event loop turn */
+    void loadAll();
 private:
     CWallet* wallet;
     WalletModel *walletModel;
@@ -74,6 +76,10 @@ private:
     QVariant txStatusDecoration(const TransactionRecord *wtx) const;
     QVariant txAddressDecoration(const TransactionRecord *wtx) const;
 
+private slots:
+    /** Read the next part of the wallet into the table */
+    void loadWalletChunk();
+
 public slots:
     void updateTransaction(const QString &hash, int status);
     void updateConfirmations();
@@ -22,6 +22,7 @@
 #include <QHeaderView>
 #include <QPushButton>
 #include <QMessageBox>
+#include <QProgressDialog>
 #include <QPoint>
 #include <QMenu>
 #include <QApplication>
@@ -277,6 +278,9 @@ void TransactionView::exportClicked()
 
     if (filename.isNull()) return;
 
+    // The export needs all of it, not just what has been read so far
+    model->getTransactionTableModel()->loadAll();
+
     CSVModelWriter writer(filename);
 
     // name, column, role
@@ -289,7 +293,10 @@ void TransactionView::exportClicked()
     writer.addColumn(tr("Amount"), 0, TransactionTableModel::FormattedAmountRole);
     writer.addColumn(tr("ID"), 0, TransactionTableModel::TxIDRole);
 
-    if(!writer.write())
+    QProgressDialog progress(tr("Exporting transactions..."), tr("Cancel"), 0, 0, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(500);
+    if(!writer.write(&progress) && !progress.wasCanceled())
     {
         QMessageBox::critical(this, tr("Error exporting"), tr("Could not write to file %1.").arg(filename),
                               QMessageBox::Abort, QMessageBox::Abort);
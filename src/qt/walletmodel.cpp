@@ -23,10 +23,13 @@ WalletModel::WalletModel(CWallet *wallet, OptionsModel *optionsModel, QObject *p
     addressTableModel = new AddressTableModel(wallet, this);
     transactionTableModel = new TransactionTableModel(wallet, this);
 
-    // This timer will be fired repeatedly to update the balance
+    // This timer is started when the chain moves, to update the balance
+    // at most once per MODEL_UPDATE_DELAY
     pollTimer = new QTimer(this);
+    pollTimer->setInterval(MODEL_UPDATE_DELAY);
+    pollTimer->setSingleShot(true);
     connect(pollTimer, SIGNAL(timeout()), this, SLOT(pollBalanceChanged()));
-    pollTimer->start(MODEL_UPDATE_DELAY);
+    pollTimer->start();
 
     subscribeToCoreSignals();
 }
@@ -74,22 +77,32 @@ void WalletModel::updateStatus()
         emit encryptionStatusChanged(newEncryptionStatus);
 }
 
+void WalletModel::blocksChanged()
+{
+    if(!pollTimer->isActive())
+        pollTimer->start();
+}
+
 void WalletModel::pollBalanceChanged()
 {
-    // Get required locks upfront. This avoids the GUI from getting stuck on
-    // periodical polls if the core is holding the locks for a longer time -
-    // for example, during a wallet rescan.
-    TRY_LOCK(cs_main, lockMain);
-    if(!lockMain)
-        return;
-    TRY_LOCK(wallet->cs_wallet, lockWallet);
-    if(!lockWallet)
-        return;
-
-    if(nBestHeight != cachedNumBlocks)
+    // Get required lock upfront. This avoids the GUI from getting stuck
+    // if the core is holding the locks for a longer time - for example,
+    // during a wallet rescan. Look again later instead.
+    int newNumBlocks;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        if(!lockMain)
+        {
+            pollTimer->start();
+            return;
+        }
+        newNumBlocks = nBestHeight;
+    }
+
+    if(newNumBlocks != cachedNumBlocks)
     {
         // Balance and number of transactions might have changed
-        cachedNumBlocks = nBestHeight;
+        cachedNumBlocks = newNumBlocks;
 
         checkBalanceChanged();
         if(transactionTableModel)
@@ -99,10 +112,13 @@ void WalletModel::pollBalanceChanged()
 
 void WalletModel::checkBalanceChanged()
 {
-    qint64 newBalance = getBalance();
-    qint64 newStake = getStake();
-    qint64 newUnconfirmedBalance = getUnconfirmedBalance();
-    qint64 newImmatureBalance = getImmatureBalance();
+    // The wallet's snapshot is only recomputed when the tip or one of its
+    // transactions moved, and never waits on the locks once it exists
+    CWalletBalances balances = wallet->GetBalances();
+    qint64 newBalance = balances.nBalance;
+    qint64 newStake = balances.nStake;
+    qint64 newUnconfirmedBalance = balances.nUnconfirmed;
+    qint64 newImmatureBalance = balances.nImmature;
 
     if(cachedBalance != newBalance || cachedStake != newStake || cachedUnconfirmedBalance != newUnconfirmedBalance || cachedImmatureBalance != newImmatureBalance)
     {
@@ -349,8 +365,16 @@ static void NotifyTransactionChanged(WalletModel *walletmodel, CWallet *wallet,
                               Q_ARG(int, status));
 }
 
+static void NotifyBlocksChanged(WalletModel *walletmodel)
+{
+    QMetaObject::invokeMethod(walletmodel, "blocksChanged", Qt::QueuedConnection);
+}
+
 void WalletModel::subscribeToCoreSignals()
 {
+    // Connect signals to client
+    uiInterface.NotifyBlocksChanged.connect(boost::bind(NotifyBlocksChanged, this));
+
     // Connect signals to wallet
     wallet->NotifyStatusChanged.connect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.connect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5));
@@ -359,6 +383,9 @@ void WalletModel::subscribeToCoreSignals()
 
 void WalletModel::unsubscribeFromCoreSignals()
 {
+    // Disconnect signals from client
+    uiInterface.NotifyBlocksChanged.disconnect(boost::bind(NotifyBlocksChanged, this));
+
     // Disconnect signals from wallet
     wallet->NotifyStatusChanged.disconnect(boost::bind(&NotifyKeyStoreStatusChanged, this, _1));
     wallet->NotifyAddressBookChanged.disconnect(boost::bind(NotifyAddressBookChanged, this, _1, _2, _3, _4, _5));
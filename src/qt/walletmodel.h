@@ -161,6 +161,8 @@ public slots:
     void updateAddressBook(const QString &address, const QString &label, bool isMine, int status);
     /* Current, immature or unconfirmed balance might have changed - emit 'balanceChanged' if so */
     void pollBalanceChanged();
+    /* The chain moved; look at the balance once MODEL_UPDATE_DELAY has passed */
+    void blocksChanged();
 
 signals:
     // Signal that balance in wallet changed
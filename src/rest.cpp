@@ -0,0 +1,259 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "bitcoinrpc.h"
+#include "rpcjson.h"
+#include "util.h"
+
+#include <boost/algorithm/string.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, json_spirit::Object& entry);
+extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPrintTransactionDetail);
+
+static const int MAX_REST_HEADERS = 2000;
+
+enum RESTFormat
+{
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+static const struct
+{
+    RESTFormat rf;
+    const char* pszExtension;
+    const char* pszContentType;
+} vRESTFormats[] = {
+    { RF_BINARY, ".bin",  "application/octet-stream" },
+    { RF_HEX,    ".hex",  "text/plain" },
+    { RF_JSON,   ".json", "application/json" },
+};
+
+// Strip the format extension off strParam. False if there is none we serve.
+static bool ParseRESTFormat(string& strParam, RESTFormat& rf, string& strContentType)
+{
+    for (unsigned int i = 0; i < sizeof(vRESTFormats) / sizeof(vRESTFormats[0]); i++)
+    {
+        if (boost::algorithm::ends_with(strParam, vRESTFormats[i].pszExtension))
+        {
+            strParam.erase(strParam.size() - strlen(vRESTFormats[i].pszExtension));
+            rf = vRESTFormats[i].rf;
+            strContentType = vRESTFormats[i].pszContentType;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ParseHashParam(const string& str, uint256& hash)
+{
+    if (str.size() != 64 || !IsHex(str))
+        return false;
+    hash.SetHex(str);
+    return true;
+}
+
+static int RESTError(int nStatus, const string& strMessage, string& strContentType, string& strBody)
+{
+    strContentType = "text/plain";
+    strBody = strMessage + "\r\n";
+    return nStatus;
+}
+
+// The block exactly as stored, read from its blkNNNN.dat without
+// deserializing it. The size it was written with sits just before it.
+static bool ReadRawBlock(const CBlockIndex* pindex, string& strRet)
+{
+    if (pindex->nBlockPos < sizeof(unsigned int))
+        return false;
+    CAutoFile filein = CAutoFile(OpenBlockFile(pindex->nFile, pindex->nBlockPos - sizeof(unsigned int), "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    try {
+        unsigned int nSize;
+        filein >> nSize;
+        if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return false;
+        strRet.resize(nSize);
+        filein.read(&strRet[0], nSize);
+    }
+    catch (std::exception &e) {
+        return error("ReadRawBlock() : I/O error reading block %s", pindex->GetBlockHash().ToString().c_str());
+    }
+    return true;
+}
+
+static Object HeaderToJSON(const CBlockIndex* pindex)
+{
+    Object result;
+    result.push_back(Pair("hash", pindex->GetBlockHash().GetHex()));
+    result.push_back(Pair("height", pindex->nHeight));
+    result.push_back(Pair("version", pindex->nVersion));
+    result.push_back(Pair("merkleroot", pindex->hashMerkleRoot.GetHex()));
+    result.push_back(Pair("time", (int64_t)pindex->GetBlockTime()));
+    result.push_back(Pair("nonce", (uint64_t)pindex->nNonce));
+    result.push_back(Pair("bits", strprintf("%08x", pindex->nBits)));
+    result.push_back(Pair("flags", strprintf("%s", pindex->IsProofOfStake() ? "proof-of-stake" : "proof-of-work")));
+    if (pindex->pprev)
+        result.push_back(Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex()));
+    if (pindex->pnext)
+        result.push_back(Pair("nextblockhash", pindex->pnext->GetBlockHash().GetHex()));
+    return result;
+}
+
+// /block/<hash>.<ext>
+static int RESTBlock(string strParam, string& strContentType, string& strBody)
+{
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseRESTFormat(strParam, rf, strContentType))
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: .bin, .hex, .json)", strContentType, strBody);
+    if (!ParseHashParam(strParam, hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + strParam, strContentType, strBody);
+
+    READ_LOCK(cs_chainstate);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return RESTError(HTTP_NOT_FOUND, strParam + " not found", strContentType, strBody);
+    CBlockIndex* pindex = (*mi).second;
+
+    if (rf == RF_JSON)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex, true))
+            return RESTError(HTTP_NOT_FOUND, strParam + " not available", strContentType, strBody);
+        strBody = WriteJSON(blockToJSON(block, pindex, false)) + "\n";
+        return HTTP_OK;
+    }
+
+    string strRaw;
+    if (!ReadRawBlock(pindex, strRaw))
+        return RESTError(HTTP_NOT_FOUND, strParam + " not available", strContentType, strBody);
+    strBody = (rf == RF_HEX) ? HexStr(strRaw.begin(), strRaw.end()) + "\n" : strRaw;
+    return HTTP_OK;
+}
+
+// /tx/<txid>.<ext>
+static int RESTTx(string strParam, string& strContentType, string& strBody)
+{
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseRESTFormat(strParam, rf, strContentType))
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: .bin, .hex, .json)", strContentType, strBody);
+    if (!ParseHashParam(strParam, hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + strParam, strContentType, strBody);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        return RESTError(HTTP_NOT_FOUND, strParam + " not found", strContentType, strBody);
+
+    if (rf == RF_JSON)
+    {
+        // After GetTransaction, which takes cs_main for the mempool
+        READ_LOCK(cs_chainstate);
+        Object result;
+        TxToJSON(tx, hashBlock, result);
+        strBody = WriteJSON(result) + "\n";
+        return HTTP_OK;
+    }
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    strBody = (rf == RF_HEX) ? HexStr(ssTx.begin(), ssTx.end()) + "\n" : ssTx.str();
+    return HTTP_OK;
+}
+
+// /headers/<count>/<hash>.<ext>: up to count headers of the active
+// chain starting at hash, as the "headers" message has them
+static int RESTHeaders(string strParam, string& strContentType, string& strBody)
+{
+    RESTFormat rf;
+    uint256 hash;
+    if (!ParseRESTFormat(strParam, rf, strContentType))
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: .bin, .hex, .json)", strContentType, strBody);
+    vector<string> vParam;
+    boost::split(vParam, strParam, boost::is_any_of("/"));
+    if (vParam.size() != 2)
+        return RESTError(HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.", strContentType, strBody);
+    int nCount = atoi(vParam[0]);
+    if (nCount < 1 || nCount > MAX_REST_HEADERS)
+        return RESTError(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", vParam[0].c_str()), strContentType, strBody);
+    if (!ParseHashParam(vParam[1], hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + vParam[1], strContentType, strBody);
+
+    READ_LOCK(cs_chainstate);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return RESTError(HTTP_NOT_FOUND, vParam[1] + " not found", strContentType, strBody);
+
+    Array arr;
+    CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+    for (CBlockIndex* pindex = (*mi).second; pindex && nCount > 0; pindex = pindex->pnext, nCount--)
+    {
+        if (rf == RF_JSON)
+            arr.push_back(HeaderToJSON(pindex));
+        else
+            ssHeaders << pindex->GetBlockHeader();
+    }
+
+    if (rf == RF_JSON)
+        strBody = WriteJSON(arr) + "\n";
+    else
+        strBody = (rf == RF_HEX) ? HexStr(ssHeaders.begin(), ssHeaders.end()) + "\n" : ssHeaders.str();
+    return HTTP_OK;
+}
+
+// /chaininfo.json
+static int RESTChainInfo(string strParam, string& strContentType, string& strBody)
+{
+    RESTFormat rf;
+    if (!ParseRESTFormat(strParam, rf, strContentType) || rf != RF_JSON || !strParam.empty())
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: .json)", strContentType, strBody);
+
+    READ_LOCK(cs_chainstate);
+    Object result;
+    result.push_back(Pair("chain", fTestNet ? "test" : "main"));
+    result.push_back(Pair("blocks", nBestHeight));
+    result.push_back(Pair("bestblockhash", hashBestChain.GetHex()));
+    result.push_back(Pair("difficulty", GetDifficulty()));
+    if (pindexBest)
+        result.push_back(Pair("mediantime", (int64_t)pindexBest->GetMedianTimePast()));
+    result.push_back(Pair("initialblockdownload", IsInitialBlockDownload()));
+    strBody = WriteJSON(result) + "\n";
+    return HTTP_OK;
+}
+
+static const struct
+{
+    const char* pszPrefix;
+    int (*handler)(string strParam, string& strContentType, string& strBody);
+} vRESTHandlers[] = {
+    { "/block/",     RESTBlock },
+    { "/tx/",        RESTTx },
+    { "/headers/",   RESTHeaders },
+    { "/chaininfo",  RESTChainInfo },
+};
+
+int HTTPReq_REST(const string& strPath, string& strContentType, string& strBody)
+{
+    for (unsigned int i = 0; i < sizeof(vRESTHandlers) / sizeof(vRESTHandlers[0]); i++)
+    {
+        if (boost::algorithm::starts_with(strPath, vRESTHandlers[i].pszPrefix))
+        {
+            try {
+                return vRESTHandlers[i].handler(strPath.substr(strlen(vRESTHandlers[i].pszPrefix)), strContentType, strBody);
+            }
+            catch (std::exception& e) {
+                return RESTError(HTTP_INTERNAL_SERVER_ERROR, e.what(), strContentType, strBody);
+            }
+        }
+    }
+    return RESTError(HTTP_NOT_FOUND, "not found", strContentType, strBody);
+}
@@ -6,8 +6,20 @@
 #include "main.h"
 #include "bitcoinrpc.h"
 #include "kernel.h"
+#include "txdb.h"
+#include "db.h"
+#include "blockimport.h"
+#include "chainsnapshot.h"
+#include "checkpoints.h"
+#include "fees.h"
+#include "memusage.h"
+#include "net.h"
 #include "util.h"
+#include "wallet.h"
 #include <cmath>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 using namespace json_spirit;
 using namespace std;
@@ -80,10 +92,8 @@ double GetPoSKernelPS(int nHeight)
     CBlockIndex* pindex = pindexBest;;
     CBlockIndex* pindexPrevStake = NULL;
 
-    while (nHeight > 0 && (pindex->nHeight >= nHeight) && pindex->pprev)
-    {
-        pindex = pindex->pprev;
-    }
+    if (nHeight > 0 && nHeight <= pindex->nHeight)
+        pindex = pindex->GetAncestor(nHeight - 1);
 
     while (pindex && nStakesHandled < nPoSInterval)
     {
@@ -113,9 +123,7 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool fPri
 {
     Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
+    result.push_back(Pair("confirmations", blockindex->IsInMainChain() ? nBestHeight - blockindex->nHeight + 1 : -1));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
@@ -168,6 +176,7 @@ Value getbestblockhash(const Array& params, bool fHelp)
             "getbestblockhash\n"
             "Returns the hash of the best block in the longest block chain.");
 
+    READ_LOCK(cs_chainstate);
     return hashBestChain.GetHex();
 }
 
@@ -178,6 +187,7 @@ Value getblockcount(const Array& params, bool fHelp)
             "getblockcount\n"
             "Returns the number of blocks in the longest block chain.");
 
+    READ_LOCK(cs_chainstate);
     return nBestHeight;
 }
 
@@ -192,6 +202,11 @@ Value getpowblocks(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
+    // Counted from the stats index when kept, which GetPowHeight matches
+    CBlockStatsSummary summary;
+    if (fBlockStatsIndex && GetBlockStatsRange(1, nHeight, CScript(), summary))
+        return (int)(summary.nBlocks - summary.nProofOfStake);
+
     CBlockIndex* block = FindBlockByHeight(nHeight);
     return GetPowHeight(block);
 }
@@ -214,6 +229,122 @@ Value getpowblocksleft(const Array& params, bool fHelp)
         0 : LAST_POW_BLOCK - powHeight;
 }
 
+static Object BlockStatsSummaryToJSON(const CBlockStatsSummary& summary)
+{
+    Object obj;
+    obj.push_back(Pair("blocks",       (int)summary.nBlocks));
+    obj.push_back(Pair("proofofstake", (int)summary.nProofOfStake));
+    obj.push_back(Pair("proofofwork",  (int)(summary.nBlocks - summary.nProofOfStake)));
+    obj.push_back(Pair("transactions", (int64_t)summary.nTx));
+    obj.push_back(Pair("size",         (int64_t)summary.nSize));
+    obj.push_back(Pair("fees",         ValueFromAmount(summary.nFees)));
+    obj.push_back(Pair("reward",       ValueFromAmount(summary.nReward)));
+    obj.push_back(Pair("stakevalue",   ValueFromAmount(summary.nStakeValue)));
+    return obj;
+}
+
+static void RequireBlockStatsIndex()
+{
+    if (!fBlockStatsIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block stats index not enabled, restart with -blockstatsindex -reindex");
+}
+
+Value getblockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getblockstats <height>\n"
+            "Returns the -blockstatsindex record of the block at <height>.");
+
+    RequireBlockStatsIndex();
+    int nHeight = params[0].get_int();
+    CBlockIndex* pindex = FindBlockByHeight(nHeight);
+    if (!pindex)
+        throw runtime_error("Block number out of range.");
+
+    CBlockStats stats;
+    if (!CTxDB("r").ReadBlockStats(nHeight, stats))
+        throw JSONRPCError(RPC_MISC_ERROR, "No stats for this block");
+
+    Object obj;
+    obj.push_back(Pair("height",       nHeight));
+    obj.push_back(Pair("hash",         pindex->GetBlockHash().GetHex()));
+    obj.push_back(Pair("time",         (int64_t)stats.nTime));
+    obj.push_back(Pair("proofofstake", stats.fProofOfStake));
+    obj.push_back(Pair("transactions", (int)stats.nTx));
+    obj.push_back(Pair("size",         (int)stats.nSize));
+    obj.push_back(Pair("fees",         ValueFromAmount(stats.nFees)));
+    obj.push_back(Pair("reward",       ValueFromAmount(stats.nReward)));
+    obj.push_back(Pair("stakevalue",   ValueFromAmount(stats.nStakeValue)));
+    CTxDestination dest;
+    if (ExtractDestination(stats.scriptMinter, dest))
+        obj.push_back(Pair("minter",   cba(dest).ToString()));
+    else
+        obj.push_back(Pair("minter",   HexStr(stats.scriptMinter.begin(), stats.scriptMinter.end())));
+    obj.push_back(Pair("moneysupply",  ValueFromAmount(pindex->nMoneySupply)));
+    return obj;
+}
+
+// Most windows getchainstats returns at once
+static const int MAX_CHAIN_STATS_WINDOWS = 10000;
+
+Value getchainstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "getchainstats <fromheight> <toheight> [address] [step]\n"
+            "Returns totals of the blocks at <fromheight> to <toheight> inclusive from the\n"
+            "-blockstatsindex: blocks by kind, transactions, size, fees, reward and stake\n"
+            "value, and the money supply at the end. With [address] only the blocks it\n"
+            "minted count; \"\" for all. With [step] returns an array of totals over\n"
+            "windows of that many blocks. Full strides of " + strprintf("%d", BLOCK_STATS_STRIDE) + " aligned blocks are\n"
+            "read from a summary each, so aligned windows are cheapest.");
+
+    RequireBlockStatsIndex();
+    int nStart = params[0].get_int();
+    int nEnd = params[1].get_int();
+    if (nStart < 0 || nEnd < nStart || nEnd > nBestHeight)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+
+    CScript scriptMinter;
+    if (params.size() > 2 && !params[2].get_str().empty())
+    {
+        cba address(params[2].get_str());
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid I/OCoin address");
+        scriptMinter.SetDestination(address.Get());
+    }
+
+    int nStep = nEnd - nStart + 1;
+    if (params.size() > 3)
+    {
+        nStep = params[3].get_int();
+        if (nStep <= 0 || (nEnd - nStart) / nStep >= MAX_CHAIN_STATS_WINDOWS)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid step");
+    }
+
+    Array windows;
+    for (int nFrom = nStart; nFrom <= nEnd; nFrom += nStep)
+    {
+        int nTo = min(nEnd, nFrom + nStep - 1);
+        CBlockStatsSummary summary;
+        if (!GetBlockStatsRange(nFrom, nTo, scriptMinter, summary))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "Block stats index incomplete");
+        Object obj;
+        obj.push_back(Pair("fromheight",  nFrom));
+        obj.push_back(Pair("toheight",    nTo));
+        obj.push_back(Pair("fromtime",    (int64_t)FindBlockByHeight(nFrom)->nTime));
+        obj.push_back(Pair("totime",      (int64_t)FindBlockByHeight(nTo)->nTime));
+        Object objSummary = BlockStatsSummaryToJSON(summary);
+        obj.insert(obj.end(), objSummary.begin(), objSummary.end());
+        obj.push_back(Pair("moneysupply", ValueFromAmount(FindBlockByHeight(nTo)->nMoneySupply)));
+        windows.push_back(obj);
+    }
+    if (params.size() > 3)
+        return windows;
+    return windows[0];
+}
+
 // TODO: Move somewhere more accessible
 double GetBlocktime(CBlockIndex * block, int blocks,
                     bool proofOfWork, bool proofOfStake)
@@ -291,14 +422,541 @@ Value getdifficulty(const Array& params, bool fHelp)
             "getdifficulty\n"
             "Returns the difficulty as a multiple of the minimum difficulty.");
 
+    CChainTipSummaryRef ptip = GetChainTipSummary();
     Object obj;
-    obj.push_back(Pair("proof-of-work",        GetDifficulty()));
-    obj.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("proof-of-work",        ptip->dDifficultyPoW));
+    obj.push_back(Pair("proof-of-stake",       ptip->dDifficultyPoS));
     obj.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
     return obj;
 }
 
 
+Value getdbcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbcacheinfo\n"
+            "Returns statistics about the transaction database write-back cache,\n"
+            "and under aliasvalues about the cache of shared alias values.");
+
+    CTxDBCacheStats stats;
+    CTxDB::GetCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("entries",      (int64_t)stats.nEntries));
+    obj.push_back(Pair("usage",        (int64_t)stats.nUsage));
+    obj.push_back(Pair("dirty",        (int64_t)stats.nDirtyUsage));
+    obj.push_back(Pair("limit",        (int64_t)stats.nLimit));
+    obj.push_back(Pair("hits",         (int64_t)stats.nHits));
+    obj.push_back(Pair("misses",       (int64_t)stats.nMisses));
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+    obj.push_back(Pair("hitrate",      nLookups ? (double)stats.nHits / nLookups : 0.0));
+    obj.push_back(Pair("flushes",      (int64_t)stats.nFlushes));
+
+    CAliasValueStats valueStats;
+    CTxDB::GetAliasValueStats(valueStats);
+    Object values;
+    values.push_back(Pair("entries",   (int64_t)valueStats.nEntries));
+    values.push_back(Pair("usage",     (int64_t)valueStats.nUsage));
+    values.push_back(Pair("limit",     (int64_t)valueStats.nLimit));
+    values.push_back(Pair("hits",      (int64_t)valueStats.nHits));
+    values.push_back(Pair("misses",    (int64_t)valueStats.nMisses));
+    uint64_t nValueLookups = valueStats.nHits + valueStats.nMisses;
+    values.push_back(Pair("hitrate",   nValueLookups ? (double)valueStats.nHits / nValueLookups : 0.0));
+    obj.push_back(Pair("aliasvalues", values));
+    return obj;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "Returns cache, lock and log statistics of the wallet database environment,\n"
+            "with the cache hits and misses of each open file under files.");
+
+    CDBEnvStats stats;
+    if (!bitdb.GetStats(stats))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Database environment not open");
+
+    Object cache;
+    cache.push_back(Pair("size",       (int64_t)stats.nCacheSize));
+    cache.push_back(Pair("hits",       (int64_t)stats.nHits));
+    cache.push_back(Pair("misses",     (int64_t)stats.nMisses));
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+    cache.push_back(Pair("hitrate",    nLookups ? (double)stats.nHits / nLookups : 0.0));
+    cache.push_back(Pair("pages",      (int64_t)stats.nPages));
+    cache.push_back(Pair("dirty",      (int64_t)stats.nPagesDirty));
+    cache.push_back(Pair("pagesin",    (int64_t)stats.nPagesIn));
+    cache.push_back(Pair("pagesout",   (int64_t)stats.nPagesOut));
+    cache.push_back(Pair("evictions",  (int64_t)stats.nEvictions));
+
+    Array files;
+    BOOST_FOREACH(const CDBFileStats& file, stats.vFiles)
+    {
+        Object entry;
+        entry.push_back(Pair("file",     file.strFile));
+        entry.push_back(Pair("pagesize", (int64_t)file.nPageSize));
+        entry.push_back(Pair("hits",     (int64_t)file.nHits));
+        entry.push_back(Pair("misses",   (int64_t)file.nMisses));
+        uint64_t nFileLookups = file.nHits + file.nMisses;
+        entry.push_back(Pair("hitrate",  nFileLookups ? (double)file.nHits / nFileLookups : 0.0));
+        entry.push_back(Pair("created",  (int64_t)file.nPagesCreated));
+        entry.push_back(Pair("pagesin",  (int64_t)file.nPagesIn));
+        entry.push_back(Pair("pagesout", (int64_t)file.nPagesOut));
+        files.push_back(entry);
+    }
+
+    Object locks;
+    locks.push_back(Pair("max",        (int64_t)stats.nMaxLocks));
+    locks.push_back(Pair("current",    (int64_t)stats.nLocks));
+    locks.push_back(Pair("peak",       (int64_t)stats.nLocksPeak));
+    locks.push_back(Pair("maxobjects", (int64_t)stats.nMaxObjects));
+    locks.push_back(Pair("objects",    (int64_t)stats.nObjects));
+    locks.push_back(Pair("peakobjects", (int64_t)stats.nObjectsPeak));
+    locks.push_back(Pair("waits",      (int64_t)stats.nLockWaits));
+    locks.push_back(Pair("deadlocks",  (int64_t)stats.nDeadlocks));
+
+    Object log;
+    log.push_back(Pair("buffer",       (int64_t)stats.nLogBuffer));
+    log.push_back(Pair("written",      (int64_t)stats.nLogWritten));
+    log.push_back(Pair("writes",       (int64_t)stats.nLogWrites));
+    log.push_back(Pair("syncs",        (int64_t)stats.nLogSyncs));
+
+    Object obj;
+    obj.push_back(Pair("cache", cache));
+    obj.push_back(Pair("files", files));
+    obj.push_back(Pair("locks", locks));
+    obj.push_back(Pair("log",   log));
+    return obj;
+}
+
+Value getleveldbinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getleveldbinfo\n"
+            "Returns the files, size and compaction work of each level of the LevelDB\n"
+            "databases, and the writes they stalled: slowdowns were delayed 1ms at the\n"
+            "level-0 slowdown trigger, waits were held until a compaction finished.");
+
+    vector<CLevelDBStats> vStats;
+    CTxDB::GetLevelDBStats(vStats);
+
+    Object obj;
+    BOOST_FOREACH(const CLevelDBStats& stats, vStats)
+    {
+        Array levels;
+        for (unsigned int nLevel = 0; nLevel < stats.vLevels.size(); nLevel++)
+        {
+            const CLevelDBLevelStats& level = stats.vLevels[nLevel];
+            Object entry;
+            entry.push_back(Pair("level",   (int)nLevel));
+            entry.push_back(Pair("files",   level.nFiles));
+            entry.push_back(Pair("sizemb",  level.dSizeMB));
+            entry.push_back(Pair("seconds", level.dCompactionSeconds));
+            entry.push_back(Pair("readmb",  level.dReadMB));
+            entry.push_back(Pair("writemb", level.dWriteMB));
+            levels.push_back(entry);
+        }
+
+        Object stalls;
+        stalls.push_back(Pair("slowdowns", (int64_t)stats.nStallSlowdowns));
+        stalls.push_back(Pair("waits",     (int64_t)stats.nStallWaits));
+        stalls.push_back(Pair("seconds",   stats.nStallMicros / 1e6));
+
+        Object db;
+        db.push_back(Pair("levels", levels));
+        db.push_back(Pair("stalls", stalls));
+        obj.push_back(Pair(stats.strName, db));
+    }
+    return obj;
+}
+
+Value compactdb(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "compactdb\n"
+            "Compacts the LevelDB databases completely, which may take minutes. Blocks\n"
+            "are still processed meanwhile but their writes may stall, so run it while\n"
+            "the node is idle.");
+
+    int64_t nStart = GetTimeMillis();
+    string strError;
+    if (!CTxDB::CompactLevelDB(strError))
+        throw JSONRPCError(RPC_DATABASE_ERROR, strError);
+
+    Object obj;
+    obj.push_back(Pair("seconds", (GetTimeMillis() - nStart) / 1000.0));
+    return obj;
+}
+
+static Object MemoryEntry(size_t nEntries, size_t nUsage)
+{
+    Object obj;
+    obj.push_back(Pair("entries", (int64_t)nEntries));
+    obj.push_back(Pair("usage",   (int64_t)nUsage));
+    return obj;
+}
+
+// Transactions of a wallet and, apart, the vtxPrev copies of their inputs
+static Object WalletMemoryUsage(__wx__* pwallet, size_t& nTotal)
+{
+    LOCK(pwallet->cs_wallet);
+    size_t nUsage = MapUsage(pwallet->mapWallet);
+    size_t nPrev = 0, nPrevUsage = 0;
+    for (map<uint256, __wx__Tx>::const_iterator mi = pwallet->mapWallet.begin(); mi != pwallet->mapWallet.end(); ++mi)
+    {
+        const __wx__Tx& wtx = mi->second;
+        nUsage += TransactionUsage(wtx) + VectorUsage(wtx.vMerkleBranch) + VectorUsage(wtx.vfSpent) +
+                  MapUsage(wtx.mapValue) + VectorUsage(wtx.vOrderForm);
+        nPrevUsage += VectorUsage(wtx.vtxPrev);
+        BOOST_FOREACH(const CMerkleTx& txPrev, wtx.vtxPrev)
+            nPrevUsage += TransactionUsage(txPrev) + VectorUsage(txPrev.vMerkleBranch);
+        nPrev += wtx.vtxPrev.size();
+    }
+    nTotal += nUsage + nPrevUsage;
+
+    Object obj;
+    obj.push_back(Pair("file",         pwallet->strWalletFile));
+    obj.push_back(Pair("transactions", (int64_t)pwallet->mapWallet.size()));
+    obj.push_back(Pair("usage",        (int64_t)nUsage));
+    obj.push_back(Pair("prevtxs",      (int64_t)nPrev));
+    obj.push_back(Pair("prevusage",    (int64_t)nPrevUsage));
+    return obj;
+}
+
+Value getmemoryinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "Returns the approximate heap memory, in bytes, of the block index, memory pool,\n"
+            "orphan pools, wallets, address manager, signature caches and database caches,\n"
+            "the memory locked for keys and, where the allocator reports them, malloc's totals.\n"
+            "The figures are estimated from container sizes; leveldb is the most its caches may take.");
+
+    Object obj;
+    size_t nTotal = 0;
+
+    CMainMemoryUsage mainUsage;
+    GetMainMemoryUsage(mainUsage);
+    obj.push_back(Pair("blockindex",         MemoryEntry(mainUsage.nBlockIndexEntries, mainUsage.nBlockIndex)));
+    obj.push_back(Pair("mempool",            MemoryEntry(mempool.size(), mempool.DynamicMemoryUsage())));
+    obj.push_back(Pair("orphanblocks",       MemoryEntry(mainUsage.nOrphanBlockEntries, mainUsage.nOrphanBlocks)));
+    obj.push_back(Pair("orphantransactions", MemoryEntry(mainUsage.nOrphanTxEntries, mainUsage.nOrphanTxs)));
+    nTotal += mainUsage.nBlockIndex + mempool.DynamicMemoryUsage() + mainUsage.nOrphanBlocks + mainUsage.nOrphanTxs;
+
+    Array wallets;
+    {
+        LOCK(cs_setpwalletRegistered);
+        BOOST_FOREACH(__wx__* pwallet, setpwalletRegistered)
+            wallets.push_back(WalletMemoryUsage(pwallet, nTotal));
+    }
+    obj.push_back(Pair("wallets", wallets));
+
+    size_t nAddrMan = addrman.DynamicUsage();
+    obj.push_back(Pair("addrman",            MemoryEntry(addrman.size(), nAddrMan)));
+    size_t nSigCache = GetSignatureCacheUsage(), nPubKeyCache = GetPubKeyCacheUsage();
+    obj.push_back(Pair("sigcache",           (int64_t)nSigCache));
+    obj.push_back(Pair("pubkeycache",        (int64_t)nPubKeyCache));
+    nTotal += nAddrMan + nSigCache + nPubKeyCache;
+
+    CTxDBCacheStats txdbStats;
+    CTxDB::GetCacheStats(txdbStats);
+    CAliasValueStats valueStats;
+    CTxDB::GetAliasValueStats(valueStats);
+    size_t nAliasRecords, nAliasRecordUsage;
+    GetAliasRecordUsage(nAliasRecords, nAliasRecordUsage);
+    obj.push_back(Pair("txdbcache",          MemoryEntry(txdbStats.nEntries, txdbStats.nUsage)));
+    obj.push_back(Pair("aliasvalues",        MemoryEntry(valueStats.nEntries, valueStats.nUsage)));
+    obj.push_back(Pair("aliasrecords",       MemoryEntry(nAliasRecords, nAliasRecordUsage)));
+    obj.push_back(Pair("leveldb",            (int64_t)txdbStats.nLevelDBMemory));
+    nTotal += txdbStats.nUsage + valueStats.nUsage + nAliasRecordUsage + txdbStats.nLevelDBMemory;
+
+    Object locked;
+    int nLockedPages = LockedPageManager::instance.GetLockedPageCount();
+    locked.push_back(Pair("pages", nLockedPages));
+    locked.push_back(Pair("bytes", (int64_t)nLockedPages * (int64_t)GetSystemPageSize()));
+    obj.push_back(Pair("locked", locked));
+    obj.push_back(Pair("total",  (int64_t)nTotal));
+
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+#else
+    // Wraps past 4GB, older glibc has no mallinfo2
+    struct mallinfo info = mallinfo();
+#endif
+    Object mallocStats;
+    mallocStats.push_back(Pair("arena",  (int64_t)(size_t)info.arena));
+    mallocStats.push_back(Pair("mmap",   (int64_t)(size_t)info.hblkhd));
+    mallocStats.push_back(Pair("used",   (int64_t)(size_t)info.uordblks));
+    mallocStats.push_back(Pair("free",   (int64_t)(size_t)info.fordblks));
+    obj.push_back(Pair("malloc", mallocStats));
+#endif
+    return obj;
+}
+
+Value getthreadinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getthreadinfo\n"
+            "Returns the thread pools with how many threads each is running, their priority\n"
+            "and the CPUs they are pinned to (all of them if cpus is empty).");
+
+    vector<CThreadPoolInfo> vInfo;
+    GetThreadPoolInfo(vInfo);
+
+    Object obj;
+    BOOST_FOREACH(const CThreadPoolInfo& info, vInfo)
+    {
+        Array cpus;
+        BOOST_FOREACH(int nCPU, info.vCPUs)
+            cpus.push_back(nCPU);
+        Object pool;
+        pool.push_back(Pair("threads",  info.nRunning));
+        pool.push_back(Pair("priority", info.strPriority));
+        pool.push_back(Pair("cpus",     cpus));
+        obj.push_back(Pair(info.strName, pool));
+    }
+    return obj;
+}
+
+static bool LockSiteWaitedLonger(const CLockSiteStats& a, const CLockSiteStats& b)
+{
+    return a.nWaitMicros > b.nWaitMicros;
+}
+
+static Array LockWaitHistogram(const uint64_t* vBuckets)
+{
+    Array arr;
+    for (int i = 0; i < LOCK_WAIT_BUCKETS; i++)
+        arr.push_back((int64_t)vBuckets[i]);
+    return arr;
+}
+
+Value getlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getlockstats [reset=false]\n"
+            "Returns, per lock, the acquisitions, contended acquisitions, wait and hold\n"
+            "times in microseconds and the call sites by file:line, longest waits first.\n"
+            "waithistogram counts contended waits below 10us, 100us, 1ms, 10ms, 100ms,\n"
+            "1s and above. Counting is off unless -lockstats or setlockstats turned it on.\n"
+            "With reset the counters start again from zero after being returned.");
+
+    vector<CLockSiteStats> vSites;
+    GetLockStats(vSites);
+    if (params.size() > 0 && params[0].get_bool())
+        ResetLockStats();
+    sort(vSites.begin(), vSites.end(), LockSiteWaitedLonger);
+
+    // Sites sorted by wait leave the locks in the order of their worst site
+    vector<string> vNames;
+    map<string, vector<const CLockSiteStats*> > mapSites;
+    BOOST_FOREACH(const CLockSiteStats& site, vSites)
+    {
+        if (site.nAcquired == 0 && site.nTryFailed == 0)
+            continue;
+        if (!mapSites.count(site.pszName))
+            vNames.push_back(site.pszName);
+        mapSites[site.pszName].push_back(&site);
+    }
+
+    Array locks;
+    BOOST_FOREACH(const string& strName, vNames)
+    {
+        CLockSiteStats total(NULL, NULL, 0);
+        Array sites;
+        BOOST_FOREACH(const CLockSiteStats* psite, mapSites[strName])
+        {
+            total.nAcquired += psite->nAcquired;
+            total.nContended += psite->nContended;
+            total.nTryFailed += psite->nTryFailed;
+            total.nWaitMicros += psite->nWaitMicros;
+            total.nMaxWaitMicros = max(total.nMaxWaitMicros, psite->nMaxWaitMicros);
+            total.nHeldMicros += psite->nHeldMicros;
+            total.nMaxHeldMicros = max(total.nMaxHeldMicros, psite->nMaxHeldMicros);
+            for (int i = 0; i < LOCK_WAIT_BUCKETS; i++)
+                total.vWaitHistogram[i] += psite->vWaitHistogram[i];
+
+            Object site;
+            site.push_back(Pair("site",       strprintf("%s:%d", psite->pszFile, psite->nLine)));
+            site.push_back(Pair("acquired",   (int64_t)psite->nAcquired));
+            site.push_back(Pair("contended",  (int64_t)psite->nContended));
+            if (psite->nTryFailed)
+                site.push_back(Pair("tryfailed", (int64_t)psite->nTryFailed));
+            site.push_back(Pair("waitus",     psite->nWaitMicros));
+            site.push_back(Pair("maxwaitus",  psite->nMaxWaitMicros));
+            site.push_back(Pair("heldus",     psite->nHeldMicros));
+            site.push_back(Pair("maxheldus",  psite->nMaxHeldMicros));
+            sites.push_back(site);
+        }
+
+        Object lock;
+        lock.push_back(Pair("name",           strName));
+        lock.push_back(Pair("acquired",       (int64_t)total.nAcquired));
+        lock.push_back(Pair("contended",      (int64_t)total.nContended));
+        lock.push_back(Pair("tryfailed",      (int64_t)total.nTryFailed));
+        lock.push_back(Pair("waitus",         total.nWaitMicros));
+        lock.push_back(Pair("maxwaitus",      total.nMaxWaitMicros));
+        lock.push_back(Pair("heldus",         total.nHeldMicros));
+        lock.push_back(Pair("maxheldus",      total.nMaxHeldMicros));
+        lock.push_back(Pair("waithistogram",  LockWaitHistogram(total.vWaitHistogram)));
+        lock.push_back(Pair("sites",          sites));
+        locks.push_back(lock);
+    }
+
+    Object obj;
+    obj.push_back(Pair("enabled", (bool)fLockProfiling));
+    obj.push_back(Pair("locks",   locks));
+    return obj;
+}
+
+Value setlockstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "setlockstats <enabled>\n"
+            "Turns lock counting for getlockstats on or off. The counters are kept\n"
+            "when it is turned off; getlockstats true clears them.");
+
+    fLockProfiling = params[0].get_bool();
+    return Value::null;
+}
+
+Value getimportinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getimportinfo\n"
+            "Returns progress of -reindex, -loadblock or bootstrap.dat block import.");
+
+    CImportProgress progress;
+    GetImportProgress(progress);
+
+    Object obj;
+    obj.push_back(Pair("importing",    fImporting || progress.fActive));
+    obj.push_back(Pair("reindex",      fReindex));
+    obj.push_back(Pair("file",         progress.strFile));
+    obj.push_back(Pair("progress",     progress.nFileSize ? (double)progress.nFilePos / progress.nFileSize : 0.0));
+    obj.push_back(Pair("bytesread",    progress.nBytesRead));
+    obj.push_back(Pair("blocksread",   progress.nBlocksRead));
+    obj.push_back(Pair("connected",    progress.nBlocksConnected));
+    obj.push_back(Pair("rejected",     progress.nBlocksRejected));
+    double dElapsed = progress.nStartTime ? (GetTimeMillis() - progress.nStartTime) / 1000.0 : 0.0;
+    obj.push_back(Pair("elapsed",      dElapsed));
+    obj.push_back(Pair("mbpersec",     dElapsed > 0 ? progress.nBytesRead / dElapsed / 1048576.0 : 0.0));
+    obj.push_back(Pair("blockspersec", dElapsed > 0 ? progress.nBlocksConnected / dElapsed : 0.0));
+    return obj;
+}
+
+Value dumpsnapshot(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumpsnapshot <file>\n"
+            "Writes a chainstate snapshot at the current best block to <file>, relative\n"
+            "to the data directory unless absolute. Blocks the node for as long as the\n"
+            "copy takes. Only a snapshot at a checkpoint whose content hash is added to\n"
+            "checkpoints.cpp can be loaded with -loadsnapshot.");
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+
+    CChainSnapshotInfo info;
+    string strError;
+    if (!DumpChainSnapshot(path, info, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, "Error: " + strError);
+
+    Object obj;
+    obj.push_back(Pair("file",        path.string()));
+    obj.push_back(Pair("height",      info.nHeight));
+    obj.push_back(Pair("blockhash",   info.hashBlock.GetHex()));
+    obj.push_back(Pair("checkpoint",  Checkpoints::GetCheckpointHeight(info.hashBlock) == info.nHeight));
+    obj.push_back(Pair("contenthash", info.hashContent.GetHex()));
+    obj.push_back(Pair("bytes",       (int64_t)info.nBytes));
+    obj.push_back(Pair("blockfiles",  (int)info.nBlockFiles));
+    obj.push_back(Pair("records",     (int64_t)info.nRecords));
+    return obj;
+}
+
+Value getsnapshotinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsnapshotinfo\n"
+            "Returns the chainstate snapshot this node started from, if any, and how far\n"
+            "the background verification of the history before it has got.");
+
+    Object obj;
+    CChainSnapshotState state;
+    if (!GetChainSnapshotState(state))
+    {
+        obj.push_back(Pair("snapshot", false));
+        return obj;
+    }
+    int nVerified = min(state.nVerifiedHeight, state.nHeight + 1);
+    obj.push_back(Pair("snapshot",       true));
+    obj.push_back(Pair("height",         state.nHeight));
+    obj.push_back(Pair("blockhash",      state.hashBlock.GetHex()));
+    obj.push_back(Pair("verifiedblocks", nVerified));
+    obj.push_back(Pair("progress",       (double)nVerified / (state.nHeight + 1)));
+    obj.push_back(Pair("verified",       state.IsVerified()));
+    obj.push_back(Pair("failed",         state.fFailed));
+    return obj;
+}
+
+Value getorphanblockinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getorphanblockinfo\n"
+            "Returns the number and size of blocks waiting for their parent.");
+
+    unsigned int nCount;
+    uint64_t nBytes;
+    GetOrphanBlockStats(nCount, nBytes);
+
+    Object obj;
+    obj.push_back(Pair("blocks",   (int)nCount));
+    obj.push_back(Pair("bytes",    (int64_t)nBytes));
+    obj.push_back(Pair("maxbytes", (int64_t)nMaxOrphanBlocksSize));
+    return obj;
+}
+
+Value getblockconnectstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblockconnectstats\n"
+            "Returns cumulative timings for each stage of connecting blocks.\n"
+            "Times are in microseconds; histogram entry i counts samples below 2^(i+1).");
+
+    Object obj;
+    for (int stage = 0; stage < BENCH_STAGES; stage++)
+    {
+        Array histogram;
+        for (int i = 0; i < BENCH_BUCKETS; i++)
+            histogram.push_back(blockConnectStats.nBuckets[stage][i]);
+
+        int64_t nCount = blockConnectStats.nCount[stage];
+        Object entry;
+        entry.push_back(Pair("count",     nCount));
+        entry.push_back(Pair("total",     blockConnectStats.nTotalMicros[stage]));
+        entry.push_back(Pair("average",   nCount ? blockConnectStats.nTotalMicros[stage] / nCount : 0));
+        entry.push_back(Pair("max",       blockConnectStats.nMaxMicros[stage]));
+        entry.push_back(Pair("histogram", histogram));
+        obj.push_back(Pair(GetBlockConnectStageName(stage), entry));
+    }
+    return obj;
+}
+
 Value settxfee(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 1 || AmountFromValue(params[0]) < MIN_TX_FEE)
@@ -329,6 +987,40 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the size of the memory pool, the memory it uses and the fee it takes to get in.");
+
+    Object obj;
+    obj.push_back(Pair("size", (int64_t)mempool.size()));
+    obj.push_back(Pair("bytes", (int64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool", (int64_t)nMaxMempoolSize));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount((int64_t)mempool.GetMinFeePerKb(nMaxMempoolSize))));
+    return obj;
+}
+
+Value estimatefee(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "estimatefee <nblocks>\n"
+            "Returns the fee per kB that lately got transactions confirmed within <nblocks> blocks,\n"
+            "or -1 if there is not enough data yet.");
+
+    int nBlocks = params[0].get_int();
+    if (nBlocks < 1 || nBlocks > MAX_CONFIRM_TARGET)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("<nblocks> must be between 1 and %d", MAX_CONFIRM_TARGET));
+
+    double dFeePerKb = feeEstimator.EstimateFee(nBlocks);
+    if (dFeePerKb < 0)
+        return -1.0;
+    return ValueFromAmount((int64_t)dFeePerKb);
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -336,6 +1028,7 @@ Value getblockhash(const Array& params, bool fHelp)
             "getblockhash <index>\n"
             "Returns hash of block in best-block-chain at <index>.");
 
+    READ_LOCK(cs_chainstate);
     int nHeight = params[0].get_int();
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
@@ -355,11 +1048,13 @@ Value getblock(const Array& params, bool fHelp)
     std::string strHash = params[0].get_str();
     uint256 hash(strHash);
 
-    if (mapBlockIndex.count(hash) == 0)
+    READ_LOCK(cs_chainstate);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = mi->second;
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -373,18 +1068,13 @@ Value getblockbynumber(const Array& params, bool fHelp)
             "txinfo optional to print more detailed tx info\n"
             "Returns details of a block with given block-number.");
 
+    READ_LOCK(cs_chainstate);
     int nHeight = params[0].get_int();
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
@@ -479,39 +1169,15 @@ Value gettxout(const Array& params, bool fHelp)
     }
     else
     {
-      map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+      BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
       if (mi != mapBlockIndex.end() && (*mi).second)
       {
         CBlockIndex* pindex = (*mi).second;
         if (pindex->IsInMainChain())
         {
-          bool isSpent=false;
-          CBlockIndex* p = pindex;
-          p=p->pnext;
-          for (; p; p = p->pnext)
-          {
-            CBlock block;
-            CBlockIndex* pblockindex = mapBlockIndex[p->GetBlockHash()];
-            block.ReadFromDisk(pblockindex, true);
-            BOOST_FOREACH(const CTransaction& tx, block.vtx)
-            {
-              BOOST_FOREACH(const CTxIn& txin, tx.vin)
-              {
-                if( hash == txin.prevout.hash &&
-                   (int64_t)txin.prevout.n )
-                {
-                  printf("spent at block %s\n", block.GetHash().GetHex().c_str());
-                  isSpent=true; break;
-                }
-              }
-
-              if(isSpent) break;
-            }
-
-            if(isSpent) break;
-          }
-
-          if(isSpent)
+          // The tx index has where each output was spent, if it was
+          CTxIndex txindex;
+          if (!CTxDB("r").ReadTxIndex(hash, txindex) || (unsigned int)n >= txindex.vSpent.size() || !txindex.vSpent[n].IsNull())
             return Value::null;
 
           ret.push_back(Pair("confirmations", pindexBest->nHeight - pindex->nHeight + 1));
@@ -113,15 +113,34 @@ public:
 
 Value importprivkey(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() < 1 || params.size() > 2)
+    if (fHelp || params.size() < 1 || params.size() > 3)
         throw runtime_error(
-            "importprivkey <iocoinprivkey> [label]\n"
-            "Adds a private key (as returned by dumpprivkey) to your wallet.");
+            "importprivkey <iocoinprivkey> [label] [birth]\n"
+            "Adds a private key (as returned by dumpprivkey) to your wallet.\n"
+            "[birth] is the height of the first block the key can have been used in,\n"
+            "or that time as a unix timestamp; the rescan starts there instead of at genesis.");
 
     string strSecret = params[0].get_str();
     string strLabel = "";
     if (params.size() > 1)
         strLabel = params[1].get_str();
+    // 1 for unknown, as 0 would be considered 'no value'
+    int64_t nBirthTime = 1;
+    if (params.size() > 2)
+    {
+        int64_t nBirth = params[2].get_int64();
+        if (nBirth < 0)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative birth");
+        if (nBirth < LOCKTIME_THRESHOLD)
+        {
+            LOCK(cs_main);
+            if (nBirth > nBestHeight)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Birth height is beyond the best block");
+            nBirthTime = max((int64_t)1, (int64_t)FindBlockByHeight(nBirth)->nTime);
+        }
+        else
+            nBirthTime = nBirth;
+    }
     CBitcoinSecret vchSecret;
     bool fGood = vchSecret.SetString(strSecret);
 
@@ -134,6 +153,7 @@ Value importprivkey(const Array& params, bool fHelp)
     CSecret secret = vchSecret.GetSecret(fCompressed);
     key.SetSecret(secret, fCompressed);
     CKeyID vchAddress = key.GetPubKey().GetID();
+    CBlockIndex* pindexRescan;
     {
         LOCK2(cs_main, pwalletMain->cs_wallet);
 
@@ -144,21 +164,36 @@ Value importprivkey(const Array& params, bool fHelp)
         if (pwalletMain->HaveKey(vchAddress))
             return Value::null;
 
-        pwalletMain->kd[vchAddress].nCreateTime = 1;
+        pwalletMain->kd[vchAddress].nCreateTime = nBirthTime;
 
         if (!pwalletMain->ak(key))
             throw JSONRPCError(RPC_WALLET_ERROR, "Error adding key to wallet");
 
-        // whenever a key is imported, we need to scan the whole chain
-        pwalletMain->nTimeFirstKey = 1; // 0 would be considered 'no value'
-
-        pwalletMain->ScanForWalletTransactions(pindexGenesisBlock, true);
-        pwalletMain->ReacceptWalletTransactions();
+        // whenever a key is imported, we need to scan the chain from its birth
+        if (!pwalletMain->nTimeFirstKey || nBirthTime < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nBirthTime;
+        pindexRescan = FindRescanStart(nBirthTime);
     }
 
+    // Takes the locks block by block, so abortrescan and getinfo still answer
+    SetRPCJobProgress(0, "rescan");
+    pwalletMain->ScanForWalletTransactions(pindexRescan, true);
+    pwalletMain->ReacceptWalletTransactions();
+
     return Value::null;
 }
 
+Value abortrescan(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "Stops the wallet rescan started by importprivkey, importwallet or -rescan.\n"
+            "Returns whether a rescan was running.");
+
+    return pwalletMain->AbortRescan();
+}
+
 Value importwalletRT(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -222,20 +257,19 @@ Value importwalletRT(const Array& params, bool fHelp)
             }
         }
         printf("Importing %s...\n", cba(keyid).ToString().c_str());
+        // Before ak(), which writes the key with its metadata
+        pwalletMain->kd[keyid].nCreateTime = nTime;
         if (!pwalletMain->ak(key)) {
             fGood = false;
             continue;
         }
-        pwalletMain->kd[keyid].nCreateTime = nTime;
         if (fLabel)
             pwalletMain->SetAddressBookName(keyid, strLabel);
         nTimeBegin = std::min(nTimeBegin, nTime);
     }
     file.close();
 
-    CBlockIndex *pindex = pindexBest;
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+    CBlockIndex *pindex = FindRescanStart(nTimeBegin);
 
     if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
         pwalletMain->nTimeFirstKey = nTimeBegin;
@@ -437,24 +471,35 @@ Value importwallet(const Array& params, bool fHelp)
       "wallet configured as : view"
       );
 
-    EnsureWalletIsUnlocked();
-
     ifstream file;
-    file.open(params[0].get_str().c_str());
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
-
-    
     string strWalletFile;
-    GetWalletFile(pwalletMain, strWalletFile);
+    int64_t nTimeBegin;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
+
+        file.open(params[0].get_str().c_str());
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+
+        GetWalletFile(pwalletMain, strWalletFile);
+        nTimeBegin = pindexBest->nTime;
+    }
+    file.seekg(0, file.end);
+    int64_t nFileSize = max((int64_t)1, (int64_t)file.tellg());
+    file.seekg(0, file.beg);
 
     uint160 sector(0);
-    int64_t nTimeBegin = pindexBest->nTime;
 
     bool fGood = true;
 
     //ydwi base
+    // The locks are taken key by key, so the node keeps going meanwhile
     while (file.good()) {
+        if (IsRPCJobCancelled())
+            throw JSONRPCError(RPC_MISC_ERROR, "Cancelled");
+        SetRPCJobProgress((int)(100 * max((int64_t)0, (int64_t)file.tellg()) / nFileSize), "import");
+
         std::string line;
         std::getline(file, line, '#');
         if (line.empty() || line[0] == ';')
@@ -474,6 +519,7 @@ Value importwallet(const Array& params, bool fHelp)
         key.SetSecret(secret, fCompressed);
         CKeyID keyid = key.GetPubKey().GetID();
 
+        LOCK2(cs_main, pwalletMain->cs_wallet);
         if (pwalletMain->HaveKey(keyid)) {
             printf("Skipping import of %s (key already present)\n", cba(keyid).ToString().c_str());
             continue;
@@ -563,28 +609,35 @@ Value importwallet(const Array& params, bool fHelp)
               }
         }
         printf("Importing %s...\n", cba(keyid).ToString().c_str());
+        // Before ak(), which writes the key with its metadata
+        pwalletMain->kd[keyid].nCreateTime = nTime;
         if (!pwalletMain->ak(key)) {
             fGood = false;
             continue;
         }
-        pwalletMain->kd[keyid].nCreateTime = nTime;
         if (fLabel)
             pwalletMain->SetAddressBookName(keyid, strLabel);
         nTimeBegin = std::min(nTimeBegin, nTime);
     }
     file.close();
 
-    CBlockIndex *pindex = pindexBest;
-    while (pindex && pindex->pprev && pindex->nTime > nTimeBegin - 7200)
-        pindex = pindex->pprev;
+    CBlockIndex *pindex;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pindex = FindRescanStart(nTimeBegin);
 
-    if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
-        pwalletMain->nTimeFirstKey = nTimeBegin;
+        if (!pwalletMain->nTimeFirstKey || nTimeBegin < pwalletMain->nTimeFirstKey)
+            pwalletMain->nTimeFirstKey = nTimeBegin;
 
-    printf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
+        printf("Rescanning last %i blocks\n", pindexBest->nHeight - pindex->nHeight + 1);
+    }
+    SetRPCJobProgress(0, "rescan");
     pwalletMain->ScanForWalletTransactions(pindex);
     pwalletMain->ReacceptWalletTransactions();
-    pwalletMain->MarkDirty();
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pwalletMain->MarkDirty();
+    }
 
     if (!fGood)
         throw JSONRPCError(RPC_WALLET_ERROR, "Error adding some keys to wallet");
@@ -598,20 +651,29 @@ Value dumpwallet(const Array& params, bool fHelp)
             "dumpwallet <filename>\n"
             "Dumps all wallet keys in a human-readable format.");
 
-    EnsureWalletIsUnlocked();
-
     ofstream file;
-    file.open(params[0].get_str().c_str());
-    if (!file.is_open())
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
-
     std::map<CKeyID, int64_t> mapKeyBirth;
 
     std::set<CKeyID> setKeyPool;
 
-    pwalletMain->kt(mapKeyBirth);
+    string strHeader;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        EnsureWalletIsUnlocked();
 
-    pwalletMain->GetAllReserveKeys(setKeyPool);
+        file.open(params[0].get_str().c_str());
+        if (!file.is_open())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Cannot open wallet dump file");
+
+        pwalletMain->kt(mapKeyBirth);
+
+        pwalletMain->GetAllReserveKeys(setKeyPool);
+
+        strHeader += strprintf("# Wallet dump created by I/OCoin %s (%s)\n", CLIENT_BUILD.c_str(), CLIENT_DATE.c_str());
+        strHeader += strprintf("# * Created on %s\n", EncodeDumpTime(GetTime()).c_str());
+        strHeader += strprintf("# * Best block at time of backup was %i (%s),\n", nBestHeight, hashBestChain.ToString().c_str());
+        strHeader += strprintf("#   mined on %s\n", EncodeDumpTime(pindexBest->nTime).c_str());
+    }
 
     // sort time/key pairs
     std::vector<std::pair<int64_t, CKeyID> > vKeyBirth;
@@ -621,13 +683,15 @@ Value dumpwallet(const Array& params, bool fHelp)
     mapKeyBirth.clear();
     std::sort(vKeyBirth.begin(), vKeyBirth.end());
 
-    // produce output
-    file << strprintf("# Wallet dump created by I/OCoin %s (%s)\n", CLIENT_BUILD.c_str(), CLIENT_DATE.c_str());
-    file << strprintf("# * Created on %s\n", EncodeDumpTime(GetTime()).c_str());
-    file << strprintf("# * Best block at time of backup was %i (%s),\n", nBestHeight, hashBestChain.ToString().c_str());
-    file << strprintf("#   mined on %s\n", EncodeDumpTime(pindexBest->nTime).c_str());
+    // produce output, taking the wallet lock key by key
+    file << strHeader;
     file << "\n";
     for (std::vector<std::pair<int64_t, CKeyID> >::const_iterator it = vKeyBirth.begin(); it != vKeyBirth.end(); it++) {
+        if (IsRPCJobCancelled())
+            throw JSONRPCError(RPC_MISC_ERROR, "Cancelled");
+        SetRPCJobProgress((int)(100 * (it - vKeyBirth.begin()) / vKeyBirth.size()), "dump");
+
+        LOCK(pwalletMain->cs_wallet);
         const CKeyID &keyid = it->second;
         std::string strTime = EncodeDumpTime(it->first);
         std::string strAddr = cba(keyid).ToString();
@@ -0,0 +1,285 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "init.h"
+#include "bitcoinrpc.h"
+#include "rpcjson.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <boost/thread.hpp>
+
+using namespace json_spirit;
+using namespace std;
+
+/** A command run by startjob on a thread of its own. Everything after
+ *  construction is guarded by mutexJobs. */
+struct CRPCJob
+{
+    int nId;
+    string strMethod;
+    Array params;
+    string strState; // running, done, failed or cancelled
+    string strStage;
+    int nProgress;
+    bool fCancel;
+    int64_t nTimeStart;
+    int64_t nTimeEnd;
+    Value result;
+    string strError;
+
+    CRPCJob(int nIdIn, const string& strMethodIn, const Array& paramsIn) :
+        nId(nIdIn), strMethod(strMethodIn), params(paramsIn), strState("running"),
+        nProgress(0), fCancel(false), nTimeStart(GetTime()), nTimeEnd(0) {}
+};
+
+// Finished jobs kept for getjob before the oldest are dropped
+static const unsigned int MAX_FINISHED_JOBS = 100;
+
+static boost::mutex mutexJobs;
+// Notified whenever a job finishes
+static boost::condition_variable condJobs;
+static map<int, CRPCJob*> mapJobs;
+static int nJobNext = 1;
+
+static void NoCleanup(CRPCJob*) {}
+// The job the calling thread is running, if any
+static boost::thread_specific_ptr<CRPCJob> pjobCurrent(NoCleanup);
+
+void SetRPCJobProgress(int nPercent, const string& strStage)
+{
+    CRPCJob* pjob = pjobCurrent.get();
+    if (!pjob)
+        return;
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    pjob->nProgress = max(0, min(100, nPercent));
+    pjob->strStage = strStage;
+}
+
+bool IsRPCJobCancelled()
+{
+    CRPCJob* pjob = pjobCurrent.get();
+    if (fShutdown)
+        return pjob != NULL;
+    if (!pjob)
+        return false;
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    return pjob->fCancel;
+}
+
+static void PruneFinishedJobs()
+{
+    unsigned int nFinished = 0;
+    for (map<int, CRPCJob*>::iterator it = mapJobs.begin(); it != mapJobs.end(); ++it)
+        if (it->second->nTimeEnd)
+            nFinished++;
+    // Ids grow with time, so the first finished ones are the oldest
+    for (map<int, CRPCJob*>::iterator it = mapJobs.begin(); it != mapJobs.end() && nFinished > MAX_FINISHED_JOBS; )
+    {
+        if (it->second->nTimeEnd)
+        {
+            delete it->second;
+            mapJobs.erase(it++);
+            nFinished--;
+        }
+        else
+            ++it;
+    }
+}
+
+static void ThreadRPCJob(void* parg)
+{
+    CRPCJob* pjob = (CRPCJob*)parg;
+    RenameThread("iocoin-rpcjob");
+    pjobCurrent.reset(pjob);
+
+    Value result;
+    string strError;
+    bool fFailed = false;
+    try
+    {
+        result = tableRPC.execute(pjob->strMethod, pjob->params);
+    }
+    catch (Object& objError)
+    {
+        fFailed = true;
+        strError = find_value(objError, "message").get_str();
+    }
+    catch (std::exception& e)
+    {
+        fFailed = true;
+        strError = e.what();
+    }
+    pjobCurrent.reset();
+
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    pjob->nTimeEnd = GetTime();
+    if (pjob->fCancel)
+        pjob->strState = "cancelled";
+    else if (fFailed)
+        pjob->strState = "failed";
+    else
+    {
+        pjob->strState = "done";
+        pjob->nProgress = 100;
+    }
+    pjob->result = result;
+    pjob->strError = strError;
+    printf("RPC job %d (%s) %s\n", pjob->nId, pjob->strMethod.c_str(), pjob->strState.c_str());
+    PruneFinishedJobs();
+    condJobs.notify_all();
+}
+
+static Object JobToJSON(const CRPCJob& job)
+{
+    Object obj;
+    obj.push_back(Pair("id",       job.nId));
+    obj.push_back(Pair("method",   job.strMethod));
+    obj.push_back(Pair("state",    job.strState));
+    if (!job.strStage.empty())
+        obj.push_back(Pair("stage", job.strStage));
+    // A rescan reports its own progress; the job can't while inside it
+    int nProgress = job.nProgress;
+    if (!job.nTimeEnd && job.strStage == "rescan" && pwalletMain->fScanningWallet)
+        nProgress = pwalletMain->nRescanProgress;
+    obj.push_back(Pair("progress", nProgress));
+    obj.push_back(Pair("started",  job.nTimeStart));
+    if (job.nTimeEnd)
+        obj.push_back(Pair("finished", job.nTimeEnd));
+    if (job.strState == "done")
+        obj.push_back(Pair("result", job.result));
+    if (!job.strError.empty())
+        obj.push_back(Pair("error", job.strError));
+    return obj;
+}
+
+static CRPCJob* FindJob(const Value& id)
+{
+    map<int, CRPCJob*>::iterator it = mapJobs.find(id.get_int());
+    if (it == mapJobs.end())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "No such job");
+    return it->second;
+}
+
+static void CancelJob(CRPCJob* pjob)
+{
+    pjob->fCancel = true;
+    if (pjob->strStage == "rescan")
+        pwalletMain->AbortRescan();
+}
+
+int StartRPCJob(const string& strMethod, const Array& params)
+{
+    if (!tableRPC[strMethod])
+        throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    if (strMethod == "startjob" || strMethod == "stop")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strMethod + " cannot run as a job");
+
+    CRPCJob* pjob;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJobs);
+        pjob = new CRPCJob(nJobNext++, strMethod, params);
+        mapJobs[pjob->nId] = pjob;
+    }
+    if (!NewThread(ThreadRPCJob, pjob, THREADPOOL_RPC))
+    {
+        boost::unique_lock<boost::mutex> lock(mutexJobs);
+        mapJobs.erase(pjob->nId);
+        delete pjob;
+        throw JSONRPCError(RPC_MISC_ERROR, "Cannot start job thread");
+    }
+    return pjob->nId;
+}
+
+bool CancelRPCJob(int nId)
+{
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    map<int, CRPCJob*>::iterator it = mapJobs.find(nId);
+    if (it == mapJobs.end() || it->second->nTimeEnd)
+        return false;
+    CancelJob(it->second);
+    return true;
+}
+
+bool TakeRPCJobResult(int nId, Value& result, string& strError)
+{
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    map<int, CRPCJob*>::iterator it;
+    while ((it = mapJobs.find(nId)) != mapJobs.end() && !it->second->nTimeEnd)
+        condJobs.wait(lock);
+    if (it == mapJobs.end())
+    {
+        strError = "No such job";
+        return false;
+    }
+
+    CRPCJob* pjob = it->second;
+    bool fDone = (pjob->strState == "done");
+    if (fDone)
+        result = pjob->result;
+    else
+        strError = (pjob->strState == "cancelled") ? "Cancelled" : pjob->strError;
+    mapJobs.erase(it);
+    delete pjob;
+    return fDone;
+}
+
+Value startjob(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1)
+        throw runtime_error(
+            "startjob <method> [params...]\n"
+            "Runs an RPC command in the background and returns its job id at once.\n"
+            "Meant for importwallet, dumpwallet, importprivkey and the like, which take\n"
+            "the locks a batch at a time; follow it with getjob and stop it with canceljob.");
+
+    string strMethod = params[0].get_str();
+
+    // Typed as they would be on the command line
+    vector<string> vArgs;
+    for (unsigned int i = 1; i < params.size(); i++)
+        vArgs.push_back(params[i].type() == str_type ? params[i].get_str() : WriteJSON(params[i]));
+    return StartRPCJob(strMethod, RPCConvertValues(strMethod, vArgs));
+}
+
+Value getjob(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getjob <id>\n"
+            "Returns the state, progress in percent and, once done, the result of a job.");
+
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    return JobToJSON(*FindJob(params[0]));
+}
+
+Value listjobs(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listjobs\n"
+            "Returns the running jobs and the last finished ones, as getjob does.");
+
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    Array ret;
+    for (map<int, CRPCJob*>::const_iterator it = mapJobs.begin(); it != mapJobs.end(); ++it)
+        ret.push_back(JobToJSON(*it->second));
+    return ret;
+}
+
+Value canceljob(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "canceljob <id>\n"
+            "Asks a running job to stop at its next batch.\n"
+            "Returns false if it had already finished.");
+
+    boost::unique_lock<boost::mutex> lock(mutexJobs);
+    CRPCJob* pjob = FindJob(params[0]);
+    if (pjob->nTimeEnd)
+        return false;
+    CancelJob(pjob);
+    return true;
+}
@@ -0,0 +1,487 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "rpcjson.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+
+#include <limits>
+
+using namespace std;
+using namespace json_spirit;
+
+// Deeper nesting than any RPC takes is refused rather than recursed into
+static const int MAX_JSON_DEPTH = 512;
+
+static inline int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+/** Recursive descent over the text, building the Value tree in place
+ *  so no subtree is copied once parsed.
+ */
+class CJSONReader
+{
+public:
+    CJSONReader(const char* pbeginIn, const char* pendIn) : p(pbeginIn), pend(pendIn), nDepth(0) {}
+
+    bool Read(Value& valRet)
+    {
+        SkipSpace();
+        return ParseValue(valRet);
+    }
+
+private:
+    const char* p;
+    const char* pend;
+    int nDepth;
+
+    void SkipSpace()
+    {
+        while (p < pend && isspace((unsigned char)*p))
+            p++;
+    }
+
+    // The closing quote of the string whose text starts at q, or pend.
+    // memchr finds each candidate; an odd run of backslashes before it
+    // means it is escaped.
+    const char* FindStringEnd(const char* q) const
+    {
+        const char* pstart = q;
+        while ((q = (const char*)memchr(q, '"', pend - q)) != NULL)
+        {
+            const char* pback = q;
+            while (pback > pstart && pback[-1] == '\\')
+                pback--;
+            if ((q - pback) % 2 == 0)
+                return q;
+            q++;
+        }
+        return pend;
+    }
+
+    bool Literal(const char* pszWord, size_t nLen)
+    {
+        if ((size_t)(pend - p) < nLen || memcmp(p, pszWord, nLen) != 0)
+            return false;
+        p += nLen;
+        return true;
+    }
+
+    bool ParseValue(Value& valRet)
+    {
+        if (p >= pend)
+            return false;
+        switch (*p)
+        {
+        case '"':
+        {
+            // Parse straight into the Value's own string; hex payloads
+            // run to megabytes and copying them twice more shows
+            valRet = Value(string());
+            return ParseString(const_cast<string&>(valRet.get_str()));
+        }
+        case '{': return ParseObject(valRet);
+        case '[': return ParseArray(valRet);
+        case 't': valRet = Value(true);  return Literal("true", 4);
+        case 'f': valRet = Value(false); return Literal("false", 5);
+        case 'n': valRet = Value();      return Literal("null", 4);
+        default:  return ParseNumber(valRet);
+        }
+    }
+
+    // Anything may follow a backslash: \x takes two hex digits, \u four
+    // (kept to their low byte, as json_spirit does for std::string), and
+    // an unknown escape drops out of the string
+    bool ParseString(string& strRet)
+    {
+        const char* pbegin = ++p;
+        p = FindStringEnd(p);
+        if (p >= pend)
+            return false;
+        const char* pclose = p++;
+
+        strRet.reserve(pclose - pbegin);
+        const char* q = pbegin;
+        while (q < pclose)
+        {
+            const char* pesc = (const char*)memchr(q, '\\', pclose - q);
+            if (!pesc)
+            {
+                strRet.append(q, pclose - q);
+                break;
+            }
+            strRet.append(q, pesc - q);
+            q = pesc + 1;
+            switch (*q)
+            {
+            case 't':  strRet += '\t'; break;
+            case 'b':  strRet += '\b'; break;
+            case 'f':  strRet += '\f'; break;
+            case 'n':  strRet += '\n'; break;
+            case 'r':  strRet += '\r'; break;
+            case '\\': strRet += '\\'; break;
+            case '/':  strRet += '/';  break;
+            case '"':  strRet += '"';  break;
+            case 'x':
+                if (pclose - q >= 3)
+                {
+                    strRet += (char)((HexDigit(q[1]) << 4) + HexDigit(q[2]));
+                    q += 2;
+                }
+                break;
+            case 'u':
+                if (pclose - q >= 5)
+                {
+                    strRet += (char)((HexDigit(q[1]) << 12) + (HexDigit(q[2]) << 8) +
+                                     (HexDigit(q[3]) << 4) + HexDigit(q[4]));
+                    q += 4;
+                }
+                break;
+            }
+            q++;
+        }
+        return true;
+    }
+
+    // A real needs a point or an exponent; anything else is an int64, or
+    // failing that a uint64
+    bool ParseNumber(Value& valRet)
+    {
+        const char* pbegin = p;
+        const char* q = p;
+        if (q < pend && (*q == '+' || *q == '-'))
+            q++;
+        const char* pdigits = q;
+        while (q < pend && isdigit((unsigned char)*q))
+            q++;
+        bool fDigits = q > pdigits;
+        bool fReal = false;
+        if (q < pend && *q == '.')
+        {
+            const char* pfrac = ++q;
+            while (q < pend && isdigit((unsigned char)*q))
+                q++;
+            fDigits |= q > pfrac;
+            fReal = true;
+        }
+        if (!fDigits)
+            return false;
+        if (q < pend && (*q == 'e' || *q == 'E'))
+        {
+            const char* pexp = q + 1;
+            if (pexp < pend && (*pexp == '+' || *pexp == '-'))
+                pexp++;
+            const char* pexpdigits = pexp;
+            while (pexp < pend && isdigit((unsigned char)*pexp))
+                pexp++;
+            if (pexp > pexpdigits)
+            {
+                q = pexp;
+                fReal = true;
+            }
+        }
+
+        if (fReal)
+        {
+            valRet = Value(strtod(string(pbegin, q).c_str(), NULL));
+            p = q;
+            return true;
+        }
+
+        bool fNegative = *pbegin == '-';
+        uint64_t n = 0;
+        for (const char* d = pdigits; d < q; d++)
+        {
+            if (n > (std::numeric_limits<uint64_t>::max() - (*d - '0')) / 10)
+                return false;
+            n = n * 10 + (*d - '0');
+        }
+        if (fNegative)
+        {
+            if (n > (uint64_t)std::numeric_limits<int64_t>::max() + 1)
+                return false;
+            valRet = Value((int64_t)(0 - n));
+        }
+        else if (n <= (uint64_t)std::numeric_limits<int64_t>::max())
+            valRet = Value((int64_t)n);
+        else if (*pbegin != '+')
+            valRet = Value(n);
+        else
+            return false;
+        p = q;
+        return true;
+    }
+
+    // Number of members of the array or object p has just entered, counted ahead
+    // so the vector is sized once. Growing it would copy every parsed
+    // subtree in it.
+    size_t CountMembers() const
+    {
+        size_t nCommas = 0;
+        int nNest = 0;
+        for (const char* q = p; q < pend; q++)
+        {
+            switch (*q)
+            {
+            case '"':
+                q = FindStringEnd(q + 1);
+                break;
+            case '[': case '{':
+                nNest++;
+                break;
+            case ']': case '}':
+                if (nNest-- == 0)
+                    return nCommas + 1;
+                break;
+            case ',':
+                if (nNest == 0)
+                    nCommas++;
+                break;
+            }
+        }
+        return nCommas + 1;
+    }
+
+    bool ParseArray(Value& valRet)
+    {
+        if (++nDepth > MAX_JSON_DEPTH)
+            return false;
+        p++;
+        valRet = Array();
+        Array& arr = valRet.get_array();
+        arr.reserve(CountMembers());
+        SkipSpace();
+        if (p < pend && *p == ']')
+        {
+            p++;
+            nDepth--;
+            return true;
+        }
+        while (true)
+        {
+            arr.push_back(Value());
+            if (!ParseValue(arr.back()))
+                return false;
+            SkipSpace();
+            if (p >= pend)
+                return false;
+            if (*p == ']')
+                break;
+            if (*p != ',')
+                return false;
+            p++;
+            SkipSpace();
+        }
+        p++;
+        nDepth--;
+        return true;
+    }
+
+    bool ParseObject(Value& valRet)
+    {
+        if (++nDepth > MAX_JSON_DEPTH)
+            return false;
+        p++;
+        valRet = Object();
+        Object& obj = valRet.get_obj();
+        obj.reserve(CountMembers());
+        SkipSpace();
+        if (p < pend && *p == '}')
+        {
+            p++;
+            nDepth--;
+            return true;
+        }
+        while (true)
+        {
+            if (p >= pend || *p != '"')
+                return false;
+            obj.push_back(Pair("", Value()));
+            if (!ParseString(obj.back().name_))
+                return false;
+            SkipSpace();
+            if (p >= pend || *p != ':')
+                return false;
+            p++;
+            SkipSpace();
+            if (!ParseValue(obj.back().value_))
+                return false;
+            SkipSpace();
+            if (p >= pend)
+                return false;
+            if (*p == '}')
+                break;
+            if (*p != ',')
+                return false;
+            p++;
+            SkipSpace();
+        }
+        p++;
+        nDepth--;
+        return true;
+    }
+};
+
+bool ReadJSON(const string& str, Value& valRet)
+{
+    const char* pbegin = str.data();
+    CJSONReader reader(pbegin, pbegin + str.size());
+    return reader.Read(valRet);
+}
+
+class CStringSink
+{
+public:
+    explicit CStringSink(string& strIn) : str(strIn) {}
+    void Append(const char* pch, size_t n) { str.append(pch, n); }
+    void Append(char c) { str += c; }
+private:
+    string& str;
+};
+
+class COstreamSink
+{
+public:
+    explicit COstreamSink(ostream& osIn) : os(osIn) {}
+    void Append(const char* pch, size_t n) { os.write(pch, n); }
+    void Append(char c) { os.put(c); }
+private:
+    ostream& os;
+};
+
+// Same escapes as json_spirit's add_esc_chars: the short forms, and \u00XX
+// for whatever iswprint doesn't pass. Printable ASCII is copied in runs.
+template <typename Sink>
+static void WriteJSONString(const string& str, Sink& sink)
+{
+    static const char* pszHex = "0123456789ABCDEF";
+    sink.Append('"');
+    const char* pch = str.data();
+    const char* pend = pch + str.size();
+    const char* prun = pch;
+    for (; pch < pend; pch++)
+    {
+        char c = *pch;
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+            continue;
+        const char* pszEsc = NULL;
+        switch (c)
+        {
+        case '"':  pszEsc = "\\\""; break;
+        case '\\': pszEsc = "\\\\"; break;
+        case '\b': pszEsc = "\\b";  break;
+        case '\f': pszEsc = "\\f";  break;
+        case '\n': pszEsc = "\\n";  break;
+        case '\r': pszEsc = "\\r";  break;
+        case '\t': pszEsc = "\\t";  break;
+        }
+        const wint_t unsigned_c = (c >= 0) ? c : 256 + c;
+        if (!pszEsc && iswprint(unsigned_c))
+            continue;
+        sink.Append(prun, pch - prun);
+        prun = pch + 1;
+        if (pszEsc)
+            sink.Append(pszEsc, 2);
+        else
+        {
+            char esc[6] = { '\\', 'u', '0', '0', pszHex[(unsigned_c >> 4) & 0xf], pszHex[unsigned_c & 0xf] };
+            sink.Append(esc, 6);
+        }
+    }
+    sink.Append(prun, pend - prun);
+    sink.Append('"');
+}
+
+template <typename Sink>
+static void WriteJSONValue(const Value& value, Sink& sink)
+{
+    char buf[64];
+    switch (value.type())
+    {
+    case obj_type:
+    {
+        const Object& obj = value.get_obj();
+        sink.Append('{');
+        for (Object::const_iterator it = obj.begin(); it != obj.end(); ++it)
+        {
+            if (it != obj.begin())
+                sink.Append(',');
+            WriteJSONString(it->name_, sink);
+            sink.Append(':');
+            WriteJSONValue(it->value_, sink);
+        }
+        sink.Append('}');
+        break;
+    }
+    case array_type:
+    {
+        const Array& arr = value.get_array();
+        sink.Append('[');
+        for (Array::const_iterator it = arr.begin(); it != arr.end(); ++it)
+        {
+            if (it != arr.begin())
+                sink.Append(',');
+            WriteJSONValue(*it, sink);
+        }
+        sink.Append(']');
+        break;
+    }
+    case str_type:
+        WriteJSONString(value.get_str(), sink);
+        break;
+    case bool_type:
+        if (value.get_bool())
+            sink.Append("true", 4);
+        else
+            sink.Append("false", 5);
+        break;
+    case int_type:
+        if (value.is_uint64())
+            sink.Append(buf, snprintf(buf, sizeof(buf), "%" PRIu64, value.get_uint64()));
+        else
+            sink.Append(buf, snprintf(buf, sizeof(buf), "%" PRId64, value.get_int64()));
+        break;
+    case real_type:
+    {
+        // As json_spirit formats amounts: fixed, eight decimals
+        int n = snprintf(buf, sizeof(buf), "%.8f", value.get_real());
+        if (n >= (int)sizeof(buf))
+        {
+            string str(n + 1, '\0');
+            snprintf(&str[0], str.size(), "%.8f", value.get_real());
+            sink.Append(str.data(), n);
+        }
+        else
+            sink.Append(buf, n);
+        break;
+    }
+    case null_type:
+        sink.Append("null", 4);
+        break;
+    }
+}
+
+string WriteJSON(const Value& value)
+{
+    string str;
+    CStringSink sink(str);
+    WriteJSONValue(value, sink);
+    return str;
+}
+
+void WriteJSON(const Value& value, ostream& os)
+{
+    COstreamSink sink(os);
+    WriteJSONValue(value, sink);
+}
@@ -0,0 +1,27 @@
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_RPCJSON_H
+#define BITCOIN_RPCJSON_H
+
+#include <ostream>
+#include <string>
+
+#include "json/json_spirit_value.h"
+
+/** Hand-written JSON reader and writer for the RPC layer.
+ *
+ *  They produce and consume the json_spirit Value tree, accept and emit
+ *  exactly what json_spirit's read_string and write_string do, but parse
+ *  in one pass without boost::spirit and write without copying members.
+ *  Pretty printing for the command line is left to json_spirit.
+ */
+
+// Parse str into valRet. Like read_string, text after the value is ignored.
+bool ReadJSON(const std::string& str, json_spirit::Value& valRet);
+
+// Compact JSON as write_string(value, false) produces it
+std::string WriteJSON(const json_spirit::Value& value);
+void WriteJSON(const json_spirit::Value& value, std::ostream& os);
+
+#endif
@@ -8,6 +8,7 @@
 #include "txdb.h"
 #include "init.h"
 #include "miner.h"
+#include "kernel.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -45,21 +46,22 @@ Value getmininginfo(const Array& params, bool fHelp)
 
     uint64_t nWeight = 0;
     pwalletMain->GetStakeWeight(nWeight);
+    CChainTipSummaryRef ptip = GetChainTipSummary();
 
     Object obj, diff, weight;
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
+    obj.push_back(Pair("blocks",        ptip->nHeight));
     obj.push_back(Pair("currentblocksize",(uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",(uint64_t)nLastBlockTx));
 
-    diff.push_back(Pair("proof-of-work",        GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake",       GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",        ptip->dDifficultyPoW));
+    diff.push_back(Pair("proof-of-stake",       ptip->dDifficultyPoS));
 
     diff.push_back(Pair("search-interval",      (int)nLastCoinStakeSearchInterval));
     obj.push_back(Pair("difficulty",    diff));
 
-    obj.push_back(Pair("blockvalue",    (uint64_t)GetProofOfWorkReward((int)nBestHeight, 0)));
-    obj.push_back(Pair("netmhashps",     GetPoWMHashPS()));
-    obj.push_back(Pair("netstakeweight", GetPoSKernelPS()));
+    obj.push_back(Pair("blockvalue",    (uint64_t)ptip->nBlockValue));
+    obj.push_back(Pair("netmhashps",     ptip->dNetMHashPS));
+    obj.push_back(Pair("netstakeweight", ptip->dNetStakeWeight));
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     obj.push_back(Pair("pooledtx",      (uint64_t)mempool.size()));
 
@@ -68,7 +70,7 @@ Value getmininginfo(const Array& params, bool fHelp)
     weight.push_back(Pair("combined",  (uint64_t)nWeight));
     obj.push_back(Pair("stakeweight", weight));
 
-    obj.push_back(Pair("stakeinterest",    (uint64_t)GetProofOfStakeInterest(nBestHeight)));
+    obj.push_back(Pair("stakeinterest",    (uint64_t)ptip->nStakeInterest));
     obj.push_back(Pair("testnet",       fTestNet));
     return obj;
 }
@@ -80,12 +82,13 @@ Value getstakinginfo(const Array& params, bool fHelp)
             "getstakinginfo\n"
             "Returns an object containing staking-related information.");
 
-    uint64_t nWeight = 0;
-    pwalletMain->GetStakeWeight(nWeight);
+    uint64_t nWeight = 0, nImmatureWeight = 0;
+    pwalletMain->GetStakeWeight(nWeight, &nImmatureWeight);
+    CChainTipSummaryRef ptip = GetChainTipSummary();
 
-    uint64_t nNetworkWeight = GetPoSKernelPS();
+    uint64_t nNetworkWeight = ptip->dNetStakeWeight;
     bool staking = nLastCoinStakeSearchInterval && nWeight;
-    uint64_t nExpectedTime = staking ? (GetTargetSpacing(nBestHeight) * nNetworkWeight / nWeight) : -1;
+    uint64_t nExpectedTime = staking ? (GetTargetSpacing(ptip->nHeight) * nNetworkWeight / nWeight) : -1;
 
     Object obj;
 
@@ -97,10 +100,11 @@ Value getstakinginfo(const Array& params, bool fHelp)
     obj.push_back(Pair("currentblocktx", (uint64_t)nLastBlockTx));
     obj.push_back(Pair("pooledtx", (uint64_t)mempool.size()));
 
-    obj.push_back(Pair("difficulty", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    obj.push_back(Pair("difficulty", ptip->dDifficultyPoS));
     obj.push_back(Pair("search-interval", (int)nLastCoinStakeSearchInterval));
 
     obj.push_back(Pair("weight", (uint64_t)nWeight));
+    obj.push_back(Pair("immatureweight", (uint64_t)nImmatureWeight));
     obj.push_back(Pair("netstakeweight", (uint64_t)nNetworkWeight));
 
     obj.push_back(Pair("expectedtime", nExpectedTime));
@@ -108,6 +112,85 @@ Value getstakinginfo(const Array& params, bool fHelp)
     return obj;
 }
 
+Value simulatestake(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "simulatestake [blocks]\n"
+            "Replays the stake kernel search of the wallet's current staking outputs\n"
+            "over the time slots of the last [blocks] blocks (default: 100), as if\n"
+            "they had been staking then. Returns the hits found, the kernel hashes\n"
+            "per second and the milliseconds spent in each phase.");
+
+    int nBlocks = params.size() > 0 ? params[0].get_int() : 100;
+    if (nBlocks < 1)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid number of blocks");
+
+    CBlockIndex* pindexTip;
+    vector<CStakeCandidate> vCandidates;
+    int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeSelect, nTimeLoad;
+    {
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        pindexTip = pindexBest;
+
+        vector<COutput> vCoins;
+        pwalletMain->AvailableCoinsForStaking(vCoins, GetAdjustedTime());
+        nTimeSelect = GetTimeMicros();
+
+        CTxDB txdb("r");
+        vCandidates.reserve(vCoins.size());
+        BOOST_FOREACH(const COutput& out, vCoins)
+        {
+            CStakeCandidate candidate;
+            if (GetStakeCandidate(txdb, COutPoint(out.tx->GetHash(), out.i), candidate))
+                vCandidates.push_back(candidate);
+        }
+        nTimeLoad = GetTimeMicros();
+    }
+
+    // Block index entries are never freed, so the walk doesn't need cs_main
+    int nSlots = 0, nHits = 0, nBlocksWon = 0, nBlocksSimulated = 0;
+    uint64_t nEvaluations = 0;
+    for (CBlockIndex* pindex = pindexTip; pindex && pindex->pprev && nBlocksSimulated < nBlocks && !fShutdown; pindex = pindex->pprev)
+    {
+        CBlockIndex* pindexPrev = pindex->pprev;
+        unsigned int nBits = GetNextTargetRequired(pindexPrev, true, 0);
+        bool fWon = false;
+
+        // The slots StakeMiner() would have tried before this block turned up
+        unsigned int nSlotTime = (pindexPrev->GetBlockTime() + STAKE_TIMESTAMP_MASK + 1) & ~STAKE_TIMESTAMP_MASK;
+        for (; nSlotTime <= pindex->GetBlockTime(); nSlotTime += STAKE_TIMESTAMP_MASK + 1)
+        {
+            unsigned int nOffset;
+            nSlots++;
+            if (FindStakeKernel(pindexPrev, nBits, vCandidates, nSlotTime, 1, nOffset, &nEvaluations) >= 0)
+            {
+                nHits++;
+                fWon = true;
+            }
+        }
+        if (fWon)
+            nBlocksWon++;
+        nBlocksSimulated++;
+    }
+    int64_t nTimeSearch = GetTimeMicros();
+
+    Object obj;
+    obj.push_back(Pair("outputs", (int)vCandidates.size()));
+    obj.push_back(Pair("blocks", nBlocksSimulated));
+    obj.push_back(Pair("slots", nSlots));
+    obj.push_back(Pair("hits", nHits));
+    obj.push_back(Pair("blockswon", nBlocksWon));
+    obj.push_back(Pair("hitrate", nSlots ? (double)nHits / nSlots : 0.0));
+    obj.push_back(Pair("evaluations", (uint64_t)nEvaluations));
+    obj.push_back(Pair("evaluationspersec", nTimeSearch > nTimeLoad ? nEvaluations * 1000000.0 / (nTimeSearch - nTimeLoad) : 0.0));
+    obj.push_back(Pair("selectms", (nTimeSelect - nTimeStart) * 0.001));
+    obj.push_back(Pair("loadms", (nTimeLoad - nTimeSelect) * 0.001));
+    obj.push_back(Pair("searchms", (nTimeSearch - nTimeLoad) * 0.001));
+    return obj;
+}
+
 Value getworkex(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -232,7 +315,7 @@ Value getworkex(const Array& params, bool fHelp)
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->hashMerkleRoot = pblock->UpdateMerkleLeaf(0);
 
         return CheckWork(pblock, *pwalletMain, reservekey);
     }
@@ -348,7 +431,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->hashMerkleRoot = pblock->UpdateMerkleLeaf(0);
 
         return CheckWork(pblock, *pwalletMain, reservekey);
     }
@@ -469,7 +552,7 @@ Value tmpTest(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
-        pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+        pblock->hashMerkleRoot = pblock->UpdateMerkleLeaf(0);
 
         found = CheckWork(pblock, *pwalletMain, reservekey);
         if(found == true)
@@ -480,92 +563,41 @@ Value tmpTest(const Array& params, bool fHelp)
 }
 
 
-Value getblocktemplate(const Array& params, bool fHelp)
-{
-    if (fHelp || params.size() > 1)
-        throw runtime_error(
-            "getblocktemplate [params]\n"
-            "Returns data needed to construct a block to work on:\n"
-            "  \"version\" : block version\n"
-            "  \"previousblockhash\" : hash of current highest block\n"
-            "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
-            "  \"coinbaseaux\" : data that should be included in coinbase\n"
-            "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
-            "  \"target\" : hash target\n"
-            "  \"mintime\" : minimum timestamp appropriate for next block\n"
-            "  \"curtime\" : current timestamp\n"
-            "  \"mutable\" : list of ways the block template may be changed\n"
-            "  \"noncerange\" : range of valid nonces\n"
-            "  \"sigoplimit\" : limit of sigops in blocks\n"
-            "  \"sizelimit\" : limit of block size\n"
-            "  \"bits\" : compressed target of next block\n"
-            "  \"height\" : height of the next block\n"
-            "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
-
-    std::string strMode = "template";
-    if (params.size() > 0)
-    {
-        const Object& oparam = params[0].get_obj();
-        const Value& modeval = find_value(oparam, "mode");
-        if (modeval.type() == str_type)
-            strMode = modeval.get_str();
-        else if (modeval.type() == null_type)
-        {
-            /* Do nothing */
-        }
-        else
-            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
-    }
-
-    if (strMode != "template")
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
-
-    if (vNodes.empty())
-        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "I/OCoin is not connected!");
-
-    if (IsInitialBlockDownload())
-        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "I/OCoin is downloading blocks...");
-
-    int nPowHeight = GetPowHeight(pindexBest);
-    if (nPowHeight >= LAST_POW_BLOCK)
-        throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
+// A template is rebuilt for a new best block at once, but for a changed
+// memory pool only every TEMPLATE_REFRESH_INTERVAL seconds, and long polls
+// waiting on the memory pool return on the same schedule
+static const int64_t TEMPLATE_REFRESH_INTERVAL = 5;
 
-    static CReserveKey reservekey(pwalletMain);
+// The block getblocktemplate hands out and its reply without "curtime".
+// They are built once and shared by every request until they go stale, so
+// the cost is independent of how many workers poll. Guarded by cs_main.
+static CBlock* pblockTemplate = NULL;
+static CBlockIndex* pindexTemplatePrev = NULL;
+static unsigned int nTemplateTxUpdated = 0;
+static int64_t nTemplateStart = 0;
+static Object objTemplate;
 
-    // Update block
-    static unsigned int nTransactionsUpdatedLast;
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlock* pblock;
-    if (pindexPrev != pindexBest ||
-        (nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+// Wait until the best block is no longer hashWatched or, once the refresh
+// interval has passed, the memory pool has changed since nTxWatched
+static void WaitForTemplateChange(const uint256& hashWatched, unsigned int nTxWatched)
+{
+    int64_t nStart = GetTime();
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (!fShutdown)
     {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = nTransactionsUpdated;
-        CBlockIndex* pindexPrevNew = pindexBest;
-        nStart = GetTime();
-
-        // Create new block
-        if(pblock)
         {
-            delete pblock;
-            pblock = NULL;
+            READ_LOCK(cs_chainstate);
+            if (hashBestChain != hashWatched)
+                return;
         }
-        pblock = CreateNewBlock(pwalletMain);
-        if (!pblock)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
+        if (nTransactionsUpdated != nTxWatched && GetTime() - nStart >= TEMPLATE_REFRESH_INTERVAL)
+            return;
+        cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
     }
+}
 
-    // Update nTime
-    pblock->UpdateTime(pindexPrev);
-    pblock->nNonce = 0;
-
+static Object TemplateToJSON(CBlock* pblock, CBlockIndex* pindexPrev)
+{
     Array transactions;
     map<uint256, int64_t> setTxIndex;
     int i = 0;
@@ -614,13 +646,10 @@ Value getblocktemplate(const Array& params, bool fHelp)
 
     uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
 
-    static Array aMutable;
-    if (aMutable.empty())
-    {
-        aMutable.push_back("time");
-        aMutable.push_back("transactions");
-        aMutable.push_back("prevblock");
-    }
+    Array aMutable;
+    aMutable.push_back("time");
+    aMutable.push_back("transactions");
+    aMutable.push_back("prevblock");
 
     Object result;
     result.push_back(Pair("version", pblock->nVersion));
@@ -628,16 +657,118 @@ Value getblocktemplate(const Array& params, bool fHelp)
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("longpollid", pindexPrev->GetBlockHash().GetHex() + i64tostr(nTemplateTxUpdated)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetPastTimeLimit()+1));
     result.push_back(Pair("mutable", aMutable));
     result.push_back(Pair("noncerange", "00000000ffffffff"));
     result.push_back(Pair("sigoplimit", (int64_t)MAX_BLOCK_SIGOPS));
     result.push_back(Pair("sizelimit", (int64_t)MAX_BLOCK_SIZE));
-    result.push_back(Pair("curtime", (int64_t)pblock->nTime));
     result.push_back(Pair("bits", strprintf("%08x", pblock->nBits)));
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
+    return result;
+}
+
+Value getblocktemplate(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getblocktemplate [params]\n"
+            "Returns data needed to construct a block to work on:\n"
+            "  \"version\" : block version\n"
+            "  \"previousblockhash\" : hash of current highest block\n"
+            "  \"transactions\" : contents of non-coinbase transactions that should be included in the next block\n"
+            "  \"coinbaseaux\" : data that should be included in coinbase\n"
+            "  \"coinbasevalue\" : maximum allowable input to coinbase transaction, including the generation award and transaction fees\n"
+            "  \"longpollid\" : pass back as \"longpollid\" in [params] to wait for the next template\n"
+            "  \"target\" : hash target\n"
+            "  \"mintime\" : minimum timestamp appropriate for next block\n"
+            "  \"curtime\" : current timestamp\n"
+            "  \"mutable\" : list of ways the block template may be changed\n"
+            "  \"noncerange\" : range of valid nonces\n"
+            "  \"sigoplimit\" : limit of sigops in blocks\n"
+            "  \"sizelimit\" : limit of block size\n"
+            "  \"bits\" : compressed target of next block\n"
+            "  \"height\" : height of the next block\n"
+            "A long poll holds an RPC thread until a new block or, after a few\n"
+            "seconds, new transactions; size -rpcthreads for the miners served.\n"
+            "See https://en.bitcoin.it/wiki/BIP_0022 for full specification.");
+
+    std::string strMode = "template";
+    std::string strLongPollId;
+    if (params.size() > 0)
+    {
+        const Object& oparam = params[0].get_obj();
+        const Value& modeval = find_value(oparam, "mode");
+        if (modeval.type() == str_type)
+            strMode = modeval.get_str();
+        else if (modeval.type() == null_type)
+        {
+            /* Do nothing */
+        }
+        else
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+        const Value& lpval = find_value(oparam, "longpollid");
+        if (lpval.type() == str_type)
+            strLongPollId = lpval.get_str();
+    }
+
+    if (strMode != "template")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
+
+    // Wait without holding any lock; the id is the best block hash and the
+    // memory pool update count the template was built from
+    if (strLongPollId.size() > 64)
+    {
+        uint256 hashWatched;
+        hashWatched.SetHex(strLongPollId.substr(0, 64));
+        WaitForTemplateChange(hashWatched, (unsigned int)atoi64(strLongPollId.substr(64)));
+        if (fShutdown)
+            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+    }
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    if (vNodes.empty())
+        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "I/OCoin is not connected!");
+
+    if (IsInitialBlockDownload())
+        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "I/OCoin is downloading blocks...");
+
+    int nPowHeight = GetPowHeight(pindexBest);
+    if (nPowHeight >= LAST_POW_BLOCK)
+        throw JSONRPCError(RPC_MISC_ERROR, "No more PoW blocks");
+
+    // Update block
+    if (pindexTemplatePrev != pindexBest ||
+        (nTransactionsUpdated != nTemplateTxUpdated && GetTime() - nTemplateStart > TEMPLATE_REFRESH_INTERVAL))
+    {
+        // Clear pindexTemplatePrev so future calls make a new block, despite any failures from here on
+        pindexTemplatePrev = NULL;
+
+        // Store the pindexBest used before CreateNewBlock, to avoid races
+        nTemplateTxUpdated = nTransactionsUpdated;
+        CBlockIndex* pindexPrevNew = pindexBest;
+        nTemplateStart = GetTime();
+
+        // Create new block
+        delete pblockTemplate;
+        pblockTemplate = NULL;
+        pblockTemplate = CreateNewBlock(pwalletMain);
+        if (!pblockTemplate)
+            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+
+        // Need to update only after we know CreateNewBlock succeeded
+        pindexTemplatePrev = pindexPrevNew;
+        objTemplate = TemplateToJSON(pblockTemplate, pindexTemplatePrev);
+    }
+
+    // Update nTime
+    pblockTemplate->UpdateTime(pindexTemplatePrev);
+    pblockTemplate->nNonce = 0;
 
+    Object result = objTemplate;
+    result.push_back(Pair("curtime", (int64_t)pblockTemplate->nTime));
     return result;
 }
 
@@ -61,6 +61,24 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("inbound", stats.fInbound));
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
+        if (stats.fFastPeer)
+            obj.push_back(Pair("fastpeer", true));
+        if (stats.nPingUsecTime > 0)
+            obj.push_back(Pair("pingtime", stats.nPingUsecTime / 1e6));
+        if (stats.nMinPingUsecTime < std::numeric_limits<int64_t>::max())
+            obj.push_back(Pair("minping", stats.nMinPingUsecTime / 1e6));
+        obj.push_back(Pair("bytessent", (int64_t)stats.nSendBytes));
+        obj.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
+
+        Object sendPerMsgCmd;
+        BOOST_FOREACH(const mapMsgCmdSize::value_type& i, stats.mapSendBytesPerMsgCmd)
+            sendPerMsgCmd.push_back(Pair(i.first, (int64_t)i.second));
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsgCmd));
+
+        Object recvPerMsgCmd;
+        BOOST_FOREACH(const mapMsgCmdSize::value_type& i, stats.mapRecvBytesPerMsgCmd)
+            recvPerMsgCmd.push_back(Pair(i.first, (int64_t)i.second));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
         ret.push_back(obj);
     }
@@ -68,6 +86,50 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getnetworkinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getnetworkinfo\n"
+            "Returns an object containing the state of this node's networking, "
+            "including how often getdata for blocks was served from memory.");
+
+    Object obj;
+    obj.push_back(Pair("version",         FormatFullVersion()));
+    obj.push_back(Pair("protocolversion", (int)PROTOCOL_VERSION));
+    obj.push_back(Pair("localservices",   strprintf("%08"PRIx64, nLocalServices)));
+    obj.push_back(Pair("timeoffset",      (int64_t)GetTimeOffset()));
+    {
+        LOCK(cs_vNodes);
+        obj.push_back(Pair("connections", (int)vNodes.size()));
+    }
+
+    obj.push_back(Pair("totalbytesrecv",  (int64_t)GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent",  (int64_t)GetTotalBytesSent()));
+
+    Object upload;
+    upload.push_back(Pair("timeframe",               MAX_UPLOAD_TIMEFRAME));
+    upload.push_back(Pair("target",                  (int64_t)GetMaxOutboundTarget()));
+    upload.push_back(Pair("target_reached",          OutboundTargetReached(false)));
+    upload.push_back(Pair("serve_historical_blocks", !OutboundTargetReached(true)));
+    upload.push_back(Pair("bytes_left_in_cycle",     (int64_t)GetOutboundTargetBytesLeft()));
+    upload.push_back(Pair("time_left_in_cycle",      GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", upload));
+
+    unsigned int nCount;
+    uint64_t nBytes, nHits, nMisses;
+    GetBlockMessageCacheStats(nCount, nBytes, nHits, nMisses);
+    Object cache;
+    cache.push_back(Pair("blocks",   (int)nCount));
+    cache.push_back(Pair("bytes",    (int64_t)nBytes));
+    cache.push_back(Pair("maxbytes", (int64_t)nBlockMessageCacheSize));
+    cache.push_back(Pair("hits",     (int64_t)nHits));
+    cache.push_back(Pair("misses",   (int64_t)nMisses));
+    obj.push_back(Pair("blockservecache", cache));
+
+    return obj;
+}
+
 // ppcoin: send alert.
 // There is a known deadlock situation with ThreadMessageHandler
 // ThreadMessageHandler: holds cs_vSend and acquiring cs_main in SendMessages()
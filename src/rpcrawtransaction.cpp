@@ -145,8 +145,68 @@ void spj(const CScript& scriptPubKey, Object& out, bool fIncludeHex)
     out.push_back(Pair("addresses", a));
 } */
 
+// The output a transaction input spends: a single read with -spentindex,
+// otherwise the transaction it came from. Mempool parents aren't looked at.
+static bool ReadPrevOut(CTxDB& txdb, const COutPoint& prevout, CTxOut& txoutRet)
+{
+    CSpentIndexValue spent;
+    if (fSpentIndex && txdb.ReadSpentIndex(prevout, spent))
+    {
+        txoutRet = spent.txout;
+        return true;
+    }
+    CTransaction txPrev;
+    if (!txdb.ReadDiskTx(prevout.hash, txPrev) || prevout.n >= txPrev.vout.size())
+        return false;
+    txoutRet = txPrev.vout[prevout.n];
+    return true;
+}
+
+// Where output n of tx was spent, if it was. Without -spentindex the
+// spending transaction is read to find its id, and the height is left out.
+static void SpentToJSON(CTxDB& txdb, const uint256& hashTx, const CTxIndex* ptxindex, unsigned int n, Object& out)
+{
+    CSpentIndexValue spent;
+    if (fSpentIndex)
+    {
+        if (!txdb.ReadSpentIndex(COutPoint(hashTx, n), spent))
+            return;
+        out.push_back(Pair("spentTxId", spent.txid.GetHex()));
+        out.push_back(Pair("spentIndex", (int)spent.nIndex));
+        out.push_back(Pair("spentHeight", spent.nHeight));
+        return;
+    }
+    if (!ptxindex || n >= ptxindex->vSpent.size() || ptxindex->vSpent[n].IsNull())
+        return;
+    CTransaction txSpend;
+    if (!txSpend.ReadFromDisk(ptxindex->vSpent[n]))
+        return;
+    for (unsigned int i = 0; i < txSpend.vin.size(); i++)
+    {
+        if (txSpend.vin[i].prevout == COutPoint(hashTx, n))
+        {
+            out.push_back(Pair("spentTxId", txSpend.GetHash().GetHex()));
+            out.push_back(Pair("spentIndex", (int)i));
+            return;
+        }
+    }
+}
+
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry, bool fSpentInfo);
+
 void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
 {
+    TxToJSON(tx, hashBlock, entry, false);
+}
+
+// With fSpentInfo the inputs carry the value and address they spend and the
+// outputs where they were spent, as getrawtransaction verbose=2 shows them
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry, bool fSpentInfo)
+{
+    CTxDB txdb("r");
+    CTxIndex txindex;
+    bool fTxIndex = fSpentInfo && !fSpentIndex && txdb.ReadTxIndex(tx.GetHash(), txindex);
+
     entry.push_back(Pair("txid", tx.GetHash().GetHex()));
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("time", (int64_t)tx.nTime));
@@ -167,6 +227,14 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
             o.push_back(Pair("asm", txin.scriptSig.ToString()));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
+            CTxOut txoutPrev;
+            if (fSpentInfo && ReadPrevOut(txdb, txin.prevout, txoutPrev))
+            {
+                in.push_back(Pair("value", ValueFromAmount(txoutPrev.nValue)));
+                CTxDestination address;
+                if (ExtractDestination(txoutPrev.scriptPubKey, address))
+                    in.push_back(Pair("address", cba(address).ToString()));
+            }
         }
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
         vin.push_back(in);
@@ -182,6 +250,8 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         spj(txout.scriptPubKey, o, false);
         out.push_back(Pair("scriptPubKey", o));
+        if (fSpentInfo)
+            SpentToJSON(txdb, tx.GetHash(), fTxIndex ? &txindex : NULL, i, out);
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
@@ -189,12 +259,14 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end() && (*mi).second)
         {
             CBlockIndex* pindex = (*mi).second;
             if (pindex->IsInMainChain())
             {
+                if (fSpentInfo)
+                    entry.push_back(Pair("height", pindex->nHeight));
                 entry.push_back(Pair("confirmations", 1 + nBestHeight - pindex->nHeight));
                 entry.push_back(Pair("time", (int64_t)pindex->nTime));
                 entry.push_back(Pair("blocktime", (int64_t)pindex->nTime));
@@ -213,14 +285,17 @@ Value getrawtransaction(const Array& params, bool fHelp)
             "If verbose=0, returns a string that is\n"
             "serialized, hex-encoded data for <txid>.\n"
             "If verbose is non-zero, returns an Object\n"
-            "with information about <txid>.");
+            "with information about <txid>.\n"
+            "If verbose=2, the inputs also show the value\n"
+            "and address they spend and the outputs where\n"
+            "they were spent, quickest with -spentindex.");
 
     uint256 hash;
     hash.SetHex(params[0].get_str());
 
-    bool fVerbose = false;
+    int nVerbose = 0;
     if (params.size() > 1)
-        fVerbose = (params[1].get_int() != 0);
+        nVerbose = params[1].get_int();
 
     CTransaction tx;
     uint256 hashBlock = 0;
@@ -231,12 +306,140 @@ Value getrawtransaction(const Array& params, bool fHelp)
     ssTx << tx;
     string strHex = HexStr(ssTx.begin(), ssTx.end());
 
-    if (!fVerbose)
+    if (nVerbose == 0)
         return strHex;
 
+    // Runs without cs_main; GetTransaction locks it itself for the mempool
+    READ_LOCK(cs_chainstate);
     Object result;
     result.push_back(Pair("hex", strHex));
-    TxToJSON(tx, hashBlock, result);
+    TxToJSON(tx, hashBlock, result, nVerbose >= 2);
+    return result;
+}
+
+// Script hash the address index keys an address by
+static uint160 AddressIndexHash(const string& strAddress)
+{
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addrindex -reindex");
+    cba address(strAddress);
+    if (!address.IsValid())
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid I/OCoin address");
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(address.Get());
+    return Hash160(scriptPubKey);
+}
+
+static void ParseHeightRange(const Array& params, unsigned int nFirst, int& nStart, int& nEnd)
+{
+    nStart = 0;
+    nEnd = std::numeric_limits<int>::max();
+    if (params.size() > nFirst)
+        nStart = params[nFirst].get_int();
+    if (params.size() > nFirst + 1)
+        nEnd = params[nFirst + 1].get_int();
+    if (nStart < 0 || nEnd < nStart)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid height range");
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance <address>\n"
+            "Returns the balance of <address> and the total it has received,\n"
+            "from the address index (-addrindex).");
+
+    uint160 hashScript = AddressIndexHash(params[0].get_str());
+    vector<pair<CAddressIndexKey, int64_t> > vIndex;
+    if (!CTxDB("r").ReadAddressIndex(hashScript, 0, std::numeric_limits<int>::max(), vIndex))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    int64_t nBalance = 0, nReceived = 0;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        nBalance += vIndex[i].second;
+        if (!vIndex[i].first.fSpending)
+            nReceived += vIndex[i].second;
+    }
+
+    Object result;
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
+Value getaddresstxids(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresstxids <address> [start] [end]\n"
+            "Returns the ids of the transactions paying to or spending from <address>\n"
+            "in blocks <start> to <end>, oldest first, from the address index (-addrindex).");
+
+    uint160 hashScript = AddressIndexHash(params[0].get_str());
+    int nStart, nEnd;
+    ParseHeightRange(params, 1, nStart, nEnd);
+
+    vector<pair<CAddressIndexKey, int64_t> > vIndex;
+    if (!CTxDB("r").ReadAddressIndex(hashScript, nStart, nEnd, vIndex))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    // A transaction is listed once per output and input touching the
+    // address, and within a block the entries are in txid order
+    Array result;
+    set<uint256> setBlockTxids;
+    int nHeight = -1;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        if (vIndex[i].first.nHeight != nHeight)
+        {
+            setBlockTxids.clear();
+            nHeight = vIndex[i].first.nHeight;
+        }
+        if (setBlockTxids.insert(vIndex[i].first.txid).second)
+            result.push_back(vIndex[i].first.txid.GetHex());
+    }
+    return result;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos <address> [start] [end]\n"
+            "Returns the unspent outputs paid to <address> in blocks <start> to <end>,\n"
+            "oldest first, from the address index (-addrindex).");
+
+    string strAddress = params[0].get_str();
+    uint160 hashScript = AddressIndexHash(strAddress);
+    int nStart, nEnd;
+    ParseHeightRange(params, 1, nStart, nEnd);
+
+    vector<pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    if (!CTxDB("r").ReadAddressUnspent(hashScript, vUnspent))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read the address index");
+
+    // Keyed by outpoint on disk; order by height for the caller
+    vector<pair<int, unsigned int> > vOrder;
+    for (unsigned int i = 0; i < vUnspent.size(); i++)
+        if (vUnspent[i].second.nHeight >= nStart && vUnspent[i].second.nHeight <= nEnd)
+            vOrder.push_back(make_pair(vUnspent[i].second.nHeight, i));
+    sort(vOrder.begin(), vOrder.end());
+
+    Array result;
+    for (unsigned int i = 0; i < vOrder.size(); i++)
+    {
+        const pair<CAddressUnspentKey, CAddressUnspentValue>& entry = vUnspent[vOrder[i].second];
+        Object out;
+        out.push_back(Pair("address", strAddress));
+        out.push_back(Pair("txid", entry.first.outpoint.hash.GetHex()));
+        out.push_back(Pair("vout", (int)entry.first.outpoint.n));
+        out.push_back(Pair("scriptPubKey", HexStr(entry.second.scriptPubKey.begin(), entry.second.scriptPubKey.end())));
+        out.push_back(Pair("amount", ValueFromAmount(entry.second.nValue)));
+        out.push_back(Pair("height", entry.second.nHeight));
+        result.push_back(out);
+    }
     return result;
 }
 
@@ -298,18 +501,57 @@ Array listunspent__(double p, double& iR)
     return results;
 }
 
+static Object UnspentToJSON(const COutput& out)
+{
+    int64_t nValue = out.tx->vout[out.i].nValue;
+    const CScript& pk = out.tx->vout[out.i].scriptPubKey;
+    Object entry;
+    entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
+    entry.push_back(Pair("vout", out.i));
+    CTxDestination address;
+    if (ExtractDestination(pk, address))
+    {
+        entry.push_back(Pair("address", cba(address).ToString()));
+        if (pwalletMain->mapAddressBook.count(address))
+            entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+    }
+    entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
+    entry.push_back(Pair("amount",ValueFromAmount(nValue)));
+    entry.push_back(Pair("confirmations",out.nDepth));
+    return entry;
+}
+
+// "<txid>:<n>" of the last output a page returned, "" for the first page
+static COutPoint ParseUnspentCursor(const string& strCursor)
+{
+    if (strCursor.empty())
+        return COutPoint();
+    size_t nColon = strCursor.find(':');
+    string strHash = strCursor.substr(0, nColon);
+    if (nColon == string::npos || strHash.size() != 64 || !IsHex(strHash) ||
+        strCursor.size() == nColon + 1 || strCursor.find_first_not_of("0123456789", nColon + 1) != string::npos)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor: " + strCursor);
+    return COutPoint(uint256(strHash), atoi(strCursor.substr(nColon + 1)));
+}
+
 Value listunspent(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 3)
+    if (fHelp || params.size() > 4)
         throw runtime_error(
-            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...]\n"
+            "listunspent [minconf=1] [maxconf=9999999]  [\"address\",...] [options]\n"
             "Returns array of unspent transaction outputs\n"
             "with between minconf and maxconf (inclusive) confirmations.\n"
             "Optionally filtered to only include txouts paid to specified addresses.\n"
             "Results are an array of Objects, each of which has:\n"
-            "{txid, vout, scriptPubKey, amount, confirmations}");
+            "{txid, vout, scriptPubKey, amount, confirmations}\n"
+            "options is an Object with any of:\n"
+            "  minamount, maxamount  only outputs of at least/at most this amount\n"
+            "  count                 return at most this many outputs (default: all)\n"
+            "  cursor                \"\" for the first page, else the cursor the last page returned\n"
+            "With a cursor the result is {\"unspent\": [...], \"cursor\": next} in txid order.\n"
+            "The cursor is left out once there are no more outputs.");
 
-    RPCTypeCheck(params, list_of(int_type)(int_type)(array_type));
+    RPCTypeCheck(params, list_of(int_type)(int_type)(array_type)(obj_type));
 
     int nMinDepth = 1;
     if (params.size() > 0)
@@ -334,43 +576,86 @@ Value listunspent(const Array& params, bool fHelp)
         }
     }
 
+    int64_t nMinAmount = 0;
+    int64_t nMaxAmount = MAX_MONEY;
+    unsigned int nCount = 0;
+    bool fCursor = false;
+    COutPoint outCursor;
+    if (params.size() > 3)
+    {
+        const Object& options = params[3].get_obj();
+        const Value& minamount = find_value(options, "minamount");
+        if (minamount.type() != null_type)
+            nMinAmount = AmountFromValue(minamount);
+        const Value& maxamount = find_value(options, "maxamount");
+        if (maxamount.type() != null_type)
+            nMaxAmount = AmountFromValue(maxamount);
+        const Value& count = find_value(options, "count");
+        if (count.type() != null_type)
+        {
+            if (count.get_int() < 1)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "count must be positive");
+            nCount = count.get_int();
+        }
+        const Value& cursor = find_value(options, "cursor");
+        if (cursor.type() != null_type)
+        {
+            fCursor = true;
+            outCursor = ParseUnspentCursor(cursor.get_str());
+        }
+    }
+
     Array results;
     vector<COutput> vecOutputs;
-    pwalletMain->AvailableCoins(vecOutputs, false);
-    BOOST_FOREACH(const COutput& out, vecOutputs)
+    bool fMore = false;
+    if (!fCursor)
+        pwalletMain->AvailableCoins(vecOutputs, false);
+    for (;;)
     {
-        if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
-            continue;
+        // A page at a time, so a large wallet is never collected in one go
+        if (fCursor)
+            pwalletMain->AvailableCoinsAfter(vecOutputs, outCursor, nCount ? max(nCount - (unsigned int)results.size(), 100u) : 1000);
 
-        if(setAddress.size())
+        BOOST_FOREACH(const COutput& out, vecOutputs)
         {
-            CTxDestination address;
-            if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+            if (nCount && results.size() >= nCount)
+            {
+                fMore = true;
+                break;
+            }
+            outCursor = COutPoint(out.tx->GetHash(), out.i);
+
+            if (out.nDepth < nMinDepth || out.nDepth > nMaxDepth)
                 continue;
 
-            if (!setAddress.count(address))
+            int64_t nValue = out.tx->vout[out.i].nValue;
+            if (nValue < nMinAmount || nValue > nMaxAmount)
                 continue;
-        }
 
-        int64_t nValue = out.tx->vout[out.i].nValue;
-        const CScript& pk = out.tx->vout[out.i].scriptPubKey;
-        Object entry;
-        entry.push_back(Pair("txid", out.tx->GetHash().GetHex()));
-        entry.push_back(Pair("vout", out.i));
-        CTxDestination address;
-        if (ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
-        {
-            entry.push_back(Pair("address", cba(address).ToString()));
-            if (pwalletMain->mapAddressBook.count(address))
-                entry.push_back(Pair("account", pwalletMain->mapAddressBook[address]));
+            if(setAddress.size())
+            {
+                CTxDestination address;
+                if(!ExtractDestination(out.tx->vout[out.i].scriptPubKey, address))
+                    continue;
+
+                if (!setAddress.count(address))
+                    continue;
+            }
+
+            results.push_back(UnspentToJSON(out));
         }
-        entry.push_back(Pair("scriptPubKey", HexStr(pk.begin(), pk.end())));
-        entry.push_back(Pair("amount",ValueFromAmount(nValue)));
-        entry.push_back(Pair("confirmations",out.nDepth));
-        results.push_back(entry);
+        if (!fCursor || fMore || vecOutputs.empty())
+            break;
     }
 
-    return results;
+    if (!fCursor)
+        return results;
+
+    Object ret;
+    ret.push_back(Pair("unspent", results));
+    if (fMore)
+        ret.push_back(Pair("cursor", outCursor.hash.GetHex() + ":" + strprintf("%u", outCursor.n)));
+    return ret;
 }
 
 Value crawgen(const Array& params, bool fHelp)
@@ -419,18 +704,13 @@ Value crawgen(const Array& params, bool fHelp)
       cba address(s.name_);
       if(!address.IsValid())
       {
-        vector<AliasIndex> vtxPos;
+        CAliasRecord rec;
         string aliasStr = s.name_;
         std::transform(aliasStr.begin(), aliasStr.end(), aliasStr.begin(), ::tolower);
         vchType vchAlias = vchFromString(aliasStr);
-        if (ln1Db->lKey(vchAlias))
+        if (aliasRecord(*ln1Db, vchAlias, rec))
         {
-          if (!ln1Db->lGet (vchAlias, vtxPos))
-            return error("crawgen : failed to read from alias DB");
-          if (vtxPos.empty ())
-            return -1;
-
-          AliasIndex& txPos = vtxPos.back ();
+          AliasIndex& txPos = rec.index;
           if(txPos.nHeight + scaleMonitor() <= nBestHeight)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "extern alias");
   
@@ -535,18 +815,13 @@ Value createrawtransaction(const Array& params, bool fHelp)
       cba address(s.name_);
       if(!address.IsValid())
       {
-        vector<AliasIndex> vtxPos;
+        CAliasRecord rec;
         string aliasStr = s.name_;
         std::transform(aliasStr.begin(), aliasStr.end(), aliasStr.begin(), ::tolower);
         vchType vchAlias = vchFromString(aliasStr);
-        if (ln1Db->lKey (vchAlias))
+        if (aliasRecord(*ln1Db, vchAlias, rec))
         {
-          if (!ln1Db->lGet (vchAlias, vtxPos))
-            return error("aliasHeight() : failed to read from alias DB");
-          if (vtxPos.empty ())
-            return -1;
-
-          AliasIndex& txPos = vtxPos.back ();
+          AliasIndex& txPos = rec.index;
           if(txPos.nHeight + scaleMonitor() <= nBestHeight)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "extern alias");
           address.SetString(txPos.vAddress); 
@@ -780,7 +1055,8 @@ Value signrawtransaction(const Array& params, bool fHelp)
 
     bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
 
-    // Sign what we can:
+    // Sign what we can; the signatures added don't change the cached parts
+    CSignatureHashCache cache(mergedTx);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++)
     {
         CTxIn& txin = mergedTx.vin[i];
@@ -794,14 +1070,14 @@ Value signrawtransaction(const Array& params, bool fHelp)
         txin.scriptSig.clear();
         // Only sign SIGHASH_SINGLE if there's a corresponding output:
         if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType, &cache);
 
         // ... and merge in other signatures:
         BOOST_FOREACH(const CTransaction& txv, txVariants)
         {
             txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
         }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0))
+        if (!VerifyScript(txin.scriptSig, prevPubKey, mergedTx, i, STANDARD_SCRIPT_VERIFY_FLAGS, 0, &cache))
             fComplete = false;
     }
 
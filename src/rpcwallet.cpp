@@ -9,6 +9,7 @@
 #include "init.h"
 #include "base58.h"
 #include "dions.h"
+#include "blocksync.h"
 using namespace json_spirit;
 using namespace std;
 
@@ -88,31 +89,43 @@ Value getinfo(const Array& params, bool fHelp)
 
     proxyType proxy;
     GetProxy(NET_IPV4, proxy);
+    CChainTipSummaryRef ptip = GetChainTipSummary();
 
     Object obj, diff;
     obj.push_back(Pair("version",       FormatFullVersion()));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
+    CWalletBalances balances = pwalletMain->GetBalances();
     obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
-    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
-    obj.push_back(Pair("pending",       ValueFromAmount(pwalletMain->GetUnconfirmedBalance())));
-    obj.push_back(Pair("newmint",       ValueFromAmount(pwalletMain->GetNewMint())));
-    obj.push_back(Pair("stake",         ValueFromAmount(pwalletMain->GetStake())));
-    obj.push_back(Pair("blocks",        (int)nBestHeight));
-    obj.push_back(Pair("powblocks",     (int)GetPowHeight(pindexBest)));
-    obj.push_back(Pair("powblocksleft", LAST_POW_BLOCK - (int)GetPowHeight(pindexBest)));
+    obj.push_back(Pair("balance",       ValueFromAmount(balances.nBalance)));
+    obj.push_back(Pair("pending",       ValueFromAmount(balances.nUnconfirmed)));
+    obj.push_back(Pair("newmint",       ValueFromAmount(balances.nNewMint)));
+    obj.push_back(Pair("stake",         ValueFromAmount(balances.nStake)));
+    obj.push_back(Pair("blocks",        ptip->nHeight));
+    if (fHeadersFirst)
+    {
+        LOCK(cs_main);
+        obj.push_back(Pair("headers",   GetBestHeaderHeight()));
+    }
+    obj.push_back(Pair("powblocks",     ptip->nPowHeight));
+    obj.push_back(Pair("powblocksleft", LAST_POW_BLOCK - ptip->nPowHeight));
     obj.push_back(Pair("timeoffset",    (int64_t)GetTimeOffset()));
     //obj.push_back(Pair("moneysupply",   ValueFromAmount(pindexBest->nMoneySupply)));
     obj.push_back(Pair("connections",   (int)vNodes.size()));
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
     obj.push_back(Pair("ip",            addrSeenByPeer.ToStringIP()));
 
-    diff.push_back(Pair("proof-of-work",  GetDifficulty()));
-    diff.push_back(Pair("proof-of-stake", GetDifficulty(GetLastBlockIndex(pindexBest, true))));
+    diff.push_back(Pair("proof-of-work",  ptip->dDifficultyPoW));
+    diff.push_back(Pair("proof-of-stake", ptip->dDifficultyPoS));
     obj.push_back(Pair("difficulty",    diff));
 
     obj.push_back(Pair("testnet",       fTestNet));
-    obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
-    obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+    {
+        LOCK(pwalletMain->cs_wallet);
+        obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
+        obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+    }
+    if (pwalletMain->fScanningWallet)
+        obj.push_back(Pair("rescanprogress", (int)pwalletMain->nRescanProgress));
     obj.push_back(Pair("paytxfee",      ValueFromAmount(nTransactionFee)));
     obj.push_back(Pair("mininput",      ValueFromAmount(nMinimumInputValue)));
     if (pwalletMain->IsCrypted())
@@ -122,6 +135,35 @@ Value getinfo(const Array& params, bool fHelp)
     return obj;
 }
 
+Value getwalletinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getwalletinfo\n"
+            "Returns an object containing wallet state info, with the number of\n"
+            "wallet transactions and the bytes they take serialized (txbytes).");
+
+    Object obj;
+    obj.push_back(Pair("walletversion", pwalletMain->GetVersion()));
+    obj.push_back(Pair("balance",       ValueFromAmount(pwalletMain->GetBalance())));
+    obj.push_back(Pair("unconfirmed_balance", ValueFromAmount(pwalletMain->GetUnconfirmedBalance())));
+    obj.push_back(Pair("immature_balance", ValueFromAmount(pwalletMain->GetImmatureBalance())));
+
+    uint64_t nTxBytes = 0;
+    BOOST_FOREACH(const PAIRTYPE(const uint256, __wx__Tx)& item, pwalletMain->mapWallet)
+        nTxBytes += ::GetSerializeSize(item.second, SER_DISK, CLIENT_VERSION);
+    obj.push_back(Pair("txcount",       (int)pwalletMain->mapWallet.size()));
+    obj.push_back(Pair("txbytes",       (int64_t)nTxBytes));
+    obj.push_back(Pair("ismine_cache_hits",   (int64_t)pwalletMain->nIsMineCacheHits));
+    obj.push_back(Pair("ismine_cache_misses", (int64_t)pwalletMain->nIsMineCacheMisses));
+
+    obj.push_back(Pair("keypoololdest", (int64_t)pwalletMain->GetOldestKeyPoolTime()));
+    obj.push_back(Pair("keypoolsize",   (int)pwalletMain->GetKeyPoolSize()));
+    if (pwalletMain->IsCrypted())
+        obj.push_back(Pair("unlocked_until", (int64_t)nWalletUnlockTime / 1000));
+    return obj;
+}
+
 
 Value getnewpubkey(const Array& params, bool fHelp)
 {
@@ -616,64 +658,23 @@ Value addresstodion(const Array& params, bool fHelp)
     string alias;
 
 
-    Dbc* cursorp;
-    try 
+    vector<pair<vchType, vector<AliasIndex> > > vAliases;
+    ln1Db->lGetAll(vAliases);
+    for (unsigned int n = 0; n < vAliases.size(); n++)
     {
-      cursorp = ln1Db->GetCursor(); 
+      const vector<AliasIndex>& vtxPos = vAliases[n].second;
+      if (vtxPos.empty())
+        continue;
 
-      Dbt key, data;
-      int ret;
-
-      while ((ret = cursorp->get(&key, &data, DB_NEXT)) == 0) 
+      AliasIndex i = vtxPos.back();
+      string i_address = (i.vAddress).c_str();
+      if(i_address == address)
       {
-        printf("  key \n");
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write((char*)key.get_data(), key.get_size());
-
-        string k1;
-        ssKey >> k1;
-        if(k1 == "alias_")
-        {
-          printf("  k1 %s\n", k1.c_str());
-          vchType k2;
-          ssKey >> k2; 
-          string a = stringFromVch(k2);
-          printf("  k2 %s\n", a.c_str());
-
-          vector<AliasIndex> vtxPos;
-          CDataStream ssValue((char*)data.get_data(), (char*)data.get_data() + data.get_size(), SER_DISK, CLIENT_VERSION);
-          ssValue >> vtxPos;
-
-          AliasIndex i = vtxPos.back();
-          string i_address = (i.vAddress).c_str();
-          printf("  vAddress %s\n", i_address.c_str());
-          if(i_address == address)
-          {
-            alias = a;
-            break;
-          }
-        }
-      }
-      if (ret != DB_NOTFOUND) 
-      {
-        // ret should be DB_NOTFOUND upon exiting the loop.
-        // Dbc::get() will by default throw an exception if any
-        // significant errors occur, so by default this if block
-        // can never be reached. 
+        alias = stringFromVch(vAliases[n].first);
+        break;
       }
-    } 
-    catch(DbException &e) 
-    {
-      //ln1Db.err(e.get_errno(), "Error!");
-    } 
-    catch(std::exception &e) 
-    {
-      //ln1Db.errx("Error! %s", e.what());
     }
 
-    if (cursorp != NULL) 
-      cursorp->close(); 
-
     Array oRes;
     if(alias != "")
     {
@@ -696,16 +697,11 @@ Value sendtodion(const Array& params, bool fHelp)
     std::transform(alias.begin(), alias.end(), alias.begin(), ::tolower);
     string address = "address not found";
 
-    vector<AliasIndex> vtxPos;
+    CAliasRecord rec;
     vchType vchAlias = vchFromString(alias);
-    if(ln1Db->lKey(vchAlias))
+    if(aliasRecord(*ln1Db, vchAlias, rec))
     {
-      if(!ln1Db->lGet(vchAlias, vtxPos))
-        return error("aliasHeight() : failed to read from name DB");
-      if(vtxPos.empty())
-        return -1;
-
-      AliasIndex& txPos = vtxPos.back();
+      AliasIndex& txPos = rec.index;
           if(txPos.nHeight + scaleMonitor() <= nBestHeight)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "extern alias");
       address = txPos.vAddress;
@@ -730,17 +726,11 @@ Value sendtoaddress(const Array& params, bool fHelp)
     cba address(addrStr);
     if(!address.IsValid())
     {
-      vector<AliasIndex> vtxPos;
+      CAliasRecord rec;
       vchType vchAlias = vchFromString(addrStr);
-      if (ln1Db->lKey (vchAlias))
+      if (aliasRecord(*ln1Db, vchAlias, rec))
       {
-        printf("  name exists\n");
-        if (!ln1Db->lGet (vchAlias, vtxPos))
-          return error("aliasHeight() : failed to read from name DB");
-        if (vtxPos.empty ())
-          return -1;
-
-        AliasIndex& txPos = vtxPos.back ();
+        AliasIndex& txPos = rec.index;
           if(txPos.nHeight + scaleMonitor() <= nBestHeight)
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "extern alias");
         address.SetString(txPos.vAddress); 
@@ -886,11 +876,11 @@ Value verifymessage(const Array& params, bool fHelp)
     ss << strMessageMagic;
     ss << strMessage;
 
-    CKey key;
-    if (!key.SetCompactSignature(Hash(ss.begin(), ss.end()), vchSig))
+    CKeyID keyIDSigner;
+    if (!RecoverCompactKeyID(Hash(ss.begin(), ss.end()), vchSig, keyIDSigner))
         return false;
 
-    return (key.GetPubKey().GetID() == keyID);
+    return (keyIDSigner == keyID);
 }
 
 Value xtu_url__(const string& s)
@@ -930,18 +920,7 @@ Value xtu_url__(const string& s)
     int nMinDepth = 1;
 
     // Tally
-    int64_t nAmount = 0;
-    for (map<uint256, __wx__Tx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const __wx__Tx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int64_t nAmount = pwalletMain->GetReceivedByDestination(address.Get(), nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -990,18 +969,7 @@ Value xtu_url(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64_t nAmount = 0;
-    for (map<uint256, __wx__Tx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const __wx__Tx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int64_t nAmount = pwalletMain->GetReceivedByDestination(address.Get(), nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -1028,18 +996,7 @@ Value getreceivedbyaddress(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64_t nAmount = 0;
-    for (map<uint256, __wx__Tx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const __wx__Tx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int64_t nAmount = pwalletMain->GetReceivedByDestination(address.Get(), nMinDepth);
 
     return  ValueFromAmount(nAmount);
 }
@@ -1066,18 +1023,7 @@ Value gra(const Array& params, bool fHelp)
         nMinDepth = params[1].get_int();
 
     // Tally
-    int64_t nAmount = 0;
-    for (map<uint256, __wx__Tx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const __wx__Tx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-            if (txout.scriptPubKey == scriptPubKey)
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-    }
+    int64_t nAmount = pwalletMain->GetReceivedByDestination(address.Get(), nMinDepth);
 
     Array oRes;
     oRes.push_back(params[0]);
@@ -1117,20 +1063,9 @@ Value getreceivedbyaccount(const Array& params, bool fHelp)
 
     // Tally
     int64_t nAmount = 0;
-    for (map<uint256, __wx__Tx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
-    {
-        const __wx__Tx& wtx = (*it).second;
-        if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
-            continue;
-
-        BOOST_FOREACH(const CTxOut& txout, wtx.vout)
-        {
-            CTxDestination address;
-            if (ExtractDestination(txout.scriptPubKey, address) && IsMine(*pwalletMain, address) && setAddress.count(address))
-                if (wtx.GetDepthInMainChain() >= nMinDepth)
-                    nAmount += txout.nValue;
-        }
-    }
+    BOOST_FOREACH(const CTxDestination& address, setAddress)
+        if (IsMine(*pwalletMain, address))
+            nAmount += pwalletMain->GetReceivedByDestination(address, nMinDepth);
 
     return (double)nAmount / (double)COIN;
 }
@@ -1187,7 +1122,9 @@ Value getbalance(const Array& params, bool fHelp)
             "If [account] is specified, returns the balance in the account.");
 
     if (params.size() == 0)
-        return  ValueFromAmount(pwalletMain->GetBalance());
+        return  ValueFromAmount(pwalletMain->GetBalances().nBalance);
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
 
     int nMinDepth = 1;
     if (params.size() > 1)
@@ -1265,7 +1202,11 @@ Value movecmd(const Array& params, bool fHelp)
     debit.nTime = nNow;
     debit.strOtherAccount = strTo;
     debit.strComment = strComment;
-    walletdb.WriteAccountingEntry(debit);
+    if (!pwalletMain->AddAccountingEntry(debit, walletdb))
+    {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
 
     // Credit
     CAccountingEntry credit;
@@ -1275,7 +1216,11 @@ Value movecmd(const Array& params, bool fHelp)
     credit.nTime = nNow;
     credit.strOtherAccount = strFrom;
     credit.strComment = strComment;
-    walletdb.WriteAccountingEntry(credit);
+    if (!pwalletMain->AddAccountingEntry(credit, walletdb))
+    {
+        walletdb.TxnAbort();
+        throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
+    }
 
     if (!walletdb.TxnCommit())
         throw JSONRPCError(RPC_DATABASE_ERROR, "database error");
@@ -1399,6 +1344,105 @@ Value sendmany(const Array& params, bool fHelp)
     return wtx.GetHash().GetHex();
 }
 
+Value sendbatch(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 4)
+        throw runtime_error(
+            "sendbatch <fromaccount> {address:amount,...} [minconf=1] [comment]\n"
+            "Pays the recipients like sendmany, splitting them over as many\n"
+            "transactions as it takes to keep each within the standard size.\n"
+            "Returns the ids of the transactions sent and the total fee."
+            + HelpRequiringPassphrase());
+
+    string strAccount = AccountFromValue(params[0]);
+    Object sendTo = params[1].get_obj();
+    int nMinDepth = 1;
+    if (params.size() > 2)
+        nMinDepth = params[2].get_int();
+    string strComment;
+    if (params.size() > 3 && params[3].type() != null_type)
+        strComment = params[3].get_str();
+
+    set<cba> setAddress;
+    vector<pair<CScript, int64_t> > vecSend;
+
+    int64_t totalAmount = 0;
+    BOOST_FOREACH(const Pair& s, sendTo)
+    {
+        cba address(s.name_);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, string("Invalid I/OCoin address: ")+s.name_);
+
+        if (setAddress.count(address))
+            throw JSONRPCError(RPC_INVALID_PARAMETER, string("Invalid parameter, duplicated address: ")+s.name_);
+        setAddress.insert(address);
+
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(address.Get());
+        int64_t nAmount = AmountFromValue(s.value_);
+
+        totalAmount += nAmount;
+
+        vecSend.push_back(make_pair(scriptPubKey, nAmount));
+    }
+    if (vecSend.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, no recipients");
+
+    EnsureWalletIsUnlocked();
+
+    // Check funds
+    int64_t nBalance = GetAccountBalance(strAccount, nMinDepth);
+    if (totalAmount > nBalance)
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Account has insufficient funds");
+
+    // Send the recipients in runs, halving a run that doesn't fit in one
+    // transaction. Sizing happens before signing, so a run that is too big
+    // costs no signatures.
+    Array txids;
+    int64_t nFeeTotal = 0;
+    unsigned int nPos = 0, nRun = vecSend.size();
+    while (nPos < vecSend.size())
+    {
+        nRun = min(nRun, (unsigned int)vecSend.size() - nPos);
+        vector<pair<CScript, int64_t> > vecRun(vecSend.begin() + nPos, vecSend.begin() + nPos + nRun);
+        int64_t nRunAmount = 0;
+        BOOST_FOREACH(const PAIRTYPE(CScript, int64_t)& s, vecRun)
+            nRunAmount += s.second;
+
+        __wx__Tx wtx;
+        wtx.strFromAccount = strAccount;
+        if (!strComment.empty())
+            wtx.mapValue["comment"] = strComment;
+
+        CReserveKey keyChange(pwalletMain);
+        int64_t nFeeRequired = 0;
+        if (!pwalletMain->CreateTransaction(vecRun, wtx, keyChange, nFeeRequired, ""))
+        {
+            bool fFunds = nRunAmount + nFeeRequired <= pwalletMain->GetBalance();
+            if (fFunds && nRun > 1)
+            {
+                nRun = (nRun + 1) / 2;
+                continue;
+            }
+            string strError = fFunds ? "Transaction creation failed" : "Insufficient funds";
+            if (!txids.empty())
+                strError += strprintf(" after sending %"PRIszu" of %"PRIszu" recipients", (size_t)nPos, vecSend.size());
+            throw JSONRPCError(fFunds ? RPC_WALLET_ERROR : RPC_WALLET_INSUFFICIENT_FUNDS, strError);
+        }
+        if (!pwalletMain->CommitTransaction(wtx, keyChange))
+            throw JSONRPCError(RPC_WALLET_ERROR, "Transaction commit failed");
+
+        txids.push_back(wtx.GetHash().GetHex());
+        nFeeTotal += nFeeRequired;
+        nPos += nRun;
+    }
+
+    Object result;
+    result.push_back(Pair("txids", txids));
+    result.push_back(Pair("fee", ValueFromAmount(nFeeTotal)));
+    return result;
+}
+
 Value addmultisigaddress(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -1754,11 +1798,9 @@ Value listtransactions__(const Array& params, bool fHelp)
 
     Array ret;
 
-    std::list<CAccountingEntry> acentries;
-    __wx__::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
-
     // iterate backwards until we have nCount items to return:
-    for (__wx__::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    const __wx__::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    for (__wx__::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         __wx__Tx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1789,10 +1831,14 @@ Value listtransactions__(const Array& params, bool fHelp)
 }
 Value listtransactions(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() > 3)
+    if (fHelp || params.size() > 4)
         throw runtime_error(
-            "listtransactions [account] [count=10] [from=0]\n"
-            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].");
+            "listtransactions [account] [count=10] [from=0] [cursor]\n"
+            "Returns up to [count] most recent transactions skipping the first [from] transactions for account [account].\n"
+            "With [cursor], \"\" for the newest page and afterwards the cursor the last page returned,\n"
+            "[from] counts from the cursor and the result is {\"transactions\": [...], \"cursor\": next}.\n"
+            "A page ends on a whole wallet transaction, so it can hold a few more than [count] entries.\n"
+            "The cursor is left out once there are no older transactions.");
 
     string strAccount = "*";
     if (params.size() > 0)
@@ -1809,13 +1855,23 @@ Value listtransactions(const Array& params, bool fHelp)
     if (nFrom < 0)
         throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative from");
 
-    Array ret;
+    // The cursor is the order position of the oldest item of the last page
+    bool fCursor = params.size() > 3;
+    const __wx__::TxItems& txOrdered = pwalletMain->wtxOrdered;
+    __wx__::TxItems::const_reverse_iterator it = txOrdered.rbegin();
+    if (fCursor && params[3].get_str() != "")
+    {
+        const string& strCursor = params[3].get_str();
+        if (strCursor.find_first_not_of("-0123456789") != string::npos)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor: " + strCursor);
+        it = __wx__::TxItems::const_reverse_iterator(txOrdered.lower_bound(atoi64(strCursor)));
+    }
 
-    std::list<CAccountingEntry> acentries;
-    __wx__::TxItems txOrdered = pwalletMain->OrderedTxItems(acentries, strAccount);
+    Array ret;
+    int64_t nCursor = 0;
 
     // iterate backwards until we have nCount items to return:
-    for (__wx__::TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+    for (; it != txOrdered.rend(); ++it)
     {
         __wx__Tx *const pwtx = (*it).second.first;
         if (pwtx != 0)
@@ -1823,14 +1879,16 @@ Value listtransactions(const Array& params, bool fHelp)
         CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
+        nCursor = (*it).first;
 
         if ((int)ret.size() >= (nCount+nFrom)) break;
     }
     // ret is newest to oldest
+    bool fMore = it != txOrdered.rend() && ++it != txOrdered.rend();
 
     if (nFrom > (int)ret.size())
         nFrom = ret.size();
-    if ((nFrom + nCount) > (int)ret.size())
+    if ((nFrom + nCount) > (int)ret.size() || fCursor)
         nCount = ret.size() - nFrom;
     Array::iterator first = ret.begin();
     std::advance(first, nFrom);
@@ -1842,6 +1900,28 @@ Value listtransactions(const Array& params, bool fHelp)
 
     std::reverse(ret.begin(), ret.end()); // Return oldest to newest
 
+    if (!fCursor)
+        return ret;
+
+    Object result;
+    result.push_back(Pair("transactions", ret));
+    if (fMore)
+        result.push_back(Pair("cursor", i64tostr(nCursor)));
+    return result;
+}
+
+Value listwallets(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "listwallets\n"
+            "Returns the file names of the loaded wallets.\n"
+            "Each is reached over RPC at /wallet/<file>.");
+
+    Array ret;
+    BOOST_FOREACH(const PAIRTYPE(string, __wx__*)& item, mapWallets)
+        ret.push_back(item.first);
+
     return ret;
 }
 
@@ -1888,9 +1968,7 @@ Value listaccounts(const Array& params, bool fHelp)
         }
     }
 
-    list<CAccountingEntry> acentries;
-    __wx__DB(pwalletMain->strWalletFile).ListAccountCreditDebit("*", acentries);
-    BOOST_FOREACH(const CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CAccountingEntry& entry, pwalletMain->laccentries)
         mapAccountBalances[entry.strAccount] += entry.nCreditDebit;
 
     Object ret;
@@ -1948,10 +2026,7 @@ Value listsinceblock(const Array& params, bool fHelp)
     {
         int target_height = pindexBest->nHeight + 1 - target_confirms;
 
-        CBlockIndex *block;
-        for (block = pindexBest;
-             block && block->nHeight > target_height;
-             block = block->pprev)  { }
+        CBlockIndex *block = pindexBest->GetAncestor(target_height);
 
         lastblock = block ? block->GetBlockHash() : 0;
     }
@@ -2008,7 +2083,7 @@ Value gettransaction(const Array& params, bool fHelp)
             else
             {
                 entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
                 if (mi != mapBlockIndex.end() && (*mi).second)
                 {
                     CBlockIndex* pindex = (*mi).second;
@@ -2151,7 +2226,7 @@ Value walletpassphrase(const Array& params, bool fHelp)
             "walletpassphrase <passphrase> <timeout>\n"
             "Stores the wallet decryption key in memory for <timeout> seconds.");
 
-    NewThread(ThreadTopUpKeyPool, NULL);
+    NewThread(ThreadTopUpKeyPool, NULL, THREADPOOL_BACKGROUND);
     int64_t* pnSleepTime = new int64_t(params[1].get_int64());
     NewThread(ThreadCleanWalletPassphrase, pnSleepTime);
 
@@ -2409,6 +2484,34 @@ Value reservebalance(const Array& params, bool fHelp)
     return result;
 }
 
+Value getcompactioninfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcompactioninfo\n"
+            "Returns the progress of merging small outputs (-compactwallet).");
+
+    unsigned int nCount;
+    int64_t nValue;
+    pwalletMain->GetCompactableOutputs(nCount, nValue);
+
+    Object result;
+    LOCK(walletCompactionStatus.cs);
+    result.push_back(Pair("enabled", walletCompactionStatus.fEnabled));
+    result.push_back(Pair("smalloutputs", (int)nCount));
+    result.push_back(Pair("smallvalue", ValueFromAmount(nValue)));
+    result.push_back(Pair("transactions", walletCompactionStatus.nTransactions));
+    result.push_back(Pair("outputsmerged", walletCompactionStatus.nOutputsMerged));
+    result.push_back(Pair("feespaid", ValueFromAmount(walletCompactionStatus.nFeesPaid)));
+    result.push_back(Pair("feeslastday", ValueFromAmount(walletCompactionStatus.nFeesLastDay)));
+    result.push_back(Pair("feebudget", ValueFromAmount(walletCompactionStatus.nFeeBudget)));
+    result.push_back(Pair("maxfee", ValueFromAmount(walletCompactionStatus.nMaxFee)));
+    result.push_back(Pair("interval", walletCompactionStatus.nInterval));
+    result.push_back(Pair("lasttime", walletCompactionStatus.nLastTime));
+    result.push_back(Pair("lastresult", walletCompactionStatus.strLastResult));
+    return result;
+}
+
 
 // ppcoin: check wallet integrity
 Value checkwallet(const Array& params, bool fHelp)
@@ -4,40 +4,26 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
 
 #include "script.h"
 #include "keystore.h"
-#include "bignum.h"
 #include "key.h"
 #include "main.h"
+#include "memusage.h"
+#include "metrics.h"
 #include "sync.h"
 #include "util.h"
 #include "dions.h"
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType,
+              const CSignatureHashCache* pcache);
 
 static const valtype vchFalse(0);
 static const valtype vchZero(0);
 static const valtype vchTrue(1, 1);
-static const CBigNum bnZero(0);
-static const CBigNum bnOne(1);
-static const CBigNum bnFalse(0);
-static const CBigNum bnTrue(1);
-static const size_t nMaxNumSize = 4;
-
-
-CBigNum CastToBigNum(const valtype& vch)
-{
-    if (vch.size() > nMaxNumSize)
-        throw runtime_error("CastToBigNum() : overflow");
-    // Get rid of extra leading zeros
-    return CBigNum(CBigNum(vch).getvch());
-}
 
 bool CastToBool(const valtype& vch)
 {
@@ -322,15 +308,17 @@ static bool IsCanonicalSignature(const valtype &vchSig) {
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType)
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType,
+                const CSignatureHashCache* pcache)
 {
-    CAutoBN_CTX pctx;
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
     valtype vchPushValue;
     vector<bool> vfExec;
+    // Number of false entries in vfExec, so fExec needs no scan per opcode
+    int nExecFalse = 0;
     vector<valtype> altstack;
     if (script.size() > 1000000)
       return false;
@@ -341,7 +329,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
     {
         while (pc < pend)
         {
-            bool fExec = !count(vfExec.begin(), vfExec.end(), false);
+            bool fExec = (nExecFalse == 0);
 
             //
             // Read instruction
@@ -397,7 +385,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_16:
                 {
                     // ( -- value)
-                    CBigNum bn((int)opcode - (int)(OP_1 - 1));
+                    CScriptNum bn((int)opcode - (int)(OP_1 - 1));
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -497,6 +485,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         popstack(stack);
                     }
                     vfExec.push_back(fValue);
+                    if (!fValue)
+                        nExecFalse++;
                 }
                 break;
 
@@ -504,6 +494,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    nExecFalse += vfExec.back() ? 1 : -1;
                     vfExec.back() = !vfExec.back();
                 }
                 break;
@@ -512,6 +503,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 {
                     if (vfExec.empty())
                         return false;
+                    if (!vfExec.back())
+                        nExecFalse--;
                     vfExec.pop_back();
                 }
                 break;
@@ -643,7 +636,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 case OP_DEPTH:
                 {
                     // -- stacksize
-                    CBigNum bn(stack.size());
+                    CScriptNum bn(stack.size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -693,7 +686,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (xn ... x2 x1 x0 n - ... x2 x1 x0 xn)
                     if (stack.size() < 2)
                         return false;
-                    int n = CastToBigNum(stacktop(-1)).getint();
+                    int n = CScriptNum(stacktop(-1), false).getint();
                     popstack(stack);
                     if (n < 0 || n >= (int)stack.size())
                         return false;
@@ -759,8 +752,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 3)
                         return false;
                     valtype& vch = stacktop(-3);
-                    int nBegin = CastToBigNum(stacktop(-2)).getint();
-                    int nEnd = nBegin + CastToBigNum(stacktop(-1)).getint();
+                    int nBegin = CScriptNum(stacktop(-2), false).getint();
+                    int nEnd = nBegin + CScriptNum(stacktop(-1), false).getint();
                     if (nBegin < 0 || nEnd < nBegin)
                         return false;
                     if (nBegin > (int)vch.size())
@@ -781,7 +774,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if (stack.size() < 2)
                         return false;
                     valtype& vch = stacktop(-2);
-                    int nSize = CastToBigNum(stacktop(-1)).getint();
+                    int nSize = CScriptNum(stacktop(-1), false).getint();
                     if (nSize < 0)
                         return false;
                     if (nSize > (int)vch.size())
@@ -799,7 +792,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- in size)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn(stacktop(-1).size());
+                    CScriptNum bn(stacktop(-1).size());
                     stack.push_back(bn.getvch());
                 }
                 break;
@@ -887,8 +880,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                 //
                 case OP_1ADD:
                 case OP_1SUB:
-                case OP_2MUL:
-                case OP_2DIV:
                 case OP_NEGATE:
                 case OP_ABS:
                 case OP_NOT:
@@ -897,17 +888,15 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (in -- out)
                     if (stack.size() < 1)
                         return false;
-                    CBigNum bn = CastToBigNum(stacktop(-1));
+                    CScriptNum bn(stacktop(-1), false);
                     switch (opcode)
                     {
-                    case OP_1ADD:       bn += bnOne; break;
-                    case OP_1SUB:       bn -= bnOne; break;
-                    case OP_2MUL:       bn <<= 1; break;
-                    case OP_2DIV:       bn >>= 1; break;
+                    case OP_1ADD:       bn += 1; break;
+                    case OP_1SUB:       bn -= 1; break;
                     case OP_NEGATE:     bn = -bn; break;
-                    case OP_ABS:        if (bn < bnZero) bn = -bn; break;
-                    case OP_NOT:        bn = (bn == bnZero); break;
-                    case OP_0NOTEQUAL:  bn = (bn != bnZero); break;
+                    case OP_ABS:        if (bn < 0) bn = -bn; break;
+                    case OP_NOT:        bn = (bn == 0); break;
+                    case OP_0NOTEQUAL:  bn = (bn != 0); break;
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
@@ -917,11 +906,6 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                 case OP_ADD:
                 case OP_SUB:
-                case OP_MUL:
-                case OP_DIV:
-                case OP_MOD:
-                case OP_LSHIFT:
-                case OP_RSHIFT:
                 case OP_BOOLAND:
                 case OP_BOOLOR:
                 case OP_NUMEQUAL:
@@ -937,9 +921,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x1 x2 -- out)
                     if (stack.size() < 2)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-2));
-                    CBigNum bn2 = CastToBigNum(stacktop(-1));
-                    CBigNum bn;
+                    CScriptNum bn1(stacktop(-2), false);
+                    CScriptNum bn2(stacktop(-1), false);
+                    CScriptNum bn(0);
                     switch (opcode)
                     {
                     case OP_ADD:
@@ -950,35 +934,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                         bn = bn1 - bn2;
                         break;
 
-                    case OP_MUL:
-                        if (!BN_mul(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_DIV:
-                        if (!BN_div(&bn, NULL, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_MOD:
-                        if (!BN_mod(&bn, &bn1, &bn2, pctx))
-                            return false;
-                        break;
-
-                    case OP_LSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 << bn2.getulong();
-                        break;
-
-                    case OP_RSHIFT:
-                        if (bn2 < bnZero || bn2 > CBigNum(2048))
-                            return false;
-                        bn = bn1 >> bn2.getulong();
-                        break;
-
-                    case OP_BOOLAND:             bn = (bn1 != bnZero && bn2 != bnZero); break;
-                    case OP_BOOLOR:              bn = (bn1 != bnZero || bn2 != bnZero); break;
+                    case OP_BOOLAND:             bn = (bn1 != 0 && bn2 != 0); break;
+                    case OP_BOOLOR:              bn = (bn1 != 0 || bn2 != 0); break;
                     case OP_NUMEQUAL:            bn = (bn1 == bn2); break;
                     case OP_NUMEQUALVERIFY:      bn = (bn1 == bn2); break;
                     case OP_NUMNOTEQUAL:         bn = (bn1 != bn2); break;
@@ -1009,9 +966,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     // (x min max -- out)
                     if (stack.size() < 3)
                         return false;
-                    CBigNum bn1 = CastToBigNum(stacktop(-3));
-                    CBigNum bn2 = CastToBigNum(stacktop(-2));
-                    CBigNum bn3 = CastToBigNum(stacktop(-1));
+                    CScriptNum bn1(stacktop(-3), false);
+                    CScriptNum bn2(stacktop(-2), false);
+                    CScriptNum bn3(stacktop(-1), false);
                     bool fValue = (bn2 <= bn1 && bn1 < bn3);
                     popstack(stack);
                     popstack(stack);
@@ -1080,7 +1037,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     scriptCode.FindAndDelete(CScript(vchSig));
 
                     bool fSuccess = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                        CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pcache);
 
                     popstack(stack);
                     popstack(stack);
@@ -1104,7 +1061,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nKeysCount = CastToBigNum(stacktop(-i)).getint();
+                    int nKeysCount = CScriptNum(stacktop(-i), false).getint();
                     if (nKeysCount < 0 || nKeysCount > 20)
                         return false;
                     nOpCount += nKeysCount;
@@ -1115,7 +1072,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
                     if ((int)stack.size() < i)
                         return false;
 
-                    int nSigsCount = CastToBigNum(stacktop(-i)).getint();
+                    int nSigsCount = CScriptNum(stacktop(-i), false).getint();
                     if (nSigsCount < 0 || nSigsCount > nKeysCount)
                         return false;
                     int isig = ++i;
@@ -1141,7 +1098,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
                         // Check signature
                         bool fOk = IsCanonicalSignature(vchSig) && IsCanonicalPubKey(vchPubKey) &&
-                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType);
+                            CheckSig(vchSig, vchPubKey, scriptCode, txTo, nIn, nHashType, pcache);
 
                         if (fOk)
                         {
@@ -1200,66 +1157,156 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, co
 
 
 
-uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+/** Writes txTo as SignatureHash used to see it after blanking a copy:
+ *  other inputs' scripts empty, input nIn carrying scriptCode, and the
+ *  inputs and outputs nHashType leaves out dropped or nulled. The
+ *  transaction itself is never copied. */
+class CTransactionSignatureSerializer
 {
-    if (nIn >= txTo.vin.size())
+private:
+    const CTransaction& txTo;
+    const CScript& scriptCode;
+    unsigned int nIn;
+    bool fAnyoneCanPay;
+    bool fHashSingle;
+    bool fHashNone;
+
+public:
+    CTransactionSignatureSerializer(const CTransaction& txToIn, const CScript& scriptCodeIn, unsigned int nInIn, int nHashTypeIn) :
+        txTo(txToIn), scriptCode(scriptCodeIn), nIn(nInIn),
+        fAnyoneCanPay(!!(nHashTypeIn & SIGHASH_ANYONECANPAY)),
+        fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
+        fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
+
+    template<typename S>
+    void SerializeInput(S& s, unsigned int nInput, int nType, int nVersion) const
     {
-        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
-        return 1;
+        // With ANYONECANPAY only input nIn is left
+        if (fAnyoneCanPay)
+            nInput = nIn;
+        const CTxIn& txin = txTo.vin[nInput];
+        ::Serialize(s, txin.prevout, nType, nVersion);
+        if (nInput == nIn)
+            ::Serialize(s, scriptCode, nType, nVersion);
+        else
+            ::Serialize(s, CScript(), nType, nVersion);
+        // Under NONE and SINGLE the others may update at will
+        if (nInput != nIn && (fHashSingle || fHashNone))
+            ::Serialize(s, (unsigned int)0, nType, nVersion);
+        else
+            ::Serialize(s, txin.nSequence, nType, nVersion);
     }
-    CTransaction txTmp(txTo);
-
-    // In case concatenating two scripts ends up with two codeseparators,
-    // or an extra one at the end, this prevents all those possible incompatibilities.
-    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
 
-    // Blank out other inputs' signatures
-    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-        txTmp.vin[i].scriptSig = CScript();
-    txTmp.vin[nIn].scriptSig = scriptCode;
-
-    // Blank out some of the outputs
-    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    template<typename S>
+    void SerializeOutput(S& s, unsigned int nOutput, int nType, int nVersion) const
     {
-        // Wildcard payee
-        txTmp.vout.clear();
-
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+        if (fHashSingle && nOutput != nIn)
+            ::Serialize(s, CTxOut(), nType, nVersion);
+        else
+            ::Serialize(s, txTo.vout[nOutput], nType, nVersion);
     }
-    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+
+    template<typename S>
+    void Serialize(S& s, int nType, int nVersion) const
     {
-        // Only lock-in the txout payee at same index as txin
-        unsigned int nOut = nIn;
-        if (nOut >= txTmp.vout.size())
-        {
-            printf("ERROR: SignatureHash() : nOut=%d out of range\n", nOut);
-            return 1;
-        }
-        txTmp.vout.resize(nOut+1);
-        for (unsigned int i = 0; i < nOut; i++)
-            txTmp.vout[i].SetNull();
+        ::Serialize(s, txTo.nVersion, nType, nVersion);
+        nVersion = txTo.nVersion;
+        ::Serialize(s, txTo.nTime, nType, nVersion);
+        unsigned int nInputs = fAnyoneCanPay ? 1 : txTo.vin.size();
+        WriteCompactSize(s, nInputs);
+        for (unsigned int nInput = 0; nInput < nInputs; nInput++)
+            SerializeInput(s, nInput, nType, nVersion);
+        // Wildcard payee under NONE, only the one at nIn locked in under SINGLE
+        unsigned int nOutputs = fHashNone ? 0 : (fHashSingle ? nIn+1 : txTo.vout.size());
+        WriteCompactSize(s, nOutputs);
+        for (unsigned int nOutput = 0; nOutput < nOutputs; nOutput++)
+            SerializeOutput(s, nOutput, nType, nVersion);
+        ::Serialize(s, txTo.nLockTime, nType, nVersion);
+        if (txTo.nVersion >= CTransaction::VERSION_WITH_INFO)
+            ::Serialize(s, txTo.strTxInfo, nType, nVersion);
+    }
+};
 
-        // Let the others update at will
-        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
-            if (i != nIn)
-                txTmp.vin[i].nSequence = 0;
+CSignatureHashCache::CSignatureHashCache(const CTransaction& txToIn) :
+    txTo(txToIn), ssAnyoneCanPay(SER_GETHASH, 0)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ss.nVersion = txTo.nVersion;
+    ss << txTo.nTime;
+    ssAnyoneCanPay = ss;
+    WriteCompactSize(ss, txTo.vin.size());
+    WriteCompactSize(ssAnyoneCanPay, 1);
+
+    CDataStream ssInputs(SER_GETHASH, txTo.nVersion);
+    vMidstate.reserve(txTo.vin.size());
+    vInputEnd.reserve(txTo.vin.size());
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+    {
+        vMidstate.push_back(ss);
+        unsigned int nBegin = ssInputs.size();
+        ssInputs << txin.prevout << CScript() << txin.nSequence;
+        ss.write(&ssInputs[nBegin], ssInputs.size() - nBegin);
+        vInputEnd.push_back(ssInputs.size());
     }
+    vchInputs.assign(ssInputs.begin(), ssInputs.end());
 
-    // Blank out other inputs completely, not recommended for open transactions
-    if (nHashType & SIGHASH_ANYONECANPAY)
+    CDataStream ssOutputs(SER_GETHASH, txTo.nVersion);
+    ssOutputs << txTo.vout << txTo.nLockTime;
+    if (txTo.nVersion >= CTransaction::VERSION_WITH_INFO)
+        ssOutputs << txTo.strTxInfo;
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+bool CSignatureHashCache::Get(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const
+{
+    if (nIn >= vMidstate.size() || (nHashType & 0x1f) == SIGHASH_NONE || (nHashType & 0x1f) == SIGHASH_SINGLE)
+        return false;
+
+    // Everything before input nIn is already in the midstate
+    bool fAnyoneCanPay = !!(nHashType & SIGHASH_ANYONECANPAY);
+    CHashWriter ss(fAnyoneCanPay ? ssAnyoneCanPay : vMidstate[nIn]);
+    const CTxIn& txin = txTo.vin[nIn];
+    ss << txin.prevout << scriptCode << txin.nSequence;
+    if (!fAnyoneCanPay && vInputEnd[nIn] < vchInputs.size())
+        ss.write(&vchInputs[vInputEnd[nIn]], vchInputs.size() - vInputEnd[nIn]);
+    ss.write(&vchOutputs[0], vchOutputs.size());
+    ss << nHashType;
+    hashRet = ss.GetHash();
+    return true;
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    return SignatureHash(scriptCode, txTo, nIn, nHashType, NULL);
+}
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache)
+{
+    if (nIn >= txTo.vin.size())
+    {
+        printf("ERROR: SignatureHash() : nIn=%d out of range\n", nIn);
+        return 1;
+    }
+    if ((nHashType & 0x1f) == SIGHASH_SINGLE && nIn >= txTo.vout.size())
     {
-        txTmp.vin[0] = txTmp.vin[nIn];
-        txTmp.vin.resize(1);
+        printf("ERROR: SignatureHash() : nOut=%d out of range\n", nIn);
+        return 1;
     }
 
-    // Serialize and hash
-    CDataStream ss(SER_GETHASH, 0);
-    ss.reserve(10000);
+    // In case concatenating two scripts ends up with two codeseparators,
+    // or an extra one at the end, this prevents all those possible incompatibilities.
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+
+    uint256 hash;
+    if (pcache && pcache->Get(scriptCode, nIn, nHashType, hash))
+        return hash;
+
+    // Serialize straight into the hash
+    CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
+    CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
-    return Hash(ss.begin(), ss.end());
+    return ss.GetHash();
 }
 
 
@@ -1267,62 +1314,203 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
+/** Signatures known to be valid, each as a salted hash of its (sighash,
+ *  signature, public key) in a fixed table of 32-byte entries. An entry
+ *  may live in any of 8 slots picked by its own bits (cuckoo hashing);
+ *  inserting into 8 taken slots moves an older entry on to one of its
+ *  other slots, a few times over, and drops whatever is left. Lookups only
+ *  take the lock shared, so the script check threads don't wait on each
+ *  other. */
 class CSignatureCache
 {
 private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    std::vector<uint256> vTable;
+    uint256 salt;
+    unsigned int nMaxDepth;
+    CSharedCriticalSection cs_sigcache;
+
+    uint256 GetEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+    {
+        // The length keeps a signature and key from being re-split
+        unsigned int nSigSize = vchSig.size();
+        uint256 entry;
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        SHA256_Update(&ctx, (const unsigned char*)&salt, sizeof(salt));
+        SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+        SHA256_Update(&ctx, (const unsigned char*)&nSigSize, sizeof(nSigSize));
+        if (!vchSig.empty())
+            SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+        if (!pubKey.empty())
+            SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+        SHA256_Final((unsigned char*)&entry, &ctx);
+        return entry;
+    }
+
+    void GetSlots(const uint256& entry, unsigned int* pnSlot) const
+    {
+        uint64_t nSize = vTable.size();
+        for (int i = 0; i < 4; i++)
+        {
+            uint64_t n = entry.Get64(i);
+            pnSlot[2 * i] = ((n & 0xffffffff) * nSize) >> 32;
+            pnSlot[2 * i + 1] = ((n >> 32) * nSize) >> 32;
+        }
+    }
 
 public:
+    CSignatureCache()
+    {
+        // -maxsigcachesize is in megabytes; every slot must fit in 32 bits
+        int64_t nMaxCacheSize = max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE));
+        uint64_t nEntries = min((uint64_t)nMaxCacheSize * 1048576 / sizeof(uint256), (uint64_t)1 << 31);
+        vTable.resize(nEntries);
+        salt = GetRandHash();
+        nMaxDepth = 1;
+        while (((uint64_t)1 << nMaxDepth) < nEntries)
+            nMaxDepth++;
+    }
+
     bool
     Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        LOCK(cs_sigcache);
+        if (vTable.empty())
+            return false;
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+        unsigned int vnSlot[8];
+        GetSlots(entry, vnSlot);
+
+        READ_LOCK(cs_sigcache);
+        for (int i = 0; i < 8; i++)
+            if (vTable[vnSlot[i]] == entry)
+                return true;
         return false;
     }
 
     void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        if (vTable.empty())
+            return;
+
+        uint256 entry = GetEntry(hash, vchSig, pubKey);
+
+        WRITE_LOCK(cs_sigcache);
+        unsigned int nLastSlot = (unsigned int)-1;
+        for (unsigned int nDepth = 0; nDepth < nMaxDepth; nDepth++)
+        {
+            unsigned int vnSlot[8];
+            GetSlots(entry, vnSlot);
+            int nLast = 8;
+            for (int i = 0; i < 8; i++)
+            {
+                if (vTable[vnSlot[i]] == entry)
+                    return;
+                if (vTable[vnSlot[i]] == 0)
+                {
+                    vTable[vnSlot[i]] = entry;
+                    return;
+                }
+                if (vnSlot[i] == nLastSlot)
+                    nLast = i;
+            }
+
+            // All taken: push out the one after the slot the current
+            // entry was pushed out of, and go on placing that one
+            nLastSlot = vnSlot[(nLast + 1) & 7];
+            std::swap(vTable[nLastSlot], entry);
+        }
+    }
+
+    // Fixed once constructed
+    size_t DynamicUsage() const
+    {
+        return VectorUsage(vTable);
+    }
+};
+
+/** Public keys already decoded for OP_CHECKSIG, by their serialization.
+ *  Decoding a compressed key takes a square root on the curve, more than
+ *  half the cost of verifying with it, and the same keys come back in
+ *  every multisig and address reuse. Entries are handed out as copies,
+ *  since OpenSSL keys may not be shared between verifying threads. */
+class CPubKeyCache
+{
+private:
+    static const unsigned int MAX_PUBKEY_CACHE = 10000;
 
-        LOCK(cs_sigcache);
+    std::map<valtype, CKey> mapKeys;
+    CCriticalSection cs_pubkeycache;
+
+public:
+    bool Get(const valtype& vchPubKey, CKey& key)
+    {
+        LOCK(cs_pubkeycache);
+        std::map<valtype, CKey>::const_iterator mi = mapKeys.find(vchPubKey);
+        if (mi == mapKeys.end())
+            return false;
+        key = mi->second;
+        return true;
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+    void Set(const valtype& vchPubKey, const CKey& key)
+    {
+        LOCK(cs_pubkeycache);
+        if (mapKeys.size() >= MAX_PUBKEY_CACHE)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            // Evict a random entry, as the old signature cache did
+            uint256 hashRand = GetRandHash();
+            valtype vchRand(hashRand.begin(), hashRand.end());
+            std::map<valtype, CKey>::iterator it = mapKeys.lower_bound(vchRand);
+            if (it == mapKeys.end())
+                it = mapKeys.begin();
+            mapKeys.erase(it);
         }
+        mapKeys.insert(make_pair(vchPubKey, key));
+    }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+    // Not counting OpenSSL's own key objects
+    size_t DynamicUsage()
+    {
+        LOCK(cs_pubkeycache);
+        size_t nUsage = MapUsage(mapKeys);
+        for (std::map<valtype, CKey>::const_iterator mi = mapKeys.begin(); mi != mapKeys.end(); ++mi)
+            nUsage += VectorUsage(mi->first);
+        return nUsage;
     }
 };
 
-bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
-              const CTransaction& txTo, unsigned int nIn, int nHashType)
+// Built on first use, once -maxsigcachesize has been read
+static CSignatureCache& SignatureCache()
 {
     static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+static CPubKeyCache& PubKeyCache()
+{
+    static CPubKeyCache pubKeyCache;
+    return pubKeyCache;
+}
+
+size_t GetSignatureCacheUsage()
+{
+    return SignatureCache().DynamicUsage();
+}
+
+size_t GetPubKeyCacheUsage()
+{
+    return PubKeyCache().DynamicUsage();
+}
+
+static CMetric metricSigCacheHits("iocoin_sigcache_hits_total", "Signature checks answered by the signature cache.", METRIC_COUNTER);
+static CMetric metricSigCacheMisses("iocoin_sigcache_misses_total", "Signature checks that had to verify the signature.", METRIC_COUNTER);
+
+bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
+              const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache)
+{
+    CSignatureCache& signatureCache = SignatureCache();
+    CPubKeyCache& pubKeyCache = PubKeyCache();
 
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
@@ -1333,14 +1521,22 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
         return false;
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, txTo, nIn, nHashType, pcache);
 
     if (signatureCache.Get(sighash, vchSig, vchPubKey))
+    {
+        metricSigCacheHits.Inc();
         return true;
+    }
+    metricSigCacheMisses.Inc();
 
     CKey key;
-    if (!key.SetPubKey(vchPubKey))
-        return false;
+    if (!pubKeyCache.Get(vchPubKey, key))
+    {
+        if (!key.SetPubKey(vchPubKey))
+            return false;
+        pubKeyCache.Set(vchPubKey, key);
+    }
 
     if (!key.Verify(sighash, vchSig))
         return false;
@@ -1356,18 +1552,55 @@ bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CSc
 
 
 
+// Byte-level tests for the two forms nearly every output has. They only
+// take scripts the template matchers below read the same way; a key
+// pushed with OP_PUSHDATA1 and the like is still left to the templates.
+static bool IsPayToPubKeyHash(const CScript& script)
+{
+    return (script.size() == 25 &&
+            script[0] == OP_DUP &&
+            script[1] == OP_HASH160 &&
+            script[2] == 0x14 &&
+            script[23] == OP_EQUALVERIFY &&
+            script[24] == OP_CHECKSIG);
+}
+
+static bool IsPayToPubKey(const CScript& script)
+{
+    return (((script.size() == 35 && script[0] == 33) ||
+             (script.size() == 67 && script[0] == 65)) &&
+            script[script.size()-1] == OP_CHECKSIG);
+}
+
+static vector<CScript> BuildSolverTemplates()
+{
+    vector<CScript> vTemplates;
+
+    // Standard tx, sender provides pubkey, receiver adds signature
+    vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
+
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
+
+    return vTemplates;
+}
+
 bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSolutionRet)
 {
-    // Templates
-    static vector<CScript> vTemplates;
-    if (vTemplates.empty())
+    vSolutionRet.clear();
+    if (IsPayToPubKeyHash(scriptPubKey))
     {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        vTemplates.push_back(CScript() << OP_PUBKEY << OP_CHECKSIG);
-
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        vTemplates.push_back(CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG);
+        vSolutionRet.push_back(make_pair(OP_PUBKEYHASH, valtype(scriptPubKey.begin()+3, scriptPubKey.begin()+23)));
+        return true;
     }
+    if (IsPayToPubKey(scriptPubKey))
+    {
+        vSolutionRet.push_back(make_pair(OP_PUBKEY, valtype(scriptPubKey.begin()+1, scriptPubKey.end()-1)));
+        return true;
+    }
+
+    // Templates, built once by the first caller
+    static const vector<CScript> vTemplates = BuildSolverTemplates();
 
     // Scan templates
     const CScript& script1 = scriptPubKey;
@@ -1418,26 +1651,28 @@ bool Solver(const CScript& scriptPubKey, vector<pair<opcodetype, valtype> >& vSo
 //
 // Return public keys or hashes from scriptPubKey, for 'standard' transaction types.
 //
-bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+static multimap<txnouttype, CScript> BuildTypedSolverTemplates()
 {
-    // Templates
-    static multimap<txnouttype, CScript> mTemplates;
-    if (mTemplates.empty())
-    {
-        // Standard tx, sender provides pubkey, receiver adds signature
-        mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
+    multimap<txnouttype, CScript> mTemplates;
 
-        // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
-        mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
+    // Standard tx, sender provides pubkey, receiver adds signature
+    mTemplates.insert(make_pair(TX_PUBKEY, CScript() << OP_PUBKEY << OP_CHECKSIG));
 
-        // Sender provides N pubkeys, receivers provides M signatures
-        mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
+    // Bitcoin address tx, sender provides hash of pubkey, receiver provides signature and pubkey
+    mTemplates.insert(make_pair(TX_PUBKEYHASH, CScript() << OP_DUP << OP_HASH160 << OP_PUBKEYHASH << OP_EQUALVERIFY << OP_CHECKSIG));
 
-        // Empty, provably prunable, data-carrying output
-        mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN << OP_SMALLDATA));
-        mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
-    }
+    // Sender provides N pubkeys, receivers provides M signatures
+    mTemplates.insert(make_pair(TX_MULTISIG, CScript() << OP_SMALLINTEGER << OP_PUBKEYS << OP_SMALLINTEGER << OP_CHECKMULTISIG));
 
+    // Empty, provably prunable, data-carrying output
+    mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN << OP_SMALLDATA));
+    mTemplates.insert(make_pair(TX_NULL_DATA, CScript() << OP_RETURN));
+
+    return mTemplates;
+}
+
+bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsigned char> >& vSolutionsRet)
+{
     // Shortcut for pay-to-script-hash, which are more constrained than the other types:
     // it is always OP_HASH160 20 [20 byte hash] OP_EQUAL
     if (scriptPubKey.IsPayToScriptHash())
@@ -1448,6 +1683,26 @@ bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, vector<vector<unsi
         return true;
     }
 
+    // Likewise for the other two common forms
+    if (IsPayToPubKeyHash(scriptPubKey))
+    {
+        typeRet = TX_PUBKEYHASH;
+        vSolutionsRet.clear();
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin()+3, scriptPubKey.begin()+23));
+        return true;
+    }
+    if (IsPayToPubKey(scriptPubKey))
+    {
+        typeRet = TX_PUBKEY;
+        vSolutionsRet.clear();
+        vSolutionsRet.push_back(valtype(scriptPubKey.begin()+1, scriptPubKey.end()-1));
+        return true;
+    }
+
+    // Templates, built once by the first caller (the script check
+    // threads may be among the first)
+    static const multimap<txnouttype, CScript> mTemplates = BuildTypedSolverTemplates();
+
     // Scan templates
     const CScript& script1 = scriptPubKey;
     BOOST_FOREACH(const PAIRTYPE(txnouttype, CScript)& tplate, mTemplates)
@@ -1833,17 +2088,17 @@ bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, vecto
 }
 
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int flags,
-                  int nHashType)
+                  int nHashType, const CSignatureHashCache* pcache)
 {
     vector<vector<unsigned char> > stack, stackCopy;
-    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptSig, txTo, nIn, flags, nHashType, pcache))
     {
         return false;
     }
 
     stackCopy = stack;
 
-    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType))
+    if (!EvalScript(stack, scriptPubKey, txTo, nIn, flags, nHashType, pcache))
     {
         return false;
     }
@@ -1869,7 +2124,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
         popstack(stackCopy);
 
-        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType))
+        if (!EvalScript(stackCopy, pubKey2, txTo, nIn, flags, nHashType, pcache))
         {
             return false;
          }
@@ -1884,7 +2139,8 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
 }
 
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1900,7 +2156,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
-    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
+    uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType, pcache);
 
     txnouttype whichType;
     if (!Solver(keystore, rawScript, hash, nHashType, txin.scriptSig, whichType))
@@ -1917,7 +2173,7 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
         CScript subscript = txin.scriptSig;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
-        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
+        uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType, pcache);
 
         txnouttype subType;
         bool fSolved =
@@ -1932,10 +2188,11 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     }
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0);
+    return VerifyScript(txin.scriptSig, fromPubKey, txTo, nIn, STANDARD_SCRIPT_VERIFY_FLAGS, 0, pcache);
 }
 
-bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType)
+bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType,
+                   const CSignatureHashCache* pcache)
 {
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
@@ -1943,7 +2200,7 @@ bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CTrans
     assert(txin.prevout.hash == txFrom.GetHash());
     const CTxOut& txout = txFrom.vout[txin.prevout.n];
 
-    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType);
+    return SignSignature(keystore, txout.scriptPubKey, txTo, nIn, nHashType, pcache);
 }
 
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType)
@@ -1998,7 +2255,7 @@ static CScript CombineMultisig(CScript scriptPubKey, const CTransaction& txTo, u
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0))
+            if (CheckSig(sig, pubkey, scriptPubKey, txTo, nIn, 0, NULL))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -29,6 +29,8 @@ extern bool AddressToHash160(const std::string& str, uint160& hash160Ret);
 extern string Hash160ToAddress(uint160 hash160);
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 1000000; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 40;      // bytes
+/** Default for -maxsigcachesize, in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 32;
 
 /** Signature hash types/flags */
 enum
@@ -842,7 +844,37 @@ class CScript : public std::vector<unsigned char>
 
 
 
-bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType);
+/** The parts of txTo's signature hash that are the same for every input
+ *  signed SIGHASH_ALL: the hash state after each run of leading inputs
+ *  with their scripts blanked, and the serialized inputs and outputs that
+ *  follow. Each input then hashes its own script code and the bytes after
+ *  it, without serializing the transaction again. The input scripts of
+ *  txTo may be changed while this is in use; nothing else may. */
+class CSignatureHashCache
+{
+private:
+    const CTransaction& txTo;
+    // Hash state after the header and the first i blanked inputs
+    std::vector<CHashWriter> vMidstate;
+    // Hash state after the header of an ANYONECANPAY signature
+    CHashWriter ssAnyoneCanPay;
+    // Every input with its script blanked, and where each one ends
+    std::vector<char> vchInputs;
+    std::vector<unsigned int> vInputEnd;
+    // From the output count to the end of the transaction
+    std::vector<char> vchOutputs;
+
+public:
+    explicit CSignatureHashCache(const CTransaction& txToIn);
+
+    // False unless nHashType signs all outputs; SignatureHash then does it the long way
+    bool Get(const CScript& scriptCode, unsigned int nIn, int nHashType, uint256& hashRet) const;
+};
+
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CSignatureHashCache* pcache);
+bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType,
+                const CSignatureHashCache* pcache = NULL);
 bool Solver(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<std::vector<unsigned char> >& vSolutionsRet);
 int ScriptSigArgsExpected(txnouttype t, const std::vector<std::vector<unsigned char> >& vSolutions);
 bool IsStandard(const CScript& scriptPubKey, txnouttype& whichType);
@@ -851,11 +883,16 @@ bool IsMine(const CKeyStore& keystore, const CTxDestination &dest);
 void ExtractAffectedKeys(const CKeyStore &keystore, const CScript& scriptPubKey, std::vector<CKeyID> &vKeys);
 bool ExtractDestination(const CScript& scriptPubKey, CTxDestination& addressRet);
 bool ExtractDestinations(const CScript& scriptPubKey, txnouttype& typeRet, std::vector<CTxDestination>& addressRet, int& nRequiredRet);
-bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
-bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashCache* pcache=NULL);
+bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL,
+                   const CSignatureHashCache* pcache=NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CTransaction& txTo, unsigned int nIn, int flags,
-                  int nHashType);
+                  int nHashType, const CSignatureHashCache* pcache = NULL);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int flags, int nHashType);
+// Heap memory of the signature cache and of the decoded public key cache
+size_t GetSignatureCacheUsage();
+size_t GetPubKeyCacheUsage();
 
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
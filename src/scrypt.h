@@ -7,6 +7,8 @@
 #include "util.h"
 #include "net.h"
 
+// Left from the scrypt-based code base; block proof of work here is X11
+// (Hash9 in hashblock.h), and scrypt.o isn't part of the build.
 uint256 scrypt_salted_multiround_hash(const void* input, size_t inputlen, const void* salt, size_t saltlen, const unsigned int nRounds);
 uint256 scrypt_salted_hash(const void* input, size_t inputlen, const void* salt, size_t saltlen);
 uint256 scrypt_hash(const void* input, size_t inputlen);
@@ -242,6 +242,83 @@ uint64_t ReadCompactSize(Stream& is)
     return nSizeRet;
 }
 
+// Bytes left to read in a stream whose end is known, such as a received
+// message; streams that don't know it have no limit here
+template<typename Stream>
+inline uint64_t GetUnreadSize(const Stream&)
+{
+    return std::numeric_limits<uint64_t>::max();
+}
+
+// Read a compact size that counts elements taking at least nMinElementSize
+// bytes each, failing before anything is allocated for them if the stream
+// can't hold that many. Keeps a few crafted bytes from having a vector or
+// string sized for data that never arrives.
+template<typename Stream>
+unsigned int ReadCompactSizeBounded(Stream& is, unsigned int nMinElementSize)
+{
+    uint64_t nSize = ReadCompactSize(is);
+    if (nSize * nMinElementSize > GetUnreadSize(is))
+        throw std::ios_base::failure("ReadCompactSizeBounded() : end of data");
+    return nSize;
+}
+
+
+// Variable-length integers: bytes are a MSB base-128 encoding of the number.
+// The high bit in each byte signifies whether another digit follows. To make
+// the encoding one-to-one, one is subtracted from all but the last digit.
+// Thus, the byte sequence a[] with length len, where all but the last byte
+// has bit 128 set, encodes the number:
+//
+//   (a[len-1] & 0x7F) + sum(i=1..len-1, 128^i*((a[len-i-1] & 0x7F)+1))
+//
+// Only for unsigned types.
+template<typename I>
+inline unsigned int GetSizeOfVarInt(I n)
+{
+    int nRet = 0;
+    while(true) {
+        nRet++;
+        if (n <= 0x7F)
+            break;
+        n = (n >> 7) - 1;
+    }
+    return nRet;
+}
+
+template<typename Stream, typename I>
+void WriteVarInt(Stream& os, I n)
+{
+    unsigned char tmp[(sizeof(n)*8+6)/7];
+    int len=0;
+    while(true) {
+        tmp[len] = (n & 0x7F) | (len ? 0x80 : 0x00);
+        if (n <= 0x7F)
+            break;
+        n = (n >> 7) - 1;
+        len++;
+    }
+    do {
+        WRITEDATA(os, tmp[len]);
+    } while(len--);
+}
+
+template<typename Stream, typename I>
+I ReadVarInt(Stream& is)
+{
+    I n = 0;
+    while(true) {
+        unsigned char chData;
+        READDATA(is, chData);
+        if (n > (std::numeric_limits<I>::max() >> 7))
+            throw std::ios_base::failure("ReadVarInt() : size too large");
+        n = (n << 7) | (chData & 0x7F);
+        if (chData & 0x80)
+            n++;
+        else
+            return n;
+    }
+}
 
 
 #define FLATDATA(obj)   REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
@@ -380,7 +457,7 @@ void Serialize(Stream& os, const std::basic_string<C>& str, int, int)
 template<typename Stream, typename C>
 void Unserialize(Stream& is, std::basic_string<C>& str, int, int)
 {
-    unsigned int nSize = ReadCompactSize(is);
+    unsigned int nSize = ReadCompactSizeBounded(is, sizeof(C));
     str.resize(nSize);
     if (nSize != 0)
         is.read((char*)&str[0], nSize * sizeof(str[0]));
@@ -447,7 +524,7 @@ void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion,
 {
     // Limit size per read so bogus size value won't cause out of memory
     v.clear();
-    unsigned int nSize = ReadCompactSize(is);
+    unsigned int nSize = ReadCompactSizeBounded(is, sizeof(T));
     unsigned int i = 0;
     while (i < nSize)
     {
@@ -461,8 +538,9 @@ void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion,
 template<typename Stream, typename T, typename A>
 void Unserialize_impl(Stream& is, std::vector<T, A>& v, int nType, int nVersion, const boost::false_type&)
 {
+    // Every element takes at least a byte
     v.clear();
-    unsigned int nSize = ReadCompactSize(is);
+    unsigned int nSize = ReadCompactSizeBounded(is, 1);
     unsigned int i = 0;
     unsigned int nMid = 0;
     while (nMid < nSize)
@@ -811,6 +889,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity(); }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -1007,8 +1086,19 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange contents with another stream, each keeping its type and version
+    void swap(CDataStream& other) {
+        vch.swap(other.vch);
+        std::swap(nReadPos, other.nReadPos);
+    }
 };
 
+inline uint64_t GetUnreadSize(const CDataStream& is)
+{
+    return is.size();
+}
+
 
 
 
@@ -1133,4 +1223,66 @@ public:
     }
 };
 
+/** Read-only stream over a range of memory that is owned by someone else,
+ * for instance a memory mapped block file. Unlike CDataStream nothing is
+ * copied up front; objects are deserialized straight from the range.
+ */
+class CBufferReader
+{
+protected:
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pcur = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+    bool eof() const             { return pcur >= pend; }
+    const char* pos() const      { return pcur; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::read : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CBufferReader& ignore(size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::ignore : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+inline uint64_t GetUnreadSize(const CBufferReader& is)
+{
+    return is.size();
+}
+
 #endif
@@ -8,6 +8,8 @@
 
 #include <boost/foreach.hpp>
 
+#include <map>
+
 #ifdef DEBUG_LOCKCONTENTION
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 {
@@ -16,6 +18,119 @@ void PrintLockContention(const char* pszName, const char* pszFile, int nLine)
 }
 #endif /* DEBUG_LOCKCONTENTION */
 
+//
+// Lock profiler. Sites live in a map that is never erased from, so the
+// pointers handed to CMutexLock stay valid across ResetLockStats. The same
+// file:line can show up under several __FILE__ pointers when the LOCK is
+// in a header; GetLockStats merges those.
+//
+
+volatile bool fLockProfiling = false;
+
+typedef std::pair<std::pair<const char*, const char*>, int> LockSiteKey;
+static boost::mutex mutexLockStats;
+static std::map<LockSiteKey, CLockSiteStats> mapLockSites;
+
+CLockSiteStats::CLockSiteStats(const char* pszNameIn, const char* pszFileIn, int nLineIn) :
+    pszName(pszNameIn), pszFile(pszFileIn), nLine(nLineIn)
+{
+    Reset();
+}
+
+void CLockSiteStats::Reset()
+{
+    nAcquired = 0;
+    nContended = 0;
+    nTryFailed = 0;
+    nWaitMicros = 0;
+    nMaxWaitMicros = 0;
+    nHeldMicros = 0;
+    nMaxHeldMicros = 0;
+    for (int i = 0; i < LOCK_WAIT_BUCKETS; i++)
+        vWaitHistogram[i] = 0;
+}
+
+int64_t LockProfileTime()
+{
+    return GetTimeMicros();
+}
+
+static CLockSiteStats& LockSite(const char* pszName, const char* pszFile, int nLine)
+{
+    LockSiteKey key(std::make_pair(pszFile, pszName), nLine);
+    std::map<LockSiteKey, CLockSiteStats>::iterator it = mapLockSites.find(key);
+    if (it == mapLockSites.end())
+        it = mapLockSites.insert(std::make_pair(key, CLockSiteStats(pszName, pszFile, nLine))).first;
+    return it->second;
+}
+
+CLockSiteStats* LockProfileAcquired(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWaitMicros)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    CLockSiteStats& site = LockSite(pszName, pszFile, nLine);
+    site.nAcquired++;
+    if (fContended)
+    {
+        site.nContended++;
+        site.nWaitMicros += nWaitMicros;
+        site.nMaxWaitMicros = std::max(site.nMaxWaitMicros, nWaitMicros);
+        int nBucket = 0;
+        for (int64_t n = 10; nBucket < LOCK_WAIT_BUCKETS - 1 && nWaitMicros >= n; n *= 10)
+            nBucket++;
+        site.vWaitHistogram[nBucket]++;
+    }
+    return &site;
+}
+
+void LockProfileReleased(CLockSiteStats* psite, int64_t nHeldMicros)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    psite->nHeldMicros += nHeldMicros;
+    psite->nMaxHeldMicros = std::max(psite->nMaxHeldMicros, nHeldMicros);
+}
+
+void LockProfileTryFailed(const char* pszName, const char* pszFile, int nLine)
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    LockSite(pszName, pszFile, nLine).nTryFailed++;
+}
+
+void GetLockStats(std::vector<CLockSiteStats>& vStats)
+{
+    vStats.clear();
+    std::map<std::pair<std::string, int>, unsigned int> mapIndex;
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    for (std::map<LockSiteKey, CLockSiteStats>::const_iterator it = mapLockSites.begin(); it != mapLockSites.end(); ++it)
+    {
+        const CLockSiteStats& site = it->second;
+        std::pair<std::string, int> key(std::string(site.pszFile) + ":" + site.pszName, site.nLine);
+        std::map<std::pair<std::string, int>, unsigned int>::iterator mi = mapIndex.find(key);
+        if (mi == mapIndex.end())
+        {
+            mapIndex[key] = vStats.size();
+            vStats.push_back(site);
+            continue;
+        }
+        CLockSiteStats& merged = vStats[mi->second];
+        merged.nAcquired += site.nAcquired;
+        merged.nContended += site.nContended;
+        merged.nTryFailed += site.nTryFailed;
+        merged.nWaitMicros += site.nWaitMicros;
+        merged.nMaxWaitMicros = std::max(merged.nMaxWaitMicros, site.nMaxWaitMicros);
+        merged.nHeldMicros += site.nHeldMicros;
+        merged.nMaxHeldMicros = std::max(merged.nMaxHeldMicros, site.nMaxHeldMicros);
+        for (int i = 0; i < LOCK_WAIT_BUCKETS; i++)
+            merged.vWaitHistogram[i] += site.vWaitHistogram[i];
+    }
+}
+
+void ResetLockStats()
+{
+    boost::unique_lock<boost::mutex> lock(mutexLockStats);
+    for (std::map<LockSiteKey, CLockSiteStats>::iterator it = mapLockSites.begin(); it != mapLockSites.end(); ++it)
+        it->second.Reset();
+}
+
 #ifdef DEBUG_LOCKORDER
 //
 // Early deadlock detection.
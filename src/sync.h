@@ -8,10 +8,14 @@
 
 #include "threadsafety.h"
 
+#include <stdint.h>
+#include <vector>
+
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 
 ////////////////////////////////////////////////
@@ -84,6 +88,12 @@ typedef AnnotatedMixin<boost::recursive_mutex> CCriticalSection;
 /** Wrapped boost mutex: supports waiting but not recursive locking */
 typedef AnnotatedMixin<boost::mutex> CWaitableCriticalSection;
 
+/** Wrapped boost shared mutex: many readers or one writer, not recursive */
+typedef boost::shared_mutex CSharedCriticalSection;
+
+#define READ_LOCK(cs) boost::shared_lock<CSharedCriticalSection> readlock(cs)
+#define WRITE_LOCK(cs) boost::unique_lock<CSharedCriticalSection> writelock(cs)
+
 #ifdef DEBUG_LOCKORDER
 void EnterCritical(const char* pszName, const char* pszFile, int nLine, void* cs, bool fTry = false);
 void LeaveCritical();
@@ -100,16 +110,59 @@ void static inline AssertLockHeldInternal(const char* pszName, const char* pszFi
 void PrintLockContention(const char* pszName, const char* pszFile, int nLine);
 #endif
 
+// Waits are counted in buckets below 10us, 100us, 1ms, 10ms, 100ms, 1s
+// and above
+static const int LOCK_WAIT_BUCKETS = 7;
+
+/** What the lock profiler knows about one LOCK call site. Times are in
+ *  microseconds; only contended acquisitions wait. */
+struct CLockSiteStats
+{
+    const char* pszName;
+    const char* pszFile;
+    int nLine;
+    uint64_t nAcquired;
+    uint64_t nContended;
+    uint64_t nTryFailed;
+    int64_t nWaitMicros;
+    int64_t nMaxWaitMicros;
+    int64_t nHeldMicros;
+    int64_t nMaxHeldMicros;
+    uint64_t vWaitHistogram[LOCK_WAIT_BUCKETS];
+
+    CLockSiteStats(const char* pszNameIn, const char* pszFileIn, int nLineIn);
+    void Reset();
+};
+
+// Set by -lockstats or setlockstats; while false LOCK costs one extra test
+extern volatile bool fLockProfiling;
+
+CLockSiteStats* LockProfileAcquired(const char* pszName, const char* pszFile, int nLine, bool fContended, int64_t nWaitMicros);
+void LockProfileReleased(CLockSiteStats* psite, int64_t nHeldMicros);
+void LockProfileTryFailed(const char* pszName, const char* pszFile, int nLine);
+int64_t LockProfileTime();
+// A copy of every call site seen since start, merged by file:line
+void GetLockStats(std::vector<CLockSiteStats>& vStats);
+void ResetLockStats();
+
 /** Wrapper around boost::unique_lock<Mutex> */
 template<typename Mutex>
 class CMutexLock
 {
 private:
     boost::unique_lock<Mutex> lock;
+    // Set when the lock profiler counted this acquisition
+    CLockSiteStats* psite;
+    int64_t nLockedTime;
 
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()));
+        if (fLockProfiling)
+        {
+            EnterProfiled(pszName, pszFile, nLine);
+            return;
+        }
 #ifdef DEBUG_LOCKCONTENTION
         if (!lock.try_lock())
         {
@@ -121,17 +174,44 @@ private:
 #endif
     }
 
+    void EnterProfiled(const char* pszName, const char* pszFile, int nLine)
+    {
+        int64_t nWait = 0;
+        bool fContended = !lock.try_lock();
+        if (fContended)
+        {
+#ifdef DEBUG_LOCKCONTENTION
+            PrintLockContention(pszName, pszFile, nLine);
+#endif
+            int64_t nStart = LockProfileTime();
+            lock.lock();
+            nWait = LockProfileTime() - nStart;
+        }
+        psite = LockProfileAcquired(pszName, pszFile, nLine, fContended, nWait);
+        nLockedTime = LockProfileTime();
+    }
+
     bool TryEnter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, (void*)(lock.mutex()), true);
         lock.try_lock();
         if (!lock.owns_lock())
             LeaveCritical();
+        if (fLockProfiling)
+        {
+            if (lock.owns_lock())
+            {
+                psite = LockProfileAcquired(pszName, pszFile, nLine, false, 0);
+                nLockedTime = LockProfileTime();
+            }
+            else
+                LockProfileTryFailed(pszName, pszFile, nLine);
+        }
         return lock.owns_lock();
     }
 
 public:
-    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock)
+    CMutexLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) : lock(mutexIn, boost::defer_lock), psite(NULL), nLockedTime(0)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -141,6 +221,8 @@ public:
 
     ~CMutexLock()
     {
+        if (psite)
+            LockProfileReleased(psite, LockProfileTime() - nLockedTime);
         if (lock.owns_lock())
             LeaveCritical();
     }
@@ -16,10 +16,9 @@
 #include <stdint.h>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CDataStream& vMsg);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CDataStream*> mapOrphanTransactions;
-extern std::map<uint256, std::map<uint256, CDataStream*> > mapOrphanTransactionsByPrev;
+extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, unsigned int nMaxBytes);
+extern boost::unordered_map<uint256, std::set<uint256>, SaltedTxidHasher> mapOrphanTransactionsByPrev;
 
 CService ip(uint32_t i)
 {
@@ -63,6 +62,38 @@ BOOST_AUTO_TEST_CASE(DoS_banscore)
     mapArgs.erase("-banscore");
 }
 
+BOOST_AUTO_TEST_CASE(DoS_eviction)
+{
+    // Too few to leave anyone unprotected
+    std::vector<CNodeEvictionCandidate> vCandidates;
+    for (int i = 0; i < 20; i++)
+    {
+        CNodeEvictionCandidate candidate;
+        candidate.id = i;
+        candidate.nTimeConnected = 1000 + i;
+        candidate.nMinPingUsecTime = 10000 + i * 1000;
+        candidate.nLastBlockTime = 0;
+        candidate.nLastTXTime = 0;
+        candidate.nKeyedNetGroup = i;
+        vCandidates.push_back(candidate);
+    }
+    NodeId id;
+    BOOST_CHECK(!SelectNodeToEvict(vCandidates, id));
+
+    // Past that, the youngest of the most crowded netgroup goes
+    for (int i = 20; i < 60; i++)
+    {
+        CNodeEvictionCandidate candidate = vCandidates[0];
+        candidate.id = i;
+        candidate.nTimeConnected = 1000 + i;
+        candidate.nMinPingUsecTime = 10000 + i * 1000;
+        candidate.nKeyedNetGroup = (i < 40 ? 0 : i);
+        vCandidates.push_back(candidate);
+    }
+    BOOST_CHECK(SelectNodeToEvict(vCandidates, id));
+    BOOST_CHECK_EQUAL(id, 39);
+}
+
 BOOST_AUTO_TEST_CASE(DoS_bantime)
 {
     CNode::ClearBanned();
@@ -132,16 +163,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
     
 }
 
+static std::vector<CTransaction> vOrphans;
+
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CDataStream*>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    const CDataStream* pvMsg = it->second;
-    CTransaction tx;
-    CDataStream(*pvMsg) >> tx;
-    return tx;
+    return vOrphans[GetRand(vOrphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -163,9 +189,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
@@ -182,9 +207,18 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        AddOrphanTx(ds);
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        vOrphans.push_back(tx);
+    }
+
+    // That is all peer 0 may have us keep, others still get in:
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        BOOST_CHECK(!AddOrphanTx(tx, 0));
+        BOOST_CHECK(AddOrphanTx(tx, 1));
     }
 
     // This really-big orphan should be ignored:
@@ -208,19 +242,18 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        CDataStream ds(SER_DISK, CLIENT_VERSION);
-        ds << tx;
-        BOOST_CHECK(!AddOrphanTx(ds));
+        BOOST_CHECK(!AddOrphanTx(tx, 2));
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(40, MAX_ORPHAN_TX_BYTES), 61U);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(10, MAX_ORPHAN_TX_BYTES), 30U);
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS, 0), 10U);
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+
+    // Peer 0's quota is free again
+    BOOST_CHECK(AddOrphanTx(vOrphans[0], 0));
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(0, MAX_ORPHAN_TX_BYTES), 1U);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
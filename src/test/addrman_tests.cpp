@@ -0,0 +1,57 @@
+#include <boost/test/unit_test.hpp>
+
+#include "addrman.h"
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+static CAddress MakeAddr(int i)
+{
+    CAddress addr(CService(strprintf("250.%d.%d.1", i / 256, i % 256), 8333));
+    addr.nTime = GetAdjustedTime();
+    return addr;
+}
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrMan addrman;
+    BOOST_CHECK(!addrman.Select().IsValid());
+
+    CNetAddr source("252.2.2.2");
+    for (int i = 0; i < 1000; i++)
+        addrman.Add(MakeAddr(i), source);
+    BOOST_CHECK(addrman.size() > 0 && addrman.size() <= 1000);
+
+    CAddress addr = addrman.Select();
+    BOOST_CHECK(addr.IsValid());
+
+    // Once known to work, only tried addresses are picked with no bias to new ones
+    CAddrMan addrmanOne;
+    addrmanOne.Add(MakeAddr(1), source);
+    addrmanOne.Good(MakeAddr(1));
+    BOOST_CHECK(addrmanOne.Select(0) == MakeAddr(1));
+}
+
+BOOST_AUTO_TEST_CASE(addrman_serialize)
+{
+    CAddrMan addrman;
+    CNetAddr source("252.2.2.2");
+    for (int i = 0; i < 500; i++)
+        addrman.Add(MakeAddr(i), source);
+    for (int i = 0; i < 50; i++)
+        addrman.Good(MakeAddr(i));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << addrman;
+    CDataStream ssCopy = ss;
+
+    CAddrMan addrmanRead;
+    ss >> addrmanRead;
+    BOOST_CHECK_EQUAL(addrmanRead.size(), addrman.size());
+
+    // Written again, the tables come out the same
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << addrmanRead;
+    BOOST_CHECK(ss2.str() == ssCopy.str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,87 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "main.h"
+
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.nTime = 1500000000;
+    block.nBits = 0x1e0fffff;
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        CTransaction tx;
+        tx.nTime = block.nTime;
+        tx.vin.resize(1);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 + i;
+        if (i == 0)
+            tx.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+        else
+            tx.vin[0].prevout = COutPoint(GetRandHash(), i);
+        block.vtx.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+BOOST_AUTO_TEST_CASE(compact_block_roundtrip)
+{
+    CBlock block = BuildBlock(10);
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.GetTransactionCount(), 10U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblock2;
+    ss >> cmpctblock2;
+    BOOST_CHECK(cmpctblock2.header.GetHash() == block.GetHash());
+
+    // The pool has every other transaction
+    CTxMemPool pool;
+    for (unsigned int i = 2; i < block.vtx.size(); i += 2)
+        pool.addUnchecked(block.vtx[i].GetHash(), block.vtx[i]);
+
+    CPartiallyDownloadedBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock2, pool));
+    BOOST_CHECK_EQUAL(partial.vMissing.size(), 5U);
+
+    std::vector<CTransaction> vtxMissing;
+    BOOST_FOREACH(unsigned int nIndex, partial.vMissing)
+    {
+        BOOST_CHECK(nIndex % 2 == 1);
+        vtxMissing.push_back(block.vtx[nIndex]);
+    }
+
+    // The wrong transactions don't add up to the merkle root
+    CPartiallyDownloadedBlock partialBad = partial;
+    std::swap(vtxMissing[0], vtxMissing[1]);
+    BOOST_CHECK(!partialBad.Fill(vtxMissing));
+    std::swap(vtxMissing[0], vtxMissing[1]);
+
+    BOOST_CHECK(partial.Fill(vtxMissing));
+    BOOST_CHECK(partial.block.GetHash() == block.GetHash());
+    BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(compact_block_bad_encoding)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool;
+
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.vPrefilledTxn[0].nIndex = 4;
+    CPartiallyDownloadedBlock partial;
+    BOOST_CHECK(!partial.Init(cmpctblock, pool));
+
+    CBlockHeaderAndShortTxIDs cmpctblock2(block);
+    cmpctblock2.vchShortTxIDs.push_back(0);
+    BOOST_CHECK(!partial.Init(cmpctblock2, pool));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockimport.h"
+#include "main.h"
+
+#include <stdio.h>
+
+using namespace std;
+
+static CBlock SampleBlock(unsigned int nNonce)
+{
+    CBlock block;
+    block.nTime = 1400000000;
+    block.nNonce = nNonce;
+    CTransaction tx;
+    tx.nTime = block.nTime;
+    tx.vin.push_back(CTxIn());
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void WriteRecord(FILE* file, const CBlock& block)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << block;
+    unsigned int nSize = ss.size();
+    fwrite(pchMessageStart, 1, sizeof(pchMessageStart), file);
+    fwrite(&nSize, 1, sizeof(nSize), file);
+    fwrite(&ss[0], 1, ss.size(), file);
+}
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+BOOST_AUTO_TEST_CASE(blockimport_header_across_refill)
+{
+    // The reader's first fill is 4 * MAX_BLOCK_SIZE bytes. End it within
+    // the message start or the size of a record, leaving the rest of the
+    // record to the next fill, with another record after it.
+    CBlock block1 = SampleBlock(1);
+    CBlock block2 = SampleBlock(2);
+    for (unsigned int nTail = 1; nTail <= sizeof(pchMessageStart) + 4; nTail++)
+    {
+        FILE* file = tmpfile();
+        BOOST_REQUIRE(file);
+        vector<char> vPadding(4 * MAX_BLOCK_SIZE - nTail, 0);
+        fwrite(&vPadding[0], 1, vPadding.size(), file);
+        WriteRecord(file, block1);
+        WriteRecord(file, block2);
+        rewind(file);
+
+        CBlockFileReader reader(file);
+        CBlock block;
+        BOOST_CHECK(reader.ReadNext(block));
+        BOOST_CHECK(block.GetHash() == block1.GetHash());
+        BOOST_CHECK(reader.ReadNext(block));
+        BOOST_CHECK(block.GetHash() == block2.GetHash());
+        BOOST_CHECK(!reader.ReadNext(block));
+        fclose(file);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_truncated_record)
+{
+    // A record cut short at the end of the file ends the read cleanly
+    CBlock block1 = SampleBlock(1);
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file);
+    WriteRecord(file, block1);
+    fwrite(pchMessageStart, 1, sizeof(pchMessageStart), file);
+    fwrite("\x10", 1, 1, file);
+    rewind(file);
+
+    CBlockFileReader reader(file);
+    CBlock block;
+    BOOST_CHECK(reader.ReadNext(block));
+    BOOST_CHECK(block.GetHash() == block1.GetHash());
+    BOOST_CHECK(!reader.ReadNext(block));
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,73 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "merkleblock.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+BOOST_AUTO_TEST_CASE(bloom_create_insert_serialize)
+{
+    CBloomFilter filter(3, 0.01, 0, BLOOM_UPDATE_ALL);
+
+    filter.insert(ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8"));
+    BOOST_CHECK_MESSAGE( filter.contains(ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8")), "BloomFilter doesn't contain just-inserted object!");
+    // One bit different in first byte
+    BOOST_CHECK_MESSAGE(!filter.contains(ParseHex("19108ad8ed9bb6274d3980bab5a85c048f0950c8")), "BloomFilter contains something it shouldn't!");
+
+    filter.insert(ParseHex("b5a2c786d9ef4658287ced5914b37a1b4aa32eee"));
+    filter.insert(ParseHex("b9300670b4c5366e95b2699e8b18bc75e5f729c5"));
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << filter;
+    BOOST_CHECK_EQUAL(HexStr(stream.begin(), stream.end()), "03614e9b050000000000000001");
+
+    // Read back, and a cleared filter matches everything
+    CBloomFilter filter2;
+    stream >> filter2;
+    filter2.UpdateEmptyFull();
+    BOOST_CHECK(filter2.contains(ParseHex("b9300670b4c5366e95b2699e8b18bc75e5f729c5")));
+    BOOST_CHECK(CBloomFilter().contains(ParseHex("19108ad8ed9bb6274d3980bab5a85c048f0950c8")));
+}
+
+BOOST_AUTO_TEST_CASE(partial_merkle_tree)
+{
+    for (unsigned int nTx = 1; nTx <= 33; nTx++)
+    {
+        CBlock block;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            CTransaction tx;
+            tx.nTime = 1500000000 + i;
+            tx.vout.resize(1);
+            tx.vout[0].nValue = i;
+            block.vtx.push_back(tx);
+        }
+        uint256 hashMerkleRoot = block.BuildMerkleTree();
+
+        vector<uint256> vTxid;
+        vector<bool> vMatch;
+        vector<uint256> vMatchExpected;
+        for (unsigned int i = 0; i < nTx; i++)
+        {
+            vTxid.push_back(block.vtx[i].GetHash());
+            vMatch.push_back(i % 3 == 0);
+            if (vMatch.back())
+                vMatchExpected.push_back(vTxid.back());
+        }
+
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CPartialMerkleTree(vTxid, vMatch);
+        CPartialMerkleTree tree;
+        ss >> tree;
+
+        vector<uint256> vMatchRet;
+        BOOST_CHECK(tree.ExtractMatches(vMatchRet) == hashMerkleRoot);
+        BOOST_CHECK(vMatchRet == vMatchExpected);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,47 @@
+#include <boost/test/unit_test.hpp>
+
+#include "chainsnapshot.h"
+#include "checkpoints.h"
+
+#include <boost/filesystem.hpp>
+#include <openssl/sha.h>
+#include <string.h>
+
+BOOST_AUTO_TEST_SUITE(chainsnapshot_tests)
+
+BOOST_AUTO_TEST_CASE(snapshot_file_hash)
+{
+    const char* pszData = "IOCSNAP1 header, blocks and records";
+    size_t nSize = strlen(pszData);
+    uint256 hashExpected;
+    SHA256((const unsigned char*)pszData, nSize, (unsigned char*)&hashExpected);
+
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    {
+        CChainSnapshotFile fileOut(fopen(path.string().c_str(), "wb"));
+        BOOST_CHECK(fileOut.Write(pszData, 9));
+        BOOST_CHECK(fileOut.Write(pszData + 9, nSize - 9));
+        BOOST_CHECK(fileOut.GetHash() == hashExpected);
+        BOOST_CHECK_EQUAL(fileOut.GetBytes(), nSize);
+        BOOST_CHECK(fileOut.Commit());
+    }
+
+    // Reading it back hashes the same bytes
+    {
+        CChainSnapshotFile fileIn(fopen(path.string().c_str(), "rb"));
+        char buf[64];
+        BOOST_CHECK(fileIn.Read(buf, nSize));
+        BOOST_CHECK(fileIn.GetHash() == hashExpected);
+        BOOST_CHECK(!fileIn.Read(buf, 1));
+    }
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_hash_needs_checkpoint)
+{
+    uint256 hashContent;
+    BOOST_CHECK(!Checkpoints::GetSnapshotHash(0, uint256(1), hashContent));
+    BOOST_CHECK(!Checkpoints::GetSnapshotHash(1, uint256(0), hashContent));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
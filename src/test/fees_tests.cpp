@@ -0,0 +1,39 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "fees.h"
+
+BOOST_AUTO_TEST_SUITE(fees_tests)
+
+BOOST_AUTO_TEST_CASE(fees_estimate)
+{
+    CFeeEstimator estimator;
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(1), -1);
+
+    // Every block confirms ten transactions paying 0.01 per kB that waited
+    // one block, transactions paying 0.0001 per kB never make it
+    int nHeight = 1;
+    for (int i = 0; i < 100; i++, nHeight++)
+    {
+        std::vector<CTransaction> vtx;
+        for (int j = 0; j < 10; j++)
+        {
+            CTransaction tx;
+            tx.nTime = i * 10 + j;
+            estimator.AddTx(tx.GetHash(), 0.01 * COIN, nHeight - 1);
+            vtx.push_back(tx);
+
+            CTransaction txCheap;
+            txCheap.nTime = 100000 + i * 10 + j;
+            estimator.AddTx(txCheap.GetHash(), 0.0001 * COIN, nHeight - 1);
+        }
+        estimator.ProcessBlock(nHeight, vtx);
+    }
+
+    double dFeePerKb = estimator.EstimateFee(1);
+    BOOST_CHECK(dFeePerKb > 0.0099 * COIN && dFeePerKb < 0.0101 * COIN);
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(MAX_CONFIRM_TARGET + 10), estimator.EstimateFee(MAX_CONFIRM_TARGET));
+    BOOST_CHECK_EQUAL(estimator.EstimateFee(0), -1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
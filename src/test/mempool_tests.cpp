@@ -0,0 +1,101 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+static CTransaction Spend(const uint256& hashPrev, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_fee_rate)
+{
+    CTxMemPool pool;
+
+    // A free parent and a child that pays for both
+    CTransaction txParent = Spend(GetRandHash(), 10 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild = Spend(hashParent, 9 * COIN);
+    uint256 hashChild = txChild.GetHash();
+    CTransaction txOther = Spend(GetRandHash(), 5 * COIN);
+    uint256 hashOther = txOther.GetHash();
+
+    pool.addUnchecked(hashParent, txParent, CTxMemPoolEntry(0, 1000, 0, 0, 0));
+    pool.addUnchecked(hashChild, txChild, CTxMemPoolEntry(4 * MIN_TX_FEE, 1000, 0, 0, 0));
+    pool.addUnchecked(hashOther, txOther, CTxMemPoolEntry(MIN_TX_FEE, 1000, 0, 0, 0));
+
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashChild].nCountWithAncestors, 2U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashChild].nFeesWithAncestors, 4 * MIN_TX_FEE);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashChild].nSizeWithAncestors, 2000U);
+
+    // The package pays 2 * MIN_TX_FEE per kB, ahead of txOther
+    BOOST_CHECK(pool.setByAncestorFeeRate.rbegin()->second == hashChild);
+    BOOST_CHECK(pool.setByAncestorFeeRate.begin()->second == hashParent);
+
+    std::vector<uint256> vAncestors;
+    pool.GetAncestors(hashChild, vAncestors);
+    BOOST_CHECK_EQUAL(vAncestors.size(), 1U);
+    BOOST_CHECK(vAncestors[0] == hashParent);
+
+    // Once the parent is mined the child stands alone
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.setByAncestorFeeRate.size(), 2U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashChild].nCountWithAncestors, 1U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashChild].nFeesWithAncestors, 4 * MIN_TX_FEE);
+    BOOST_CHECK(pool.setByAncestorFeeRate.rbegin()->second == hashChild);
+
+    pool.remove(txOther, true);
+    pool.remove(txChild, true);
+    BOOST_CHECK(pool.setByAncestorFeeRate.empty());
+    BOOST_CHECK(pool.mapInfo.empty());
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim_to_size)
+{
+    CTxMemPool pool;
+
+    // A cheap parent whose child pays for both, and a transaction in between
+    CTransaction txParent = Spend(GetRandHash(), 10 * COIN);
+    uint256 hashParent = txParent.GetHash();
+    CTransaction txChild = Spend(hashParent, 9 * COIN);
+    uint256 hashChild = txChild.GetHash();
+    CTransaction txMiddle = Spend(GetRandHash(), 5 * COIN);
+    uint256 hashMiddle = txMiddle.GetHash();
+    CTransaction txCheap = Spend(GetRandHash(), 1 * COIN);
+    uint256 hashCheap = txCheap.GetHash();
+
+    pool.addUnchecked(hashParent, txParent, CTxMemPoolEntry(0, 1000, 0, 0, 0));
+    pool.addUnchecked(hashChild, txChild, CTxMemPoolEntry(6 * MIN_TX_FEE, 1000, 0, 0, 0));
+    pool.addUnchecked(hashMiddle, txMiddle, CTxMemPoolEntry(2 * MIN_TX_FEE, 1000, 0, 0, 0));
+    pool.addUnchecked(hashCheap, txCheap, CTxMemPoolEntry(MIN_TX_FEE, 1000, 0, 0, 0));
+
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 4000U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashParent].nCountWithDescendants, 2U);
+    BOOST_CHECK_EQUAL(pool.mapInfo[hashParent].nFeesWithDescendants, 6 * MIN_TX_FEE);
+    size_t nUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+    BOOST_CHECK_EQUAL(pool.GetMinFeePerKb(nUsage), 0);
+
+    // Evicting one goes for the cheapest package, the parent and child stay
+    BOOST_CHECK_EQUAL(pool.TrimToSize(nUsage - 1), 1U);
+    BOOST_CHECK(!pool.exists(hashCheap));
+    BOOST_CHECK(pool.exists(hashParent) && pool.exists(hashChild) && pool.exists(hashMiddle));
+    BOOST_CHECK(pool.GetMinFeePerKb(nUsage) >= 2 * MIN_TX_FEE);
+
+    // The package goes as a whole
+    BOOST_CHECK_EQUAL(pool.TrimToSize(pool.DynamicMemoryUsage() - 1), 1U);
+    BOOST_CHECK(!pool.exists(hashMiddle));
+    BOOST_CHECK_EQUAL(pool.TrimToSize(0), 2U);
+    BOOST_CHECK_EQUAL(pool.mapTx.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
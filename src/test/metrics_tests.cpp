@@ -0,0 +1,25 @@
+#include <boost/test/unit_test.hpp>
+
+#include "metrics.h"
+
+#include <string>
+
+BOOST_AUTO_TEST_SUITE(metrics_tests)
+
+static CMetric metricTestCounter("iocoin_test_events_total", "Events counted by metrics_tests.", METRIC_COUNTER);
+static CMetric metricTestSeconds("iocoin_test_seconds", "Microseconds shown as seconds.", METRIC_GAUGE, 1e-6);
+
+BOOST_AUTO_TEST_CASE(metrics_text)
+{
+    metricTestCounter.Inc();
+    metricTestCounter.Add(2);
+    BOOST_CHECK_EQUAL(metricTestCounter.Get(), 3);
+    metricTestSeconds.Set(1500000);
+
+    std::string str = GetMetricsText();
+    BOOST_CHECK(str.find("# HELP iocoin_test_events_total Events counted by metrics_tests.\n") != std::string::npos);
+    BOOST_CHECK(str.find("# TYPE iocoin_test_events_total counter\niocoin_test_events_total 3\n") != std::string::npos);
+    BOOST_CHECK(str.find("# TYPE iocoin_test_seconds gauge\niocoin_test_seconds 1.500000\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
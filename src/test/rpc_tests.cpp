@@ -4,6 +4,7 @@
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "rpcjson.h"
 
 using namespace std;
 using namespace json_spirit;
@@ -59,4 +60,27 @@ BOOST_AUTO_TEST_CASE(rpc_addmultisig)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_json_matches_spirit)
+{
+    // ReadJSON and WriteJSON must agree with json_spirit on what clients send and get
+    const char* vText[] = {
+        "{\"method\":\"getblock\",\"params\":[\"00ff\",true],\"id\":1}",
+        " [ 18446744073709551615 , -9223372036854775808, 1., .5, +7, 1e3 ] trailing",
+        "{\"a\":[true,false,null,{}],\"b\":\"x\\ny\\u00e9\\x41\\q\\\\\\\"\"}",
+        "[\"\xc3\xa9\x01\"]",
+        "[1,]",
+        "{\"a\" 1}",
+        "\"unterminated",
+        "123456789012345678901234",
+    };
+    for (unsigned int i = 0; i < sizeof(vText) / sizeof(vText[0]); i++)
+    {
+        Value valSpirit, valFast;
+        bool fSpirit = read_string(string(vText[i]), valSpirit);
+        BOOST_CHECK_EQUAL(ReadJSON(vText[i], valFast), fSpirit);
+        if (fSpirit)
+            BOOST_CHECK_EQUAL(WriteJSON(valFast), write_string(valSpirit, false));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
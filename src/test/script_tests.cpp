@@ -442,4 +442,147 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+// SignatureHash as it was, blanking a copy of the transaction
+static uint256 SignatureHashOld(CScript scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    CTransaction txTmp(txTo);
+    scriptCode.FindAndDelete(CScript(OP_CODESEPARATOR));
+    for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+        txTmp.vin[i].scriptSig = CScript();
+    txTmp.vin[nIn].scriptSig = scriptCode;
+    if ((nHashType & 0x1f) == SIGHASH_NONE)
+    {
+        txTmp.vout.clear();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    else if ((nHashType & 0x1f) == SIGHASH_SINGLE)
+    {
+        if (nIn >= txTmp.vout.size())
+            return 1;
+        txTmp.vout.resize(nIn+1);
+        for (unsigned int i = 0; i < nIn; i++)
+            txTmp.vout[i].SetNull();
+        for (unsigned int i = 0; i < txTmp.vin.size(); i++)
+            if (i != nIn)
+                txTmp.vin[i].nSequence = 0;
+    }
+    if (nHashType & SIGHASH_ANYONECANPAY)
+    {
+        txTmp.vin[0] = txTmp.vin[nIn];
+        txTmp.vin.resize(1);
+    }
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTmp << nHashType;
+    return Hash(ss.begin(), ss.end());
+}
+
+BOOST_AUTO_TEST_CASE(script_SignatureHash)
+{
+    const int nHashTypes[] = { SIGHASH_ALL, SIGHASH_NONE, SIGHASH_SINGLE, 0 };
+    CScript scriptCode = CScript() << OP_DUP << OP_CODESEPARATOR << OP_HASH160 << OP_EQUALVERIFY << OP_CHECKSIG;
+    for (int nVersion = 1; nVersion <= CTransaction::VERSION_WITH_INFO; nVersion++)
+    {
+        CTransaction txTo;
+        txTo.nVersion = nVersion;
+        txTo.nLockTime = 12345;
+        txTo.strTxInfo = "info";
+        txTo.vin.resize(3);
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        {
+            txTo.vin[i].prevout = COutPoint(GetRandHash(), i);
+            txTo.vin[i].scriptSig = CScript() << OP_1 << i;
+            txTo.vin[i].nSequence = i;
+        }
+        txTo.vout.resize(2);
+        for (unsigned int i = 0; i < txTo.vout.size(); i++)
+        {
+            txTo.vout[i].nValue = (i+1) * COIN;
+            txTo.vout[i].scriptPubKey = CScript() << OP_2 << i;
+        }
+
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++)
+            BOOST_FOREACH(int nHashType, nHashTypes)
+            {
+                BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType) == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+                BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType | SIGHASH_ANYONECANPAY) == SignatureHashOld(scriptCode, txTo, nIn, nHashType | SIGHASH_ANYONECANPAY));
+            }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_SignatureHashCache)
+{
+    CScript scriptCode = CScript() << OP_DUP << OP_CODESEPARATOR << OP_HASH160 << OP_EQUALVERIFY << OP_CHECKSIG;
+    for (int nTest = 0; nTest < 200; nTest++)
+    {
+        CTransaction txTo;
+        txTo.nVersion = 1 + GetRandInt(CTransaction::VERSION_WITH_INFO);
+        txTo.nTime = GetRand(1 << 30);
+        txTo.nLockTime = GetRand(1 << 30);
+        txTo.strTxInfo = string(GetRandInt(300), 'i');
+        txTo.vin.resize(1 + GetRandInt(300));
+        for (unsigned int i = 0; i < txTo.vin.size(); i++)
+        {
+            txTo.vin[i].prevout = COutPoint(GetRandHash(), GetRandInt(10));
+            txTo.vin[i].scriptSig = CScript() << OP_1 << i;
+            txTo.vin[i].nSequence = GetRandInt(3) ? 0xffffffff : GetRandInt(1000);
+        }
+        txTo.vout.resize(GetRandInt(300));
+        for (unsigned int i = 0; i < txTo.vout.size(); i++)
+        {
+            txTo.vout[i].nValue = GetRand(100 * COIN);
+            txTo.vout[i].scriptPubKey = CScript() << OP_2 << i;
+        }
+
+        CSignatureHashCache cache(txTo);
+        // The cache must not read the scripts it was built over
+        txTo.vin[0].scriptSig = CScript() << OP_3;
+        for (int nCheck = 0; nCheck < 10; nCheck++)
+        {
+            unsigned int nIn = GetRandInt(txTo.vin.size());
+            int nHashType = GetRandInt(256);
+            BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &cache) == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+            BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, SIGHASH_ALL, &cache) == SignatureHashOld(scriptCode, txTo, nIn, SIGHASH_ALL));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(script_Solver_standard)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    vector<unsigned char> vchPubKey = key.GetPubKey().Raw();
+    vector<valtype> solutions;
+    txnouttype whichType;
+
+    CScript p2pkh;
+    p2pkh << OP_DUP << OP_HASH160 << key.GetPubKey().GetID() << OP_EQUALVERIFY << OP_CHECKSIG;
+    BOOST_CHECK(Solver(p2pkh, whichType, solutions));
+    BOOST_CHECK(whichType == TX_PUBKEYHASH);
+    BOOST_CHECK(solutions.size() == 1 && uint160(solutions[0]) == key.GetPubKey().GetID());
+
+    CScript p2pk;
+    p2pk << vchPubKey << OP_CHECKSIG;
+    BOOST_CHECK(Solver(p2pk, whichType, solutions));
+    BOOST_CHECK(whichType == TX_PUBKEY);
+    BOOST_CHECK(solutions.size() == 1 && solutions[0] == vchPubKey);
+
+    // The same key pushed with OP_PUSHDATA1 is only matched by the templates
+    CScript p2pkPushData;
+    p2pkPushData << OP_PUSHDATA1;
+    p2pkPushData.push_back(vchPubKey.size());
+    p2pkPushData.insert(p2pkPushData.end(), vchPubKey.begin(), vchPubKey.end());
+    p2pkPushData << OP_CHECKSIG;
+    BOOST_CHECK(Solver(p2pkPushData, whichType, solutions));
+    BOOST_CHECK(whichType == TX_PUBKEY);
+    BOOST_CHECK(solutions.size() == 1 && solutions[0] == vchPubKey);
+
+    // Anything after the standard form makes it nonstandard
+    CScript p2pkhExtra = p2pkh;
+    p2pkhExtra << OP_NOP;
+    BOOST_CHECK(!Solver(p2pkhExtra, whichType, solutions));
+    BOOST_CHECK(whichType == TX_NONSTANDARD);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
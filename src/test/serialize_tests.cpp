@@ -0,0 +1,181 @@
+//
+// Unit tests for deserializing what peers send
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "dions.h"
+#include "protocol.h"
+#include "util.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+// A message that says it holds nCount elements and holds nothing else
+static CDataStream ClaimedSize(uint64_t nCount)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(ss, nCount);
+    return ss;
+}
+
+template<typename T>
+static bool UnserializeFails(CDataStream ss, T& obj)
+{
+    try
+    {
+        ss >> obj;
+    }
+    catch (std::ios_base::failure& e)
+    {
+        return true;
+    }
+    return false;
+}
+
+// Heap in use, 0 where glibc can't say
+static size_t GetHeapUsage()
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 info = mallinfo2();
+#else
+    struct mallinfo info = mallinfo();
+#endif
+    return (size_t)info.uordblks + (size_t)info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static CTransaction SampleTransaction()
+{
+    vector<unsigned char> vchAlias = vchFromString("fuzz");
+    CTransaction tx;
+    tx.nTime = 1400000000;
+    tx.vin.push_back(CTxIn(uint256(1), 0, CScript() << vector<unsigned char>(72, 0x30) << vector<unsigned char>(33, 0x02)));
+    tx.vin.push_back(CTxIn(uint256(2), 1));
+    tx.vout.push_back(CTxOut(COIN, CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG));
+    tx.vout.push_back(CTxOut(CENT, CScript() << OP_ALIAS_SET << vchAlias << vchFromString("value") << OP_2DROP << OP_DROP << OP_TRUE));
+    return tx;
+}
+
+// Every kind of payload ProcessMessage reads, mutated at random; the worst
+// input of each kind is reported and has to stay cheap
+template<typename T>
+static void FuzzUnserialize(const char* pszName, const CDataStream& ssValid, int nRounds)
+{
+    int64_t nWorstMicros = 0;
+    size_t nWorstHeap = 0;
+    for (int i = 0; i < nRounds; i++)
+    {
+        CDataStream ss(ssValid);
+        int nMutations = 1 + insecure_rand() % 4;
+        for (int j = 0; j < nMutations && !ss.empty(); j++)
+        {
+            unsigned int nPos = insecure_rand() % ss.size();
+            switch (insecure_rand() % 4)
+            {
+            case 0: ss[nPos] ^= 1 << (insecure_rand() % 8); break;
+            // A first byte that makes a compact size of whatever follows
+            case 1: ss[nPos] = 0xfe; break;
+            case 2: ss[nPos] = insecure_rand(); break;
+            case 3: ss.resize(nPos); break;
+            }
+        }
+
+        size_t nHeapBefore = GetHeapUsage();
+        int64_t nStart = GetTimeMicros();
+        T obj;
+        UnserializeFails(ss, obj);
+        nWorstMicros = max(nWorstMicros, GetTimeMicros() - nStart);
+        size_t nHeapAfter = GetHeapUsage();
+        if (nHeapAfter > nHeapBefore)
+            nWorstHeap = max(nWorstHeap, nHeapAfter - nHeapBefore);
+    }
+    BOOST_TEST_MESSAGE(strprintf("%s: %u bytes, worst of %d inputs %"PRId64"us and %u bytes of heap",
+        pszName, (unsigned int)ssValid.size(), nRounds, nWorstMicros, (unsigned int)nWorstHeap));
+    BOOST_CHECK_MESSAGE(nWorstMicros < 1000000, pszName);
+    BOOST_CHECK_MESSAGE(nWorstHeap < 1000000, pszName);
+}
+
+BOOST_AUTO_TEST_SUITE(serialize_tests)
+
+BOOST_AUTO_TEST_CASE(serialize_claimed_size)
+{
+    // Nothing is allocated for elements the message can't hold
+    vector<unsigned char> vch;
+    BOOST_CHECK(UnserializeFails(ClaimedSize(MAX_SIZE), vch));
+    BOOST_CHECK_EQUAL(vch.capacity(), 0U);
+
+    string str;
+    BOOST_CHECK(UnserializeFails(ClaimedSize(MAX_SIZE), str));
+    BOOST_CHECK(str.capacity() < 1000);
+
+    vector<CTransaction> vtx;
+    BOOST_CHECK(UnserializeFails(ClaimedSize(MAX_SIZE), vtx));
+    BOOST_CHECK_EQUAL(vtx.capacity(), 0U);
+
+    vector<CAddress> vAddr;
+    BOOST_CHECK(UnserializeFails(ClaimedSize(MAX_SIZE), vAddr));
+    BOOST_CHECK_EQUAL(vAddr.capacity(), 0U);
+
+    vector<CInv> vInv;
+    BOOST_CHECK(UnserializeFails(ClaimedSize(1000), vInv));
+    BOOST_CHECK_EQUAL(vInv.capacity(), 0U);
+
+    CBlock block;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block.nVersion << block.hashPrevBlock << block.hashMerkleRoot << block.nTime << block.nBits << block.nNonce;
+    WriteCompactSize(ssBlock, MAX_SIZE);
+    BOOST_CHECK(UnserializeFails(ssBlock, block));
+    BOOST_CHECK_EQUAL(block.vtx.capacity(), 0U);
+
+    // Sizes the data does cover still read
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << vector<unsigned char>(100, 'x');
+    BOOST_CHECK(!UnserializeFails(ss, vch));
+    BOOST_CHECK_EQUAL(vch.size(), 100U);
+}
+
+BOOST_AUTO_TEST_CASE(serialize_fuzz_corpus)
+{
+    seed_insecure_rand(true);
+
+    CTransaction tx = SampleTransaction();
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    FuzzUnserialize<CTransaction>("tx", ssTx, 2000);
+
+    CBlock block;
+    block.nTime = tx.nTime;
+    for (int i = 0; i < 4; i++)
+        block.vtx.push_back(tx);
+    block.vchBlockSig = vector<unsigned char>(72, 0x30);
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    FuzzUnserialize<CBlock>("block", ssBlock, 1000);
+
+    vector<CAddress> vAddr;
+    for (int i = 0; i < 10; i++)
+        vAddr.push_back(CAddress(CService(CNetAddr("10.0.0.1"), 33764 + i)));
+    CDataStream ssAddr(SER_NETWORK, PROTOCOL_VERSION);
+    ssAddr << vAddr;
+    FuzzUnserialize<vector<CAddress> >("addr", ssAddr, 2000);
+
+    vector<CInv> vInv;
+    for (int i = 0; i < 10; i++)
+        vInv.push_back(CInv(MSG_TX, uint256(i)));
+    CDataStream ssInv(SER_NETWORK, PROTOCOL_VERSION);
+    ssInv << vInv;
+    FuzzUnserialize<vector<CInv> >("inv", ssInv, 2000);
+
+    CDataStream ssScript(SER_NETWORK, PROTOCOL_VERSION);
+    ssScript << tx.vout[1].scriptPubKey;
+    FuzzUnserialize<CScript>("alias script", ssScript, 2000);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
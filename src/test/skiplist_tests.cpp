@@ -0,0 +1,93 @@
+#include <boost/test/unit_test.hpp>
+
+#include <vector>
+
+#include "main.h"
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i = 0; i < SKIPLIST_LENGTH; i++)
+    {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i = 0; i < SKIPLIST_LENGTH; i++)
+    {
+        if (i > 0)
+        {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        }
+        else
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+    }
+
+    for (int i = 0; i < 1000; i++)
+    {
+        int from = GetRand(SKIPLIST_LENGTH - 1);
+        int to = GetRand(from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+// The locator walk of the skip list alone
+static std::vector<uint256> LocatorBySkipList(const CBlockIndex* pindex)
+{
+    std::vector<uint256> vHave;
+    int nStep = 1;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        pindex = pindex->GetAncestor(pindex->nHeight - nStep);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    return vHave;
+}
+
+BOOST_AUTO_TEST_CASE(skiplist_locator)
+{
+    // A main chain, and a branch off it at height 5000
+    const int nLength = 10000, nBranch = 50;
+    std::vector<CBlockIndex> vIndex(nLength + nBranch);
+    std::vector<uint256> vHash(nLength + nBranch);
+    for (int i = 0; i < nLength + nBranch; i++)
+    {
+        vHash[i] = uint256(i + 1);
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].nHeight = i < nLength ? i : 5000 + (i - nLength) + 1;
+        vIndex[i].pprev = i == 0 ? NULL : (i == nLength ? &vIndex[5000] : &vIndex[i - 1]);
+        vIndex[i].BuildSkip();
+    }
+
+    std::vector<CBlockIndex*> vChainSaved;
+    vChainSaved.swap(vChainActive);
+    for (int i = 0; i < nLength; i++)
+        vChainActive.push_back(&vIndex[i]);
+
+    const CBlockIndex* tips[] = { &vIndex[nLength - 1], &vIndex[nLength + nBranch - 1], &vIndex[7], &vIndex[0] };
+    for (unsigned int i = 0; i < sizeof(tips) / sizeof(tips[0]); i++)
+    {
+        std::vector<uint256> vHave;
+        AppendLocatorHashes(vHave, tips[i], 1);
+        BOOST_CHECK(vHave == LocatorBySkipList(tips[i]));
+    }
+
+    vChainActive.swap(vChainSaved);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
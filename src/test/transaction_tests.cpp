@@ -261,4 +261,66 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_UnspentApplyTo)
+{
+    CTransaction txStake;
+    txStake.nTime = 1400000000;
+    txStake.vin.resize(1);
+    txStake.vin[0].prevout.hash = GetRandHash();
+    txStake.vin[0].prevout.n = 0;
+    txStake.vout.resize(3);
+    txStake.vout[0].SetEmpty();
+    txStake.vout[1].nValue = 10*CENT;
+    txStake.vout[1].scriptPubKey << OP_1;
+    txStake.vout[2].nValue = 11*CENT;
+    txStake.vout[2].scriptPubKey << OP_2;
+    BOOST_CHECK(txStake.IsCoinStake());
+
+    CUnspent unspent(txStake, 2, 100);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << unspent;
+    CUnspent unspentRead;
+    ss >> unspentRead;
+    BOOST_CHECK(unspentRead.IsCoinStake());
+    BOOST_CHECK(!unspentRead.IsCoinBase());
+    BOOST_CHECK_EQUAL(unspentRead.nHeight, 100);
+
+    CTransaction txPrev;
+    unspentRead.ApplyTo(txPrev, 2);
+    BOOST_CHECK(txPrev.IsCoinStake());
+    BOOST_CHECK_EQUAL(txPrev.nTime, txStake.nTime);
+    BOOST_CHECK_EQUAL(txPrev.vout.size(), txStake.vout.size());
+    BOOST_CHECK(txPrev.vout[2] == txStake.vout[2]);
+}
+
+BOOST_AUTO_TEST_CASE(test_TxIndexCompact)
+{
+    CDiskTxPos pos(3, 1000000, 1000200);
+    CTxIndex txindex(pos, 20);
+    txindex.vSpent[0] = CDiskTxPos(3, 1000000, 1000900);
+    txindex.vSpent[7] = CDiskTxPos(3, 2500000, 2500081);
+    txindex.vSpent[19] = CDiskTxPos(5, 10, 90);
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txindex;
+    CTxIndex txindexRead;
+    ss >> txindexRead;
+    BOOST_CHECK(txindexRead == txindex);
+
+    // Fully spent and unspent records skip the bitmap
+    for (unsigned int i = 0; i < txindex.vSpent.size(); i++)
+        txindex.vSpent[i] = CDiskTxPos(3, 1200000, 1200000 + i);
+    ss << txindex;
+    unsigned int nCompactSize = ss.size();
+    ss >> txindexRead;
+    BOOST_CHECK(txindexRead == txindex);
+
+    // Old records with a full position per output are still readable
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << (int)CLIENT_VERSION << txindex.pos << txindex.vSpent;
+    BOOST_CHECK(nCompactSize < ssLegacy.size());
+    ssLegacy >> txindexRead;
+    BOOST_CHECK(txindexRead == txindex);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -15,4 +15,48 @@ BOOST_AUTO_TEST_CASE(uint256_equality)
     BOOST_CHECK(num1+num2 == num3+num2);
 }
 
+BOOST_AUTO_TEST_CASE(uint256_compact)
+{
+    bool fNegative, fOverflow;
+    uint256 num;
+    num.SetCompact(0x1d00ffff, &fNegative, &fOverflow);
+    BOOST_CHECK(num == uint256("00000000ffff0000000000000000000000000000000000000000000000000000"));
+    BOOST_CHECK(!fNegative && !fOverflow);
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x1d00ffffU);
+
+    // The mantissa's top bit is the sign
+    num.SetCompact(0x04923456, &fNegative, &fOverflow);
+    BOOST_CHECK(fNegative && !fOverflow);
+    BOOST_CHECK_EQUAL(num.GetCompact(true), 0x04923456U);
+    num = 0x80;
+    BOOST_CHECK_EQUAL(num.GetCompact(), 0x02008000U);
+
+    num.SetCompact(0x22000100, &fNegative, &fOverflow);
+    BOOST_CHECK(fOverflow);
+    num.SetCompact(0x2100ffff, &fNegative, &fOverflow);
+    BOOST_CHECK(!fOverflow);
+}
+
+BOOST_AUTO_TEST_CASE(uint256_muldiv)
+{
+    uint256 num = ~uint256(0) >> 20;
+    uint256 num2 = num;
+    num2 *= 1020U;
+    num2 /= uint256(1020);
+    BOOST_CHECK(num2 == num);
+
+    num2 = num;
+    num2 *= uint256(3);
+    BOOST_CHECK(num2 == num + num + num);
+    num2 /= num;
+    BOOST_CHECK(num2 == 3);
+
+    // Rounds down, and a zero divisor gives zero
+    num2 = 7;
+    num2 /= uint256(2);
+    BOOST_CHECK(num2 == 3);
+    num2 /= uint256(0);
+    BOOST_CHECK(num2 == 0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
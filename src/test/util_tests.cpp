@@ -53,6 +53,18 @@ BOOST_AUTO_TEST_CASE(util_MedianFilter)
 
     filter.input(0); // [0 3 7 18 30]
     BOOST_CHECK_EQUAL(filter.median(), 7);
+
+    // Evicting one of several equal values leaves the others in place
+    filter.input(7); // [0 3 7 7 18]
+    filter.input(7); // [0 7 7 7 18]
+    filter.input(7); // [0 7 7 7 18]
+    BOOST_CHECK_EQUAL(filter.median(), 7);
+    filter.input(40); // [0 7 7 7 40]
+    filter.input(40); // [7 7 7 40 40]
+    filter.input(40); // [7 7 40 40 40]
+    BOOST_CHECK_EQUAL(filter.median(), 40);
+    BOOST_CHECK_EQUAL(filter.sorted().size(), 5U);
+    BOOST_CHECK_EQUAL(filter.sorted().front(), 7);
 }
 
 static const unsigned char ParseHex_expected[65] = {
@@ -323,4 +335,49 @@ BOOST_AUTO_TEST_CASE(util_seed_insecure_rand)
     }
 }
 
+BOOST_AUTO_TEST_CASE(util_Hash64)
+{
+    unsigned char vch[64];
+    for (int i = 0; i < 64; i++)
+        vch[i] = i * 7;
+    BOOST_CHECK(Hash64(vch) == Hash(vch, vch + 64));
+    memset(vch, 0, sizeof(vch));
+    BOOST_CHECK(Hash64(vch) == Hash(vch, vch + 64));
+}
+
+BOOST_AUTO_TEST_CASE(util_SipHashBytes)
+{
+    // Reference vectors of SipHash-2-4, keyed with bytes 00..0f
+    uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0f0e0d0c0b0a0908ULL;
+    unsigned char vch[32];
+    for (int i = 0; i < 32; i++)
+        vch[i] = i;
+    BOOST_CHECK_EQUAL(SipHashBytes(k0, k1, vch, 0), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(SipHashBytes(k0, k1, vch, 15), 0xa129ca6149be45e5ULL);
+
+    // The same as SipHashUint256 over the value's bytes
+    uint256 hash;
+    memcpy(hash.begin(), vch, 32);
+    BOOST_CHECK_EQUAL(SipHashBytes(k0, k1, vch, 32), SipHashUint256(k0, k1, hash));
+}
+
+BOOST_AUTO_TEST_CASE(util_ParseCPUList)
+{
+    std::vector<int> vCPUs;
+    BOOST_CHECK(ParseCPUList("3", vCPUs));
+    BOOST_CHECK(vCPUs.size() == 1 && vCPUs[0] == 3);
+
+    // Ranges and single CPUs, sorted and without duplicates
+    BOOST_CHECK(ParseCPUList("6,0-2,1", vCPUs));
+    BOOST_CHECK_EQUAL(vCPUs.size(), 4U);
+    BOOST_CHECK(vCPUs[0] == 0 && vCPUs[1] == 1 && vCPUs[2] == 2 && vCPUs[3] == 6);
+
+    BOOST_CHECK(!ParseCPUList("", vCPUs));
+    BOOST_CHECK(!ParseCPUList("2-1", vCPUs));
+    BOOST_CHECK(!ParseCPUList("-1", vCPUs));
+    BOOST_CHECK(!ParseCPUList("1,", vCPUs));
+    BOOST_CHECK(!ParseCPUList("1x", vCPUs));
+    BOOST_CHECK(!ParseCPUList("0-3x", vCPUs));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,9 +3,11 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <list>
 #include <map>
 
 #include <boost/version.hpp>
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
@@ -14,31 +16,208 @@
 #include <leveldb/filter_policy.h>
 #include <memenv/memenv.h>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "kernel.h"
+#include "chainsnapshot.h"
 #include "checkpoints.h"
+#include "metrics.h"
 #include "txdb.h"
 #include "util.h"
 #include "main.h"
+#include "ui_interface.h"
 
 using namespace std;
 using namespace boost;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
-static leveldb::Options GetOptions() {
+// Block index records live in their own instance when kept apart
+// (-splitblockindex), so that compactions of the much busier tx index don't
+// stall the block index scan at startup. NULL when everything is in txdb.
+static leveldb::DB *blkindexdb;
+static leveldb::Options blkindexOptions;
+
+// Write-back cache shared by all CTxDB instances. Every key read or written
+// through CTxDB outside of a batch lands here; committed batches are applied
+// to it instead of to LevelDB. Dirty entries are written out together once
+// the cache grows past its budget, when we are caught up with the network, or
+// on shutdown, so that initial sync and reindex do a few large sequential
+// writes instead of one synchronous LevelDB commit per block. The on-disk
+// state is always an older but consistent snapshot, since a flush writes
+// everything including hashBestChain in one batch.
+struct CTxDBCacheEntry
+{
+    std::string strValue;
+    bool fErased;
+    bool fDirty;
+
+    CTxDBCacheEntry() : fErased(false), fDirty(false) {}
+};
+
+static CCriticalSection cs_txdbcache;
+static std::map<std::string, CTxDBCacheEntry> mapTxDBCache;
+static uint64_t nTxDBCacheUsage = 0;
+static uint64_t nTxDBCacheDirty = 0;
+static uint64_t nTxDBCacheLimit = 0;
+static uint64_t nTxDBCacheHits = 0;
+static uint64_t nTxDBCacheMisses = 0;
+static uint64_t nTxDBCacheFlushes = 0;
+static int64_t nTxDBCacheFlushMillis = 0;
+// Block cache plus current and compacting memtables, of each instance
+static uint64_t nTxDBLevelDBMemory = 0;
+static uint64_t nBlockIndexLevelDBMemory = 0;
+
+// Rough per-entry overhead of the map node and strings
+static const unsigned int TXDB_CACHE_ENTRY_OVERHEAD = 96;
+
+static uint64_t CacheEntryUsage(const std::string& key, const CTxDBCacheEntry& entry)
+{
+    return key.size() + entry.strValue.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+}
+
+static void CacheStore(const std::string& key, const std::string& value, bool fErased, bool fDirty)
+{
+    std::map<std::string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.find(key);
+    if (mi == mapTxDBCache.end())
+        mi = mapTxDBCache.insert(std::make_pair(key, CTxDBCacheEntry())).first;
+    else
+    {
+        nTxDBCacheUsage -= CacheEntryUsage(key, mi->second);
+        if (mi->second.fDirty)
+            nTxDBCacheDirty -= CacheEntryUsage(key, mi->second);
+    }
+    CTxDBCacheEntry& entry = mi->second;
+    entry.strValue = value;
+    entry.fErased = fErased;
+    entry.fDirty = entry.fDirty || fDirty;
+    nTxDBCacheUsage += CacheEntryUsage(key, entry);
+    if (entry.fDirty)
+        nTxDBCacheDirty += CacheEntryUsage(key, entry);
+}
+
+static leveldb::Options GetOptions(bool fBlockIndex = false) {
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    options.max_open_files = GetArg("-dbmaxopenfiles", 1000);
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    // LevelDB keeps each trigger at least as high as the one before it
+    options.l0_compaction_trigger = GetArg("-dbcompactiontrigger", options.l0_compaction_trigger);
+    options.l0_slowdown_writes_trigger = GetArg("-dbslowdowntrigger", options.l0_slowdown_writes_trigger);
+    options.l0_stop_writes_trigger = GetArg("-dbstoptrigger", options.l0_stop_writes_trigger);
+
+    if (fBlockIndex)
+    {
+        // Read in one sequential pass at startup and only written a record
+        // at a time afterwards, as everything lives in mapBlockIndex once
+        // loaded: large blocks, a small cache and no bloom filter.
+        options.block_cache = leveldb::NewLRUCache(1048576);
+        options.block_size = 64 * 1024;
+        LOCK(cs_txdbcache);
+        nBlockIndexLevelDBMemory = 1048576 + 2 * options.write_buffer_size;
+        return options;
+    }
+
+    // -dbcache is split between LevelDB's own block cache and our write-back
+    // cache, which gets the larger share as it absorbs most of the traffic.
+    int64_t nCacheSizeMB = GetArg("-dbcache", 25);
+    if (nCacheSizeMB < 4)
+        nCacheSizeMB = 4;
+    options.block_cache = leveldb::NewLRUCache((nCacheSizeMB / 4) * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.write_buffer_size = max((int64_t)1, GetArg("-dbwritebuffer", 4)) * 1048576;
+    options.block_size = max((int64_t)1, GetArg("-dbblocksize", 4)) * 1024;
+    {
+        LOCK(cs_txdbcache);
+        nTxDBCacheLimit = (nCacheSizeMB - nCacheSizeMB / 4) * 1048576;
+        nTxDBLevelDBMemory = (nCacheSizeMB / 4) * 1048576 + 2 * options.write_buffer_size;
+    }
     return options;
 }
 
+static bool IsBlockIndexKey(const std::string& key)
+{
+    static std::string strPrefix;
+    if (strPrefix.empty())
+    {
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << string("blockindex");
+        strPrefix = ss.str();
+    }
+    return key.compare(0, strPrefix.size(), strPrefix) == 0;
+}
+
+// Instance holding the given key
+static leveldb::DB* DBForKey(const std::string& key)
+{
+    return (blkindexdb && IsBlockIndexKey(key)) ? blkindexdb : txdb;
+}
+
+// Move block index records left in txdb over to blkindexdb. They are copied
+// first and only then deleted, so an interrupted move is finished on the
+// next start.
+static void MoveBlockIndexRecords()
+{
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    unsigned int nMoved = 0;
+    while (true)
+    {
+        leveldb::WriteBatch batchCopy, batchErase;
+        unsigned int nBatch = 0;
+        leveldb::Iterator *iterator = txdb->NewIterator(leveldb::ReadOptions());
+        for (iterator->Seek(ssStartKey.str()); iterator->Valid() && nBatch < 10000; iterator->Next())
+        {
+            std::string strKey = iterator->key().ToString();
+            if (!IsBlockIndexKey(strKey))
+                break;
+            batchCopy.Put(strKey, iterator->value());
+            batchErase.Delete(strKey);
+            nBatch++;
+        }
+        delete iterator;
+        if (nBatch == 0)
+            break;
+
+        leveldb::Status status = blkindexdb->Write(writeOptions, &batchCopy);
+        if (status.ok())
+            status = txdb->Write(writeOptions, &batchErase);
+        if (!status.ok())
+            throw runtime_error(strprintf("MoveBlockIndexRecords() : %s", status.ToString().c_str()));
+        nMoved += nBatch;
+    }
+    if (nMoved > 0)
+        printf("Moved %u block index records to the block index database\n", nMoved);
+}
+
+static void OpenBlockIndexDB()
+{
+    filesystem::path directory = GetDataDir() / "blkindexleveldb";
+    filesystem::create_directory(directory);
+    blkindexOptions = GetOptions(true);
+    blkindexOptions.create_if_missing = true;
+    printf("Opening LevelDB in %s\n", directory.string().c_str());
+    leveldb::Status status = leveldb::DB::Open(blkindexOptions, directory.string(), &blkindexdb);
+    if (!status.ok()) {
+        throw runtime_error(strprintf("OpenBlockIndexDB(): error opening database environment %s", status.ToString().c_str()));
+    }
+    MoveBlockIndexRecords();
+}
+
 void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
     // First time init.
     filesystem::path directory = GetDataDir() / "txleveldb";
 
     if (fRemoveOld) {
         filesystem::remove_all(directory); // remove directory
+        filesystem::remove_all(GetDataDir() / "blkindexleveldb");
         unsigned int nFile = 1;
 
         while (true)
@@ -80,7 +259,6 @@ CTxDB::CTxDB(const char* pszMode)
 
     options = GetOptions();
     options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
 
     init_blockindex(options); // Init directory
     pdb = txdb;
@@ -99,6 +277,11 @@ CTxDB::CTxDB(const char* pszMode)
             txdb = pdb = NULL;
             delete activeBatch;
             activeBatch = NULL;
+            {
+                LOCK(cs_txdbcache);
+                mapTxDBCache.clear();
+                nTxDBCacheUsage = nTxDBCacheDirty = 0;
+            }
 
             init_blockindex(options, true); // Remove directory and create new database
             pdb = txdb;
@@ -117,13 +300,22 @@ CTxDB::CTxDB(const char* pszMode)
         fReadOnly = fTmp;
     }
 
+    // Once split off, the block index stays apart even without the option
+    if (GetBoolArg("-splitblockindex") || filesystem::exists(GetDataDir() / "blkindexleveldb"))
+        OpenBlockIndexDB();
+
     printf("Opened LevelDB successfully\n");
 }
 
 void CTxDB::Close()
 {
+    Flush(true);
     delete txdb;
     txdb = pdb = NULL;
+    delete blkindexdb;
+    blkindexdb = NULL;
+    delete blkindexOptions.block_cache;
+    blkindexOptions.block_cache = NULL;
     delete options.filter_policy;
     options.filter_policy = NULL;
     delete options.block_cache;
@@ -139,19 +331,349 @@ bool CTxDB::TxnBegin()
     return true;
 }
 
+// Applies a committed batch to the write-back cache
+class CBatchCacheWriter : public leveldb::WriteBatch::Handler {
+public:
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        CacheStore(key.ToString(), value.ToString(), false, true);
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        CacheStore(key.ToString(), std::string(), true, true);
+    }
+};
+
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
-    if (!status.ok()) {
-        printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
+    bool fFlush;
+    {
+        LOCK(cs_txdbcache);
+        CBatchCacheWriter writer;
+        leveldb::Status status = activeBatch->Iterate(&writer);
+        delete activeBatch;
+        activeBatch = NULL;
+        if (!status.ok()) {
+            printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
+            return false;
+        }
+        fFlush = (nTxDBCacheUsage > nTxDBCacheLimit);
+    }
+    if (fFlush || !IsInitialBlockDownload())
+        return Flush(fFlush);
+    return true;
+}
+
+// A stream that has grown past this gives its buffer back
+static const unsigned int MAX_SCRATCH_STREAM_SIZE = 1000000;
+
+static boost::thread_specific_ptr<CDataStream> pssScratchKey;
+static boost::thread_specific_ptr<CDataStream> pssScratchValue;
+
+static CDataStream& GetScratchStream(boost::thread_specific_ptr<CDataStream>& pss, int nVersion)
+{
+    if (!pss.get() || pss->capacity() > MAX_SCRATCH_STREAM_SIZE)
+        pss.reset(new CDataStream(SER_DISK, nVersion));
+    pss->clear();
+    pss->clear(0);
+    pss->nVersion = nVersion;
+    return *pss;
+}
+
+CDataStream& CTxDB::ScratchKeyStream()
+{
+    return GetScratchStream(pssScratchKey, CLIENT_VERSION);
+}
+
+CDataStream& CTxDB::ScratchValueStream(int nVersion)
+{
+    return GetScratchStream(pssScratchValue, nVersion);
+}
+
+bool CTxDB::ReadRaw(const std::string &key, std::string &value)
+{
+    {
+        LOCK(cs_txdbcache);
+        std::map<std::string, CTxDBCacheEntry>::const_iterator mi = mapTxDBCache.find(key);
+        if (mi != mapTxDBCache.end())
+        {
+            nTxDBCacheHits++;
+            if (mi->second.fErased)
+                return false;
+            value = mi->second.strValue;
+            return true;
+        }
+        nTxDBCacheMisses++;
+    }
+
+    leveldb::Status status = DBForKey(key)->Get(leveldb::ReadOptions(), key, &value);
+    if (!status.ok() && !status.IsNotFound()) {
+        // Some unexpected error.
+        printf("LevelDB read failure: %s\n", status.ToString().c_str());
+        return false;
+    }
+
+    // Remember misses as well, most lookups of new transactions find nothing
+    LOCK(cs_txdbcache);
+    if (!mapTxDBCache.count(key))
+        CacheStore(key, status.ok() ? value : std::string(), !status.ok(), false);
+    return status.ok();
+}
+
+bool CTxDB::WriteRaw(const std::string &key, const std::string &value)
+{
+    {
+        LOCK(cs_txdbcache);
+        CacheStore(key, value, false, true);
+        if (nTxDBCacheUsage <= nTxDBCacheLimit)
+            return true;
+    }
+    return Flush(true);
+}
+
+bool CTxDB::EraseRaw(const std::string &key)
+{
+    {
+        LOCK(cs_txdbcache);
+        CacheStore(key, std::string(), true, true);
+        if (nTxDBCacheUsage <= nTxDBCacheLimit)
+            return true;
+    }
+    return Flush(true);
+}
+
+bool CTxDB::ScanRaw(const std::string &strFrom, const std::string &strTo, std::vector<std::pair<std::string, std::string> > &vRet)
+{
+    vRet.clear();
+    if (!pdb)
+        return false;
+
+    // Hold the cache for the whole scan so a concurrent flush can't move
+    // entries from it to disk between the two cursors
+    LOCK(cs_txdbcache);
+    std::map<std::string, CTxDBCacheEntry>::const_iterator mi = mapTxDBCache.lower_bound(strFrom);
+    leveldb::Iterator *iterator = DBForKey(strFrom)->NewIterator(leveldb::ReadOptions());
+    iterator->Seek(strFrom);
+    leveldb::Slice sliceTo(strTo);
+    while (true)
+    {
+        bool fCache = (mi != mapTxDBCache.end() && mi->first < strTo);
+        bool fDisk = (iterator->Valid() && iterator->key().compare(sliceTo) < 0);
+        if (!fCache && !fDisk)
+            break;
+        // A cached entry, erased or not, shadows the same key on disk
+        int nCmp = !fCache ? 1 : !fDisk ? -1 : leveldb::Slice(mi->first).compare(iterator->key());
+        if (nCmp <= 0)
+        {
+            if (!mi->second.fErased)
+                vRet.push_back(std::make_pair(mi->first, mi->second.strValue));
+            if (nCmp == 0)
+                iterator->Next();
+            ++mi;
+        }
+        else
+        {
+            vRet.push_back(std::make_pair(iterator->key().ToString(), iterator->value().ToString()));
+            iterator->Next();
+        }
+    }
+    bool fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
+}
+
+bool CTxDB::Flush(bool fEvict)
+{
+    if (!txdb)
+        return false;
+
+    LOCK(cs_txdbcache);
+    if (nTxDBCacheDirty == 0 && !fEvict)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    // The blocks go to disk before the index entries that point at them
+    CommitBlockFiles();
+    leveldb::WriteBatch batch, batchBlockIndex;
+    unsigned int nWritten = 0, nWrittenBlockIndex = 0;
+    for (std::map<std::string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.begin(); mi != mapTxDBCache.end(); ++mi)
+    {
+        CTxDBCacheEntry& entry = mi->second;
+        if (!entry.fDirty)
+            continue;
+        bool fBlockIndex = (DBForKey(mi->first) != txdb);
+        leveldb::WriteBatch& batchFor = fBlockIndex ? batchBlockIndex : batch;
+        if (entry.fErased)
+            batchFor.Delete(mi->first);
+        else
+            batchFor.Put(mi->first, entry.strValue);
+        if (fBlockIndex)
+            nWrittenBlockIndex++;
+        else
+            nWritten++;
+    }
+
+    if (nWritten + nWrittenBlockIndex > 0)
+    {
+        leveldb::WriteOptions writeOptions;
+        writeOptions.sync = true;
+        // The block index goes first: entries for blocks the tx index hasn't
+        // caught up with are dropped by LoadBlockIndex, while hashBestChain,
+        // written with the tx index, never points past what is on disk
+        leveldb::Status status;
+        if (nWrittenBlockIndex > 0)
+            status = blkindexdb->Write(writeOptions, &batchBlockIndex);
+        if (status.ok() && nWritten > 0)
+            status = txdb->Write(writeOptions, &batch);
+        if (!status.ok()) {
+            printf("LevelDB cache flush failure: %s\n", status.ToString().c_str());
+            return false;
+        }
+        nTxDBCacheFlushes++;
+        nTxDBCacheFlushMillis += GetTimeMillis() - nStart;
+        nWritten += nWrittenBlockIndex;
+    }
+
+    if (fEvict)
+    {
+        mapTxDBCache.clear();
+        nTxDBCacheUsage = 0;
+    }
+    else
+    {
+        for (std::map<std::string, CTxDBCacheEntry>::iterator mi = mapTxDBCache.begin(); mi != mapTxDBCache.end(); ++mi)
+            mi->second.fDirty = false;
+    }
+    nTxDBCacheDirty = 0;
+
+    if (fDebug && nWritten > 0)
+        printf("CTxDB::Flush() : wrote %u entries in %"PRId64"ms\n", nWritten, GetTimeMillis() - nStart);
+    return true;
+}
+
+void CTxDB::GetCacheStats(CTxDBCacheStats& stats)
+{
+    LOCK(cs_txdbcache);
+    stats.nHits = nTxDBCacheHits;
+    stats.nMisses = nTxDBCacheMisses;
+    stats.nEntries = mapTxDBCache.size();
+    stats.nUsage = nTxDBCacheUsage;
+    stats.nDirtyUsage = nTxDBCacheDirty;
+    stats.nLimit = nTxDBCacheLimit;
+    stats.nFlushes = nTxDBCacheFlushes;
+    stats.nFlushMillis = nTxDBCacheFlushMillis;
+    stats.nLevelDBMemory = (txdb ? nTxDBLevelDBMemory : 0) + (blkindexdb ? nBlockIndexLevelDBMemory : 0);
+}
+
+static void GetLevelDBStats(leveldb::DB* db, const char* pszName, CLevelDBStats& stats)
+{
+    stats.strName = pszName;
+    stats.vLevels.clear();
+    string strValue;
+    // Asking for a level past the last one fails
+    while (db->GetProperty(strprintf("leveldb.num-files-at-level%"PRIszu, stats.vLevels.size()), &strValue))
+    {
+        stats.vLevels.push_back(CLevelDBLevelStats());
+        stats.vLevels.back().nFiles = atoi(strValue.c_str());
+    }
+
+    // Three header lines, then "level files size time read write" for each
+    // level that has files or has been compacted into
+    if (db->GetProperty("leveldb.stats", &strValue))
+    {
+        vector<string> vLines;
+        boost::split(vLines, strValue, boost::is_any_of("\n"));
+        for (unsigned int i = 3; i < vLines.size(); i++)
+        {
+            int nLevel, nFiles;
+            double dSize, dTime, dRead, dWrite;
+            if (sscanf(vLines[i].c_str(), "%d %d %lf %lf %lf %lf", &nLevel, &nFiles, &dSize, &dTime, &dRead, &dWrite) != 6 ||
+                nLevel < 0 || nLevel >= (int)stats.vLevels.size())
+                continue;
+            CLevelDBLevelStats& level = stats.vLevels[nLevel];
+            level.dSizeMB = dSize;
+            level.dCompactionSeconds = dTime;
+            level.dReadMB = dRead;
+            level.dWriteMB = dWrite;
+        }
+    }
+
+    unsigned long long nSlowdowns = 0, nWaits = 0, nMicros = 0;
+    if (db->GetProperty("leveldb.write-stalls", &strValue) &&
+        sscanf(strValue.c_str(), "%llu %llu %llu", &nSlowdowns, &nWaits, &nMicros) == 3)
+    {
+        stats.nStallSlowdowns = nSlowdowns;
+        stats.nStallWaits = nWaits;
+        stats.nStallMicros = nMicros;
+    }
+}
+
+void CTxDB::GetLevelDBStats(std::vector<CLevelDBStats>& vStats)
+{
+    vStats.clear();
+    if (txdb)
+    {
+        vStats.push_back(CLevelDBStats());
+        ::GetLevelDBStats(txdb, "txdb", vStats.back());
+    }
+    if (blkindexdb)
+    {
+        vStats.push_back(CLevelDBStats());
+        ::GetLevelDBStats(blkindexdb, "blkindexdb", vStats.back());
+    }
+}
+
+bool CTxDB::CompactLevelDB(std::string& strError)
+{
+    if (!txdb)
+    {
+        strError = "database not open";
         return false;
     }
+    int64_t nStart = GetTimeMillis();
+    // NULL to NULL is the whole key range, pushed down level by level
+    if (blkindexdb)
+        blkindexdb->CompactRange(NULL, NULL);
+    txdb->CompactRange(NULL, NULL);
+    printf("CTxDB::CompactLevelDB() : compacted in %"PRId64"ms\n", GetTimeMillis() - nStart);
     return true;
 }
 
+static void CollectTxDBMetrics(string& str)
+{
+    CTxDBCacheStats stats;
+    CTxDB::GetCacheStats(stats);
+    WriteMetricHeader(str, "iocoin_txdb_cache_hits_total", "Transaction index reads answered by the txdb cache.", METRIC_COUNTER);
+    str += strprintf("iocoin_txdb_cache_hits_total %"PRIu64"\n", stats.nHits);
+    WriteMetricHeader(str, "iocoin_txdb_cache_misses_total", "Transaction index reads that went to LevelDB.", METRIC_COUNTER);
+    str += strprintf("iocoin_txdb_cache_misses_total %"PRIu64"\n", stats.nMisses);
+    WriteMetricHeader(str, "iocoin_txdb_cache_usage_bytes", "Memory used by the txdb cache.", METRIC_GAUGE);
+    str += strprintf("iocoin_txdb_cache_usage_bytes %"PRIu64"\n", stats.nUsage);
+    WriteMetricHeader(str, "iocoin_txdb_flush_seconds_total", "Time spent writing the txdb cache to LevelDB.", METRIC_COUNTER);
+    str += strprintf("iocoin_txdb_flush_seconds_total %.3f\n", stats.nFlushMillis / 1000.0);
+
+    vector<CLevelDBStats> vStats;
+    CTxDB::GetLevelDBStats(vStats);
+    WriteMetricHeader(str, "iocoin_leveldb_level_files", "Table files in each LevelDB level.", METRIC_GAUGE);
+    BOOST_FOREACH(const CLevelDBStats& db, vStats)
+        for (unsigned int nLevel = 0; nLevel < db.vLevels.size(); nLevel++)
+            str += strprintf("iocoin_leveldb_level_files{db=\"%s\",level=\"%u\"} %d\n", db.strName.c_str(), nLevel, db.vLevels[nLevel].nFiles);
+    WriteMetricHeader(str, "iocoin_leveldb_compaction_seconds_total", "Time LevelDB spent compacting into each level.", METRIC_COUNTER);
+    BOOST_FOREACH(const CLevelDBStats& db, vStats)
+        for (unsigned int nLevel = 0; nLevel < db.vLevels.size(); nLevel++)
+            str += strprintf("iocoin_leveldb_compaction_seconds_total{db=\"%s\",level=\"%u\"} %.0f\n", db.strName.c_str(), nLevel, db.vLevels[nLevel].dCompactionSeconds);
+    WriteMetricHeader(str, "iocoin_leveldb_write_stalls_total", "Writes LevelDB delayed (slowdown) or held until a compaction finished (wait).", METRIC_COUNTER);
+    BOOST_FOREACH(const CLevelDBStats& db, vStats)
+    {
+        str += strprintf("iocoin_leveldb_write_stalls_total{db=\"%s\",kind=\"slowdown\"} %"PRIu64"\n", db.strName.c_str(), db.nStallSlowdowns);
+        str += strprintf("iocoin_leveldb_write_stalls_total{db=\"%s\",kind=\"wait\"} %"PRIu64"\n", db.strName.c_str(), db.nStallWaits);
+    }
+    WriteMetricHeader(str, "iocoin_leveldb_write_stall_seconds_total", "Time writers spent stalled by LevelDB.", METRIC_COUNTER);
+    BOOST_FOREACH(const CLevelDBStats& db, vStats)
+        str += strprintf("iocoin_leveldb_write_stall_seconds_total{db=\"%s\"} %.3f\n", db.strName.c_str(), db.nStallMicros / 1e6);
+}
+static CMetricsCollector collectTxDB(CollectTxDBMetrics);
+
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
     std::string needle;
@@ -252,129 +774,1116 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
     return ReadDiskTx(outpoint.hash, tx, txindex);
 }
 
-bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+bool CTxDB::ReadUnspent(const COutPoint& outpoint, CUnspent& unspent)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    unspent.SetNull();
+    return Read(make_pair(string("utxo"), outpoint), unspent);
 }
 
-bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+bool CTxDB::WriteUnspent(const COutPoint& outpoint, const CUnspent& unspent)
 {
-    return Read(string("hashBestChain"), hashBestChain);
+    return Write(make_pair(string("utxo"), outpoint), unspent);
 }
 
-bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+bool CTxDB::EraseUnspent(const COutPoint& outpoint)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    return Erase(make_pair(string("utxo"), outpoint));
 }
 
-bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+bool CTxDB::ReadBlockUndo(const uint256& hashBlock, CBlockUndo& undo)
 {
-    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    undo.vtxundo.clear();
+    return Read(make_pair(string("undo"), hashBlock), undo);
 }
 
-bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+bool CTxDB::WriteBlockUndo(const uint256& hashBlock, const CBlockUndo& undo)
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    return Write(make_pair(string("undo"), hashBlock), undo);
 }
 
-bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
+bool CTxDB::EraseBlockUndo(const uint256& hashBlock)
 {
-    return Read(string("hashSyncCheckpoint"), hashCheckpoint);
+    return Erase(make_pair(string("undo"), hashBlock));
 }
 
-bool CTxDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
+bool CTxDB::WriteAddressIndex(const CAddressIndexKey& key, int64_t nValue)
 {
-    return Write(string("hashSyncCheckpoint"), hashCheckpoint);
+    return Write(make_pair(string("addrtx"), key), nValue);
 }
 
-bool CTxDB::ReadCheckpointPubKey(string& strPubKey)
+bool CTxDB::EraseAddressIndex(const CAddressIndexKey& key)
 {
-    return Read(string("strCheckpointPubKey"), strPubKey);
+    return Erase(make_pair(string("addrtx"), key));
 }
 
-bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
+bool CTxDB::WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value)
 {
-    return Write(string("strCheckpointPubKey"), strPubKey);
+    return Write(make_pair(string("addrutxo"), key), value);
 }
 
-static CBlockIndex *InsertBlockIndex(uint256 hash)
+bool CTxDB::EraseAddressUnspent(const CAddressUnspentKey& key)
 {
-    if (hash == 0)
-        return NULL;
-
-    // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
-
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    return Erase(make_pair(string("addrutxo"), key));
+}
 
-    return pindexNew;
+// Key prefix of one script's records of the given type, with the height
+// appended big-endian as CAddressIndexKey writes it when nHeight >= 0
+static string AddressKeyPrefix(const char* pszType, const uint160& hashScript, int64_t nHeight = -1)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << string(pszType) << hashScript;
+    string strKey = ssKey.str();
+    if (nHeight >= 0)
+        for (int nShift = 24; nShift >= 0; nShift -= 8)
+            strKey.push_back((char)((nHeight >> nShift) & 0xff));
+    return strKey;
 }
 
-bool CTxDB::LoadBlockIndex()
+bool CTxDB::ReadAddressIndex(const uint160& hashScript, int nStart, int nEnd, vector<pair<CAddressIndexKey, int64_t> >& vRet)
 {
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
+    vRet.clear();
+    if (nStart < 0)
+        nStart = 0;
+    if (nEnd < nStart)
         return true;
-    }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
 
-        uint256 blockHash = diskindex.GetBlockHash();
+    vector<pair<string, string> > vRaw;
+    if (!ScanRaw(AddressKeyPrefix("addrtx", hashScript, nStart), AddressKeyPrefix("addrtx", hashScript, (int64_t)nEnd + 1), vRaw))
+        return false;
 
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
+    vRet.reserve(vRaw.size());
+    try {
+        for (unsigned int i = 0; i < vRaw.size(); i++)
+        {
+            CDataStream ssKey(vRaw[i].first.data(), vRaw[i].first.data() + vRaw[i].first.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(vRaw[i].second.data(), vRaw[i].second.data() + vRaw[i].second.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            pair<CAddressIndexKey, int64_t> entry;
+            ssKey >> strType >> entry.first;
+            ssValue >> entry.second;
+            vRet.push_back(entry);
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadAddressIndex() : deserialize error");
+    }
+    return true;
+}
 
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
+bool CTxDB::ReadAddressUnspent(const uint160& hashScript, vector<pair<CAddressUnspentKey, CAddressUnspentValue> >& vRet)
+{
+    vRet.clear();
+    string strFrom = AddressKeyPrefix("addrutxo", hashScript);
+    // Bumping the last byte of the script hash, with carry, gives the first
+    // key past all of this script's records. The prefix starts with the
+    // length of "addrutxo", so it never carries out.
+    string strTo = strFrom;
+    while ((unsigned char)strTo[strTo.size() - 1] == 0xff)
+        strTo.erase(strTo.size() - 1);
+    strTo[strTo.size() - 1]++;
+
+    vector<pair<string, string> > vRaw;
+    if (!ScanRaw(strFrom, strTo, vRaw))
+        return false;
 
-        if (!pindexNew->CheckIndex()) {
+    vRet.reserve(vRaw.size());
+    try {
+        for (unsigned int i = 0; i < vRaw.size(); i++)
+        {
+            CDataStream ssKey(vRaw[i].first.data(), vRaw[i].first.data() + vRaw[i].first.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(vRaw[i].second.data(), vRaw[i].second.data() + vRaw[i].second.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            pair<CAddressUnspentKey, CAddressUnspentValue> entry;
+            ssKey >> strType >> entry.first;
+            ssValue >> entry.second;
+            vRet.push_back(entry);
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadAddressUnspent() : deserialize error");
+    }
+    return true;
+}
+
+bool CTxDB::ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value)
+{
+    return Write(make_pair(string("spent"), outpoint), value);
+}
+
+bool CTxDB::EraseSpentIndex(const COutPoint& outpoint)
+{
+    return Erase(make_pair(string("spent"), outpoint));
+}
+
+bool CTxDB::ReadTxBlock(const uint256& hash, int& nHeight, uint256& hashBlock)
+{
+    pair<int, uint256> value;
+    if (!Read(make_pair(string("txblock"), hash), value))
+        return false;
+    nHeight = value.first;
+    hashBlock = value.second;
+    return true;
+}
+
+bool CTxDB::WriteTxBlock(const uint256& hash, int nHeight, const uint256& hashBlock)
+{
+    return Write(make_pair(string("txblock"), hash), make_pair(nHeight, hashBlock));
+}
+
+bool CTxDB::EraseTxBlock(const uint256& hash)
+{
+    return Erase(make_pair(string("txblock"), hash));
+}
+
+bool CTxDB::ReadBlockStats(int nHeight, CBlockStats& stats)
+{
+    return Read(make_pair(string("blockstats"), nHeight), stats);
+}
+
+bool CTxDB::WriteBlockStats(int nHeight, const CBlockStats& stats)
+{
+    return Write(make_pair(string("blockstats"), nHeight), stats);
+}
+
+bool CTxDB::EraseBlockStats(int nHeight)
+{
+    return Erase(make_pair(string("blockstats"), nHeight));
+}
+
+bool CTxDB::ReadBlockStatsSummary(int nStride, CBlockStatsSummary& summary)
+{
+    summary = CBlockStatsSummary();
+    return Read(make_pair(string("blockstatsum"), nStride), summary);
+}
+
+// Empty summaries are erased rather than kept
+bool CTxDB::WriteBlockStatsSummary(int nStride, const CBlockStatsSummary& summary)
+{
+    if (summary.IsEmpty())
+        return Erase(make_pair(string("blockstatsum"), nStride));
+    return Write(make_pair(string("blockstatsum"), nStride), summary);
+}
+
+bool CTxDB::ReadMinterStats(const uint160& hashScript, int nStride, CBlockStatsSummary& summary)
+{
+    summary = CBlockStatsSummary();
+    return Read(make_pair(string("minterstats"), make_pair(hashScript, nStride)), summary);
+}
+
+bool CTxDB::WriteMinterStats(const uint160& hashScript, int nStride, const CBlockStatsSummary& summary)
+{
+    if (summary.IsEmpty())
+        return Erase(make_pair(string("minterstats"), make_pair(hashScript, nStride)));
+    return Write(make_pair(string("minterstats"), make_pair(hashScript, nStride)), summary);
+}
+
+bool CTxDB::ReadIndexFlag(const std::string& strName, bool& fValue)
+{
+    fValue = false;
+    return Read(strName, fValue);
+}
+
+bool CTxDB::WriteIndexFlag(const std::string& strName, bool fValue)
+{
+    return Write(strName, fValue);
+}
+
+// Values up to this long stay in the alias history entry itself
+static const unsigned int ALIAS_VALUE_INLINE_MAX = 32;
+// Format of the alias index records, kept in "aliasIndexFormat": 1 moved
+// the long values out, 2 keeps only each alias's latest entry
+static const int ALIAS_INDEX_FORMAT = 2;
+// Memory for the most recently read shared values
+static const uint64_t ALIAS_VALUE_CACHE_BYTES = 8 << 20;
+
+/** An AliasIndex as the alias index stores it: a long value is replaced by
+ *  its hash in the alias value store */
+class CDiskAliasIndex
+{
+public:
+    CDiskTxPos txPos;
+    unsigned int nHeight;
+    std::vector<unsigned char> vValue;
+    uint256 hashValue;
+    std::string vAddress;
+
+    CDiskAliasIndex() : nHeight(0), hashValue(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txPos);
+        READWRITE(nHeight);
+        READWRITE(vValue);
+        READWRITE(hashValue);
+        READWRITE(vAddress);
+    )
+};
+
+class CAliasValue
+{
+public:
+    unsigned int nRefs;
+    std::vector<unsigned char> vchValue;
+
+    CAliasValue() : nRefs(0) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nRefs);
+        READWRITE(vchValue);
+    )
+};
+
+// Shared values by hash, most recently used first. Content addressed, so
+// an entry never goes stale; it only ages out.
+static CCriticalSection cs_aliasvalues;
+typedef std::list<std::pair<uint256, std::vector<unsigned char> > > AliasValueList;
+static AliasValueList lruAliasValues;
+static std::map<uint256, AliasValueList::iterator> mapAliasValues;
+static uint64_t nAliasValueUsage = 0;
+static uint64_t nAliasValueHits = 0;
+static uint64_t nAliasValueMisses = 0;
+
+static void CacheAliasValue(const uint256& hash, const vector<unsigned char>& vchValue)
+{
+    AssertLockHeld(cs_aliasvalues);
+    if (mapAliasValues.count(hash))
+        return;
+    lruAliasValues.push_front(make_pair(hash, vchValue));
+    mapAliasValues[hash] = lruAliasValues.begin();
+    nAliasValueUsage += vchValue.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+    while (nAliasValueUsage > ALIAS_VALUE_CACHE_BYTES && lruAliasValues.size() > 1)
+    {
+        nAliasValueUsage -= lruAliasValues.back().second.size() + TXDB_CACHE_ENTRY_OVERHEAD;
+        mapAliasValues.erase(lruAliasValues.back().first);
+        lruAliasValues.pop_back();
+    }
+}
+
+bool CTxDB::ReadAliasValue(const uint256& hash, vector<unsigned char>& vchValue)
+{
+    {
+        LOCK(cs_aliasvalues);
+        map<uint256, AliasValueList::iterator>::iterator mi = mapAliasValues.find(hash);
+        if (mi != mapAliasValues.end())
+        {
+            nAliasValueHits++;
+            lruAliasValues.splice(lruAliasValues.begin(), lruAliasValues, mi->second);
+            vchValue = mi->second->second;
+            return true;
+        }
+        nAliasValueMisses++;
+    }
+
+    CAliasValue value;
+    if (!Read(make_pair(string("aliasvalue"), hash), value))
+        return false;
+    vchValue.swap(value.vchValue);
+    LOCK(cs_aliasvalues);
+    CacheAliasValue(hash, vchValue);
+    return true;
+}
+
+bool CTxDB::AddAliasValueRef(const uint256& hash, const vector<unsigned char>& vchValue)
+{
+    CAliasValue value;
+    if (!Read(make_pair(string("aliasvalue"), hash), value))
+        value.vchValue = vchValue;
+    value.nRefs++;
+    return Write(make_pair(string("aliasvalue"), hash), value);
+}
+
+bool CTxDB::ReleaseAliasValueRef(const uint256& hash)
+{
+    CAliasValue value;
+    if (!Read(make_pair(string("aliasvalue"), hash), value))
+        return false;
+    if (value.nRefs > 1)
+    {
+        value.nRefs--;
+        return Write(make_pair(string("aliasvalue"), hash), value);
+    }
+    // A cached copy may stay behind; the hash still names the same bytes
+    return Erase(make_pair(string("aliasvalue"), hash));
+}
+
+bool CTxDB::ResolveAliasIndex(const vector<CDiskAliasIndex>& vDisk, vector<AliasIndex>& vtxPos)
+{
+    vtxPos.resize(vDisk.size());
+    for (unsigned int i = 0; i < vDisk.size(); i++)
+    {
+        vtxPos[i].txPos = vDisk[i].txPos;
+        vtxPos[i].nHeight = vDisk[i].nHeight;
+        vtxPos[i].vAddress = vDisk[i].vAddress;
+        if (vDisk[i].hashValue == 0)
+            vtxPos[i].vValue = vDisk[i].vValue;
+        else if (!ReadAliasValue(vDisk[i].hashValue, vtxPos[i].vValue))
+            return error("ResolveAliasIndex() : alias value %s missing", vDisk[i].hashValue.ToString().substr(0,20).c_str());
+    }
+    return true;
+}
+
+bool CTxDB::ReadAliasIndex(const vector<unsigned char>& vchAlias, vector<AliasIndex>& vtxPos)
+{
+    vector<CDiskAliasIndex> vDisk;
+    if (!Read(make_pair(string("alias_"), vchAlias), vDisk))
+        return false;
+    return ResolveAliasIndex(vDisk, vtxPos);
+}
+
+bool CTxDB::WriteAliasIndex(const vector<unsigned char>& vchAlias, const vector<AliasIndex>& vtxPos)
+{
+    vector<CDiskAliasIndex> vOld;
+    bool fOld = Read(make_pair(string("alias_"), vchAlias), vOld);
+
+    vector<CDiskAliasIndex> vDisk(vtxPos.size());
+    for (unsigned int i = 0; i < vtxPos.size(); i++)
+    {
+        vDisk[i].txPos = vtxPos[i].txPos;
+        vDisk[i].nHeight = vtxPos[i].nHeight;
+        vDisk[i].vAddress = vtxPos[i].vAddress;
+        const vector<unsigned char>& vchValue = vtxPos[i].vValue;
+        if (vchValue.size() <= ALIAS_VALUE_INLINE_MAX)
+            vDisk[i].vValue = vchValue;
+        else
+        {
+            vDisk[i].hashValue = Hash(vchValue.begin(), vchValue.end());
+            if (!AddAliasValueRef(vDisk[i].hashValue, vchValue))
+                return false;
+        }
+    }
+    // After taking the new references, so a value kept across the rewrite
+    // is never dropped in between
+    if (fOld)
+    {
+        BOOST_FOREACH(const CDiskAliasIndex& old, vOld)
+        {
+            if (old.hashValue != 0)
+                ReleaseAliasValueRef(old.hashValue);
+        }
+    }
+    return Write(make_pair(string("alias_"), vchAlias), vDisk);
+}
+
+bool CTxDB::HaveAliasIndex(const vector<unsigned char>& vchAlias)
+{
+    return Exists(make_pair(string("alias_"), vchAlias));
+}
+
+bool CTxDB::EraseAliasIndex(const vector<unsigned char>& vchAlias)
+{
+    vector<CDiskAliasIndex> vOld;
+    if (Read(make_pair(string("alias_"), vchAlias), vOld))
+    {
+        BOOST_FOREACH(const CDiskAliasIndex& old, vOld)
+        {
+            if (old.hashValue != 0)
+                ReleaseAliasValueRef(old.hashValue);
+        }
+    }
+    return Erase(make_pair(string("alias_"), vchAlias));
+}
+
+bool CTxDB::ReadAliasIndexHeight(int& nHeight)
+{
+    return Read(string("aliasIndexHeight"), nHeight);
+}
+
+bool CTxDB::WriteAliasIndexHeight(int nHeight)
+{
+    return Write(string("aliasIndexHeight"), nHeight);
+}
+
+bool CTxDB::ReadAllAliasIndex(vector<pair<vector<unsigned char>, vector<AliasIndex> > >& vRet)
+{
+    vRet.clear();
+    CDataStream ssFrom(SER_DISK, CLIENT_VERSION);
+    ssFrom << string("alias_");
+    string strFrom = ssFrom.str();
+    // The type string is the last thing in the prefix, so bumping its last
+    // character gives the first key past every alias record
+    string strTo = strFrom;
+    strTo[strTo.size() - 1]++;
+
+    vector<pair<string, string> > vRaw;
+    if (!ScanRaw(strFrom, strTo, vRaw))
+        return false;
+
+    vRet.reserve(vRaw.size());
+    try {
+        for (unsigned int i = 0; i < vRaw.size(); i++)
+        {
+            CDataStream ssKey(vRaw[i].first.data(), vRaw[i].first.data() + vRaw[i].first.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(vRaw[i].second.data(), vRaw[i].second.data() + vRaw[i].second.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            pair<vector<unsigned char>, vector<AliasIndex> > entry;
+            vector<CDiskAliasIndex> vDisk;
+            ssKey >> strType >> entry.first;
+            ssValue >> vDisk;
+            if (!ResolveAliasIndex(vDisk, entry.second))
+                return false;
+            vRet.push_back(entry);
+        }
+    }
+    catch (std::exception &e) {
+        return error("ReadAllAliasIndex() : deserialize error");
+    }
+    return true;
+}
+
+bool CTxDB::UpgradeAliasIndex()
+{
+    int nFormat = 0;
+    if (Read(string("aliasIndexFormat"), nFormat) && nFormat >= ALIAS_INDEX_FORMAT)
+        return true;
+
+    CDataStream ssFrom(SER_DISK, CLIENT_VERSION);
+    ssFrom << string("alias_");
+    string strFrom = ssFrom.str();
+    string strTo = strFrom;
+    strTo[strTo.size() - 1]++;
+    vector<pair<string, string> > vRaw;
+    if (!ScanRaw(strFrom, strTo, vRaw))
+        return false;
+
+    // Records of format 0 carry their values inline. Every alias update
+    // replaces the history with its latest entry, and nothing rolls the
+    // index back on a reorg, so older entries, which only records moved
+    // over from aliascache.dat still have, are dropped.
+    unsigned int nChanged = 0;
+    TxnBegin();
+    try {
+        for (unsigned int i = 0; i < vRaw.size(); i++)
+        {
+            CDataStream ssKey(vRaw[i].first.data(), vRaw[i].first.data() + vRaw[i].first.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(vRaw[i].second.data(), vRaw[i].second.data() + vRaw[i].second.size(), SER_DISK, CLIENT_VERSION);
+            string strType;
+            vector<unsigned char> vchAlias;
+            vector<AliasIndex> vtxPos;
+            ssKey >> strType >> vchAlias;
+            if (nFormat < 1)
+            {
+                ssValue >> vtxPos;
+                // Gone from the batch first, so WriteAliasIndex doesn't
+                // take the old record for one of the new format
+                Erase(make_pair(string("alias_"), vchAlias));
+            }
+            else
+            {
+                vector<CDiskAliasIndex> vDisk;
+                ssValue >> vDisk;
+                if (vDisk.size() <= 1)
+                    continue;
+                if (!ResolveAliasIndex(vDisk, vtxPos))
+                {
+                    TxnAbort();
+                    return false;
+                }
+            }
+            if (vtxPos.size() > 1)
+                vtxPos.erase(vtxPos.begin(), vtxPos.end() - 1);
+            if (!WriteAliasIndex(vchAlias, vtxPos))
+            {
+                TxnAbort();
+                return false;
+            }
+            nChanged++;
+        }
+    }
+    catch (std::exception &e) {
+        TxnAbort();
+        return error("UpgradeAliasIndex() : deserialize error");
+    }
+    Write(string("aliasIndexFormat"), ALIAS_INDEX_FORMAT);
+    if (!TxnCommit())
+        return false;
+    if (nChanged)
+        printf("Rewrote %u alias index records in format %d\n", nChanged, ALIAS_INDEX_FORMAT);
+    return true;
+}
+
+void CTxDB::GetAliasValueStats(CAliasValueStats& stats)
+{
+    LOCK(cs_aliasvalues);
+    stats.nHits = nAliasValueHits;
+    stats.nMisses = nAliasValueMisses;
+    stats.nEntries = mapAliasValues.size();
+    stats.nUsage = nAliasValueUsage;
+    stats.nLimit = ALIAS_VALUE_CACHE_BYTES;
+}
+
+bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+{
+    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex, max(CLIENT_VERSION, BLOCKINDEX_CHECKSUM_VERSION));
+}
+
+bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+{
+    return Read(string("hashBestChain"), hashBestChain);
+}
+
+bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+{
+    return Write(string("hashBestChain"), hashBestChain);
+}
+
+bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+{
+    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+}
+
+bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+{
+    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+}
+
+bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
+{
+    return Read(string("hashSyncCheckpoint"), hashCheckpoint);
+}
+
+bool CTxDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
+{
+    return Write(string("hashSyncCheckpoint"), hashCheckpoint);
+}
+
+bool CTxDB::ReadCheckpointPubKey(string& strPubKey)
+{
+    return Read(string("strCheckpointPubKey"), strPubKey);
+}
+
+bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
+{
+    return Write(string("strCheckpointPubKey"), strPubKey);
+}
+
+static CBlockIndex *InsertBlockIndex(uint256 hash)
+{
+    if (hash == 0)
+        return NULL;
+
+    // Return existing
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return (*mi).second;
+
+    // Create new
+    CBlockIndex* pindexNew = AllocBlockIndex();
+    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+
+    return pindexNew;
+}
+
+// Block index snapshot. Written on a clean shutdown and loaded instead of
+// scanning every blockindex record, which also saves recomputing the chain
+// trust and stake modifier checksums and, without -fastindex, every block
+// hash. The file is a header followed by one flat record per block index
+// entry with pprev/pnext as array positions. It is removed as soon as it has
+// been loaded, so a crash can never bring back a stale one, and only written
+// again once the index in memory has been checked against the database.
+// Snapshot records are their key and value sizes followed by the bytes, with
+// an empty key after the last
+static bool WriteSnapshotDB(leveldb::DB* pdbIn, CChainSnapshotFile& file, uint64_t& nRecords)
+{
+    leveldb::ReadOptions readOptions;
+    readOptions.fill_cache = false;
+    leveldb::Iterator *iterator = pdbIn->NewIterator(readOptions);
+    bool fOk = true;
+    for (iterator->SeekToFirst(); fOk && iterator->Valid(); iterator->Next())
+    {
+        uint32_t nSizes[2] = { (uint32_t)iterator->key().size(), (uint32_t)iterator->value().size() };
+        fOk = file.Write(nSizes, sizeof(nSizes)) &&
+              file.Write(iterator->key().data(), nSizes[0]) &&
+              file.Write(iterator->value().data(), nSizes[1]);
+        nRecords++;
+    }
+    if (fOk)
+        fOk = iterator->status().ok();
+    delete iterator;
+    return fOk;
+}
+
+bool CTxDB::WriteSnapshotRecords(CChainSnapshotFile& file, uint64_t& nRecords)
+{
+    AssertLockHeld(cs_main);
+    nRecords = 0;
+    if (!Flush())
+        return error("WriteSnapshotRecords() : flush failed");
+    if (!WriteSnapshotDB(txdb, file, nRecords) || (blkindexdb && !WriteSnapshotDB(blkindexdb, file, nRecords)))
+        return error("WriteSnapshotRecords() : write failed");
+    uint32_t nSizes[2] = { 0, 0 };
+    return file.Write(nSizes, sizeof(nSizes));
+}
+
+bool CTxDB::ReadSnapshotRecords(CChainSnapshotFile& file, uint64_t& nRecords)
+{
+    nRecords = 0;
+    // Nothing may stay cached from before, not even a miss
+    if (!Flush(true))
+        return false;
+
+    leveldb::WriteBatch batch, batchBlockIndex;
+    size_t nBatchBytes = 0;
+    string strKey, strValue;
+    while (true)
+    {
+        uint32_t nSizes[2];
+        if (!file.Read(nSizes, sizeof(nSizes)))
+            return error("ReadSnapshotRecords() : read failed");
+        bool fEnd = (nSizes[0] == 0);
+        if (!fEnd)
+        {
+            if (nSizes[0] > MAX_SIZE || nSizes[1] > MAX_SIZE)
+                return error("ReadSnapshotRecords() : oversized record");
+            strKey.resize(nSizes[0]);
+            strValue.resize(nSizes[1]);
+            if (!file.Read(&strKey[0], nSizes[0]) || (nSizes[1] > 0 && !file.Read(&strValue[0], nSizes[1])))
+                return error("ReadSnapshotRecords() : read failed");
+            (DBForKey(strKey) == txdb ? batch : batchBlockIndex).Put(strKey, strValue);
+            nBatchBytes += nSizes[0] + nSizes[1];
+            nRecords++;
+        }
+
+        if (fEnd || nBatchBytes >= (16 << 20))
+        {
+            // Only the last write is synced; the whole load is thrown away
+            // if it doesn't get that far
+            leveldb::WriteOptions writeOptions;
+            writeOptions.sync = fEnd;
+            leveldb::Status status;
+            if (blkindexdb)
+                status = blkindexdb->Write(writeOptions, &batchBlockIndex);
+            if (status.ok())
+                status = txdb->Write(writeOptions, &batch);
+            if (!status.ok())
+                return error("ReadSnapshotRecords() : %s", status.ToString().c_str());
+            batch.Clear();
+            batchBlockIndex.Clear();
+            nBatchBytes = 0;
+        }
+        if (fEnd)
+            return true;
+    }
+}
+
+bool CTxDB::ReadChainSnapshotState(CChainSnapshotState& state)
+{
+    return Read(string("chainsnapshot"), state);
+}
+
+bool CTxDB::WriteChainSnapshotState(const CChainSnapshotState& state)
+{
+    return Write(string("chainsnapshot"), state);
+}
+
+bool fBlockIndexVerified = true;
+
+static const char pchSnapshotMagic[8] = { 'I', 'O', 'C', 'B', 'I', 'D', 'X', '1' };
+static const unsigned int BLOCKINDEX_SNAPSHOT_VERSION = 1;
+
+struct CBlockIndexSnapshotHeader
+{
+    char pchMagic[8];
+    uint32_t nVersion;
+    uint32_t nRecordSize;
+    uint256 hashBestChain;
+    uint64_t nRecords;
+};
+
+struct CBlockIndexSnapshotRecord
+{
+    uint256 hashBlock;
+    uint256 nChainTrust;
+    uint256 hashProof;
+    uint256 hashMerkleRoot;
+    uint256 hashPrevoutStake;
+    int64_t nMint;
+    int64_t nMoneySupply;
+    uint64_t nStakeModifier;
+    int32_t nPrev;
+    int32_t nNext;
+    uint32_t nFile;
+    uint32_t nBlockPos;
+    int32_t nHeight;
+    uint32_t nFlags;
+    uint32_t nStakeModifierChecksum;
+    uint32_t nPrevoutStakeN;
+    uint32_t nStakeTime;
+    int32_t nVersion;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+    uint32_t nUnused;
+};
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+struct CompareSnapshotHeight
+{
+    bool operator()(const CBlockIndex* a, const CBlockIndex* b) const
+    {
+        if (a->nHeight != b->nHeight)
+            return a->nHeight < b->nHeight;
+        return a < b;
+    }
+};
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+    if (!fBlockIndexVerified || mapBlockIndex.empty() || !GetBoolArg("-blockindexsnapshot", true))
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    // Records go out in height order so that loading them allocates the
+    // block index contiguously along the chain
+    vector<const CBlockIndex*> vIndex;
+    vIndex.reserve(mapBlockIndex.size());
+    for (BlockMap::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        vIndex.push_back(mi->second);
+    sort(vIndex.begin(), vIndex.end(), CompareSnapshotHeight());
+    map<const CBlockIndex*, int32_t> mapPos;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        mapPos[vIndex[i]] = i;
+
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : open failed");
+
+    // Value-initialized, which zeroes the padding written out with it too
+    CBlockIndexSnapshotHeader header = CBlockIndexSnapshotHeader();
+    memcpy(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic));
+    header.nVersion = BLOCKINDEX_SNAPSHOT_VERSION;
+    header.nRecordSize = sizeof(CBlockIndexSnapshotRecord);
+    header.hashBestChain = hashBestChain;
+    header.nRecords = vIndex.size();
+    bool fOk = (fwrite(&header, sizeof(header), 1, file) == 1);
+
+    BOOST_FOREACH(const CBlockIndex* pindex, vIndex)
+    {
+        if (!fOk)
+            break;
+        CBlockIndexSnapshotRecord rec = CBlockIndexSnapshotRecord();
+        rec.hashBlock = pindex->GetBlockHash();
+        rec.nChainTrust = pindex->nChainTrust;
+        rec.hashProof = pindex->hashProof;
+        rec.hashMerkleRoot = pindex->hashMerkleRoot;
+        rec.hashPrevoutStake = pindex->prevoutStake.hash;
+        rec.nMint = pindex->nMint;
+        rec.nMoneySupply = pindex->nMoneySupply;
+        rec.nStakeModifier = pindex->nStakeModifier;
+        rec.nPrev = pindex->pprev ? mapPos[pindex->pprev] : -1;
+        rec.nNext = pindex->pnext ? mapPos[pindex->pnext] : -1;
+        rec.nFile = pindex->nFile;
+        rec.nBlockPos = pindex->nBlockPos;
+        rec.nHeight = pindex->nHeight;
+        rec.nFlags = pindex->nFlags;
+        rec.nStakeModifierChecksum = pindex->nStakeModifierChecksum;
+        rec.nPrevoutStakeN = pindex->prevoutStake.n;
+        rec.nStakeTime = pindex->nStakeTime;
+        rec.nVersion = pindex->nVersion;
+        rec.nTime = pindex->nTime;
+        rec.nBits = pindex->nBits;
+        rec.nNonce = pindex->nNonce;
+        fOk = (fwrite(&rec, sizeof(rec), 1, file) == 1);
+    }
+    if (fOk)
+        fOk = (fflush(file) == 0);
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, BlockIndexSnapshotPath()))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : write failed");
+    }
+    printf("Wrote block index snapshot of %"PRIszu" entries in %"PRId64"ms\n", vIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    boost::filesystem::path path = BlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(path))
+        return false;
+
+    bool fLoaded = false;
+#ifndef WIN32
+    int64_t nStart = GetTimeMillis();
+    uint256 hashBestChainDB;
+    int fd = open(path.string().c_str(), O_RDONLY);
+    struct stat st;
+    if (ReadHashBestChain(hashBestChainDB) && fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CBlockIndexSnapshotHeader))
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            const char* pbegin = (const char*)p;
+            CBlockIndexSnapshotHeader header;
+            memcpy(&header, pbegin, sizeof(header));
+
+            if (memcmp(header.pchMagic, pchSnapshotMagic, sizeof(header.pchMagic)) != 0 ||
+                header.nVersion != BLOCKINDEX_SNAPSHOT_VERSION ||
+                header.nRecordSize != sizeof(CBlockIndexSnapshotRecord) ||
+                header.nRecords > (uint64_t)std::numeric_limits<int32_t>::max() ||
+                (uint64_t)st.st_size != sizeof(header) + header.nRecords * sizeof(CBlockIndexSnapshotRecord))
+                printf("LoadBlockIndexSnapshot() : unusable snapshot, ignoring it\n");
+            else if (header.hashBestChain != hashBestChainDB)
+                printf("LoadBlockIndexSnapshot() : snapshot is for a different best chain, ignoring it\n");
+            else
+            {
+                const CBlockIndexSnapshotRecord* precs = (const CBlockIndexSnapshotRecord*)(pbegin + sizeof(header));
+                fLoaded = LoadBlockIndexSnapshotRecords(precs, header.nRecords);
+                if (fLoaded)
+                    printf("Loaded block index snapshot of %"PRIu64" entries in %"PRId64"ms\n", header.nRecords, GetTimeMillis() - nStart);
+            }
+            munmap(p, st.st_size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    // Never trust a snapshot across a crash: the index on disk moves on
+    // from here, and a new snapshot is only written on a clean shutdown
+    boost::filesystem::remove(path);
+    return fLoaded;
+}
+
+bool CTxDB::LoadBlockIndexSnapshotRecords(const CBlockIndexSnapshotRecord* precs, uint64_t nRecords)
+{
+    vector<CBlockIndex*> vIndex;
+    vIndex.reserve(nRecords);
+    for (uint64_t i = 0; i < nRecords; i++)
+    {
+        CBlockIndexSnapshotRecord rec;
+        memcpy(&rec, &precs[i], sizeof(rec));
+        if (rec.nPrev >= (int64_t)nRecords || rec.nNext >= (int64_t)nRecords ||
+            rec.hashBlock == 0 || mapBlockIndex.count(rec.hashBlock))
+        {
+            printf("LoadBlockIndexSnapshot() : bad record %"PRIu64", ignoring snapshot\n", i);
+            UnloadBlockIndex();
+            return false;
+        }
+        CBlockIndex* pindexNew = InsertBlockIndex(rec.hashBlock);
+        pindexNew->nChainTrust    = rec.nChainTrust;
+        pindexNew->nFile          = rec.nFile;
+        pindexNew->nBlockPos      = rec.nBlockPos;
+        pindexNew->nHeight        = rec.nHeight;
+        pindexNew->nMint          = rec.nMint;
+        pindexNew->nMoneySupply   = rec.nMoneySupply;
+        pindexNew->nFlags         = rec.nFlags;
+        pindexNew->nStakeModifier = rec.nStakeModifier;
+        pindexNew->nStakeModifierChecksum = rec.nStakeModifierChecksum;
+        pindexNew->prevoutStake   = COutPoint(rec.hashPrevoutStake, rec.nPrevoutStakeN);
+        pindexNew->nStakeTime     = rec.nStakeTime;
+        pindexNew->hashProof      = rec.hashProof;
+        pindexNew->nVersion       = rec.nVersion;
+        pindexNew->hashMerkleRoot = rec.hashMerkleRoot;
+        pindexNew->nTime          = rec.nTime;
+        pindexNew->nBits          = rec.nBits;
+        pindexNew->nNonce         = rec.nNonce;
+        vIndex.push_back(pindexNew);
+    }
+
+    for (uint64_t i = 0; i < nRecords; i++)
+    {
+        CBlockIndex* pindex = vIndex[i];
+        pindex->pprev = (precs[i].nPrev >= 0) ? vIndex[precs[i].nPrev] : NULL;
+        pindex->pnext = (precs[i].nNext >= 0) ? vIndex[precs[i].nNext] : NULL;
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindex;
+
+        // NovaCoin: build setStakeSeen
+        if (pindex->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    }
+    return true;
+}
+
+// Undo a partially loaded snapshot so the database scan can start afresh
+void CTxDB::UnloadBlockIndex()
+{
+    mapBlockIndex.clear();
+    FreeBlockIndexes();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+}
+
+static bool BlockIndexMatches(const CDiskBlockIndex& diskindex, const CBlockIndex* pindex)
+{
+    return diskindex.nFile == pindex->nFile &&
+           diskindex.nBlockPos == pindex->nBlockPos &&
+           diskindex.nHeight == pindex->nHeight &&
+           diskindex.nMint == pindex->nMint &&
+           diskindex.nMoneySupply == pindex->nMoneySupply &&
+           diskindex.nFlags == pindex->nFlags &&
+           diskindex.nStakeModifier == pindex->nStakeModifier &&
+           diskindex.prevoutStake == pindex->prevoutStake &&
+           diskindex.nStakeTime == pindex->nStakeTime &&
+           diskindex.hashProof == pindex->hashProof &&
+           diskindex.nVersion == pindex->nVersion &&
+           diskindex.hashMerkleRoot == pindex->hashMerkleRoot &&
+           diskindex.nTime == pindex->nTime &&
+           diskindex.nBits == pindex->nBits &&
+           diskindex.nNonce == pindex->nNonce &&
+           diskindex.hashPrev == (pindex->pprev ? pindex->pprev->GetBlockHash() : 0);
+}
+
+// Check a block index loaded from a snapshot against what LoadBlockIndexGuts
+// would have built: chain trust and stake modifier checksums are recomputed
+// and every blockindex record in the database must match its entry.
+bool CTxDB::VerifyBlockIndexSnapshot()
+{
+    int64_t nStart = GetTimeMillis();
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    {
+        LOCK(cs_main);
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        if (fShutdown)
+            return false;
+        CBlockIndex* pindex = item.second;
+        if (!pindex->CheckIndex())
+            return error("VerifyBlockIndexSnapshot() : CheckIndex failed at %d", pindex->nHeight);
+        if (pindex->nChainTrust != (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust())
+            return error("VerifyBlockIndexSnapshot() : chain trust mismatch at height %d", pindex->nHeight);
+        if (pindex->nStakeModifierChecksum != GetStakeModifierChecksum(pindex))
+            return error("VerifyBlockIndexSnapshot() : stake modifier checksum mismatch at height %d", pindex->nHeight);
+        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+            return error("VerifyBlockIndexSnapshot() : failed stake modifier checkpoint height=%d, modifier=0x%016"PRIx64, pindex->nHeight, pindex->nStakeModifier);
+    }
+
+    // Every record on disk needs a matching entry. Fields other than pnext
+    // never change once an entry is in the index.
+    leveldb::Iterator *iterator = (blkindexdb ? blkindexdb : txdb)->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    unsigned int nChecked = 0;
+    bool fOk = true;
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid() && fOk && !fShutdown; iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        uint256 hash;
+        ssKey >> strType;
+        if (strType != "blockindex")
+            break;
+        ssKey >> hash;
+        CDiskBlockIndex diskindex;
+        ssValue >> diskindex;
+
+        CBlockIndex* pindex = NULL;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
+            if (mi != mapBlockIndex.end())
+                pindex = mi->second;
+        }
+        if (!pindex)
+            fOk = error("VerifyBlockIndexSnapshot() : block %s missing from the snapshot", hash.ToString().substr(0,20).c_str());
+        else if (!BlockIndexMatches(diskindex, pindex))
+            fOk = error("VerifyBlockIndexSnapshot() : block %s doesn't match the database", hash.ToString().substr(0,20).c_str());
+        nChecked++;
+    }
+    delete iterator;
+    if (!fOk || fShutdown)
+        return false;
+
+    printf("Verified block index snapshot, %u records in %"PRId64"ms\n", nChecked, GetTimeMillis() - nStart);
+    return true;
+}
+
+void ThreadVerifyBlockIndex(void* parg)
+{
+    RenameThread("iocoin-idxcheck");
+    vnThreadsRunning[THREAD_INDEXCHECK]++;
+    if (CTxDB::VerifyBlockIndexSnapshot())
+        fBlockIndexVerified = true;
+    else if (!fShutdown)
+    {
+        strMiscWarning = _("Warning: the block index snapshot didn't match the database. Please restart to reload the block index.");
+        printf("*** %s\n", strMiscWarning.c_str());
+    }
+    vnThreadsRunning[THREAD_INDEXCHECK]--;
+}
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    leveldb::Iterator *iterator = (blkindexdb ? blkindexdb : pdb)->NewIterator(leveldb::ReadOptions());
+    // Seek to start key.
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    set<CBlockIndex*> setNoChecksum;
+    // Now read each entry.
+    while (iterator->Valid())
+    {
+        // Unpack keys and values.
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        ssKey >> strType;
+        // Did we reach the end of the data to read?
+        if (fRequestShutdown || strType != "blockindex")
+            break;
+        CDiskBlockIndex diskindex;
+        ssValue >> diskindex;
+
+        uint256 blockHash = diskindex.GetBlockHash();
+
+        // Construct block index object
+        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nBlockPos      = diskindex.nBlockPos;
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nMint          = diskindex.nMint;
+        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+        pindexNew->nFlags         = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake   = diskindex.prevoutStake;
+        pindexNew->nStakeTime     = diskindex.nStakeTime;
+        pindexNew->hashProof      = diskindex.hashProof;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStakeModifierChecksum = diskindex.nStakeModifierChecksum;
+        if (!diskindex.fStakeModifierChecksum)
+            setNoChecksum.insert(pindexNew);
+
+        // Watch for genesis block
+        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
+            pindexGenesisBlock = pindexNew;
+
+        if (!pindexNew->CheckIndex()) {
             delete iterator;
             return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
         }
@@ -399,16 +1908,58 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    // Stored checksums below the last checkpoint are trusted, the rest are recomputed
+    int nCheckpointHeight = Checkpoints::GetTotalBlocksEstimate();
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
         pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
         // NovaCoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+        if (pindex->nHeight > nCheckpointHeight || setNoChecksum.count(pindex))
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
         if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
             return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRIx64, pindex->nHeight, pindex->nStakeModifier);
     }
 
+    // Upgrade records written before checksums were stored
+    if (!setNoChecksum.empty() && !fReadOnly)
+    {
+        printf("LoadBlockIndex(): storing stake modifier checksums for %"PRIszu" blocks\n", setNoChecksum.size());
+        TxnBegin();
+        BOOST_FOREACH(CBlockIndex* pindex, setNoChecksum)
+            WriteBlockIndex(CDiskBlockIndex(pindex));
+        if (!TxnCommit())
+            return error("CTxDB::LoadBlockIndex() : failed to store stake modifier checksums");
+    }
+
+    return true;
+}
+
+bool CTxDB::LoadBlockIndex()
+{
+    if (mapBlockIndex.size() > 0) {
+        // Already loaded once in this session. It can happen during migration
+        // from BDB.
+        return true;
+    }
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    // The iterator only sees what is in LevelDB
+    Flush();
+    if (GetBoolArg("-blockindexsnapshot", true) && LoadBlockIndexSnapshot())
+    {
+        // Trust, stake modifier checksums and the records themselves are
+        // checked against the database by ThreadVerifyBlockIndex
+        fBlockIndexVerified = false;
+    }
+    else if (!LoadBlockIndexGuts())
+        return false;
+    CompactBlockIndex();
+
+    if (fRequestShutdown)
+        return true;
+
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
     {
@@ -420,7 +1971,17 @@ bool CTxDB::LoadBlockIndex()
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
     nBestHeight = pindexBest->nHeight;
+
+    // A separate block index instance is flushed ahead of the tx index, so it
+    // may link past the best chain to blocks that were never connected here
+    for (CBlockIndex* pindex = pindexBest; pindex->pnext; )
+    {
+        CBlockIndex* pindexNext = pindex->pnext;
+        pindex->pnext = NULL;
+        pindex = pindexNext;
+    }
     nBestChainTrust = pindexBest->nChainTrust;
+    SetActiveChainTip(pindexBest);
 
     printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
       hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
@@ -443,6 +2004,8 @@ bool CTxDB::LoadBlockIndex()
         nCheckDepth = 1000000000; // suffices until the year 19000
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
+    if (nPruneTarget && nCheckDepth > MIN_BLOCKS_TO_KEEP)
+        nCheckDepth = MIN_BLOCKS_TO_KEEP; // older blocks may be gone
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
@@ -15,6 +15,96 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+struct CBlockIndexSnapshotRecord;
+class CDiskAliasIndex;
+class CChainSnapshotFile;
+class CChainSnapshotState;
+
+/** Counters for the process-wide write-back cache sitting between CTxDB and
+ *  LevelDB. Sizes are in bytes. */
+struct CTxDBCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEntries;
+    uint64_t nUsage;
+    uint64_t nDirtyUsage;
+    uint64_t nLimit;
+    uint64_t nFlushes;
+    int64_t nFlushMillis;
+    // Most LevelDB's block caches and memtables may take
+    uint64_t nLevelDBMemory;
+};
+
+/** Counters for the in-memory cache of the alias value store. Sizes are in
+ *  bytes. */
+struct CAliasValueStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEntries;
+    uint64_t nUsage;
+    uint64_t nLimit;
+};
+
+/** Compactions of one LevelDB level, from its leveldb.stats table. Sizes
+ *  are in megabytes. */
+struct CLevelDBLevelStats
+{
+    int nFiles;
+    double dSizeMB;
+    double dCompactionSeconds;
+    double dReadMB;
+    double dWriteMB;
+
+    CLevelDBLevelStats() : nFiles(0), dSizeMB(0), dCompactionSeconds(0), dReadMB(0), dWriteMB(0) {}
+};
+
+/** Compaction and write stall statistics of one LevelDB instance: txdb, or
+ *  blkindexdb with -splitblockindex */
+struct CLevelDBStats
+{
+    std::string strName;
+    std::vector<CLevelDBLevelStats> vLevels;
+    // Writes delayed by 1ms at the level-0 slowdown trigger, writes that
+    // waited for a compaction, and the time spent on both
+    uint64_t nStallSlowdowns;
+    uint64_t nStallWaits;
+    uint64_t nStallMicros;
+
+    CLevelDBStats() : nStallSlowdowns(0), nStallWaits(0), nStallMicros(0) {}
+};
+
+/** One entry of a DIONS alias history, oldest first, in the alias index */
+class AliasIndex
+{
+  public:
+    CDiskTxPos txPos;
+    unsigned int nHeight;
+    std::vector<unsigned char> vValue;
+    std::string vAddress;
+
+    AliasIndex()
+    {
+    }
+
+    AliasIndex(CDiskTxPos txPosIn, unsigned int nHeightIn, std::vector<unsigned char> vValueIn, std::string vAddressIn)
+    {
+        txPos = txPosIn;
+        nHeight = nHeightIn;
+        vValue = vValueIn;
+        vAddress = vAddressIn;
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(txPos);
+        READWRITE(nHeight);
+        READWRITE(vValue);
+        READWRITE(vAddress);
+    )
+};
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -56,11 +146,32 @@ protected:
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // Emptied streams owned by the calling thread, which Read, Write, Erase
+    // and Exists serialize into. They keep their capacity from call to call,
+    // so a lookup does not allocate and zero a new buffer each time.
+    static CDataStream& ScratchKeyStream();
+    static CDataStream& ScratchValueStream(int nVersion = CLIENT_VERSION);
+
+    // Access the write-back cache, falling through to LevelDB on a miss.
+    // Writes are held in memory until the cache is flushed.
+    bool ReadRaw(const std::string &key, std::string &value);
+    bool WriteRaw(const std::string &key, const std::string &value);
+    bool EraseRaw(const std::string &key);
+    // All pairs with strFrom <= key < strTo, cache and disk merged. Writes
+    // still pending in activeBatch are not seen.
+    bool ScanRaw(const std::string &strFrom, const std::string &strTo, std::vector<std::pair<std::string, std::string> > &vRet);
+
+    // The alias value store: each value by its hash, with a count of the
+    // history entries that refer to it
+    bool ReadAliasValue(const uint256& hash, std::vector<unsigned char>& vchValue);
+    bool AddAliasValueRef(const uint256& hash, const std::vector<unsigned char>& vchValue);
+    bool ReleaseAliasValueRef(const uint256& hash);
+    bool ResolveAliasIndex(const std::vector<CDiskAliasIndex>& vDisk, std::vector<AliasIndex>& vtxPos);
+
     template<typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CDataStream& ssKey = ScratchKeyStream();
         ssKey << key;
         std::string strValue;
 
@@ -74,21 +185,12 @@ protected:
                 return false;
             }
         }
-        if (readFromDb) {
-            leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
-                                              ssKey.str(), &strValue);
-            if (!status.ok()) {
-                if (status.IsNotFound())
-                    return false;
-                // Some unexpected error.
-                printf("LevelDB read failure: %s\n", status.ToString().c_str());
-                return false;
-            }
-        }
+        if (readFromDb && !ReadRaw(ssKey.str(), strValue))
+            return false;
         // Unserialize value
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+            CDataStream& ssValue = ScratchValueStream();
+            ssValue.write(strValue.data(), strValue.size());
             ssValue >> value;
         }
         catch (std::exception &e) {
@@ -98,28 +200,21 @@ protected:
     }
 
     template<typename K, typename T>
-    bool Write(const K& key, const T& value)
+    bool Write(const K& key, const T& value, int nValueVersion = CLIENT_VERSION)
     {
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CDataStream& ssKey = ScratchKeyStream();
         ssKey << key;
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.reserve(10000);
+        CDataStream& ssValue = ScratchValueStream(nValueVersion);
         ssValue << value;
 
         if (activeBatch) {
             activeBatch->Put(ssKey.str(), ssValue.str());
             return true;
         }
-        leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
-        if (!status.ok()) {
-            printf("LevelDB write failure: %s\n", status.ToString().c_str());
-            return false;
-        }
-        return true;
+        return WriteRaw(ssKey.str(), ssValue.str());
     }
 
     template<typename K>
@@ -130,35 +225,30 @@ protected:
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
 
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CDataStream& ssKey = ScratchKeyStream();
         ssKey << key;
         if (activeBatch) {
             activeBatch->Delete(ssKey.str());
             return true;
         }
-        leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
-        return (status.ok() || status.IsNotFound());
+        return EraseRaw(ssKey.str());
     }
 
     template<typename K>
     bool Exists(const K& key)
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(1000);
+        CDataStream& ssKey = ScratchKeyStream();
         ssKey << key;
         std::string unused;
 
         if (activeBatch) {
             bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted) {
-                return true;
+            if (ScanBatch(ssKey, &unused, &deleted)) {
+                return !deleted;
             }
         }
 
-
-        leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
-        return status.IsNotFound() == false;
+        return ReadRaw(ssKey.str(), unused);
     }
 
 
@@ -172,6 +262,15 @@ public:
         return true;
     }
 
+    // Write all dirty cache entries to LevelDB in a single batch. With
+    // fEvict the clean entries are dropped too.
+    static bool Flush(bool fEvict = false);
+    static void GetCacheStats(CTxDBCacheStats& stats);
+    static void GetLevelDBStats(std::vector<CLevelDBStats>& vStats);
+    // Compact every LevelDB instance completely. Writers keep going, but
+    // may stall behind it; meant for when the node is idle.
+    static bool CompactLevelDB(std::string& strError);
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -192,6 +291,50 @@ public:
     bool ReadDiskTx(uint256 hash, CTransaction& tx);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex);
     bool ReadDiskTx(COutPoint outpoint, CTransaction& tx);
+    bool ReadUnspent(const COutPoint& outpoint, CUnspent& unspent);
+    bool WriteUnspent(const COutPoint& outpoint, const CUnspent& unspent);
+    bool EraseUnspent(const COutPoint& outpoint);
+    bool ReadBlockUndo(const uint256& hashBlock, CBlockUndo& undo);
+    bool WriteBlockUndo(const uint256& hashBlock, const CBlockUndo& undo);
+    bool EraseBlockUndo(const uint256& hashBlock);
+    bool WriteAddressIndex(const CAddressIndexKey& key, int64_t nValue);
+    bool EraseAddressIndex(const CAddressIndexKey& key);
+    bool WriteAddressUnspent(const CAddressUnspentKey& key, const CAddressUnspentValue& value);
+    bool EraseAddressUnspent(const CAddressUnspentKey& key);
+    // History of a script at heights nStart to nEnd inclusive, oldest first
+    bool ReadAddressIndex(const uint160& hashScript, int nStart, int nEnd, std::vector<std::pair<CAddressIndexKey, int64_t> >& vRet);
+    bool ReadAddressUnspent(const uint160& hashScript, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vRet);
+    bool ReadSpentIndex(const COutPoint& outpoint, CSpentIndexValue& value);
+    bool WriteSpentIndex(const COutPoint& outpoint, const CSpentIndexValue& value);
+    bool EraseSpentIndex(const COutPoint& outpoint);
+    bool ReadTxBlock(const uint256& hash, int& nHeight, uint256& hashBlock);
+    bool WriteTxBlock(const uint256& hash, int nHeight, const uint256& hashBlock);
+    bool EraseTxBlock(const uint256& hash);
+    // -blockstatsindex: a record per main chain block, and summaries of them
+    // per BLOCK_STATS_STRIDE heights for the chain and for each minter script
+    bool ReadBlockStats(int nHeight, CBlockStats& stats);
+    bool WriteBlockStats(int nHeight, const CBlockStats& stats);
+    bool EraseBlockStats(int nHeight);
+    bool ReadBlockStatsSummary(int nStride, CBlockStatsSummary& summary);
+    bool WriteBlockStatsSummary(int nStride, const CBlockStatsSummary& summary);
+    bool ReadMinterStats(const uint160& hashScript, int nStride, CBlockStatsSummary& summary);
+    bool WriteMinterStats(const uint160& hashScript, int nStride, const CBlockStatsSummary& summary);
+    // Whether an optional index such as "addrindex" is being kept
+    bool ReadIndexFlag(const std::string& strName, bool& fValue);
+    bool WriteIndexFlag(const std::string& strName, bool fValue);
+    // DIONS alias histories, one record per alias. Values longer than a hash
+    // are kept once each in the alias value store and shared by reference.
+    bool ReadAliasIndex(const std::vector<unsigned char>& vchAlias, std::vector<AliasIndex>& vtxPos);
+    bool WriteAliasIndex(const std::vector<unsigned char>& vchAlias, const std::vector<AliasIndex>& vtxPos);
+    bool HaveAliasIndex(const std::vector<unsigned char>& vchAlias);
+    bool EraseAliasIndex(const std::vector<unsigned char>& vchAlias);
+    bool ReadAllAliasIndex(std::vector<std::pair<std::vector<unsigned char>, std::vector<AliasIndex> > >& vRet);
+    // Height of the last block whose aliases are in the alias index
+    bool ReadAliasIndexHeight(int& nHeight);
+    bool WriteAliasIndexHeight(int nHeight);
+    // Rewrite alias records of the format before the value store
+    bool UpgradeAliasIndex();
+    static void GetAliasValueStats(CAliasValueStats& stats);
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
     bool ReadHashBestChain(uint256& hashBestChain);
     bool WriteHashBestChain(uint256 hashBestChain);
@@ -202,9 +345,32 @@ public:
     bool ReadCheckpointPubKey(std::string& strPubKey);
     bool WriteCheckpointPubKey(const std::string& strPubKey);
     bool LoadBlockIndex();
+
+    // Save the block index for a fast start next time; needs cs_main
+    static bool WriteBlockIndexSnapshot();
+    // Check an index loaded from a snapshot against the database
+    static bool VerifyBlockIndexSnapshot();
+
+    // Every record of the tx and block index databases, for chainstate
+    // snapshots. Writing flushes the cache first and needs cs_main so that
+    // nothing changes meanwhile. Reading puts the records straight into
+    // LevelDB, and is meant for a database that was just created.
+    static bool WriteSnapshotRecords(CChainSnapshotFile& file, uint64_t& nRecords);
+    static bool ReadSnapshotRecords(CChainSnapshotFile& file, uint64_t& nRecords);
+    bool ReadChainSnapshotState(CChainSnapshotState& state);
+    bool WriteChainSnapshotState(const CChainSnapshotState& state);
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    bool LoadBlockIndexSnapshotRecords(const CBlockIndexSnapshotRecord* precs, uint64_t nRecords);
+    static void UnloadBlockIndex();
 };
 
+/** False while the block index in memory came from a snapshot that
+ *  ThreadVerifyBlockIndex hasn't finished checking yet */
+extern bool fBlockIndexVerified;
+
+void ThreadVerifyBlockIndex(void* parg);
+
 
 #endif // BITCOIN_DB_H
@@ -210,61 +210,153 @@ public:
         return ret;
     }
 
+    // Products and quotients wrap at BITS, like the other operators
+    base_uint& operator*=(uint32_t b32)
+    {
+        uint64_t carry = 0;
+        for (int i = 0; i < WIDTH; i++)
+        {
+            uint64_t n = carry + (uint64_t)b32 * pn[i];
+            pn[i] = n & 0xffffffff;
+            carry = n >> 32;
+        }
+        return *this;
+    }
 
-    friend inline bool operator<(const base_uint& a, const base_uint& b)
+    base_uint& operator*=(const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
+        base_uint a;
+        for (int i = 0; i < WIDTH; i++)
+            a.pn[i] = 0;
+        for (int j = 0; j < WIDTH; j++)
         {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
+            uint64_t carry = 0;
+            for (int i = 0; i + j < WIDTH; i++)
+            {
+                uint64_t n = carry + a.pn[i + j] + (uint64_t)pn[j] * b.pn[i];
+                a.pn[i + j] = n & 0xffffffff;
+                carry = n >> 32;
+            }
         }
-        return false;
+        *this = a;
+        return *this;
     }
 
-    friend inline bool operator<=(const base_uint& a, const base_uint& b)
+    // Rounds down; a zero divisor gives zero
+    base_uint& operator/=(const base_uint& b)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
+        base_uint div = b;
+        base_uint num = *this;
+        for (int i = 0; i < WIDTH; i++)
+            pn[i] = 0;
+        int nNumBits = num.bits();
+        int nDivBits = div.bits();
+        if (nDivBits == 0 || nDivBits > nNumBits)
+            return *this;
+        int nShift = nNumBits - nDivBits;
+        div <<= nShift;
+        while (nShift >= 0)
         {
-            if (a.pn[i] < b.pn[i])
-                return true;
-            else if (a.pn[i] > b.pn[i])
-                return false;
+            if (num >= div)
+            {
+                num -= div;
+                pn[nShift / 32] |= (1U << (nShift & 31));
+            }
+            div >>= 1;
+            nShift--;
         }
-        return true;
+        return *this;
     }
 
-    friend inline bool operator>(const base_uint& a, const base_uint& b)
+    // Position of the highest set bit plus one, 0 for zero
+    unsigned int bits() const
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
+        for (int pos = WIDTH - 1; pos >= 0; pos--)
         {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
+            if (pn[pos])
+            {
+                for (int nBits = 31; nBits > 0; nBits--)
+                    if (pn[pos] & (1U << nBits))
+                        return 32 * pos + nBits + 1;
+                return 32 * pos + 1;
+            }
         }
-        return false;
+        return 0;
     }
 
-    friend inline bool operator>=(const base_uint& a, const base_uint& b)
+    // The compact nBits encoding: a byte of size, then a 23-bit mantissa
+    // and a sign bit, as CBigNum::SetCompact and GetCompact have it
+    base_uint& SetCompact(uint32_t nCompact, bool* pfNegative = NULL, bool* pfOverflow = NULL)
     {
-        for (int i = base_uint::WIDTH-1; i >= 0; i--)
+        int nSize = nCompact >> 24;
+        uint32_t nWord = nCompact & 0x007fffff;
+        if (nSize <= 3)
         {
-            if (a.pn[i] > b.pn[i])
-                return true;
-            else if (a.pn[i] < b.pn[i])
-                return false;
+            nWord >>= 8 * (3 - nSize);
+            *this = nWord;
         }
-        return true;
+        else
+        {
+            *this = nWord;
+            *this <<= 8 * (nSize - 3);
+        }
+        if (pfNegative)
+            *pfNegative = nWord != 0 && (nCompact & 0x00800000) != 0;
+        if (pfOverflow)
+            *pfOverflow = nWord != 0 && ((nSize > BITS / 8 + 2) ||
+                                         (nWord > 0xff && nSize > BITS / 8 + 1) ||
+                                         (nWord > 0xffff && nSize > BITS / 8));
+        return *this;
+    }
+
+    uint32_t GetCompact(bool fNegative = false) const
+    {
+        int nSize = (bits() + 7) / 8;
+        uint32_t nCompact = 0;
+        if (nSize <= 3)
+            nCompact = Get64() << 8 * (3 - nSize);
+        else
+        {
+            base_uint bn = *this;
+            bn >>= 8 * (nSize - 3);
+            nCompact = bn.Get64();
+        }
+        // The top mantissa bit is the sign, so a mantissa using it moves
+        // down a byte
+        if (nCompact & 0x00800000)
+        {
+            nCompact >>= 8;
+            nSize++;
+        }
+        nCompact |= nSize << 24;
+        if (fNegative && (nCompact & 0x007fffff))
+            nCompact |= 0x00800000;
+        return nCompact;
     }
 
+
+    // Negative, zero or positive as a is below, equal to or above b. The
+    // top words decide almost every comparison of hashes.
+    int CompareTo(const base_uint& b) const
+    {
+        for (int i = WIDTH-1; i >= 0; i--)
+        {
+            if (pn[i] < b.pn[i])
+                return -1;
+            if (pn[i] > b.pn[i])
+                return 1;
+        }
+        return 0;
+    }
+
+    friend inline bool operator<(const base_uint& a, const base_uint& b)  { return a.CompareTo(b) < 0; }
+    friend inline bool operator<=(const base_uint& a, const base_uint& b) { return a.CompareTo(b) <= 0; }
+    friend inline bool operator>(const base_uint& a, const base_uint& b)  { return a.CompareTo(b) > 0; }
+    friend inline bool operator>=(const base_uint& a, const base_uint& b) { return a.CompareTo(b) >= 0; }
+
     friend inline bool operator==(const base_uint& a, const base_uint& b)
     {
-        for (int i = 0; i < base_uint::WIDTH; i++)
-            if (a.pn[i] != b.pn[i])
-                return false;
-        return true;
+        return memcmp(a.pn, b.pn, sizeof(a.pn)) == 0;
     }
 
     friend inline bool operator==(const base_uint& a, uint64_t b)
@@ -361,6 +453,12 @@ public:
         return pn[2*n] | (uint64_t)pn[2*n+1] << 32;
     }
 
+    // The low 64 bits, a bucket index for values that are already hashes
+    uint64_t GetCheapHash() const
+    {
+        return Get64(0);
+    }
+
     unsigned int GetSerializeSize(int nType, int nVersion) const
     {
         return sizeof(pn);
@@ -456,8 +554,8 @@ public:
     }
 };
 
-inline bool operator==(const uint160& a, uint64_t b)                         { return (base_uint160)a == b; }
-inline bool operator!=(const uint160& a, uint64_t b)                         { return (base_uint160)a != b; }
+inline bool operator==(const uint160& a, uint64_t b)                         { return (const base_uint160&)a == b; }
+inline bool operator!=(const uint160& a, uint64_t b)                         { return (const base_uint160&)a != b; }
 inline const uint160 operator<<(const base_uint160& a, unsigned int shift)   { return uint160(a) <<= shift; }
 inline const uint160 operator>>(const base_uint160& a, unsigned int shift)   { return uint160(a) >>= shift; }
 inline const uint160 operator<<(const uint160& a, unsigned int shift)        { return uint160(a) <<= shift; }
@@ -469,41 +567,41 @@ inline const uint160 operator|(const base_uint160& a, const base_uint160& b) { r
 inline const uint160 operator+(const base_uint160& a, const base_uint160& b) { return uint160(a) += b; }
 inline const uint160 operator-(const base_uint160& a, const base_uint160& b) { return uint160(a) -= b; }
 
-inline bool operator<(const base_uint160& a, const uint160& b)          { return (base_uint160)a <  (base_uint160)b; }
-inline bool operator<=(const base_uint160& a, const uint160& b)         { return (base_uint160)a <= (base_uint160)b; }
-inline bool operator>(const base_uint160& a, const uint160& b)          { return (base_uint160)a >  (base_uint160)b; }
-inline bool operator>=(const base_uint160& a, const uint160& b)         { return (base_uint160)a >= (base_uint160)b; }
-inline bool operator==(const base_uint160& a, const uint160& b)         { return (base_uint160)a == (base_uint160)b; }
-inline bool operator!=(const base_uint160& a, const uint160& b)         { return (base_uint160)a != (base_uint160)b; }
-inline const uint160 operator^(const base_uint160& a, const uint160& b) { return (base_uint160)a ^  (base_uint160)b; }
-inline const uint160 operator&(const base_uint160& a, const uint160& b) { return (base_uint160)a &  (base_uint160)b; }
-inline const uint160 operator|(const base_uint160& a, const uint160& b) { return (base_uint160)a |  (base_uint160)b; }
-inline const uint160 operator+(const base_uint160& a, const uint160& b) { return (base_uint160)a +  (base_uint160)b; }
-inline const uint160 operator-(const base_uint160& a, const uint160& b) { return (base_uint160)a -  (base_uint160)b; }
-
-inline bool operator<(const uint160& a, const base_uint160& b)          { return (base_uint160)a <  (base_uint160)b; }
-inline bool operator<=(const uint160& a, const base_uint160& b)         { return (base_uint160)a <= (base_uint160)b; }
-inline bool operator>(const uint160& a, const base_uint160& b)          { return (base_uint160)a >  (base_uint160)b; }
-inline bool operator>=(const uint160& a, const base_uint160& b)         { return (base_uint160)a >= (base_uint160)b; }
-inline bool operator==(const uint160& a, const base_uint160& b)         { return (base_uint160)a == (base_uint160)b; }
-inline bool operator!=(const uint160& a, const base_uint160& b)         { return (base_uint160)a != (base_uint160)b; }
-inline const uint160 operator^(const uint160& a, const base_uint160& b) { return (base_uint160)a ^  (base_uint160)b; }
-inline const uint160 operator&(const uint160& a, const base_uint160& b) { return (base_uint160)a &  (base_uint160)b; }
-inline const uint160 operator|(const uint160& a, const base_uint160& b) { return (base_uint160)a |  (base_uint160)b; }
-inline const uint160 operator+(const uint160& a, const base_uint160& b) { return (base_uint160)a +  (base_uint160)b; }
-inline const uint160 operator-(const uint160& a, const base_uint160& b) { return (base_uint160)a -  (base_uint160)b; }
-
-inline bool operator<(const uint160& a, const uint160& b)               { return (base_uint160)a <  (base_uint160)b; }
-inline bool operator<=(const uint160& a, const uint160& b)              { return (base_uint160)a <= (base_uint160)b; }
-inline bool operator>(const uint160& a, const uint160& b)               { return (base_uint160)a >  (base_uint160)b; }
-inline bool operator>=(const uint160& a, const uint160& b)              { return (base_uint160)a >= (base_uint160)b; }
-inline bool operator==(const uint160& a, const uint160& b)              { return (base_uint160)a == (base_uint160)b; }
-inline bool operator!=(const uint160& a, const uint160& b)              { return (base_uint160)a != (base_uint160)b; }
-inline const uint160 operator^(const uint160& a, const uint160& b)      { return (base_uint160)a ^  (base_uint160)b; }
-inline const uint160 operator&(const uint160& a, const uint160& b)      { return (base_uint160)a &  (base_uint160)b; }
-inline const uint160 operator|(const uint160& a, const uint160& b)      { return (base_uint160)a |  (base_uint160)b; }
-inline const uint160 operator+(const uint160& a, const uint160& b)      { return (base_uint160)a +  (base_uint160)b; }
-inline const uint160 operator-(const uint160& a, const uint160& b)      { return (base_uint160)a -  (base_uint160)b; }
+inline bool operator<(const base_uint160& a, const uint160& b)          { return (const base_uint160&)a <  (const base_uint160&)b; }
+inline bool operator<=(const base_uint160& a, const uint160& b)         { return (const base_uint160&)a <= (const base_uint160&)b; }
+inline bool operator>(const base_uint160& a, const uint160& b)          { return (const base_uint160&)a >  (const base_uint160&)b; }
+inline bool operator>=(const base_uint160& a, const uint160& b)         { return (const base_uint160&)a >= (const base_uint160&)b; }
+inline bool operator==(const base_uint160& a, const uint160& b)         { return (const base_uint160&)a == (const base_uint160&)b; }
+inline bool operator!=(const base_uint160& a, const uint160& b)         { return (const base_uint160&)a != (const base_uint160&)b; }
+inline const uint160 operator^(const base_uint160& a, const uint160& b) { return (const base_uint160&)a ^  (const base_uint160&)b; }
+inline const uint160 operator&(const base_uint160& a, const uint160& b) { return (const base_uint160&)a &  (const base_uint160&)b; }
+inline const uint160 operator|(const base_uint160& a, const uint160& b) { return (const base_uint160&)a |  (const base_uint160&)b; }
+inline const uint160 operator+(const base_uint160& a, const uint160& b) { return (const base_uint160&)a +  (const base_uint160&)b; }
+inline const uint160 operator-(const base_uint160& a, const uint160& b) { return (const base_uint160&)a -  (const base_uint160&)b; }
+
+inline bool operator<(const uint160& a, const base_uint160& b)          { return (const base_uint160&)a <  (const base_uint160&)b; }
+inline bool operator<=(const uint160& a, const base_uint160& b)         { return (const base_uint160&)a <= (const base_uint160&)b; }
+inline bool operator>(const uint160& a, const base_uint160& b)          { return (const base_uint160&)a >  (const base_uint160&)b; }
+inline bool operator>=(const uint160& a, const base_uint160& b)         { return (const base_uint160&)a >= (const base_uint160&)b; }
+inline bool operator==(const uint160& a, const base_uint160& b)         { return (const base_uint160&)a == (const base_uint160&)b; }
+inline bool operator!=(const uint160& a, const base_uint160& b)         { return (const base_uint160&)a != (const base_uint160&)b; }
+inline const uint160 operator^(const uint160& a, const base_uint160& b) { return (const base_uint160&)a ^  (const base_uint160&)b; }
+inline const uint160 operator&(const uint160& a, const base_uint160& b) { return (const base_uint160&)a &  (const base_uint160&)b; }
+inline const uint160 operator|(const uint160& a, const base_uint160& b) { return (const base_uint160&)a |  (const base_uint160&)b; }
+inline const uint160 operator+(const uint160& a, const base_uint160& b) { return (const base_uint160&)a +  (const base_uint160&)b; }
+inline const uint160 operator-(const uint160& a, const base_uint160& b) { return (const base_uint160&)a -  (const base_uint160&)b; }
+
+inline bool operator<(const uint160& a, const uint160& b)               { return (const base_uint160&)a <  (const base_uint160&)b; }
+inline bool operator<=(const uint160& a, const uint160& b)              { return (const base_uint160&)a <= (const base_uint160&)b; }
+inline bool operator>(const uint160& a, const uint160& b)               { return (const base_uint160&)a >  (const base_uint160&)b; }
+inline bool operator>=(const uint160& a, const uint160& b)              { return (const base_uint160&)a >= (const base_uint160&)b; }
+inline bool operator==(const uint160& a, const uint160& b)              { return (const base_uint160&)a == (const base_uint160&)b; }
+inline bool operator!=(const uint160& a, const uint160& b)              { return (const base_uint160&)a != (const base_uint160&)b; }
+inline const uint160 operator^(const uint160& a, const uint160& b)      { return (const base_uint160&)a ^  (const base_uint160&)b; }
+inline const uint160 operator&(const uint160& a, const uint160& b)      { return (const base_uint160&)a &  (const base_uint160&)b; }
+inline const uint160 operator|(const uint160& a, const uint160& b)      { return (const base_uint160&)a |  (const base_uint160&)b; }
+inline const uint160 operator+(const uint160& a, const uint160& b)      { return (const base_uint160&)a +  (const base_uint160&)b; }
+inline const uint160 operator-(const uint160& a, const uint160& b)      { return (const base_uint160&)a -  (const base_uint160&)b; }
 
 
 
@@ -571,8 +669,8 @@ public:
     }
 };
 
-inline bool operator==(const uint256& a, uint64_t b)                         { return (base_uint256)a == b; }
-inline bool operator!=(const uint256& a, uint64_t b)                         { return (base_uint256)a != b; }
+inline bool operator==(const uint256& a, uint64_t b)                         { return (const base_uint256&)a == b; }
+inline bool operator!=(const uint256& a, uint64_t b)                         { return (const base_uint256&)a != b; }
 inline const uint256 operator<<(const base_uint256& a, unsigned int shift)   { return uint256(a) <<= shift; }
 inline const uint256 operator>>(const base_uint256& a, unsigned int shift)   { return uint256(a) >>= shift; }
 inline const uint256 operator<<(const uint256& a, unsigned int shift)        { return uint256(a) <<= shift; }
@@ -584,41 +682,41 @@ inline const uint256 operator|(const base_uint256& a, const base_uint256& b) { r
 inline const uint256 operator+(const base_uint256& a, const base_uint256& b) { return uint256(a) += b; }
 inline const uint256 operator-(const base_uint256& a, const base_uint256& b) { return uint256(a) -= b; }
 
-inline bool operator<(const base_uint256& a, const uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
-inline bool operator<=(const base_uint256& a, const uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
-inline bool operator>(const base_uint256& a, const uint256& b)          { return (base_uint256)a >  (base_uint256)b; }
-inline bool operator>=(const base_uint256& a, const uint256& b)         { return (base_uint256)a >= (base_uint256)b; }
-inline bool operator==(const base_uint256& a, const uint256& b)         { return (base_uint256)a == (base_uint256)b; }
-inline bool operator!=(const base_uint256& a, const uint256& b)         { return (base_uint256)a != (base_uint256)b; }
-inline const uint256 operator^(const base_uint256& a, const uint256& b) { return (base_uint256)a ^  (base_uint256)b; }
-inline const uint256 operator&(const base_uint256& a, const uint256& b) { return (base_uint256)a &  (base_uint256)b; }
-inline const uint256 operator|(const base_uint256& a, const uint256& b) { return (base_uint256)a |  (base_uint256)b; }
-inline const uint256 operator+(const base_uint256& a, const uint256& b) { return (base_uint256)a +  (base_uint256)b; }
-inline const uint256 operator-(const base_uint256& a, const uint256& b) { return (base_uint256)a -  (base_uint256)b; }
-
-inline bool operator<(const uint256& a, const base_uint256& b)          { return (base_uint256)a <  (base_uint256)b; }
-inline bool operator<=(const uint256& a, const base_uint256& b)         { return (base_uint256)a <= (base_uint256)b; }
-inline bool operator>(const uint256& a, const base_uint256& b)          { return (base_uint256)a >  (base_uint256)b; }
-inline bool operator>=(const uint256& a, const base_uint256& b)         { return (base_uint256)a >= (base_uint256)b; }
-inline bool operator==(const uint256& a, const base_uint256& b)         { return (base_uint256)a == (base_uint256)b; }
-inline bool operator!=(const uint256& a, const base_uint256& b)         { return (base_uint256)a != (base_uint256)b; }
-inline const uint256 operator^(const uint256& a, const base_uint256& b) { return (base_uint256)a ^  (base_uint256)b; }
-inline const uint256 operator&(const uint256& a, const base_uint256& b) { return (base_uint256)a &  (base_uint256)b; }
-inline const uint256 operator|(const uint256& a, const base_uint256& b) { return (base_uint256)a |  (base_uint256)b; }
-inline const uint256 operator+(const uint256& a, const base_uint256& b) { return (base_uint256)a +  (base_uint256)b; }
-inline const uint256 operator-(const uint256& a, const base_uint256& b) { return (base_uint256)a -  (base_uint256)b; }
-
-inline bool operator<(const uint256& a, const uint256& b)               { return (base_uint256)a <  (base_uint256)b; }
-inline bool operator<=(const uint256& a, const uint256& b)              { return (base_uint256)a <= (base_uint256)b; }
-inline bool operator>(const uint256& a, const uint256& b)               { return (base_uint256)a >  (base_uint256)b; }
-inline bool operator>=(const uint256& a, const uint256& b)              { return (base_uint256)a >= (base_uint256)b; }
-inline bool operator==(const uint256& a, const uint256& b)              { return (base_uint256)a == (base_uint256)b; }
-inline bool operator!=(const uint256& a, const uint256& b)              { return (base_uint256)a != (base_uint256)b; }
-inline const uint256 operator^(const uint256& a, const uint256& b)      { return (base_uint256)a ^  (base_uint256)b; }
-inline const uint256 operator&(const uint256& a, const uint256& b)      { return (base_uint256)a &  (base_uint256)b; }
-inline const uint256 operator|(const uint256& a, const uint256& b)      { return (base_uint256)a |  (base_uint256)b; }
-inline const uint256 operator+(const uint256& a, const uint256& b)      { return (base_uint256)a +  (base_uint256)b; }
-inline const uint256 operator-(const uint256& a, const uint256& b)      { return (base_uint256)a -  (base_uint256)b; }
+inline bool operator<(const base_uint256& a, const uint256& b)          { return (const base_uint256&)a <  (const base_uint256&)b; }
+inline bool operator<=(const base_uint256& a, const uint256& b)         { return (const base_uint256&)a <= (const base_uint256&)b; }
+inline bool operator>(const base_uint256& a, const uint256& b)          { return (const base_uint256&)a >  (const base_uint256&)b; }
+inline bool operator>=(const base_uint256& a, const uint256& b)         { return (const base_uint256&)a >= (const base_uint256&)b; }
+inline bool operator==(const base_uint256& a, const uint256& b)         { return (const base_uint256&)a == (const base_uint256&)b; }
+inline bool operator!=(const base_uint256& a, const uint256& b)         { return (const base_uint256&)a != (const base_uint256&)b; }
+inline const uint256 operator^(const base_uint256& a, const uint256& b) { return (const base_uint256&)a ^  (const base_uint256&)b; }
+inline const uint256 operator&(const base_uint256& a, const uint256& b) { return (const base_uint256&)a &  (const base_uint256&)b; }
+inline const uint256 operator|(const base_uint256& a, const uint256& b) { return (const base_uint256&)a |  (const base_uint256&)b; }
+inline const uint256 operator+(const base_uint256& a, const uint256& b) { return (const base_uint256&)a +  (const base_uint256&)b; }
+inline const uint256 operator-(const base_uint256& a, const uint256& b) { return (const base_uint256&)a -  (const base_uint256&)b; }
+
+inline bool operator<(const uint256& a, const base_uint256& b)          { return (const base_uint256&)a <  (const base_uint256&)b; }
+inline bool operator<=(const uint256& a, const base_uint256& b)         { return (const base_uint256&)a <= (const base_uint256&)b; }
+inline bool operator>(const uint256& a, const base_uint256& b)          { return (const base_uint256&)a >  (const base_uint256&)b; }
+inline bool operator>=(const uint256& a, const base_uint256& b)         { return (const base_uint256&)a >= (const base_uint256&)b; }
+inline bool operator==(const uint256& a, const base_uint256& b)         { return (const base_uint256&)a == (const base_uint256&)b; }
+inline bool operator!=(const uint256& a, const base_uint256& b)         { return (const base_uint256&)a != (const base_uint256&)b; }
+inline const uint256 operator^(const uint256& a, const base_uint256& b) { return (const base_uint256&)a ^  (const base_uint256&)b; }
+inline const uint256 operator&(const uint256& a, const base_uint256& b) { return (const base_uint256&)a &  (const base_uint256&)b; }
+inline const uint256 operator|(const uint256& a, const base_uint256& b) { return (const base_uint256&)a |  (const base_uint256&)b; }
+inline const uint256 operator+(const uint256& a, const base_uint256& b) { return (const base_uint256&)a +  (const base_uint256&)b; }
+inline const uint256 operator-(const uint256& a, const base_uint256& b) { return (const base_uint256&)a -  (const base_uint256&)b; }
+
+inline bool operator<(const uint256& a, const uint256& b)               { return (const base_uint256&)a <  (const base_uint256&)b; }
+inline bool operator<=(const uint256& a, const uint256& b)              { return (const base_uint256&)a <= (const base_uint256&)b; }
+inline bool operator>(const uint256& a, const uint256& b)               { return (const base_uint256&)a >  (const base_uint256&)b; }
+inline bool operator>=(const uint256& a, const uint256& b)              { return (const base_uint256&)a >= (const base_uint256&)b; }
+inline bool operator==(const uint256& a, const uint256& b)              { return (const base_uint256&)a == (const base_uint256&)b; }
+inline bool operator!=(const uint256& a, const uint256& b)              { return (const base_uint256&)a != (const base_uint256&)b; }
+inline const uint256 operator^(const uint256& a, const uint256& b)      { return (const base_uint256&)a ^  (const base_uint256&)b; }
+inline const uint256 operator&(const uint256& a, const uint256& b)      { return (const base_uint256&)a &  (const base_uint256&)b; }
+inline const uint256 operator|(const uint256& a, const uint256& b)      { return (const base_uint256&)a |  (const base_uint256&)b; }
+inline const uint256 operator+(const uint256& a, const uint256& b)      { return (const base_uint256&)a +  (const base_uint256&)b; }
+inline const uint256 operator-(const uint256& a, const uint256& b)      { return (const base_uint256&)a -  (const base_uint256&)b; }
 
 
 //////////////////////////////////////////////////////////////////////////////
@@ -691,8 +789,8 @@ public:
     }
 };
 
-inline bool operator==(const uint512& a, uint64_t b)                           { return (base_uint512)a == b; }
-inline bool operator!=(const uint512& a, uint64_t b)                           { return (base_uint512)a != b; }
+inline bool operator==(const uint512& a, uint64_t b)                           { return (const base_uint512&)a == b; }
+inline bool operator!=(const uint512& a, uint64_t b)                           { return (const base_uint512&)a != b; }
 inline const uint512 operator<<(const base_uint512& a, unsigned int shift)   { return uint512(a) <<= shift; }
 inline const uint512 operator>>(const base_uint512& a, unsigned int shift)   { return uint512(a) >>= shift; }
 inline const uint512 operator<<(const uint512& a, unsigned int shift)        { return uint512(a) <<= shift; }
@@ -704,41 +802,41 @@ inline const uint512 operator|(const base_uint512& a, const base_uint512& b) { r
 inline const uint512 operator+(const base_uint512& a, const base_uint512& b) { return uint512(a) += b; }
 inline const uint512 operator-(const base_uint512& a, const base_uint512& b) { return uint512(a) -= b; }
 
-inline bool operator<(const base_uint512& a, const uint512& b)          { return (base_uint512)a <  (base_uint512)b; }
-inline bool operator<=(const base_uint512& a, const uint512& b)         { return (base_uint512)a <= (base_uint512)b; }
-inline bool operator>(const base_uint512& a, const uint512& b)          { return (base_uint512)a >  (base_uint512)b; }
-inline bool operator>=(const base_uint512& a, const uint512& b)         { return (base_uint512)a >= (base_uint512)b; }
-inline bool operator==(const base_uint512& a, const uint512& b)         { return (base_uint512)a == (base_uint512)b; }
-inline bool operator!=(const base_uint512& a, const uint512& b)         { return (base_uint512)a != (base_uint512)b; }
-inline const uint512 operator^(const base_uint512& a, const uint512& b) { return (base_uint512)a ^  (base_uint512)b; }
-inline const uint512 operator&(const base_uint512& a, const uint512& b) { return (base_uint512)a &  (base_uint512)b; }
-inline const uint512 operator|(const base_uint512& a, const uint512& b) { return (base_uint512)a |  (base_uint512)b; }
-inline const uint512 operator+(const base_uint512& a, const uint512& b) { return (base_uint512)a +  (base_uint512)b; }
-inline const uint512 operator-(const base_uint512& a, const uint512& b) { return (base_uint512)a -  (base_uint512)b; }
-
-inline bool operator<(const uint512& a, const base_uint512& b)          { return (base_uint512)a <  (base_uint512)b; }
-inline bool operator<=(const uint512& a, const base_uint512& b)         { return (base_uint512)a <= (base_uint512)b; }
-inline bool operator>(const uint512& a, const base_uint512& b)          { return (base_uint512)a >  (base_uint512)b; }
-inline bool operator>=(const uint512& a, const base_uint512& b)         { return (base_uint512)a >= (base_uint512)b; }
-inline bool operator==(const uint512& a, const base_uint512& b)         { return (base_uint512)a == (base_uint512)b; }
-inline bool operator!=(const uint512& a, const base_uint512& b)         { return (base_uint512)a != (base_uint512)b; }
-inline const uint512 operator^(const uint512& a, const base_uint512& b) { return (base_uint512)a ^  (base_uint512)b; }
-inline const uint512 operator&(const uint512& a, const base_uint512& b) { return (base_uint512)a &  (base_uint512)b; }
-inline const uint512 operator|(const uint512& a, const base_uint512& b) { return (base_uint512)a |  (base_uint512)b; }
-inline const uint512 operator+(const uint512& a, const base_uint512& b) { return (base_uint512)a +  (base_uint512)b; }
-inline const uint512 operator-(const uint512& a, const base_uint512& b) { return (base_uint512)a -  (base_uint512)b; }
-
-inline bool operator<(const uint512& a, const uint512& b)               { return (base_uint512)a <  (base_uint512)b; }
-inline bool operator<=(const uint512& a, const uint512& b)              { return (base_uint512)a <= (base_uint512)b; }
-inline bool operator>(const uint512& a, const uint512& b)               { return (base_uint512)a >  (base_uint512)b; }
-inline bool operator>=(const uint512& a, const uint512& b)              { return (base_uint512)a >= (base_uint512)b; }
-inline bool operator==(const uint512& a, const uint512& b)              { return (base_uint512)a == (base_uint512)b; }
-inline bool operator!=(const uint512& a, const uint512& b)              { return (base_uint512)a != (base_uint512)b; }
-inline const uint512 operator^(const uint512& a, const uint512& b)      { return (base_uint512)a ^  (base_uint512)b; }
-inline const uint512 operator&(const uint512& a, const uint512& b)      { return (base_uint512)a &  (base_uint512)b; }
-inline const uint512 operator|(const uint512& a, const uint512& b)      { return (base_uint512)a |  (base_uint512)b; }
-inline const uint512 operator+(const uint512& a, const uint512& b)      { return (base_uint512)a +  (base_uint512)b; }
-inline const uint512 operator-(const uint512& a, const uint512& b)      { return (base_uint512)a -  (base_uint512)b; }
+inline bool operator<(const base_uint512& a, const uint512& b)          { return (const base_uint512&)a <  (const base_uint512&)b; }
+inline bool operator<=(const base_uint512& a, const uint512& b)         { return (const base_uint512&)a <= (const base_uint512&)b; }
+inline bool operator>(const base_uint512& a, const uint512& b)          { return (const base_uint512&)a >  (const base_uint512&)b; }
+inline bool operator>=(const base_uint512& a, const uint512& b)         { return (const base_uint512&)a >= (const base_uint512&)b; }
+inline bool operator==(const base_uint512& a, const uint512& b)         { return (const base_uint512&)a == (const base_uint512&)b; }
+inline bool operator!=(const base_uint512& a, const uint512& b)         { return (const base_uint512&)a != (const base_uint512&)b; }
+inline const uint512 operator^(const base_uint512& a, const uint512& b) { return (const base_uint512&)a ^  (const base_uint512&)b; }
+inline const uint512 operator&(const base_uint512& a, const uint512& b) { return (const base_uint512&)a &  (const base_uint512&)b; }
+inline const uint512 operator|(const base_uint512& a, const uint512& b) { return (const base_uint512&)a |  (const base_uint512&)b; }
+inline const uint512 operator+(const base_uint512& a, const uint512& b) { return (const base_uint512&)a +  (const base_uint512&)b; }
+inline const uint512 operator-(const base_uint512& a, const uint512& b) { return (const base_uint512&)a -  (const base_uint512&)b; }
+
+inline bool operator<(const uint512& a, const base_uint512& b)          { return (const base_uint512&)a <  (const base_uint512&)b; }
+inline bool operator<=(const uint512& a, const base_uint512& b)         { return (const base_uint512&)a <= (const base_uint512&)b; }
+inline bool operator>(const uint512& a, const base_uint512& b)          { return (const base_uint512&)a >  (const base_uint512&)b; }
+inline bool operator>=(const uint512& a, const base_uint512& b)         { return (const base_uint512&)a >= (const base_uint512&)b; }
+inline bool operator==(const uint512& a, const base_uint512& b)         { return (const base_uint512&)a == (const base_uint512&)b; }
+inline bool operator!=(const uint512& a, const base_uint512& b)         { return (const base_uint512&)a != (const base_uint512&)b; }
+inline const uint512 operator^(const uint512& a, const base_uint512& b) { return (const base_uint512&)a ^  (const base_uint512&)b; }
+inline const uint512 operator&(const uint512& a, const base_uint512& b) { return (const base_uint512&)a &  (const base_uint512&)b; }
+inline const uint512 operator|(const uint512& a, const base_uint512& b) { return (const base_uint512&)a |  (const base_uint512&)b; }
+inline const uint512 operator+(const uint512& a, const base_uint512& b) { return (const base_uint512&)a +  (const base_uint512&)b; }
+inline const uint512 operator-(const uint512& a, const base_uint512& b) { return (const base_uint512&)a -  (const base_uint512&)b; }
+
+inline bool operator<(const uint512& a, const uint512& b)               { return (const base_uint512&)a <  (const base_uint512&)b; }
+inline bool operator<=(const uint512& a, const uint512& b)              { return (const base_uint512&)a <= (const base_uint512&)b; }
+inline bool operator>(const uint512& a, const uint512& b)               { return (const base_uint512&)a >  (const base_uint512&)b; }
+inline bool operator>=(const uint512& a, const uint512& b)              { return (const base_uint512&)a >= (const base_uint512&)b; }
+inline bool operator==(const uint512& a, const uint512& b)              { return (const base_uint512&)a == (const base_uint512&)b; }
+inline bool operator!=(const uint512& a, const uint512& b)              { return (const base_uint512&)a != (const base_uint512&)b; }
+inline const uint512 operator^(const uint512& a, const uint512& b)      { return (const base_uint512&)a ^  (const base_uint512&)b; }
+inline const uint512 operator&(const uint512& a, const uint512& b)      { return (const base_uint512&)a &  (const base_uint512&)b; }
+inline const uint512 operator|(const uint512& a, const uint512& b)      { return (const base_uint512&)a |  (const base_uint512&)b; }
+inline const uint512 operator+(const uint512& a, const uint512& b)      { return (const base_uint512&)a +  (const base_uint512&)b; }
+inline const uint512 operator-(const uint512& a, const uint512& b)      { return (const base_uint512&)a -  (const base_uint512&)b; }
 
 
 
@@ -3,6 +3,7 @@
 #include "strlcpy.h"
 #include "version.h"
 #include "ui_interface.h"
+#include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/join.hpp>
 
 #include <stdio.h>
@@ -63,6 +64,9 @@ namespace boost {
 #include "shlobj.h"
 #elif defined(__linux__)
 # include <sys/prctl.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sched.h>
 #endif
 
 using namespace std;
@@ -73,6 +77,7 @@ map<string, string> mapArgs;
 map<string, vector<string> > mapMultiArgs;
 bool fDebug = false;
 bool fDebugNet = false;
+bool fDebugBench = false;
 bool fPrintToConsole = false;
 bool fPrintToDebugger = false;
 bool fRequestShutdown = false;
@@ -85,7 +90,8 @@ bool fTestNet = false;
 bool fViewWallet = false;
 bool fNoListen = false;
 bool fLogTimestamps = false;
-CMedianFilter<int64_t> vTimeOffsets(200,0);
+static CCriticalSection cs_timedata;
+static CMedianFilter<int64_t> vTimeOffsets(200,0);
 bool fReopenDebugLog = false;
 
 
@@ -139,16 +145,37 @@ void ex(void)
   abort();
 }
 
+// One cipher context per thread, set up afresh by each EncryptInit or
+// DecryptInit rather than allocated for every message
+static boost::thread_specific_ptr<EVP_CIPHER_CTX> pcipherctx(EVP_CIPHER_CTX_free);
+
+static EVP_CIPHER_CTX* ThreadCipherContext()
+{
+  if(!pcipherctx.get())
+  {
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if(!ctx) ex();
+    pcipherctx.reset(ctx);
+  }
+  return pcipherctx.get();
+}
+
+static boost::once_flag fCryptoLoaded = BOOST_ONCE_INIT;
+
+static void LoadCrypto()
+{
+  ERR_load_crypto_strings();
+  OpenSSL_add_all_algorithms();
+}
+
 int encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *key,
   unsigned char *iv, unsigned char *ciphertext)
 {
-  EVP_CIPHER_CTX *ctx;
+  EVP_CIPHER_CTX *ctx = ThreadCipherContext();
 
 
   int ciphertext_len = 0;
 
-  if(!(ctx = EVP_CIPHER_CTX_new())) ex();
-
   if(EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
     ex();
 
@@ -160,21 +187,17 @@ int encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *key,
   if(EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1) ex();
   ciphertext_len += len;
 
-  EVP_CIPHER_CTX_free(ctx);
-
   return ciphertext_len;
 }
 
 int decrypt(unsigned char* ciphertext, int ciphertext_len, unsigned char* key,
   unsigned char *iv, unsigned char *plaintext)
 {
-  EVP_CIPHER_CTX *ctx;
+  EVP_CIPHER_CTX *ctx = ThreadCipherContext();
 
 
   int plaintext_len=0;
 
-  if(!(ctx = EVP_CIPHER_CTX_new())) ex();
-
   if(EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) != 1)
     ex();
 
@@ -186,8 +209,6 @@ int decrypt(unsigned char* ciphertext, int ciphertext_len, unsigned char* key,
   if(EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1) ex();
   plaintext_len += len;
 
-  EVP_CIPHER_CTX_free(ctx);
-
   return plaintext_len;
 }
 
@@ -213,8 +234,7 @@ bool EncryptMessageAES(const string& message, string& encryptedMsg, vector<unsig
   unsigned char* msg = (unsigned char*)m;
 
 
-  ERR_load_crypto_strings();
-  OpenSSL_add_all_algorithms();
+  boost::call_once(LoadCrypto, fCryptoLoaded);
 
 
   unsigned char* encrypted_msg = (unsigned char*)malloc(message.size() + 16);
@@ -238,8 +258,7 @@ bool EncryptMessageAES(const string& message, string& encryptedMsg, vector<unsig
 bool DecryptMessageAES(const string& encryptedMsg, string& message, vector<unsigned char>& key, string& iv128Base64)
 {
 
-  ERR_load_crypto_strings();
-  OpenSSL_add_all_algorithms();
+  boost::call_once(LoadCrypto, fCryptoLoaded);
 
 
   unsigned char* plain = (unsigned char*)malloc(encryptedMsg.size());
@@ -262,34 +281,72 @@ bool DecryptMessageAES(const string& encryptedMsg, string& message, vector<unsig
   return true;
 }
 
+// Parsed RSA keys by their PEM text, so that a run of messages under one
+// key parses it once. Held under cs_rsakeys while in use; the private ones
+// are freed by ClearRSAKeyCache when the wallet locks.
+static const unsigned int MAX_RSA_KEY_CACHE = 256;
+static CCriticalSection cs_rsakeys;
+static map<string, RSA*> mapRSAPrivKeys;
+static map<string, RSA*> mapRSAPubKeys;
+
+static void FreeRSAKeys(map<string, RSA*>& mapKeys)
+{
+  for(map<string, RSA*>::iterator it = mapKeys.begin(); it != mapKeys.end(); ++it)
+    RSA_free(it->second);
+  mapKeys.clear();
+}
+
+static RSA* CachedRSAKey(const string& strPEM, bool fPrivate)
+{
+  AssertLockHeld(cs_rsakeys);
+  map<string, RSA*>& mapKeys = fPrivate ? mapRSAPrivKeys : mapRSAPubKeys;
+  map<string, RSA*>::iterator mi = mapKeys.find(strPEM);
+  if(mi != mapKeys.end())
+    return mi->second;
+
+  BIO *keybio = BIO_new_mem_buf((void*)strPEM.c_str(), -1);
+  if(keybio == NULL)
+    return NULL;
+  RSA *rsa = fPrivate ? PEM_read_bio_RSAPrivateKey(keybio, NULL, NULL, NULL)
+                      : PEM_read_bio_RSA_PUBKEY(keybio, NULL, NULL, NULL);
+  BIO_free(keybio);
+  if(rsa == NULL)
+    return NULL;
+
+  if(mapKeys.size() >= MAX_RSA_KEY_CACHE)
+    FreeRSAKeys(mapKeys);
+  mapKeys[strPEM] = rsa;
+  return rsa;
+}
+
+void ClearRSAKeyCache()
+{
+  LOCK(cs_rsakeys);
+  FreeRSAKeys(mapRSAPrivKeys);
+}
+
 bool EncryptMessage(const string& rsaPubKey, const string& message, string& encryptedMsg)
 {
   const int KEY_LENGTH=4096;
 
-  const char* pubKeyStr = rsaPubKey.c_str();
-
   const unsigned char* msg = reinterpret_cast<const unsigned char*>(message.c_str());
 
-  RSA *rsa= NULL;
-  BIO *keybio ;
-  keybio = BIO_new_mem_buf((void*)pubKeyStr, -1);
-  if (keybio==NULL)
-  {
+  LOCK(cs_rsakeys);
+  RSA *rsa = CachedRSAKey(rsaPubKey, false);
+  if(rsa == NULL)
     return false;
-  }
-
-  rsa = PEM_read_bio_RSA_PUBKEY(keybio, &rsa,NULL, NULL);
 
   unsigned char encrypted[KEY_LENGTH/8] = { };
 
   int result = RSA_public_encrypt(message.size(),msg,encrypted,rsa,RSA_PKCS1_OAEP_PADDING);
-  if(result != 0)
+  if(result == -1)
   {
-     ERR_load_crypto_strings();
+     boost::call_once(LoadCrypto, fCryptoLoaded);
      char* err = (char*)malloc(0x100);
      ERR_error_string(ERR_get_error(), err);
      fprintf(stderr, "Error encrypting message: %s\n", err);
      free(err);
+     return false;
   }
 
 
@@ -299,20 +356,14 @@ bool EncryptMessage(const string& rsaPubKey, const string& message, string& encr
 }
 bool DecryptMessage(const string& rsaPrivKey, const string& encrypted, string& decryptedMsg)
 {
-  const char* privKeyStr = rsaPrivKey.c_str();
-
-
   vector<unsigned char> msg = DecodeBase64(encrypted.c_str());
-
-  RSA *rsa= NULL;
-  BIO *keybio ;
-  keybio = BIO_new_mem_buf((unsigned char*)privKeyStr, -1);
-  if (keybio==NULL)
-  {
+  if(msg.empty())
     return false;
-  }
 
-  rsa = PEM_read_bio_RSAPrivateKey(keybio, &rsa,NULL, NULL);
+  LOCK(cs_rsakeys);
+  RSA *rsa = CachedRSAKey(rsaPrivKey, true);
+  if(rsa == NULL)
+    return false;
 
   unsigned char decrypted[4098] = { };
 
@@ -440,12 +491,224 @@ uint256 GetRandHash()
     return hash;
 }
 
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; \
+    v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; \
+    v2 = ROTL(v2, 32); \
+} while (0)
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // No tail bytes left, just the length
+    uint64_t m = ((uint64_t)32) << 56;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    for (int i = 0; i < 4; i++)
+    {
+        uint64_t m = val.Get64(i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // The extra word is the tail, next to the length
+    uint64_t m = (((uint64_t)36) << 56) | extra;
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Padding of a 64-byte message: its second block, 512 in the length
+static const unsigned char pchPad64[64] = { 0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00 };
+
+static void WriteSHA256State(const SHA256_CTX& ctx, unsigned char* pchOut)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        pchOut[4 * i]     = ctx.h[i] >> 24;
+        pchOut[4 * i + 1] = ctx.h[i] >> 16;
+        pchOut[4 * i + 2] = ctx.h[i] >> 8;
+        pchOut[4 * i + 3] = ctx.h[i];
+    }
+}
+
+uint256 Hash64(const unsigned char* pch)
+{
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Transform(&ctx, pch);
+    SHA256_Transform(&ctx, pchPad64);
+
+    // The 32-byte first hash and its padding fill one block
+    unsigned char block[64] = { 0 };
+    WriteSHA256State(ctx, block);
+    block[32] = 0x80;
+    block[62] = 0x01;
+    SHA256_Init(&ctx);
+    SHA256_Transform(&ctx, block);
+
+    uint256 hash;
+    WriteSHA256State(ctx, (unsigned char*)&hash);
+    return hash;
+}
+
+uint64_t SipHashBytes(uint64_t k0, uint64_t k1, const unsigned char* pch, size_t nSize)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    size_t i = 0;
+    for (; i + 8 <= nSize; i += 8)
+    {
+        uint64_t m = 0;
+        for (int j = 0; j < 8; j++)
+            m |= ((uint64_t)pch[i + j]) << (8 * j);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // The tail bytes, with the length in the top byte
+    uint64_t m = ((uint64_t)nSize) << 56;
+    for (int j = 0; i + j < nSize; j++)
+        m |= ((uint64_t)pch[i + j]) << (8 * j);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
 
 
 
 
 
 
+
+// debug.log, and the text formatted for it that ThreadDebugLog has yet to
+// write. The queue lock is taken before the file lock, so whoever writes a
+// batch out does so before anything queued after it.
+static FILE* fileoutDebugLog = NULL;
+static boost::mutex* mutexDebugLog = NULL;
+static boost::mutex* mutexDebugLogFile = NULL;
+static std::string* pstrDebugLogQueue = NULL;
+static bool fDebugLogThread = false;
+static bool fStartedNewLine = true;
+static boost::once_flag debugLogOnce = BOOST_ONCE_INIT;
+
+// Past this much queued text the logging thread writes it out itself
+static const unsigned int MAX_DEBUG_LOG_QUEUE = 4 * 1024 * 1024;
+
+static void InitDebugLog()
+{
+    mutexDebugLog = new boost::mutex();
+    mutexDebugLogFile = new boost::mutex();
+    pstrDebugLogQueue = new std::string();
+}
+
+// Takes the queue lock held and hands over to the file lock
+static void WriteDebugLogQueue(boost::mutex::scoped_lock& lockQueue)
+{
+    std::string str;
+    str.swap(*pstrDebugLogQueue);
+    boost::mutex::scoped_lock lockFile(*mutexDebugLogFile);
+    lockQueue.unlock();
+
+    if (fReopenDebugLog) {
+        fReopenDebugLog = false;
+        boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
+        if (freopen(pathDebug.string().c_str(),"a",fileoutDebugLog) == NULL)
+            return;
+    }
+
+    if (!str.empty())
+    {
+        fwrite(str.data(), 1, str.size(), fileoutDebugLog);
+        fflush(fileoutDebugLog);
+    }
+}
+
+void ThreadDebugLog(void* parg)
+{
+    RenameThread("iocoin-log");
+    boost::call_once(InitDebugLog, debugLogOnce);
+
+    {
+        boost::mutex::scoped_lock lock(*mutexDebugLog);
+        fDebugLogThread = true;
+    }
+    while (!fShutdown)
+    {
+        MilliSleep(100);
+        boost::mutex::scoped_lock lock(*mutexDebugLog);
+        if (fileoutDebugLog && (!pstrDebugLogQueue->empty() || fReopenDebugLog))
+            WriteDebugLogQueue(lock);
+    }
+
+    // Whatever is logged from here on is written as it comes
+    boost::mutex::scoped_lock lock(*mutexDebugLog);
+    fDebugLogThread = false;
+    if (fileoutDebugLog)
+        WriteDebugLogQueue(lock);
+}
+
 inline int OutputDebugStringF(const char* pszFormat, ...)
 {
     int ret = 0;
@@ -459,38 +722,18 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     }
     else if (!fPrintToDebugger)
     {
+        boost::call_once(InitDebugLog, debugLogOnce);
+        boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
 
-        static FILE* fileout = NULL;
-
-        if (!fileout)
+        if (!fileoutDebugLog)
         {
             boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-            fileout = fopen(pathDebug.string().c_str(), "a");
-            if (fileout) setbuf(fileout, NULL);
+            fileoutDebugLog = fopen(pathDebug.string().c_str(), "a");
         }
-        if (fileout)
+        if (fileoutDebugLog)
         {
-            static bool fStartedNewLine = true;
-
-
-
-
-
-            static boost::mutex* mutexDebugLog = NULL;
-            if (mutexDebugLog == NULL) mutexDebugLog = new boost::mutex();
-            boost::mutex::scoped_lock scoped_lock(*mutexDebugLog);
-
-
-            if (fReopenDebugLog) {
-                fReopenDebugLog = false;
-                boost::filesystem::path pathDebug = GetDataDir() / "debug.log";
-                if (freopen(pathDebug.string().c_str(),"a",fileout) != NULL)
-                    setbuf(fileout, NULL);
-            }
-
-
             if (fLogTimestamps && fStartedNewLine)
-                fprintf(fileout, "%s ", DateTimeStrFormat("%x %H:%M:%S", GetTime()).c_str());
+                *pstrDebugLogQueue += DateTimeStrFormat("%x %H:%M:%S", GetTime()) + " ";
             if (pszFormat[strlen(pszFormat) - 1] == '\n')
                 fStartedNewLine = true;
             else
@@ -498,8 +741,14 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
 
             va_list arg_ptr;
             va_start(arg_ptr, pszFormat);
-            ret = vfprintf(fileout, pszFormat, arg_ptr);
+            std::string str = vstrprintf(pszFormat, arg_ptr);
             va_end(arg_ptr);
+            *pstrDebugLogQueue += str;
+            ret = str.size();
+
+            // Without the logging thread every message is on disk before printf returns
+            if (!fDebugLogThread || pstrDebugLogQueue->size() > MAX_DEBUG_LOG_QUEUE)
+                WriteDebugLogQueue(scoped_lock);
         }
     }
 
@@ -531,6 +780,18 @@ inline int OutputDebugStringF(const char* pszFormat, ...)
     return ret;
 }
 
+static std::set<std::string> setDebugCategories;
+
+void SetDebugCategories(const std::vector<std::string>& vCategories)
+{
+    setDebugCategories.insert(vCategories.begin(), vCategories.end());
+}
+
+bool LogAcceptCategory(const char* pszCategory)
+{
+    return fDebug || (!setDebugCategories.empty() && setDebugCategories.count(pszCategory));
+}
+
 string vstrprintf(const char *format, va_list ap)
 {
     char buffer[50000];
@@ -1362,6 +1623,15 @@ void FileCommit(FILE *fileout)
 #endif
 }
 
+void AllocateFileRange(FILE *file, unsigned int nOffset, unsigned int nLength)
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+    // Only the blocks are reserved; the size stays where writes left it,
+    // so appends and readers that go by the file size are unaffected
+    fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, nOffset, nLength);
+#endif
+}
+
 void ShrinkDebugFile()
 {
 
@@ -1398,11 +1668,18 @@ void SetMockTime(int64_t nMockTimeIn)
     nMockTime = nMockTimeIn;
 }
 
+// Set by AddTimeData under cs_timedata, read without a lock: staking asks
+// for the adjusted time in its tightest loops
 static int64_t nTimeOffset = 0;
 
 int64_t GetTimeOffset()
 {
-    return nTimeOffset;
+    return __atomic_load_n(&nTimeOffset, __ATOMIC_RELAXED);
+}
+
+static void SetTimeOffset(int64_t nOffset)
+{
+    __atomic_store_n(&nTimeOffset, nOffset, __ATOMIC_RELAXED);
 }
 
 int64_t GetAdjustedTime()
@@ -1414,26 +1691,25 @@ void AddTimeData(const CNetAddr& ip, int64_t nTime)
 {
     int64_t nOffsetSample = nTime - GetTime();
 
-
+    LOCK(cs_timedata);
     static set<CNetAddr> setKnown;
     if (!setKnown.insert(ip).second)
         return;
 
-
     vTimeOffsets.input(nOffsetSample);
     printf("Added time data, samples %d, offset %+"PRId64" (%+"PRId64" minutes)\n", vTimeOffsets.size(), nOffsetSample, nOffsetSample/60);
     if (vTimeOffsets.size() >= 5 && vTimeOffsets.size() % 2 == 1)
     {
         int64_t nMedian = vTimeOffsets.median();
-        std::vector<int64_t> vSorted = vTimeOffsets.sorted();
+        const std::vector<int64_t>& vSorted = vTimeOffsets.sorted();
 
         if (abs64(nMedian) < 70 * 60)
         {
-            nTimeOffset = nMedian;
+            SetTimeOffset(nMedian);
         }
         else
         {
-            nTimeOffset = 0;
+            SetTimeOffset(0);
 
             static bool fDone;
             if (!fDone)
@@ -1459,7 +1735,7 @@ void AddTimeData(const CNetAddr& ip, int64_t nTime)
                 printf("%+"PRId64"  ", n);
             printf("|  ");
         }
-        printf("nTimeOffset = %+"PRId64"  (%+"PRId64" minutes)\n", nTimeOffset, nTimeOffset/60);
+        printf("nTimeOffset = %+"PRId64"  (%+"PRId64" minutes)\n", GetTimeOffset(), GetTimeOffset()/60);
     }
 }
 
@@ -1587,6 +1863,218 @@ bool NewThread(void(*pfn)(void*), void* parg)
     return true;
 }
 
+struct CThreadPoolConfig
+{
+    const char* pszName;
+    int nPriority;
+    std::vector<int> vCPUs;
+    int nRunning;
+
+    CThreadPoolConfig(const char* pszNameIn, int nPriorityIn) : pszName(pszNameIn), nPriority(nPriorityIn), nRunning(0) {}
+};
+
+// Staking keeps the lowest priority its threads always had, and background
+// work makes way for everything else
+static CThreadPoolConfig threadPools[THREADPOOL_MAX] =
+{
+    CThreadPoolConfig("validation", THREAD_PRIORITY_NORMAL),
+    CThreadPoolConfig("network", THREAD_PRIORITY_NORMAL),
+    CThreadPoolConfig("rpc", THREAD_PRIORITY_NORMAL),
+    CThreadPoolConfig("staking", THREAD_PRIORITY_LOWEST),
+    CThreadPoolConfig("background", THREAD_PRIORITY_BELOW_NORMAL),
+};
+
+// Set once any pool is pinned
+static bool fThreadAffinity = false;
+#if defined(__linux__)
+static cpu_set_t setProcessCPUs;
+#endif
+
+static const struct
+{
+    const char* pszName;
+    int nPriority;
+} threadPriorities[] =
+{
+    { "lowest", THREAD_PRIORITY_LOWEST },
+    { "low", THREAD_PRIORITY_BELOW_NORMAL },
+    { "normal", THREAD_PRIORITY_NORMAL },
+    { "high", THREAD_PRIORITY_HIGHEST },
+};
+
+bool ParseCPUList(const std::string& str, std::vector<int>& vCPUs)
+{
+    vCPUs.clear();
+    std::vector<std::string> vRanges;
+    boost::split(vRanges, str, boost::is_any_of(","));
+    BOOST_FOREACH(const std::string& strRange, vRanges)
+    {
+        int nFirst, nLast;
+        char c;
+        if (sscanf(strRange.c_str(), "%d-%d%c", &nFirst, &nLast, &c) == 2)
+            ;
+        else if (sscanf(strRange.c_str(), "%d%c", &nFirst, &c) == 1 && strRange.find('-') == std::string::npos)
+            nLast = nFirst;
+        else
+            return false;
+        if (nFirst < 0 || nLast < nFirst || nLast >= 1024)
+            return false;
+        for (int n = nFirst; n <= nLast; n++)
+            if (std::find(vCPUs.begin(), vCPUs.end(), n) == vCPUs.end())
+                vCPUs.push_back(n);
+    }
+    std::sort(vCPUs.begin(), vCPUs.end());
+    return !vCPUs.empty();
+}
+
+// Split <pool>:<value>
+static bool ParseThreadPoolArg(const std::string& strArg, int& nPool, std::string& strValue)
+{
+    size_t nColon = strArg.find(':');
+    if (nColon == std::string::npos)
+        return false;
+    std::string strPool = strArg.substr(0, nColon);
+    strValue = strArg.substr(nColon + 1);
+    for (nPool = 0; nPool < THREADPOOL_MAX; nPool++)
+        if (strPool == threadPools[nPool].pszName)
+            return true;
+    return false;
+}
+
+bool InitThreadPools(std::string& strError)
+{
+    BOOST_FOREACH(const std::string& strArg, mapMultiArgs["-threadpriority"])
+    {
+        int nPool;
+        std::string strValue;
+        if (!ParseThreadPoolArg(strArg, nPool, strValue))
+        {
+            strError = strprintf("Invalid -threadpriority '%s'", strArg.c_str());
+            return false;
+        }
+        unsigned int i = 0;
+        while (i < ARRAYLEN(threadPriorities) && strValue != threadPriorities[i].pszName)
+            i++;
+        if (i == ARRAYLEN(threadPriorities))
+        {
+            strError = strprintf("Invalid -threadpriority '%s'", strArg.c_str());
+            return false;
+        }
+        threadPools[nPool].nPriority = threadPriorities[i].nPriority;
+    }
+
+    BOOST_FOREACH(const std::string& strArg, mapMultiArgs["-threadaffinity"])
+    {
+        int nPool;
+        std::string strValue;
+        if (!ParseThreadPoolArg(strArg, nPool, strValue) || !ParseCPUList(strValue, threadPools[nPool].vCPUs))
+        {
+            strError = strprintf("Invalid -threadaffinity '%s'", strArg.c_str());
+            return false;
+        }
+#if !defined(__linux__) && !defined(WIN32)
+        printf("InitThreadPools() : -threadaffinity is not supported on this platform\n");
+#endif
+        fThreadAffinity = true;
+    }
+
+#if defined(__linux__)
+    CPU_ZERO(&setProcessCPUs);
+    if (fThreadAffinity && sched_getaffinity(0, sizeof(setProcessCPUs), &setProcessCPUs) != 0)
+        fThreadAffinity = false;
+#endif
+    return true;
+}
+
+static void SetThreadAffinity(const std::vector<int>& vCPUs)
+{
+    // A thread starts with the affinity of the one that started it, which
+    // may be in another pool, so unpinned pools get all of the process's CPUs
+    if (!fThreadAffinity)
+        return;
+#if defined(__linux__)
+    cpu_set_t set;
+    if (vCPUs.empty())
+        set = setProcessCPUs;
+    else
+    {
+        CPU_ZERO(&set);
+        BOOST_FOREACH(int nCPU, vCPUs)
+            if (nCPU < CPU_SETSIZE)
+                CPU_SET(nCPU, &set);
+    }
+    int nErr = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (nErr != 0)
+        printf("SetThreadAffinity() : pthread_setaffinity_np failed: %s\n", strerror(nErr));
+#elif defined(WIN32)
+    DWORD_PTR nMask = 0, nSystemMask = 0;
+    if (vCPUs.empty())
+        GetProcessAffinityMask(GetCurrentProcess(), &nMask, &nSystemMask);
+    BOOST_FOREACH(int nCPU, vCPUs)
+        if (nCPU < (int)(8 * sizeof(nMask)))
+            nMask |= (DWORD_PTR)1 << nCPU;
+    if (!SetThreadAffinityMask(GetCurrentThread(), nMask))
+        printf("SetThreadAffinity() : SetThreadAffinityMask failed: %d\n", (int)GetLastError());
+#endif
+}
+
+void SetThreadPoolPriority(ThreadPool pool, bool fAtLeastNormal)
+{
+    int nPriority = threadPools[pool].nPriority;
+    if (fAtLeastNormal && nPriority != THREAD_PRIORITY_HIGHEST)
+        nPriority = THREAD_PRIORITY_NORMAL;
+    // Raising it above normal needs privileges (CAP_SYS_NICE) on Linux
+    SetThreadPriority(nPriority);
+}
+
+static void ThreadPoolStart(void(*pfn)(void*), void* parg, ThreadPool pool)
+{
+    CThreadPoolConfig& config = threadPools[pool];
+    SetThreadAffinity(config.vCPUs);
+    SetThreadPoolPriority(pool);
+    __sync_fetch_and_add(&config.nRunning, 1);
+    try
+    {
+        pfn(parg);
+    }
+    catch (...)
+    {
+        __sync_fetch_and_sub(&config.nRunning, 1);
+        throw;
+    }
+    __sync_fetch_and_sub(&config.nRunning, 1);
+}
+
+bool NewThread(void(*pfn)(void*), void* parg, ThreadPool pool)
+{
+    try
+    {
+        boost::thread(ThreadPoolStart, pfn, parg, pool);
+    } catch(boost::thread_resource_error &e) {
+        printf("Error creating thread: %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+void GetThreadPoolInfo(std::vector<CThreadPoolInfo>& vInfo)
+{
+    vInfo.clear();
+    for (int nPool = 0; nPool < THREADPOOL_MAX; nPool++)
+    {
+        const CThreadPoolConfig& config = threadPools[nPool];
+        CThreadPoolInfo info;
+        info.strName = config.pszName;
+        info.strPriority = strprintf("%d", config.nPriority);
+        for (unsigned int i = 0; i < ARRAYLEN(threadPriorities); i++)
+            if (threadPriorities[i].nPriority == config.nPriority)
+                info.strPriority = threadPriorities[i].pszName;
+        info.vCPUs = config.vCPUs;
+        info.nRunning = __sync_fetch_and_add(const_cast<int*>(&config.nRunning), 0);
+        vInfo.push_back(info);
+    }
+}
+
 
 int fqa__7(vector<unsigned char>& a)
 {
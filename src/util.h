@@ -14,6 +14,7 @@
 #include <sys/resource.h>
 #endif
 
+#include <deque>
 #include <map>
 #include <vector>
 #include <string>
@@ -131,6 +132,7 @@ extern std::map<std::string, std::string> mapArgs;
 extern std::map<std::string, std::vector<std::string> > mapMultiArgs;
 extern bool fDebug;
 extern bool fDebugNet;
+extern bool fDebugBench;
 extern bool fPrintToConsole;
 extern bool fPrintToDebugger;
 extern bool fRequestShutdown;
@@ -149,6 +151,8 @@ bool EncryptMessageAES(const std::string& message, std::string& encryptedMsg, st
 bool DecryptMessageAES(const std::string& encryptedMsg, std::string& message, std::vector<unsigned char>& key, std::string& iv128Base64);
 bool EncryptMessage(const std::string& rsaPubKey, const std::string& message, std::string& encryptedMsg);
 bool DecryptMessage(const std::string& rsaPrivKey, const std::string& encrpyted, std::string& decryptedMsg);
+// Forget the parsed RSA private keys DecryptMessage keeps
+void ClearRSAKeyCache();
 void GenerateRSAKey(CoordinateVector& p);
 void GenerateAESKey(vchType& rsaPubKey);
 
@@ -157,6 +161,12 @@ int fqa__7(vector<unsigned char>&);
 void RandAddSeed();
 void RandAddSeedPerfmon();
 int ATTR_WARN_PRINTF(1,2) OutputDebugStringF(const char* pszFormat, ...);
+// Writes debug.log from the queue printf fills, so callers skip the syscalls
+void ThreadDebugLog(void* parg);
+// The categories -debug=<category> names
+void SetDebugCategories(const std::vector<std::string>& vCategories);
+// True when -debug or -debug=<category> asks for this category
+bool LogAcceptCategory(const char* pszCategory);
 
 /*
   Rationale for the real_strprintf / strprintf construction:
@@ -184,6 +194,10 @@ bool ATTR_WARN_PRINTF(1,2) error(const char *format, ...);
  */
 #define printf OutputDebugStringF
 
+/* printf for one category of debug messages. The arguments are not even
+ * evaluated unless the category is enabled. */
+#define LogPrint(category, ...) do { if (LogAcceptCategory(category)) printf(__VA_ARGS__); } while (0)
+
 void PrintException(std::exception* pex, const char* pszThread);
 void PrintExceptionContinue(std::exception* pex, const char* pszThread);
 void ParseString(const std::string& str, char c, std::vector<std::string>& v);
@@ -205,6 +219,9 @@ void ParseParameters(int argc, const char*const argv[]);
 bool WildcardMatch(const char* psz, const char* mask);
 bool WildcardMatch(const std::string& str, const std::string& mask);
 void FileCommit(FILE *fileout);
+/** Reserve disk space for nLength bytes at nOffset without changing the
+ *  file's size, where the platform can. A hint only; failure is ignored. */
+void AllocateFileRange(FILE *file, unsigned int nOffset, unsigned int nLength);
 bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest);
 boost::filesystem::path GetDefaultDataDir();
 const boost::filesystem::path &GetDataDir(bool fNetSpecific = true);
@@ -221,6 +238,12 @@ void ShrinkDebugFile();
 int GetRandInt(int nMax);
 uint64_t GetRand(uint64_t nMax);
 uint256 GetRandHash();
+/** SipHash-2-4 of a 32-byte value, keyed with k0 and k1 */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+/** Same, with a 4-byte word after the value */
+uint64_t SipHashUint256Extra(uint64_t k0, uint64_t k1, const uint256& val, uint32_t extra);
+/** SipHash-2-4 of nSize bytes at pch */
+uint64_t SipHashBytes(uint64_t k0, uint64_t k1, const unsigned char* pch, size_t nSize);
 int64_t GetTime();
 void SetMockTime(int64_t nMockTimeIn);
 int64_t GetAdjustedTime();
@@ -333,6 +356,12 @@ inline int64_t GetPerformanceCounter()
     return nCounter;
 }
 
+inline int64_t GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline int64_t GetTimeMillis()
 {
     return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
@@ -531,6 +560,11 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+/** Hash() of exactly 64 bytes, as a merkle node hashes its two children.
+ *  The padding blocks are fixed, so it runs three block transforms and
+ *  none of the SHA256_Update buffering. */
+uint256 Hash64(const unsigned char* pch);
+
 inline uint160 Hash160(const std::vector<unsigned char>& vch)
 {
     uint256 hash1;
@@ -561,29 +595,29 @@ bool TimingResistantEqual(const T& a, const T& b)
 template <typename T> class CMedianFilter
 {
 private:
-    std::vector<T> vValues;
+    std::deque<T> vValues;
     std::vector<T> vSorted;
     unsigned int nSize;
 public:
     CMedianFilter(unsigned int size, T initial_value):
         nSize(size)
     {
-        vValues.reserve(size);
+        vSorted.reserve(size);
         vValues.push_back(initial_value);
-        vSorted = vValues;
+        vSorted.push_back(initial_value);
     }
 
     void input(T value)
     {
+        // vSorted stays sorted: the oldest value is taken out and the new
+        // one put in its place, instead of sorting everything again
         if(vValues.size() == nSize)
         {
-            vValues.erase(vValues.begin());
+            vSorted.erase(std::lower_bound(vSorted.begin(), vSorted.end(), vValues.front()));
+            vValues.pop_front();
         }
         vValues.push_back(value);
-
-        vSorted.resize(vValues.size());
-        std::copy(vValues.begin(), vValues.end(), vSorted.begin());
-        std::sort(vSorted.begin(), vSorted.end());
+        vSorted.insert(std::upper_bound(vSorted.begin(), vSorted.end(), value), value);
     }
 
     T median() const
@@ -605,7 +639,7 @@ public:
         return vValues.size();
     }
 
-    std::vector<T> sorted () const
+    const std::vector<T>& sorted () const
     {
         return vSorted;
     }
@@ -613,6 +647,43 @@ public:
 
 bool NewThread(void(*pfn)(void*), void* parg);
 
+/** The pools threads are started into. A pool has the same priority and CPU
+ *  affinity for all its threads, set with -threadpriority=<pool>:<priority>
+ *  and -threadaffinity=<pool>:<cpus>; how many threads it has is up to its
+ *  own option (-par, -rpcthreads, -stakethreads). */
+enum ThreadPool
+{
+    THREADPOOL_VALIDATION,
+    THREADPOOL_NETWORK,
+    THREADPOOL_RPC,
+    THREADPOOL_STAKING,
+    THREADPOOL_BACKGROUND,
+
+    THREADPOOL_MAX
+};
+
+struct CThreadPoolInfo
+{
+    std::string strName;
+    std::string strPriority;
+    std::vector<int> vCPUs;
+    int nRunning;
+};
+
+/** Start a thread in a pool, which gets the pool's priority and affinity
+ *  before pfn runs */
+bool NewThread(void(*pfn)(void*), void* parg, ThreadPool pool);
+/** Read -threadpriority and -threadaffinity; false with strError if they
+ *  don't parse. Called before the first pooled thread is started. */
+bool InitThreadPools(std::string& strError);
+/** Back to the pool's own priority, for threads that change it for a while,
+ *  or with fAtLeastNormal to no lower than normal while holding locks
+ *  others wait for */
+void SetThreadPoolPriority(ThreadPool pool, bool fAtLeastNormal = false);
+void GetThreadPoolInfo(std::vector<CThreadPoolInfo>& vInfo);
+/** Parse a CPU list such as "0-3,6" */
+bool ParseCPUList(const std::string& str, std::vector<int>& vCPUs);
+
 #ifdef WIN32
 inline void SetThreadPriority(int nPriority)
 {
@@ -624,6 +695,7 @@ inline void SetThreadPriority(int nPriority)
 #define THREAD_PRIORITY_BELOW_NORMAL    2
 #define THREAD_PRIORITY_NORMAL          0
 #define THREAD_PRIORITY_ABOVE_NORMAL    0
+#define THREAD_PRIORITY_HIGHEST         -10
 
 inline void SetThreadPriority(int nPriority)
 {
@@ -26,11 +26,15 @@ extern const std::string CLIENT_DATE;
 //
 static const int DATABASE_VERSION = 70509;
 
+// block index records written with this version or later carry nStakeModifierChecksum
+static const int BLOCKINDEX_CHECKSUM_VERSION = 15000001;
+
 //
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION    = 60022;
+static const int PROTOCOL_VERSION    = 60023;
+static const int X5_PROTOCOL_VERSION = 60022;
 static const int X4_PROTOCOL_VERSION = 60021;
 static const int X3_PROTOCOL_VERSION = 60020;
 static const int X2_PROTOCOL_VERSION = 60019;
@@ -40,7 +44,7 @@ static const int X1_PROTOCOL_VERSION = 60017;
 static const int INIT_PROTO_VERSION = 209;
 
 // disconnect from peers older than this proto version
-static const int MIN_PEER_PROTO_VERSION = PROTOCOL_VERSION;
+static const int MIN_PEER_PROTO_VERSION = X5_PROTOCOL_VERSION;
 
 // nTime field added to CAddress, starting with this version;
 // if possible, avoid requesting addresses nodes older than this
@@ -56,4 +60,7 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" start with this version
+static const int COMPACT_BLOCKS_VERSION = 60023;
+
 #endif
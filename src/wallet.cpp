@@ -3,6 +3,7 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "blockprefetch.h"
 #include "txdb.h"
 #include "wallet.h"
 #include "walletdb.h"
@@ -16,6 +17,8 @@
 #include "ray_shade.h"
 
 #include "main.h"
+#include "fees.h"
+#include "notify.h"
 
 
 #include <boost/filesystem.hpp>
@@ -23,6 +26,7 @@
 #include <boost/filesystem/convenience.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
 using namespace std;
 
 using namespace boost;
@@ -30,8 +34,21 @@ using namespace boost;
 static unsigned int GetStakeSplitAge() { return IsProtocolV2(nBestHeight) ? (10 * 24 * 60 * 60) : (1 * 24 * 60 * 60); }
 static int64_t GetStakeCombineThreshold() { return IsProtocolV2(nBestHeight) ? (50 * COIN) : (1000 * COIN); }
 
+// The -paytxfee rate, raised to what has lately confirmed within
+// -txconfirmtarget blocks
+static int64_t GetPayFee(unsigned int nBytes)
+{
+    int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
+    if (nTxConfirmTarget > 0)
+    {
+        double dFeePerKb = feeEstimator.EstimateFee(nTxConfirmTarget);
+        if (dFeePerKb > 0)
+            nPayFee = max(nPayFee, (int64_t)(dFeePerKb * nBytes / 1000));
+    }
+    return nPayFee;
+}
+
 bool isAliasTx(const __wx__Tx* tx);
-extern __wx__* pwalletMain;
 extern CScript aliasStrip(const CScript& scriptIn);
 extern bool aliasScript(const CScript& script, int& op, vector<vector<unsigned char> > &vvch);
 
@@ -49,20 +66,28 @@ struct CompareValueOnly
   return t1.first < t2.first;
     }
 };
+// Seconds without wallet writes before wallet.dat is detached from the log
+static const int64_t WALLET_DETACH_IDLE = 60;
+
 void ThreadFlushWalletDB(void* parg)
 {
     // Make this thread recognisable as the wallet flushing thread
     RenameThread("iocoin-wallet");
 
     const string& strFile = ((const string*)parg)[0];
-    static bool fOneThread;
-    if (fOneThread)
-        return;
-    fOneThread = true;
+    // One thread per wallet file, however often each one is loaded
+    static CCriticalSection cs_flushing;
+    static set<string> setFlushing;
+    {
+        LOCK(cs_flushing);
+        if (!setFlushing.insert(strFile).second)
+            return;
+    }
     if (!GetBoolArg("-flushwallet", true))
         return;
 
     unsigned int nLastSeen = nWalletDBUpdated;
+    unsigned int nLastCheckpoint = nWalletDBUpdated;
     unsigned int nLastFlushed = nWalletDBUpdated;
     int64_t nLastWalletUpdate = GetTime();
     while (!fShutdown)
@@ -75,7 +100,22 @@ void ThreadFlushWalletDB(void* parg)
             nLastWalletUpdate = GetTime();
         }
 
-        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        // Writes are appended to the log as they happen. A checkpoint
+        // writes the pages they dirtied into wallet.dat and lets the old
+        // log go, so that startup recovery only replays what came after.
+        // It doesn't close the database, so wallet writes carry on.
+        if (nLastCheckpoint != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= 2)
+        {
+            nLastCheckpoint = nWalletDBUpdated;
+            int64_t nStart = GetTimeMillis();
+            bitdb.dbenv.txn_checkpoint(0, 0, 0);
+            if (fDebug)
+                printf("Checkpointed wallet.dat %"PRId64"ms\n", GetTimeMillis() - nStart);
+        }
+
+        // Detaching rewrites every page of wallet.dat and holds off all
+        // database use meanwhile, so leave it until the wallet is idle
+        if (nLastFlushed != nWalletDBUpdated && GetTime() - nLastWalletUpdate >= WALLET_DETACH_IDLE)
         {
             TRY_LOCK(bitdb.cs_db,lockDb);
             if (lockDb)
@@ -159,10 +199,16 @@ CPubKey __wx__::GenerateNewKey()
     RandAddSeedPerfmon();
     CKey key;
     key.MakeNewKey(fCompressed);
+    return AddGeneratedKey(key);
+}
+
+CPubKey __wx__::AddGeneratedKey(const CKey& key)
+{
+    AssertLockHeld(cs_wallet); // kd
 
     // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
-  SetMinVersion(FEATURE_COMPRPUBKEY);
+    if (key.IsCompressed())
+  SetMinVersion(FEATURE_COMPRPUBKEY, pwalletdbBatch);
 
     CPubKey pubkey = key.GetPubKey();
 
@@ -174,7 +220,7 @@ CPubKey __wx__::GenerateNewKey()
 
     if (!ak(key))
   throw std::runtime_error("__wx__::GenerateNewKey() : ak failed");
-    return key.GetPubKey();
+    return pubkey;
 }
 
 
@@ -189,7 +235,11 @@ bool __wx__::ak(const CKey& key)
     if (!fFileBacked)
   return true;
     if (!IsCrypted())
+    {
+  if (pwalletdbBatch)
+      return pwalletdbBatch->WriteKey(pubkey, key.GetPrivKey(), kd[pubkey.GetID()]);
   return __wx__DB(strWalletFile).WriteKey(pubkey, key.GetPrivKey(), kd[pubkey.GetID()]);
+    }
     return true;
 }
 
@@ -201,9 +251,9 @@ bool __wx__::sync(const CPubKey &vchPubKey, const vector<unsigned char> &vchCryp
   return true;
     {
   LOCK(cs_wallet);
-  if (pwalletdbEncryption)
+  if (pwalletdbBatch)
   {
-      return pwalletdbEncryption->WriteCryptedKey(vchPubKey, vchCryptedSecret, kd[vchPubKey.GetID()]);
+      return pwalletdbBatch->WriteCryptedKey(vchPubKey, vchCryptedSecret, kd[vchPubKey.GetID()]);
   }
   else
   {
@@ -357,6 +407,20 @@ bool __wx__::AddCScript(const CScript& redeemScript)
 // provides no real security
 bool fWalletUnlockStakingOnly = false;
 
+// -walletrbf: let the memory pool replace what we send with a higher fee
+bool fWalletRbf = false;
+
+// -coinselectiontries: branch and bound steps before the knapsack solver
+int nCoinSelectionTries = DEFAULT_COIN_SELECTION_TRIES;
+
+// Change this small is added to the fee rather than given an output, so
+// coin selection may overshoot the target by up to this much
+static const int64_t COST_OF_CHANGE = MIN_TX_FEE;
+
+// Coin visits the knapsack solver may spend on a selection, which bounds
+// its iterations on wallets with many small outputs
+static const int64_t MAX_KNAPSACK_STEPS = 10000000;
+
 bool __wx__::LoadCScript(const CScript& redeemScript)
 {
     /* A sanity check was added in pull #3843 to avoid adding redeemScripts
@@ -399,8 +463,9 @@ bool __wx__::Unlock(const SecureString& strWalletPassphrase)
   {
       if(!crypter.SetKeyFromPassphrase(strWalletPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod))
     return false;
+      // A wrong passphrase usually fails the padding check; try the next master key
       if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
-    return false;
+    continue;
       if (CCryptoKeyStore::Unlock(vMasterKey))
       {
         __transient();
@@ -411,6 +476,32 @@ bool __wx__::Unlock(const SecureString& strWalletPassphrase)
     return false;
 }
 
+bool __wx__::Lock()
+{
+    {
+  LOCK(cs_plaintext);
+  mapPlaintext.clear();
+    }
+    ClearRSAKeyCache();
+    return CCryptoKeyStore::Lock();
+}
+
+bool __wx__::GetPlaintext(const uint256& hash, string& strRet) const
+{
+    LOCK(cs_plaintext);
+    map<uint256, SecureString>::const_iterator mi = mapPlaintext.find(hash);
+    if (mi == mapPlaintext.end())
+  return false;
+    strRet.assign((*mi).second.begin(), (*mi).second.end());
+    return true;
+}
+
+void __wx__::SetPlaintext(const uint256& hash, const string& str)
+{
+    LOCK(cs_plaintext);
+    mapPlaintext[hash] = SecureString(str.begin(), str.end());
+}
+
 
 bool __wx__::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase)
 {
@@ -557,29 +648,29 @@ bool __wx__::EncryptWallet(const SecureString& strWalletPassphrase)
   mapMasterKeys[++nMasterKeyMaxID] = kMasterKey;
   if (fFileBacked)
   {
-      pwalletdbEncryption = new __wx__DB(strWalletFile);
-      if (!pwalletdbEncryption->TxnBegin())
+      pwalletdbBatch = new __wx__DB(strWalletFile);
+      if (!pwalletdbBatch->TxnBegin())
     return false;
-      pwalletdbEncryption->WriteMasterKey(nMasterKeyMaxID, kMasterKey);
+      pwalletdbBatch->WriteMasterKey(nMasterKeyMaxID, kMasterKey);
   }
 
   if (!EncryptKeys(vMasterKey))
   {
       if (fFileBacked)
-    pwalletdbEncryption->TxnAbort();
+    pwalletdbBatch->TxnAbort();
       exit(1); //We now probably have half of our keys encrypted in memory, and half not...die and let the user reload their unencrypted wallet.
   }
 
   // Encryption was introduced in version 0.4.0
-  SetMinVersion(FEATURE_WALLETCRYPT, pwalletdbEncryption, true);
+  SetMinVersion(FEATURE_WALLETCRYPT, pwalletdbBatch, true);
 
   if (fFileBacked)
   {
-      if (!pwalletdbEncryption->TxnCommit())
+      if (!pwalletdbBatch->TxnCommit())
     exit(1); //We now have keys encrypted in memory, but no on disk...die to avoid confusion and let the user reload their unencrypted wallet.
 
-      delete pwalletdbEncryption;
-      pwalletdbEncryption = NULL;
+      delete pwalletdbBatch;
+      pwalletdbBatch = NULL;
   }
 
   Lock();
@@ -609,29 +700,234 @@ int64_t __wx__::IncOrderPosNext(__wx__DB *pwalletdb)
     return nRet;
 }
 
-__wx__::TxItems __wx__::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
+void __wx__::BuildTxIndexes()
 {
-    AssertLockHeld(cs_wallet); // mapWallet
-    __wx__DB walletdb(strWalletFile);
+    LOCK(cs_wallet);
+    wtxOrdered.clear();
+    mapTxByDestination.clear();
+    mapDionTxByOp.clear();
+    mapDionTxByName.clear();
+    mapDionTxOp.clear();
+    mapDionKeyTxs.clear();
+    for (map<uint256, __wx__Tx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+  IndexWalletTx((*it).first, &(*it).second);
 
-    // First: get all __wx__Tx and CAccountingEntry into a sorted-by-order multimap.
-    TxItems txOrdered;
+    laccentries.clear();
+    if (fFileBacked)
+  __wx__DB(strWalletFile).ListAccountCreditDebit("*", laccentries);
+    BOOST_FOREACH(CAccountingEntry& entry, laccentries)
+  wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((__wx__Tx*)0, &entry)));
+}
 
-    // Note: maintaining indices in the database of (account,time) --> txid and (account, time) --> acentry
-    // would make this much faster for applications that do this a lot.
-    for (map<uint256, __wx__Tx>::iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+void __wx__::IndexWalletTx(const uint256& hash, __wx__Tx* pwtx)
+{
+    AssertLockHeld(cs_wallet);
+    wtxOrdered.insert(make_pair(pwtx->nOrderPos, TxPair(pwtx, (CAccountingEntry*)0)));
+    BOOST_FOREACH(const CTxOut& txout, pwtx->vout)
+    {
+  CTxDestination address;
+  if (ExtractDestination(txout.scriptPubKey, address))
+      mapTxByDestination[address].insert(hash);
+    }
+
+    vector<vchType> vvch;
+    int op, nOut;
+    if (pwtx->nVersion != CTransaction::DION_TX_VERSION || !aliasTx(*pwtx, op, nOut, vvch))
+  return;
+    mapDionTxByOp[op].insert(hash);
+    mapDionTxOp[hash] = op;
+    // Aliases are named by vvch[0]; keys and messages by sender and recipient
+    unsigned int nNames = (DION_OPS_ALIAS & (1 << op)) ? 1 : 2;
+    for (unsigned int i = 0; i < nNames && i < vvch.size(); i++)
+  mapDionTxByName[vvch[i]].insert(hash);
+    if (((DION_OPS_PUBLIC_KEY | DION_OPS_VERTEX) & (1 << op)) && vvch.size() >= 5)
+  mapDionKeyTxs[make_pair(vvch[0], vvch[1])].insert(hash);
+}
+
+void __wx__::UnindexWalletTx(const uint256& hash, __wx__Tx* pwtx)
+{
+    AssertLockHeld(cs_wallet);
+    pair<TxItems::iterator, TxItems::iterator> range = wtxOrdered.equal_range(pwtx->nOrderPos);
+    for (TxItems::iterator it = range.first; it != range.second; ++it)
     {
-  __wx__Tx* wtx = &((*it).second);
-  txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
+  if ((*it).second.first == pwtx)
+  {
+      wtxOrdered.erase(it);
+      break;
+  }
     }
-    acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
-    BOOST_FOREACH(CAccountingEntry& entry, acentries)
+    BOOST_FOREACH(const CTxOut& txout, pwtx->vout)
     {
-  txOrdered.insert(make_pair(entry.nOrderPos, TxPair((__wx__Tx*)0, &entry)));
+  CTxDestination address;
+  if (!ExtractDestination(txout.scriptPubKey, address))
+      continue;
+  map<CTxDestination, set<uint256> >::iterator mi = mapTxByDestination.find(address);
+  if (mi == mapTxByDestination.end())
+      continue;
+  (*mi).second.erase(hash);
+  if ((*mi).second.empty())
+      mapTxByDestination.erase(mi);
     }
 
-    return txOrdered;
+    vector<vchType> vvch;
+    int op, nOut;
+    if (!mapDionTxOp.erase(hash) || !aliasTx(*pwtx, op, nOut, vvch))
+  return;
+    mapDionTxByOp[op].erase(hash);
+    unsigned int nNames = (DION_OPS_ALIAS & (1 << op)) ? 1 : 2;
+    for (unsigned int i = 0; i < nNames && i < vvch.size(); i++)
+    {
+  map<vchType, set<uint256> >::iterator ni = mapDionTxByName.find(vvch[i]);
+  if (ni == mapDionTxByName.end())
+      continue;
+  (*ni).second.erase(hash);
+  if ((*ni).second.empty())
+      mapDionTxByName.erase(ni);
+    }
+    if (((DION_OPS_PUBLIC_KEY | DION_OPS_VERTEX) & (1 << op)) && vvch.size() >= 5)
+    {
+  map<pair<vchType, vchType>, set<uint256> >::iterator ki = mapDionKeyTxs.find(make_pair(vvch[0], vvch[1]));
+  if (ki != mapDionKeyTxs.end())
+  {
+      (*ki).second.erase(hash);
+      if ((*ki).second.empty())
+    mapDionKeyTxs.erase(ki);
+  }
+    }
+}
+
+void __wx__::ListDionTxs(int nOpMask, vector<__wx__Tx*>& vRet)
+{
+    AssertLockHeld(cs_wallet);
+    set<uint256> setHash;
+    for (map<int, set<uint256> >::const_iterator it = mapDionTxByOp.begin(); it != mapDionTxByOp.end(); ++it)
+  if (nOpMask & (1 << (*it).first))
+      setHash.insert((*it).second.begin(), (*it).second.end());
+
+    vRet.clear();
+    BOOST_FOREACH(const uint256& hash, setHash)
+    {
+  map<uint256, __wx__Tx>::iterator mi = mapWallet.find(hash);
+  if (mi != mapWallet.end())
+      vRet.push_back(&(*mi).second);
+    }
+}
+
+void __wx__::ListDionTxs(int nOpMask, const vchType& vchName, vector<__wx__Tx*>& vRet, int nOpMaskUnnamed)
+{
+    AssertLockHeld(cs_wallet);
+    set<uint256> setHash;
+    map<vchType, set<uint256> >::const_iterator ni = mapDionTxByName.find(vchName);
+    if (ni != mapDionTxByName.end())
+    {
+  BOOST_FOREACH(const uint256& hash, (*ni).second)
+  {
+      if (nOpMask & (1 << mapDionTxOp[hash]))
+    setHash.insert(hash);
+  }
+    }
+    for (map<int, set<uint256> >::const_iterator it = mapDionTxByOp.begin(); it != mapDionTxByOp.end(); ++it)
+  if (nOpMaskUnnamed & (1 << (*it).first))
+      setHash.insert((*it).second.begin(), (*it).second.end());
+
+    vRet.clear();
+    BOOST_FOREACH(const uint256& hash, setHash)
+    {
+  map<uint256, __wx__Tx>::iterator mi = mapWallet.find(hash);
+  if (mi != mapWallet.end())
+      vRet.push_back(&(*mi).second);
+    }
+}
+
+// The newest of setHash by nOrderPos whose op is in nOpMask, or pwtxBest
+static __wx__Tx* LatestDionKeyTx(map<uint256, __wx__Tx>& mapWallet, const map<uint256, int>& mapDionTxOp,
+                                 int nOpMask, const set<uint256>& setHash, __wx__Tx* pwtxBest)
+{
+    BOOST_FOREACH(const uint256& hash, setHash)
+    {
+  map<uint256, int>::const_iterator oi = mapDionTxOp.find(hash);
+  if (oi == mapDionTxOp.end() || !(nOpMask & (1 << (*oi).second)))
+      continue;
+  map<uint256, __wx__Tx>::iterator mi = mapWallet.find(hash);
+  if (mi != mapWallet.end() && (!pwtxBest || (*mi).second.nOrderPos > pwtxBest->nOrderPos))
+      pwtxBest = &(*mi).second;
+    }
+    return pwtxBest;
+}
+
+__wx__Tx* __wx__::FindDionKeyTx(int nOpMask, const vchType& vchSender, const vchType& vchRecipient)
+{
+    AssertLockHeld(cs_wallet);
+    map<pair<vchType, vchType>, set<uint256> >::const_iterator ki = mapDionKeyTxs.find(make_pair(vchSender, vchRecipient));
+    if (ki == mapDionKeyTxs.end())
+  return NULL;
+    return LatestDionKeyTx(mapWallet, mapDionTxOp, nOpMask, (*ki).second, NULL);
+}
+
+bool __wx__::HaveDionKeyTxInMainChain(int nOpMask, const vchType& vchSender, const vchType& vchRecipient, const uint256& hashExclude)
+{
+    AssertLockHeld(cs_wallet);
+    map<pair<vchType, vchType>, set<uint256> >::const_iterator ki = mapDionKeyTxs.find(make_pair(vchSender, vchRecipient));
+    if (ki == mapDionKeyTxs.end())
+  return false;
+    BOOST_FOREACH(const uint256& hash, (*ki).second)
+    {
+  if (hash == hashExclude || !(nOpMask & (1 << mapDionTxOp[hash])))
+      continue;
+  map<uint256, __wx__Tx>::iterator mi = mapWallet.find(hash);
+  if (mi != mapWallet.end() && (*mi).second.GetHeightInMainChain() != -1)
+      return true;
+    }
+    return false;
+}
+
+__wx__Tx* __wx__::FindDionKeyTx(int nOpMask, const vchType& vchSender)
+{
+    AssertLockHeld(cs_wallet);
+    __wx__Tx* pwtxBest = NULL;
+    for (map<pair<vchType, vchType>, set<uint256> >::const_iterator ki = mapDionKeyTxs.lower_bound(make_pair(vchSender, vchType()));
+         ki != mapDionKeyTxs.end() && (*ki).first.first == vchSender; ++ki)
+  pwtxBest = LatestDionKeyTx(mapWallet, mapDionTxOp, nOpMask, (*ki).second, pwtxBest);
+    return pwtxBest;
+}
+
+bool __wx__::AddAccountingEntry(const CAccountingEntry& acentry, __wx__DB& walletdb)
+{
+    if (!walletdb.WriteAccountingEntry(acentry))
+  return false;
+
+    LOCK(cs_wallet);
+    laccentries.push_back(acentry);
+    CAccountingEntry& entry = laccentries.back();
+    wtxOrdered.insert(make_pair(entry.nOrderPos, TxPair((__wx__Tx*)0, &entry)));
+    return true;
+}
+
+int64_t __wx__::GetReceivedByDestination(const CTxDestination& dest, int nMinDepth) const
+{
+    LOCK(cs_wallet);
+    int64_t nAmount = 0;
+    map<CTxDestination, set<uint256> >::const_iterator mi = mapTxByDestination.find(dest);
+    if (mi == mapTxByDestination.end())
+  return 0;
+
+    CScript scriptPubKey;
+    scriptPubKey.SetDestination(dest);
+    BOOST_FOREACH(const uint256& hash, (*mi).second)
+    {
+  map<uint256, __wx__Tx>::const_iterator it = mapWallet.find(hash);
+  if (it == mapWallet.end())
+      continue;
+  const __wx__Tx& wtx = (*it).second;
+  if (wtx.IsCoinBase() || wtx.IsCoinStake() || !IsFinalTx(wtx))
+      continue;
+  if (wtx.GetDepthInMainChain() < nMinDepth)
+      continue;
+  BOOST_FOREACH(const CTxOut& txout, wtx.vout)
+      if (txout.scriptPubKey == scriptPubKey)
+	  nAmount += txout.nValue;
+    }
+    return nAmount;
 }
 
 void __wx__::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
@@ -641,6 +937,7 @@ void __wx__::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
     // restored from backup or the user making copies of wallet.dat.
     {
   LOCK(cs_wallet);
+  InvalidateWalletTotals();
   BOOST_FOREACH(const CTxIn& txin, tx.vin)
   {
       map<uint256, __wx__Tx>::iterator mi = mapWallet.find(txin.prevout.hash);
@@ -649,7 +946,7 @@ void __wx__::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
     __wx__Tx& wtx = (*mi).second;
     if (txin.prevout.n >= wtx.vout.size())
 	printf("WalletUpdateSpent: bad wtx %s\n", wtx.GetHash().ToString().c_str());
-    else if (!wtx.IsSpent(txin.prevout.n) && IsMine(wtx.vout[txin.prevout.n]))
+    else if (!wtx.IsSpent(txin.prevout.n) && wtx.IsOutputMine(txin.prevout.n))
     {
 	printf("WalletUpdateSpent found spent coin %s IO %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
 	wtx.MarkSpent(txin.prevout.n);
@@ -670,6 +967,7 @@ void __wx__::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
     if (IsMine(txout))
     {
 	wtx.MarkUnspent(&txout - &tx.vout[0]);
+	NoteUnspent(hash);
 	wtx.WriteToDisk();
 	NotifyTransactionChanged(this, hash, CT_UPDATED);
     }
@@ -683,6 +981,7 @@ void __wx__::MarkDirty()
 {
     {
   LOCK(cs_wallet);
+  InvalidateWalletTotals();
   BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item, mapWallet)
       item.second.MarkDirty();
     }
@@ -693,15 +992,18 @@ bool __wx__::AddToWallet(const __wx__Tx& wtxIn)
     uint256 hash = wtxIn.GetHash();
     {
   LOCK(cs_wallet);
+  InvalidateWalletTotals();
   // Inserts only if not already there, returns tx inserted or tx found
   pair<map<uint256, __wx__Tx>::iterator, bool> ret = mapWallet.insert(make_pair(hash, wtxIn));
   __wx__Tx& wtx = (*ret.first).second;
   wtx.BindWallet(this);
+  NoteUnspent(hash);
   bool fInsertedNew = ret.second;
   if (fInsertedNew)
   {
       wtx.nTimeReceived = GetAdjustedTime();
       wtx.nOrderPos = IncOrderPosNext();
+      IndexWalletTx(hash, &wtx);
 
       wtx.nTimeSmart = wtx.nTimeReceived;
       if (wtxIn.hashBlock != 0)
@@ -713,9 +1015,7 @@ bool __wx__::AddToWallet(const __wx__Tx& wtxIn)
 	{
       // Tolerate times up to the last timestamp in the wallet not more than 5 minutes into the future
       int64_t latestTolerated = latestNow + 300;
-      std::list<CAccountingEntry> acentries;
-      TxItems txOrdered = OrderedTxItems(acentries);
-      for (TxItems::reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
+      for (TxItems::reverse_iterator it = wtxOrdered.rbegin(); it != wtxOrdered.rend(); ++it)
       {
 	  __wx__Tx *const pwtx = (*it).second.first;
 	  if (pwtx == &wtx)
@@ -805,14 +1105,8 @@ bool __wx__::AddToWallet(const __wx__Tx& wtxIn)
   // Notify UI of new or updated transaction
   NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
-  // notify an external script when a wallet transaction comes in or is updated
-  std::string strCmd = GetArg("-walletnotify", "");
-
-  if ( !strCmd.empty())
-  {
-      boost::replace_all(strCmd, "%s", wtxIn.GetHash().GetHex());
-      boost::thread t(runCommand, strCmd); // thread runs free
-  }
+  // notify an external script or subscribers when a wallet transaction comes in or is updated
+  QueueWalletTxNotification(hash);
 
     }
     return true;
@@ -848,8 +1142,15 @@ bool __wx__::EraseFromWallet(uint256 hash)
   return false;
     {
   LOCK(cs_wallet);
-  if (mapWallet.erase(hash))
+  InvalidateWalletTotals();
+  setWalletUnspent.erase(hash);
+  map<uint256, __wx__Tx>::iterator mi = mapWallet.find(hash);
+  if (mi != mapWallet.end())
+  {
+      UnindexWalletTx(hash, &(*mi).second);
+      mapWallet.erase(mi);
       __wx__DB(strWalletFile).EraseTx(hash);
+  }
     }
     return true;
 }
@@ -863,11 +1164,8 @@ bool __wx__::IsMine(const CTxIn &txin) const
   if (mi != mapWallet.end())
   {
       const __wx__Tx& prev = (*mi).second;
-      if (txin.prevout.n < prev.vout.size())
-    if (IsMine(prev.vout[txin.prevout.n]))
-    {
-	return true;
-    }
+      if (prev.IsOutputMine(txin.prevout.n))
+	  return true;
   }
     }
     return false;
@@ -881,9 +1179,8 @@ int64_t __wx__::GetDebit(const CTxIn &txin) const
   if (mi != mapWallet.end())
   {
       const __wx__Tx& prev = (*mi).second;
-      if (txin.prevout.n < prev.vout.size())
-    if (IsMine(prev.vout[txin.prevout.n]))
-	return prev.vout[txin.prevout.n].nValue;
+      if (prev.IsOutputMine(txin.prevout.n))
+	  return prev.vout[txin.prevout.n].nValue;
   }
     }
     return 0;
@@ -970,8 +1267,9 @@ void __wx__Tx::GetAmounts(list<pair<CTxDestination, int64_t> >& listReceived,
   }
 
   // Sent/received.
-  BOOST_FOREACH(const CTxOut& txout, vout)
+  for (unsigned int nOut = 0; nOut < vout.size(); nOut++)
   {
+      const CTxOut& txout = vout[nOut];
       // Skip special stake out
       if (txout.scriptPubKey.empty())
 	  continue;
@@ -993,9 +1291,9 @@ void __wx__Tx::GetAmounts(list<pair<CTxDestination, int64_t> >& listReceived,
 	  // Don't report 'change' txouts
 	  if (pwallet->IsChange(txout))
 	      continue;
-	  fIsMine = pwallet->IsMine(txout);
+	  fIsMine = IsOutputMine(nOut);
       }
-      else if (!(fIsMine = pwallet->IsMine(txout)))
+      else if (!(fIsMine = IsOutputMine(nOut)))
 	  continue;
 
       // In either case, we need to get the destination address
@@ -1066,64 +1364,51 @@ void __wx__Tx::GetAccountAmounts(const string& strAccount, int64_t& nReceived,
   }
 }
 
-void __wx__Tx::AddSupportingTransactions(CTxDB& txdb)
+bool __wx__Tx::IsOutputMine(unsigned int nOut) const
 {
-  vtxPrev.clear();
-
-  const int COPY_DEPTH = 3;
-  if (SetMerkleBranch() < COPY_DEPTH)
+  if (nOut >= vout.size())
+      return false;
+  unsigned int nGeneration = pwallet->GetGeneration();
+  if (vfIsMineCached.size() != vout.size() || nIsMineGeneration != nGeneration)
   {
-      vector<uint256> vWorkQueue;
-      BOOST_FOREACH(const CTxIn& txin, vin)
-	  vWorkQueue.push_back(txin.prevout.hash);
+      pwallet->nIsMineCacheMisses++;
+      vfIsMineCached.resize(vout.size());
+      for (unsigned int i = 0; i < vout.size(); i++)
+	  vfIsMineCached[i] = pwallet->IsMine(vout[i]);
+      nIsMineGeneration = nGeneration;
+  }
+  else
+      pwallet->nIsMineCacheHits++;
+  return vfIsMineCached[nOut];
+}
 
-      // This critsect is OK because txdb is already open
-      {
-	  LOCK(pwallet->cs_wallet);
-	  map<uint256, const CMerkleTx*> mapWalletPrev;
-	  set<uint256> setAlreadyDone;
-	  for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-	  {
-	      uint256 hash = vWorkQueue[i];
-	      if (setAlreadyDone.count(hash))
-		  continue;
-	      setAlreadyDone.insert(hash);
+void __wx__Tx::GetSupportingTransactions(vector<CMerkleTx>& vSupportingRet) const
+{
+  vSupportingRet.clear();
+  if (!pwallet)
+      return;
 
-	      CMerkleTx tx;
-	      map<uint256, __wx__Tx>::const_iterator mi = pwallet->mapWallet.find(hash);
-	      if (mi != pwallet->mapWallet.end())
-	      {
-		  tx = (*mi).second;
-		  BOOST_FOREACH(const CMerkleTx& txWalletPrev, (*mi).second.vtxPrev)
-		      mapWalletPrev[txWalletPrev.GetHash()] = &txWalletPrev;
-	      }
-	      else if (mapWalletPrev.count(hash))
-	      {
-		  tx = *mapWalletPrev[hash];
-	      }
-	      else if (txdb.ReadDiskTx(hash, tx))
-	      {
-		  ;
-	      }
-	      else
-	      {
-		  printf("ERROR: AddSupportingTransactions() : unsupported transaction\n");
-		  continue;
-	      }
+  LOCK(pwallet->cs_wallet);
+  vector<uint256> vWorkQueue;
+  BOOST_FOREACH(const CTxIn& txin, vin)
+      vWorkQueue.push_back(txin.prevout.hash);
 
-	      int nDepth = tx.SetMerkleBranch();
-	      vtxPrev.push_back(tx);
+  set<uint256> setAlreadyDone;
+  for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+  {
+      uint256 hash = vWorkQueue[i];
+      if (!setAlreadyDone.insert(hash).second)
+	  continue;
 
-	      if (nDepth < COPY_DEPTH)
-	      {
-		  BOOST_FOREACH(const CTxIn& txin, tx.vin)
-		      vWorkQueue.push_back(txin.prevout.hash);
-	      }
-	  }
-      }
+      map<uint256, __wx__Tx>::const_iterator mi = pwallet->mapWallet.find(hash);
+      if (mi == pwallet->mapWallet.end() || (*mi).second.GetDepthInMainChain() != 0)
+	  continue;
+      vSupportingRet.push_back((*mi).second);
+      BOOST_FOREACH(const CTxIn& txin, (*mi).second.vin)
+	  vWorkQueue.push_back(txin.prevout.hash);
   }
 
-  reverse(vtxPrev.begin(), vtxPrev.end());
+  reverse(vSupportingRet.begin(), vSupportingRet.end());
 }
 
 bool __wx__Tx::WriteToDisk()
@@ -1134,35 +1419,181 @@ bool __wx__Tx::WriteToDisk()
 // Scan the block chain (starting in pindexStart) for transactions
 // from or to us. If fUpdate is true, found transactions that already
 // exist in the wallet will be updated.
-int __wx__::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// Blocks the rescan readers may get ahead of the wallet update
+static const unsigned int MAX_RESCAN_AHEAD = 256;
+
+/** Reads blocks for ScanForWalletTransactions() on several threads and
+ *  picks out the transactions that can involve the wallet. Matching the
+ *  outputs against the keys and scripts the wallet had when the scan
+ *  started is what costs, so the readers do that; spends of wallet coins
+ *  and transactions already in the wallet are map lookups left to the
+ *  wallet update, which runs in chain order so that a spend of an output
+ *  found a few blocks earlier is still seen.
+ */
+class CWalletRescanner : private CBlockPrefetcher
 {
-  int ret = 0;
+private:
+    struct CScanBlock : public CPrefetchedBlock
+    {
+        // Transactions with an output that may be ours
+        std::vector<bool> vCandidate;
+    };
 
-  CBlockIndex* pindex = pindexStart;
-  {
-      LOCK2(cs_main, cs_wallet);
-      while (pindex)
-      {
-	  // no need to read and scan block, if block was created before
-	  // our wallet birthday (as adjusted for block time variability)
-	  if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-	      pindex = pindex->pnext;
-	      continue;
-	  }
+    __wx__* pwallet;
+    std::set<CKeyID> setKeys;
 
-	  CBlock block;
-	  block.ReadFromDisk(pindex, true);
-	  BOOST_FOREACH(CTransaction& tx, block.vtx)
-	  {
-	      if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-		  ret++;
-	  }
-	  pindex = pindex->pnext;
-      }
+    bool IsCandidate(const CScript& scriptPubKey) const
+    {
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        if (!Solver(aliasStrip(scriptPubKey), whichType, vSolutions))
+            return false;
+
+        switch (whichType)
+        {
+        case TX_PUBKEY:
+            return setKeys.count(CPubKey(vSolutions[0]).GetID());
+        case TX_PUBKEYHASH:
+            return setKeys.count(CKeyID(uint160(vSolutions[0])));
+        case TX_SCRIPTHASH:
+            return pwallet->HaveCScript(CScriptID(uint160(vSolutions[0])));
+        case TX_MULTISIG:
+            for (unsigned int i = 1; i + 1 < vSolutions.size(); i++)
+                if (setKeys.count(CPubKey(vSolutions[i]).GetID()))
+                    return true;
+            return false;
+        case TX_NULL_DATA:
+            // __xfa() matches these against keys derived from ours
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool IsCandidate(const CTransaction& tx) const
+    {
+        // Aliases and encrypted messages have rules of their own
+        if (tx.nVersion == CTransaction::DION_TX_VERSION)
+            return true;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+            if (IsCandidate(txout.scriptPubKey))
+                return true;
+        return false;
+    }
+
+    CPrefetchedBlock* Read(unsigned int nPos)
+    {
+        CScanBlock* pscan = new CScanBlock();
+        pscan->fRead = pscan->block.ReadFromDisk(vIndex[nPos], true);
+        if (pscan->fRead)
+        {
+            // Caches the txids for the wallet update
+            pscan->block.BuildMerkleTree();
+            pscan->vCandidate.resize(pscan->block.vtx.size());
+            for (unsigned int i = 0; i < pscan->block.vtx.size(); i++)
+                pscan->vCandidate[i] = IsCandidate(pscan->block.vtx[i]);
+        }
+        return pscan;
+    }
+
+    bool Interrupted() const
+    {
+        return fShutdown || pwallet->fAbortRescan;
+    }
+
+    int Connect(const CScanBlock& scan, bool fUpdate)
+    {
+        int ret = 0;
+        const CBlock& block = scan.block;
+        LOCK2(cs_main, pwallet->cs_wallet);
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+        {
+            const CTransaction& tx = block.vtx[i];
+            bool fInvolvesMe = scan.vCandidate[i] || pwallet->mapWallet.count(block.GetTxHash(i));
+            for (unsigned int j = 0; j < tx.vin.size() && !fInvolvesMe; j++)
+                fInvolvesMe = pwallet->mapWallet.count(tx.vin[j].prevout.hash);
+            if (fInvolvesMe && pwallet->AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                ret++;
+        }
+        return ret;
+    }
+
+public:
+    CWalletRescanner(__wx__* pwalletIn, const std::vector<CBlockIndex*>& vIndexIn) : CBlockPrefetcher(vIndexIn, MAX_RESCAN_AHEAD), pwallet(pwalletIn)
+    {
+        pwallet->GetKeys(setKeys);
+    }
+
+    int Run(bool fUpdate)
+    {
+        int ret = 0;
+        Start();
+
+        int64_t nLastLog = GetTimeMillis();
+        while (true)
+        {
+            auto_ptr<CPrefetchedBlock> pblock = Next();
+            if (!pblock.get())
+                break;
+            if (pblock->fRead)
+                ret += Connect(*static_cast<CScanBlock*>(pblock.get()), fUpdate);
+
+            pwallet->nRescanProgress = (int)(100LL * GetPos() / vIndex.size());
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nLastLog >= 10000)
+            {
+                nLastLog = nNow;
+                printf("Rescanning wallet: %d%%, height %d, %d transactions found\n",
+                       pwallet->nRescanProgress, pblock->pindex->nHeight, ret);
+            }
+        }
+
+        if (pwallet->fAbortRescan)
+            printf("Rescan aborted at height %d\n", GetPos() < vIndex.size() ? vIndex[GetPos()]->nHeight : nBestHeight);
+
+        Stop();
+        return ret;
+    }
+};
+
+CBlockIndex* FindRescanStart(int64_t nBirthTime)
+{
+  // Allow for block time variability, as ScanForWalletTransactions() does
+  CBlockIndex* pindex = pindexBest;
+  while (pindex && pindex->pprev && pindex->nTime > nBirthTime - 7200)
+      pindex = pindex->pprev;
+  return pindex;
+}
+
+int __wx__::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+  // no need to read and scan blocks created before our wallet birthday
+  // (as adjusted for block time variability)
+  vector<CBlockIndex*> vIndex;
+  {
+      LOCK(cs_main);
+      for (CBlockIndex* pindex = pindexStart; pindex; pindex = pindex->pnext)
+	  if (!nTimeFirstKey || pindex->nTime >= (nTimeFirstKey - 7200))
+	      vIndex.push_back(pindex);
   }
+  if (vIndex.empty())
+      return 0;
+
+  fAbortRescan = false;
+  fScanningWallet = true;
+  nRescanProgress = 0;
+  int ret = CWalletRescanner(this, vIndex).Run(fUpdate);
+  fScanningWallet = false;
   return ret;
 }
 
+// Inputs can't be older than what they spend, so sorting by time puts
+// parents ahead of their children
+static bool CompareTxTime(const CTransaction& a, const CTransaction& b)
+{
+  return a.nTime < b.nTime;
+}
+
 void __wx__::ReacceptWalletTransactions()
 {
   CTxDB txdb("r");
@@ -1172,6 +1603,10 @@ void __wx__::ReacceptWalletTransactions()
       LOCK2(cs_main, cs_wallet);
       fRepeat = false;
       vector<CDiskTxPos> vMissingTx;
+      // Accepted into the memory pool by ThreadRevalidateMempool, which
+      // checks them in batches without holding cs_main throughout
+      vector<CTransaction> vReaccept;
+      set<uint256> setReaccept;
       BOOST_FOREACH(PAIRTYPE(const uint256, __wx__Tx)& item, mapWallet)
       {
 	  __wx__Tx& wtx = item.second;
@@ -1192,9 +1627,10 @@ void __wx__::ReacceptWalletTransactions()
 	      {
 		  if (wtx.IsSpent(i))
 		      continue;
-		  if (!txindex.vSpent[i].IsNull() && IsMine(wtx.vout[i]))
+		  if (!txindex.vSpent[i].IsNull() && wtx.IsOutputMine(i))
 		  {
 		      wtx.MarkSpent(i);
+		      InvalidateWalletTotals();
 		      fUpdated = true;
 		      vMissingTx.push_back(txindex.vSpent[i]);
 		  }
@@ -1208,11 +1644,18 @@ void __wx__::ReacceptWalletTransactions()
 	  }
 	  else
 	  {
-	      // Re-accept any txes of ours that aren't already in a block
+	      // Re-accept any txes of ours that aren't already in a block.
+	      // The unconfirmed ones they spend are wallet txes too, met in
+	      // this loop, and the sort below puts them first.
 	      if (!(wtx.IsCoinBase() || wtx.IsCoinStake()))
-		  wtx.AcceptWalletTransaction(txdb);
+	      {
+		  if (!mempool.exists(wtx.GetHash()) && setReaccept.insert(wtx.GetHash()).second)
+		      vReaccept.push_back(wtx);
+	      }
 	  }
       }
+      stable_sort(vReaccept.begin(), vReaccept.end(), CompareTxTime);
+      QueueMempoolRevalidation(vReaccept);
       if (!vMissingTx.empty())
       {
 	  // TODO: optimize this to scan just part of the block chain?
@@ -1224,7 +1667,9 @@ void __wx__::ReacceptWalletTransactions()
 
 void __wx__Tx::RelayWalletTransaction(CTxDB& txdb)
 {
-  BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
+  vector<CMerkleTx> vSupporting;
+  GetSupportingTransactions(vSupporting);
+  BOOST_FOREACH(const CMerkleTx& tx, vSupporting)
   {
       if (!(tx.IsCoinBase() || tx.IsCoinStake()))
       {
@@ -1308,14 +1753,40 @@ void __wx__::ResendWalletTransactions(bool fForce)
 //
 
 
+// requires cs_wallet
+void __wx__::GetUnspentWalletTx(vector<const __wx__Tx*>& vRet) const
+{
+  vRet.clear();
+  vRet.reserve(setWalletUnspent.size());
+  for (set<uint256>::const_iterator it = setWalletUnspent.begin(); it != setWalletUnspent.end(); )
+  {
+      map<uint256, __wx__Tx>::const_iterator mi = mapWallet.find(*it);
+      bool fUnspent = false;
+      if (mi != mapWallet.end())
+      {
+	  const __wx__Tx& wtx = (*mi).second;
+	  for (unsigned int i = 0; i < wtx.vout.size() && !fUnspent; i++)
+	      fUnspent = !wtx.IsSpent(i) && wtx.IsOutputMine(i);
+      }
+      if (!fUnspent)
+      {
+	  setWalletUnspent.erase(it++);
+	  continue;
+      }
+      vRet.push_back(&(*mi).second);
+      ++it;
+  }
+}
+
 int64_t __wx__::GetBalance() const
 {
   int64_t nTotal = 0;
   {
       LOCK2(cs_main, cs_wallet);
-      for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+      vector<const __wx__Tx*> vUnspent;
+      GetUnspentWalletTx(vUnspent);
+      BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
       {
-	  const __wx__Tx* pcoin = &(*it).second;
 	  if (pcoin->IsTrusted())
 	      nTotal += pcoin->GetAvailableCredit();
       }
@@ -1324,14 +1795,47 @@ int64_t __wx__::GetBalance() const
   return nTotal;
 }
 
+CWalletBalances __wx__::GetBalances() const
+{
+  CWalletBalances balances;
+  {
+      LOCK(cs_balances);
+      balances = balancesSnapshot;
+  }
+  uint256 hashTip;
+  {
+      READ_LOCK(cs_chainstate);
+      hashTip = hashBestChain;
+  }
+  if (balances.fValid && balances.hashBlock == hashTip && balances.nGeneration == nBalancesGeneration)
+      return balances;
+
+  {
+      LOCK2(cs_main, cs_wallet);
+      balances.hashBlock = hashBestChain;
+      balances.nGeneration = nBalancesGeneration;
+      balances.nBalance = GetBalance();
+      balances.nUnconfirmed = GetUnconfirmedBalance();
+      balances.nImmature = GetImmatureBalance();
+      balances.nStake = GetStake();
+      balances.nNewMint = GetNewMint();
+      balances.fValid = true;
+  }
+
+  LOCK(cs_balances);
+  balancesSnapshot = balances;
+  return balances;
+}
+
 int64_t __wx__::GetUnconfirmedBalance() const
 {
   int64_t nTotal = 0;
   {
       LOCK2(cs_main, cs_wallet);
-      for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+      vector<const __wx__Tx*> vUnspent;
+      GetUnspentWalletTx(vUnspent);
+      BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
       {
-	  const __wx__Tx* pcoin = &(*it).second;
 	  if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
 	      nTotal += pcoin->GetAvailableCredit();
       }
@@ -1344,11 +1848,12 @@ int64_t __wx__::GetImmatureBalance() const
   int64_t nTotal = 0;
   {
       LOCK2(cs_main, cs_wallet);
-      for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+      vector<const __wx__Tx*> vUnspent;
+      GetUnspentWalletTx(vUnspent);
+      BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
       {
-	  const __wx__Tx& pcoin = (*it).second;
-	  if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-	      nTotal += GetCredit(pcoin);
+	  if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->IsInMainChain())
+	      nTotal += GetCredit(*pcoin);
       }
   }
   return nTotal;
@@ -1381,10 +1886,10 @@ void __wx__::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
   {
       LOCK2(cs_main, cs_wallet);
-      for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+      vector<const __wx__Tx*> vUnspent;
+      GetUnspentWalletTx(vUnspent);
+      BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
       {
-	  const __wx__Tx* pcoin = &(*it).second;
-
 	  if (!IsFinalTx(*pcoin))
 	      continue;
  
@@ -1403,8 +1908,8 @@ void __wx__::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
 	  for (unsigned int i = 0; i < pcoin->vout.size(); i++)
 	  {
-	      if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue > nMinimumInputValue &&
-	      (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+	      if (!(pcoin->IsSpent(i)) && pcoin->IsOutputMine(i) && pcoin->vout[i].nValue > nMinimumInputValue &&
+	      (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(pcoin->GetHash(), i)))
 	      {
     
         vCoins.push_back(COutput(pcoin, i, nDepth));
@@ -1415,16 +1920,53 @@ void __wx__::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
   }
 }
 
+// The outputs AvailableCoins(vCoins, false) would return, in (txid, n) order
+// and strictly after outAfter, at most nMax of them. A null outAfter starts
+// from the beginning; an empty vCoins means there are no more.
+void __wx__::AvailableCoinsAfter(vector<COutput>& vCoins, const COutPoint& outAfter, unsigned int nMax) const
+{
+  vCoins.clear();
+
+  {
+      LOCK2(cs_main, cs_wallet);
+      set<uint256>::const_iterator it = outAfter.IsNull() ? setWalletUnspent.begin() : setWalletUnspent.lower_bound(outAfter.hash);
+      for (; it != setWalletUnspent.end() && vCoins.size() < nMax; ++it)
+      {
+	  map<uint256, __wx__Tx>::const_iterator mi = mapWallet.find(*it);
+	  if (mi == mapWallet.end())
+	      continue;
+	  const __wx__Tx* pcoin = &(*mi).second;
+
+	  if (!IsFinalTx(*pcoin))
+	      continue;
+
+	  if ((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+	      continue;
+
+	  int nDepth = pcoin->GetDepthInMainChain();
+	  if (nDepth < 0)
+	      continue;
+
+	  unsigned int i = (!outAfter.IsNull() && *it == outAfter.hash) ? outAfter.n + 1 : 0;
+	  for (; i < pcoin->vout.size() && vCoins.size() < nMax; i++)
+	  {
+	      if (!(pcoin->IsSpent(i)) && pcoin->IsOutputMine(i) && pcoin->vout[i].nValue > nMinimumInputValue)
+		  vCoins.push_back(COutput(pcoin, i, nDepth));
+	  }
+      }
+  }
+}
+
 void __wx__::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpendTime) const
 {
   vCoins.clear();
 
   {
       LOCK2(cs_main, cs_wallet);
-      for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+      vector<const __wx__Tx*> vUnspent;
+      GetUnspentWalletTx(vUnspent);
+      BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
       {
-	  const __wx__Tx* pcoin = &(*it).second;
-  
 
 	  if (pcoin->GetBlocksToMaturity() > 0)
 	    continue;
@@ -1439,7 +1981,7 @@ void __wx__::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpe
 
 	  for (unsigned int i = 0; i < pcoin->vout.size(); i++)
 	  {
-	      if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue > nMinimumInputValue)
+	      if (!(pcoin->IsSpent(i)) && pcoin->IsOutputMine(i) && pcoin->vout[i].nValue > nMinimumInputValue)
 	      {
 		  vCoins.push_back(COutput(pcoin, i, nDepth));
 	      }
@@ -1448,7 +1990,94 @@ void __wx__::AvailableCoinsForStaking(vector<COutput>& vCoins, unsigned int nSpe
   }
 }
 
-static void ApproximateBestSubset(vector<pair<int64_t, pair<const __wx__Tx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
+// For lower_bound() on values sorted in descending order
+struct CompareValueAbove
+{
+    bool operator()(const pair<int64_t, pair<const __wx__Tx*, unsigned int> >& t, int64_t nValue) const
+    {
+	return t.first > nValue;
+    }
+};
+struct CompareValueNotBelow
+{
+    bool operator()(const pair<int64_t, pair<const __wx__Tx*, unsigned int> >& t, int64_t nValue) const
+    {
+	return t.first >= nValue;
+    }
+};
+
+// Depth first search, largest coins first, for the subset of vValue (sorted
+// by descending value) that exceeds nTargetValue by the least, and by no
+// more than nCostOfChange so that it needs no change. Gives up after
+// nMaxTries steps; returns whether any such subset was found.
+static bool SelectCoinsBnB(const vector<pair<int64_t, pair<const __wx__Tx*,unsigned int> > >& vValue, int64_t nTargetValue, int64_t nCostOfChange,
+				vector<char>& vfBest, int64_t& nBest, int nMaxTries)
+{
+  typedef vector<pair<int64_t, pair<const __wx__Tx*,unsigned int> > >::const_iterator CoinIter;
+
+  // What the coins from i on can still add
+  vector<int64_t> vSuffix(vValue.size() + 1, 0);
+  for (unsigned int i = vValue.size(); i > 0; i--)
+      vSuffix[i - 1] = vSuffix[i] + vValue[i - 1].first;
+  if (vSuffix[0] < nTargetValue)
+      return false;
+
+  // The coins taken on the current branch; those before nDepth that aren't
+  // in it are left out
+  vector<unsigned int> vIncluded;
+  unsigned int nDepth = 0;
+  int64_t nTotal = 0;
+  int64_t nBestExcess = std::numeric_limits<int64_t>::max();
+
+  for (int nTries = 0; nTries < nMaxTries; nTries++)
+  {
+      bool fBacktrack = false;
+      if (nTotal + vSuffix[nDepth] < nTargetValue)
+	  fBacktrack = true;
+      else if (nTotal >= nTargetValue)
+      {
+	  if (nTotal - nTargetValue < nBestExcess)
+	  {
+	      nBestExcess = nTotal - nTargetValue;
+	      nBest = nTotal;
+	      vfBest.assign(vValue.size(), false);
+	      BOOST_FOREACH(unsigned int i, vIncluded)
+		  vfBest[i] = true;
+	      if (nBestExcess == 0)
+		  break;
+	  }
+	  fBacktrack = true;
+      }
+
+      if (fBacktrack)
+      {
+	  // Leave out the last coin taken instead. Taking a later coin of
+	  // the same value in its place would repeat the branches just done.
+	  if (vIncluded.empty())
+	      break;
+	  unsigned int nLast = vIncluded.back();
+	  vIncluded.pop_back();
+	  nTotal -= vValue[nLast].first;
+	  nDepth = lower_bound(vValue.begin() + nLast + 1, vValue.end(), vValue[nLast].first, CompareValueNotBelow()) - vValue.begin();
+      }
+      else if (vValue[nDepth].first > nTargetValue + nCostOfChange - nTotal)
+      {
+	  // Too big for this branch, as are the coins up to the first that fits
+	  CoinIter it = lower_bound(vValue.begin() + nDepth, vValue.end(), nTargetValue + nCostOfChange - nTotal, CompareValueAbove());
+	  nDepth = it - vValue.begin();
+      }
+      else
+      {
+	  vIncluded.push_back(nDepth);
+	  nTotal += vValue[nDepth].first;
+	  nDepth++;
+      }
+  }
+
+  return nBestExcess != std::numeric_limits<int64_t>::max();
+}
+
+static void ApproximateBestSubset(const vector<pair<int64_t, pair<const __wx__Tx*,unsigned int> > >& vValue, int64_t nTotalLower, int64_t nTargetValue,
 				vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
 {
   vector<char> vfIncluded;
@@ -1499,9 +2128,10 @@ int64_t __wx__::GetStake() const
 {
   int64_t nTotal = 0;
   LOCK2(cs_main, cs_wallet);
-  for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+  vector<const __wx__Tx*> vUnspent;
+  GetUnspentWalletTx(vUnspent);
+  BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
   {
-      const __wx__Tx* pcoin = &(*it).second;
       if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
 	  nTotal += __wx__::GetCredit(*pcoin);
   }
@@ -1512,9 +2142,10 @@ int64_t __wx__::GetNewMint() const
 {
   int64_t nTotal = 0;
   LOCK2(cs_main, cs_wallet);
-  for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+  vector<const __wx__Tx*> vUnspent;
+  GetUnspentWalletTx(vUnspent);
+  BOOST_FOREACH(const __wx__Tx* pcoin, vUnspent)
   {
-      const __wx__Tx* pcoin = &(*it).second;
       if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
 	  nTotal += __wx__::GetCredit(*pcoin);
   }
@@ -1597,14 +2228,27 @@ bool __wx__::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, i
       return true;
   }
 
-  // Solve subset sum by stochastic approximation
   sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
   vector<char> vfBest;
   int64_t nBest;
 
-  ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
+  // A subset that needs no change output is best
+  if (SelectCoinsBnB(vValue, nTargetValue, COST_OF_CHANGE, vfBest, nBest, nCoinSelectionTries))
+  {
+      for (unsigned int i = 0; i < vValue.size(); i++)
+	  if (vfBest[i])
+	  {
+	      setCoinsRet.insert(vValue[i].second);
+	      nValueRet += vValue[i].first;
+	  }
+      return true;
+  }
+
+  // Solve subset sum by stochastic approximation
+  int nIterations = (int)max((int64_t)10, min((int64_t)1000, MAX_KNAPSACK_STEPS / (int64_t)vValue.size()));
+  ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, nIterations);
   if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-      ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+      ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, nIterations);
 
   // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
   //                                   or the next bigger coin is closer), return the bigger coin
@@ -1700,7 +2344,104 @@ bool __wx__::SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime
   return true;
 }
 
-bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl* coinControl)
+// Below this many inputs per thread, signing isn't worth handing out
+static const unsigned int SIGN_INPUTS_PER_THREAD = 16;
+
+// Serialized size txTo will have once its inputs, spending vCoins in order,
+// are signed: each scriptSig is sized with the largest signature and the
+// public key we hold. Returns 0 if an input's script is of a kind that can
+// only be sized by signing it.
+static unsigned int EstimateSignedSize(const CKeyStore& keystore, const CTransaction& txTo,
+				       const vector<pair<const __wx__Tx*,unsigned int> >& vCoins)
+{
+  CTransaction txSized(txTo);
+  const valtype vchSig(73, 0);
+  for (unsigned int i = 0; i < vCoins.size(); i++)
+  {
+      txnouttype whichType;
+      vector<valtype> vSolutions;
+      if (!Solver(aliasStrip(vCoins[i].first->vout[vCoins[i].second].scriptPubKey), whichType, vSolutions))
+	  return 0;
+
+      CScript& scriptSig = txSized.vin[i].scriptSig;
+      scriptSig.clear();
+      switch (whichType)
+      {
+      case TX_PUBKEY:
+	  scriptSig << vchSig;
+	  break;
+      case TX_PUBKEYHASH:
+      {
+	  CPubKey vchPubKey;
+	  unsigned int nPubKeySize = 65;
+	  if (keystore.GetPubKey(CKeyID(uint160(vSolutions[0])), vchPubKey))
+	      nPubKeySize = vchPubKey.Raw().size();
+	  scriptSig << vchSig << valtype(nPubKeySize, 0);
+	  break;
+      }
+      case TX_MULTISIG:
+	  scriptSig << OP_0;
+	  for (int n = 0; n < (int)vSolutions.front()[0]; n++)
+	      scriptSig << vchSig;
+	  break;
+      default:
+	  return 0;
+      }
+  }
+  return ::GetSerializeSize(txSized, SER_NETWORK, PROTOCOL_VERSION);
+}
+
+// Signs every nStep'th input from nStart on a copy of txTo, as the signature
+// hash reads the other inputs
+static void SignInputsWorker(const CKeyStore* pkeystore, const CTransaction* ptxTo,
+			     const vector<pair<const __wx__Tx*,unsigned int> >* pvCoins, const CSignatureHashCache* pcache,
+			     unsigned int nStart, unsigned int nStep, vector<CScript>* pvScriptSig, char* pfSigned)
+{
+  CTransaction txCopy(*ptxTo);
+  for (unsigned int i = nStart; i < pvCoins->size(); i += nStep)
+  {
+      if (!SignSignature(*pkeystore, *(*pvCoins)[i].first, txCopy, i, SIGHASH_ALL, pcache))
+      {
+	  *pfSigned = false;
+	  return;
+      }
+      (*pvScriptSig)[i] = txCopy.vin[i].scriptSig;
+  }
+  *pfSigned = true;
+}
+
+// Signs the inputs of txTo, spending vCoins in order, across the script
+// check threads when there are enough of them
+static bool SignInputs(const CKeyStore& keystore, CTransaction& txTo,
+		       const vector<pair<const __wx__Tx*,unsigned int> >& vCoins)
+{
+  // Only the scripts change while signing, so every input shares one
+  CSignatureHashCache cache(txTo);
+  unsigned int nThreads = min((unsigned int)max(nScriptCheckThreads, 1), (unsigned int)vCoins.size() / SIGN_INPUTS_PER_THREAD);
+  if (nThreads <= 1)
+  {
+      for (unsigned int i = 0; i < vCoins.size(); i++)
+	  if (!SignSignature(keystore, *vCoins[i].first, txTo, i, SIGHASH_ALL, &cache))
+	      return false;
+      return true;
+  }
+
+  vector<CScript> vScriptSig(vCoins.size());
+  vector<char> vfSigned(nThreads, false);
+  boost::thread_group threadGroup;
+  for (unsigned int n = 0; n < nThreads; n++)
+      threadGroup.create_thread(boost::bind(&SignInputsWorker, &keystore, &txTo, &vCoins, &cache, n, nThreads, &vScriptSig, &vfSigned[n]));
+  threadGroup.join_all();
+
+  for (unsigned int n = 0; n < nThreads; n++)
+      if (!vfSigned[n])
+	  return false;
+  for (unsigned int i = 0; i < vCoins.size(); i++)
+      txTo.vin[i].scriptSig = vScriptSig[i];
+  return true;
+}
+
+bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl* coinControl)
 {
   int64_t nValue = 0;
   BOOST_FOREACH (const PAIRTYPE(CScript, int64_t)& s, vecSend)
@@ -1720,8 +2461,6 @@ bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend,
      {wtxNew.nVersion=3;}
   {
       LOCK2(cs_main, cs_wallet);
-      // txdb must be opened before the mapWallet lock
-      CTxDB txdb("r");
       {
 	  nFeeRet = CENT;
 	  while (true)
@@ -1758,6 +2497,13 @@ bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend,
 		  nFeeRet += nMoveToFee;
 	      }
 
+	      // Not worth an output, as SelectCoins() allows for
+	      if (nChange > 0 && nChange <= COST_OF_CHANGE)
+	      {
+		  nFeeRet += nChange;
+		  nChange = 0;
+	      }
+
 	      if (nChange > 0)
 	      {
 		  // Fill a vout to ourself
@@ -1795,22 +2541,29 @@ bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend,
 
 	      // Fill vin
 	      BOOST_FOREACH(const PAIRTYPE(const __wx__Tx*,unsigned int)& coin, setCoins)
-		  wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
-
-	      // Sign
-	      int nIn = 0;
-	      BOOST_FOREACH(const PAIRTYPE(const __wx__Tx*,unsigned int)& coin, setCoins)
-		  if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+		  wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second,CScript(),
+		      fWalletRbf ? MAX_RBF_SEQUENCE : std::numeric_limits<unsigned int>::max()));
+	      vector<pair<const __wx__Tx*,unsigned int> > vCoins(setCoins.begin(), setCoins.end());
+
+	      // Settle the fee on the signed size before signing, so that
+	      // the inputs are signed once rather than on every pass
+	      bool fSigned = false;
+	      unsigned int nBytes = EstimateSignedSize(*this, wtxNew, vCoins);
+	      if (nBytes == 0)
+	      {
+		  if (!SignInputs(*this, wtxNew, vCoins))
 		      return false;
+		  fSigned = true;
+		  nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+	      }
 
 	      // Limit size
-	      unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
 	      if (nBytes >= MAX_STANDARD_TX_SIZE)
 		  return false;
 	      dPriority /= nBytes;
 
 	      // Check that enough fee is included
-	      int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
+	      int64_t nPayFee = GetPayFee(nBytes);
 	      int64_t nMinFee = wtxNew.GetMinFee(1, GMF_SEND, nBytes);
 
 	      if (nFeeRet < max(nPayFee, nMinFee))
@@ -1819,8 +2572,23 @@ bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend,
 		  continue;
 	      }
 
-	      // Fill vtxPrev by copying from previous transactions vtxPrev
-	      wtxNew.AddSupportingTransactions(txdb);
+	      // Sign
+	      if (!fSigned)
+	      {
+		  if (!SignInputs(*this, wtxNew, vCoins))
+		      return false;
+
+		  // The estimate is an upper bound, but don't rely on it
+		  nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+		  if (nBytes >= MAX_STANDARD_TX_SIZE)
+		      return false;
+		  if (nFeeRet < max(GetPayFee(nBytes), wtxNew.GetMinFee(1, GMF_SEND, nBytes)))
+		  {
+		      nFeeRet = max(GetPayFee(nBytes), wtxNew.GetMinFee(1, GMF_SEND, nBytes));
+		      continue;
+		  }
+	      }
+
 	      wtxNew.fTimeReceivedIsTxTime = true;
 
 	      break;
@@ -1830,7 +2598,7 @@ bool __wx__::CreateTransaction__(const vector<pair<CScript, int64_t> >& vecSend,
   return true;
 }
 
-bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl* coinControl)
+bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl* coinControl)
 {
   int64_t nValue = 0;
   BOOST_FOREACH (const PAIRTYPE(CScript, int64_t)& s, vecSend)
@@ -1850,8 +2618,6 @@ bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, _
      {wtxNew.nVersion=3;}
   {
       LOCK2(cs_main, cs_wallet);
-      // txdb must be opened before the mapWallet lock
-      CTxDB txdb("r");
       {
 	  nFeeRet = S_MIN_TX_FEE;
 	  while (true)
@@ -1888,6 +2654,13 @@ bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, _
 		  nFeeRet += nMoveToFee;
 	      }
 
+	      // Not worth an output, as SelectCoins() allows for
+	      if (nChange > 0 && nChange <= COST_OF_CHANGE)
+	      {
+		  nFeeRet += nChange;
+		  nChange = 0;
+	      }
+
 	      if (nChange > 0)
 	      {
 		  // Fill a vout to ourself
@@ -1925,22 +2698,29 @@ bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, _
 
 	      // Fill vin
 	      BOOST_FOREACH(const PAIRTYPE(const __wx__Tx*,unsigned int)& coin, setCoins)
-		  wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
-
-	      // Sign
-	      int nIn = 0;
-	      BOOST_FOREACH(const PAIRTYPE(const __wx__Tx*,unsigned int)& coin, setCoins)
-		  if (!SignSignature(*this, *coin.first, wtxNew, nIn++))
+		  wtxNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second,CScript(),
+		      fWalletRbf ? MAX_RBF_SEQUENCE : std::numeric_limits<unsigned int>::max()));
+	      vector<pair<const __wx__Tx*,unsigned int> > vCoins(setCoins.begin(), setCoins.end());
+
+	      // Settle the fee on the signed size before signing, so that
+	      // the inputs are signed once rather than on every pass
+	      bool fSigned = false;
+	      unsigned int nBytes = EstimateSignedSize(*this, wtxNew, vCoins);
+	      if (nBytes == 0)
+	      {
+		  if (!SignInputs(*this, wtxNew, vCoins))
 		      return false;
+		  fSigned = true;
+		  nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+	      }
 
 	      // Limit size
-	      unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
 	      if (nBytes >= MAX_STANDARD_TX_SIZE)
 		  return false;
 	      dPriority /= nBytes;
 
 	      // Check that enough fee is included
-	      int64_t nPayFee = nTransactionFee * (1 + (int64_t)nBytes / 1000);
+	      int64_t nPayFee = GetPayFee(nBytes);
 	      int64_t nMinFee = wtxNew.GetMinFee(1, GMF_SEND, nBytes);
 
 	      if (nFeeRet < max(nPayFee, nMinFee))
@@ -1949,8 +2729,23 @@ bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, _
 		  continue;
 	      }
 
-	      // Fill vtxPrev by copying from previous transactions vtxPrev
-	      wtxNew.AddSupportingTransactions(txdb);
+	      // Sign
+	      if (!fSigned)
+	      {
+		  if (!SignInputs(*this, wtxNew, vCoins))
+		      return false;
+
+		  // The estimate is an upper bound, but don't rely on it
+		  nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+		  if (nBytes >= MAX_STANDARD_TX_SIZE)
+		      return false;
+		  if (nFeeRet < max(GetPayFee(nBytes), wtxNew.GetMinFee(1, GMF_SEND, nBytes)))
+		  {
+		      nFeeRet = max(GetPayFee(nBytes), wtxNew.GetMinFee(1, GMF_SEND, nBytes));
+		      continue;
+		  }
+	      }
+
 	      wtxNew.fTimeReceivedIsTxTime = true;
 
 	      break;
@@ -1960,56 +2755,293 @@ bool __wx__::CreateTransaction(const vector<pair<CScript, int64_t> >& vecSend, _
   return true;
 }
 
-bool __wx__::CreateTransaction__(CScript scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl* coinControl)
+bool __wx__::CreateTransaction__(const CScript& scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl* coinControl)
 {
   vector< pair<CScript, int64_t> > vecSend;
   vecSend.push_back(make_pair(scriptPubKey, nValue));
   return CreateTransaction__(vecSend, wtxNew, reservekey, nFeeRet, strTxInfo, coinControl);
 }
 
-bool __wx__::CreateTransaction(CScript scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl* coinControl)
+bool __wx__::CreateTransaction(const CScript& scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl* coinControl)
 {
   vector< pair<CScript, int64_t> > vecSend;
   vecSend.push_back(make_pair(scriptPubKey, nValue));
   return CreateTransaction(vecSend, wtxNew, reservekey, nFeeRet, strTxInfo, coinControl);
 }
 
-bool __wx__::GetStakeWeight(uint64_t& nWeight)
+bool __wx__::GetStakeWeight(uint64_t& nWeight, uint64_t* pnImmature)
 {
+  {
+      LOCK(cs_wallet);
+      if (fStakeWeightValid && nStakeWeightHeight == nBestHeight && nStakeWeightReserve == nReserveBalance)
+      {
+	  nWeight = nStakeWeight;
+	  if (pnImmature)
+	      *pnImmature = nStakeWeightImmature;
+	  return fStakeWeightRet;
+      }
+  }
+
+  LOCK2(cs_main, cs_wallet);
+  fStakeWeightValid = true;
+  fStakeWeightRet = false;
+  nStakeWeightHeight = nBestHeight;
+  nStakeWeightReserve = nReserveBalance;
+  nStakeWeight = 0;
+  nStakeWeightImmature = 0;
+
+  for (map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+  {
+      const __wx__Tx* pcoin = &(*it).second;
+      if (pcoin->GetBlocksToMaturity() > 0)
+	  continue;
+      int nDepth = pcoin->GetDepthInMainChain();
+      if (nDepth < 1 || nDepth >= nStakeMinConfirmations)
+	  continue;
+      for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+	  if (!pcoin->IsSpent(i) && pcoin->IsOutputMine(i) && pcoin->vout[i].nValue > nMinimumInputValue)
+	      nStakeWeightImmature += pcoin->vout[i].nValue;
+  }
+
   // Choose coins to use
   int64_t nBalance = GetBalance();
+  set<pair<const __wx__Tx*,unsigned int> > setCoins;
+  int64_t nValueIn = 0;
+  if (nBalance > nReserveBalance && SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn) && !setCoins.empty())
+  {
+      fStakeWeightRet = true;
+      // SelectCoinsForStaking() only picks outputs deep enough to stake
+      BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
+	  nStakeWeight += pcoin.first->vout[pcoin.second].nValue;
+  }
 
-  if (nBalance <= nReserveBalance)
+  nWeight = nStakeWeight;
+  if (pnImmature)
+      *pnImmature = nStakeWeightImmature;
+  return fStakeWeightRet;
+}
+
+// Outputs below the combine threshold by script, smallest first; only
+// scripts a coinstake could use
+static void GetCompactableGroups(const vector<COutput>& vCoins, map<CScript, vector<pair<int64_t, COutPoint> > >& mapGroups)
+{
+  int64_t nThreshold = GetStakeCombineThreshold();
+  BOOST_FOREACH(const COutput& out, vCoins)
+  {
+      const CTxOut& txout = out.tx->vout[out.i];
+      if (txout.nValue >= nThreshold)
+	  continue;
+      vector<valtype> vSolutions;
+      txnouttype whichType;
+      if (!Solver(txout.scriptPubKey, whichType, vSolutions) || (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH))
+	  continue;
+      mapGroups[txout.scriptPubKey].push_back(make_pair(txout.nValue, COutPoint(out.tx->GetHash(), out.i)));
+  }
+  for (map<CScript, vector<pair<int64_t, COutPoint> > >::iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+      sort(it->second.begin(), it->second.end());
+}
+
+void __wx__::GetCompactableOutputs(unsigned int& nCountRet, int64_t& nValueRet) const
+{
+  vector<COutput> vCoins;
+  AvailableCoins(vCoins);
+  map<CScript, vector<pair<int64_t, COutPoint> > > mapGroups;
+  GetCompactableGroups(vCoins, mapGroups);
+
+  nCountRet = 0;
+  nValueRet = 0;
+  for (map<CScript, vector<pair<int64_t, COutPoint> > >::const_iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+  {
+      if (it->second.size() < MIN_COMPACT_INPUTS)
+	  continue;
+      nCountRet += it->second.size();
+      for (unsigned int i = 0; i < it->second.size(); i++)
+	  nValueRet += it->second[i].first;
+  }
+}
+
+bool __wx__::CompactOutputs(int64_t nMaxFee, __wx__Tx& wtxNew, int64_t& nFeeRet, std::string& strFailReason)
+{
+  vector<COutput> vCoins;
+  AvailableCoins(vCoins);
+  map<CScript, vector<pair<int64_t, COutPoint> > > mapGroups;
+  GetCompactableGroups(vCoins, mapGroups);
+
+  // The address with the most small outputs goes first
+  map<CScript, vector<pair<int64_t, COutPoint> > >::const_iterator itBest = mapGroups.end();
+  for (map<CScript, vector<pair<int64_t, COutPoint> > >::const_iterator it = mapGroups.begin(); it != mapGroups.end(); ++it)
+      if (it->second.size() >= MIN_COMPACT_INPUTS && (itBest == mapGroups.end() || it->second.size() > itBest->second.size()))
+	  itBest = it;
+  if (itBest == mapGroups.end())
+  {
+      strFailReason = _("Nothing to compact");
       return false;
+  }
 
-  vector<const __wx__Tx*> vwtxPrev;
+  LOCK2(cs_main, cs_wallet);
 
-  set<pair<const __wx__Tx*,unsigned int> > setCoins;
+  // Smallest first, until the result is big enough to stake on its own
+  const CScript& scriptPubKey = itBest->first;
+  vector<pair<const __wx__Tx*, unsigned int> > vInputs;
   int64_t nValueIn = 0;
-
-  if (!SelectCoinsForStaking(nBalance - nReserveBalance, GetTime(), setCoins, nValueIn))
+  for (unsigned int i = 0; i < itBest->second.size() && vInputs.size() < MAX_COMPACT_INPUTS && nValueIn < GetStakeCombineThreshold(); i++)
+  {
+      const COutPoint& prevout = itBest->second[i].second;
+      map<uint256, __wx__Tx>::const_iterator mi = mapWallet.find(prevout.hash);
+      if (mi == mapWallet.end() || mi->second.IsSpent(prevout.n))
+	  continue;
+      vInputs.push_back(make_pair(&mi->second, prevout.n));
+      nValueIn += itBest->second[i].first;
+  }
+  if (vInputs.size() < MIN_COMPACT_INPUTS)
+  {
+      strFailReason = _("Nothing to compact");
       return false;
+  }
 
-  if (setCoins.empty())
+  wtxNew.BindWallet(this);
+  nFeeRet = MIN_TX_FEE;
+  while (true)
+  {
+      if (nFeeRet > nMaxFee || nFeeRet >= nValueIn)
+      {
+	  strFailReason = strprintf(_("Compacting %"PRIszu" outputs needs a fee of %s"), vInputs.size(), FormatMoney(nFeeRet).c_str());
+	  return false;
+      }
+
+      wtxNew.vin.clear();
+      wtxNew.vout.clear();
+      wtxNew.fFromMe = true;
+      for (unsigned int i = 0; i < vInputs.size(); i++)
+	  wtxNew.vin.push_back(CTxIn(vInputs[i].first->GetHash(), vInputs[i].second));
+      wtxNew.vout.push_back(CTxOut(nValueIn - nFeeRet, scriptPubKey));
+
+      for (unsigned int i = 0; i < vInputs.size(); i++)
+	  if (!SignSignature(*this, *vInputs[i].first, wtxNew, i))
+	  {
+	      strFailReason = _("Signing transaction failed");
+	      return false;
+	  }
+
+      // Same fee rules as CreateTransaction()
+      unsigned int nBytes = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+      int64_t nPayFee = GetPayFee(nBytes);
+      int64_t nMinFee = wtxNew.GetMinFee(1, GMF_SEND, nBytes);
+      if (nFeeRet < max(nPayFee, nMinFee))
+      {
+	  nFeeRet = max(nPayFee, nMinFee);
+	  continue;
+      }
+      break;
+  }
+
+  wtxNew.fTimeReceivedIsTxTime = true;
+
+  // Nothing goes to change, so the reserved key goes straight back
+  CReserveKey reservekey(this);
+  reservekey.ReturnKey();
+  if (!CommitTransaction(wtxNew, reservekey))
+  {
+      strFailReason = _("The transaction was rejected");
       return false;
+  }
+  return true;
+}
 
-  nWeight = 0;
+CWalletCompactionStatus walletCompactionStatus;
 
-  int64_t nCurrentTime = GetTime();
-  CTxDB txdb("r");
+void ThreadCompactWallet(void* parg)
+{
+  RenameThread("iocoin-compact");
+  __wx__* pwallet = (__wx__*)parg;
+
+  int64_t nMaxFee = COIN / 100;
+  if (mapArgs.count("-compactmaxfee"))
+      ParseMoney(mapArgs["-compactmaxfee"], nMaxFee);
+  int64_t nFeeBudget = COIN / 10;
+  if (mapArgs.count("-compactfeebudget"))
+      ParseMoney(mapArgs["-compactfeebudget"], nFeeBudget);
+  int64_t nInterval = max((int64_t)60, GetArg("-compactinterval", 600));
 
-  LOCK2(cs_main, cs_wallet);
-  BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
   {
-      CTxIndex txindex;
-      if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
+      LOCK(walletCompactionStatus.cs);
+      walletCompactionStatus.fEnabled = true;
+      walletCompactionStatus.nMaxFee = nMaxFee;
+      walletCompactionStatus.nFeeBudget = nFeeBudget;
+      walletCompactionStatus.nInterval = nInterval;
+  }
+
+  // Fees paid in the last day, by time
+  list<pair<int64_t, int64_t> > lFees;
+  int64_t nFeesDay = 0;
+  int64_t nLastTry = 0;
+  while (!fShutdown)
+  {
+      MilliSleep(1000);
+      int64_t nNow = GetTime();
+      if (nNow - nLastTry < nInterval || IsInitialBlockDownload() || pwallet->as())
+	  continue;
+      nLastTry = nNow;
+
+      while (!lFees.empty() && lFees.front().first < nNow - 24 * 60 * 60)
+      {
+	  nFeesDay -= lFees.front().second;
+	  lFees.pop_front();
+      }
+
+      __wx__Tx wtx;
+      int64_t nFee = 0;
+      string strFailReason;
+      bool fOk = pwallet->CompactOutputs(min(nMaxFee, nFeeBudget - nFeesDay), wtx, nFee, strFailReason);
+
+      LOCK(walletCompactionStatus.cs);
+      walletCompactionStatus.nLastTime = nNow;
+      walletCompactionStatus.nFeesLastDay = nFeesDay;
+      if (!fOk)
+      {
+	  walletCompactionStatus.strLastResult = strFailReason;
 	  continue;
+      }
+      lFees.push_back(make_pair(nNow, nFee));
+      nFeesDay += nFee;
+      walletCompactionStatus.nTransactions++;
+      walletCompactionStatus.nOutputsMerged += wtx.vin.size();
+      walletCompactionStatus.nFeesPaid += nFee;
+      walletCompactionStatus.strLastResult = wtx.GetHash().GetHex();
+      printf("ThreadCompactWallet() : merged %"PRIszu" outputs in %s for a fee of %s\n",
+	     wtx.vin.size(), wtx.GetHash().ToString().c_str(), FormatMoney(nFee).c_str());
+  }
+}
 
-    if(pcoin.first->GetDepthInMainChain() >= nStakeMinConfirmations)
-      nWeight += pcoin.first->vout[pcoin.second].nValue;
+void __wx__::UpdateStakeCandidates(CTxDB& txdb, const set<pair<const __wx__Tx*,unsigned int> >& setCoins)
+{
+  AssertLockHeld(cs_wallet);
+
+  // Forget outputs that were spent or left the wallet
+  map<COutPoint, CStakeCandidate>::iterator it = mapStakeCandidates.begin();
+  while (it != mapStakeCandidates.end())
+  {
+      map<uint256, __wx__Tx>::const_iterator mi = mapWallet.find(it->first.hash);
+      if (mi == mapWallet.end() || mi->second.IsSpent(it->first.n))
+	  mapStakeCandidates.erase(it++);
+      else
+	  ++it;
   }
 
-  return true;
+  BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
+  {
+      COutPoint prevout(pcoin.first->GetHash(), pcoin.second);
+      map<COutPoint, CStakeCandidate>::iterator mi = mapStakeCandidates.find(prevout);
+      // A reorganisation moves the transaction to another block
+      if (mi != mapStakeCandidates.end() && mi->second.hashBlockFrom == pcoin.first->hashBlock)
+	  continue;
+
+      CStakeCandidate candidate;
+      if (GetStakeCandidate(txdb, prevout, candidate))
+	  mapStakeCandidates[prevout] = candidate;
+      else if (mi != mapStakeCandidates.end())
+	  mapStakeCandidates.erase(mi);
+  }
 }
 
 bool __wx__::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key, int nHeight)
@@ -2047,32 +3079,75 @@ bool __wx__::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int6
   int64_t nCredit = 0;
   CScript scriptPubKeyKernel;
   CTxDB txdb("r");
-  BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
+
+  // With V3 the kernel only needs what CStakeCandidate caches, so only
+  // outputs new to the cache, or whose block changed, touch the disk
+  bool fUseCandidates = V3(nBestHeight);
+  static int nMaxStakeSearchInterval = 60;
+  unsigned int nSearch = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+  COutPoint prevoutKernel;
+  unsigned int nTimeBlockFromKernel = 0;
+  unsigned int nKernelOffset = 0;
+  if (fUseCandidates)
   {
-      CTxIndex txindex;
+      vector<CStakeCandidate> vCandidates;
       {
 	  LOCK2(cs_main, cs_wallet);
-	  if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-	      continue;
+	  UpdateStakeCandidates(txdb, setCoins);
+	  vCandidates.reserve(setCoins.size());
+	  BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
+	  {
+	      map<COutPoint, CStakeCandidate>::const_iterator mi = mapStakeCandidates.find(COutPoint(pcoin.first->GetHash(), pcoin.second));
+	      if (mi != mapStakeCandidates.end())
+		  vCandidates.push_back(mi->second);
+	  }
       }
 
-      // Read block header
-      CBlock block;
+      // One pass over all candidates; the loop below only builds the winner
+      int nCandidate = FindStakeKernel(pindexPrev, nBits, vCandidates, txNew.nTime, nSearch, nKernelOffset);
+      if (nCandidate < 0 || pindexPrev != pindexBest)
+	  return false;
+      prevoutKernel = vCandidates[nCandidate].prevout;
+      nTimeBlockFromKernel = vCandidates[nCandidate].nTimeBlockFrom;
+  }
+
+  BOOST_FOREACH(PAIRTYPE(const __wx__Tx*, unsigned int) pcoin, setCoins)
+  {
+      COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+      unsigned int nTimeBlockFrom;
+      if (fUseCandidates)
       {
-	  LOCK2(cs_main, cs_wallet);
-	  if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+	  if (prevoutStake != prevoutKernel)
 	      continue;
+	  nTimeBlockFrom = nTimeBlockFromKernel;
+      }
+      else
+      {
+	  CTxIndex txindex;
+	  {
+	      LOCK2(cs_main, cs_wallet);
+	      if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
+		  continue;
+	  }
+
+	  // Read block header
+	  CBlock block;
+	  {
+	      LOCK2(cs_main, cs_wallet);
+	      if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+		  continue;
+	  }
+	  nTimeBlockFrom = block.GetBlockTime();
       }
 
-      static int nMaxStakeSearchInterval = 60;
       bool fKernelFound = false;
-      for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
+      for (unsigned int n=0; n<nSearch && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
       {
 	  // Search backward in time from the given txNew timestamp
 	  // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-	  COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-          int64_t nBlockTime;
-	  if(CheckKernel(pindexPrev,  nBits, txNew.nTime -n, prevoutStake, &nBlockTime))
+	  bool fKernel = fUseCandidates ? n == nKernelOffset
+	                                : CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake);
+	  if (fKernel)
 	  {
 	      // Found a kernel
 	      if (fDebug && GetBoolArg("-printcoinstake"))
@@ -2132,7 +3207,7 @@ bool __wx__::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int6
 	      vwtxPrev.push_back(pcoin.first);
 	      txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-	      if (GetWeight(block.GetBlockTime(), (int64_t)txNew.nTime) < GetStakeSplitAge())
+	      if (GetWeight(nTimeBlockFrom, (int64_t)txNew.nTime) < GetStakeSplitAge())
 		  txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
 	      if (fDebug && GetBoolArg("-printcoinstake"))
 		  printf("CreateCoinStake : added kernel type=%d\n", whichType);
@@ -2254,6 +3329,7 @@ bool __wx__::CommitTransaction__(__wx__Tx& wtxNew, CReserveKey& reservekey)
 	      __wx__Tx &coin = mapWallet[txin.prevout.hash];
 	      coin.BindWallet(this);
 	      coin.MarkSpent(txin.prevout.n);
+	      InvalidateWalletTotals();
 	      coin.WriteToDisk();
 	      NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
 	  }
@@ -2305,6 +3381,7 @@ bool __wx__::CommitTransaction(__wx__Tx& wtxNew, CReserveKey& reservekey)
 	      __wx__Tx &coin = mapWallet[txin.prevout.hash];
 	      coin.BindWallet(this);
 	      coin.MarkSpent(txin.prevout.n);
+	      InvalidateWalletTotals();
 	      coin.WriteToDisk();
 	      NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
 	  }
@@ -2446,8 +3523,9 @@ DBErrors __wx__::LoadWallet(bool& fFirstRunRet)
   if (nLoadWalletRet != DB_LOAD_OK)
       return nLoadWalletRet;
   fFirstRunRet = !vchDefaultKey.IsValid();
+  BuildTxIndexes();
 
-  NewThread(ThreadFlushWalletDB, &strWalletFile);
+  NewThread(ThreadFlushWalletDB, &strWalletFile, THREADPOOL_BACKGROUND);
   return DB_LOAD_OK;
 }
 
@@ -2553,12 +3631,7 @@ bool __wx__::NewKeyPool()
 	  return false;
 
       int64_t nKeys = max(GetArg("-keypool", 100), (int64_t)0);
-      for (int i = 0; i < nKeys; i++)
-      {
-	  int64_t nIndex = i+1;
-	  walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-	  setKeyPool.insert(nIndex);
-      }
+      AddKeysToPool(walletdb, nKeys);
       printf("__wx__::NewKeyPool wrote %"PRId64" new keys\n", nKeys);
   }
   return true;
@@ -2581,18 +3654,72 @@ bool __wx__::TopUpKeyPool(unsigned int nSize)
       else
 	  nTargetSize = max(GetArg("-keypool", 100), (int64_t)0);
 
-      while (setKeyPool.size() < (nTargetSize + 1))
+      if (setKeyPool.size() < (nTargetSize + 1))
+      {
+	  unsigned int nKeys = nTargetSize + 1 - setKeyPool.size();
+	  AddKeysToPool(walletdb, nKeys);
+	  printf("keypool added %u keys, size=%"PRIszu"\n", nKeys, setKeyPool.size());
+      }
+  }
+  return true;
+}
+
+static const unsigned int NEW_KEYS_PER_THREAD = 64;
+
+static void MakeNewKeysWorker(vector<CKey>* pvKeys, bool fCompressed, unsigned int nThread, unsigned int nThreads)
+{
+  for (unsigned int i = nThread; i < pvKeys->size(); i += nThreads)
+      (*pvKeys)[i].MakeNewKey(fCompressed);
+}
+
+// Generate nKeys new keys across the script check threads and append them to
+// the pool in a single database transaction.
+void __wx__::AddKeysToPool(__wx__DB& walletdb, unsigned int nKeys)
+{
+  AssertLockHeld(cs_wallet);
+  if (nKeys == 0)
+      return;
+
+  bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY);
+  RandAddSeedPerfmon();
+  vector<CKey> vKeys(nKeys);
+  unsigned int nThreads = min((unsigned int)max(nScriptCheckThreads, 1), nKeys / NEW_KEYS_PER_THREAD);
+  if (nThreads <= 1)
+      MakeNewKeysWorker(&vKeys, fCompressed, 0, 1);
+  else
+  {
+      boost::thread_group threadGroup;
+      for (unsigned int n = 0; n < nThreads; n++)
+	  threadGroup.create_thread(boost::bind(&MakeNewKeysWorker, &vKeys, fCompressed, n, nThreads));
+      threadGroup.join_all();
+  }
+
+  if (fFileBacked && !walletdb.TxnBegin())
+      throw runtime_error("TopUpKeyPool() : database transaction failed");
+  if (fFileBacked)
+      pwalletdbBatch = &walletdb;
+  try
+  {
+      BOOST_FOREACH(const CKey& key, vKeys)
       {
 	  int64_t nEnd = 1;
 	  if (!setKeyPool.empty())
 	      nEnd = *(--setKeyPool.end()) + 1;
-	  if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+	  if (!walletdb.WritePool(nEnd, CKeyPool(AddGeneratedKey(key))))
 	      throw runtime_error("TopUpKeyPool() : writing generated key failed");
 	  setKeyPool.insert(nEnd);
-	  printf("keypool added key %"PRId64", size=%"PRIszu"\n", nEnd, setKeyPool.size());
       }
   }
-  return true;
+  catch (...)
+  {
+      pwalletdbBatch = NULL;
+      if (fFileBacked)
+	  walletdb.TxnAbort();
+      throw;
+  }
+  pwalletdbBatch = NULL;
+  if (fFileBacked && !walletdb.TxnCommit())
+      throw runtime_error("TopUpKeyPool() : committing generated keys failed");
 }
 
 void __wx__::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -2761,7 +3888,7 @@ std::map<CTxDestination, int64_t> __wx__::GetAddressBalances()
 	  for (unsigned int i = 0; i < pcoin->vout.size(); i++)
 	  {
 	      CTxDestination addr;
-	      if (!IsMine(pcoin->vout[i]))
+	      if (!pcoin->IsOutputMine(i))
 		  continue;
 	      if(!ExtractDestination(pcoin->vout[i].scriptPubKey, addr))
 		  continue;
@@ -2815,7 +3942,7 @@ set< set<CTxDestination> > __wx__::GetAddressGroupings()
 
       // group lone addrs by themselves
       for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-	  if (IsMine(pcoin->vout[i]))
+	  if (pcoin->IsOutputMine(i))
 	  {
 	      CTxDestination address;
 	      if(!ExtractDestination(pcoin->vout[i].scriptPubKey, address))
@@ -2884,7 +4011,7 @@ void __wx__::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, boo
 	  continue;
       for (unsigned int n=0; n < pcoin->vout.size(); n++)
       {
-	  if (IsMine(pcoin->vout[n]) && pcoin->IsSpent(n) && (txindex.vSpent.size() <= n || txindex.vSpent[n].IsNull()))
+	  if (pcoin->IsOutputMine(n) && pcoin->IsSpent(n) && (txindex.vSpent.size() <= n || txindex.vSpent[n].IsNull()))
 	  {
 	      printf("FixSpentCoins found lost coin %s IO %s[%d], %s\n",
 		  FormatMoney(pcoin->vout[n].nValue).c_str(), pcoin->GetHash().ToString().c_str(), n, fCheckOnly? "repair not attempted" : "repairing");
@@ -2893,10 +4020,12 @@ void __wx__::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, boo
 	      if (!fCheckOnly)
 	      {
 		  pcoin->MarkUnspent(n);
+		  NoteUnspent(pcoin->GetHash());
+		  InvalidateWalletTotals();
 		  pcoin->WriteToDisk();
 	      }
 	  }
-	  else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
+	  else if (pcoin->IsOutputMine(n) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
 	  {
 	      printf("FixSpentCoins found spent coin %s IO %s[%d], %s\n",
 		  FormatMoney(pcoin->vout[n].nValue).c_str(), pcoin->GetHash().ToString().c_str(), n, fCheckOnly? "repair not attempted" : "repairing");
@@ -2905,6 +4034,7 @@ void __wx__::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, boo
 	      if (!fCheckOnly)
 	      {
 		  pcoin->MarkSpent(n);
+		  InvalidateWalletTotals();
 		  pcoin->WriteToDisk();
 	      }
 	  }
@@ -2919,6 +4049,7 @@ void __wx__::DisableTransaction(const CTransaction &tx)
       return; // only disconnecting coinstake requires marking input unspent
 
   LOCK(cs_wallet);
+  InvalidateWalletTotals();
   BOOST_FOREACH(const CTxIn& txin, tx.vin)
   {
       map<uint256, __wx__Tx>::iterator mi = mapWallet.find(txin.prevout.hash);
@@ -2928,6 +4059,7 @@ void __wx__::DisableTransaction(const CTransaction &tx)
 	  if (txin.prevout.n < prev.vout.size() && IsMine(prev.vout[txin.prevout.n]))
 	  {
 	      prev.MarkUnspent(txin.prevout.n);
+	      NoteUnspent(txin.prevout.hash);
 	      prev.WriteToDisk();
 	  }
       }
@@ -3040,7 +4172,7 @@ void __wx__::kt(std::map<CKeyID, int64_t> &mapKeyBirth) const {
   for (std::map<uint256, __wx__Tx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
       // iterate over all wallet transactions...
       const __wx__Tx &wtx = (*it).second;
-      std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+      BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
       if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
 	  // ... which are already in a block
 	  int nHeight = blit->second->nHeight;
@@ -3321,7 +4453,7 @@ int CMerkleTx::GetDepthInMainChain(int& nHeightRet) const
       return 0;
 
   // Find the block it claims to be in
-  map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+  BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
   if (mi == mapBlockIndex.end())
       return 0;
   CBlockIndex* pindex = (*mi).second;
@@ -3434,9 +4566,9 @@ bool __wx__::__xfa(const vector<CTxOut>& vout) const
         if(t == TX_PUBKEYHASH)
         {
           CKeyID p = CKeyID(uint160(vs[0]));
-          if(!pwalletMain->HaveKey(p))
+          if(!HaveKey(p))
           {
-            intersect= __intersect(p, e);
+            intersect= __intersect(const_cast<__wx__*>(this), p, e);
             if(intersect) return true; 
           }
         }
@@ -3447,29 +4579,29 @@ bool __wx__::__xfa(const vector<CTxOut>& vout) const
   return false;
 }
 
-bool __intersect(CKeyID& i, CPubKey& j)
+bool __intersect(__wx__* pwallet, CKeyID& i, CPubKey& j)
 {
   std::map<CKeyID, int64_t> mk;
-  pwalletMain->kt(mk);
+  pwallet->kt(mk);
 
   for(std::map<CKeyID, int64_t>::const_iterator it = mk.begin(); it != mk.end(); it++)
   {
     CKeyID ck = it->first;
-    RayShade& r1 = pwalletMain->kd[ck].rs_;
+    RayShade& r1 = pwallet->kd[ck].rs_;
     if(r1.ctrlExternalAngle())
     {
       for(std::map<CKeyID, int64_t>::const_iterator it = mk.begin(); it != mk.end(); it++)
       {
         CKeyID ck_ = it->first;
-        RayShade& r = pwalletMain->kd[ck_].rs_;
+        RayShade& r = pwallet->kd[ck_].rs_;
         if(r.ctrlExternalDtx() && r.ctrlPath() == r1.ctrlPath())
         { 
-          if(pwalletMain->as())
+          if(pwallet->as())
           {
             __im__ t = r1.streamID();
             __im__ t2 = j.Raw();
             CPubKey pp;
-            pwalletMain->GetPubKey(ck_, pp);
+            pwallet->GetPubKey(ck_, pp);
             __im__ off = pp.Raw();
             __im__ c;
             if(t.size() == 0) continue;
@@ -3478,9 +4610,9 @@ bool __intersect(CKeyID& i, CPubKey& j)
             if(x.GetID() == i)
             {
               __im__ n;
-              pwalletMain->kd[i].k = j;
-              pwalletMain->kd[i].z = r.ctrlPath();
-              pwalletMain->sync(x, n);
+              pwallet->kd[i].k = j;
+              pwallet->kd[i].z = r.ctrlPath();
+              pwallet->sync(x, n);
               return true;
             }
           }
@@ -3488,7 +4620,7 @@ bool __intersect(CKeyID& i, CPubKey& j)
           {
             CSecret s2;
             bool fCompressed;
-            if(pwalletMain->GetSecret(ck_, s2, fCompressed))
+            if(pwallet->GetSecret(ck_, s2, fCompressed))
             {
               unsigned char* a2 = s2.data();
               __im__ tmp1 = r1.streamID();
@@ -3505,8 +4637,8 @@ bool __intersect(CKeyID& i, CPubKey& j)
               if(sx_p.GetID() == i)
               {
                 int64_t ct = GetTime();
-                pwalletMain->kd[sx_p.GetID()] = CKeyMetadata(ct);
-                if(!pwalletMain->ak(ks_x))
+                pwallet->kd[sx_p.GetID()] = CKeyMetadata(ct);
+                if(!pwallet->ak(ks_x))
                   throw std::runtime_error("Key");
 
                 return true;
@@ -3523,49 +4655,46 @@ bool __intersect(CKeyID& i, CPubKey& j)
 bool __wx__::__transient()
 {
   AssertLockHeld(cs_wallet);
-  std::map<CKeyID, int64_t> mk;
-  pwalletMain->kt(mk);
 
-  for(std::map<CKeyID, int64_t>::const_iterator it = mk.begin(); it != mk.end(); it++)
+  // One pass over the key metadata, rather than a scan of all keys per key
+  // on every unlock: the keys still to be derived, and the first view and
+  // spend key of each path. Keys with neither a creation time nor a secret
+  // are skipped, as kt() left them out.
+  std::vector<CKeyID> vPending;
+  std::map<uint160, CKeyID> mapViewKey;
+  std::map<uint160, CKeyID> mapSpendKey;
+  for(std::map<CKeyID, CKeyMetadata>::iterator it = kd.begin(); it != kd.end(); it++)
   {
-    CKeyID ck = it->first;
-    uint160 i  = pwalletMain->kd[ck].z;
-    if(i == 0)
+    if(!it->second.nCreateTime && !HaveKey(it->first))
       continue;
+    if(it->second.z != 0)
+      vPending.push_back(it->first);
+    RayShade& r = it->second.rs_;
+    uint160 path = r.ctrlPath();
+    if(path == 0)
+      continue;
+    if(r.ctrlExternalAngle())
+      mapViewKey.insert(make_pair(path, it->first));
+    else
+      mapSpendKey.insert(make_pair(path, it->first));
+  }
 
-    bool found=false;
-    CPubKey k  = pwalletMain->kd[ck].k;
-    CKeyID vID;
-    CKeyID exID;
-    for(std::map<CKeyID, int64_t>::const_iterator it = mk.begin(); it != mk.end(); it++)
-    {
-      CKeyID ckV = it->first;
-      RayShade& r1 = pwalletMain->kd[ckV].rs_;
-      if(r1.ctrlExternalAngle() && r1.ctrlPath() == i)
-      {
-        for(std::map<CKeyID, int64_t>::const_iterator it = mk.begin(); it != mk.end(); it++)
-        {
-          CKeyID ck = it->first;
-          RayShade& r = pwalletMain->kd[ck].rs_;
-          if(!r.ctrlExternalAngle() && r.ctrlPath() == i)
-          {
-            vID = ckV;
-            exID = ck;
-            found = true;
-            break;
-          }
-        }
-        if(found) break;
-      }
-    }
-    if(found) 
+  BOOST_FOREACH(const CKeyID& ck, vPending)
+  {
+    uint160 i  = kd[ck].z;
+    CPubKey k  = kd[ck].k;
+    std::map<uint160, CKeyID>::const_iterator mv = mapViewKey.find(i);
+    std::map<uint160, CKeyID>::const_iterator ms = mapSpendKey.find(i);
+    if(mv != mapViewKey.end() && ms != mapSpendKey.end())
     {
+      CKeyID vID = mv->second;
+      CKeyID exID = ms->second;
       CSecret s2;
       bool f;
-      if(pwalletMain->GetSecret(exID, s2, f))
+      if(GetSecret(exID, s2, f))
       {
         unsigned char* a2 = s2.data();
-        __im__ tmp1 = pwalletMain->kd[vID].rs_.streamID();
+        __im__ tmp1 = kd[vID].rs_.streamID();
         __im__ tmp2 = k.Raw();
         __im__ tmp3(a2, a2 + 0x20);
         __im__ tmp4;
@@ -3587,9 +4716,9 @@ bool __wx__::__transient()
         if(sx_p.GetID() == ck)
         {
           int64_t ct = GetTime();
-          pwalletMain->kd[sx_p.GetID()] = CKeyMetadata(ct);
-          pwalletMain->kd[sx_p.GetID()].z = FORM; 
-          if(!pwalletMain->ak(ks_x))
+          kd[sx_p.GetID()] = CKeyMetadata(ct);
+          kd[sx_p.GetID()].z = FORM; 
+          if(!ak(ks_x))
             throw std::runtime_error("Key");
         }
       }
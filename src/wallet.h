@@ -11,6 +11,7 @@
 #include <stdlib.h>
 
 #include "main.h"
+#include "kernel.h"
 #include "key.h"
 #include "keystore.h"
 #include "script.h"
@@ -21,8 +22,12 @@
 #include "ray_shade.h"
 
 extern bool fWalletUnlockStakingOnly;
+extern bool fWalletRbf;
+static const int DEFAULT_COIN_SELECTION_TRIES = 100000;
+extern int nCoinSelectionTries;
 extern bool fConfChange;
 class CAccountingEntry;
+class __wx__;
 class __wx__Tx;
 class CReserveKey;
 class COutput;
@@ -36,12 +41,13 @@ enum WalletFeature
     FEATURE_WALLETCRYPT = 40000, // wallet encryption
     FEATURE_COMPRPUBKEY = 60000, // compressed public keys
     FEATURE_SHADE       = 80000, 
+    FEATURE_NOVTXPREV   = 90000, // wallet transactions stored without supporting transactions
 
-    FEATURE_LATEST = FEATURE_SHADE
+    FEATURE_LATEST = FEATURE_NOVTXPREV
 };
 
 
-bool __intersect(CKeyID& i, CPubKey& j);
+bool __intersect(__wx__* pwallet, CKeyID& i, CPubKey& j);
 
 /** A key pool entry */
 class CKeyPool
@@ -70,6 +76,21 @@ public:
     )
 };
 
+/** Wallet totals as of one best block and wallet generation */
+struct CWalletBalances
+{
+    bool fValid;
+    uint256 hashBlock;
+    unsigned int nGeneration;
+    int64_t nBalance;
+    int64_t nUnconfirmed;
+    int64_t nImmature;
+    int64_t nStake;
+    int64_t nNewMint;
+
+    CWalletBalances() : fValid(false), nGeneration(0), nBalance(0), nUnconfirmed(0), nImmature(0), nStake(0), nNewMint(0) {}
+};
+
 /** A __wx__ is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -77,8 +98,14 @@ class __wx__ : public CCryptoKeyStore
 {
 private:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const __wx__Tx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    void UpdateStakeCandidates(CTxDB& txdb, const std::set<std::pair<const __wx__Tx*,unsigned int> >& setCoins);
 
-    __wx__DB *pwalletdbEncryption;
+    // Open database transaction that key writes go through while the wallet
+    // is being encrypted or the key pool topped up; NULL otherwise
+    __wx__DB *pwalletdbBatch;
+
+    CPubKey AddGeneratedKey(const CKey& key);
+    void AddKeysToPool(__wx__DB& walletdb, unsigned int nKeys);
 
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
@@ -122,12 +149,47 @@ public:
         nWalletMaxVersion = FEATURE_BASE;
         fFileBacked = false;
         nMasterKeyMaxID = 0;
-        pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
+        fStakeWeightValid = false;
+        nBalancesGeneration = 0;
+        fScanningWallet = false;
+        nRescanProgress = 0;
+        fAbortRescan = false;
+        nIsMineCacheHits = 0;
+        nIsMineCacheMisses = 0;
     }
 
     std::map<uint256, __wx__Tx> mapWallet;
+    // Wallet transactions that may still have an unspent output of ours, so
+    // balance and coin queries skip the fully spent history. A superset:
+    // GetUnspentWalletTx() prunes what it finds spent, and anything that
+    // marks an output unspent again calls NoteUnspent(). Guarded by cs_wallet.
+    mutable std::set<uint256> setWalletUnspent;
+    void NoteUnspent(const uint256& hash) { setWalletUnspent.insert(hash); }
+    void GetUnspentWalletTx(std::vector<const __wx__Tx*>& vRet) const;
+    // Kernel inputs of staking outputs, kept across CreateCoinStake() calls
+    std::map<COutPoint, CStakeCandidate> mapStakeCandidates;
+
+    // GetStakeWeight() as of nStakeWeightHeight and nStakeWeightReserve;
+    // wallet changes clear fStakeWeightValid. Guarded by cs_wallet.
+    bool fStakeWeightValid;
+    bool fStakeWeightRet;
+    int nStakeWeightHeight;
+    int64_t nStakeWeightReserve;
+    uint64_t nStakeWeight;
+    uint64_t nStakeWeightImmature;
+    void InvalidateWalletTotals() { fStakeWeightValid = false; nBalancesGeneration++; }
+
+    // Totals for read-only RPCs, which take them from the snapshot without
+    // waiting for cs_main and cs_wallet while the tip and wallet are
+    // unchanged. Once the tip or nBalancesGeneration moved, GetBalances()
+    // waits for both locks and refreshes it, so stale totals never go out.
+    volatile unsigned int nBalancesGeneration;
+    mutable CCriticalSection cs_balances;
+    mutable CWalletBalances balancesSnapshot;
+    CWalletBalances GetBalances() const;
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -140,6 +202,7 @@ public:
 
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
+    void AvailableCoinsAfter(std::vector<COutput>& vCoins, const COutPoint& outAfter, unsigned int nMax) const;
     bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const __wx__Tx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
 
     // keystore implementation
@@ -174,6 +237,8 @@ public:
     
 
     bool Unlock(const SecureString& strWalletPassphrase);
+    // Also forgets every cached plaintext
+    bool Lock();
     bool LoadRelay(const vchType& k, const Relay& r);
     bool ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase, const SecureString& strNewWalletPassphrase);
     bool EncryptWallet(const SecureString& strWalletPassphrase);
@@ -189,11 +254,51 @@ public:
     typedef std::pair<__wx__Tx*, CAccountingEntry*> TxPair;
     typedef std::multimap<int64_t, TxPair > TxItems;
 
-    /** Get the wallet's activity log
-        @return multimap of ordered transactions and accounting entries
-        @warning Returned pointers are *only* valid within the scope of passed acentries
+    /** The wallet's activity log: transactions and accounting entries by
+        nOrderPos, kept up to date as they are added rather than sorted for
+        every listing. Accounting entries are read from the database once,
+        at load, into laccentries.
      */
-    TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "");
+    TxItems wtxOrdered;
+    std::list<CAccountingEntry> laccentries;
+    // The wallet transactions paying each destination
+    std::map<CTxDestination, std::set<uint256> > mapTxByDestination;
+    // The wallet's DIONS transactions by op, and by the alias, sender or
+    // recipient they carry, so the alias and message listings need not
+    // decode all of mapWallet
+    std::map<int, std::set<uint256> > mapDionTxByOp;
+    std::map<vchType, std::set<uint256> > mapDionTxByName;
+    std::map<uint256, int> mapDionTxOp;
+    // Public key and vertex transactions by (sender, recipient), the
+    // directory sendMessage and friends find a correspondent's keys in
+    std::map<std::pair<vchType, vchType>, std::set<uint256> > mapDionKeyTxs;
+
+    // Decrypted alias names and messages, by txid or by ciphertext hash.
+    // Held in locked memory from first decryption until the wallet is locked.
+    mutable CCriticalSection cs_plaintext;
+    std::map<uint256, SecureString> mapPlaintext;
+    bool GetPlaintext(const uint256& hash, std::string& strRet) const;
+    void SetPlaintext(const uint256& hash, const std::string& str);
+
+    void BuildTxIndexes();
+    void IndexWalletTx(const uint256& hash, __wx__Tx* pwtx);
+    void UnindexWalletTx(const uint256& hash, __wx__Tx* pwtx);
+    // Wallet transactions whose op has its bit set in nOpMask, in mapWallet
+    // order. With vchName, only those naming it, plus every one whose op is
+    // in nOpMaskUnnamed (encrypted aliases, whose names can't be looked up).
+    void ListDionTxs(int nOpMask, std::vector<__wx__Tx*>& vRet);
+    void ListDionTxs(int nOpMask, const vchType& vchName, std::vector<__wx__Tx*>& vRet, int nOpMaskUnnamed = 0);
+    // The latest key transaction, by nOrderPos, whose op is in nOpMask and
+    // that vchSender sent to vchRecipient, or to anyone. NULL if none.
+    __wx__Tx* FindDionKeyTx(int nOpMask, const vchType& vchSender, const vchType& vchRecipient);
+    __wx__Tx* FindDionKeyTx(int nOpMask, const vchType& vchSender);
+    // Whether vchSender sent vchRecipient such a transaction, other than
+    // hashExclude, that is in the main chain
+    bool HaveDionKeyTxInMainChain(int nOpMask, const vchType& vchSender, const vchType& vchRecipient, const uint256& hashExclude);
+    bool AddAccountingEntry(const CAccountingEntry& acentry, __wx__DB& walletdb);
+    // Total paid to dest by final, non-generated wallet transactions with at
+    // least nMinDepth confirmations
+    int64_t GetReceivedByDestination(const CTxDestination& dest, int nMinDepth) const;
 
     void MarkDirty();
     bool AddToWallet(const __wx__Tx& wtxIn);
@@ -201,6 +306,16 @@ public:
     bool EraseFromWallet(uint256 hash);
     void WalletUpdateSpent(const CTransaction& prevout, bool fBlock = false);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    // ScanForWalletTransactions() progress in percent, and a request to stop
+    // it at the next block
+    volatile bool fScanningWallet;
+    volatile int nRescanProgress;
+    volatile bool fAbortRescan;
+    // How often __wx__Tx::IsOutputMine() answered from its flags, and how
+    // often it had to run the script solver over the outputs
+    mutable uint64_t nIsMineCacheHits;
+    mutable uint64_t nIsMineCacheMisses;
+    bool AbortRescan() { bool fScanning = fScanningWallet; fAbortRescan = true; return fScanning; }
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(bool fForce = false);
     int64_t GetBalance() const;
@@ -209,14 +324,24 @@ public:
     bool __transient();
     int64_t GetStake() const;
     int64_t GetNewMint() const;
-    bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl *coinControl=NULL);
-    bool CreateTransaction__(const std::vector<std::pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl *coinControl=NULL);
-    bool CreateTransaction(CScript scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl *coinControl=NULL);
-    bool CreateTransaction__(CScript scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, std::string strTxInfo, const CCoinControl *coinControl=NULL);
+    bool CreateTransaction(const std::vector<std::pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl *coinControl=NULL);
+    bool CreateTransaction__(const std::vector<std::pair<CScript, int64_t> >& vecSend, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl *coinControl=NULL);
+    bool CreateTransaction(const CScript& scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl *coinControl=NULL);
+    bool CreateTransaction__(const CScript& scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, CReserveKey& reservekey, int64_t& nFeeRet, const std::string& strTxInfo, const CCoinControl *coinControl=NULL);
     bool CommitTransaction(__wx__Tx& wtxNew, CReserveKey& reservekey);
     bool CommitTransaction__(__wx__Tx& wtxNew, CReserveKey& reservekey);
 
-    bool GetStakeWeight(uint64_t& nWeight);
+    /** Value of the outputs that can stake now and, in *pnImmature, of those
+     *  still short of nStakeMinConfirmations. Cached until the wallet
+     *  changes or a block arrives. */
+    bool GetStakeWeight(uint64_t& nWeight, uint64_t* pnImmature = NULL);
+    /** Outputs CompactOutputs() would merge, over all addresses */
+    void GetCompactableOutputs(unsigned int& nCountRet, int64_t& nValueRet) const;
+    /** Merge up to MAX_COMPACT_INPUTS of the smallest outputs of one address
+     *  below the stake combine threshold into one output to that address,
+     *  and commit it. Fails without spending anything if there are fewer
+     *  than MIN_COMPACT_INPUTS of them or the fee would be over nMaxFee. */
+    bool CompactOutputs(int64_t nMaxFee, __wx__Tx& wtxNew, int64_t& nFeeRet, std::string& strFailReason);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key, int nHeight);
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, __wx__Tx& wtxNew, bool fAskFee=false,std::string strTx="");
@@ -430,6 +555,8 @@ private:
 
 public:
     const __wx__* pwallet;
+    // Only read from old records and emptied on load: the unconfirmed
+    // transactions spent are looked up by GetSupportingTransactions instead
     std::vector<CMerkleTx> vtxPrev;
     mapValue_t mapValue;
     std::vector<std::pair<std::string, std::string> > vOrderForm;
@@ -450,6 +577,10 @@ public:
     mutable int64_t nCreditCached;
     mutable int64_t nAvailableCreditCached;
     mutable int64_t nChangeCached;
+    // Which outputs are ours, as of keystore generation nIsMineGeneration;
+    // MarkDirty() leaves these alone, as only a new key or script changes them
+    mutable std::vector<char> vfIsMineCached;
+    mutable unsigned int nIsMineGeneration;
 
     mutable int nAliasOut;
     mutable vchType vchAlias;
@@ -512,6 +643,8 @@ public:
         nCreditCached = 0;
         nAvailableCreditCached = 0;
         nChangeCached = 0;
+        vfIsMineCached.clear();
+        nIsMineGeneration = 0;
         nOrderPos = -1;
     }
 
@@ -661,7 +794,17 @@ public:
         // GetBalance can assume transactions in mapWallet won't change
         if (fUseCache && fCreditCached)
             return nCreditCached;
-        nCreditCached = pwallet->GetCredit(*this);
+        int64_t nCredit = 0;
+        for (unsigned int i = 0; i < vout.size(); i++)
+        {
+            if (!MoneyRange(vout[i].nValue))
+                throw std::runtime_error("__wx__Tx::GetCredit() : value out of range");
+            if (IsOutputMine(i))
+                nCredit += vout[i].nValue;
+            if (!MoneyRange(nCredit))
+                throw std::runtime_error("__wx__Tx::GetCredit() : value out of range");
+        }
+        nCreditCached = nCredit;
         fCreditCached = true;
         return nCreditCached;
     }
@@ -678,10 +821,9 @@ public:
         int64_t nCredit = 0;
         for (unsigned int i = 0; i < vout.size(); i++)
         {
-            if (!IsSpent(i))
+            if (!IsSpent(i) && IsOutputMine(i))
             {
-                const CTxOut &txout = vout[i];
-                nCredit += pwallet->GetCredit(txout);
+                nCredit += vout[i].nValue;
                 if (!MoneyRange(nCredit))
                     throw std::runtime_error("__wx__Tx::GetAvailableCredit() : value out of range");
             }
@@ -732,9 +874,7 @@ public:
 
         // If no confirmations but it's from us, we can still
         // consider it confirmed if all dependencies are confirmed
-        std::map<uint256, const CMerkleTx*> mapPrev;
         std::vector<const CMerkleTx*> vWorkQueue;
-        vWorkQueue.reserve(vtxPrev.size()+1);
         vWorkQueue.push_back(this);
         for (unsigned int i = 0; i < vWorkQueue.size(); i++)
         {
@@ -758,19 +898,14 @@ public:
                 return false;
              }
 
-            if (mapPrev.empty())
-            {
-                BOOST_FOREACH(const CMerkleTx& tx, vtxPrev)
-                    mapPrev[tx.GetHash()] = &tx;
-            }
-
             BOOST_FOREACH(const CTxIn& txin, ptx->vin)
             {
-                if (!mapPrev.count(txin.prevout.hash))
+                std::map<uint256, __wx__Tx>::const_iterator mi = pwallet->mapWallet.find(txin.prevout.hash);
+                if (mi == pwallet->mapWallet.end())
                 {
                     return false;
                 }
-                vWorkQueue.push_back(mapPrev[txin.prevout.hash]);
+                vWorkQueue.push_back(&(*mi).second);
             }
         }
 
@@ -791,7 +926,13 @@ public:
     int64_t GetTxTime() const;
     int GetRequestCount() const;
 
-    void AddSupportingTransactions(CTxDB& txdb);
+    // Whether vout[nOut] is ours, from flags kept for all outputs until a
+    // key or script is added to the wallet
+    bool IsOutputMine(unsigned int nOut) const;
+
+    // The unconfirmed wallet transactions this one spends from, directly
+    // or through each other, parents first
+    void GetSupportingTransactions(std::vector<CMerkleTx>& vSupportingRet) const;
 
     bool AcceptWalletTransaction(CTxDB& txdb);
     bool AcceptWalletTransaction();
@@ -970,4 +1111,37 @@ private:
 
 bool GetWalletFile(__wx__* pwallet, std::string &strWalletFileOut);
 
+/** First main chain block a key created at nBirthTime can have been used in,
+ *  where an import's rescan starts. Requires cs_main. */
+CBlockIndex* FindRescanStart(int64_t nBirthTime);
+
+/** Background merging of small outputs (-compactwallet), so that the coins
+ *  a wallet has to go through for sending and staking stay few */
+static const unsigned int MIN_COMPACT_INPUTS = 10;
+static const unsigned int MAX_COMPACT_INPUTS = 100;
+
+struct CWalletCompactionStatus
+{
+    CCriticalSection cs;
+    bool fEnabled;
+    int64_t nMaxFee;
+    int64_t nFeeBudget;
+    int64_t nInterval;
+    int nTransactions;
+    int nOutputsMerged;
+    int64_t nFeesPaid;
+    int64_t nFeesLastDay;
+    int64_t nLastTime;
+    // Txid of the last merge, or why the last try didn't merge anything
+    std::string strLastResult;
+
+    CWalletCompactionStatus() : fEnabled(false), nMaxFee(0), nFeeBudget(0), nInterval(0), nTransactions(0),
+        nOutputsMerged(0), nFeesPaid(0), nFeesLastDay(0), nLastTime(0) {}
+};
+extern CWalletCompactionStatus walletCompactionStatus;
+
+/** Every -compactinterval seconds, one CompactOutputs() within -compactmaxfee
+ *  and what is left of -compactfeebudget for the last 24 hours */
+void ThreadCompactWallet(void* parg);
+
 #endif
@@ -7,6 +7,7 @@
 #include "wallet.h"
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/bind.hpp>
 
 using namespace std;
 using namespace boost;
@@ -200,6 +201,56 @@ public:
     }
 };
 
+// Bookkeeping for a "tx" record once it has been read into mapWallet[hash];
+// fValid is whether it passed CheckTransaction and hashes to its key.
+// ssValue holds whatever followed the transaction in the record.
+static bool LoadWalletTx(__wx__* pwallet, const uint256& hash, bool fValid, CDataStream& ssValue,
+                         __wx__ScanState &wss, string& strErr)
+{
+    if (!fValid)
+    {
+        pwallet->mapWallet.erase(hash);
+        return false;
+    }
+    __wx__Tx& wtx = pwallet->mapWallet[hash];
+    wtx.BindWallet(pwallet);
+    pwallet->NoteUnspent(hash);
+
+    // Records from before FEATURE_NOVTXPREV carry copies of the transactions
+    // spent; they are looked up when needed now. Wallets upgraded to it get
+    // the record rewritten without them.
+    if (!wtx.vtxPrev.empty())
+    {
+        wtx.vtxPrev.clear();
+        if (pwallet->GetVersion() >= FEATURE_NOVTXPREV)
+            wss.vWalletUpgrade.push_back(hash);
+    }
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        wss.vWalletUpgrade.push_back(hash);
+    }
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+    return true;
+}
+
 bool
 ReadKeyValue(__wx__* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              __wx__ScanState &wss, string& strType, string& strErr)
@@ -221,44 +272,7 @@ ReadKeyValue(__wx__* pwallet, CDataStream& ssKey, CDataStream& ssValue,
             ssKey >> hash;
             __wx__Tx& wtx = pwallet->mapWallet[hash];
             ssValue >> wtx;
-            if (wtx.CheckTransaction() && (wtx.GetHash() == hash))
-                wtx.BindWallet(pwallet);
-            else
-            {
-                pwallet->mapWallet.erase(hash);
-                return false;
-            }
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount.c_str(), hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString().c_str());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            //// debug print
-            //printf("LoadWallet  %s\n", wtx.GetHash().ToString().c_str());
-            //printf(" %12"PRId64"  %s  %s  %s\n",
-            //    wtx.vout[0].nValue,
-            //    DateTimeStrFormat("%x %H:%M:%S", wtx.GetBlockTime()).c_str(),
-            //    wtx.hashBlock.ToString().substr(0,20).c_str(),
-            //    wtx.mapValue["message"].c_str());
+            return LoadWalletTx(pwallet, hash, wtx.CheckTransaction() && (wtx.GetHash() == hash), ssValue, wss, strErr);
         }
         else if (strType == "acentry")
         {
@@ -439,6 +453,68 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+// "tx" records read off the cursor and not yet decoded
+static const unsigned int WALLET_TX_BATCH = 4096;
+
+struct CWalletTxRecord
+{
+    uint256 hash;
+    __wx__Tx* pwtx;
+    CDataStream ssValue;
+    bool fValid;
+
+    CWalletTxRecord(const uint256& hashIn, __wx__Tx* pwtxIn, const CDataStream& ssValueIn) :
+        hash(hashIn), pwtx(pwtxIn), ssValue(ssValueIn), fValid(false) {}
+};
+
+// Decodes every nStep'th record from nStart. Each record has its own entry in
+// mapWallet, made before the threads start, so the map itself isn't touched.
+static void DecodeWalletTxRecords(vector<CWalletTxRecord>* pvRecord, unsigned int nStart, unsigned int nStep)
+{
+    for (unsigned int i = nStart; i < pvRecord->size(); i += nStep)
+    {
+        CWalletTxRecord& record = (*pvRecord)[i];
+        try {
+            record.ssValue >> *record.pwtx;
+            record.fValid = record.pwtx->CheckTransaction() && (record.pwtx->GetHash() == record.hash);
+        } catch (...) {
+            record.fValid = false;
+        }
+    }
+}
+
+// Decodes the batch across the script check threads, then does the
+// bookkeeping in the order the records were read
+static bool LoadWalletTxBatch(__wx__* pwallet, vector<CWalletTxRecord>& vRecord, __wx__ScanState& wss)
+{
+    unsigned int nThreads = min((unsigned int)max(nScriptCheckThreads, 1), (unsigned int)vRecord.size());
+    if (nThreads <= 1)
+        DecodeWalletTxRecords(&vRecord, 0, 1);
+    else
+    {
+        boost::thread_group threadGroup;
+        for (unsigned int n = 0; n < nThreads; n++)
+            threadGroup.create_thread(boost::bind(&DecodeWalletTxRecords, &vRecord, n, nThreads));
+        threadGroup.join_all();
+    }
+
+    bool fAllValid = true;
+    BOOST_FOREACH(CWalletTxRecord& record, vRecord)
+    {
+        string strErr;
+        try {
+            if (!LoadWalletTx(pwallet, record.hash, record.fValid, record.ssValue, wss, strErr))
+                fAllValid = false;
+        } catch (...) {
+            fAllValid = false;
+        }
+        if (!strErr.empty())
+            printf("%s\n", strErr.c_str());
+    }
+    vRecord.clear();
+    return fAllValid;
+}
+
 DBErrors __wx__DB::LoadWallet(__wx__* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -464,6 +540,12 @@ DBErrors __wx__DB::LoadWallet(__wx__* pwallet)
             return DB_CORRUPT;
         }
 
+        // Transactions, most of the work, are decoded a batch at a time
+        // off the cursor thread
+        vector<CWalletTxRecord> vTxRecord;
+        vTxRecord.reserve(WALLET_TX_BATCH);
+        bool fBadTx = false;
+
         while (true)
         {
             // Read next record
@@ -478,6 +560,21 @@ DBErrors __wx__DB::LoadWallet(__wx__* pwallet)
                 return DB_CORRUPT;
             }
 
+            if (ssKey.size() > 3 && strncmp(&ssKey[0], "\x02tx", 3) == 0)
+            {
+                try {
+                    string strType;
+                    uint256 hash;
+                    ssKey >> strType >> hash;
+                    vTxRecord.push_back(CWalletTxRecord(hash, &pwallet->mapWallet[hash], ssValue));
+                } catch (...) {
+                    fBadTx = true;
+                }
+                if (vTxRecord.size() >= WALLET_TX_BATCH && !LoadWalletTxBatch(pwallet, vTxRecord, wss))
+                    fBadTx = true;
+                continue;
+            }
+
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
             if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
@@ -499,6 +596,15 @@ DBErrors __wx__DB::LoadWallet(__wx__* pwallet)
                 printf("%s\n", strErr.c_str());
         }
         pcursor->close();
+
+        if (!vTxRecord.empty() && !LoadWalletTxBatch(pwallet, vTxRecord, wss))
+            fBadTx = true;
+        if (fBadTx)
+        {
+            fNoncriticalErrors = true;
+            // Rescan if there is a bad transaction record:
+            SoftSetBoolArg("-rescan", true);
+        }
     }
     catch (...)
     {
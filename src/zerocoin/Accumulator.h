@@ -15,6 +15,11 @@
 namespace libzerocoin {
 /**
  * \brief Implementation of the RSA-based accumulator.
+ *
+ * A serialized Accumulator is itself the checkpoint: keep one per
+ * denomination at whatever height is convenient, and a witness built from
+ * it only needs the coins minted after that point. IOCoin has no
+ * zerocoin mints on chain, so the node stores none.
  **/
 
 class Accumulator {
@@ -113,14 +113,20 @@ bool AccumulatorProofOfKnowledge:: Verify(const Accumulator& a, const Bignum& va
 
 	Bignum c = Bignum(hasher.GetHash()); //this hash should be of length k_prime bits
 
-	Bignum st_1_prime = (valueOfCommitmentToCoin.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * sg.pow_mod(s_alpha, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_phi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-	Bignum st_2_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * ((valueOfCommitmentToCoin * sg.inverse(params->accumulatorPoKCommitmentGroup.modulus)).pow_mod(s_gamma, params->accumulatorPoKCommitmentGroup.modulus)) * sh.pow_mod(s_psi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-	Bignum st_3_prime = (sg.pow_mod(c, params->accumulatorPoKCommitmentGroup.modulus) * (sg * valueOfCommitmentToCoin).pow_mod(s_sigma, params->accumulatorPoKCommitmentGroup.modulus) * sh.pow_mod(s_xi, params->accumulatorPoKCommitmentGroup.modulus)) % params->accumulatorPoKCommitmentGroup.modulus;
-
-	Bignum t_1_prime = (C_r.pow_mod(c, params->accumulatorModulus) * h_n.pow_mod(s_zeta, params->accumulatorModulus) * g_n.pow_mod(s_epsilon, params->accumulatorModulus)) % params->accumulatorModulus;
-	Bignum t_2_prime = (C_e.pow_mod(c, params->accumulatorModulus) * h_n.pow_mod(s_eta, params->accumulatorModulus) * g_n.pow_mod(s_alpha, params->accumulatorModulus)) % params->accumulatorModulus;
-	Bignum t_3_prime = ((a.getValue()).pow_mod(c, params->accumulatorModulus) * C_u.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
-	Bignum t_4_prime = (C_r.pow_mod(s_alpha, params->accumulatorModulus) * ((h_n.inverse(params->accumulatorModulus)).pow_mod(s_delta, params->accumulatorModulus)) * ((g_n.inverse(params->accumulatorModulus)).pow_mod(s_beta, params->accumulatorModulus))) % params->accumulatorModulus;
+	CMontModulus sm(params->accumulatorPoKCommitmentGroup.modulus);
+	CMontModulus n(params->accumulatorModulus);
+	const Bignum& smod = sm.modulus();
+	const Bignum& nmod = n.modulus();
+
+	// Each term pairs two powers into one simultaneous exponentiation
+	Bignum st_1_prime = sm.pow_mod(valueOfCommitmentToCoin, c).mul_mod(sm.mul_pow_mod(sg, s_alpha, sh, s_phi), smod);
+	Bignum st_2_prime = sm.pow_mod(sg, c).mul_mod(sm.mul_pow_mod(valueOfCommitmentToCoin * sg.inverse(smod), s_gamma, sh, s_psi), smod);
+	Bignum st_3_prime = sm.pow_mod(sg, c).mul_mod(sm.mul_pow_mod(sg * valueOfCommitmentToCoin, s_sigma, sh, s_xi), smod);
+
+	Bignum t_1_prime = n.pow_mod(C_r, c).mul_mod(n.mul_pow_mod(h_n, s_zeta, g_n, s_epsilon), nmod);
+	Bignum t_2_prime = n.pow_mod(C_e, c).mul_mod(n.mul_pow_mod(h_n, s_eta, g_n, s_alpha), nmod);
+	Bignum t_3_prime = n.mul_pow_mod(a.getValue(), c, C_u, s_alpha).mul_mod(n.pow_mod(h_n.inverse(nmod), s_beta), nmod);
+	Bignum t_4_prime = n.pow_mod(C_r, s_alpha).mul_mod(n.mul_pow_mod(h_n.inverse(nmod), s_delta, g_n.inverse(nmod), s_beta), nmod);
 
 	bool result = false;
 
@@ -50,6 +50,10 @@ SerialNumberSignatureOfKnowledge::SerialNumberSignatureOfKnowledge(const
 		v[i] = Bignum::randBignum(params->serialNumberSoKCommitmentGroup.groupOrder);
 	}
 
+	// Every round works in the same two groups
+	CMontModulus q(params->serialNumberSoKCommitmentGroup.groupOrder);
+	CMontModulus p2(params->serialNumberSoKCommitmentGroup.modulus);
+
 	// Openssl's rng is not thread safe, so we don't call it in a parallel loop,
 	// instead we generate the random values beforehand and run the calculations
 	// based on those values in parallel.
@@ -58,7 +62,7 @@ SerialNumberSignatureOfKnowledge::SerialNumberSignatureOfKnowledge(const
 #endif
 	for(uint32_t i=0; i < params->zkp_iterations; i++) {
 		// compute g^{ {a^x b^r} h^v} mod p2
-		c[i] = challengeCalculation(coin.getSerialNumber(), r[i], v[i]);
+		c[i] = challengeCalculation(coin.getSerialNumber(), r[i], v[i], q, p2);
 	}
 
 	// We can't hash data in parallel either
@@ -84,23 +88,22 @@ SerialNumberSignatureOfKnowledge::SerialNumberSignatureOfKnowledge(const
 		} else {
 			s_notprime[i]       = r[i] - coin.getRandomness();
 			sprime[i]           = v[i] - (commitmentToCoin.getRandomness() *
-			                              b.pow_mod(r[i] - coin.getRandomness(), params->serialNumberSoKCommitmentGroup.groupOrder));
+			                              q.pow_mod(b, r[i] - coin.getRandomness()));
 		}
 	}
 }
 
 inline Bignum SerialNumberSignatureOfKnowledge::challengeCalculation(const Bignum& a_exp,const Bignum& b_exp,
-        const Bignum& h_exp) const {
+        const Bignum& h_exp, const CMontModulus& q, const CMontModulus& p) const {
 
 	Bignum a = params->coinCommitmentGroup.g;
 	Bignum b = params->coinCommitmentGroup.h;
 	Bignum g = params->serialNumberSoKCommitmentGroup.g;
 	Bignum h = params->serialNumberSoKCommitmentGroup.h;
 
-	Bignum exponent = (a.pow_mod(a_exp, params->serialNumberSoKCommitmentGroup.groupOrder)
-	                   * b.pow_mod(b_exp, params->serialNumberSoKCommitmentGroup.groupOrder)) % params->serialNumberSoKCommitmentGroup.groupOrder;
+	Bignum exponent = q.mul_pow_mod(a, a_exp, b, b_exp);
 
-	return (g.pow_mod(exponent, params->serialNumberSoKCommitmentGroup.modulus) * h.pow_mod(h_exp, params->serialNumberSoKCommitmentGroup.modulus)) % params->serialNumberSoKCommitmentGroup.modulus;
+	return p.mul_pow_mod(g, exponent, h, h_exp);
 }
 
 bool SerialNumberSignatureOfKnowledge::Verify(const Bignum& coinSerialNumber, const Bignum& valueOfCommitmentToCoin,
@@ -112,6 +115,9 @@ bool SerialNumberSignatureOfKnowledge::Verify(const Bignum& coinSerialNumber, co
 	CHashWriter hasher(0,0);
 	hasher << *params << valueOfCommitmentToCoin <<coinSerialNumber;
 
+	CMontModulus q(params->serialNumberSoKCommitmentGroup.groupOrder);
+	CMontModulus p(params->serialNumberSoKCommitmentGroup.modulus);
+
 	vector<CBigNum> tprime(params->zkp_iterations);
 	unsigned char *hashbytes = (unsigned char*) &this->hash;
 #ifdef ZEROCOIN_THREADING
@@ -122,12 +128,10 @@ bool SerialNumberSignatureOfKnowledge::Verify(const Bignum& coinSerialNumber, co
 		int byte = i / 8;
 		bool challenge_bit = ((hashbytes[byte] >> bit) & 0x01);
 		if(challenge_bit) {
-			tprime[i] = challengeCalculation(coinSerialNumber, s_notprime[i], sprime[i]);
+			tprime[i] = challengeCalculation(coinSerialNumber, s_notprime[i], sprime[i], q, p);
 		} else {
-			Bignum exp = b.pow_mod(s_notprime[i], params->serialNumberSoKCommitmentGroup.groupOrder);
-			tprime[i] = ((valueOfCommitmentToCoin.pow_mod(exp, params->serialNumberSoKCommitmentGroup.modulus) % params->serialNumberSoKCommitmentGroup.modulus) *
-			             (h.pow_mod(sprime[i], params->serialNumberSoKCommitmentGroup.modulus) % params->serialNumberSoKCommitmentGroup.modulus)) %
-			            params->serialNumberSoKCommitmentGroup.modulus;
+			Bignum exp = q.pow_mod(b, s_notprime[i]);
+			tprime[i] = p.mul_pow_mod(valueOfCommitmentToCoin, exp, h, sprime[i]);
 		}
 	}
 	for(uint32_t i = 0; i < params->zkp_iterations; i++) {
@@ -68,7 +68,7 @@ private:
 	vector<Bignum> s_notprime;
 	vector<Bignum> sprime;
 	inline Bignum challengeCalculation(const Bignum& a_exp, const Bignum& b_exp,
-	                                   const Bignum& h_exp) const;
+	                                   const Bignum& h_exp, const CMontModulus& q, const CMontModulus& p) const;
 };
 
 } /* namespace libzerocoin */
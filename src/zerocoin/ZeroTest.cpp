@@ -16,11 +16,12 @@ using namespace std;
 #include <iostream>
 #include <fstream>
 #include <exception>
+#include <algorithm>
 #include "Zerocoin.h"
 #include "../util.h"
 
 using namespace libzerocoin;
-extern Params* ZCParams;
+extern Params* GetZCParams();
 
 
 #define TESTS_COINS_TO_ACCUMULATE   10
@@ -385,7 +386,7 @@ Test_RunAllTests()
 
 	// Make a new set of parameters from a random RSA modulus
 	//g_Params = new Params(GetTestModulus());
-	g_Params = ZCParams;
+	g_Params = GetZCParams();
 
 	gNumTests = gSuccessfulTests = gProofSize = 0;
 	for (uint32_t i = 0; i < TESTS_COINS_TO_ACCUMULATE; i++) {
@@ -417,5 +418,102 @@ Test_RunAllTests()
 	}
 
 	printf("\n%d out of %d tests passed.\n\n", gSuccessfulTests, gNumTests);
-	delete g_Params;
+}
+
+//////////
+// Benchmarks
+//////////
+
+// Throughput and latency of one operation from its timings in microseconds
+static void
+LogBenchResult(string name, vector<int64_t>& times)
+{
+	if (times.empty()) {
+		return;
+	}
+	sort(times.begin(), times.end());
+
+	int64_t total = 0;
+	for (uint32_t i = 0; i < times.size(); i++) {
+		total += times[i];
+	}
+
+	printf("%-22s %10.2f ops/s  p50 %10.3f ms  p90 %10.3f ms  max %10.3f ms\n", name.c_str(),
+	       total ? times.size() * 1000000.0 / total : 0.0,
+	       times[times.size() / 2] / 1000.0, times[times.size() * 9 / 10] / 1000.0, times.back() / 1000.0);
+}
+
+void
+Benchmark_RunAll(uint32_t securityLevel, uint32_t rounds)
+{
+	printf("ZeroCoin v%s benchmark, security level %u, %u rounds\n", ZEROCOIN_VERSION_STRING, securityLevel, rounds);
+	if (rounds == 0) {
+		return;
+	}
+
+	vector<int64_t> tParams, tMint, tAccumulate, tSpend, tSerialize, tVerify;
+	vector<PrivateCoin*> coins;
+	Params* params = NULL;
+	uint32_t spendSize = 0;
+	int64_t start;
+
+	try {
+		for (uint32_t i = 0; i < rounds; i++) {
+			start = GetTimeMicros();
+			Params* p = new Params(GetTestModulus(), securityLevel);
+			tParams.push_back(GetTimeMicros() - start);
+			delete params;
+			params = p;
+		}
+
+		for (uint32_t i = 0; i < rounds; i++) {
+			start = GetTimeMicros();
+			coins.push_back(new PrivateCoin(params));
+			tMint.push_back(GetTimeMicros() - start);
+		}
+
+		Accumulator acc(&params->accumulatorParams);
+		AccumulatorWitness wAcc(params, acc, coins[0]->getPublicCoin());
+		for (uint32_t i = 0; i < rounds; i++) {
+			start = GetTimeMicros();
+			acc += coins[i]->getPublicCoin();
+			tAccumulate.push_back(GetTimeMicros() - start);
+			wAcc += coins[i]->getPublicCoin();
+		}
+
+		SpendMetaData m(1,1);
+		for (uint32_t i = 0; i < rounds; i++) {
+			start = GetTimeMicros();
+			CoinSpend spend(params, *(coins[0]), acc, wAcc, m);
+			tSpend.push_back(GetTimeMicros() - start);
+
+			start = GetTimeMicros();
+			CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+			ss << spend;
+			tSerialize.push_back(GetTimeMicros() - start);
+			spendSize = ss.size();
+
+			start = GetTimeMicros();
+			bool valid = spend.Verify(acc, m);
+			tVerify.push_back(GetTimeMicros() - start);
+			if (!valid) {
+				printf("ERROR: spend %u did not verify\n", i);
+			}
+		}
+	} catch (exception &e) {
+		printf("Benchmark exception %s\n", e.what());
+	}
+
+	LogBenchResult("parameter generation", tParams);
+	LogBenchResult("coin mint", tMint);
+	LogBenchResult("accumulator update", tAccumulate);
+	LogBenchResult("spend proof", tSpend);
+	LogBenchResult("spend serialization", tSerialize);
+	LogBenchResult("spend verification", tVerify);
+	printf("Spend proof size is %u bytes.\n", spendSize);
+
+	for (uint32_t i = 0; i < coins.size(); i++) {
+		delete coins[i];
+	}
+	delete params;
 }
@@ -3,4 +3,8 @@
 
 void Test_RunAllTests();
 
+// Time each stage of the coin life cycle, rounds times over, at the given
+// security level and print ops/s and latency percentiles
+void Benchmark_RunAll(uint32_t securityLevel, uint32_t rounds);
+
 #endif